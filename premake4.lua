@@ -10,6 +10,11 @@ for _,arg in ipairs(_ARGS) do
     elseif arg == 'no-socket'  then no_socket = true
     elseif arg == 'winsock'    then winsock = true
     elseif arg == 'pthread'    then pthread = true
+    elseif arg == 'no-computed-goto' then no_computed_goto = true
+    elseif arg == 'stats'      then stats = true
+    elseif arg == 'nan-boxing' then nan_boxing = true
+    elseif arg == 'jit'        then jit = true
+    elseif arg == 'profile'    then profile = true
     else error('Unknown argument: ' .. arg) end
 end
 
@@ -43,6 +48,11 @@ function create_project(k)
     if pthread then links { 'pthread' } end
     if no_pattern then defines { 'SU_OPT_NO_PATTERN' } end
     if no_socket then defines { 'SU_OPT_NO_SOCKET' } end
+    if no_computed_goto then defines { 'SU_OPT_NO_COMPUTED_GOTO' } end
+    if stats then defines { 'SU_OPT_VM_STATS' } end
+    if nan_boxing then defines { 'SU_OPT_NAN_BOXING' } end
+    if jit then defines { 'SU_OPT_JIT' } end
+    if profile then defines { 'SU_OPT_PROFILE' } end
 
     if os.getenv('SU_OPT_NO_FILE_IO') or no_io then defines { 'SU_OPT_NO_FILE_IO' } end
     if os.getenv('SU_OPT_NO_DYNLIB') or no_dynlib then defines { 'SU_OPT_NO_DYNLIB' } end
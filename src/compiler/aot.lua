@@ -0,0 +1,426 @@
+-- S A U R U S
+-- Copyright (c) 2009-2015 Andreas T Jonsson <andreas@saurus.org>
+--
+-- This Source Code Form is subject to the terms of the Mozilla Public
+-- License, v. 2.0. If a copy of the MPL was not distributed with this
+-- file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+-- Ahead-of-time translation of lambdas to C, enabled with the '-a' option
+-- when compiling to a .c file. A lambda without upvalues, whose nested
+-- lambdas are translated too, becomes a C function on the su_* API that is
+-- registered like a 'cfun' and pushed with LCL. Everything else, and the
+-- top level chunk, stays bytecode.
+
+local prelude_at
+
+-- Runtime helpers for the translated code, only those it calls are written
+-- so the C compiler doesn't warn about unused functions. Later ones may
+-- call earlier ones.
+local aot_helpers = {
+	{'___aot_number', [[
+static double ___aot_number(su_state *s, int idx) {
+	su_check_type(s, idx, SU_NUMBER);
+	return su_tonumber(s, idx);
+}
+
+]]},
+	{'___aot_true', [[
+static int ___aot_true(su_state *s, int idx) {
+	su_object_type_t t = su_type(s, idx);
+	return t != SU_NIL && (t != SU_BOOLEAN || su_toboolean(s, idx));
+}
+
+]]},
+	{'___aot_pop_true', [[
+static int ___aot_pop_true(su_state *s) {
+	int r = ___aot_true(s, -1);
+	su_pop(s, 1);
+	return r;
+}
+
+]]},
+	{'___aot_getglobal', [[
+static void ___aot_getglobal(su_state *s, const char *name) {
+	if (!su_getglobal(s, name))
+		su_error(s, "Undefined global variable: %s", name);
+}
+
+]]}
+}
+
+local function aot_prelude(code)
+	local used = {}
+	for i = #aot_helpers, 1, -1 do
+		local name, helper = unpack(aot_helpers[i])
+		if string.find(code, name .. '(', 1, true) then
+			table.insert(used, 1, helper)
+			code = code .. helper
+		end
+	end
+	return '#include <math.h>\n\n' .. table.concat(used)
+end
+
+local arith = {
+	ADD = '+', ADD_LL = '+', ADD_LK = '+',
+	SUB = '-', SUB_LL = '-', SUB_LK = '-', SUB_KL = '-',
+	MUL = '*', MUL_LL = '*', MUL_LK = '*',
+	DIV = '/',
+	LESS = '<', LESS_LL = '<', LESS_LK = '<', LESS_KL = '<',
+	LEQUAL = '<=', LEQUAL_LL = '<=', LEQUAL_LK = '<=', LEQUAL_KL = '<='
+}
+
+-- Quickened forms from a profile translate like their generic form.
+local generic = {
+	ADD_NN = 'ADD', SUB_NN = 'SUB', MUL_NN = 'MUL', LESS_NN = 'LESS', LEQUAL_NN = 'LEQUAL'
+}
+
+local function c_string(str)
+	return '"' .. string.gsub(str, '[%c"\\?\128-\255]', function(c)
+		return string.format('\\%03o', string.byte(c))
+	end) .. '"'
+end
+
+local function c_number(n)
+	return string.format('%.17g', n)
+end
+
+local function is_number_const(asm, k)
+	return type(asm.constants[k + 1]) == 'number'
+end
+
+local function push_const(asm, k)
+	local v = asm.constants[k + 1]
+	if v == 'nil' then
+		return 'su_pushnil(s);'
+	elseif type(v) == 'number' then
+		return string.format('su_pushnumber(s, %s);', c_number(v))
+	elseif type(v) == 'boolean' then
+		return string.format('su_pushboolean(s, %i);', v and 1 or 0)
+	end
+	return string.format('su_pushbytes(s, %s, %i);', c_string(v), #v)
+end
+
+-- Operands of the _LL, _LK and _KL forms as C expressions, in the order
+-- the VM reads them. Nil if a constant operand is not a number.
+local function number_operands(asm, inst, depth)
+	local op, a, b = inst[1], inst[2] or 0, inst[3] or 0
+	local loc = function(i) return string.format('___aot_number(s, %i)', i - depth) end
+	if string.find(op, '_LL$') then
+		return loc(a), loc(b)
+	elseif not is_number_const(asm, b) then
+		return nil
+	elseif string.find(op, '_KL$') then
+		return c_number(asm.constants[b + 1]), loc(a)
+	end
+	return loc(a), c_number(asm.constants[b + 1])
+end
+
+local function jump_targets(asm)
+	local targets = {}
+	for _,v in ipairs(asm.instructions) do
+		if v[1] == 'TEST' or v[1] == 'JMP' or v[1] == 'FOR' or v[1] == 'FORLOOP' then
+			targets[v[3]] = true
+		end
+	end
+	return targets
+end
+
+-- The C expression for a compare or EQ operand form, for fusing with a
+-- following TEST. Nil if the form has no expression.
+local function condition(asm, inst, depth)
+	local op = inst[1]
+	if op == 'EQ_LL' then
+		return string.format('su_equal(s, %i, %i)', inst[2] - depth, inst[3] - depth)
+	elseif op == 'EQ_LK' and is_number_const(asm, inst[3]) then
+		local idx = inst[2] - depth
+		return string.format('(su_type(s, %i) == SU_NUMBER && su_tonumber(s, %i) == %s)', idx, idx, c_number(asm.constants[inst[3] + 1]))
+	elseif string.find(op, '^LESS_') or string.find(op, '^LEQUAL_') then
+		local a, b = number_operands(asm, inst, depth)
+		if a then
+			return string.format('%s %s %s', a, arith[op], b)
+		end
+	end
+end
+
+local function translatable(asm)
+	if not asm.parent or #asm.up > 0 or #asm.prototypes > 0 then
+		return false
+	end
+	for _,v in ipairs(asm.instructions) do
+		local op = v[1]
+		-- A native can't hand a tail call back to the VM, so a lambda that
+		-- makes one stays bytecode and the call stays proper.
+		if op == 'LUP' or op == 'LAMBDA' or op == 'TCALL' then
+			return false
+		elseif arith[op] and string.find(op, '_[LK][LK]$') and not number_operands(asm, v, 0) then
+			return false
+		end
+	end
+	return true
+end
+
+-- Emits the body of one lambda. The VM stack depth relative to the frame
+-- base is known at every instruction, so locals become fixed negative
+-- indices.
+local function translate(asm, name)
+	local code = {}
+	local depth = {}
+	local targets = jump_targets(asm)
+	local jumped = {}
+	local labels = {}
+	local line
+
+	local function emit(fmt, ...)
+		table.insert(code, '\t' .. string.format(fmt, ...))
+	end
+
+	local function reach(pc, d)
+		assert(not depth[pc] or depth[pc] == d, 'AOT stack depth mismatch')
+		depth[pc] = d
+	end
+
+	-- Like reach, for the target of a jump that is emitted.
+	local function branch(pc, d)
+		jumped[pc] = true
+		reach(pc, d)
+	end
+
+	local function goto_pc(from, to)
+		if to <= from then
+			emit('su_safepoint(s);')
+		end
+		emit('goto L%i;', to)
+	end
+
+	table.insert(code, string.format('static int ___%s(su_state *s, int narg) {', name))
+	if asm.varg then
+		emit('su_vector(s, narg);')
+	else
+		emit('if (narg != %i) su_error(s, "Bad number of arguments to function! Expected %%i, but got %%i.", %i, narg);', asm.num_args, asm.num_args)
+	end
+	reach(0, asm.num_args + 1)
+
+	local i = 1
+	while i <= #asm.instructions do
+		local pc = i - 1
+		local inst = asm.instructions[i]
+		local op, a, b = generic[inst[1]] or inst[1], inst[2] or 0, inst[3] or 0
+		local d = depth[pc]
+		local next_d = d
+		local size = 1
+
+		if d then
+			if targets[pc] then
+				table.insert(code, string.format('L%i:', pc))
+				labels[#code] = pc
+			end
+			if asm.linenr[i] ~= line then
+				line = asm.linenr[i]
+				table.insert(code, string.format('#ifdef SU_OPT_C_LINE\n\t#line %i "%s"\n#endif', line, asm.name))
+			end
+
+			local nxt = asm.instructions[i + 1]
+			local cond = nxt and nxt[1] == 'TEST' and condition(asm, inst, d)
+
+			if cond then
+				-- A compare followed by TEST branches without pushing the result.
+				emit('if (%s) goto L%i;', cond, nxt[3])
+				branch(nxt[3], d)
+				if targets[pc + 1] then
+					-- Something jumps to the TEST, which then runs on its own.
+					emit('goto L%i;', pc + 2)
+					targets[pc + 2] = true
+					branch(pc + 2, d)
+					reach(pc + 1, d + 1)
+					next_d = nil
+				else
+					size = 2
+				end
+			elseif op == 'PUSH' then
+				emit('%s', push_const(asm, a))
+				next_d = d + 1
+			elseif op == 'POP' then
+				emit('su_pop(s, %i);', a)
+				next_d = d - a
+			elseif op == 'LOAD' then
+				emit('su_copy(s, %i);', a - d)
+				next_d = d + 1
+			elseif op == 'LCL' then
+				local f = c_func[b + 1]
+				if f.enum then
+					emit('su_pushnumber(s, (double)%s);', f.enum)
+				else
+					emit('su_pushfunction(s, &___%s);', f.name)
+				end
+				next_d = d + 1
+			elseif op == 'ADD' or op == 'SUB' or op == 'MUL' or op == 'DIV' or op == 'MOD' or op == 'POW'
+				or op == 'LESS' or op == 'LEQUAL' then
+				emit('{')
+				emit('\tdouble a = ___aot_number(s, -2);')
+				emit('\tdouble b = ___aot_number(s, -1);')
+				emit('\tsu_pop(s, 2);')
+				if op == 'DIV' then
+					emit('\tsu_assert(s, b != 0.0, "Division by zero!");')
+				end
+				if op == 'MOD' then
+					emit('\tsu_pushnumber(s, (double)((int)a %% (int)b));')
+				elseif op == 'POW' then
+					emit('\tsu_pushnumber(s, pow(a, b));')
+				elseif op == 'LESS' or op == 'LEQUAL' then
+					emit('\tsu_pushboolean(s, a %s b);', arith[op])
+				else
+					emit('\tsu_pushnumber(s, a %s b);', arith[op])
+				end
+				emit('}')
+				next_d = d - 1
+			elseif op == 'UNM' then
+				emit('{ double a = ___aot_number(s, -1); su_pop(s, 1); su_pushnumber(s, -a); }')
+			elseif op == 'EQ' then
+				emit('{ int r = su_equal(s, -2, -1); su_pop(s, 2); su_pushboolean(s, r); }')
+				next_d = d - 1
+			elseif op == 'NOT' then
+				emit('su_pushboolean(s, !___aot_pop_true(s));')
+			elseif op == 'AND' then
+				emit('if (___aot_true(s, -2) && ___aot_true(s, -1)) { su_swap(s, -2, -1); su_pop(s, 1); }')
+				emit('else { su_pop(s, 2); su_pushboolean(s, 0); }')
+				next_d = d - 1
+			elseif op == 'OR' then
+				emit('if (___aot_true(s, -2)) { su_pop(s, 1); }')
+				emit('else if (___aot_true(s, -1)) { su_swap(s, -2, -1); su_pop(s, 1); }')
+				emit('else { su_pop(s, 2); su_pushboolean(s, 0); }')
+				next_d = d - 1
+			elseif op == 'TEST' then
+				emit('if (___aot_pop_true(s)) goto L%i;', b)
+				next_d = d - 1
+				branch(b, next_d)
+			elseif op == 'FOR' then
+				emit('if (su_type(s, -2) == SU_NIL) { su_swap(s, -2, -1); su_pop(s, 1); goto L%i; }', b)
+				emit('su_pop(s, 1);')
+				emit('su_check_type(s, -1, SU_SEQ);')
+				emit('su_rest(s, -1); su_swap(s, -2, -1); su_first(s, -1); su_swap(s, -2, -1); su_pop(s, 1);')
+				branch(b, d - 1)
+			elseif op == 'JMP' then
+				goto_pc(pc, b)
+				branch(b, d)
+				next_d = nil
+			elseif op == 'RETURN' then
+				emit('return 1;')
+				next_d = nil
+			elseif op == 'SHIFT' then
+				if a > 0 then
+					emit('su_swap(s, %i, -1); su_pop(s, %i);', -(a + 1), a)
+				end
+				next_d = d - a
+			elseif op == 'CALL' then
+				local nret = b > 0 and b or 1
+				emit('su_call(s, %i, %i);', a, nret)
+				next_d = d - a - 1 + nret
+			elseif op == 'GETGLOBAL' then
+				emit('___aot_getglobal(s, %s);', c_string(asm.constants[a + 1]))
+				next_d = d + 1
+			elseif op == 'SETGLOBAL' then
+				emit('su_copy(s, -1); su_setglobal(s, %s);', c_string(asm.constants[a + 1]))
+			elseif op == 'GETFIELD' then
+				emit('%s su_call(s, 1, 1);', push_const(asm, a))
+			elseif op == 'FORPREP' then
+				emit('{')
+				emit('\tint i = (int)___aot_number(s, -2), j = (int)___aot_number(s, -1);')
+				emit('\tj += (j - i > 0) ? 1 : -1;')
+				emit('\tsu_pop(s, 2); su_pushnumber(s, (double)j); su_pushnumber(s, (double)i);')
+				emit('}')
+			elseif op == 'FORLOOP' then
+				emit('{')
+				emit('\tdouble e = su_tonumber(s, -3), c = su_tonumber(s, -2);')
+				emit('\tc += (e > c) ? 1.0 : -1.0;')
+				emit('\tif (c != e) { su_pop(s, 2); su_pushnumber(s, c); su_safepoint(s); goto L%i; }', b)
+				emit('\tsu_swap(s, -3, -1); su_pop(s, 2);')
+				emit('}')
+				branch(b, d - 1)
+				next_d = d - 2
+			elseif op == 'STORE' then
+				for k = 0, a - 1 do
+					local dst, src = b + k, d - a + k
+					if dst ~= src then
+						emit('su_swap(s, %i, %i);', dst - d, src - d)
+					end
+				end
+				if d - (b + a) > 0 then
+					emit('su_pop(s, %i);', d - (b + a))
+				end
+				next_d = b + a
+			elseif arith[op] then
+				local x, y = number_operands(asm, inst, d)
+				local push = (string.find(op, '^LESS') or string.find(op, '^LEQUAL')) and 'su_pushboolean' or 'su_pushnumber'
+				emit('{ double a = %s; double b = %s; %s(s, a %s b); }', x, y, push, arith[op])
+				next_d = d + 1
+			elseif op == 'EQ_LL' or op == 'EQ_LK' then
+				if op == 'EQ_LL' then
+					emit('su_pushboolean(s, su_equal(s, %i, %i));', a - d, b - d)
+				else
+					emit('{ int r; %s r = su_equal(s, %i, -1); su_pop(s, 1); su_pushboolean(s, r); }', push_const(asm, b), a - d - 1)
+				end
+				next_d = d + 1
+			else
+				error('Invalid AOT instruction: ' .. op)
+			end
+		end
+
+		if next_d and i + size <= #asm.instructions then
+			reach(pc + size, next_d)
+		end
+		i = i + size
+	end
+
+	-- A branch that is never reached, like the JMP after a self tail call,
+	-- emits no goto, so its target is only known to be unused at the end.
+	for k = #code, 1, -1 do
+		if labels[k] and not jumped[labels[k]] then
+			table.remove(code, k)
+		end
+	end
+
+	table.insert(code, '}\n\n')
+	return table.concat(code, '\n')
+end
+
+-- Translates nested lambdas bottom up and rewrites the LAMBDA instructions
+-- that create them to LCL.
+local function aot_func(asm)
+	local prototypes = {}
+	local map = {}
+
+	for i,v in ipairs(asm.prototypes) do
+		aot_func(v)
+		if translatable(v) then
+			local name = 'aot' .. tostring(#c_func)
+			table.insert(c_func, {name = name})
+			c_code = c_code or ''
+			prelude_at = prelude_at or #c_code
+			c_code = c_code .. translate(v, name)
+			map[i - 1] = {'LCL', 0, #c_func - 1}
+		else
+			table.insert(prototypes, v)
+			map[i - 1] = #prototypes - 1
+		end
+	end
+
+	for i,v in ipairs(asm.instructions) do
+		if v[1] == 'LAMBDA' then
+			local m = map[v[2]]
+			if type(m) == 'table' then
+				asm.instructions[i] = m
+			else
+				v[2] = m
+			end
+		end
+	end
+	asm.prototypes = prototypes
+end
+
+function aot(asm)
+	prelude_at = nil
+	aot_func(asm)
+	if prelude_at then
+		c_code = string.sub(c_code, 1, prelude_at) .. aot_prelude(c_code) .. string.sub(c_code, prelude_at + 1)
+	end
+end
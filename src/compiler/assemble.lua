@@ -39,7 +39,68 @@ local instruction_set = {
 	'LAMBDA',
 
 	'GETGLOBAL',
-	'SETGLOBAL'
+	'SETGLOBAL',
+	'GETFIELD',
+	'FORPREP',
+	'FORLOOP',
+	'STORE',
+
+	'ADD_LL',
+	'ADD_LK',
+	'SUB_LL',
+	'SUB_LK',
+	'SUB_KL',
+	'MUL_LL',
+	'MUL_LK',
+	'EQ_LL',
+	'EQ_LK',
+	'LESS_LL',
+	'LESS_LK',
+	'LESS_KL',
+	'LEQUAL_LL',
+	'LEQUAL_LK',
+	'LEQUAL_KL',
+
+	'EQ_LL_TEST',
+	'EQ_LK_TEST',
+	'LESS_LL_TEST',
+	'LESS_LK_TEST',
+	'LESS_KL_TEST',
+	'LEQUAL_LL_TEST',
+	'LEQUAL_LK_TEST',
+	'LEQUAL_KL_TEST',
+	'SHIFT_JMP',
+	'LOAD_LOAD',
+
+	'ADD_NN',
+	'SUB_NN',
+	'MUL_NN',
+	'LESS_NN',
+	'LEQUAL_NN'
+}
+
+-- Header flags, must match the VM.
+local HEADER_OPERANDS = 0x1
+local HEADER_SUPERINST = 0x2
+
+local opt_superinst = not os.getenv('SU_OPT_NO_SUPERINST')
+
+-- Opcode pairs fused into a superinstruction, picked from the pair
+-- histogram of a VM built with SU_OPT_VM_STATS (tools/bench/pairs.sh).
+-- The second instruction is left in place as an operand word, so the
+-- instruction count, jump targets and line info are unchanged and a
+-- jump to the second instruction still executes it on its own.
+local superinst = {
+	EQ_LL = { TEST = 'EQ_LL_TEST' },
+	EQ_LK = { TEST = 'EQ_LK_TEST' },
+	LESS_LL = { TEST = 'LESS_LL_TEST' },
+	LESS_LK = { TEST = 'LESS_LK_TEST' },
+	LESS_KL = { TEST = 'LESS_KL_TEST' },
+	LEQUAL_LL = { TEST = 'LEQUAL_LL_TEST' },
+	LEQUAL_LK = { TEST = 'LEQUAL_LK_TEST' },
+	LEQUAL_KL = { TEST = 'LEQUAL_KL_TEST' },
+	SHIFT = { JMP = 'SHIFT_JMP' },
+	LOAD = { LOAD = 'LOAD_LOAD' }
 }
 
 local instruction_matrix = {}
@@ -54,7 +115,21 @@ local function asm_error(file, line, ...)
 	error(saurus_error)
 end
 
+local function fuse(instructions)
+	for i = 1, #instructions - 1 do
+		local pair = superinst[instructions[i][1]]
+		local fused = pair and pair[instructions[i + 1][1]]
+		if fused then
+			instructions[i][1] = fused
+		end
+	end
+end
+
 function asm_func(asm, bin)
+	if opt_superinst then
+		fuse(asm.instructions)
+	end
+
 	bin:write(writebin.uint32(#asm.instructions))
 	for i,v in ipairs(asm.instructions) do
 		local inst = assert(instruction_matrix[v[1]], 'Invalid instruction: ' .. v[1])
@@ -116,7 +191,7 @@ function assemble(asm, dest)
 		end
 	}
 
-	bin:write(writebin.header(SAURUS_VERSION[1], SAURUS_VERSION[2]))
+	bin:write(writebin.header(SAURUS_VERSION[1], SAURUS_VERSION[2], HEADER_OPERANDS + HEADER_SUPERINST))
 	asm_func(asm, bin)
 	return bin.data
 end
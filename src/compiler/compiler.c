@@ -83,9 +83,9 @@ static int ___saurus(su_state *s);
     static int encode_header(lua_State *L) {
         header h;
         memcpy(h.sign, "\x1bsuc", 4);
-        h.maj = (unsigned char)lua_tointeger(L, -2);
-        h.min = (unsigned char)lua_tointeger(L, -1);
-        h.flags = 0;
+        h.maj = (unsigned char)lua_tointeger(L, 1);
+        h.min = (unsigned char)lua_tointeger(L, 2);
+        h.flags = (unsigned short)lua_tointeger(L, 3);
 
         assert(sizeof(header) == 8);
         lua_pushlstring(L, (char*)&h, 8);
@@ -222,7 +222,7 @@ static int ___saurus(su_state *s);
 
 static int ___saurus(su_state *s) {
 	const char code[] = {
-		27,115,117,99,0,0,0,0,6,0,0,0,0,0,0,0,1,1,0,0,
+		27,115,117,99,0,0,3,0,6,0,0,0,0,0,0,0,1,1,0,0,
 		0,0,0,0,1,1,0,0,0,0,0,0,21,0,0,0,1,0,0,0,
 		0,0,0,0,0,0,0,0,0,24,0,0,0,115,114,99,47,99,111,109,
 		112,105,108,101,114,47,99,111,109,112,105,108,101,114,46,115,117,6,0,0,
@@ -8,6 +8,8 @@
 require('parser')
 require('generate')
 require('assemble')
+require('profile')
+require('aot')
 
 SAURUS_VERSION = {0, 0, 1}
 SAURUS_VERSION_STRING = string.format('%i.%i.%i', unpack(SAURUS_VERSION))
@@ -21,7 +23,7 @@ function get_file_path(str)
 	return root_path
 end
 
-function repl(src, name, path, asm_out)
+function repl(src, name, path, asm_out, aot_out)
 	c_guard = {}
 	c_func = {}
 	c_code = nil
@@ -36,14 +38,18 @@ function repl(src, name, path, asm_out)
 	--ast_print(ast)
 
 	local asm = generate(ast, name or '?')
+	profile(asm)
 	if asm_out then
 		gen_print(asm, nil, asm_out)
 		return
 	end
+	if aot_out then
+		aot(asm)
+	end
 	return assemble(asm, dest)
 end
 
-function compile(src, dest, compile)
+function compile(src, dest, compile, translate)
 	local fp = io.open(src, 'rb')
 	if not fp then
 		saurus_error = 'Could not open: ' .. src
@@ -57,12 +63,13 @@ function compile(src, dest, compile)
 	end
 
 	local asm_out = compile and string.sub(dest, -4) == '.sua'
-	local res = repl(fp:read('*a'), src, get_file_path(src), asm_out and out_fp)
+	local c_out = compile and string.sub(dest, -2) == '.c'
+	local res = repl(fp:read('*a'), src, get_file_path(src), asm_out and out_fp, c_out and translate)
 
 	fp:close()
 	fp = out_fp
 
-	if compile and string.sub(dest, -2) == '.c' then
+	if c_out then
 		fp:write(string.format('/*\n * Generated with Saurus v %s\n', SAURUS_VERSION_STRING))
 		fp:write(string.format(' * http://www.saurus.org\n */\n\n', src))
 		fp:write(string.format('/* %s */\n\n#include <saurus.h>\n\n', src))
@@ -6,6 +6,24 @@
 -- file, You can obtain one at http://mozilla.org/MPL/2.0/.
 
 local opt_tail = true
+local opt_operands = not os.getenv('SU_OPT_NO_OPERANDS')
+local opt_getfield = not os.getenv('SU_OPT_NO_GETFIELD')
+local opt_forrange = not os.getenv('SU_OPT_NO_FORRANGE')
+local opt_tailrec = not os.getenv('SU_OPT_NO_TAILREC')
+
+-- Instructions that read their operands straight from frame slots (L)
+-- or the constant table (K) instead of from the stack.
+local operand_inst = {
+	['+'] = {'ADD', commutative = true},
+	['-'] = {'SUB'},
+	['*'] = {'MUL', commutative = true},
+	['=='] = {'EQ', commutative = true},
+	['~='] = {'EQ', commutative = true, negate = true},
+	['<'] = {'LESS'},
+	['<='] = {'LEQUAL'},
+	['>'] = {'LESS', swap = true},
+	['>='] = {'LEQUAL', swap = true}
+}
 
 local function table_clone(tab)
 	local t = {}
@@ -21,9 +39,17 @@ local function gen_inst(func, inst, line, ...)
 	func.linenr[instidx] = line
 end
 
-local function call_or_tail(func, tail, line, narg)
-	gen_inst(func, (tail and opt_tail and func.parent) and 'TCALL' or 'CALL', line, narg)
-	func.stack_pointer = func.stack_pointer - narg
+-- A call leaves nret results, one by default, in place of the function
+-- and its arguments. A tail call returns whatever its caller asked for.
+local function call_or_tail(func, tail, line, narg, nret)
+	nret = nret or 1
+	if tail and opt_tail and func.parent then
+		assert(nret == 1)
+		gen_inst(func, 'TCALL', line, narg)
+	else
+		gen_inst(func, 'CALL', line, narg, nret > 1 and nret or nil)
+	end
+	func.stack_pointer = func.stack_pointer - narg + nret - 1
 	assert(func.stack_pointer > 0)
 end
 
@@ -36,13 +62,36 @@ local function gen_pop(func, num)
 	assert(func.stack_pointer >= 0)
 end
 
-local function gen_call(func, ast, tail)
+-- A 'rec' call in tail position reuses the frame. The arguments are
+-- stored over the current ones and control jumps to the function start.
+local function is_tail_rec(func, ast, tail)
+	return tail and opt_tail and opt_tailrec and func.parent and not func.varg
+		and ast.func.type == 'identifier' and ast.func.value == 'rec'
+		and #ast.args == func.num_args
+end
+
+local function gen_tail_rec(func, ast)
+	local stack = func.stack_pointer
+	for _,arg in ipairs(ast.args) do
+		gen(func, arg)
+	end
+	gen_inst(func, 'STORE', ast.line, #ast.args, 1)
+	gen_inst(func, 'JMP', ast.line, 0, 0)
+	func.stack_pointer = stack + 1
+end
+
+local function gen_call(func, ast, tail, nret)
 	assert(ast.type == 'call')
+	if is_tail_rec(func, ast, tail) then
+		gen_tail_rec(func, ast)
+		return
+	end
+
 	gen(func, ast.func)
 	for _,arg in ipairs(ast.args) do
 		gen(func, arg)
 	end
-	call_or_tail(func, tail, ast.line, #ast.args)
+	call_or_tail(func, tail, ast.line, #ast.args, nret)
 end
 
 local function find_lable(func, name)
@@ -100,14 +149,97 @@ local function gen_fetch(func, ident)
 	func.stack_pointer = func.stack_pointer + 1
 end
 
+local function operand(func, ast)
+	if ast.type == 'number' or ast.type == 'string' or ast.type == 'boolean' then
+		return 'K', push_const(func, ast.value)
+	elseif ast.type == 'identifier' then
+		if ast.value == 'nil' then
+			return 'K', push_const(func, 'nil')
+		elseif func.parent and ast.value == 'rec' then
+			return 'L', 0
+		end
+		local lv, id = find_up(func, ast.value)
+		if lv == 0 and id + 1 <= 255 then
+			return 'L', id + 1
+		end
+	end
+end
+
+local function gen_operands(func, ast)
+	local inst = operand_inst[ast.operator]
+	if not opt_operands or not inst then
+		return false
+	end
+
+	local left, right = ast.left, ast.right
+	if inst.swap then
+		left, right = right, left
+	end
+
+	local lk, lv = operand(func, left)
+	local rk, rv = operand(func, right)
+	if not lk or not rk or (lk == 'K' and rk == 'K') then
+		return false
+	end
+
+	if lk == 'K' and inst.commutative then
+		lk, lv, rk, rv = rk, rv, lk, lv
+	end
+
+	if lk == 'L' and rk == 'L' then
+		gen_inst(func, inst[1] .. '_LL', ast.line, lv, rv)
+	elseif lk == 'L' then
+		gen_inst(func, inst[1] .. '_LK', ast.line, lv, rv)
+	else
+		gen_inst(func, inst[1] .. '_KL', ast.line, rv, lv)
+	end
+	if inst.negate then
+		gen_inst(func, 'NOT', ast.line)
+	end
+
+	func.stack_pointer = func.stack_pointer + 1
+	return true
+end
+
+local function gen_assign(func, ast, tail, discard)
+	assert(ast.left.type == 'identifier')
+	table.insert(func.lables, {ast.left.value, func.stack_pointer})
+	gen(func, ast.right, tail)
+	if not discard then
+		gen_inst(func, 'LOAD', ast.line, func.stack_pointer)
+		func.stack_pointer = func.stack_pointer + 1
+	end
+end
+
+-- '(a b) = f()' binds the results of a call to new locals, missing ones
+-- are nil. Anything but a call has a single result. The value of the
+-- expression is the first local.
+local function gen_destructure(func, ast, discard)
+	assert(ast.type == 'destructure')
+	local stack = func.stack_pointer
+	if ast.value.type == 'call' then
+		gen_call(func, ast.value, false, #ast.names)
+	else
+		gen(func, ast.value)
+		for i = 2, #ast.names do
+			gen_const(func, {type = 'string', value = 'nil', line = ast.line})
+		end
+	end
+	for i,name in ipairs(ast.names) do
+		table.insert(func.lables, {name.value, stack + i - 1})
+	end
+	if not discard then
+		gen_inst(func, 'LOAD', ast.line, stack + 1)
+		func.stack_pointer = func.stack_pointer + 1
+	end
+end
+
 local function gen_operator(func, ast, tail)
 	assert(ast.type == 'operator')
 	if ast.operator == '=' then
-		assert(ast.left.type == 'identifier')
-		table.insert(func.lables, {ast.left.value, func.stack_pointer})
-		gen(func, ast.right, tail)
-		gen_inst(func, 'LOAD', ast.line, func.stack_pointer)
-		func.stack_pointer = func.stack_pointer + 1
+		gen_assign(func, ast, tail)
+		return
+	elseif gen_operands(func, ast) then
 		return
 	elseif ast.operator == ':' or ast.operator == '..' then
 		gen_inst(func, 'GETGLOBAL', ast.line, push_const(func, (ast.operator == '..') and 'range' or 'cons'))
@@ -175,8 +307,12 @@ local function gen_dot(func, ast, tail)
 	assert(ast.type == 'dot')
 	gen(func, ast.left)
 	for _,arg in ipairs(ast.path) do
-		gen_const(func, arg)
-		call_or_tail(func, false, ast.line, 1)
+		if opt_getfield then
+			gen_inst(func, 'GETFIELD', ast.line, push_const(func, arg.value))
+		else
+			gen_const(func, arg)
+			call_or_tail(func, false, ast.line, 1)
+		end
 	end
 end
 
@@ -197,8 +333,16 @@ local function gen_block(func, ast, tail)
 	local lables = table_clone(func.lables)
 
 	for i = 1, num - 1 do
-		gen(func, ast.body[i])
-		gen_pop(func)
+		local expr = ast.body[i]
+		if opt_operands and expr.type == 'operator' and expr.operator == '=' then
+			-- The assigned value stays in its slot; no copy to discard.
+			gen_assign(func, expr, false, true)
+		elseif expr.type == 'destructure' then
+			gen_destructure(func, expr, true)
+		else
+			gen(func, expr)
+			gen_pop(func)
+		end
 	end
 	gen(func, ast.body[num], tail)
 	local shift = func.stack_pointer - (stack + 1)
@@ -238,8 +382,34 @@ local function gen_cond(func, ast, tail)
 	assert(#func.instructions == #func.linenr)
 end
 
+-- Loop over a range literal, 'for x = a..b'. The counter lives in the
+-- label slot and the end value in the slot below it, so nothing is
+-- allocated. Like range, the bounds are inclusive and the loop always
+-- runs at least once.
+local function gen_for_range(func, ast)
+	local stack = func.stack_pointer + 1
+	local bind_idx = #func.lables + 1
+	local bind = {ast.name, stack}
+
+	table.insert(func.lables, bind)
+	gen(func, ast.value.left)
+	gen(func, ast.value.right)
+	gen_inst(func, 'FORPREP', ast.value.line)
+
+	local body = #func.instructions
+	gen(func, ast.body)
+	gen_inst(func, 'FORLOOP', ast.line, 0, body)
+
+	func.stack_pointer = stack
+	assert(table.remove(func.lables, bind_idx) == bind)
+end
+
 local function gen_for(func, ast, tail)
 	assert(ast.type == 'for')
+	if opt_forrange and ast.value.type == 'operator' and ast.value.operator == '..' then
+		gen_for_range(func, ast)
+		return
+	end
 
 	local stack = func.stack_pointer + 1
 	local bind_idx = #func.lables + 1
@@ -281,6 +451,7 @@ local function gen_lambda(parent, ast)
 		constants = {},
 		up = {},
 		num_args = #ast.args,
+		varg = ast.varg,
 		stack_pointer = 0,
 		name = ast.file,
 		parent = parent
@@ -315,6 +486,8 @@ function gen(func, ast, tail)
 		gen_operator(func, ast, tail)
 	elseif ast.type == 'call' then
 		gen_call(func, ast, tail)
+	elseif ast.type == 'destructure' then
+		gen_destructure(func, ast)
 	elseif ast.type == 'block' then
 		gen_block(func, ast, tail)
 	elseif ast.type == 'cond' then
@@ -385,8 +558,10 @@ function gen_print(asm, lv, out)
 	puts(lv, out, '----------------------------')
 	for i,v in ipairs(asm.instructions) do
 		puts(lv, out, asm.linenr[i] .. ':', unpack(v))
-		if v[1] == 'PUSH' or v[1] == 'GETGLOBAL' then
+		if v[1] == 'PUSH' or v[1] == 'GETGLOBAL' or v[1] == 'GETFIELD' then
 			puts(lv, out, '\t -> ' .. tostring(asm.constants[v[2] + 1]))
+		elseif string.find(v[1], '_[LK]K$') or string.find(v[1], '_KL$') then
+			puts(lv, out, '\t -> ' .. tostring(asm.constants[v[3] + 1]))
 		end
 	end
 	for _,v in ipairs(asm.prototypes) do
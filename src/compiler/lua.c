@@ -1254,1302 +1254,2764 @@ const char compiler_code[] = {
 	0x6b, 0x2c, 0x20, 0x76, 0x61, 0x72, 0x67, 0x20, 0x3d, 0x20, 0x76, 0x61, 0x72, 0x67, 0x2c, 0x20, 
 	0x66, 0x69, 0x6c, 0x65, 0x20, 0x3d, 0x20, 0x74, 0x6f, 0x6b, 0x2e, 0x66, 0x69, 0x6c, 0x65, 0x2c, 
 	0x20, 0x6c, 0x69, 0x6e, 0x65, 0x20, 0x3d, 0x20, 0x6c, 0x69, 0x6e, 0x65, 0x7d, 0xa, 0x65, 0x6e, 
-	0x64, 0xa, 0xa, 0x66, 0x75, 0x6e, 0x63, 0x74, 0x69, 0x6f, 0x6e, 0x20, 0x72, 0x65, 0x61, 0x64, 
-	0x5f, 0x65, 0x78, 0x70, 0x72, 0x65, 0x73, 0x73, 0x69, 0x6f, 0x6e, 0x28, 0x73, 0x74, 0x72, 0x65, 
-	0x61, 0x6d, 0x2c, 0x20, 0x72, 0x65, 0x61, 0x64, 0x5f, 0x6f, 0x70, 0x29, 0xa, 0x20, 0x20, 0x20, 
-	0x20, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x20, 0x72, 0x65, 0x74, 0xa, 0x20, 0x20, 0x20, 0x20, 0x6c, 
-	0x6f, 0x63, 0x61, 0x6c, 0x20, 0x74, 0x6f, 0x6b, 0x20, 0x3d, 0x20, 0x6e, 0x65, 0x78, 0x74, 0x5f, 
-	0x74, 0x6f, 0x6b, 0x65, 0x6e, 0x28, 0x73, 0x74, 0x72, 0x65, 0x61, 0x6d, 0x29, 0xa, 0xa, 0x20, 
-	0x20, 0x20, 0x20, 0x69, 0x66, 0x20, 0x72, 0x65, 0x61, 0x64, 0x5f, 0x6f, 0x70, 0x20, 0x3d, 0x3d, 
-	0x20, 0x6e, 0x69, 0x6c, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
-	0x20, 0x20, 0x72, 0x65, 0x61, 0x64, 0x5f, 0x6f, 0x70, 0x20, 0x3d, 0x20, 0x74, 0x72, 0x75, 0x65, 
-	0xa, 0x20, 0x20, 0x20, 0x20, 0x65, 0x6e, 0x64, 0xa, 0xa, 0x20, 0x20, 0x20, 0x20, 0x6c, 0x6f, 
-	0x63, 0x61, 0x6c, 0x20, 0x66, 0x75, 0x6e, 0x63, 0x74, 0x69, 0x6f, 0x6e, 0x20, 0x66, 0x6c, 0x69, 
-	0x70, 0x28, 0x65, 0x78, 0x70, 0x72, 0x2c, 0x20, 0x72, 0x65, 0x74, 0x29, 0xa, 0x20, 0x20, 0x20, 
-	0x20, 0x20, 0x20, 0x20, 0x20, 0x69, 0x66, 0x20, 0x65, 0x78, 0x70, 0x72, 0x2e, 0x74, 0x79, 0x70, 
-	0x65, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x6f, 0x70, 0x65, 0x72, 0x61, 0x74, 0x6f, 0x72, 0x27, 0x20, 
-	0x61, 0x6e, 0x64, 0x20, 0x65, 0x78, 0x70, 0x72, 0x2e, 0x6f, 0x70, 0x65, 0x72, 0x61, 0x74, 0x6f, 
-	0x72, 0x20, 0x7e, 0x3d, 0x20, 0x27, 0x2e, 0x27, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x20, 0x20, 
-	0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x20, 
-	0x6c, 0x65, 0x66, 0x74, 0x20, 0x3d, 0x20, 0x65, 0x78, 0x70, 0x72, 0x2e, 0x6c, 0x65, 0x66, 0x74, 
-	0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x72, 0x65, 0x74, 
-	0x2e, 0x61, 0x72, 0x67, 0x2e, 0x6c, 0x65, 0x66, 0x74, 0x20, 0x3d, 0x20, 0x72, 0x65, 0x74, 0xa, 
-	0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x72, 0x65, 0x74, 0x2e, 
-	0x61, 0x72, 0x67, 0x20, 0x3d, 0x20, 0x6c, 0x65, 0x66, 0x74, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 
-	0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x72, 0x65, 0x74, 0x20, 0x3d, 0x20, 0x65, 0x78, 0x70, 
-	0x72, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x65, 0x6e, 0x64, 0xa, 0x20, 0x20, 
-	0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x72, 0x65, 0x74, 0x75, 0x72, 0x6e, 0x20, 0x72, 0x65, 0x74, 
-	0xa, 0x20, 0x20, 0x20, 0x20, 0x65, 0x6e, 0x64, 0xa, 0xa, 0x20, 0x20, 0x20, 0x20, 0x69, 0x66, 
-	0x20, 0x6e, 0x6f, 0x74, 0x20, 0x74, 0x6f, 0x6b, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x20, 0x20, 
-	0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x72, 0x65, 0x74, 0x75, 0x72, 0x6e, 0xa, 0x20, 0x20, 0x20, 
-	0x20, 0x65, 0x6e, 0x64, 0xa, 0xa, 0x20, 0x20, 0x20, 0x20, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x20, 
-	0x76, 0x74, 0x79, 0x70, 0x65, 0x20, 0x3d, 0x20, 0x74, 0x79, 0x70, 0x65, 0x28, 0x74, 0x6f, 0x6b, 
-	0x2e, 0x76, 0x61, 0x6c, 0x75, 0x65, 0x29, 0xa, 0x20, 0x20, 0x20, 0x20, 0x69, 0x66, 0x20, 0x76, 
-	0x74, 0x79, 0x70, 0x65, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x62, 0x6f, 0x6f, 0x6c, 0x65, 0x61, 0x6e, 
-	0x27, 0x20, 0x6f, 0x72, 0x20, 0x76, 0x74, 0x79, 0x70, 0x65, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x6e, 
-	0x75, 0x6d, 0x62, 0x65, 0x72, 0x27, 0x20, 0x6f, 0x72, 0x20, 0x76, 0x74, 0x79, 0x70, 0x65, 0x20, 
-	0x3d, 0x3d, 0x20, 0x27, 0x73, 0x74, 0x72, 0x69, 0x6e, 0x67, 0x27, 0x20, 0x74, 0x68, 0x65, 0x6e, 
-	0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x72, 0x65, 0x74, 0x20, 0x3d, 0x20, 0x7b, 
-	0x74, 0x79, 0x70, 0x65, 0x20, 0x3d, 0x20, 0x76, 0x74, 0x79, 0x70, 0x65, 0x2c, 0x20, 0x76, 0x61, 
-	0x6c, 0x75, 0x65, 0x20, 0x3d, 0x20, 0x74, 0x6f, 0x6b, 0x2e, 0x76, 0x61, 0x6c, 0x75, 0x65, 0x2c, 
-	0x20, 0x66, 0x69, 0x6c, 0x65, 0x20, 0x3d, 0x20, 0x74, 0x6f, 0x6b, 0x2e, 0x66, 0x69, 0x6c, 0x65, 
-	0x2c, 0x20, 0x6c, 0x69, 0x6e, 0x65, 0x20, 0x3d, 0x20, 0x74, 0x6f, 0x6b, 0x2e, 0x6c, 0x69, 0x6e, 
-	0x65, 0x7d, 0xa, 0x20, 0x20, 0x20, 0x20, 0x65, 0x6c, 0x73, 0x65, 0x69, 0x66, 0x20, 0x76, 0x74, 
-	0x79, 0x70, 0x65, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x74, 0x61, 0x62, 0x6c, 0x65, 0x27, 0x20, 0x74, 
-	0x68, 0x65, 0x6e, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x69, 0x66, 0x20, 0x74, 
-	0x6f, 0x6b, 0x2e, 0x69, 0x73, 0x5f, 0x6b, 0x65, 0x79, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x20, 
-	0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 
-	0x20, 0x76, 0x20, 0x3d, 0x20, 0x74, 0x6f, 0x6b, 0x2e, 0x76, 0x61, 0x6c, 0x75, 0x65, 0x5b, 0x31, 
-	0x5d, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x69, 0x66, 
-	0x20, 0x76, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x64, 0x6f, 0x27, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 
-	0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
-	0x72, 0x65, 0x74, 0x20, 0x3d, 0x20, 0x72, 0x65, 0x61, 0x64, 0x5f, 0x62, 0x6c, 0x6f, 0x63, 0x6b, 
-	0x28, 0x73, 0x74, 0x72, 0x65, 0x61, 0x6d, 0x29, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
-	0x20, 0x20, 0x20, 0x20, 0x20, 0x65, 0x6c, 0x73, 0x65, 0x69, 0x66, 0x20, 0x76, 0x20, 0x3d, 0x3d, 
-	0x20, 0x27, 0x69, 0x66, 0x27, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 
-	0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x72, 0x65, 0x74, 0x20, 0x3d, 
-	0x20, 0x72, 0x65, 0x61, 0x64, 0x5f, 0x63, 0x6f, 0x6e, 0x64, 0x28, 0x73, 0x74, 0x72, 0x65, 0x61, 
-	0x6d, 0x29, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x65, 
-	0x6c, 0x73, 0x65, 0x69, 0x66, 0x20, 0x76, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x64, 0x65, 0x66, 0x27, 
+	0x64, 0xa, 0xa, 0x2d, 0x2d, 0x20, 0x44, 0x65, 0x73, 0x74, 0x72, 0x75, 0x63, 0x74, 0x75, 0x72, 
+	0x69, 0x6e, 0x67, 0x20, 0x61, 0x73, 0x73, 0x69, 0x67, 0x6e, 0x6d, 0x65, 0x6e, 0x74, 0x2c, 0x20, 
+	0x27, 0x28, 0x61, 0x20, 0x62, 0x29, 0x20, 0x3d, 0x20, 0x66, 0x28, 0x29, 0x27, 0x2e, 0xa, 0x6c, 
+	0x6f, 0x63, 0x61, 0x6c, 0x20, 0x66, 0x75, 0x6e, 0x63, 0x74, 0x69, 0x6f, 0x6e, 0x20, 0x72, 0x65, 
+	0x61, 0x64, 0x5f, 0x64, 0x65, 0x73, 0x74, 0x72, 0x75, 0x63, 0x74, 0x75, 0x72, 0x65, 0x28, 0x73, 
+	0x74, 0x72, 0x65, 0x61, 0x6d, 0x29, 0xa, 0x20, 0x20, 0x20, 0x20, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 
+	0x20, 0x6c, 0x69, 0x6e, 0x65, 0x20, 0x3d, 0x20, 0x73, 0x74, 0x72, 0x65, 0x61, 0x6d, 0x2e, 0x6c, 
+	0x69, 0x6e, 0x65, 0xa, 0x20, 0x20, 0x20, 0x20, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x20, 0x74, 0x6f, 
+	0x6b, 0x65, 0x6e, 0x73, 0x2c, 0x20, 0x6e, 0x61, 0x6d, 0x65, 0x73, 0x20, 0x3d, 0x20, 0x7b, 0x7d, 
+	0x2c, 0x20, 0x7b, 0x7d, 0xa, 0xa, 0x20, 0x20, 0x20, 0x20, 0x77, 0x68, 0x69, 0x6c, 0x65, 0x20, 
+	0x74, 0x72, 0x75, 0x65, 0x20, 0x64, 0x6f, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
+	0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x20, 0x74, 0x6f, 0x6b, 0x20, 0x3d, 0x20, 0x6e, 0x65, 0x78, 0x74, 
+	0x5f, 0x74, 0x6f, 0x6b, 0x65, 0x6e, 0x28, 0x73, 0x74, 0x72, 0x65, 0x61, 0x6d, 0x29, 0xa, 0x20, 
+	0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x74, 0x61, 0x62, 0x6c, 0x65, 0x2e, 0x69, 0x6e, 0x73, 
+	0x65, 0x72, 0x74, 0x28, 0x74, 0x6f, 0x6b, 0x65, 0x6e, 0x73, 0x2c, 0x20, 0x74, 0x6f, 0x6b, 0x29, 
+	0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x69, 0x66, 0x20, 0x6e, 0x6f, 0x74, 0x20, 
+	0x74, 0x6f, 0x6b, 0x20, 0x6f, 0x72, 0x20, 0x74, 0x79, 0x70, 0x65, 0x28, 0x74, 0x6f, 0x6b, 0x2e, 
+	0x76, 0x61, 0x6c, 0x75, 0x65, 0x29, 0x20, 0x7e, 0x3d, 0x20, 0x27, 0x74, 0x61, 0x62, 0x6c, 0x65, 
+	0x27, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
+	0x20, 0x20, 0x20, 0x69, 0x66, 0x20, 0x6e, 0x6f, 0x74, 0x20, 0x74, 0x6f, 0x6b, 0x20, 0x6f, 0x72, 
+	0x20, 0x74, 0x6f, 0x6b, 0x2e, 0x74, 0x6f, 0x6b, 0x65, 0x6e, 0x20, 0x7e, 0x3d, 0x20, 0x27, 0x29, 
+	0x27, 0x20, 0x6f, 0x72, 0x20, 0x23, 0x6e, 0x61, 0x6d, 0x65, 0x73, 0x20, 0x3d, 0x3d, 0x20, 0x30, 
 	0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
-	0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x72, 0x65, 0x74, 0x20, 0x3d, 0x20, 0x72, 0x65, 0x61, 0x64, 
-	0x5f, 0x64, 0x65, 0x66, 0x28, 0x73, 0x74, 0x72, 0x65, 0x61, 0x6d, 0x29, 0xa, 0x20, 0x20, 0x20, 
-	0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x65, 0x6c, 0x73, 0x65, 0x69, 0x66, 0x20, 
-	0x76, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x63, 0x66, 0x75, 0x6e, 0x27, 0x20, 0x74, 0x68, 0x65, 0x6e, 
+	0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x77, 0x68, 0x69, 0x6c, 0x65, 0x20, 0x23, 0x74, 0x6f, 0x6b, 
+	0x65, 0x6e, 0x73, 0x20, 0x3e, 0x20, 0x30, 0x20, 0x64, 0x6f, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 
+	0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x72, 
+	0x65, 0x76, 0x65, 0x72, 0x74, 0x5f, 0x74, 0x6f, 0x6b, 0x65, 0x6e, 0x28, 0x73, 0x74, 0x72, 0x65, 
+	0x61, 0x6d, 0x2c, 0x20, 0x74, 0x61, 0x62, 0x6c, 0x65, 0x2e, 0x72, 0x65, 0x6d, 0x6f, 0x76, 0x65, 
+	0x28, 0x74, 0x6f, 0x6b, 0x65, 0x6e, 0x73, 0x2c, 0x20, 0x31, 0x29, 0x29, 0xa, 0x20, 0x20, 0x20, 
+	0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x65, 0x6e, 0x64, 
 	0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
-	0x20, 0x72, 0x65, 0x74, 0x20, 0x3d, 0x20, 0x72, 0x65, 0x61, 0x64, 0x5f, 0x63, 0x66, 0x75, 0x6e, 
-	0x28, 0x73, 0x74, 0x72, 0x65, 0x61, 0x6d, 0x29, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
-	0x20, 0x20, 0x20, 0x20, 0x20, 0x65, 0x6c, 0x73, 0x65, 0x69, 0x66, 0x20, 0x76, 0x20, 0x3d, 0x3d, 
-	0x20, 0x27, 0x63, 0x64, 0x65, 0x63, 0x27, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x20, 0x20, 0x20, 
-	0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x72, 0x65, 0x74, 
-	0x20, 0x3d, 0x20, 0x72, 0x65, 0x61, 0x64, 0x5f, 0x63, 0x64, 0x65, 0x63, 0x28, 0x73, 0x74, 0x72, 
-	0x65, 0x61, 0x6d, 0x29, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
-	0x20, 0x65, 0x6c, 0x73, 0x65, 0x69, 0x66, 0x20, 0x76, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x63, 0x69, 
-	0x6e, 0x63, 0x6c, 0x75, 0x64, 0x65, 0x27, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x20, 0x20, 0x20, 
+	0x20, 0x72, 0x65, 0x74, 0x75, 0x72, 0x6e, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
+	0x20, 0x20, 0x20, 0x20, 0x65, 0x6e, 0x64, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
+	0x20, 0x20, 0x20, 0x20, 0x62, 0x72, 0x65, 0x61, 0x6b, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
+	0x20, 0x20, 0x65, 0x6e, 0x64, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x74, 0x61, 
+	0x62, 0x6c, 0x65, 0x2e, 0x69, 0x6e, 0x73, 0x65, 0x72, 0x74, 0x28, 0x6e, 0x61, 0x6d, 0x65, 0x73, 
+	0x2c, 0x20, 0x74, 0x6f, 0x6b, 0x29, 0xa, 0x20, 0x20, 0x20, 0x20, 0x65, 0x6e, 0x64, 0xa, 0xa, 
+	0x20, 0x20, 0x20, 0x20, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x20, 0x74, 0x6f, 0x6b, 0x20, 0x3d, 0x20, 
+	0x6e, 0x65, 0x78, 0x74, 0x5f, 0x74, 0x6f, 0x6b, 0x65, 0x6e, 0x28, 0x73, 0x74, 0x72, 0x65, 0x61, 
+	0x6d, 0x29, 0xa, 0x20, 0x20, 0x20, 0x20, 0x69, 0x66, 0x20, 0x6e, 0x6f, 0x74, 0x20, 0x74, 0x6f, 
+	0x6b, 0x20, 0x6f, 0x72, 0x20, 0x74, 0x6f, 0x6b, 0x2e, 0x74, 0x6f, 0x6b, 0x65, 0x6e, 0x20, 0x7e, 
+	0x3d, 0x20, 0x27, 0x3d, 0x27, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 
+	0x20, 0x20, 0x20, 0x77, 0x68, 0x69, 0x6c, 0x65, 0x20, 0x23, 0x74, 0x6f, 0x6b, 0x65, 0x6e, 0x73, 
+	0x20, 0x3e, 0x20, 0x30, 0x20, 0x64, 0x6f, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
+	0x20, 0x20, 0x20, 0x20, 0x72, 0x65, 0x76, 0x65, 0x72, 0x74, 0x5f, 0x74, 0x6f, 0x6b, 0x65, 0x6e, 
+	0x28, 0x73, 0x74, 0x72, 0x65, 0x61, 0x6d, 0x2c, 0x20, 0x74, 0x61, 0x62, 0x6c, 0x65, 0x2e, 0x72, 
+	0x65, 0x6d, 0x6f, 0x76, 0x65, 0x28, 0x74, 0x6f, 0x6b, 0x65, 0x6e, 0x73, 0x2c, 0x20, 0x31, 0x29, 
+	0x29, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x65, 0x6e, 0x64, 0xa, 0x20, 0x20, 
+	0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x72, 0x65, 0x76, 0x65, 0x72, 0x74, 0x5f, 0x74, 0x6f, 0x6b, 
+	0x65, 0x6e, 0x28, 0x73, 0x74, 0x72, 0x65, 0x61, 0x6d, 0x2c, 0x20, 0x74, 0x6f, 0x6b, 0x29, 0xa, 
+	0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x72, 0x65, 0x74, 0x75, 0x72, 0x6e, 0xa, 0x20, 
+	0x20, 0x20, 0x20, 0x65, 0x6e, 0x64, 0xa, 0xa, 0x20, 0x20, 0x20, 0x20, 0x6c, 0x6f, 0x63, 0x61, 
+	0x6c, 0x20, 0x65, 0x78, 0x70, 0x72, 0x20, 0x3d, 0x20, 0x72, 0x65, 0x61, 0x64, 0x5f, 0x65, 0x78, 
+	0x70, 0x72, 0x65, 0x73, 0x73, 0x69, 0x6f, 0x6e, 0x28, 0x73, 0x74, 0x72, 0x65, 0x61, 0x6d, 0x29, 
+	0xa, 0x20, 0x20, 0x20, 0x20, 0x70, 0x61, 0x72, 0x73, 0x65, 0x72, 0x5f, 0x61, 0x73, 0x73, 0x65, 
+	0x72, 0x74, 0x28, 0x65, 0x78, 0x70, 0x72, 0x2c, 0x20, 0x73, 0x74, 0x72, 0x65, 0x61, 0x6d, 0x2c, 
+	0x20, 0x27, 0x61, 0x73, 0x73, 0x69, 0x67, 0x6e, 0x6d, 0x65, 0x6e, 0x74, 0x20, 0x65, 0x78, 0x70, 
+	0x65, 0x63, 0x74, 0x65, 0x64, 0x20, 0x72, 0x69, 0x67, 0x68, 0x74, 0x20, 0x73, 0x69, 0x64, 0x65, 
+	0x20, 0x65, 0x78, 0x70, 0x72, 0x65, 0x73, 0x73, 0x69, 0x6f, 0x6e, 0x27, 0x29, 0xa, 0x20, 0x20, 
+	0x20, 0x20, 0x72, 0x65, 0x74, 0x75, 0x72, 0x6e, 0x20, 0x7b, 0x74, 0x79, 0x70, 0x65, 0x20, 0x3d, 
+	0x20, 0x27, 0x64, 0x65, 0x73, 0x74, 0x72, 0x75, 0x63, 0x74, 0x75, 0x72, 0x65, 0x27, 0x2c, 0x20, 
+	0x6e, 0x61, 0x6d, 0x65, 0x73, 0x20, 0x3d, 0x20, 0x61, 0x72, 0x67, 0x73, 0x5f, 0x74, 0x6f, 0x5f, 
+	0x69, 0x64, 0x65, 0x6e, 0x74, 0x69, 0x66, 0x69, 0x65, 0x72, 0x73, 0x28, 0x6e, 0x61, 0x6d, 0x65, 
+	0x73, 0x29, 0x2c, 0x20, 0x76, 0x61, 0x6c, 0x75, 0x65, 0x20, 0x3d, 0x20, 0x65, 0x78, 0x70, 0x72, 
+	0x2c, 0x20, 0x66, 0x69, 0x6c, 0x65, 0x20, 0x3d, 0x20, 0x74, 0x6f, 0x6b, 0x2e, 0x66, 0x69, 0x6c, 
+	0x65, 0x2c, 0x20, 0x6c, 0x69, 0x6e, 0x65, 0x20, 0x3d, 0x20, 0x6c, 0x69, 0x6e, 0x65, 0x7d, 0xa, 
+	0x65, 0x6e, 0x64, 0xa, 0xa, 0x66, 0x75, 0x6e, 0x63, 0x74, 0x69, 0x6f, 0x6e, 0x20, 0x72, 0x65, 
+	0x61, 0x64, 0x5f, 0x65, 0x78, 0x70, 0x72, 0x65, 0x73, 0x73, 0x69, 0x6f, 0x6e, 0x28, 0x73, 0x74, 
+	0x72, 0x65, 0x61, 0x6d, 0x2c, 0x20, 0x72, 0x65, 0x61, 0x64, 0x5f, 0x6f, 0x70, 0x29, 0xa, 0x20, 
+	0x20, 0x20, 0x20, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x20, 0x72, 0x65, 0x74, 0xa, 0x20, 0x20, 0x20, 
+	0x20, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x20, 0x74, 0x6f, 0x6b, 0x20, 0x3d, 0x20, 0x6e, 0x65, 0x78, 
+	0x74, 0x5f, 0x74, 0x6f, 0x6b, 0x65, 0x6e, 0x28, 0x73, 0x74, 0x72, 0x65, 0x61, 0x6d, 0x29, 0xa, 
+	0xa, 0x20, 0x20, 0x20, 0x20, 0x69, 0x66, 0x20, 0x72, 0x65, 0x61, 0x64, 0x5f, 0x6f, 0x70, 0x20, 
+	0x3d, 0x3d, 0x20, 0x6e, 0x69, 0x6c, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x20, 0x20, 0x20, 0x20, 
+	0x20, 0x20, 0x20, 0x20, 0x72, 0x65, 0x61, 0x64, 0x5f, 0x6f, 0x70, 0x20, 0x3d, 0x20, 0x74, 0x72, 
+	0x75, 0x65, 0xa, 0x20, 0x20, 0x20, 0x20, 0x65, 0x6e, 0x64, 0xa, 0xa, 0x20, 0x20, 0x20, 0x20, 
+	0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x20, 0x66, 0x75, 0x6e, 0x63, 0x74, 0x69, 0x6f, 0x6e, 0x20, 0x66, 
+	0x6c, 0x69, 0x70, 0x28, 0x65, 0x78, 0x70, 0x72, 0x2c, 0x20, 0x72, 0x65, 0x74, 0x29, 0xa, 0x20, 
+	0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x69, 0x66, 0x20, 0x65, 0x78, 0x70, 0x72, 0x2e, 0x74, 
+	0x79, 0x70, 0x65, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x6f, 0x70, 0x65, 0x72, 0x61, 0x74, 0x6f, 0x72, 
+	0x27, 0x20, 0x61, 0x6e, 0x64, 0x20, 0x65, 0x78, 0x70, 0x72, 0x2e, 0x6f, 0x70, 0x65, 0x72, 0x61, 
+	0x74, 0x6f, 0x72, 0x20, 0x7e, 0x3d, 0x20, 0x27, 0x2e, 0x27, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 
+	0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x6c, 0x6f, 0x63, 0x61, 
+	0x6c, 0x20, 0x6c, 0x65, 0x66, 0x74, 0x20, 0x3d, 0x20, 0x65, 0x78, 0x70, 0x72, 0x2e, 0x6c, 0x65, 
+	0x66, 0x74, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x72, 
+	0x65, 0x74, 0x2e, 0x61, 0x72, 0x67, 0x2e, 0x6c, 0x65, 0x66, 0x74, 0x20, 0x3d, 0x20, 0x72, 0x65, 
+	0x74, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x72, 0x65, 
+	0x74, 0x2e, 0x61, 0x72, 0x67, 0x20, 0x3d, 0x20, 0x6c, 0x65, 0x66, 0x74, 0xa, 0x20, 0x20, 0x20, 
+	0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x72, 0x65, 0x74, 0x20, 0x3d, 0x20, 0x65, 
+	0x78, 0x70, 0x72, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x65, 0x6e, 0x64, 0xa, 
+	0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x72, 0x65, 0x74, 0x75, 0x72, 0x6e, 0x20, 0x72, 
+	0x65, 0x74, 0xa, 0x20, 0x20, 0x20, 0x20, 0x65, 0x6e, 0x64, 0xa, 0xa, 0x20, 0x20, 0x20, 0x20, 
+	0x69, 0x66, 0x20, 0x6e, 0x6f, 0x74, 0x20, 0x74, 0x6f, 0x6b, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 
+	0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x72, 0x65, 0x74, 0x75, 0x72, 0x6e, 0xa, 0x20, 
+	0x20, 0x20, 0x20, 0x65, 0x6e, 0x64, 0xa, 0xa, 0x20, 0x20, 0x20, 0x20, 0x6c, 0x6f, 0x63, 0x61, 
+	0x6c, 0x20, 0x76, 0x74, 0x79, 0x70, 0x65, 0x20, 0x3d, 0x20, 0x74, 0x79, 0x70, 0x65, 0x28, 0x74, 
+	0x6f, 0x6b, 0x2e, 0x76, 0x61, 0x6c, 0x75, 0x65, 0x29, 0xa, 0x20, 0x20, 0x20, 0x20, 0x69, 0x66, 
+	0x20, 0x76, 0x74, 0x79, 0x70, 0x65, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x62, 0x6f, 0x6f, 0x6c, 0x65, 
+	0x61, 0x6e, 0x27, 0x20, 0x6f, 0x72, 0x20, 0x76, 0x74, 0x79, 0x70, 0x65, 0x20, 0x3d, 0x3d, 0x20, 
+	0x27, 0x6e, 0x75, 0x6d, 0x62, 0x65, 0x72, 0x27, 0x20, 0x6f, 0x72, 0x20, 0x76, 0x74, 0x79, 0x70, 
+	0x65, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x73, 0x74, 0x72, 0x69, 0x6e, 0x67, 0x27, 0x20, 0x74, 0x68, 
+	0x65, 0x6e, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x72, 0x65, 0x74, 0x20, 0x3d, 
+	0x20, 0x7b, 0x74, 0x79, 0x70, 0x65, 0x20, 0x3d, 0x20, 0x76, 0x74, 0x79, 0x70, 0x65, 0x2c, 0x20, 
+	0x76, 0x61, 0x6c, 0x75, 0x65, 0x20, 0x3d, 0x20, 0x74, 0x6f, 0x6b, 0x2e, 0x76, 0x61, 0x6c, 0x75, 
+	0x65, 0x2c, 0x20, 0x66, 0x69, 0x6c, 0x65, 0x20, 0x3d, 0x20, 0x74, 0x6f, 0x6b, 0x2e, 0x66, 0x69, 
+	0x6c, 0x65, 0x2c, 0x20, 0x6c, 0x69, 0x6e, 0x65, 0x20, 0x3d, 0x20, 0x74, 0x6f, 0x6b, 0x2e, 0x6c, 
+	0x69, 0x6e, 0x65, 0x7d, 0xa, 0x20, 0x20, 0x20, 0x20, 0x65, 0x6c, 0x73, 0x65, 0x69, 0x66, 0x20, 
+	0x76, 0x74, 0x79, 0x70, 0x65, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x74, 0x61, 0x62, 0x6c, 0x65, 0x27, 
+	0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x69, 0x66, 
+	0x20, 0x74, 0x6f, 0x6b, 0x2e, 0x69, 0x73, 0x5f, 0x6b, 0x65, 0x79, 0x20, 0x74, 0x68, 0x65, 0x6e, 
+	0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x6c, 0x6f, 0x63, 
+	0x61, 0x6c, 0x20, 0x76, 0x20, 0x3d, 0x20, 0x74, 0x6f, 0x6b, 0x2e, 0x76, 0x61, 0x6c, 0x75, 0x65, 
+	0x5b, 0x31, 0x5d, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
+	0x69, 0x66, 0x20, 0x76, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x64, 0x6f, 0x27, 0x20, 0x74, 0x68, 0x65, 
+	0x6e, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
+	0x20, 0x20, 0x72, 0x65, 0x74, 0x20, 0x3d, 0x20, 0x72, 0x65, 0x61, 0x64, 0x5f, 0x62, 0x6c, 0x6f, 
+	0x63, 0x6b, 0x28, 0x73, 0x74, 0x72, 0x65, 0x61, 0x6d, 0x29, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 
+	0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x65, 0x6c, 0x73, 0x65, 0x69, 0x66, 0x20, 0x76, 0x20, 
+	0x3d, 0x3d, 0x20, 0x27, 0x69, 0x66, 0x27, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x20, 0x20, 0x20, 
 	0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x72, 0x65, 0x74, 
-	0x20, 0x3d, 0x20, 0x72, 0x65, 0x61, 0x64, 0x5f, 0x63, 0x69, 0x6e, 0x63, 0x6c, 0x75, 0x64, 0x65, 
-	0x28, 0x73, 0x74, 0x72, 0x65, 0x61, 0x6d, 0x29, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
-	0x20, 0x20, 0x20, 0x20, 0x20, 0x65, 0x6c, 0x73, 0x65, 0x69, 0x66, 0x20, 0x76, 0x20, 0x3d, 0x3d, 
-	0x20, 0x27, 0x66, 0x6f, 0x72, 0x27, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x20, 0x20, 0x20, 0x20, 
-	0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x72, 0x65, 0x74, 0x20, 
-	0x3d, 0x20, 0x72, 0x65, 0x61, 0x64, 0x5f, 0x66, 0x6f, 0x72, 0x28, 0x73, 0x74, 0x72, 0x65, 0x61, 
-	0x6d, 0x29, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x65, 
-	0x6c, 0x73, 0x65, 0x69, 0x66, 0x20, 0x76, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x69, 0x6e, 0x63, 0x6c, 
-	0x75, 0x64, 0x65, 0x27, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
-	0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x72, 0x65, 0x74, 0x20, 0x3d, 0x20, 
-	0x72, 0x65, 0x61, 0x64, 0x5f, 0x69, 0x6e, 0x63, 0x6c, 0x75, 0x64, 0x65, 0x28, 0x73, 0x74, 0x72, 
+	0x20, 0x3d, 0x20, 0x72, 0x65, 0x61, 0x64, 0x5f, 0x63, 0x6f, 0x6e, 0x64, 0x28, 0x73, 0x74, 0x72, 
 	0x65, 0x61, 0x6d, 0x29, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
-	0x20, 0x65, 0x6c, 0x73, 0x65, 0x69, 0x66, 0x20, 0x76, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x6d, 0x61, 
-	0x63, 0x72, 0x6f, 0x27, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
-	0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x70, 0x61, 0x72, 0x73, 0x65, 0x72, 
-	0x5f, 0x65, 0x72, 0x72, 0x6f, 0x72, 0x28, 0x73, 0x74, 0x72, 0x65, 0x61, 0x6d, 0x2c, 0x20, 0x27, 
-	0x6d, 0x61, 0x63, 0x72, 0x6f, 0x73, 0x20, 0x61, 0x72, 0x65, 0x20, 0x6e, 0x6f, 0x74, 0x20, 0x69, 
-	0x6d, 0x70, 0x6c, 0x65, 0x6d, 0x65, 0x6e, 0x74, 0x65, 0x64, 0x27, 0x29, 0xa, 0x20, 0x20, 0x20, 
-	0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x65, 0x6c, 0x73, 0x65, 0xa, 0x20, 0x20, 
-	0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x70, 0x61, 
-	0x72, 0x73, 0x65, 0x72, 0x5f, 0x65, 0x72, 0x72, 0x6f, 0x72, 0x28, 0x73, 0x74, 0x72, 0x65, 0x61, 
-	0x6d, 0x2c, 0x20, 0x27, 0x69, 0x6e, 0x76, 0x61, 0x6c, 0x69, 0x64, 0x20, 0x75, 0x73, 0x65, 0x20, 
-	0x6f, 0x66, 0x20, 0x6b, 0x65, 0x79, 0x77, 0x6f, 0x72, 0x64, 0x3a, 0x20, 0x27, 0x20, 0x2e, 0x2e, 
-	0x20, 0x74, 0x6f, 0x6b, 0x2e, 0x76, 0x61, 0x6c, 0x75, 0x65, 0x5b, 0x31, 0x5d, 0x29, 0xa, 0x20, 
-	0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x65, 0x6e, 0x64, 0xa, 0x20, 
-	0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x65, 0x6c, 0x73, 0x65, 0xa, 0x20, 0x20, 0x20, 0x20, 
-	0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x20, 0x74, 0x6d, 
-	0x70, 0x20, 0x3d, 0x20, 0x6e, 0x65, 0x78, 0x74, 0x5f, 0x74, 0x6f, 0x6b, 0x65, 0x6e, 0x28, 0x73, 
+	0x20, 0x65, 0x6c, 0x73, 0x65, 0x69, 0x66, 0x20, 0x76, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x64, 0x65, 
+	0x66, 0x27, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
+	0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x72, 0x65, 0x74, 0x20, 0x3d, 0x20, 0x72, 0x65, 
+	0x61, 0x64, 0x5f, 0x64, 0x65, 0x66, 0x28, 0x73, 0x74, 0x72, 0x65, 0x61, 0x6d, 0x29, 0xa, 0x20, 
+	0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x65, 0x6c, 0x73, 0x65, 0x69, 
+	0x66, 0x20, 0x76, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x63, 0x66, 0x75, 0x6e, 0x27, 0x20, 0x74, 0x68, 
+	0x65, 0x6e, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
+	0x20, 0x20, 0x20, 0x72, 0x65, 0x74, 0x20, 0x3d, 0x20, 0x72, 0x65, 0x61, 0x64, 0x5f, 0x63, 0x66, 
+	0x75, 0x6e, 0x28, 0x73, 0x74, 0x72, 0x65, 0x61, 0x6d, 0x29, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 
+	0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x65, 0x6c, 0x73, 0x65, 0x69, 0x66, 0x20, 0x76, 0x20, 
+	0x3d, 0x3d, 0x20, 0x27, 0x63, 0x64, 0x65, 0x63, 0x27, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x20, 
+	0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x72, 
+	0x65, 0x74, 0x20, 0x3d, 0x20, 0x72, 0x65, 0x61, 0x64, 0x5f, 0x63, 0x64, 0x65, 0x63, 0x28, 0x73, 
 	0x74, 0x72, 0x65, 0x61, 0x6d, 0x29, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
-	0x20, 0x20, 0x20, 0x69, 0x66, 0x20, 0x74, 0x6d, 0x70, 0x20, 0x61, 0x6e, 0x64, 0x20, 0x74, 0x6d, 
-	0x70, 0x2e, 0x74, 0x6f, 0x6b, 0x65, 0x6e, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x2d, 0x3e, 0x27, 0x20, 
-	0x74, 0x68, 0x65, 0x6e, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
-	0x20, 0x20, 0x20, 0x20, 0x20, 0x72, 0x65, 0x76, 0x65, 0x72, 0x74, 0x5f, 0x74, 0x6f, 0x6b, 0x65, 
-	0x6e, 0x28, 0x73, 0x74, 0x72, 0x65, 0x61, 0x6d, 0x2c, 0x20, 0x74, 0x6f, 0x6b, 0x29, 0xa, 0x20, 
+	0x20, 0x20, 0x20, 0x65, 0x6c, 0x73, 0x65, 0x69, 0x66, 0x20, 0x76, 0x20, 0x3d, 0x3d, 0x20, 0x27, 
+	0x63, 0x69, 0x6e, 0x63, 0x6c, 0x75, 0x64, 0x65, 0x27, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x20, 
 	0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x72, 
-	0x65, 0x76, 0x65, 0x72, 0x74, 0x5f, 0x74, 0x6f, 0x6b, 0x65, 0x6e, 0x28, 0x73, 0x74, 0x72, 0x65, 
-	0x61, 0x6d, 0x2c, 0x20, 0x74, 0x6d, 0x70, 0x29, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
-	0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x72, 0x65, 0x74, 0x20, 0x3d, 0x20, 0x72, 
-	0x65, 0x61, 0x64, 0x5f, 0x6c, 0x61, 0x6d, 0x62, 0x64, 0x61, 0x28, 0x73, 0x74, 0x72, 0x65, 0x61, 
-	0x6d, 0x2c, 0x20, 0x74, 0x72, 0x75, 0x65, 0x29, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
-	0x20, 0x20, 0x20, 0x20, 0x20, 0x65, 0x6c, 0x73, 0x65, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
-	0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x72, 0x65, 0x76, 0x65, 0x72, 0x74, 
-	0x5f, 0x74, 0x6f, 0x6b, 0x65, 0x6e, 0x28, 0x73, 0x74, 0x72, 0x65, 0x61, 0x6d, 0x2c, 0x20, 0x74, 
-	0x6d, 0x70, 0x29, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
-	0x20, 0x20, 0x20, 0x20, 0x72, 0x65, 0x74, 0x20, 0x3d, 0x20, 0x74, 0x6f, 0x6b, 0x65, 0x6e, 0x5f, 
-	0x74, 0x6f, 0x5f, 0x69, 0x64, 0x65, 0x6e, 0x74, 0x69, 0x66, 0x69, 0x65, 0x72, 0x28, 0x74, 0x6f, 
-	0x6b, 0x29, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
-	0x20, 0x20, 0x20, 0x69, 0x66, 0x20, 0x74, 0x6f, 0x6b, 0x2e, 0x69, 0x73, 0x5f, 0x63, 0x61, 0x6c, 
-	0x6c, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
+	0x65, 0x74, 0x20, 0x3d, 0x20, 0x72, 0x65, 0x61, 0x64, 0x5f, 0x63, 0x69, 0x6e, 0x63, 0x6c, 0x75, 
+	0x64, 0x65, 0x28, 0x73, 0x74, 0x72, 0x65, 0x61, 0x6d, 0x29, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 
+	0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x65, 0x6c, 0x73, 0x65, 0x69, 0x66, 0x20, 0x76, 0x20, 
+	0x3d, 0x3d, 0x20, 0x27, 0x66, 0x6f, 0x72, 0x27, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x20, 0x20, 
+	0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x72, 0x65, 
+	0x74, 0x20, 0x3d, 0x20, 0x72, 0x65, 0x61, 0x64, 0x5f, 0x66, 0x6f, 0x72, 0x28, 0x73, 0x74, 0x72, 
+	0x65, 0x61, 0x6d, 0x29, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
+	0x20, 0x65, 0x6c, 0x73, 0x65, 0x69, 0x66, 0x20, 0x76, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x69, 0x6e, 
+	0x63, 0x6c, 0x75, 0x64, 0x65, 0x27, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x20, 0x20, 0x20, 0x20, 
+	0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x72, 0x65, 0x74, 0x20, 
+	0x3d, 0x20, 0x72, 0x65, 0x61, 0x64, 0x5f, 0x69, 0x6e, 0x63, 0x6c, 0x75, 0x64, 0x65, 0x28, 0x73, 
+	0x74, 0x72, 0x65, 0x61, 0x6d, 0x29, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
+	0x20, 0x20, 0x20, 0x65, 0x6c, 0x73, 0x65, 0x69, 0x66, 0x20, 0x76, 0x20, 0x3d, 0x3d, 0x20, 0x27, 
+	0x6d, 0x61, 0x63, 0x72, 0x6f, 0x27, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x20, 0x20, 0x20, 0x20, 
+	0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x70, 0x61, 0x72, 0x73, 
+	0x65, 0x72, 0x5f, 0x65, 0x72, 0x72, 0x6f, 0x72, 0x28, 0x73, 0x74, 0x72, 0x65, 0x61, 0x6d, 0x2c, 
+	0x20, 0x27, 0x6d, 0x61, 0x63, 0x72, 0x6f, 0x73, 0x20, 0x61, 0x72, 0x65, 0x20, 0x6e, 0x6f, 0x74, 
+	0x20, 0x69, 0x6d, 0x70, 0x6c, 0x65, 0x6d, 0x65, 0x6e, 0x74, 0x65, 0x64, 0x27, 0x29, 0xa, 0x20, 
+	0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x65, 0x6c, 0x73, 0x65, 0xa, 
+	0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
+	0x70, 0x61, 0x72, 0x73, 0x65, 0x72, 0x5f, 0x65, 0x72, 0x72, 0x6f, 0x72, 0x28, 0x73, 0x74, 0x72, 
+	0x65, 0x61, 0x6d, 0x2c, 0x20, 0x27, 0x69, 0x6e, 0x76, 0x61, 0x6c, 0x69, 0x64, 0x20, 0x75, 0x73, 
+	0x65, 0x20, 0x6f, 0x66, 0x20, 0x6b, 0x65, 0x79, 0x77, 0x6f, 0x72, 0x64, 0x3a, 0x20, 0x27, 0x20, 
+	0x2e, 0x2e, 0x20, 0x74, 0x6f, 0x6b, 0x2e, 0x76, 0x61, 0x6c, 0x75, 0x65, 0x5b, 0x31, 0x5d, 0x29, 
+	0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x65, 0x6e, 0x64, 
+	0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x65, 0x6c, 0x73, 0x65, 0xa, 0x20, 0x20, 
+	0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x20, 
+	0x74, 0x6d, 0x70, 0x20, 0x3d, 0x20, 0x6e, 0x65, 0x78, 0x74, 0x5f, 0x74, 0x6f, 0x6b, 0x65, 0x6e, 
+	0x28, 0x73, 0x74, 0x72, 0x65, 0x61, 0x6d, 0x29, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
+	0x20, 0x20, 0x20, 0x20, 0x20, 0x69, 0x66, 0x20, 0x74, 0x6d, 0x70, 0x20, 0x61, 0x6e, 0x64, 0x20, 
+	0x74, 0x6d, 0x70, 0x2e, 0x74, 0x6f, 0x6b, 0x65, 0x6e, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x2d, 0x3e, 
+	0x27, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
+	0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x72, 0x65, 0x76, 0x65, 0x72, 0x74, 0x5f, 0x74, 0x6f, 
+	0x6b, 0x65, 0x6e, 0x28, 0x73, 0x74, 0x72, 0x65, 0x61, 0x6d, 0x2c, 0x20, 0x74, 0x6f, 0x6b, 0x29, 
+	0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
+	0x20, 0x72, 0x65, 0x76, 0x65, 0x72, 0x74, 0x5f, 0x74, 0x6f, 0x6b, 0x65, 0x6e, 0x28, 0x73, 0x74, 
+	0x72, 0x65, 0x61, 0x6d, 0x2c, 0x20, 0x74, 0x6d, 0x70, 0x29, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 
 	0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x72, 0x65, 0x74, 0x20, 0x3d, 
-	0x20, 0x72, 0x65, 0x61, 0x64, 0x5f, 0x63, 0x61, 0x6c, 0x6c, 0x28, 0x73, 0x74, 0x72, 0x65, 0x61, 
-	0x6d, 0x2c, 0x20, 0x72, 0x65, 0x74, 0x29, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
-	0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x65, 0x6e, 0x64, 0xa, 0x20, 0x20, 0x20, 0x20, 
-	0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x65, 0x6e, 0x64, 0xa, 0x20, 0x20, 0x20, 0x20, 
-	0x20, 0x20, 0x20, 0x20, 0x65, 0x6e, 0x64, 0xa, 0x20, 0x20, 0x20, 0x20, 0x65, 0x6c, 0x73, 0x65, 
-	0x69, 0x66, 0x20, 0x74, 0x6f, 0x6b, 0x2e, 0x74, 0x6f, 0x6b, 0x65, 0x6e, 0x20, 0x3d, 0x3d, 0x20, 
-	0x27, 0x7e, 0x27, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
-	0x20, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x20, 0x65, 0x78, 0x70, 0x72, 0x20, 0x3d, 0x20, 0x72, 0x65, 
-	0x61, 0x64, 0x5f, 0x65, 0x78, 0x70, 0x72, 0x65, 0x73, 0x73, 0x69, 0x6f, 0x6e, 0x28, 0x73, 0x74, 
-	0x72, 0x65, 0x61, 0x6d, 0x29, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x69, 0x66, 
-	0x20, 0x6e, 0x6f, 0x74, 0x20, 0x65, 0x78, 0x70, 0x72, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x20, 
-	0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x70, 0x61, 0x72, 0x73, 0x65, 
-	0x72, 0x5f, 0x65, 0x72, 0x72, 0x6f, 0x72, 0x28, 0x73, 0x74, 0x72, 0x65, 0x61, 0x6d, 0x2c, 0x20, 
-	0x27, 0x65, 0x78, 0x70, 0x65, 0x63, 0x74, 0x65, 0x64, 0x20, 0x65, 0x78, 0x70, 0x72, 0x65, 0x73, 
-	0x73, 0x69, 0x6f, 0x6e, 0x27, 0x29, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x65, 
-	0x6e, 0x64, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x72, 0x65, 0x74, 0x20, 0x3d, 
-	0x20, 0x7b, 0x74, 0x79, 0x70, 0x65, 0x20, 0x3d, 0x20, 0x27, 0x6e, 0x6f, 0x74, 0x27, 0x2c, 0x20, 
-	0x61, 0x72, 0x67, 0x20, 0x3d, 0x20, 0x65, 0x78, 0x70, 0x72, 0x2c, 0x20, 0x66, 0x69, 0x6c, 0x65, 
-	0x20, 0x3d, 0x20, 0x74, 0x6f, 0x6b, 0x2e, 0x66, 0x69, 0x6c, 0x65, 0x2c, 0x20, 0x6c, 0x69, 0x6e, 
-	0x65, 0x20, 0x3d, 0x20, 0x74, 0x6f, 0x6b, 0x2e, 0x6c, 0x69, 0x6e, 0x65, 0x7d, 0xa, 0x20, 0x20, 
-	0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x72, 0x65, 0x74, 0x20, 0x3d, 0x20, 0x66, 0x6c, 0x69, 0x70, 
-	0x28, 0x65, 0x78, 0x70, 0x72, 0x2c, 0x20, 0x72, 0x65, 0x74, 0x29, 0xa, 0x20, 0x20, 0x20, 0x20, 
-	0x65, 0x6c, 0x73, 0x65, 0x69, 0x66, 0x20, 0x74, 0x6f, 0x6b, 0x2e, 0x74, 0x6f, 0x6b, 0x65, 0x6e, 
-	0x20, 0x3d, 0x3d, 0x20, 0x27, 0x2d, 0x27, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x20, 0x20, 0x20, 
-	0x20, 0x20, 0x20, 0x20, 0x20, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x20, 0x65, 0x78, 0x70, 0x72, 0x20, 
-	0x3d, 0x20, 0x72, 0x65, 0x61, 0x64, 0x5f, 0x65, 0x78, 0x70, 0x72, 0x65, 0x73, 0x73, 0x69, 0x6f, 
-	0x6e, 0x28, 0x73, 0x74, 0x72, 0x65, 0x61, 0x6d, 0x29, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
-	0x20, 0x20, 0x69, 0x66, 0x20, 0x6e, 0x6f, 0x74, 0x20, 0x65, 0x78, 0x70, 0x72, 0x20, 0x74, 0x68, 
-	0x65, 0x6e, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x70, 
-	0x61, 0x72, 0x73, 0x65, 0x72, 0x5f, 0x65, 0x72, 0x72, 0x6f, 0x72, 0x28, 0x73, 0x74, 0x72, 0x65, 
-	0x61, 0x6d, 0x2c, 0x20, 0x27, 0x65, 0x78, 0x70, 0x65, 0x63, 0x74, 0x65, 0x64, 0x20, 0x65, 0x78, 
-	0x70, 0x72, 0x65, 0x73, 0x73, 0x69, 0x6f, 0x6e, 0x27, 0x29, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 
-	0x20, 0x20, 0x20, 0x65, 0x6e, 0x64, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x72, 
-	0x65, 0x74, 0x20, 0x3d, 0x20, 0x7b, 0x74, 0x79, 0x70, 0x65, 0x20, 0x3d, 0x20, 0x27, 0x75, 0x6e, 
-	0x6d, 0x27, 0x2c, 0x20, 0x61, 0x72, 0x67, 0x20, 0x3d, 0x20, 0x65, 0x78, 0x70, 0x72, 0x2c, 0x20, 
-	0x66, 0x69, 0x6c, 0x65, 0x20, 0x3d, 0x20, 0x74, 0x6f, 0x6b, 0x2e, 0x66, 0x69, 0x6c, 0x65, 0x2c, 
-	0x20, 0x6c, 0x69, 0x6e, 0x65, 0x20, 0x3d, 0x20, 0x74, 0x6f, 0x6b, 0x2e, 0x6c, 0x69, 0x6e, 0x65, 
-	0x7d, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x72, 0x65, 0x74, 0x20, 0x3d, 0x20, 
-	0x66, 0x6c, 0x69, 0x70, 0x28, 0x65, 0x78, 0x70, 0x72, 0x2c, 0x20, 0x72, 0x65, 0x74, 0x29, 0xa, 
-	0x20, 0x20, 0x20, 0x20, 0x65, 0x6c, 0x73, 0x65, 0x69, 0x66, 0x20, 0x74, 0x6f, 0x6b, 0x2e, 0x74, 
-	0x6f, 0x6b, 0x65, 0x6e, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x40, 0x27, 0x20, 0x74, 0x68, 0x65, 0x6e, 
-	0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x20, 0x65, 
-	0x78, 0x70, 0x72, 0x20, 0x3d, 0x20, 0x72, 0x65, 0x61, 0x64, 0x5f, 0x65, 0x78, 0x70, 0x72, 0x65, 
-	0x73, 0x73, 0x69, 0x6f, 0x6e, 0x28, 0x73, 0x74, 0x72, 0x65, 0x61, 0x6d, 0x29, 0xa, 0x20, 0x20, 
-	0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x69, 0x66, 0x20, 0x6e, 0x6f, 0x74, 0x20, 0x65, 0x78, 0x70, 
-	0x72, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
-	0x20, 0x20, 0x20, 0x70, 0x61, 0x72, 0x73, 0x65, 0x72, 0x5f, 0x65, 0x72, 0x72, 0x6f, 0x72, 0x28, 
-	0x73, 0x74, 0x72, 0x65, 0x61, 0x6d, 0x2c, 0x20, 0x27, 0x65, 0x78, 0x70, 0x65, 0x63, 0x74, 0x65, 
-	0x64, 0x20, 0x65, 0x78, 0x70, 0x72, 0x65, 0x73, 0x73, 0x69, 0x6f, 0x6e, 0x27, 0x29, 0xa, 0x20, 
-	0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x65, 0x6e, 0x64, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 
-	0x20, 0x20, 0x20, 0x72, 0x65, 0x74, 0x20, 0x3d, 0x20, 0x7b, 0x74, 0x79, 0x70, 0x65, 0x20, 0x3d, 
-	0x20, 0x27, 0x75, 0x6e, 0x72, 0x65, 0x66, 0x27, 0x2c, 0x20, 0x61, 0x72, 0x67, 0x20, 0x3d, 0x20, 
-	0x65, 0x78, 0x70, 0x72, 0x2c, 0x20, 0x66, 0x69, 0x6c, 0x65, 0x20, 0x3d, 0x20, 0x74, 0x6f, 0x6b, 
-	0x2e, 0x66, 0x69, 0x6c, 0x65, 0x2c, 0x20, 0x6c, 0x69, 0x6e, 0x65, 0x20, 0x3d, 0x20, 0x74, 0x6f, 
-	0x6b, 0x2e, 0x6c, 0x69, 0x6e, 0x65, 0x7d, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
-	0x72, 0x65, 0x74, 0x20, 0x3d, 0x20, 0x66, 0x6c, 0x69, 0x70, 0x28, 0x65, 0x78, 0x70, 0x72, 0x2c, 
-	0x20, 0x72, 0x65, 0x74, 0x29, 0xa, 0x20, 0x20, 0x20, 0x20, 0x65, 0x6c, 0x73, 0x65, 0x69, 0x66, 
-	0x20, 0x74, 0x6f, 0x6b, 0x2e, 0x74, 0x6f, 0x6b, 0x65, 0x6e, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x7b, 
-	0x27, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x72, 
-	0x65, 0x74, 0x20, 0x3d, 0x20, 0x72, 0x65, 0x61, 0x64, 0x5f, 0x63, 0x6f, 0x6c, 0x6c, 0x65, 0x63, 
-	0x74, 0x69, 0x6f, 0x6e, 0x28, 0x73, 0x74, 0x72, 0x65, 0x61, 0x6d, 0x2c, 0x20, 0x27, 0x68, 0x61, 
-	0x73, 0x68, 0x6d, 0x61, 0x70, 0x27, 0x29, 0xa, 0x20, 0x20, 0x20, 0x20, 0x65, 0x6c, 0x73, 0x65, 
+	0x20, 0x72, 0x65, 0x61, 0x64, 0x5f, 0x6c, 0x61, 0x6d, 0x62, 0x64, 0x61, 0x28, 0x73, 0x74, 0x72, 
+	0x65, 0x61, 0x6d, 0x2c, 0x20, 0x74, 0x72, 0x75, 0x65, 0x29, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 
+	0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x65, 0x6c, 0x73, 0x65, 0xa, 0x20, 0x20, 0x20, 0x20, 
+	0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x72, 0x65, 0x76, 0x65, 
+	0x72, 0x74, 0x5f, 0x74, 0x6f, 0x6b, 0x65, 0x6e, 0x28, 0x73, 0x74, 0x72, 0x65, 0x61, 0x6d, 0x2c, 
+	0x20, 0x74, 0x6d, 0x70, 0x29, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
+	0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x72, 0x65, 0x74, 0x20, 0x3d, 0x20, 0x74, 0x6f, 0x6b, 0x65, 
+	0x6e, 0x5f, 0x74, 0x6f, 0x5f, 0x69, 0x64, 0x65, 0x6e, 0x74, 0x69, 0x66, 0x69, 0x65, 0x72, 0x28, 
+	0x74, 0x6f, 0x6b, 0x29, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
+	0x20, 0x20, 0x20, 0x20, 0x20, 0x69, 0x66, 0x20, 0x74, 0x6f, 0x6b, 0x2e, 0x69, 0x73, 0x5f, 0x63, 
+	0x61, 0x6c, 0x6c, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
+	0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x72, 0x65, 0x74, 
+	0x20, 0x3d, 0x20, 0x72, 0x65, 0x61, 0x64, 0x5f, 0x63, 0x61, 0x6c, 0x6c, 0x28, 0x73, 0x74, 0x72, 
+	0x65, 0x61, 0x6d, 0x2c, 0x20, 0x72, 0x65, 0x74, 0x29, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
+	0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x65, 0x6e, 0x64, 0xa, 0x20, 0x20, 
+	0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x65, 0x6e, 0x64, 0xa, 0x20, 0x20, 
+	0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x65, 0x6e, 0x64, 0xa, 0x20, 0x20, 0x20, 0x20, 0x65, 0x6c, 
+	0x73, 0x65, 0x69, 0x66, 0x20, 0x74, 0x6f, 0x6b, 0x2e, 0x74, 0x6f, 0x6b, 0x65, 0x6e, 0x20, 0x3d, 
+	0x3d, 0x20, 0x27, 0x7e, 0x27, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 
+	0x20, 0x20, 0x20, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x20, 0x65, 0x78, 0x70, 0x72, 0x20, 0x3d, 0x20, 
+	0x72, 0x65, 0x61, 0x64, 0x5f, 0x65, 0x78, 0x70, 0x72, 0x65, 0x73, 0x73, 0x69, 0x6f, 0x6e, 0x28, 
+	0x73, 0x74, 0x72, 0x65, 0x61, 0x6d, 0x29, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
+	0x69, 0x66, 0x20, 0x6e, 0x6f, 0x74, 0x20, 0x65, 0x78, 0x70, 0x72, 0x20, 0x74, 0x68, 0x65, 0x6e, 
+	0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x70, 0x61, 0x72, 
+	0x73, 0x65, 0x72, 0x5f, 0x65, 0x72, 0x72, 0x6f, 0x72, 0x28, 0x73, 0x74, 0x72, 0x65, 0x61, 0x6d, 
+	0x2c, 0x20, 0x27, 0x65, 0x78, 0x70, 0x65, 0x63, 0x74, 0x65, 0x64, 0x20, 0x65, 0x78, 0x70, 0x72, 
+	0x65, 0x73, 0x73, 0x69, 0x6f, 0x6e, 0x27, 0x29, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
+	0x20, 0x65, 0x6e, 0x64, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x72, 0x65, 0x74, 
+	0x20, 0x3d, 0x20, 0x7b, 0x74, 0x79, 0x70, 0x65, 0x20, 0x3d, 0x20, 0x27, 0x6e, 0x6f, 0x74, 0x27, 
+	0x2c, 0x20, 0x61, 0x72, 0x67, 0x20, 0x3d, 0x20, 0x65, 0x78, 0x70, 0x72, 0x2c, 0x20, 0x66, 0x69, 
+	0x6c, 0x65, 0x20, 0x3d, 0x20, 0x74, 0x6f, 0x6b, 0x2e, 0x66, 0x69, 0x6c, 0x65, 0x2c, 0x20, 0x6c, 
+	0x69, 0x6e, 0x65, 0x20, 0x3d, 0x20, 0x74, 0x6f, 0x6b, 0x2e, 0x6c, 0x69, 0x6e, 0x65, 0x7d, 0xa, 
+	0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x72, 0x65, 0x74, 0x20, 0x3d, 0x20, 0x66, 0x6c, 
+	0x69, 0x70, 0x28, 0x65, 0x78, 0x70, 0x72, 0x2c, 0x20, 0x72, 0x65, 0x74, 0x29, 0xa, 0x20, 0x20, 
+	0x20, 0x20, 0x65, 0x6c, 0x73, 0x65, 0x69, 0x66, 0x20, 0x74, 0x6f, 0x6b, 0x2e, 0x74, 0x6f, 0x6b, 
+	0x65, 0x6e, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x2d, 0x27, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x20, 
+	0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x20, 0x65, 0x78, 0x70, 
+	0x72, 0x20, 0x3d, 0x20, 0x72, 0x65, 0x61, 0x64, 0x5f, 0x65, 0x78, 0x70, 0x72, 0x65, 0x73, 0x73, 
+	0x69, 0x6f, 0x6e, 0x28, 0x73, 0x74, 0x72, 0x65, 0x61, 0x6d, 0x29, 0xa, 0x20, 0x20, 0x20, 0x20, 
+	0x20, 0x20, 0x20, 0x20, 0x69, 0x66, 0x20, 0x6e, 0x6f, 0x74, 0x20, 0x65, 0x78, 0x70, 0x72, 0x20, 
+	0x74, 0x68, 0x65, 0x6e, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
+	0x20, 0x70, 0x61, 0x72, 0x73, 0x65, 0x72, 0x5f, 0x65, 0x72, 0x72, 0x6f, 0x72, 0x28, 0x73, 0x74, 
+	0x72, 0x65, 0x61, 0x6d, 0x2c, 0x20, 0x27, 0x65, 0x78, 0x70, 0x65, 0x63, 0x74, 0x65, 0x64, 0x20, 
+	0x65, 0x78, 0x70, 0x72, 0x65, 0x73, 0x73, 0x69, 0x6f, 0x6e, 0x27, 0x29, 0xa, 0x20, 0x20, 0x20, 
+	0x20, 0x20, 0x20, 0x20, 0x20, 0x65, 0x6e, 0x64, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
+	0x20, 0x72, 0x65, 0x74, 0x20, 0x3d, 0x20, 0x7b, 0x74, 0x79, 0x70, 0x65, 0x20, 0x3d, 0x20, 0x27, 
+	0x75, 0x6e, 0x6d, 0x27, 0x2c, 0x20, 0x61, 0x72, 0x67, 0x20, 0x3d, 0x20, 0x65, 0x78, 0x70, 0x72, 
+	0x2c, 0x20, 0x66, 0x69, 0x6c, 0x65, 0x20, 0x3d, 0x20, 0x74, 0x6f, 0x6b, 0x2e, 0x66, 0x69, 0x6c, 
+	0x65, 0x2c, 0x20, 0x6c, 0x69, 0x6e, 0x65, 0x20, 0x3d, 0x20, 0x74, 0x6f, 0x6b, 0x2e, 0x6c, 0x69, 
+	0x6e, 0x65, 0x7d, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x72, 0x65, 0x74, 0x20, 
+	0x3d, 0x20, 0x66, 0x6c, 0x69, 0x70, 0x28, 0x65, 0x78, 0x70, 0x72, 0x2c, 0x20, 0x72, 0x65, 0x74, 
+	0x29, 0xa, 0x20, 0x20, 0x20, 0x20, 0x65, 0x6c, 0x73, 0x65, 0x69, 0x66, 0x20, 0x74, 0x6f, 0x6b, 
+	0x2e, 0x74, 0x6f, 0x6b, 0x65, 0x6e, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x40, 0x27, 0x20, 0x74, 0x68, 
+	0x65, 0x6e, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 
+	0x20, 0x65, 0x78, 0x70, 0x72, 0x20, 0x3d, 0x20, 0x72, 0x65, 0x61, 0x64, 0x5f, 0x65, 0x78, 0x70, 
+	0x72, 0x65, 0x73, 0x73, 0x69, 0x6f, 0x6e, 0x28, 0x73, 0x74, 0x72, 0x65, 0x61, 0x6d, 0x29, 0xa, 
+	0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x69, 0x66, 0x20, 0x6e, 0x6f, 0x74, 0x20, 0x65, 
+	0x78, 0x70, 0x72, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
+	0x20, 0x20, 0x20, 0x20, 0x20, 0x70, 0x61, 0x72, 0x73, 0x65, 0x72, 0x5f, 0x65, 0x72, 0x72, 0x6f, 
+	0x72, 0x28, 0x73, 0x74, 0x72, 0x65, 0x61, 0x6d, 0x2c, 0x20, 0x27, 0x65, 0x78, 0x70, 0x65, 0x63, 
+	0x74, 0x65, 0x64, 0x20, 0x65, 0x78, 0x70, 0x72, 0x65, 0x73, 0x73, 0x69, 0x6f, 0x6e, 0x27, 0x29, 
+	0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x65, 0x6e, 0x64, 0xa, 0x20, 0x20, 0x20, 
+	0x20, 0x20, 0x20, 0x20, 0x20, 0x72, 0x65, 0x74, 0x20, 0x3d, 0x20, 0x7b, 0x74, 0x79, 0x70, 0x65, 
+	0x20, 0x3d, 0x20, 0x27, 0x75, 0x6e, 0x72, 0x65, 0x66, 0x27, 0x2c, 0x20, 0x61, 0x72, 0x67, 0x20, 
+	0x3d, 0x20, 0x65, 0x78, 0x70, 0x72, 0x2c, 0x20, 0x66, 0x69, 0x6c, 0x65, 0x20, 0x3d, 0x20, 0x74, 
+	0x6f, 0x6b, 0x2e, 0x66, 0x69, 0x6c, 0x65, 0x2c, 0x20, 0x6c, 0x69, 0x6e, 0x65, 0x20, 0x3d, 0x20, 
+	0x74, 0x6f, 0x6b, 0x2e, 0x6c, 0x69, 0x6e, 0x65, 0x7d, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
+	0x20, 0x20, 0x72, 0x65, 0x74, 0x20, 0x3d, 0x20, 0x66, 0x6c, 0x69, 0x70, 0x28, 0x65, 0x78, 0x70, 
+	0x72, 0x2c, 0x20, 0x72, 0x65, 0x74, 0x29, 0xa, 0x20, 0x20, 0x20, 0x20, 0x65, 0x6c, 0x73, 0x65, 
 	0x69, 0x66, 0x20, 0x74, 0x6f, 0x6b, 0x2e, 0x74, 0x6f, 0x6b, 0x65, 0x6e, 0x20, 0x3d, 0x3d, 0x20, 
-	0x27, 0x5b, 0x27, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
+	0x27, 0x7b, 0x27, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
 	0x20, 0x72, 0x65, 0x74, 0x20, 0x3d, 0x20, 0x72, 0x65, 0x61, 0x64, 0x5f, 0x63, 0x6f, 0x6c, 0x6c, 
 	0x65, 0x63, 0x74, 0x69, 0x6f, 0x6e, 0x28, 0x73, 0x74, 0x72, 0x65, 0x61, 0x6d, 0x2c, 0x20, 0x27, 
-	0x76, 0x65, 0x63, 0x74, 0x6f, 0x72, 0x27, 0x29, 0xa, 0x20, 0x20, 0x20, 0x20, 0x65, 0x6c, 0x73, 
-	0x65, 0x69, 0x66, 0x20, 0x74, 0x6f, 0x6b, 0x2e, 0x74, 0x6f, 0x6b, 0x65, 0x6e, 0x20, 0x3d, 0x3d, 
-	0x20, 0x27, 0x28, 0x27, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
-	0x20, 0x20, 0x72, 0x65, 0x74, 0x20, 0x3d, 0x20, 0x72, 0x65, 0x61, 0x64, 0x5f, 0x6c, 0x61, 0x6d, 
-	0x62, 0x64, 0x61, 0x28, 0x73, 0x74, 0x72, 0x65, 0x61, 0x6d, 0x29, 0xa, 0x20, 0x20, 0x20, 0x20, 
-	0x20, 0x20, 0x20, 0x20, 0x69, 0x66, 0x20, 0x6e, 0x6f, 0x74, 0x20, 0x72, 0x65, 0x74, 0x20, 0x74, 
-	0x68, 0x65, 0x6e, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
-	0x72, 0x65, 0x74, 0x20, 0x3d, 0x20, 0x72, 0x65, 0x61, 0x64, 0x5f, 0x65, 0x78, 0x70, 0x72, 0x65, 
-	0x73, 0x73, 0x69, 0x6f, 0x6e, 0x28, 0x73, 0x74, 0x72, 0x65, 0x61, 0x6d, 0x29, 0xa, 0x20, 0x20, 
-	0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x20, 
-	0x74, 0x6f, 0x6b, 0x32, 0x20, 0x3d, 0x20, 0x6e, 0x65, 0x78, 0x74, 0x5f, 0x74, 0x6f, 0x6b, 0x65, 
-	0x6e, 0x28, 0x73, 0x74, 0x72, 0x65, 0x61, 0x6d, 0x29, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
-	0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x69, 0x66, 0x20, 0x6e, 0x6f, 0x74, 0x20, 0x74, 0x6f, 0x6b, 
-	0x32, 0x20, 0x6f, 0x72, 0x20, 0x28, 0x74, 0x6f, 0x6b, 0x32, 0x2e, 0x74, 0x6f, 0x6b, 0x65, 0x6e, 
-	0x20, 0x7e, 0x3d, 0x20, 0x27, 0x29, 0x27, 0x20, 0x61, 0x6e, 0x64, 0x20, 0x6e, 0x6f, 0x74, 0x20, 
-	0x69, 0x73, 0x5f, 0x63, 0x61, 0x6c, 0x6c, 0x5f, 0x70, 0x72, 0x65, 0x66, 0x69, 0x78, 0x28, 0x74, 
-	0x6f, 0x6b, 0x32, 0x2e, 0x74, 0x6f, 0x6b, 0x65, 0x6e, 0x29, 0x29, 0x20, 0x74, 0x68, 0x65, 0x6e, 
-	0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
-	0x20, 0x70, 0x61, 0x72, 0x73, 0x65, 0x72, 0x5f, 0x65, 0x72, 0x72, 0x6f, 0x72, 0x28, 0x73, 0x74, 
-	0x72, 0x65, 0x61, 0x6d, 0x2c, 0x20, 0x22, 0x65, 0x78, 0x70, 0x65, 0x63, 0x74, 0x65, 0x64, 0x20, 
-	0x27, 0x29, 0x27, 0x22, 0x29, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
-	0x20, 0x20, 0x65, 0x6e, 0x64, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
-	0x20, 0x20, 0x69, 0x66, 0x20, 0x74, 0x6f, 0x6b, 0x32, 0x2e, 0x69, 0x73, 0x5f, 0x63, 0x61, 0x6c, 
-	0x6c, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
-	0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x72, 0x65, 0x76, 0x65, 0x72, 0x74, 0x5f, 0x74, 0x6f, 
-	0x6b, 0x65, 0x6e, 0x28, 0x73, 0x74, 0x72, 0x65, 0x61, 0x6d, 0x2c, 0x20, 0x74, 0x6f, 0x6b, 0x32, 
-	0x29, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
-	0x20, 0x20, 0x72, 0x65, 0x74, 0x20, 0x3d, 0x20, 0x72, 0x65, 0x61, 0x64, 0x5f, 0x63, 0x61, 0x6c, 
-	0x6c, 0x28, 0x73, 0x74, 0x72, 0x65, 0x61, 0x6d, 0x2c, 0x20, 0x72, 0x65, 0x74, 0x29, 0xa, 0x20, 
-	0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x65, 0x6e, 0x64, 0xa, 0x20, 
-	0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x65, 0x6e, 0x64, 0xa, 0x20, 0x20, 0x20, 0x20, 0x65, 
-	0x6c, 0x73, 0x65, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x70, 0x61, 0x72, 0x73, 
-	0x65, 0x72, 0x5f, 0x65, 0x72, 0x72, 0x6f, 0x72, 0x28, 0x73, 0x74, 0x72, 0x65, 0x61, 0x6d, 0x2c, 
-	0x20, 0x22, 0x75, 0x6e, 0x65, 0x78, 0x70, 0x65, 0x63, 0x74, 0x65, 0x64, 0x20, 0x74, 0x6f, 0x6b, 
-	0x65, 0x6e, 0x20, 0x27, 0x25, 0x73, 0x27, 0x22, 0x2c, 0x20, 0x74, 0x6f, 0x6b, 0x2e, 0x74, 0x6f, 
-	0x6b, 0x65, 0x6e, 0x20, 0x6f, 0x72, 0x20, 0x74, 0x6f, 0x6b, 0x2e, 0x76, 0x61, 0x6c, 0x75, 0x65, 
-	0x29, 0xa, 0x20, 0x20, 0x20, 0x20, 0x65, 0x6e, 0x64, 0xa, 0xa, 0x20, 0x20, 0x20, 0x20, 0x6c, 
-	0x6f, 0x63, 0x61, 0x6c, 0x20, 0x74, 0x6f, 0x6b, 0x32, 0x20, 0x3d, 0x20, 0x6e, 0x65, 0x78, 0x74, 
-	0x5f, 0x74, 0x6f, 0x6b, 0x65, 0x6e, 0x28, 0x73, 0x74, 0x72, 0x65, 0x61, 0x6d, 0x29, 0xa, 0x20, 
-	0x20, 0x20, 0x20, 0x69, 0x66, 0x20, 0x6e, 0x6f, 0x74, 0x20, 0x74, 0x6f, 0x6b, 0x32, 0x20, 0x74, 
-	0x68, 0x65, 0x6e, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x72, 0x65, 0x74, 0x75, 
-	0x72, 0x6e, 0x20, 0x72, 0x65, 0x74, 0xa, 0x20, 0x20, 0x20, 0x20, 0x65, 0x6c, 0x73, 0x65, 0x69, 
-	0x66, 0x20, 0x74, 0x6f, 0x6b, 0x32, 0x2e, 0x74, 0x6f, 0x6b, 0x65, 0x6e, 0x20, 0x3d, 0x3d, 0x20, 
-	0x27, 0x2e, 0x27, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
-	0x20, 0x72, 0x65, 0x74, 0x75, 0x72, 0x6e, 0x20, 0x72, 0x65, 0x61, 0x64, 0x5f, 0x64, 0x6f, 0x74, 
-	0x28, 0x73, 0x74, 0x72, 0x65, 0x61, 0x6d, 0x2c, 0x20, 0x72, 0x65, 0x74, 0x29, 0xa, 0x20, 0x20, 
-	0x20, 0x20, 0x65, 0x6c, 0x73, 0x65, 0x69, 0x66, 0x20, 0x6e, 0x6f, 0x74, 0x20, 0x69, 0x73, 0x5f, 
-	0x6f, 0x70, 0x65, 0x72, 0x61, 0x74, 0x6f, 0x72, 0x28, 0x74, 0x6f, 0x6b, 0x32, 0x2e, 0x74, 0x6f, 
-	0x6b, 0x65, 0x6e, 0x29, 0x20, 0x6f, 0x72, 0x20, 0x6e, 0x6f, 0x74, 0x20, 0x72, 0x65, 0x61, 0x64, 
-	0x5f, 0x6f, 0x70, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
-	0x20, 0x72, 0x65, 0x76, 0x65, 0x72, 0x74, 0x5f, 0x74, 0x6f, 0x6b, 0x65, 0x6e, 0x28, 0x73, 0x74, 
-	0x72, 0x65, 0x61, 0x6d, 0x2c, 0x20, 0x74, 0x6f, 0x6b, 0x32, 0x29, 0xa, 0x20, 0x20, 0x20, 0x20, 
-	0x20, 0x20, 0x20, 0x20, 0x72, 0x65, 0x74, 0x75, 0x72, 0x6e, 0x20, 0x72, 0x65, 0x74, 0xa, 0x20, 
-	0x20, 0x20, 0x20, 0x65, 0x6e, 0x64, 0xa, 0xa, 0x20, 0x20, 0x20, 0x20, 0x72, 0x65, 0x74, 0x75, 
-	0x72, 0x6e, 0x20, 0x72, 0x65, 0x61, 0x64, 0x5f, 0x6f, 0x70, 0x65, 0x72, 0x61, 0x74, 0x6f, 0x72, 
-	0x28, 0x73, 0x74, 0x72, 0x65, 0x61, 0x6d, 0x2c, 0x20, 0x72, 0x65, 0x74, 0x2c, 0x20, 0x74, 0x6f, 
-	0x6b, 0x32, 0x2e, 0x74, 0x6f, 0x6b, 0x65, 0x6e, 0x29, 0xa, 0x65, 0x6e, 0x64, 0xa, 0xa, 0x2d, 
+	0x68, 0x61, 0x73, 0x68, 0x6d, 0x61, 0x70, 0x27, 0x29, 0xa, 0x20, 0x20, 0x20, 0x20, 0x65, 0x6c, 
+	0x73, 0x65, 0x69, 0x66, 0x20, 0x74, 0x6f, 0x6b, 0x2e, 0x74, 0x6f, 0x6b, 0x65, 0x6e, 0x20, 0x3d, 
+	0x3d, 0x20, 0x27, 0x5b, 0x27, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 
+	0x20, 0x20, 0x20, 0x72, 0x65, 0x74, 0x20, 0x3d, 0x20, 0x72, 0x65, 0x61, 0x64, 0x5f, 0x63, 0x6f, 
+	0x6c, 0x6c, 0x65, 0x63, 0x74, 0x69, 0x6f, 0x6e, 0x28, 0x73, 0x74, 0x72, 0x65, 0x61, 0x6d, 0x2c, 
+	0x20, 0x27, 0x76, 0x65, 0x63, 0x74, 0x6f, 0x72, 0x27, 0x29, 0xa, 0x20, 0x20, 0x20, 0x20, 0x65, 
+	0x6c, 0x73, 0x65, 0x69, 0x66, 0x20, 0x74, 0x6f, 0x6b, 0x2e, 0x74, 0x6f, 0x6b, 0x65, 0x6e, 0x20, 
+	0x3d, 0x3d, 0x20, 0x27, 0x28, 0x27, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x20, 0x20, 0x20, 0x20, 
+	0x20, 0x20, 0x20, 0x20, 0x72, 0x65, 0x74, 0x20, 0x3d, 0x20, 0x72, 0x65, 0x61, 0x64, 0x5f, 0x6c, 
+	0x61, 0x6d, 0x62, 0x64, 0x61, 0x28, 0x73, 0x74, 0x72, 0x65, 0x61, 0x6d, 0x29, 0x20, 0x6f, 0x72, 
+	0x20, 0x72, 0x65, 0x61, 0x64, 0x5f, 0x64, 0x65, 0x73, 0x74, 0x72, 0x75, 0x63, 0x74, 0x75, 0x72, 
+	0x65, 0x28, 0x73, 0x74, 0x72, 0x65, 0x61, 0x6d, 0x29, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
+	0x20, 0x20, 0x69, 0x66, 0x20, 0x6e, 0x6f, 0x74, 0x20, 0x72, 0x65, 0x74, 0x20, 0x74, 0x68, 0x65, 
+	0x6e, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x72, 0x65, 
+	0x74, 0x20, 0x3d, 0x20, 0x72, 0x65, 0x61, 0x64, 0x5f, 0x65, 0x78, 0x70, 0x72, 0x65, 0x73, 0x73, 
+	0x69, 0x6f, 0x6e, 0x28, 0x73, 0x74, 0x72, 0x65, 0x61, 0x6d, 0x29, 0xa, 0x20, 0x20, 0x20, 0x20, 
+	0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x20, 0x74, 0x6f, 
+	0x6b, 0x32, 0x20, 0x3d, 0x20, 0x6e, 0x65, 0x78, 0x74, 0x5f, 0x74, 0x6f, 0x6b, 0x65, 0x6e, 0x28, 
+	0x73, 0x74, 0x72, 0x65, 0x61, 0x6d, 0x29, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
+	0x20, 0x20, 0x20, 0x20, 0x69, 0x66, 0x20, 0x6e, 0x6f, 0x74, 0x20, 0x74, 0x6f, 0x6b, 0x32, 0x20, 
+	0x6f, 0x72, 0x20, 0x28, 0x74, 0x6f, 0x6b, 0x32, 0x2e, 0x74, 0x6f, 0x6b, 0x65, 0x6e, 0x20, 0x7e, 
+	0x3d, 0x20, 0x27, 0x29, 0x27, 0x20, 0x61, 0x6e, 0x64, 0x20, 0x6e, 0x6f, 0x74, 0x20, 0x69, 0x73, 
+	0x5f, 0x63, 0x61, 0x6c, 0x6c, 0x5f, 0x70, 0x72, 0x65, 0x66, 0x69, 0x78, 0x28, 0x74, 0x6f, 0x6b, 
+	0x32, 0x2e, 0x74, 0x6f, 0x6b, 0x65, 0x6e, 0x29, 0x29, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x20, 
+	0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x70, 
+	0x61, 0x72, 0x73, 0x65, 0x72, 0x5f, 0x65, 0x72, 0x72, 0x6f, 0x72, 0x28, 0x73, 0x74, 0x72, 0x65, 
+	0x61, 0x6d, 0x2c, 0x20, 0x22, 0x65, 0x78, 0x70, 0x65, 0x63, 0x74, 0x65, 0x64, 0x20, 0x27, 0x29, 
+	0x27, 0x22, 0x29, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
+	0x65, 0x6e, 0x64, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
+	0x69, 0x66, 0x20, 0x74, 0x6f, 0x6b, 0x32, 0x2e, 0x69, 0x73, 0x5f, 0x63, 0x61, 0x6c, 0x6c, 0x20, 
+	0x74, 0x68, 0x65, 0x6e, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
+	0x20, 0x20, 0x20, 0x20, 0x20, 0x72, 0x65, 0x76, 0x65, 0x72, 0x74, 0x5f, 0x74, 0x6f, 0x6b, 0x65, 
+	0x6e, 0x28, 0x73, 0x74, 0x72, 0x65, 0x61, 0x6d, 0x2c, 0x20, 0x74, 0x6f, 0x6b, 0x32, 0x29, 0xa, 
+	0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
+	0x72, 0x65, 0x74, 0x20, 0x3d, 0x20, 0x72, 0x65, 0x61, 0x64, 0x5f, 0x63, 0x61, 0x6c, 0x6c, 0x28, 
+	0x73, 0x74, 0x72, 0x65, 0x61, 0x6d, 0x2c, 0x20, 0x72, 0x65, 0x74, 0x29, 0xa, 0x20, 0x20, 0x20, 
+	0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x65, 0x6e, 0x64, 0xa, 0x20, 0x20, 0x20, 
+	0x20, 0x20, 0x20, 0x20, 0x20, 0x65, 0x6e, 0x64, 0xa, 0x20, 0x20, 0x20, 0x20, 0x65, 0x6c, 0x73, 
+	0x65, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x70, 0x61, 0x72, 0x73, 0x65, 0x72, 
+	0x5f, 0x65, 0x72, 0x72, 0x6f, 0x72, 0x28, 0x73, 0x74, 0x72, 0x65, 0x61, 0x6d, 0x2c, 0x20, 0x22, 
+	0x75, 0x6e, 0x65, 0x78, 0x70, 0x65, 0x63, 0x74, 0x65, 0x64, 0x20, 0x74, 0x6f, 0x6b, 0x65, 0x6e, 
+	0x20, 0x27, 0x25, 0x73, 0x27, 0x22, 0x2c, 0x20, 0x74, 0x6f, 0x6b, 0x2e, 0x74, 0x6f, 0x6b, 0x65, 
+	0x6e, 0x20, 0x6f, 0x72, 0x20, 0x74, 0x6f, 0x6b, 0x2e, 0x76, 0x61, 0x6c, 0x75, 0x65, 0x29, 0xa, 
+	0x20, 0x20, 0x20, 0x20, 0x65, 0x6e, 0x64, 0xa, 0xa, 0x20, 0x20, 0x20, 0x20, 0x6c, 0x6f, 0x63, 
+	0x61, 0x6c, 0x20, 0x74, 0x6f, 0x6b, 0x32, 0x20, 0x3d, 0x20, 0x6e, 0x65, 0x78, 0x74, 0x5f, 0x74, 
+	0x6f, 0x6b, 0x65, 0x6e, 0x28, 0x73, 0x74, 0x72, 0x65, 0x61, 0x6d, 0x29, 0xa, 0x20, 0x20, 0x20, 
+	0x20, 0x69, 0x66, 0x20, 0x6e, 0x6f, 0x74, 0x20, 0x74, 0x6f, 0x6b, 0x32, 0x20, 0x74, 0x68, 0x65, 
+	0x6e, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x72, 0x65, 0x74, 0x75, 0x72, 0x6e, 
+	0x20, 0x72, 0x65, 0x74, 0xa, 0x20, 0x20, 0x20, 0x20, 0x65, 0x6c, 0x73, 0x65, 0x69, 0x66, 0x20, 
+	0x74, 0x6f, 0x6b, 0x32, 0x2e, 0x74, 0x6f, 0x6b, 0x65, 0x6e, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x2e, 
+	0x27, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x72, 
+	0x65, 0x74, 0x75, 0x72, 0x6e, 0x20, 0x72, 0x65, 0x61, 0x64, 0x5f, 0x64, 0x6f, 0x74, 0x28, 0x73, 
+	0x74, 0x72, 0x65, 0x61, 0x6d, 0x2c, 0x20, 0x72, 0x65, 0x74, 0x29, 0xa, 0x20, 0x20, 0x20, 0x20, 
+	0x65, 0x6c, 0x73, 0x65, 0x69, 0x66, 0x20, 0x6e, 0x6f, 0x74, 0x20, 0x69, 0x73, 0x5f, 0x6f, 0x70, 
+	0x65, 0x72, 0x61, 0x74, 0x6f, 0x72, 0x28, 0x74, 0x6f, 0x6b, 0x32, 0x2e, 0x74, 0x6f, 0x6b, 0x65, 
+	0x6e, 0x29, 0x20, 0x6f, 0x72, 0x20, 0x6e, 0x6f, 0x74, 0x20, 0x72, 0x65, 0x61, 0x64, 0x5f, 0x6f, 
+	0x70, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x72, 
+	0x65, 0x76, 0x65, 0x72, 0x74, 0x5f, 0x74, 0x6f, 0x6b, 0x65, 0x6e, 0x28, 0x73, 0x74, 0x72, 0x65, 
+	0x61, 0x6d, 0x2c, 0x20, 0x74, 0x6f, 0x6b, 0x32, 0x29, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
+	0x20, 0x20, 0x72, 0x65, 0x74, 0x75, 0x72, 0x6e, 0x20, 0x72, 0x65, 0x74, 0xa, 0x20, 0x20, 0x20, 
+	0x20, 0x65, 0x6e, 0x64, 0xa, 0xa, 0x20, 0x20, 0x20, 0x20, 0x72, 0x65, 0x74, 0x75, 0x72, 0x6e, 
+	0x20, 0x72, 0x65, 0x61, 0x64, 0x5f, 0x6f, 0x70, 0x65, 0x72, 0x61, 0x74, 0x6f, 0x72, 0x28, 0x73, 
+	0x74, 0x72, 0x65, 0x61, 0x6d, 0x2c, 0x20, 0x72, 0x65, 0x74, 0x2c, 0x20, 0x74, 0x6f, 0x6b, 0x32, 
+	0x2e, 0x74, 0x6f, 0x6b, 0x65, 0x6e, 0x29, 0xa, 0x65, 0x6e, 0x64, 0xa, 0xa, 0x2d, 0x2d, 0x2d, 
 	0x2d, 0x2d, 0x2d, 0x2d, 0x2d, 0x2d, 0x2d, 0x2d, 0x2d, 0x2d, 0x2d, 0x2d, 0x2d, 0x2d, 0x2d, 0x2d, 
 	0x2d, 0x2d, 0x2d, 0x2d, 0x2d, 0x2d, 0x2d, 0x2d, 0x2d, 0x2d, 0x2d, 0x2d, 0x2d, 0x2d, 0x2d, 0x2d, 
 	0x2d, 0x2d, 0x2d, 0x2d, 0x2d, 0x2d, 0x2d, 0x2d, 0x2d, 0x2d, 0x2d, 0x2d, 0x2d, 0x2d, 0x2d, 0x2d, 
-	0x2d, 0x2d, 0x2d, 0x2d, 0x2d, 0x2d, 0x2d, 0x2d, 0x2d, 0x2d, 0xa, 0xa, 0x66, 0x75, 0x6e, 0x63, 
-	0x74, 0x69, 0x6f, 0x6e, 0x20, 0x63, 0x72, 0x65, 0x61, 0x74, 0x65, 0x5f, 0x73, 0x74, 0x72, 0x65, 
-	0x61, 0x6d, 0x28, 0x69, 0x6e, 0x70, 0x75, 0x74, 0x2c, 0x20, 0x6e, 0x61, 0x6d, 0x65, 0x2c, 0x20, 
-	0x70, 0x61, 0x74, 0x68, 0x29, 0xa, 0x20, 0x20, 0x20, 0x20, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x20, 
-	0x74, 0x61, 0x62, 0x20, 0x3d, 0x20, 0x7b, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
-	0x70, 0x75, 0x74, 0x20, 0x3d, 0x20, 0x66, 0x75, 0x6e, 0x63, 0x74, 0x69, 0x6f, 0x6e, 0x28, 0x73, 
-	0x65, 0x6c, 0x66, 0x2c, 0x20, 0x63, 0x68, 0x29, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
-	0x20, 0x20, 0x20, 0x20, 0x20, 0x69, 0x66, 0x20, 0x63, 0x68, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x5c, 
-	0x6e, 0x27, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
-	0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x73, 0x65, 0x6c, 0x66, 0x2e, 0x6c, 0x69, 0x6e, 
-	0x65, 0x20, 0x3d, 0x20, 0x73, 0x65, 0x6c, 0x66, 0x2e, 0x6c, 0x69, 0x6e, 0x65, 0x20, 0x2d, 0x20, 
-	0x31, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x65, 0x6e, 
-	0x64, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x74, 0x61, 
-	0x62, 0x6c, 0x65, 0x2e, 0x69, 0x6e, 0x73, 0x65, 0x72, 0x74, 0x28, 0x73, 0x65, 0x6c, 0x66, 0x2e, 
-	0x5f, 0x63, 0x61, 0x63, 0x68, 0x65, 0x2c, 0x20, 0x63, 0x68, 0x29, 0xa, 0x20, 0x20, 0x20, 0x20, 
-	0x20, 0x20, 0x20, 0x20, 0x65, 0x6e, 0x64, 0x2c, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
-	0x20, 0x6c, 0x69, 0x6e, 0x65, 0x20, 0x3d, 0x20, 0x31, 0x2c, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 
-	0x20, 0x20, 0x20, 0x66, 0x69, 0x6c, 0x65, 0x20, 0x3d, 0x20, 0x6e, 0x61, 0x6d, 0x65, 0x20, 0x6f, 
-	0x72, 0x20, 0x27, 0x3f, 0x27, 0x2c, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x5f, 
-	0x73, 0x6f, 0x75, 0x72, 0x63, 0x65, 0x20, 0x3d, 0x20, 0x69, 0x6e, 0x70, 0x75, 0x74, 0x2c, 0xa, 
-	0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x5f, 0x70, 0x61, 0x74, 0x68, 0x20, 0x3d, 0x20, 
-	0x70, 0x61, 0x74, 0x68, 0x2c, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x5f, 0x6f, 
-	0x66, 0x66, 0x73, 0x65, 0x74, 0x20, 0x3d, 0x20, 0x31, 0x2c, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 
-	0x20, 0x20, 0x20, 0x5f, 0x72, 0x65, 0x76, 0x65, 0x72, 0x74, 0x65, 0x64, 0x20, 0x3d, 0x20, 0x7b, 
-	0x7d, 0x2c, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x5f, 0x63, 0x61, 0x63, 0x68, 
-	0x65, 0x20, 0x3d, 0x20, 0x7b, 0x7d, 0xa, 0x20, 0x20, 0x20, 0x20, 0x7d, 0xa, 0xa, 0x20, 0x20, 
-	0x20, 0x20, 0x69, 0x66, 0x20, 0x69, 0x6f, 0x2e, 0x74, 0x79, 0x70, 0x65, 0x28, 0x69, 0x6e, 0x70, 
-	0x75, 0x74, 0x29, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x66, 0x69, 0x6c, 0x65, 0x27, 0x20, 0x74, 0x68, 
-	0x65, 0x6e, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x74, 0x61, 0x62, 0x2e, 0x67, 
-	0x65, 0x74, 0x20, 0x3d, 0x20, 0x66, 0x75, 0x6e, 0x63, 0x74, 0x69, 0x6f, 0x6e, 0x28, 0x73, 0x65, 
-	0x6c, 0x66, 0x29, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
-	0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x20, 0x63, 0x68, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
-	0x20, 0x20, 0x20, 0x20, 0x20, 0x69, 0x66, 0x20, 0x23, 0x73, 0x65, 0x6c, 0x66, 0x2e, 0x5f, 0x63, 
-	0x61, 0x63, 0x68, 0x65, 0x20, 0x3e, 0x20, 0x30, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x20, 0x20, 
-	0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x63, 0x68, 
-	0x20, 0x3d, 0x20, 0x74, 0x61, 0x62, 0x6c, 0x65, 0x2e, 0x72, 0x65, 0x6d, 0x6f, 0x76, 0x65, 0x28, 
-	0x73, 0x65, 0x6c, 0x66, 0x2e, 0x5f, 0x63, 0x61, 0x63, 0x68, 0x65, 0x2c, 0x20, 0x23, 0x73, 0x65, 
-	0x6c, 0x66, 0x2e, 0x5f, 0x63, 0x61, 0x63, 0x68, 0x65, 0x29, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 
-	0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x65, 0x6c, 0x73, 0x65, 0xa, 0x20, 0x20, 0x20, 0x20, 
+	0x2d, 0x2d, 0x2d, 0x2d, 0x2d, 0x2d, 0x2d, 0x2d, 0xa, 0xa, 0x66, 0x75, 0x6e, 0x63, 0x74, 0x69, 
+	0x6f, 0x6e, 0x20, 0x63, 0x72, 0x65, 0x61, 0x74, 0x65, 0x5f, 0x73, 0x74, 0x72, 0x65, 0x61, 0x6d, 
+	0x28, 0x69, 0x6e, 0x70, 0x75, 0x74, 0x2c, 0x20, 0x6e, 0x61, 0x6d, 0x65, 0x2c, 0x20, 0x70, 0x61, 
+	0x74, 0x68, 0x29, 0xa, 0x20, 0x20, 0x20, 0x20, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x20, 0x74, 0x61, 
+	0x62, 0x20, 0x3d, 0x20, 0x7b, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x70, 0x75, 
+	0x74, 0x20, 0x3d, 0x20, 0x66, 0x75, 0x6e, 0x63, 0x74, 0x69, 0x6f, 0x6e, 0x28, 0x73, 0x65, 0x6c, 
+	0x66, 0x2c, 0x20, 0x63, 0x68, 0x29, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
+	0x20, 0x20, 0x20, 0x69, 0x66, 0x20, 0x63, 0x68, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x5c, 0x6e, 0x27, 
+	0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
+	0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x73, 0x65, 0x6c, 0x66, 0x2e, 0x6c, 0x69, 0x6e, 0x65, 0x20, 
+	0x3d, 0x20, 0x73, 0x65, 0x6c, 0x66, 0x2e, 0x6c, 0x69, 0x6e, 0x65, 0x20, 0x2d, 0x20, 0x31, 0xa, 
+	0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x65, 0x6e, 0x64, 0xa, 
+	0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x74, 0x61, 0x62, 0x6c, 
+	0x65, 0x2e, 0x69, 0x6e, 0x73, 0x65, 0x72, 0x74, 0x28, 0x73, 0x65, 0x6c, 0x66, 0x2e, 0x5f, 0x63, 
+	0x61, 0x63, 0x68, 0x65, 0x2c, 0x20, 0x63, 0x68, 0x29, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
+	0x20, 0x20, 0x65, 0x6e, 0x64, 0x2c, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x6c, 
+	0x69, 0x6e, 0x65, 0x20, 0x3d, 0x20, 0x31, 0x2c, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
+	0x20, 0x66, 0x69, 0x6c, 0x65, 0x20, 0x3d, 0x20, 0x6e, 0x61, 0x6d, 0x65, 0x20, 0x6f, 0x72, 0x20, 
+	0x27, 0x3f, 0x27, 0x2c, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x5f, 0x73, 0x6f, 
+	0x75, 0x72, 0x63, 0x65, 0x20, 0x3d, 0x20, 0x69, 0x6e, 0x70, 0x75, 0x74, 0x2c, 0xa, 0x20, 0x20, 
+	0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x5f, 0x70, 0x61, 0x74, 0x68, 0x20, 0x3d, 0x20, 0x70, 0x61, 
+	0x74, 0x68, 0x2c, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x5f, 0x6f, 0x66, 0x66, 
+	0x73, 0x65, 0x74, 0x20, 0x3d, 0x20, 0x31, 0x2c, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
+	0x20, 0x5f, 0x72, 0x65, 0x76, 0x65, 0x72, 0x74, 0x65, 0x64, 0x20, 0x3d, 0x20, 0x7b, 0x7d, 0x2c, 
+	0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x5f, 0x63, 0x61, 0x63, 0x68, 0x65, 0x20, 
+	0x3d, 0x20, 0x7b, 0x7d, 0xa, 0x20, 0x20, 0x20, 0x20, 0x7d, 0xa, 0xa, 0x20, 0x20, 0x20, 0x20, 
+	0x69, 0x66, 0x20, 0x69, 0x6f, 0x2e, 0x74, 0x79, 0x70, 0x65, 0x28, 0x69, 0x6e, 0x70, 0x75, 0x74, 
+	0x29, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x66, 0x69, 0x6c, 0x65, 0x27, 0x20, 0x74, 0x68, 0x65, 0x6e, 
+	0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x74, 0x61, 0x62, 0x2e, 0x67, 0x65, 0x74, 
+	0x20, 0x3d, 0x20, 0x66, 0x75, 0x6e, 0x63, 0x74, 0x69, 0x6f, 0x6e, 0x28, 0x73, 0x65, 0x6c, 0x66, 
+	0x29, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x6c, 0x6f, 
+	0x63, 0x61, 0x6c, 0x20, 0x63, 0x68, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
+	0x20, 0x20, 0x20, 0x69, 0x66, 0x20, 0x23, 0x73, 0x65, 0x6c, 0x66, 0x2e, 0x5f, 0x63, 0x61, 0x63, 
+	0x68, 0x65, 0x20, 0x3e, 0x20, 0x30, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x20, 0x20, 0x20, 0x20, 
 	0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x63, 0x68, 0x20, 0x3d, 
-	0x20, 0x73, 0x65, 0x6c, 0x66, 0x2e, 0x5f, 0x73, 0x6f, 0x75, 0x72, 0x63, 0x65, 0x3a, 0x72, 0x65, 
-	0x61, 0x64, 0x28, 0x31, 0x29, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
-	0x20, 0x20, 0x65, 0x6e, 0x64, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
-	0x20, 0x20, 0x69, 0x66, 0x20, 0x63, 0x68, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x5c, 0x6e, 0x27, 0x20, 
-	0x74, 0x68, 0x65, 0x6e, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
-	0x20, 0x20, 0x20, 0x20, 0x20, 0x73, 0x65, 0x6c, 0x66, 0x2e, 0x6c, 0x69, 0x6e, 0x65, 0x20, 0x3d, 
-	0x20, 0x73, 0x65, 0x6c, 0x66, 0x2e, 0x6c, 0x69, 0x6e, 0x65, 0x20, 0x2b, 0x20, 0x31, 0xa, 0x20, 
-	0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x65, 0x6e, 0x64, 0xa, 0x20, 
-	0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x72, 0x65, 0x74, 0x75, 0x72, 
-	0x6e, 0x20, 0x63, 0x68, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x65, 0x6e, 0x64, 
-	0xa, 0x20, 0x20, 0x20, 0x20, 0x65, 0x6c, 0x73, 0x65, 0x69, 0x66, 0x20, 0x74, 0x79, 0x70, 0x65, 
-	0x28, 0x69, 0x6e, 0x70, 0x75, 0x74, 0x29, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x73, 0x74, 0x72, 0x69, 
-	0x6e, 0x67, 0x27, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
-	0x20, 0x74, 0x61, 0x62, 0x2e, 0x67, 0x65, 0x74, 0x20, 0x3d, 0x20, 0x66, 0x75, 0x6e, 0x63, 0x74, 
-	0x69, 0x6f, 0x6e, 0x28, 0x73, 0x65, 0x6c, 0x66, 0x29, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
-	0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x20, 0x63, 0x68, 0xa, 0x20, 
-	0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x69, 0x66, 0x20, 0x23, 0x73, 
-	0x65, 0x6c, 0x66, 0x2e, 0x5f, 0x63, 0x61, 0x63, 0x68, 0x65, 0x20, 0x3e, 0x20, 0x30, 0x20, 0x74, 
-	0x68, 0x65, 0x6e, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
-	0x20, 0x20, 0x20, 0x20, 0x63, 0x68, 0x20, 0x3d, 0x20, 0x74, 0x61, 0x62, 0x6c, 0x65, 0x2e, 0x72, 
-	0x65, 0x6d, 0x6f, 0x76, 0x65, 0x28, 0x73, 0x65, 0x6c, 0x66, 0x2e, 0x5f, 0x63, 0x61, 0x63, 0x68, 
-	0x65, 0x2c, 0x20, 0x23, 0x73, 0x65, 0x6c, 0x66, 0x2e, 0x5f, 0x63, 0x61, 0x63, 0x68, 0x65, 0x29, 
-	0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x65, 0x6c, 0x73, 
-	0x65, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
-	0x20, 0x20, 0x69, 0x66, 0x20, 0x73, 0x65, 0x6c, 0x66, 0x2e, 0x5f, 0x6f, 0x66, 0x66, 0x73, 0x65, 
-	0x74, 0x20, 0x3e, 0x20, 0x23, 0x73, 0x65, 0x6c, 0x66, 0x2e, 0x5f, 0x73, 0x6f, 0x75, 0x72, 0x63, 
-	0x65, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
-	0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x72, 0x65, 0x74, 0x75, 0x72, 
+	0x20, 0x74, 0x61, 0x62, 0x6c, 0x65, 0x2e, 0x72, 0x65, 0x6d, 0x6f, 0x76, 0x65, 0x28, 0x73, 0x65, 
+	0x6c, 0x66, 0x2e, 0x5f, 0x63, 0x61, 0x63, 0x68, 0x65, 0x2c, 0x20, 0x23, 0x73, 0x65, 0x6c, 0x66, 
+	0x2e, 0x5f, 0x63, 0x61, 0x63, 0x68, 0x65, 0x29, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
+	0x20, 0x20, 0x20, 0x20, 0x20, 0x65, 0x6c, 0x73, 0x65, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
+	0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x63, 0x68, 0x20, 0x3d, 0x20, 0x73, 
+	0x65, 0x6c, 0x66, 0x2e, 0x5f, 0x73, 0x6f, 0x75, 0x72, 0x63, 0x65, 0x3a, 0x72, 0x65, 0x61, 0x64, 
+	0x28, 0x31, 0x29, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
+	0x65, 0x6e, 0x64, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
+	0x69, 0x66, 0x20, 0x63, 0x68, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x5c, 0x6e, 0x27, 0x20, 0x74, 0x68, 
+	0x65, 0x6e, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
+	0x20, 0x20, 0x20, 0x73, 0x65, 0x6c, 0x66, 0x2e, 0x6c, 0x69, 0x6e, 0x65, 0x20, 0x3d, 0x20, 0x73, 
+	0x65, 0x6c, 0x66, 0x2e, 0x6c, 0x69, 0x6e, 0x65, 0x20, 0x2b, 0x20, 0x31, 0xa, 0x20, 0x20, 0x20, 
+	0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x65, 0x6e, 0x64, 0xa, 0x20, 0x20, 0x20, 
+	0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x72, 0x65, 0x74, 0x75, 0x72, 0x6e, 0x20, 
+	0x63, 0x68, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x65, 0x6e, 0x64, 0xa, 0x20, 
+	0x20, 0x20, 0x20, 0x65, 0x6c, 0x73, 0x65, 0x69, 0x66, 0x20, 0x74, 0x79, 0x70, 0x65, 0x28, 0x69, 
+	0x6e, 0x70, 0x75, 0x74, 0x29, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x73, 0x74, 0x72, 0x69, 0x6e, 0x67, 
+	0x27, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x74, 
+	0x61, 0x62, 0x2e, 0x67, 0x65, 0x74, 0x20, 0x3d, 0x20, 0x66, 0x75, 0x6e, 0x63, 0x74, 0x69, 0x6f, 
+	0x6e, 0x28, 0x73, 0x65, 0x6c, 0x66, 0x29, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
+	0x20, 0x20, 0x20, 0x20, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x20, 0x63, 0x68, 0xa, 0x20, 0x20, 0x20, 
+	0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x69, 0x66, 0x20, 0x23, 0x73, 0x65, 0x6c, 
+	0x66, 0x2e, 0x5f, 0x63, 0x61, 0x63, 0x68, 0x65, 0x20, 0x3e, 0x20, 0x30, 0x20, 0x74, 0x68, 0x65, 
 	0x6e, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
-	0x20, 0x20, 0x65, 0x6e, 0x64, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
-	0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x63, 0x68, 0x20, 0x3d, 0x20, 0x73, 0x74, 0x72, 0x69, 0x6e, 
-	0x67, 0x2e, 0x73, 0x75, 0x62, 0x28, 0x73, 0x65, 0x6c, 0x66, 0x2e, 0x5f, 0x73, 0x6f, 0x75, 0x72, 
-	0x63, 0x65, 0x2c, 0x20, 0x73, 0x65, 0x6c, 0x66, 0x2e, 0x5f, 0x6f, 0x66, 0x66, 0x73, 0x65, 0x74, 
-	0x2c, 0x20, 0x73, 0x65, 0x6c, 0x66, 0x2e, 0x5f, 0x6f, 0x66, 0x66, 0x73, 0x65, 0x74, 0x29, 0xa, 
+	0x20, 0x20, 0x63, 0x68, 0x20, 0x3d, 0x20, 0x74, 0x61, 0x62, 0x6c, 0x65, 0x2e, 0x72, 0x65, 0x6d, 
+	0x6f, 0x76, 0x65, 0x28, 0x73, 0x65, 0x6c, 0x66, 0x2e, 0x5f, 0x63, 0x61, 0x63, 0x68, 0x65, 0x2c, 
+	0x20, 0x23, 0x73, 0x65, 0x6c, 0x66, 0x2e, 0x5f, 0x63, 0x61, 0x63, 0x68, 0x65, 0x29, 0xa, 0x20, 
+	0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x65, 0x6c, 0x73, 0x65, 0xa, 
 	0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
-	0x73, 0x65, 0x6c, 0x66, 0x2e, 0x5f, 0x6f, 0x66, 0x66, 0x73, 0x65, 0x74, 0x20, 0x3d, 0x20, 0x73, 
-	0x65, 0x6c, 0x66, 0x2e, 0x5f, 0x6f, 0x66, 0x66, 0x73, 0x65, 0x74, 0x20, 0x2b, 0x20, 0x31, 0xa, 
-	0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x65, 0x6e, 0x64, 0xa, 
-	0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x69, 0x66, 0x20, 0x63, 
-	0x68, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x5c, 0x6e, 0x27, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x20, 
-	0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x73, 
-	0x65, 0x6c, 0x66, 0x2e, 0x6c, 0x69, 0x6e, 0x65, 0x20, 0x3d, 0x20, 0x73, 0x65, 0x6c, 0x66, 0x2e, 
-	0x6c, 0x69, 0x6e, 0x65, 0x20, 0x2b, 0x20, 0x31, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
-	0x20, 0x20, 0x20, 0x20, 0x20, 0x65, 0x6e, 0x64, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
-	0x20, 0x20, 0x20, 0x20, 0x20, 0x72, 0x65, 0x74, 0x75, 0x72, 0x6e, 0x20, 0x63, 0x68, 0xa, 0x20, 
-	0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x65, 0x6e, 0x64, 0xa, 0x20, 0x20, 0x20, 0x20, 0x65, 
-	0x6c, 0x73, 0x65, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x65, 0x72, 0x72, 0x6f, 
-	0x72, 0x28, 0x22, 0x43, 0x61, 0x6e, 0x27, 0x74, 0x20, 0x63, 0x72, 0x65, 0x61, 0x74, 0x65, 0x20, 
-	0x73, 0x74, 0x72, 0x65, 0x61, 0x6d, 0x20, 0x66, 0x72, 0x6f, 0x6d, 0x3a, 0x20, 0x22, 0x20, 0x2e, 
-	0x2e, 0x20, 0x74, 0x79, 0x70, 0x65, 0x28, 0x69, 0x6e, 0x70, 0x75, 0x74, 0x29, 0x29, 0xa, 0x20, 
-	0x20, 0x20, 0x20, 0x65, 0x6e, 0x64, 0xa, 0xa, 0x20, 0x20, 0x20, 0x20, 0x72, 0x65, 0x74, 0x75, 
-	0x72, 0x6e, 0x20, 0x74, 0x61, 0x62, 0xa, 0x65, 0x6e, 0x64, 0xa, 0xa, 0x66, 0x75, 0x6e, 0x63, 
-	0x74, 0x69, 0x6f, 0x6e, 0x20, 0x61, 0x73, 0x74, 0x5f, 0x70, 0x72, 0x69, 0x6e, 0x74, 0x28, 0x6e, 
-	0x6f, 0x64, 0x65, 0x2c, 0x20, 0x6c, 0x76, 0x29, 0xa, 0x20, 0x20, 0x20, 0x20, 0x6c, 0x6f, 0x63, 
-	0x61, 0x6c, 0x20, 0x66, 0x75, 0x6e, 0x63, 0x74, 0x69, 0x6f, 0x6e, 0x20, 0x70, 0x75, 0x74, 0x73, 
-	0x28, 0x6c, 0x76, 0x2c, 0x20, 0x2e, 0x2e, 0x2e, 0x29, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
-	0x20, 0x20, 0x66, 0x6f, 0x72, 0x20, 0x69, 0x3d, 0x31, 0x2c, 0x20, 0x6c, 0x76, 0x20, 0x64, 0x6f, 
-	0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x69, 0x6f, 0x2e, 
-	0x77, 0x72, 0x69, 0x74, 0x65, 0x28, 0x27, 0x5c, 0x74, 0x27, 0x29, 0xa, 0x20, 0x20, 0x20, 0x20, 
-	0x20, 0x20, 0x20, 0x20, 0x65, 0x6e, 0x64, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
-	0x70, 0x72, 0x69, 0x6e, 0x74, 0x28, 0x2e, 0x2e, 0x2e, 0x29, 0xa, 0x20, 0x20, 0x20, 0x20, 0x65, 
-	0x6e, 0x64, 0xa, 0xa, 0x20, 0x20, 0x20, 0x20, 0x6c, 0x76, 0x20, 0x3d, 0x20, 0x28, 0x6c, 0x76, 
-	0x20, 0x6f, 0x72, 0x20, 0x2d, 0x31, 0x29, 0x20, 0x2b, 0x20, 0x31, 0xa, 0x20, 0x20, 0x20, 0x20, 
+	0x69, 0x66, 0x20, 0x73, 0x65, 0x6c, 0x66, 0x2e, 0x5f, 0x6f, 0x66, 0x66, 0x73, 0x65, 0x74, 0x20, 
+	0x3e, 0x20, 0x23, 0x73, 0x65, 0x6c, 0x66, 0x2e, 0x5f, 0x73, 0x6f, 0x75, 0x72, 0x63, 0x65, 0x20, 
+	0x74, 0x68, 0x65, 0x6e, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
+	0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x72, 0x65, 0x74, 0x75, 0x72, 0x6e, 0xa, 
+	0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
+	0x65, 0x6e, 0x64, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
+	0x20, 0x20, 0x20, 0x20, 0x63, 0x68, 0x20, 0x3d, 0x20, 0x73, 0x74, 0x72, 0x69, 0x6e, 0x67, 0x2e, 
+	0x73, 0x75, 0x62, 0x28, 0x73, 0x65, 0x6c, 0x66, 0x2e, 0x5f, 0x73, 0x6f, 0x75, 0x72, 0x63, 0x65, 
+	0x2c, 0x20, 0x73, 0x65, 0x6c, 0x66, 0x2e, 0x5f, 0x6f, 0x66, 0x66, 0x73, 0x65, 0x74, 0x2c, 0x20, 
+	0x73, 0x65, 0x6c, 0x66, 0x2e, 0x5f, 0x6f, 0x66, 0x66, 0x73, 0x65, 0x74, 0x29, 0xa, 0x20, 0x20, 
+	0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x73, 0x65, 
+	0x6c, 0x66, 0x2e, 0x5f, 0x6f, 0x66, 0x66, 0x73, 0x65, 0x74, 0x20, 0x3d, 0x20, 0x73, 0x65, 0x6c, 
+	0x66, 0x2e, 0x5f, 0x6f, 0x66, 0x66, 0x73, 0x65, 0x74, 0x20, 0x2b, 0x20, 0x31, 0xa, 0x20, 0x20, 
+	0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x65, 0x6e, 0x64, 0xa, 0x20, 0x20, 
+	0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x69, 0x66, 0x20, 0x63, 0x68, 0x20, 
+	0x3d, 0x3d, 0x20, 0x27, 0x5c, 0x6e, 0x27, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x20, 0x20, 0x20, 
+	0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x73, 0x65, 0x6c, 
+	0x66, 0x2e, 0x6c, 0x69, 0x6e, 0x65, 0x20, 0x3d, 0x20, 0x73, 0x65, 0x6c, 0x66, 0x2e, 0x6c, 0x69, 
+	0x6e, 0x65, 0x20, 0x2b, 0x20, 0x31, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
+	0x20, 0x20, 0x20, 0x65, 0x6e, 0x64, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
+	0x20, 0x20, 0x20, 0x72, 0x65, 0x74, 0x75, 0x72, 0x6e, 0x20, 0x63, 0x68, 0xa, 0x20, 0x20, 0x20, 
+	0x20, 0x20, 0x20, 0x20, 0x20, 0x65, 0x6e, 0x64, 0xa, 0x20, 0x20, 0x20, 0x20, 0x65, 0x6c, 0x73, 
+	0x65, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x65, 0x72, 0x72, 0x6f, 0x72, 0x28, 
+	0x22, 0x43, 0x61, 0x6e, 0x27, 0x74, 0x20, 0x63, 0x72, 0x65, 0x61, 0x74, 0x65, 0x20, 0x73, 0x74, 
+	0x72, 0x65, 0x61, 0x6d, 0x20, 0x66, 0x72, 0x6f, 0x6d, 0x3a, 0x20, 0x22, 0x20, 0x2e, 0x2e, 0x20, 
+	0x74, 0x79, 0x70, 0x65, 0x28, 0x69, 0x6e, 0x70, 0x75, 0x74, 0x29, 0x29, 0xa, 0x20, 0x20, 0x20, 
+	0x20, 0x65, 0x6e, 0x64, 0xa, 0xa, 0x20, 0x20, 0x20, 0x20, 0x72, 0x65, 0x74, 0x75, 0x72, 0x6e, 
+	0x20, 0x74, 0x61, 0x62, 0xa, 0x65, 0x6e, 0x64, 0xa, 0xa, 0x66, 0x75, 0x6e, 0x63, 0x74, 0x69, 
+	0x6f, 0x6e, 0x20, 0x61, 0x73, 0x74, 0x5f, 0x70, 0x72, 0x69, 0x6e, 0x74, 0x28, 0x6e, 0x6f, 0x64, 
+	0x65, 0x2c, 0x20, 0x6c, 0x76, 0x29, 0xa, 0x20, 0x20, 0x20, 0x20, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 
+	0x20, 0x66, 0x75, 0x6e, 0x63, 0x74, 0x69, 0x6f, 0x6e, 0x20, 0x70, 0x75, 0x74, 0x73, 0x28, 0x6c, 
+	0x76, 0x2c, 0x20, 0x2e, 0x2e, 0x2e, 0x29, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
+	0x66, 0x6f, 0x72, 0x20, 0x69, 0x3d, 0x31, 0x2c, 0x20, 0x6c, 0x76, 0x20, 0x64, 0x6f, 0xa, 0x20, 
+	0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x69, 0x6f, 0x2e, 0x77, 0x72, 
+	0x69, 0x74, 0x65, 0x28, 0x27, 0x5c, 0x74, 0x27, 0x29, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
+	0x20, 0x20, 0x65, 0x6e, 0x64, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x70, 0x72, 
+	0x69, 0x6e, 0x74, 0x28, 0x2e, 0x2e, 0x2e, 0x29, 0xa, 0x20, 0x20, 0x20, 0x20, 0x65, 0x6e, 0x64, 
+	0xa, 0xa, 0x20, 0x20, 0x20, 0x20, 0x6c, 0x76, 0x20, 0x3d, 0x20, 0x28, 0x6c, 0x76, 0x20, 0x6f, 
+	0x72, 0x20, 0x2d, 0x31, 0x29, 0x20, 0x2b, 0x20, 0x31, 0xa, 0x20, 0x20, 0x20, 0x20, 0x69, 0x66, 
+	0x20, 0x6e, 0x6f, 0x64, 0x65, 0x2e, 0x74, 0x79, 0x70, 0x65, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x6e, 
+	0x75, 0x6d, 0x62, 0x65, 0x72, 0x27, 0x20, 0x6f, 0x72, 0x20, 0x6e, 0x6f, 0x64, 0x65, 0x2e, 0x74, 
+	0x79, 0x70, 0x65, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x62, 0x6f, 0x6f, 0x6c, 0x65, 0x61, 0x6e, 0x27, 
+	0x20, 0x6f, 0x72, 0x20, 0x6e, 0x6f, 0x64, 0x65, 0x2e, 0x74, 0x79, 0x70, 0x65, 0x20, 0x3d, 0x3d, 
+	0x20, 0x27, 0x73, 0x74, 0x72, 0x69, 0x6e, 0x67, 0x27, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x20, 
+	0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x70, 0x75, 0x74, 0x73, 0x28, 0x6c, 0x76, 0x2c, 0x20, 
+	0x27, 0x76, 0x61, 0x6c, 0x75, 0x65, 0x3a, 0x20, 0x27, 0x20, 0x2e, 0x2e, 0x20, 0x74, 0x6f, 0x73, 
+	0x74, 0x72, 0x69, 0x6e, 0x67, 0x28, 0x6e, 0x6f, 0x64, 0x65, 0x2e, 0x76, 0x61, 0x6c, 0x75, 0x65, 
+	0x29, 0x29, 0xa, 0x20, 0x20, 0x20, 0x20, 0x65, 0x6c, 0x73, 0x65, 0x69, 0x66, 0x20, 0x6e, 0x6f, 
+	0x64, 0x65, 0x2e, 0x74, 0x79, 0x70, 0x65, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x69, 0x64, 0x65, 0x6e, 
+	0x74, 0x69, 0x66, 0x69, 0x65, 0x72, 0x27, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x20, 0x20, 0x20, 
+	0x20, 0x20, 0x20, 0x20, 0x20, 0x70, 0x75, 0x74, 0x73, 0x28, 0x6c, 0x76, 0x2c, 0x20, 0x27, 0x69, 
+	0x64, 0x65, 0x6e, 0x74, 0x69, 0x66, 0x69, 0x65, 0x72, 0x3a, 0x20, 0x27, 0x20, 0x2e, 0x2e, 0x20, 
+	0x6e, 0x6f, 0x64, 0x65, 0x2e, 0x76, 0x61, 0x6c, 0x75, 0x65, 0x29, 0xa, 0x20, 0x20, 0x20, 0x20, 
+	0x65, 0x6c, 0x73, 0x65, 0x69, 0x66, 0x20, 0x6e, 0x6f, 0x64, 0x65, 0x2e, 0x74, 0x79, 0x70, 0x65, 
+	0x20, 0x3d, 0x3d, 0x20, 0x27, 0x6c, 0x61, 0x6d, 0x62, 0x64, 0x61, 0x27, 0x20, 0x74, 0x68, 0x65, 
+	0x6e, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x70, 0x75, 0x74, 0x73, 0x28, 0x6c, 
+	0x76, 0x2c, 0x20, 0x27, 0x6c, 0x61, 0x6d, 0x62, 0x64, 0x61, 0x3a, 0x20, 0x28, 0x2e, 0x2e, 0x2e, 
+	0x29, 0x20, 0x2d, 0x3e, 0x27, 0x29, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x61, 
+	0x73, 0x74, 0x5f, 0x70, 0x72, 0x69, 0x6e, 0x74, 0x28, 0x6e, 0x6f, 0x64, 0x65, 0x2e, 0x62, 0x6f, 
+	0x64, 0x79, 0x2c, 0x20, 0x6c, 0x76, 0x29, 0xa, 0x20, 0x20, 0x20, 0x20, 0x65, 0x6c, 0x73, 0x65, 
 	0x69, 0x66, 0x20, 0x6e, 0x6f, 0x64, 0x65, 0x2e, 0x74, 0x79, 0x70, 0x65, 0x20, 0x3d, 0x3d, 0x20, 
-	0x27, 0x6e, 0x75, 0x6d, 0x62, 0x65, 0x72, 0x27, 0x20, 0x6f, 0x72, 0x20, 0x6e, 0x6f, 0x64, 0x65, 
-	0x2e, 0x74, 0x79, 0x70, 0x65, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x62, 0x6f, 0x6f, 0x6c, 0x65, 0x61, 
-	0x6e, 0x27, 0x20, 0x6f, 0x72, 0x20, 0x6e, 0x6f, 0x64, 0x65, 0x2e, 0x74, 0x79, 0x70, 0x65, 0x20, 
-	0x3d, 0x3d, 0x20, 0x27, 0x73, 0x74, 0x72, 0x69, 0x6e, 0x67, 0x27, 0x20, 0x74, 0x68, 0x65, 0x6e, 
-	0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x70, 0x75, 0x74, 0x73, 0x28, 0x6c, 0x76, 
-	0x2c, 0x20, 0x27, 0x76, 0x61, 0x6c, 0x75, 0x65, 0x3a, 0x20, 0x27, 0x20, 0x2e, 0x2e, 0x20, 0x74, 
-	0x6f, 0x73, 0x74, 0x72, 0x69, 0x6e, 0x67, 0x28, 0x6e, 0x6f, 0x64, 0x65, 0x2e, 0x76, 0x61, 0x6c, 
-	0x75, 0x65, 0x29, 0x29, 0xa, 0x20, 0x20, 0x20, 0x20, 0x65, 0x6c, 0x73, 0x65, 0x69, 0x66, 0x20, 
-	0x6e, 0x6f, 0x64, 0x65, 0x2e, 0x74, 0x79, 0x70, 0x65, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x69, 0x64, 
-	0x65, 0x6e, 0x74, 0x69, 0x66, 0x69, 0x65, 0x72, 0x27, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x20, 
+	0x27, 0x63, 0x61, 0x6c, 0x6c, 0x27, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x20, 0x20, 0x20, 0x20, 
+	0x20, 0x20, 0x20, 0x20, 0x70, 0x75, 0x74, 0x73, 0x28, 0x6c, 0x76, 0x2c, 0x20, 0x73, 0x74, 0x72, 
+	0x69, 0x6e, 0x67, 0x2e, 0x66, 0x6f, 0x72, 0x6d, 0x61, 0x74, 0x28, 0x27, 0x25, 0x73, 0x3a, 0x27, 
+	0x2c, 0x20, 0x6e, 0x6f, 0x64, 0x65, 0x2e, 0x74, 0x79, 0x70, 0x65, 0x29, 0x29, 0xa, 0x20, 0x20, 
+	0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x61, 0x73, 0x74, 0x5f, 0x70, 0x72, 0x69, 0x6e, 0x74, 0x28, 
+	0x6e, 0x6f, 0x64, 0x65, 0x2e, 0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 0x6c, 0x76, 0x29, 0xa, 0x20, 
 	0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x70, 0x75, 0x74, 0x73, 0x28, 0x6c, 0x76, 0x2c, 0x20, 
-	0x27, 0x69, 0x64, 0x65, 0x6e, 0x74, 0x69, 0x66, 0x69, 0x65, 0x72, 0x3a, 0x20, 0x27, 0x20, 0x2e, 
-	0x2e, 0x20, 0x6e, 0x6f, 0x64, 0x65, 0x2e, 0x76, 0x61, 0x6c, 0x75, 0x65, 0x29, 0xa, 0x20, 0x20, 
-	0x20, 0x20, 0x65, 0x6c, 0x73, 0x65, 0x69, 0x66, 0x20, 0x6e, 0x6f, 0x64, 0x65, 0x2e, 0x74, 0x79, 
-	0x70, 0x65, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x6c, 0x61, 0x6d, 0x62, 0x64, 0x61, 0x27, 0x20, 0x74, 
-	0x68, 0x65, 0x6e, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x70, 0x75, 0x74, 0x73, 
-	0x28, 0x6c, 0x76, 0x2c, 0x20, 0x27, 0x6c, 0x61, 0x6d, 0x62, 0x64, 0x61, 0x3a, 0x20, 0x28, 0x2e, 
-	0x2e, 0x2e, 0x29, 0x20, 0x2d, 0x3e, 0x27, 0x29, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
-	0x20, 0x61, 0x73, 0x74, 0x5f, 0x70, 0x72, 0x69, 0x6e, 0x74, 0x28, 0x6e, 0x6f, 0x64, 0x65, 0x2e, 
-	0x62, 0x6f, 0x64, 0x79, 0x2c, 0x20, 0x6c, 0x76, 0x29, 0xa, 0x20, 0x20, 0x20, 0x20, 0x65, 0x6c, 
-	0x73, 0x65, 0x69, 0x66, 0x20, 0x6e, 0x6f, 0x64, 0x65, 0x2e, 0x74, 0x79, 0x70, 0x65, 0x20, 0x3d, 
-	0x3d, 0x20, 0x27, 0x63, 0x61, 0x6c, 0x6c, 0x27, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x20, 0x20, 
-	0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x70, 0x75, 0x74, 0x73, 0x28, 0x6c, 0x76, 0x2c, 0x20, 0x73, 
-	0x74, 0x72, 0x69, 0x6e, 0x67, 0x2e, 0x66, 0x6f, 0x72, 0x6d, 0x61, 0x74, 0x28, 0x27, 0x25, 0x73, 
-	0x3a, 0x27, 0x2c, 0x20, 0x6e, 0x6f, 0x64, 0x65, 0x2e, 0x74, 0x79, 0x70, 0x65, 0x29, 0x29, 0xa, 
-	0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x61, 0x73, 0x74, 0x5f, 0x70, 0x72, 0x69, 0x6e, 
-	0x74, 0x28, 0x6e, 0x6f, 0x64, 0x65, 0x2e, 0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 0x6c, 0x76, 0x29, 
-	0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x70, 0x75, 0x74, 0x73, 0x28, 0x6c, 0x76, 
-	0x2c, 0x20, 0x27, 0x28, 0x27, 0x29, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x66, 
-	0x6f, 0x72, 0x20, 0x5f, 0x2c, 0x76, 0x20, 0x69, 0x6e, 0x20, 0x69, 0x70, 0x61, 0x69, 0x72, 0x73, 
-	0x28, 0x6e, 0x6f, 0x64, 0x65, 0x2e, 0x61, 0x72, 0x67, 0x73, 0x29, 0x20, 0x64, 0x6f, 0xa, 0x20, 
-	0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x61, 0x73, 0x74, 0x5f, 0x70, 
-	0x72, 0x69, 0x6e, 0x74, 0x28, 0x76, 0x2c, 0x20, 0x6c, 0x76, 0x29, 0xa, 0x20, 0x20, 0x20, 0x20, 
-	0x20, 0x20, 0x20, 0x20, 0x65, 0x6e, 0x64, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
-	0x70, 0x75, 0x74, 0x73, 0x28, 0x6c, 0x76, 0x2c, 0x20, 0x27, 0x29, 0x27, 0x29, 0xa, 0x20, 0x20, 
-	0x20, 0x20, 0x65, 0x6c, 0x73, 0x65, 0x69, 0x66, 0x20, 0x6e, 0x6f, 0x64, 0x65, 0x2e, 0x74, 0x79, 
-	0x70, 0x65, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x63, 0x6f, 0x6c, 0x6c, 0x65, 0x63, 0x74, 0x69, 0x6f, 
-	0x6e, 0x27, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
-	0x70, 0x75, 0x74, 0x73, 0x28, 0x6c, 0x76, 0x2c, 0x20, 0x73, 0x74, 0x72, 0x69, 0x6e, 0x67, 0x2e, 
-	0x66, 0x6f, 0x72, 0x6d, 0x61, 0x74, 0x28, 0x27, 0x25, 0x73, 0x3a, 0x27, 0x2c, 0x20, 0x6e, 0x6f, 
-	0x64, 0x65, 0x2e, 0x63, 0x6f, 0x6c, 0x6c, 0x65, 0x63, 0x74, 0x69, 0x6f, 0x6e, 0x29, 0x29, 0xa, 
-	0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x70, 0x75, 0x74, 0x73, 0x28, 0x6c, 0x76, 0x2c, 
-	0x20, 0x27, 0x28, 0x27, 0x29, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x66, 0x6f, 
-	0x72, 0x20, 0x5f, 0x2c, 0x76, 0x20, 0x69, 0x6e, 0x20, 0x69, 0x70, 0x61, 0x69, 0x72, 0x73, 0x28, 
-	0x6e, 0x6f, 0x64, 0x65, 0x2e, 0x61, 0x72, 0x67, 0x73, 0x29, 0x20, 0x64, 0x6f, 0xa, 0x20, 0x20, 
-	0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x61, 0x73, 0x74, 0x5f, 0x70, 0x72, 
-	0x69, 0x6e, 0x74, 0x28, 0x76, 0x2c, 0x20, 0x6c, 0x76, 0x29, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 
-	0x20, 0x20, 0x20, 0x65, 0x6e, 0x64, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x70, 
-	0x75, 0x74, 0x73, 0x28, 0x6c, 0x76, 0x2c, 0x20, 0x27, 0x29, 0x27, 0x29, 0xa, 0x20, 0x20, 0x20, 
-	0x20, 0x65, 0x6c, 0x73, 0x65, 0x69, 0x66, 0x20, 0x6e, 0x6f, 0x64, 0x65, 0x2e, 0x74, 0x79, 0x70, 
-	0x65, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x6f, 0x70, 0x65, 0x72, 0x61, 0x74, 0x6f, 0x72, 0x27, 0x20, 
-	0x74, 0x68, 0x65, 0x6e, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x70, 0x75, 0x74, 
-	0x73, 0x28, 0x6c, 0x76, 0x2c, 0x20, 0x27, 0x6f, 0x70, 0x65, 0x72, 0x61, 0x74, 0x6f, 0x72, 0x3a, 
-	0x20, 0x27, 0x20, 0x2e, 0x2e, 0x20, 0x6e, 0x6f, 0x64, 0x65, 0x2e, 0x6f, 0x70, 0x65, 0x72, 0x61, 
-	0x74, 0x6f, 0x72, 0x29, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x70, 0x75, 0x74, 
-	0x73, 0x28, 0x6c, 0x76, 0x2c, 0x20, 0x27, 0x6c, 0x65, 0x66, 0x74, 0x3a, 0x27, 0x29, 0xa, 0x20, 
-	0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x61, 0x73, 0x74, 0x5f, 0x70, 0x72, 0x69, 0x6e, 0x74, 
-	0x28, 0x6e, 0x6f, 0x64, 0x65, 0x2e, 0x6c, 0x65, 0x66, 0x74, 0x2c, 0x20, 0x6c, 0x76, 0x29, 0xa, 
-	0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x70, 0x75, 0x74, 0x73, 0x28, 0x6c, 0x76, 0x2c, 
-	0x20, 0x27, 0x72, 0x69, 0x67, 0x68, 0x74, 0x3a, 0x27, 0x29, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 
-	0x20, 0x20, 0x20, 0x61, 0x73, 0x74, 0x5f, 0x70, 0x72, 0x69, 0x6e, 0x74, 0x28, 0x6e, 0x6f, 0x64, 
-	0x65, 0x2e, 0x72, 0x69, 0x67, 0x68, 0x74, 0x2c, 0x20, 0x6c, 0x76, 0x29, 0xa, 0x20, 0x20, 0x20, 
-	0x20, 0x65, 0x6c, 0x73, 0x65, 0x69, 0x66, 0x20, 0x6e, 0x6f, 0x64, 0x65, 0x2e, 0x74, 0x79, 0x70, 
-	0x65, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x63, 0x6f, 0x6e, 0x64, 0x27, 0x20, 0x74, 0x68, 0x65, 0x6e, 
-	0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x70, 0x75, 0x74, 0x73, 0x28, 0x6c, 0x76, 
-	0x2c, 0x20, 0x27, 0x69, 0x66, 0x3a, 0x27, 0x29, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
-	0x20, 0x61, 0x73, 0x74, 0x5f, 0x70, 0x72, 0x69, 0x6e, 0x74, 0x28, 0x6e, 0x6f, 0x64, 0x65, 0x2e, 
-	0x63, 0x6f, 0x6e, 0x64, 0x2c, 0x20, 0x6c, 0x76, 0x29, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
-	0x20, 0x20, 0x70, 0x75, 0x74, 0x73, 0x28, 0x6c, 0x76, 0x2c, 0x20, 0x27, 0x74, 0x68, 0x65, 0x6e, 
-	0x3a, 0x27, 0x29, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x61, 0x73, 0x74, 0x5f, 
-	0x70, 0x72, 0x69, 0x6e, 0x74, 0x28, 0x6e, 0x6f, 0x64, 0x65, 0x2e, 0x5f, 0x69, 0x66, 0x2c, 0x20, 
-	0x6c, 0x76, 0x29, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x69, 0x66, 0x20, 0x6e, 
-	0x6f, 0x64, 0x65, 0x2e, 0x5f, 0x65, 0x6c, 0x73, 0x65, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x20, 
-	0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x70, 0x75, 0x74, 0x73, 0x28, 
-	0x6c, 0x76, 0x2c, 0x20, 0x27, 0x65, 0x6c, 0x73, 0x65, 0x3a, 0x27, 0x29, 0xa, 0x20, 0x20, 0x20, 
+	0x27, 0x28, 0x27, 0x29, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x66, 0x6f, 0x72, 
+	0x20, 0x5f, 0x2c, 0x76, 0x20, 0x69, 0x6e, 0x20, 0x69, 0x70, 0x61, 0x69, 0x72, 0x73, 0x28, 0x6e, 
+	0x6f, 0x64, 0x65, 0x2e, 0x61, 0x72, 0x67, 0x73, 0x29, 0x20, 0x64, 0x6f, 0xa, 0x20, 0x20, 0x20, 
 	0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x61, 0x73, 0x74, 0x5f, 0x70, 0x72, 0x69, 
-	0x6e, 0x74, 0x28, 0x6e, 0x6f, 0x64, 0x65, 0x2e, 0x5f, 0x65, 0x6c, 0x73, 0x65, 0x2c, 0x20, 0x6c, 
-	0x76, 0x29, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x65, 0x6e, 0x64, 0xa, 0x20, 
-	0x20, 0x20, 0x20, 0x65, 0x6c, 0x73, 0x65, 0x69, 0x66, 0x20, 0x6e, 0x6f, 0x64, 0x65, 0x2e, 0x74, 
-	0x79, 0x70, 0x65, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x62, 0x6c, 0x6f, 0x63, 0x6b, 0x27, 0x20, 0x74, 
-	0x68, 0x65, 0x6e, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x70, 0x75, 0x74, 0x73, 
-	0x28, 0x6c, 0x76, 0x2c, 0x20, 0x27, 0x62, 0x6c, 0x6f, 0x63, 0x6b, 0x3a, 0x27, 0x29, 0xa, 0x20, 
-	0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x66, 0x6f, 0x72, 0x20, 0x5f, 0x2c, 0x76, 0x20, 0x69, 
-	0x6e, 0x20, 0x69, 0x70, 0x61, 0x69, 0x72, 0x73, 0x28, 0x6e, 0x6f, 0x64, 0x65, 0x2e, 0x62, 0x6f, 
-	0x64, 0x79, 0x29, 0x20, 0x64, 0x6f, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
-	0x20, 0x20, 0x20, 0x61, 0x73, 0x74, 0x5f, 0x70, 0x72, 0x69, 0x6e, 0x74, 0x28, 0x76, 0x2c, 0x20, 
-	0x6c, 0x76, 0x29, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x65, 0x6e, 0x64, 0xa, 
-	0x20, 0x20, 0x20, 0x20, 0x65, 0x6c, 0x73, 0x65, 0x69, 0x66, 0x20, 0x6e, 0x6f, 0x64, 0x65, 0x2e, 
-	0x74, 0x79, 0x70, 0x65, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x64, 0x65, 0x66, 0x27, 0x20, 0x74, 0x68, 
+	0x6e, 0x74, 0x28, 0x76, 0x2c, 0x20, 0x6c, 0x76, 0x29, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
+	0x20, 0x20, 0x65, 0x6e, 0x64, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x70, 0x75, 
+	0x74, 0x73, 0x28, 0x6c, 0x76, 0x2c, 0x20, 0x27, 0x29, 0x27, 0x29, 0xa, 0x20, 0x20, 0x20, 0x20, 
+	0x65, 0x6c, 0x73, 0x65, 0x69, 0x66, 0x20, 0x6e, 0x6f, 0x64, 0x65, 0x2e, 0x74, 0x79, 0x70, 0x65, 
+	0x20, 0x3d, 0x3d, 0x20, 0x27, 0x63, 0x6f, 0x6c, 0x6c, 0x65, 0x63, 0x74, 0x69, 0x6f, 0x6e, 0x27, 
+	0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x70, 0x75, 
+	0x74, 0x73, 0x28, 0x6c, 0x76, 0x2c, 0x20, 0x73, 0x74, 0x72, 0x69, 0x6e, 0x67, 0x2e, 0x66, 0x6f, 
+	0x72, 0x6d, 0x61, 0x74, 0x28, 0x27, 0x25, 0x73, 0x3a, 0x27, 0x2c, 0x20, 0x6e, 0x6f, 0x64, 0x65, 
+	0x2e, 0x63, 0x6f, 0x6c, 0x6c, 0x65, 0x63, 0x74, 0x69, 0x6f, 0x6e, 0x29, 0x29, 0xa, 0x20, 0x20, 
+	0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x70, 0x75, 0x74, 0x73, 0x28, 0x6c, 0x76, 0x2c, 0x20, 0x27, 
+	0x28, 0x27, 0x29, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x66, 0x6f, 0x72, 0x20, 
+	0x5f, 0x2c, 0x76, 0x20, 0x69, 0x6e, 0x20, 0x69, 0x70, 0x61, 0x69, 0x72, 0x73, 0x28, 0x6e, 0x6f, 
+	0x64, 0x65, 0x2e, 0x61, 0x72, 0x67, 0x73, 0x29, 0x20, 0x64, 0x6f, 0xa, 0x20, 0x20, 0x20, 0x20, 
+	0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x61, 0x73, 0x74, 0x5f, 0x70, 0x72, 0x69, 0x6e, 
+	0x74, 0x28, 0x76, 0x2c, 0x20, 0x6c, 0x76, 0x29, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
+	0x20, 0x65, 0x6e, 0x64, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x70, 0x75, 0x74, 
+	0x73, 0x28, 0x6c, 0x76, 0x2c, 0x20, 0x27, 0x29, 0x27, 0x29, 0xa, 0x20, 0x20, 0x20, 0x20, 0x65, 
+	0x6c, 0x73, 0x65, 0x69, 0x66, 0x20, 0x6e, 0x6f, 0x64, 0x65, 0x2e, 0x74, 0x79, 0x70, 0x65, 0x20, 
+	0x3d, 0x3d, 0x20, 0x27, 0x6f, 0x70, 0x65, 0x72, 0x61, 0x74, 0x6f, 0x72, 0x27, 0x20, 0x74, 0x68, 
 	0x65, 0x6e, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x70, 0x75, 0x74, 0x73, 0x28, 
-	0x6c, 0x76, 0x2c, 0x20, 0x73, 0x74, 0x72, 0x69, 0x6e, 0x67, 0x2e, 0x66, 0x6f, 0x72, 0x6d, 0x61, 
-	0x74, 0x28, 0x27, 0x64, 0x65, 0x66, 0x20, 0x25, 0x73, 0x3a, 0x27, 0x2c, 0x20, 0x6e, 0x6f, 0x64, 
-	0x65, 0x2e, 0x6e, 0x61, 0x6d, 0x65, 0x29, 0x29, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
+	0x6c, 0x76, 0x2c, 0x20, 0x27, 0x6f, 0x70, 0x65, 0x72, 0x61, 0x74, 0x6f, 0x72, 0x3a, 0x20, 0x27, 
+	0x20, 0x2e, 0x2e, 0x20, 0x6e, 0x6f, 0x64, 0x65, 0x2e, 0x6f, 0x70, 0x65, 0x72, 0x61, 0x74, 0x6f, 
+	0x72, 0x29, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x70, 0x75, 0x74, 0x73, 0x28, 
+	0x6c, 0x76, 0x2c, 0x20, 0x27, 0x6c, 0x65, 0x66, 0x74, 0x3a, 0x27, 0x29, 0xa, 0x20, 0x20, 0x20, 
+	0x20, 0x20, 0x20, 0x20, 0x20, 0x61, 0x73, 0x74, 0x5f, 0x70, 0x72, 0x69, 0x6e, 0x74, 0x28, 0x6e, 
+	0x6f, 0x64, 0x65, 0x2e, 0x6c, 0x65, 0x66, 0x74, 0x2c, 0x20, 0x6c, 0x76, 0x29, 0xa, 0x20, 0x20, 
+	0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x70, 0x75, 0x74, 0x73, 0x28, 0x6c, 0x76, 0x2c, 0x20, 0x27, 
+	0x72, 0x69, 0x67, 0x68, 0x74, 0x3a, 0x27, 0x29, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
 	0x20, 0x61, 0x73, 0x74, 0x5f, 0x70, 0x72, 0x69, 0x6e, 0x74, 0x28, 0x6e, 0x6f, 0x64, 0x65, 0x2e, 
-	0x76, 0x61, 0x6c, 0x75, 0x65, 0x2c, 0x20, 0x6c, 0x76, 0x29, 0xa, 0x20, 0x20, 0x20, 0x20, 0x65, 
+	0x72, 0x69, 0x67, 0x68, 0x74, 0x2c, 0x20, 0x6c, 0x76, 0x29, 0xa, 0x20, 0x20, 0x20, 0x20, 0x65, 
 	0x6c, 0x73, 0x65, 0x69, 0x66, 0x20, 0x6e, 0x6f, 0x64, 0x65, 0x2e, 0x74, 0x79, 0x70, 0x65, 0x20, 
-	0x3d, 0x3d, 0x20, 0x27, 0x73, 0x65, 0x71, 0x27, 0x20, 0x6f, 0x72, 0x20, 0x6e, 0x6f, 0x64, 0x65, 
-	0x2e, 0x74, 0x79, 0x70, 0x65, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x75, 0x6e, 0x6d, 0x27, 0x20, 0x6f, 
+	0x3d, 0x3d, 0x20, 0x27, 0x63, 0x6f, 0x6e, 0x64, 0x27, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x20, 
+	0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x70, 0x75, 0x74, 0x73, 0x28, 0x6c, 0x76, 0x2c, 0x20, 
+	0x27, 0x69, 0x66, 0x3a, 0x27, 0x29, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x61, 
+	0x73, 0x74, 0x5f, 0x70, 0x72, 0x69, 0x6e, 0x74, 0x28, 0x6e, 0x6f, 0x64, 0x65, 0x2e, 0x63, 0x6f, 
+	0x6e, 0x64, 0x2c, 0x20, 0x6c, 0x76, 0x29, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
+	0x70, 0x75, 0x74, 0x73, 0x28, 0x6c, 0x76, 0x2c, 0x20, 0x27, 0x74, 0x68, 0x65, 0x6e, 0x3a, 0x27, 
+	0x29, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x61, 0x73, 0x74, 0x5f, 0x70, 0x72, 
+	0x69, 0x6e, 0x74, 0x28, 0x6e, 0x6f, 0x64, 0x65, 0x2e, 0x5f, 0x69, 0x66, 0x2c, 0x20, 0x6c, 0x76, 
+	0x29, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x69, 0x66, 0x20, 0x6e, 0x6f, 0x64, 
+	0x65, 0x2e, 0x5f, 0x65, 0x6c, 0x73, 0x65, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x20, 0x20, 0x20, 
+	0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x70, 0x75, 0x74, 0x73, 0x28, 0x6c, 0x76, 
+	0x2c, 0x20, 0x27, 0x65, 0x6c, 0x73, 0x65, 0x3a, 0x27, 0x29, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 
+	0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x61, 0x73, 0x74, 0x5f, 0x70, 0x72, 0x69, 0x6e, 0x74, 
+	0x28, 0x6e, 0x6f, 0x64, 0x65, 0x2e, 0x5f, 0x65, 0x6c, 0x73, 0x65, 0x2c, 0x20, 0x6c, 0x76, 0x29, 
+	0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x65, 0x6e, 0x64, 0xa, 0x20, 0x20, 0x20, 
+	0x20, 0x65, 0x6c, 0x73, 0x65, 0x69, 0x66, 0x20, 0x6e, 0x6f, 0x64, 0x65, 0x2e, 0x74, 0x79, 0x70, 
+	0x65, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x62, 0x6c, 0x6f, 0x63, 0x6b, 0x27, 0x20, 0x74, 0x68, 0x65, 
+	0x6e, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x70, 0x75, 0x74, 0x73, 0x28, 0x6c, 
+	0x76, 0x2c, 0x20, 0x27, 0x62, 0x6c, 0x6f, 0x63, 0x6b, 0x3a, 0x27, 0x29, 0xa, 0x20, 0x20, 0x20, 
+	0x20, 0x20, 0x20, 0x20, 0x20, 0x66, 0x6f, 0x72, 0x20, 0x5f, 0x2c, 0x76, 0x20, 0x69, 0x6e, 0x20, 
+	0x69, 0x70, 0x61, 0x69, 0x72, 0x73, 0x28, 0x6e, 0x6f, 0x64, 0x65, 0x2e, 0x62, 0x6f, 0x64, 0x79, 
+	0x29, 0x20, 0x64, 0x6f, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
+	0x20, 0x61, 0x73, 0x74, 0x5f, 0x70, 0x72, 0x69, 0x6e, 0x74, 0x28, 0x76, 0x2c, 0x20, 0x6c, 0x76, 
+	0x29, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x65, 0x6e, 0x64, 0xa, 0x20, 0x20, 
+	0x20, 0x20, 0x65, 0x6c, 0x73, 0x65, 0x69, 0x66, 0x20, 0x6e, 0x6f, 0x64, 0x65, 0x2e, 0x74, 0x79, 
+	0x70, 0x65, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x64, 0x65, 0x66, 0x27, 0x20, 0x74, 0x68, 0x65, 0x6e, 
+	0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x70, 0x75, 0x74, 0x73, 0x28, 0x6c, 0x76, 
+	0x2c, 0x20, 0x73, 0x74, 0x72, 0x69, 0x6e, 0x67, 0x2e, 0x66, 0x6f, 0x72, 0x6d, 0x61, 0x74, 0x28, 
+	0x27, 0x64, 0x65, 0x66, 0x20, 0x25, 0x73, 0x3a, 0x27, 0x2c, 0x20, 0x6e, 0x6f, 0x64, 0x65, 0x2e, 
+	0x6e, 0x61, 0x6d, 0x65, 0x29, 0x29, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x61, 
+	0x73, 0x74, 0x5f, 0x70, 0x72, 0x69, 0x6e, 0x74, 0x28, 0x6e, 0x6f, 0x64, 0x65, 0x2e, 0x76, 0x61, 
+	0x6c, 0x75, 0x65, 0x2c, 0x20, 0x6c, 0x76, 0x29, 0xa, 0x20, 0x20, 0x20, 0x20, 0x65, 0x6c, 0x73, 
+	0x65, 0x69, 0x66, 0x20, 0x6e, 0x6f, 0x64, 0x65, 0x2e, 0x74, 0x79, 0x70, 0x65, 0x20, 0x3d, 0x3d, 
+	0x20, 0x27, 0x64, 0x65, 0x73, 0x74, 0x72, 0x75, 0x63, 0x74, 0x75, 0x72, 0x65, 0x27, 0x20, 0x74, 
+	0x68, 0x65, 0x6e, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x6c, 0x6f, 0x63, 0x61, 
+	0x6c, 0x20, 0x6e, 0x61, 0x6d, 0x65, 0x73, 0x20, 0x3d, 0x20, 0x7b, 0x7d, 0xa, 0x20, 0x20, 0x20, 
+	0x20, 0x20, 0x20, 0x20, 0x20, 0x66, 0x6f, 0x72, 0x20, 0x5f, 0x2c, 0x76, 0x20, 0x69, 0x6e, 0x20, 
+	0x69, 0x70, 0x61, 0x69, 0x72, 0x73, 0x28, 0x6e, 0x6f, 0x64, 0x65, 0x2e, 0x6e, 0x61, 0x6d, 0x65, 
+	0x73, 0x29, 0x20, 0x64, 0x6f, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
+	0x20, 0x20, 0x74, 0x61, 0x62, 0x6c, 0x65, 0x2e, 0x69, 0x6e, 0x73, 0x65, 0x72, 0x74, 0x28, 0x6e, 
+	0x61, 0x6d, 0x65, 0x73, 0x2c, 0x20, 0x76, 0x2e, 0x76, 0x61, 0x6c, 0x75, 0x65, 0x29, 0xa, 0x20, 
+	0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x65, 0x6e, 0x64, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 
+	0x20, 0x20, 0x20, 0x70, 0x75, 0x74, 0x73, 0x28, 0x6c, 0x76, 0x2c, 0x20, 0x73, 0x74, 0x72, 0x69, 
+	0x6e, 0x67, 0x2e, 0x66, 0x6f, 0x72, 0x6d, 0x61, 0x74, 0x28, 0x27, 0x28, 0x25, 0x73, 0x29, 0x20, 
+	0x3d, 0x27, 0x2c, 0x20, 0x74, 0x61, 0x62, 0x6c, 0x65, 0x2e, 0x63, 0x6f, 0x6e, 0x63, 0x61, 0x74, 
+	0x28, 0x6e, 0x61, 0x6d, 0x65, 0x73, 0x2c, 0x20, 0x27, 0x20, 0x27, 0x29, 0x29, 0x29, 0xa, 0x20, 
+	0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x61, 0x73, 0x74, 0x5f, 0x70, 0x72, 0x69, 0x6e, 0x74, 
+	0x28, 0x6e, 0x6f, 0x64, 0x65, 0x2e, 0x76, 0x61, 0x6c, 0x75, 0x65, 0x2c, 0x20, 0x6c, 0x76, 0x29, 
+	0xa, 0x20, 0x20, 0x20, 0x20, 0x65, 0x6c, 0x73, 0x65, 0x69, 0x66, 0x20, 0x6e, 0x6f, 0x64, 0x65, 
+	0x2e, 0x74, 0x79, 0x70, 0x65, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x73, 0x65, 0x71, 0x27, 0x20, 0x6f, 
 	0x72, 0x20, 0x6e, 0x6f, 0x64, 0x65, 0x2e, 0x74, 0x79, 0x70, 0x65, 0x20, 0x3d, 0x3d, 0x20, 0x27, 
-	0x6e, 0x6f, 0x74, 0x27, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
-	0x20, 0x20, 0x70, 0x75, 0x74, 0x73, 0x28, 0x6c, 0x76, 0x2c, 0x20, 0x73, 0x74, 0x72, 0x69, 0x6e, 
-	0x67, 0x2e, 0x66, 0x6f, 0x72, 0x6d, 0x61, 0x74, 0x28, 0x27, 0x25, 0x73, 0x3a, 0x27, 0x2c, 0x20, 
-	0x6e, 0x6f, 0x64, 0x65, 0x2e, 0x74, 0x79, 0x70, 0x65, 0x29, 0x29, 0xa, 0x20, 0x20, 0x20, 0x20, 
-	0x20, 0x20, 0x20, 0x20, 0x61, 0x73, 0x74, 0x5f, 0x70, 0x72, 0x69, 0x6e, 0x74, 0x28, 0x6e, 0x6f, 
-	0x64, 0x65, 0x2e, 0x61, 0x72, 0x67, 0x2c, 0x20, 0x6c, 0x76, 0x29, 0xa, 0x20, 0x20, 0x20, 0x20, 
-	0x65, 0x6c, 0x73, 0x65, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x65, 0x72, 0x72, 
-	0x6f, 0x72, 0x28, 0x6e, 0x6f, 0x64, 0x65, 0x2e, 0x74, 0x79, 0x70, 0x65, 0x29, 0xa, 0x20, 0x20, 
-	0x20, 0x20, 0x65, 0x6e, 0x64, 0xa, 0x65, 0x6e, 0x64, 0xa, 0xa, 0x65, 0x6e, 0x64, 0xa, 0xa, 
-	0xa, 0x64, 0x6f, 0xa, 0x2d, 0x2d, 0x20, 0x53, 0x20, 0x41, 0x20, 0x55, 0x20, 0x52, 0x20, 0x55, 
-	0x20, 0x53, 0xa, 0x2d, 0x2d, 0x20, 0x43, 0x6f, 0x70, 0x79, 0x72, 0x69, 0x67, 0x68, 0x74, 0x20, 
-	0x28, 0x63, 0x29, 0x20, 0x32, 0x30, 0x30, 0x39, 0x2d, 0x32, 0x30, 0x31, 0x35, 0x20, 0x41, 0x6e, 
-	0x64, 0x72, 0x65, 0x61, 0x73, 0x20, 0x54, 0x20, 0x4a, 0x6f, 0x6e, 0x73, 0x73, 0x6f, 0x6e, 0x20, 
-	0x3c, 0x61, 0x6e, 0x64, 0x72, 0x65, 0x61, 0x73, 0x40, 0x73, 0x61, 0x75, 0x72, 0x75, 0x73, 0x2e, 
-	0x6f, 0x72, 0x67, 0x3e, 0xa, 0x2d, 0x2d, 0xa, 0x2d, 0x2d, 0x20, 0x54, 0x68, 0x69, 0x73, 0x20, 
-	0x53, 0x6f, 0x75, 0x72, 0x63, 0x65, 0x20, 0x43, 0x6f, 0x64, 0x65, 0x20, 0x46, 0x6f, 0x72, 0x6d, 
-	0x20, 0x69, 0x73, 0x20, 0x73, 0x75, 0x62, 0x6a, 0x65, 0x63, 0x74, 0x20, 0x74, 0x6f, 0x20, 0x74, 
-	0x68, 0x65, 0x20, 0x74, 0x65, 0x72, 0x6d, 0x73, 0x20, 0x6f, 0x66, 0x20, 0x74, 0x68, 0x65, 0x20, 
-	0x4d, 0x6f, 0x7a, 0x69, 0x6c, 0x6c, 0x61, 0x20, 0x50, 0x75, 0x62, 0x6c, 0x69, 0x63, 0xa, 0x2d, 
-	0x2d, 0x20, 0x4c, 0x69, 0x63, 0x65, 0x6e, 0x73, 0x65, 0x2c, 0x20, 0x76, 0x2e, 0x20, 0x32, 0x2e, 
-	0x30, 0x2e, 0x20, 0x49, 0x66, 0x20, 0x61, 0x20, 0x63, 0x6f, 0x70, 0x79, 0x20, 0x6f, 0x66, 0x20, 
-	0x74, 0x68, 0x65, 0x20, 0x4d, 0x50, 0x4c, 0x20, 0x77, 0x61, 0x73, 0x20, 0x6e, 0x6f, 0x74, 0x20, 
-	0x64, 0x69, 0x73, 0x74, 0x72, 0x69, 0x62, 0x75, 0x74, 0x65, 0x64, 0x20, 0x77, 0x69, 0x74, 0x68, 
-	0x20, 0x74, 0x68, 0x69, 0x73, 0xa, 0x2d, 0x2d, 0x20, 0x66, 0x69, 0x6c, 0x65, 0x2c, 0x20, 0x59, 
-	0x6f, 0x75, 0x20, 0x63, 0x61, 0x6e, 0x20, 0x6f, 0x62, 0x74, 0x61, 0x69, 0x6e, 0x20, 0x6f, 0x6e, 
-	0x65, 0x20, 0x61, 0x74, 0x20, 0x68, 0x74, 0x74, 0x70, 0x3a, 0x2f, 0x2f, 0x6d, 0x6f, 0x7a, 0x69, 
-	0x6c, 0x6c, 0x61, 0x2e, 0x6f, 0x72, 0x67, 0x2f, 0x4d, 0x50, 0x4c, 0x2f, 0x32, 0x2e, 0x30, 0x2f, 
-	0x2e, 0xa, 0xa, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x20, 0x6f, 0x70, 0x74, 0x5f, 0x74, 0x61, 0x69, 
-	0x6c, 0x20, 0x3d, 0x20, 0x74, 0x72, 0x75, 0x65, 0xa, 0xa, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x20, 
-	0x66, 0x75, 0x6e, 0x63, 0x74, 0x69, 0x6f, 0x6e, 0x20, 0x74, 0x61, 0x62, 0x6c, 0x65, 0x5f, 0x63, 
-	0x6c, 0x6f, 0x6e, 0x65, 0x28, 0x74, 0x61, 0x62, 0x29, 0xa, 0x9, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 
-	0x20, 0x74, 0x20, 0x3d, 0x20, 0x7b, 0x7d, 0xa, 0x9, 0x66, 0x6f, 0x72, 0x20, 0x6b, 0x2c, 0x76, 
-	0x20, 0x69, 0x6e, 0x20, 0x69, 0x70, 0x61, 0x69, 0x72, 0x73, 0x28, 0x74, 0x61, 0x62, 0x29, 0x20, 
-	0x64, 0x6f, 0xa, 0x9, 0x9, 0x74, 0x5b, 0x6b, 0x5d, 0x20, 0x3d, 0x20, 0x76, 0xa, 0x9, 0x65, 
-	0x6e, 0x64, 0xa, 0x9, 0x72, 0x65, 0x74, 0x75, 0x72, 0x6e, 0x20, 0x74, 0xa, 0x65, 0x6e, 0x64, 
-	0xa, 0xa, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x20, 0x66, 0x75, 0x6e, 0x63, 0x74, 0x69, 0x6f, 0x6e, 
-	0x20, 0x67, 0x65, 0x6e, 0x5f, 0x69, 0x6e, 0x73, 0x74, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 
-	0x69, 0x6e, 0x73, 0x74, 0x2c, 0x20, 0x6c, 0x69, 0x6e, 0x65, 0x2c, 0x20, 0x2e, 0x2e, 0x2e, 0x29, 
-	0xa, 0x9, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x20, 0x69, 0x6e, 0x73, 0x74, 0x69, 0x64, 0x78, 0x20, 
-	0x3d, 0x20, 0x23, 0x66, 0x75, 0x6e, 0x63, 0x2e, 0x69, 0x6e, 0x73, 0x74, 0x72, 0x75, 0x63, 0x74, 
-	0x69, 0x6f, 0x6e, 0x73, 0x20, 0x2b, 0x20, 0x31, 0xa, 0x9, 0x66, 0x75, 0x6e, 0x63, 0x2e, 0x69, 
-	0x6e, 0x73, 0x74, 0x72, 0x75, 0x63, 0x74, 0x69, 0x6f, 0x6e, 0x73, 0x5b, 0x69, 0x6e, 0x73, 0x74, 
-	0x69, 0x64, 0x78, 0x5d, 0x20, 0x3d, 0x20, 0x7b, 0x69, 0x6e, 0x73, 0x74, 0x2c, 0x20, 0x2e, 0x2e, 
-	0x2e, 0x7d, 0xa, 0x9, 0x66, 0x75, 0x6e, 0x63, 0x2e, 0x6c, 0x69, 0x6e, 0x65, 0x6e, 0x72, 0x5b, 
-	0x69, 0x6e, 0x73, 0x74, 0x69, 0x64, 0x78, 0x5d, 0x20, 0x3d, 0x20, 0x6c, 0x69, 0x6e, 0x65, 0xa, 
-	0x65, 0x6e, 0x64, 0xa, 0xa, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x20, 0x66, 0x75, 0x6e, 0x63, 0x74, 
-	0x69, 0x6f, 0x6e, 0x20, 0x63, 0x61, 0x6c, 0x6c, 0x5f, 0x6f, 0x72, 0x5f, 0x74, 0x61, 0x69, 0x6c, 
-	0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 0x74, 0x61, 0x69, 0x6c, 0x2c, 0x20, 0x6c, 0x69, 0x6e, 
-	0x65, 0x2c, 0x20, 0x6e, 0x61, 0x72, 0x67, 0x29, 0xa, 0x9, 0x67, 0x65, 0x6e, 0x5f, 0x69, 0x6e, 
-	0x73, 0x74, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 0x28, 0x74, 0x61, 0x69, 0x6c, 0x20, 0x61, 
-	0x6e, 0x64, 0x20, 0x6f, 0x70, 0x74, 0x5f, 0x74, 0x61, 0x69, 0x6c, 0x20, 0x61, 0x6e, 0x64, 0x20, 
-	0x66, 0x75, 0x6e, 0x63, 0x2e, 0x70, 0x61, 0x72, 0x65, 0x6e, 0x74, 0x29, 0x20, 0x61, 0x6e, 0x64, 
-	0x20, 0x27, 0x54, 0x43, 0x41, 0x4c, 0x4c, 0x27, 0x20, 0x6f, 0x72, 0x20, 0x27, 0x43, 0x41, 0x4c, 
-	0x4c, 0x27, 0x2c, 0x20, 0x6c, 0x69, 0x6e, 0x65, 0x2c, 0x20, 0x6e, 0x61, 0x72, 0x67, 0x29, 0xa, 
-	0x9, 0x66, 0x75, 0x6e, 0x63, 0x2e, 0x73, 0x74, 0x61, 0x63, 0x6b, 0x5f, 0x70, 0x6f, 0x69, 0x6e, 
-	0x74, 0x65, 0x72, 0x20, 0x3d, 0x20, 0x66, 0x75, 0x6e, 0x63, 0x2e, 0x73, 0x74, 0x61, 0x63, 0x6b, 
-	0x5f, 0x70, 0x6f, 0x69, 0x6e, 0x74, 0x65, 0x72, 0x20, 0x2d, 0x20, 0x6e, 0x61, 0x72, 0x67, 0xa, 
-	0x9, 0x61, 0x73, 0x73, 0x65, 0x72, 0x74, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2e, 0x73, 0x74, 0x61, 
-	0x63, 0x6b, 0x5f, 0x70, 0x6f, 0x69, 0x6e, 0x74, 0x65, 0x72, 0x20, 0x3e, 0x20, 0x30, 0x29, 0xa, 
-	0x65, 0x6e, 0x64, 0xa, 0xa, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x20, 0x66, 0x75, 0x6e, 0x63, 0x74, 
-	0x69, 0x6f, 0x6e, 0x20, 0x67, 0x65, 0x6e, 0x5f, 0x70, 0x6f, 0x70, 0x28, 0x66, 0x75, 0x6e, 0x63, 
-	0x2c, 0x20, 0x6e, 0x75, 0x6d, 0x29, 0xa, 0x9, 0x6e, 0x75, 0x6d, 0x20, 0x3d, 0x20, 0x6e, 0x75, 
-	0x6d, 0x20, 0x6f, 0x72, 0x20, 0x31, 0xa, 0x9, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x20, 0x69, 0x64, 
-	0x78, 0x20, 0x3d, 0x20, 0x23, 0x66, 0x75, 0x6e, 0x63, 0x2e, 0x69, 0x6e, 0x73, 0x74, 0x72, 0x75, 
-	0x63, 0x74, 0x69, 0x6f, 0x6e, 0x73, 0xa, 0x9, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x20, 0x6c, 0x69, 
-	0x6e, 0x65, 0x20, 0x3d, 0x20, 0x69, 0x64, 0x78, 0x20, 0x3e, 0x20, 0x30, 0x20, 0x61, 0x6e, 0x64, 
-	0x20, 0x66, 0x75, 0x6e, 0x63, 0x2e, 0x6c, 0x69, 0x6e, 0x65, 0x6e, 0x72, 0x5b, 0x69, 0x64, 0x78, 
-	0x5d, 0x20, 0x6f, 0x72, 0x20, 0x2d, 0x31, 0xa, 0x9, 0x67, 0x65, 0x6e, 0x5f, 0x69, 0x6e, 0x73, 
-	0x74, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 0x27, 0x50, 0x4f, 0x50, 0x27, 0x2c, 0x20, 0x6c, 
-	0x69, 0x6e, 0x65, 0x2c, 0x20, 0x6e, 0x75, 0x6d, 0x29, 0xa, 0x9, 0x66, 0x75, 0x6e, 0x63, 0x2e, 
-	0x73, 0x74, 0x61, 0x63, 0x6b, 0x5f, 0x70, 0x6f, 0x69, 0x6e, 0x74, 0x65, 0x72, 0x20, 0x3d, 0x20, 
-	0x66, 0x75, 0x6e, 0x63, 0x2e, 0x73, 0x74, 0x61, 0x63, 0x6b, 0x5f, 0x70, 0x6f, 0x69, 0x6e, 0x74, 
-	0x65, 0x72, 0x20, 0x2d, 0x20, 0x6e, 0x75, 0x6d, 0xa, 0x9, 0x61, 0x73, 0x73, 0x65, 0x72, 0x74, 
-	0x28, 0x66, 0x75, 0x6e, 0x63, 0x2e, 0x73, 0x74, 0x61, 0x63, 0x6b, 0x5f, 0x70, 0x6f, 0x69, 0x6e, 
-	0x74, 0x65, 0x72, 0x20, 0x3e, 0x3d, 0x20, 0x30, 0x29, 0xa, 0x65, 0x6e, 0x64, 0xa, 0xa, 0x6c, 
-	0x6f, 0x63, 0x61, 0x6c, 0x20, 0x66, 0x75, 0x6e, 0x63, 0x74, 0x69, 0x6f, 0x6e, 0x20, 0x67, 0x65, 
-	0x6e, 0x5f, 0x63, 0x61, 0x6c, 0x6c, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 0x61, 0x73, 0x74, 
-	0x2c, 0x20, 0x74, 0x61, 0x69, 0x6c, 0x29, 0xa, 0x9, 0x61, 0x73, 0x73, 0x65, 0x72, 0x74, 0x28, 
-	0x61, 0x73, 0x74, 0x2e, 0x74, 0x79, 0x70, 0x65, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x63, 0x61, 0x6c, 
-	0x6c, 0x27, 0x29, 0xa, 0x9, 0x67, 0x65, 0x6e, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 0x61, 
+	0x75, 0x6e, 0x6d, 0x27, 0x20, 0x6f, 0x72, 0x20, 0x6e, 0x6f, 0x64, 0x65, 0x2e, 0x74, 0x79, 0x70, 
+	0x65, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x6e, 0x6f, 0x74, 0x27, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 
+	0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x70, 0x75, 0x74, 0x73, 0x28, 0x6c, 0x76, 0x2c, 
+	0x20, 0x73, 0x74, 0x72, 0x69, 0x6e, 0x67, 0x2e, 0x66, 0x6f, 0x72, 0x6d, 0x61, 0x74, 0x28, 0x27, 
+	0x25, 0x73, 0x3a, 0x27, 0x2c, 0x20, 0x6e, 0x6f, 0x64, 0x65, 0x2e, 0x74, 0x79, 0x70, 0x65, 0x29, 
+	0x29, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x61, 0x73, 0x74, 0x5f, 0x70, 0x72, 
+	0x69, 0x6e, 0x74, 0x28, 0x6e, 0x6f, 0x64, 0x65, 0x2e, 0x61, 0x72, 0x67, 0x2c, 0x20, 0x6c, 0x76, 
+	0x29, 0xa, 0x20, 0x20, 0x20, 0x20, 0x65, 0x6c, 0x73, 0x65, 0xa, 0x20, 0x20, 0x20, 0x20, 0x20, 
+	0x20, 0x20, 0x20, 0x65, 0x72, 0x72, 0x6f, 0x72, 0x28, 0x6e, 0x6f, 0x64, 0x65, 0x2e, 0x74, 0x79, 
+	0x70, 0x65, 0x29, 0xa, 0x20, 0x20, 0x20, 0x20, 0x65, 0x6e, 0x64, 0xa, 0x65, 0x6e, 0x64, 0xa, 
+	0xa, 0x65, 0x6e, 0x64, 0xa, 0xa, 0xa, 0x64, 0x6f, 0xa, 0x2d, 0x2d, 0x20, 0x53, 0x20, 0x41, 
+	0x20, 0x55, 0x20, 0x52, 0x20, 0x55, 0x20, 0x53, 0xa, 0x2d, 0x2d, 0x20, 0x43, 0x6f, 0x70, 0x79, 
+	0x72, 0x69, 0x67, 0x68, 0x74, 0x20, 0x28, 0x63, 0x29, 0x20, 0x32, 0x30, 0x30, 0x39, 0x2d, 0x32, 
+	0x30, 0x31, 0x35, 0x20, 0x41, 0x6e, 0x64, 0x72, 0x65, 0x61, 0x73, 0x20, 0x54, 0x20, 0x4a, 0x6f, 
+	0x6e, 0x73, 0x73, 0x6f, 0x6e, 0x20, 0x3c, 0x61, 0x6e, 0x64, 0x72, 0x65, 0x61, 0x73, 0x40, 0x73, 
+	0x61, 0x75, 0x72, 0x75, 0x73, 0x2e, 0x6f, 0x72, 0x67, 0x3e, 0xa, 0x2d, 0x2d, 0xa, 0x2d, 0x2d, 
+	0x20, 0x54, 0x68, 0x69, 0x73, 0x20, 0x53, 0x6f, 0x75, 0x72, 0x63, 0x65, 0x20, 0x43, 0x6f, 0x64, 
+	0x65, 0x20, 0x46, 0x6f, 0x72, 0x6d, 0x20, 0x69, 0x73, 0x20, 0x73, 0x75, 0x62, 0x6a, 0x65, 0x63, 
+	0x74, 0x20, 0x74, 0x6f, 0x20, 0x74, 0x68, 0x65, 0x20, 0x74, 0x65, 0x72, 0x6d, 0x73, 0x20, 0x6f, 
+	0x66, 0x20, 0x74, 0x68, 0x65, 0x20, 0x4d, 0x6f, 0x7a, 0x69, 0x6c, 0x6c, 0x61, 0x20, 0x50, 0x75, 
+	0x62, 0x6c, 0x69, 0x63, 0xa, 0x2d, 0x2d, 0x20, 0x4c, 0x69, 0x63, 0x65, 0x6e, 0x73, 0x65, 0x2c, 
+	0x20, 0x76, 0x2e, 0x20, 0x32, 0x2e, 0x30, 0x2e, 0x20, 0x49, 0x66, 0x20, 0x61, 0x20, 0x63, 0x6f, 
+	0x70, 0x79, 0x20, 0x6f, 0x66, 0x20, 0x74, 0x68, 0x65, 0x20, 0x4d, 0x50, 0x4c, 0x20, 0x77, 0x61, 
+	0x73, 0x20, 0x6e, 0x6f, 0x74, 0x20, 0x64, 0x69, 0x73, 0x74, 0x72, 0x69, 0x62, 0x75, 0x74, 0x65, 
+	0x64, 0x20, 0x77, 0x69, 0x74, 0x68, 0x20, 0x74, 0x68, 0x69, 0x73, 0xa, 0x2d, 0x2d, 0x20, 0x66, 
+	0x69, 0x6c, 0x65, 0x2c, 0x20, 0x59, 0x6f, 0x75, 0x20, 0x63, 0x61, 0x6e, 0x20, 0x6f, 0x62, 0x74, 
+	0x61, 0x69, 0x6e, 0x20, 0x6f, 0x6e, 0x65, 0x20, 0x61, 0x74, 0x20, 0x68, 0x74, 0x74, 0x70, 0x3a, 
+	0x2f, 0x2f, 0x6d, 0x6f, 0x7a, 0x69, 0x6c, 0x6c, 0x61, 0x2e, 0x6f, 0x72, 0x67, 0x2f, 0x4d, 0x50, 
+	0x4c, 0x2f, 0x32, 0x2e, 0x30, 0x2f, 0x2e, 0xa, 0xa, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x20, 0x6f, 
+	0x70, 0x74, 0x5f, 0x74, 0x61, 0x69, 0x6c, 0x20, 0x3d, 0x20, 0x74, 0x72, 0x75, 0x65, 0xa, 0x6c, 
+	0x6f, 0x63, 0x61, 0x6c, 0x20, 0x6f, 0x70, 0x74, 0x5f, 0x6f, 0x70, 0x65, 0x72, 0x61, 0x6e, 0x64, 
+	0x73, 0x20, 0x3d, 0x20, 0x6e, 0x6f, 0x74, 0x20, 0x6f, 0x73, 0x2e, 0x67, 0x65, 0x74, 0x65, 0x6e, 
+	0x76, 0x28, 0x27, 0x53, 0x55, 0x5f, 0x4f, 0x50, 0x54, 0x5f, 0x4e, 0x4f, 0x5f, 0x4f, 0x50, 0x45, 
+	0x52, 0x41, 0x4e, 0x44, 0x53, 0x27, 0x29, 0xa, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x20, 0x6f, 0x70, 
+	0x74, 0x5f, 0x67, 0x65, 0x74, 0x66, 0x69, 0x65, 0x6c, 0x64, 0x20, 0x3d, 0x20, 0x6e, 0x6f, 0x74, 
+	0x20, 0x6f, 0x73, 0x2e, 0x67, 0x65, 0x74, 0x65, 0x6e, 0x76, 0x28, 0x27, 0x53, 0x55, 0x5f, 0x4f, 
+	0x50, 0x54, 0x5f, 0x4e, 0x4f, 0x5f, 0x47, 0x45, 0x54, 0x46, 0x49, 0x45, 0x4c, 0x44, 0x27, 0x29, 
+	0xa, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x20, 0x6f, 0x70, 0x74, 0x5f, 0x66, 0x6f, 0x72, 0x72, 0x61, 
+	0x6e, 0x67, 0x65, 0x20, 0x3d, 0x20, 0x6e, 0x6f, 0x74, 0x20, 0x6f, 0x73, 0x2e, 0x67, 0x65, 0x74, 
+	0x65, 0x6e, 0x76, 0x28, 0x27, 0x53, 0x55, 0x5f, 0x4f, 0x50, 0x54, 0x5f, 0x4e, 0x4f, 0x5f, 0x46, 
+	0x4f, 0x52, 0x52, 0x41, 0x4e, 0x47, 0x45, 0x27, 0x29, 0xa, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x20, 
+	0x6f, 0x70, 0x74, 0x5f, 0x74, 0x61, 0x69, 0x6c, 0x72, 0x65, 0x63, 0x20, 0x3d, 0x20, 0x6e, 0x6f, 
+	0x74, 0x20, 0x6f, 0x73, 0x2e, 0x67, 0x65, 0x74, 0x65, 0x6e, 0x76, 0x28, 0x27, 0x53, 0x55, 0x5f, 
+	0x4f, 0x50, 0x54, 0x5f, 0x4e, 0x4f, 0x5f, 0x54, 0x41, 0x49, 0x4c, 0x52, 0x45, 0x43, 0x27, 0x29, 
+	0xa, 0xa, 0x2d, 0x2d, 0x20, 0x49, 0x6e, 0x73, 0x74, 0x72, 0x75, 0x63, 0x74, 0x69, 0x6f, 0x6e, 
+	0x73, 0x20, 0x74, 0x68, 0x61, 0x74, 0x20, 0x72, 0x65, 0x61, 0x64, 0x20, 0x74, 0x68, 0x65, 0x69, 
+	0x72, 0x20, 0x6f, 0x70, 0x65, 0x72, 0x61, 0x6e, 0x64, 0x73, 0x20, 0x73, 0x74, 0x72, 0x61, 0x69, 
+	0x67, 0x68, 0x74, 0x20, 0x66, 0x72, 0x6f, 0x6d, 0x20, 0x66, 0x72, 0x61, 0x6d, 0x65, 0x20, 0x73, 
+	0x6c, 0x6f, 0x74, 0x73, 0x20, 0x28, 0x4c, 0x29, 0xa, 0x2d, 0x2d, 0x20, 0x6f, 0x72, 0x20, 0x74, 
+	0x68, 0x65, 0x20, 0x63, 0x6f, 0x6e, 0x73, 0x74, 0x61, 0x6e, 0x74, 0x20, 0x74, 0x61, 0x62, 0x6c, 
+	0x65, 0x20, 0x28, 0x4b, 0x29, 0x20, 0x69, 0x6e, 0x73, 0x74, 0x65, 0x61, 0x64, 0x20, 0x6f, 0x66, 
+	0x20, 0x66, 0x72, 0x6f, 0x6d, 0x20, 0x74, 0x68, 0x65, 0x20, 0x73, 0x74, 0x61, 0x63, 0x6b, 0x2e, 
+	0xa, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x20, 0x6f, 0x70, 0x65, 0x72, 0x61, 0x6e, 0x64, 0x5f, 0x69, 
+	0x6e, 0x73, 0x74, 0x20, 0x3d, 0x20, 0x7b, 0xa, 0x9, 0x5b, 0x27, 0x2b, 0x27, 0x5d, 0x20, 0x3d, 
+	0x20, 0x7b, 0x27, 0x41, 0x44, 0x44, 0x27, 0x2c, 0x20, 0x63, 0x6f, 0x6d, 0x6d, 0x75, 0x74, 0x61, 
+	0x74, 0x69, 0x76, 0x65, 0x20, 0x3d, 0x20, 0x74, 0x72, 0x75, 0x65, 0x7d, 0x2c, 0xa, 0x9, 0x5b, 
+	0x27, 0x2d, 0x27, 0x5d, 0x20, 0x3d, 0x20, 0x7b, 0x27, 0x53, 0x55, 0x42, 0x27, 0x7d, 0x2c, 0xa, 
+	0x9, 0x5b, 0x27, 0x2a, 0x27, 0x5d, 0x20, 0x3d, 0x20, 0x7b, 0x27, 0x4d, 0x55, 0x4c, 0x27, 0x2c, 
+	0x20, 0x63, 0x6f, 0x6d, 0x6d, 0x75, 0x74, 0x61, 0x74, 0x69, 0x76, 0x65, 0x20, 0x3d, 0x20, 0x74, 
+	0x72, 0x75, 0x65, 0x7d, 0x2c, 0xa, 0x9, 0x5b, 0x27, 0x3d, 0x3d, 0x27, 0x5d, 0x20, 0x3d, 0x20, 
+	0x7b, 0x27, 0x45, 0x51, 0x27, 0x2c, 0x20, 0x63, 0x6f, 0x6d, 0x6d, 0x75, 0x74, 0x61, 0x74, 0x69, 
+	0x76, 0x65, 0x20, 0x3d, 0x20, 0x74, 0x72, 0x75, 0x65, 0x7d, 0x2c, 0xa, 0x9, 0x5b, 0x27, 0x7e, 
+	0x3d, 0x27, 0x5d, 0x20, 0x3d, 0x20, 0x7b, 0x27, 0x45, 0x51, 0x27, 0x2c, 0x20, 0x63, 0x6f, 0x6d, 
+	0x6d, 0x75, 0x74, 0x61, 0x74, 0x69, 0x76, 0x65, 0x20, 0x3d, 0x20, 0x74, 0x72, 0x75, 0x65, 0x2c, 
+	0x20, 0x6e, 0x65, 0x67, 0x61, 0x74, 0x65, 0x20, 0x3d, 0x20, 0x74, 0x72, 0x75, 0x65, 0x7d, 0x2c, 
+	0xa, 0x9, 0x5b, 0x27, 0x3c, 0x27, 0x5d, 0x20, 0x3d, 0x20, 0x7b, 0x27, 0x4c, 0x45, 0x53, 0x53, 
+	0x27, 0x7d, 0x2c, 0xa, 0x9, 0x5b, 0x27, 0x3c, 0x3d, 0x27, 0x5d, 0x20, 0x3d, 0x20, 0x7b, 0x27, 
+	0x4c, 0x45, 0x51, 0x55, 0x41, 0x4c, 0x27, 0x7d, 0x2c, 0xa, 0x9, 0x5b, 0x27, 0x3e, 0x27, 0x5d, 
+	0x20, 0x3d, 0x20, 0x7b, 0x27, 0x4c, 0x45, 0x53, 0x53, 0x27, 0x2c, 0x20, 0x73, 0x77, 0x61, 0x70, 
+	0x20, 0x3d, 0x20, 0x74, 0x72, 0x75, 0x65, 0x7d, 0x2c, 0xa, 0x9, 0x5b, 0x27, 0x3e, 0x3d, 0x27, 
+	0x5d, 0x20, 0x3d, 0x20, 0x7b, 0x27, 0x4c, 0x45, 0x51, 0x55, 0x41, 0x4c, 0x27, 0x2c, 0x20, 0x73, 
+	0x77, 0x61, 0x70, 0x20, 0x3d, 0x20, 0x74, 0x72, 0x75, 0x65, 0x7d, 0xa, 0x7d, 0xa, 0xa, 0x6c, 
+	0x6f, 0x63, 0x61, 0x6c, 0x20, 0x66, 0x75, 0x6e, 0x63, 0x74, 0x69, 0x6f, 0x6e, 0x20, 0x74, 0x61, 
+	0x62, 0x6c, 0x65, 0x5f, 0x63, 0x6c, 0x6f, 0x6e, 0x65, 0x28, 0x74, 0x61, 0x62, 0x29, 0xa, 0x9, 
+	0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x20, 0x74, 0x20, 0x3d, 0x20, 0x7b, 0x7d, 0xa, 0x9, 0x66, 0x6f, 
+	0x72, 0x20, 0x6b, 0x2c, 0x76, 0x20, 0x69, 0x6e, 0x20, 0x69, 0x70, 0x61, 0x69, 0x72, 0x73, 0x28, 
+	0x74, 0x61, 0x62, 0x29, 0x20, 0x64, 0x6f, 0xa, 0x9, 0x9, 0x74, 0x5b, 0x6b, 0x5d, 0x20, 0x3d, 
+	0x20, 0x76, 0xa, 0x9, 0x65, 0x6e, 0x64, 0xa, 0x9, 0x72, 0x65, 0x74, 0x75, 0x72, 0x6e, 0x20, 
+	0x74, 0xa, 0x65, 0x6e, 0x64, 0xa, 0xa, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x20, 0x66, 0x75, 0x6e, 
+	0x63, 0x74, 0x69, 0x6f, 0x6e, 0x20, 0x67, 0x65, 0x6e, 0x5f, 0x69, 0x6e, 0x73, 0x74, 0x28, 0x66, 
+	0x75, 0x6e, 0x63, 0x2c, 0x20, 0x69, 0x6e, 0x73, 0x74, 0x2c, 0x20, 0x6c, 0x69, 0x6e, 0x65, 0x2c, 
+	0x20, 0x2e, 0x2e, 0x2e, 0x29, 0xa, 0x9, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x20, 0x69, 0x6e, 0x73, 
+	0x74, 0x69, 0x64, 0x78, 0x20, 0x3d, 0x20, 0x23, 0x66, 0x75, 0x6e, 0x63, 0x2e, 0x69, 0x6e, 0x73, 
+	0x74, 0x72, 0x75, 0x63, 0x74, 0x69, 0x6f, 0x6e, 0x73, 0x20, 0x2b, 0x20, 0x31, 0xa, 0x9, 0x66, 
+	0x75, 0x6e, 0x63, 0x2e, 0x69, 0x6e, 0x73, 0x74, 0x72, 0x75, 0x63, 0x74, 0x69, 0x6f, 0x6e, 0x73, 
+	0x5b, 0x69, 0x6e, 0x73, 0x74, 0x69, 0x64, 0x78, 0x5d, 0x20, 0x3d, 0x20, 0x7b, 0x69, 0x6e, 0x73, 
+	0x74, 0x2c, 0x20, 0x2e, 0x2e, 0x2e, 0x7d, 0xa, 0x9, 0x66, 0x75, 0x6e, 0x63, 0x2e, 0x6c, 0x69, 
+	0x6e, 0x65, 0x6e, 0x72, 0x5b, 0x69, 0x6e, 0x73, 0x74, 0x69, 0x64, 0x78, 0x5d, 0x20, 0x3d, 0x20, 
+	0x6c, 0x69, 0x6e, 0x65, 0xa, 0x65, 0x6e, 0x64, 0xa, 0xa, 0x2d, 0x2d, 0x20, 0x41, 0x20, 0x63, 
+	0x61, 0x6c, 0x6c, 0x20, 0x6c, 0x65, 0x61, 0x76, 0x65, 0x73, 0x20, 0x6e, 0x72, 0x65, 0x74, 0x20, 
+	0x72, 0x65, 0x73, 0x75, 0x6c, 0x74, 0x73, 0x2c, 0x20, 0x6f, 0x6e, 0x65, 0x20, 0x62, 0x79, 0x20, 
+	0x64, 0x65, 0x66, 0x61, 0x75, 0x6c, 0x74, 0x2c, 0x20, 0x69, 0x6e, 0x20, 0x70, 0x6c, 0x61, 0x63, 
+	0x65, 0x20, 0x6f, 0x66, 0x20, 0x74, 0x68, 0x65, 0x20, 0x66, 0x75, 0x6e, 0x63, 0x74, 0x69, 0x6f, 
+	0x6e, 0xa, 0x2d, 0x2d, 0x20, 0x61, 0x6e, 0x64, 0x20, 0x69, 0x74, 0x73, 0x20, 0x61, 0x72, 0x67, 
+	0x75, 0x6d, 0x65, 0x6e, 0x74, 0x73, 0x2e, 0x20, 0x41, 0x20, 0x74, 0x61, 0x69, 0x6c, 0x20, 0x63, 
+	0x61, 0x6c, 0x6c, 0x20, 0x72, 0x65, 0x74, 0x75, 0x72, 0x6e, 0x73, 0x20, 0x77, 0x68, 0x61, 0x74, 
+	0x65, 0x76, 0x65, 0x72, 0x20, 0x69, 0x74, 0x73, 0x20, 0x63, 0x61, 0x6c, 0x6c, 0x65, 0x72, 0x20, 
+	0x61, 0x73, 0x6b, 0x65, 0x64, 0x20, 0x66, 0x6f, 0x72, 0x2e, 0xa, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 
+	0x20, 0x66, 0x75, 0x6e, 0x63, 0x74, 0x69, 0x6f, 0x6e, 0x20, 0x63, 0x61, 0x6c, 0x6c, 0x5f, 0x6f, 
+	0x72, 0x5f, 0x74, 0x61, 0x69, 0x6c, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 0x74, 0x61, 0x69, 
+	0x6c, 0x2c, 0x20, 0x6c, 0x69, 0x6e, 0x65, 0x2c, 0x20, 0x6e, 0x61, 0x72, 0x67, 0x2c, 0x20, 0x6e, 
+	0x72, 0x65, 0x74, 0x29, 0xa, 0x9, 0x6e, 0x72, 0x65, 0x74, 0x20, 0x3d, 0x20, 0x6e, 0x72, 0x65, 
+	0x74, 0x20, 0x6f, 0x72, 0x20, 0x31, 0xa, 0x9, 0x69, 0x66, 0x20, 0x74, 0x61, 0x69, 0x6c, 0x20, 
+	0x61, 0x6e, 0x64, 0x20, 0x6f, 0x70, 0x74, 0x5f, 0x74, 0x61, 0x69, 0x6c, 0x20, 0x61, 0x6e, 0x64, 
+	0x20, 0x66, 0x75, 0x6e, 0x63, 0x2e, 0x70, 0x61, 0x72, 0x65, 0x6e, 0x74, 0x20, 0x74, 0x68, 0x65, 
+	0x6e, 0xa, 0x9, 0x9, 0x61, 0x73, 0x73, 0x65, 0x72, 0x74, 0x28, 0x6e, 0x72, 0x65, 0x74, 0x20, 
+	0x3d, 0x3d, 0x20, 0x31, 0x29, 0xa, 0x9, 0x9, 0x67, 0x65, 0x6e, 0x5f, 0x69, 0x6e, 0x73, 0x74, 
+	0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 0x27, 0x54, 0x43, 0x41, 0x4c, 0x4c, 0x27, 0x2c, 0x20, 
+	0x6c, 0x69, 0x6e, 0x65, 0x2c, 0x20, 0x6e, 0x61, 0x72, 0x67, 0x29, 0xa, 0x9, 0x65, 0x6c, 0x73, 
+	0x65, 0xa, 0x9, 0x9, 0x67, 0x65, 0x6e, 0x5f, 0x69, 0x6e, 0x73, 0x74, 0x28, 0x66, 0x75, 0x6e, 
+	0x63, 0x2c, 0x20, 0x27, 0x43, 0x41, 0x4c, 0x4c, 0x27, 0x2c, 0x20, 0x6c, 0x69, 0x6e, 0x65, 0x2c, 
+	0x20, 0x6e, 0x61, 0x72, 0x67, 0x2c, 0x20, 0x6e, 0x72, 0x65, 0x74, 0x20, 0x3e, 0x20, 0x31, 0x20, 
+	0x61, 0x6e, 0x64, 0x20, 0x6e, 0x72, 0x65, 0x74, 0x20, 0x6f, 0x72, 0x20, 0x6e, 0x69, 0x6c, 0x29, 
+	0xa, 0x9, 0x65, 0x6e, 0x64, 0xa, 0x9, 0x66, 0x75, 0x6e, 0x63, 0x2e, 0x73, 0x74, 0x61, 0x63, 
+	0x6b, 0x5f, 0x70, 0x6f, 0x69, 0x6e, 0x74, 0x65, 0x72, 0x20, 0x3d, 0x20, 0x66, 0x75, 0x6e, 0x63, 
+	0x2e, 0x73, 0x74, 0x61, 0x63, 0x6b, 0x5f, 0x70, 0x6f, 0x69, 0x6e, 0x74, 0x65, 0x72, 0x20, 0x2d, 
+	0x20, 0x6e, 0x61, 0x72, 0x67, 0x20, 0x2b, 0x20, 0x6e, 0x72, 0x65, 0x74, 0x20, 0x2d, 0x20, 0x31, 
+	0xa, 0x9, 0x61, 0x73, 0x73, 0x65, 0x72, 0x74, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2e, 0x73, 0x74, 
+	0x61, 0x63, 0x6b, 0x5f, 0x70, 0x6f, 0x69, 0x6e, 0x74, 0x65, 0x72, 0x20, 0x3e, 0x20, 0x30, 0x29, 
+	0xa, 0x65, 0x6e, 0x64, 0xa, 0xa, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x20, 0x66, 0x75, 0x6e, 0x63, 
+	0x74, 0x69, 0x6f, 0x6e, 0x20, 0x67, 0x65, 0x6e, 0x5f, 0x70, 0x6f, 0x70, 0x28, 0x66, 0x75, 0x6e, 
+	0x63, 0x2c, 0x20, 0x6e, 0x75, 0x6d, 0x29, 0xa, 0x9, 0x6e, 0x75, 0x6d, 0x20, 0x3d, 0x20, 0x6e, 
+	0x75, 0x6d, 0x20, 0x6f, 0x72, 0x20, 0x31, 0xa, 0x9, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x20, 0x69, 
+	0x64, 0x78, 0x20, 0x3d, 0x20, 0x23, 0x66, 0x75, 0x6e, 0x63, 0x2e, 0x69, 0x6e, 0x73, 0x74, 0x72, 
+	0x75, 0x63, 0x74, 0x69, 0x6f, 0x6e, 0x73, 0xa, 0x9, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x20, 0x6c, 
+	0x69, 0x6e, 0x65, 0x20, 0x3d, 0x20, 0x69, 0x64, 0x78, 0x20, 0x3e, 0x20, 0x30, 0x20, 0x61, 0x6e, 
+	0x64, 0x20, 0x66, 0x75, 0x6e, 0x63, 0x2e, 0x6c, 0x69, 0x6e, 0x65, 0x6e, 0x72, 0x5b, 0x69, 0x64, 
+	0x78, 0x5d, 0x20, 0x6f, 0x72, 0x20, 0x2d, 0x31, 0xa, 0x9, 0x67, 0x65, 0x6e, 0x5f, 0x69, 0x6e, 
+	0x73, 0x74, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 0x27, 0x50, 0x4f, 0x50, 0x27, 0x2c, 0x20, 
+	0x6c, 0x69, 0x6e, 0x65, 0x2c, 0x20, 0x6e, 0x75, 0x6d, 0x29, 0xa, 0x9, 0x66, 0x75, 0x6e, 0x63, 
+	0x2e, 0x73, 0x74, 0x61, 0x63, 0x6b, 0x5f, 0x70, 0x6f, 0x69, 0x6e, 0x74, 0x65, 0x72, 0x20, 0x3d, 
+	0x20, 0x66, 0x75, 0x6e, 0x63, 0x2e, 0x73, 0x74, 0x61, 0x63, 0x6b, 0x5f, 0x70, 0x6f, 0x69, 0x6e, 
+	0x74, 0x65, 0x72, 0x20, 0x2d, 0x20, 0x6e, 0x75, 0x6d, 0xa, 0x9, 0x61, 0x73, 0x73, 0x65, 0x72, 
+	0x74, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2e, 0x73, 0x74, 0x61, 0x63, 0x6b, 0x5f, 0x70, 0x6f, 0x69, 
+	0x6e, 0x74, 0x65, 0x72, 0x20, 0x3e, 0x3d, 0x20, 0x30, 0x29, 0xa, 0x65, 0x6e, 0x64, 0xa, 0xa, 
+	0x2d, 0x2d, 0x20, 0x41, 0x20, 0x27, 0x72, 0x65, 0x63, 0x27, 0x20, 0x63, 0x61, 0x6c, 0x6c, 0x20, 
+	0x69, 0x6e, 0x20, 0x74, 0x61, 0x69, 0x6c, 0x20, 0x70, 0x6f, 0x73, 0x69, 0x74, 0x69, 0x6f, 0x6e, 
+	0x20, 0x72, 0x65, 0x75, 0x73, 0x65, 0x73, 0x20, 0x74, 0x68, 0x65, 0x20, 0x66, 0x72, 0x61, 0x6d, 
+	0x65, 0x2e, 0x20, 0x54, 0x68, 0x65, 0x20, 0x61, 0x72, 0x67, 0x75, 0x6d, 0x65, 0x6e, 0x74, 0x73, 
+	0x20, 0x61, 0x72, 0x65, 0xa, 0x2d, 0x2d, 0x20, 0x73, 0x74, 0x6f, 0x72, 0x65, 0x64, 0x20, 0x6f, 
+	0x76, 0x65, 0x72, 0x20, 0x74, 0x68, 0x65, 0x20, 0x63, 0x75, 0x72, 0x72, 0x65, 0x6e, 0x74, 0x20, 
+	0x6f, 0x6e, 0x65, 0x73, 0x20, 0x61, 0x6e, 0x64, 0x20, 0x63, 0x6f, 0x6e, 0x74, 0x72, 0x6f, 0x6c, 
+	0x20, 0x6a, 0x75, 0x6d, 0x70, 0x73, 0x20, 0x74, 0x6f, 0x20, 0x74, 0x68, 0x65, 0x20, 0x66, 0x75, 
+	0x6e, 0x63, 0x74, 0x69, 0x6f, 0x6e, 0x20, 0x73, 0x74, 0x61, 0x72, 0x74, 0x2e, 0xa, 0x6c, 0x6f, 
+	0x63, 0x61, 0x6c, 0x20, 0x66, 0x75, 0x6e, 0x63, 0x74, 0x69, 0x6f, 0x6e, 0x20, 0x69, 0x73, 0x5f, 
+	0x74, 0x61, 0x69, 0x6c, 0x5f, 0x72, 0x65, 0x63, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 0x61, 
+	0x73, 0x74, 0x2c, 0x20, 0x74, 0x61, 0x69, 0x6c, 0x29, 0xa, 0x9, 0x72, 0x65, 0x74, 0x75, 0x72, 
+	0x6e, 0x20, 0x74, 0x61, 0x69, 0x6c, 0x20, 0x61, 0x6e, 0x64, 0x20, 0x6f, 0x70, 0x74, 0x5f, 0x74, 
+	0x61, 0x69, 0x6c, 0x20, 0x61, 0x6e, 0x64, 0x20, 0x6f, 0x70, 0x74, 0x5f, 0x74, 0x61, 0x69, 0x6c, 
+	0x72, 0x65, 0x63, 0x20, 0x61, 0x6e, 0x64, 0x20, 0x66, 0x75, 0x6e, 0x63, 0x2e, 0x70, 0x61, 0x72, 
+	0x65, 0x6e, 0x74, 0x20, 0x61, 0x6e, 0x64, 0x20, 0x6e, 0x6f, 0x74, 0x20, 0x66, 0x75, 0x6e, 0x63, 
+	0x2e, 0x76, 0x61, 0x72, 0x67, 0xa, 0x9, 0x9, 0x61, 0x6e, 0x64, 0x20, 0x61, 0x73, 0x74, 0x2e, 
+	0x66, 0x75, 0x6e, 0x63, 0x2e, 0x74, 0x79, 0x70, 0x65, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x69, 0x64, 
+	0x65, 0x6e, 0x74, 0x69, 0x66, 0x69, 0x65, 0x72, 0x27, 0x20, 0x61, 0x6e, 0x64, 0x20, 0x61, 0x73, 
+	0x74, 0x2e, 0x66, 0x75, 0x6e, 0x63, 0x2e, 0x76, 0x61, 0x6c, 0x75, 0x65, 0x20, 0x3d, 0x3d, 0x20, 
+	0x27, 0x72, 0x65, 0x63, 0x27, 0xa, 0x9, 0x9, 0x61, 0x6e, 0x64, 0x20, 0x23, 0x61, 0x73, 0x74, 
+	0x2e, 0x61, 0x72, 0x67, 0x73, 0x20, 0x3d, 0x3d, 0x20, 0x66, 0x75, 0x6e, 0x63, 0x2e, 0x6e, 0x75, 
+	0x6d, 0x5f, 0x61, 0x72, 0x67, 0x73, 0xa, 0x65, 0x6e, 0x64, 0xa, 0xa, 0x6c, 0x6f, 0x63, 0x61, 
+	0x6c, 0x20, 0x66, 0x75, 0x6e, 0x63, 0x74, 0x69, 0x6f, 0x6e, 0x20, 0x67, 0x65, 0x6e, 0x5f, 0x74, 
+	0x61, 0x69, 0x6c, 0x5f, 0x72, 0x65, 0x63, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 0x61, 0x73, 
+	0x74, 0x29, 0xa, 0x9, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x20, 0x73, 0x74, 0x61, 0x63, 0x6b, 0x20, 
+	0x3d, 0x20, 0x66, 0x75, 0x6e, 0x63, 0x2e, 0x73, 0x74, 0x61, 0x63, 0x6b, 0x5f, 0x70, 0x6f, 0x69, 
+	0x6e, 0x74, 0x65, 0x72, 0xa, 0x9, 0x66, 0x6f, 0x72, 0x20, 0x5f, 0x2c, 0x61, 0x72, 0x67, 0x20, 
+	0x69, 0x6e, 0x20, 0x69, 0x70, 0x61, 0x69, 0x72, 0x73, 0x28, 0x61, 0x73, 0x74, 0x2e, 0x61, 0x72, 
+	0x67, 0x73, 0x29, 0x20, 0x64, 0x6f, 0xa, 0x9, 0x9, 0x67, 0x65, 0x6e, 0x28, 0x66, 0x75, 0x6e, 
+	0x63, 0x2c, 0x20, 0x61, 0x72, 0x67, 0x29, 0xa, 0x9, 0x65, 0x6e, 0x64, 0xa, 0x9, 0x67, 0x65, 
+	0x6e, 0x5f, 0x69, 0x6e, 0x73, 0x74, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 0x27, 0x53, 0x54, 
+	0x4f, 0x52, 0x45, 0x27, 0x2c, 0x20, 0x61, 0x73, 0x74, 0x2e, 0x6c, 0x69, 0x6e, 0x65, 0x2c, 0x20, 
+	0x23, 0x61, 0x73, 0x74, 0x2e, 0x61, 0x72, 0x67, 0x73, 0x2c, 0x20, 0x31, 0x29, 0xa, 0x9, 0x67, 
+	0x65, 0x6e, 0x5f, 0x69, 0x6e, 0x73, 0x74, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 0x27, 0x4a, 
+	0x4d, 0x50, 0x27, 0x2c, 0x20, 0x61, 0x73, 0x74, 0x2e, 0x6c, 0x69, 0x6e, 0x65, 0x2c, 0x20, 0x30, 
+	0x2c, 0x20, 0x30, 0x29, 0xa, 0x9, 0x66, 0x75, 0x6e, 0x63, 0x2e, 0x73, 0x74, 0x61, 0x63, 0x6b, 
+	0x5f, 0x70, 0x6f, 0x69, 0x6e, 0x74, 0x65, 0x72, 0x20, 0x3d, 0x20, 0x73, 0x74, 0x61, 0x63, 0x6b, 
+	0x20, 0x2b, 0x20, 0x31, 0xa, 0x65, 0x6e, 0x64, 0xa, 0xa, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x20, 
+	0x66, 0x75, 0x6e, 0x63, 0x74, 0x69, 0x6f, 0x6e, 0x20, 0x67, 0x65, 0x6e, 0x5f, 0x63, 0x61, 0x6c, 
+	0x6c, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 0x61, 0x73, 0x74, 0x2c, 0x20, 0x74, 0x61, 0x69, 
+	0x6c, 0x2c, 0x20, 0x6e, 0x72, 0x65, 0x74, 0x29, 0xa, 0x9, 0x61, 0x73, 0x73, 0x65, 0x72, 0x74, 
+	0x28, 0x61, 0x73, 0x74, 0x2e, 0x74, 0x79, 0x70, 0x65, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x63, 0x61, 
+	0x6c, 0x6c, 0x27, 0x29, 0xa, 0x9, 0x69, 0x66, 0x20, 0x69, 0x73, 0x5f, 0x74, 0x61, 0x69, 0x6c, 
+	0x5f, 0x72, 0x65, 0x63, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 0x61, 0x73, 0x74, 0x2c, 0x20, 
+	0x74, 0x61, 0x69, 0x6c, 0x29, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x9, 0x9, 0x67, 0x65, 0x6e, 
+	0x5f, 0x74, 0x61, 0x69, 0x6c, 0x5f, 0x72, 0x65, 0x63, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 
+	0x61, 0x73, 0x74, 0x29, 0xa, 0x9, 0x9, 0x72, 0x65, 0x74, 0x75, 0x72, 0x6e, 0xa, 0x9, 0x65, 
+	0x6e, 0x64, 0xa, 0xa, 0x9, 0x67, 0x65, 0x6e, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 0x61, 
 	0x73, 0x74, 0x2e, 0x66, 0x75, 0x6e, 0x63, 0x29, 0xa, 0x9, 0x66, 0x6f, 0x72, 0x20, 0x5f, 0x2c, 
 	0x61, 0x72, 0x67, 0x20, 0x69, 0x6e, 0x20, 0x69, 0x70, 0x61, 0x69, 0x72, 0x73, 0x28, 0x61, 0x73, 
 	0x74, 0x2e, 0x61, 0x72, 0x67, 0x73, 0x29, 0x20, 0x64, 0x6f, 0xa, 0x9, 0x9, 0x67, 0x65, 0x6e, 
 	0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 0x61, 0x72, 0x67, 0x29, 0xa, 0x9, 0x65, 0x6e, 0x64, 
 	0xa, 0x9, 0x63, 0x61, 0x6c, 0x6c, 0x5f, 0x6f, 0x72, 0x5f, 0x74, 0x61, 0x69, 0x6c, 0x28, 0x66, 
 	0x75, 0x6e, 0x63, 0x2c, 0x20, 0x74, 0x61, 0x69, 0x6c, 0x2c, 0x20, 0x61, 0x73, 0x74, 0x2e, 0x6c, 
-	0x69, 0x6e, 0x65, 0x2c, 0x20, 0x23, 0x61, 0x73, 0x74, 0x2e, 0x61, 0x72, 0x67, 0x73, 0x29, 0xa, 
-	0x65, 0x6e, 0x64, 0xa, 0xa, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x20, 0x66, 0x75, 0x6e, 0x63, 0x74, 
-	0x69, 0x6f, 0x6e, 0x20, 0x66, 0x69, 0x6e, 0x64, 0x5f, 0x6c, 0x61, 0x62, 0x6c, 0x65, 0x28, 0x66, 
-	0x75, 0x6e, 0x63, 0x2c, 0x20, 0x6e, 0x61, 0x6d, 0x65, 0x29, 0xa, 0x9, 0x66, 0x6f, 0x72, 0x20, 
-	0x69, 0x20, 0x3d, 0x20, 0x23, 0x66, 0x75, 0x6e, 0x63, 0x2e, 0x6c, 0x61, 0x62, 0x6c, 0x65, 0x73, 
-	0x2c, 0x20, 0x31, 0x2c, 0x20, 0x2d, 0x31, 0x20, 0x64, 0x6f, 0xa, 0x9, 0x9, 0x6c, 0x6f, 0x63, 
-	0x61, 0x6c, 0x20, 0x76, 0x20, 0x3d, 0x20, 0x66, 0x75, 0x6e, 0x63, 0x2e, 0x6c, 0x61, 0x62, 0x6c, 
-	0x65, 0x73, 0x5b, 0x69, 0x5d, 0xa, 0x9, 0x9, 0x69, 0x66, 0x20, 0x76, 0x5b, 0x31, 0x5d, 0x20, 
-	0x3d, 0x3d, 0x20, 0x6e, 0x61, 0x6d, 0x65, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x9, 0x9, 0x9, 
-	0x72, 0x65, 0x74, 0x75, 0x72, 0x6e, 0x20, 0x76, 0xa, 0x9, 0x9, 0x65, 0x6e, 0x64, 0xa, 0x9, 
-	0x65, 0x6e, 0x64, 0xa, 0x65, 0x6e, 0x64, 0xa, 0xa, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x20, 0x66, 
-	0x75, 0x6e, 0x63, 0x74, 0x69, 0x6f, 0x6e, 0x20, 0x66, 0x69, 0x6e, 0x64, 0x5f, 0x75, 0x70, 0x28, 
-	0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 0x6e, 0x61, 0x6d, 0x65, 0x29, 0xa, 0x9, 0x6c, 0x6f, 0x63, 
-	0x61, 0x6c, 0x20, 0x69, 0x20, 0x3d, 0x20, 0x30, 0xa, 0x9, 0x77, 0x68, 0x69, 0x6c, 0x65, 0x20, 
-	0x66, 0x75, 0x6e, 0x63, 0x20, 0x64, 0x6f, 0xa, 0x9, 0x9, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x20, 
-	0x6c, 0x61, 0x62, 0x6c, 0x65, 0x20, 0x3d, 0x20, 0x66, 0x69, 0x6e, 0x64, 0x5f, 0x6c, 0x61, 0x62, 
-	0x6c, 0x65, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 0x6e, 0x61, 0x6d, 0x65, 0x29, 0xa, 0x9, 
-	0x9, 0x69, 0x66, 0x20, 0x6c, 0x61, 0x62, 0x6c, 0x65, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x9, 
-	0x9, 0x9, 0x72, 0x65, 0x74, 0x75, 0x72, 0x6e, 0x20, 0x69, 0x2c, 0x20, 0x6c, 0x61, 0x62, 0x6c, 
-	0x65, 0x5b, 0x32, 0x5d, 0xa, 0x9, 0x9, 0x65, 0x6e, 0x64, 0xa, 0x9, 0x9, 0x69, 0x20, 0x3d, 
-	0x20, 0x69, 0x20, 0x2b, 0x20, 0x31, 0xa, 0x9, 0x9, 0x66, 0x75, 0x6e, 0x63, 0x20, 0x3d, 0x20, 
-	0x66, 0x75, 0x6e, 0x63, 0x2e, 0x70, 0x61, 0x72, 0x65, 0x6e, 0x74, 0xa, 0x9, 0x65, 0x6e, 0x64, 
-	0xa, 0x65, 0x6e, 0x64, 0xa, 0xa, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x20, 0x66, 0x75, 0x6e, 0x63, 
-	0x74, 0x69, 0x6f, 0x6e, 0x20, 0x70, 0x75, 0x73, 0x68, 0x5f, 0x63, 0x6f, 0x6e, 0x73, 0x74, 0x28, 
-	0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 0x76, 0x61, 0x6c, 0x75, 0x65, 0x29, 0xa, 0x9, 0x66, 0x6f, 
-	0x72, 0x20, 0x69, 0x2c, 0x76, 0x20, 0x69, 0x6e, 0x20, 0x69, 0x70, 0x61, 0x69, 0x72, 0x73, 0x28, 
-	0x66, 0x75, 0x6e, 0x63, 0x2e, 0x63, 0x6f, 0x6e, 0x73, 0x74, 0x61, 0x6e, 0x74, 0x73, 0x29, 0x20, 
-	0x64, 0x6f, 0xa, 0x9, 0x9, 0x69, 0x66, 0x20, 0x76, 0x20, 0x3d, 0x3d, 0x20, 0x76, 0x61, 0x6c, 
-	0x75, 0x65, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x9, 0x9, 0x9, 0x72, 0x65, 0x74, 0x75, 0x72, 
-	0x6e, 0x20, 0x69, 0x20, 0x2d, 0x20, 0x31, 0xa, 0x9, 0x9, 0x65, 0x6e, 0x64, 0xa, 0x9, 0x65, 
-	0x6e, 0x64, 0xa, 0x9, 0x74, 0x61, 0x62, 0x6c, 0x65, 0x2e, 0x69, 0x6e, 0x73, 0x65, 0x72, 0x74, 
-	0x28, 0x66, 0x75, 0x6e, 0x63, 0x2e, 0x63, 0x6f, 0x6e, 0x73, 0x74, 0x61, 0x6e, 0x74, 0x73, 0x2c, 
-	0x20, 0x76, 0x61, 0x6c, 0x75, 0x65, 0x29, 0xa, 0x9, 0x72, 0x65, 0x74, 0x75, 0x72, 0x6e, 0x20, 
-	0x23, 0x66, 0x75, 0x6e, 0x63, 0x2e, 0x63, 0x6f, 0x6e, 0x73, 0x74, 0x61, 0x6e, 0x74, 0x73, 0x20, 
-	0x2d, 0x20, 0x31, 0xa, 0x65, 0x6e, 0x64, 0xa, 0xa, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x20, 0x66, 
-	0x75, 0x6e, 0x63, 0x74, 0x69, 0x6f, 0x6e, 0x20, 0x67, 0x65, 0x6e, 0x5f, 0x63, 0x6f, 0x6e, 0x73, 
-	0x74, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 0x63, 0x6f, 0x6e, 0x73, 0x74, 0x29, 0xa, 0x9, 
-	0x61, 0x73, 0x73, 0x65, 0x72, 0x74, 0x28, 0x63, 0x6f, 0x6e, 0x73, 0x74, 0x2e, 0x74, 0x79, 0x70, 
-	0x65, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x6e, 0x75, 0x6d, 0x62, 0x65, 0x72, 0x27, 0x20, 0x6f, 0x72, 
-	0x20, 0x63, 0x6f, 0x6e, 0x73, 0x74, 0x2e, 0x74, 0x79, 0x70, 0x65, 0x20, 0x3d, 0x3d, 0x20, 0x27, 
-	0x62, 0x6f, 0x6f, 0x6c, 0x65, 0x61, 0x6e, 0x27, 0x20, 0x6f, 0x72, 0x20, 0x63, 0x6f, 0x6e, 0x73, 
-	0x74, 0x2e, 0x74, 0x79, 0x70, 0x65, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x73, 0x74, 0x72, 0x69, 0x6e, 
-	0x67, 0x27, 0x29, 0xa, 0x9, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x20, 0x63, 0x6f, 0x6e, 0x73, 0x74, 
-	0x69, 0x64, 0x20, 0x3d, 0x20, 0x70, 0x75, 0x73, 0x68, 0x5f, 0x63, 0x6f, 0x6e, 0x73, 0x74, 0x28, 
-	0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 0x63, 0x6f, 0x6e, 0x73, 0x74, 0x2e, 0x76, 0x61, 0x6c, 0x75, 
-	0x65, 0x29, 0xa, 0x9, 0x67, 0x65, 0x6e, 0x5f, 0x69, 0x6e, 0x73, 0x74, 0x28, 0x66, 0x75, 0x6e, 
-	0x63, 0x2c, 0x20, 0x27, 0x50, 0x55, 0x53, 0x48, 0x27, 0x2c, 0x20, 0x63, 0x6f, 0x6e, 0x73, 0x74, 
-	0x2e, 0x6c, 0x69, 0x6e, 0x65, 0x2c, 0x20, 0x63, 0x6f, 0x6e, 0x73, 0x74, 0x69, 0x64, 0x29, 0xa, 
-	0x9, 0x66, 0x75, 0x6e, 0x63, 0x2e, 0x73, 0x74, 0x61, 0x63, 0x6b, 0x5f, 0x70, 0x6f, 0x69, 0x6e, 
-	0x74, 0x65, 0x72, 0x20, 0x3d, 0x20, 0x66, 0x75, 0x6e, 0x63, 0x2e, 0x73, 0x74, 0x61, 0x63, 0x6b, 
-	0x5f, 0x70, 0x6f, 0x69, 0x6e, 0x74, 0x65, 0x72, 0x20, 0x2b, 0x20, 0x31, 0xa, 0x65, 0x6e, 0x64, 
-	0xa, 0xa, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x20, 0x66, 0x75, 0x6e, 0x63, 0x74, 0x69, 0x6f, 0x6e, 
-	0x20, 0x67, 0x65, 0x6e, 0x5f, 0x66, 0x65, 0x74, 0x63, 0x68, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 
-	0x20, 0x69, 0x64, 0x65, 0x6e, 0x74, 0x29, 0xa, 0x9, 0x69, 0x66, 0x20, 0x66, 0x75, 0x6e, 0x63, 
-	0x2e, 0x70, 0x61, 0x72, 0x65, 0x6e, 0x74, 0x20, 0x61, 0x6e, 0x64, 0x20, 0x69, 0x64, 0x65, 0x6e, 
-	0x74, 0x2e, 0x76, 0x61, 0x6c, 0x75, 0x65, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x72, 0x65, 0x63, 0x27, 
-	0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x9, 0x9, 0x67, 0x65, 0x6e, 0x5f, 0x69, 0x6e, 0x73, 0x74, 
-	0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 0x27, 0x4c, 0x4f, 0x41, 0x44, 0x27, 0x2c, 0x20, 0x69, 
-	0x64, 0x65, 0x6e, 0x74, 0x2e, 0x6c, 0x69, 0x6e, 0x65, 0x2c, 0x20, 0x30, 0x29, 0xa, 0x9, 0x65, 
-	0x6c, 0x73, 0x65, 0xa, 0x9, 0x9, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x20, 0x6c, 0x76, 0x2c, 0x20, 
-	0x69, 0x64, 0x20, 0x3d, 0x20, 0x66, 0x69, 0x6e, 0x64, 0x5f, 0x75, 0x70, 0x28, 0x66, 0x75, 0x6e, 
-	0x63, 0x2c, 0x20, 0x69, 0x64, 0x65, 0x6e, 0x74, 0x2e, 0x76, 0x61, 0x6c, 0x75, 0x65, 0x29, 0xa, 
-	0x9, 0x9, 0x69, 0x66, 0x20, 0x6e, 0x6f, 0x74, 0x20, 0x6c, 0x76, 0x20, 0x74, 0x68, 0x65, 0x6e, 
-	0xa, 0x9, 0x9, 0x9, 0x67, 0x65, 0x6e, 0x5f, 0x69, 0x6e, 0x73, 0x74, 0x28, 0x66, 0x75, 0x6e, 
-	0x63, 0x2c, 0x20, 0x27, 0x47, 0x45, 0x54, 0x47, 0x4c, 0x4f, 0x42, 0x41, 0x4c, 0x27, 0x2c, 0x20, 
-	0x69, 0x64, 0x65, 0x6e, 0x74, 0x2e, 0x6c, 0x69, 0x6e, 0x65, 0x2c, 0x20, 0x70, 0x75, 0x73, 0x68, 
-	0x5f, 0x63, 0x6f, 0x6e, 0x73, 0x74, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 0x69, 0x64, 0x65, 
-	0x6e, 0x74, 0x2e, 0x76, 0x61, 0x6c, 0x75, 0x65, 0x29, 0x29, 0xa, 0x9, 0x9, 0x65, 0x6c, 0x73, 
-	0x65, 0x69, 0x66, 0x20, 0x6c, 0x76, 0x20, 0x3d, 0x3d, 0x20, 0x30, 0x20, 0x74, 0x68, 0x65, 0x6e, 
-	0xa, 0x9, 0x9, 0x9, 0x67, 0x65, 0x6e, 0x5f, 0x69, 0x6e, 0x73, 0x74, 0x28, 0x66, 0x75, 0x6e, 
-	0x63, 0x2c, 0x20, 0x27, 0x4c, 0x4f, 0x41, 0x44, 0x27, 0x2c, 0x20, 0x69, 0x64, 0x65, 0x6e, 0x74, 
-	0x2e, 0x6c, 0x69, 0x6e, 0x65, 0x2c, 0x20, 0x69, 0x64, 0x20, 0x2b, 0x20, 0x31, 0x29, 0xa, 0x9, 
-	0x9, 0x65, 0x6c, 0x73, 0x65, 0xa, 0x9, 0x9, 0x9, 0x74, 0x61, 0x62, 0x6c, 0x65, 0x2e, 0x69, 
-	0x6e, 0x73, 0x65, 0x72, 0x74, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2e, 0x75, 0x70, 0x2c, 0x20, 0x7b, 
-	0x6c, 0x76, 0x2c, 0x20, 0x69, 0x64, 0x7d, 0x29, 0xa, 0x9, 0x9, 0x9, 0x67, 0x65, 0x6e, 0x5f, 
-	0x69, 0x6e, 0x73, 0x74, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 0x27, 0x4c, 0x55, 0x50, 0x27, 
-	0x2c, 0x20, 0x69, 0x64, 0x65, 0x6e, 0x74, 0x2e, 0x6c, 0x69, 0x6e, 0x65, 0x2c, 0x20, 0x23, 0x66, 
-	0x75, 0x6e, 0x63, 0x2e, 0x75, 0x70, 0x20, 0x2d, 0x20, 0x31, 0x29, 0xa, 0x9, 0x9, 0x65, 0x6e, 
-	0x64, 0xa, 0x9, 0x65, 0x6e, 0x64, 0xa, 0x9, 0x66, 0x75, 0x6e, 0x63, 0x2e, 0x73, 0x74, 0x61, 
-	0x63, 0x6b, 0x5f, 0x70, 0x6f, 0x69, 0x6e, 0x74, 0x65, 0x72, 0x20, 0x3d, 0x20, 0x66, 0x75, 0x6e, 
-	0x63, 0x2e, 0x73, 0x74, 0x61, 0x63, 0x6b, 0x5f, 0x70, 0x6f, 0x69, 0x6e, 0x74, 0x65, 0x72, 0x20, 
-	0x2b, 0x20, 0x31, 0xa, 0x65, 0x6e, 0x64, 0xa, 0xa, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x20, 0x66, 
-	0x75, 0x6e, 0x63, 0x74, 0x69, 0x6f, 0x6e, 0x20, 0x67, 0x65, 0x6e, 0x5f, 0x6f, 0x70, 0x65, 0x72, 
-	0x61, 0x74, 0x6f, 0x72, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 0x61, 0x73, 0x74, 0x2c, 0x20, 
-	0x74, 0x61, 0x69, 0x6c, 0x29, 0xa, 0x9, 0x61, 0x73, 0x73, 0x65, 0x72, 0x74, 0x28, 0x61, 0x73, 
-	0x74, 0x2e, 0x74, 0x79, 0x70, 0x65, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x6f, 0x70, 0x65, 0x72, 0x61, 
-	0x74, 0x6f, 0x72, 0x27, 0x29, 0xa, 0x9, 0x69, 0x66, 0x20, 0x61, 0x73, 0x74, 0x2e, 0x6f, 0x70, 
-	0x65, 0x72, 0x61, 0x74, 0x6f, 0x72, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x3d, 0x27, 0x20, 0x74, 0x68, 
-	0x65, 0x6e, 0xa, 0x9, 0x9, 0x61, 0x73, 0x73, 0x65, 0x72, 0x74, 0x28, 0x61, 0x73, 0x74, 0x2e, 
-	0x6c, 0x65, 0x66, 0x74, 0x2e, 0x74, 0x79, 0x70, 0x65, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x69, 0x64, 
-	0x65, 0x6e, 0x74, 0x69, 0x66, 0x69, 0x65, 0x72, 0x27, 0x29, 0xa, 0x9, 0x9, 0x74, 0x61, 0x62, 
-	0x6c, 0x65, 0x2e, 0x69, 0x6e, 0x73, 0x65, 0x72, 0x74, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2e, 0x6c, 
-	0x61, 0x62, 0x6c, 0x65, 0x73, 0x2c, 0x20, 0x7b, 0x61, 0x73, 0x74, 0x2e, 0x6c, 0x65, 0x66, 0x74, 
-	0x2e, 0x76, 0x61, 0x6c, 0x75, 0x65, 0x2c, 0x20, 0x66, 0x75, 0x6e, 0x63, 0x2e, 0x73, 0x74, 0x61, 
-	0x63, 0x6b, 0x5f, 0x70, 0x6f, 0x69, 0x6e, 0x74, 0x65, 0x72, 0x7d, 0x29, 0xa, 0x9, 0x9, 0x67, 
-	0x65, 0x6e, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 0x61, 0x73, 0x74, 0x2e, 0x72, 0x69, 0x67, 
-	0x68, 0x74, 0x2c, 0x20, 0x74, 0x61, 0x69, 0x6c, 0x29, 0xa, 0x9, 0x9, 0x67, 0x65, 0x6e, 0x5f, 
-	0x69, 0x6e, 0x73, 0x74, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 0x27, 0x4c, 0x4f, 0x41, 0x44, 
-	0x27, 0x2c, 0x20, 0x61, 0x73, 0x74, 0x2e, 0x6c, 0x69, 0x6e, 0x65, 0x2c, 0x20, 0x66, 0x75, 0x6e, 
-	0x63, 0x2e, 0x73, 0x74, 0x61, 0x63, 0x6b, 0x5f, 0x70, 0x6f, 0x69, 0x6e, 0x74, 0x65, 0x72, 0x29, 
-	0xa, 0x9, 0x9, 0x66, 0x75, 0x6e, 0x63, 0x2e, 0x73, 0x74, 0x61, 0x63, 0x6b, 0x5f, 0x70, 0x6f, 
-	0x69, 0x6e, 0x74, 0x65, 0x72, 0x20, 0x3d, 0x20, 0x66, 0x75, 0x6e, 0x63, 0x2e, 0x73, 0x74, 0x61, 
-	0x63, 0x6b, 0x5f, 0x70, 0x6f, 0x69, 0x6e, 0x74, 0x65, 0x72, 0x20, 0x2b, 0x20, 0x31, 0xa, 0x9, 
-	0x9, 0x72, 0x65, 0x74, 0x75, 0x72, 0x6e, 0xa, 0x9, 0x65, 0x6c, 0x73, 0x65, 0x69, 0x66, 0x20, 
-	0x61, 0x73, 0x74, 0x2e, 0x6f, 0x70, 0x65, 0x72, 0x61, 0x74, 0x6f, 0x72, 0x20, 0x3d, 0x3d, 0x20, 
-	0x27, 0x3a, 0x27, 0x20, 0x6f, 0x72, 0x20, 0x61, 0x73, 0x74, 0x2e, 0x6f, 0x70, 0x65, 0x72, 0x61, 
-	0x74, 0x6f, 0x72, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x2e, 0x2e, 0x27, 0x20, 0x74, 0x68, 0x65, 0x6e, 
-	0xa, 0x9, 0x9, 0x67, 0x65, 0x6e, 0x5f, 0x69, 0x6e, 0x73, 0x74, 0x28, 0x66, 0x75, 0x6e, 0x63, 
-	0x2c, 0x20, 0x27, 0x47, 0x45, 0x54, 0x47, 0x4c, 0x4f, 0x42, 0x41, 0x4c, 0x27, 0x2c, 0x20, 0x61, 
-	0x73, 0x74, 0x2e, 0x6c, 0x69, 0x6e, 0x65, 0x2c, 0x20, 0x70, 0x75, 0x73, 0x68, 0x5f, 0x63, 0x6f, 
-	0x6e, 0x73, 0x74, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 0x28, 0x61, 0x73, 0x74, 0x2e, 0x6f, 
-	0x70, 0x65, 0x72, 0x61, 0x74, 0x6f, 0x72, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x2e, 0x2e, 0x27, 0x29, 
-	0x20, 0x61, 0x6e, 0x64, 0x20, 0x27, 0x72, 0x61, 0x6e, 0x67, 0x65, 0x27, 0x20, 0x6f, 0x72, 0x20, 
-	0x27, 0x63, 0x6f, 0x6e, 0x73, 0x27, 0x29, 0x29, 0xa, 0x9, 0x9, 0x66, 0x75, 0x6e, 0x63, 0x2e, 
-	0x73, 0x74, 0x61, 0x63, 0x6b, 0x5f, 0x70, 0x6f, 0x69, 0x6e, 0x74, 0x65, 0x72, 0x20, 0x3d, 0x20, 
-	0x66, 0x75, 0x6e, 0x63, 0x2e, 0x73, 0x74, 0x61, 0x63, 0x6b, 0x5f, 0x70, 0x6f, 0x69, 0x6e, 0x74, 
-	0x65, 0x72, 0x20, 0x2b, 0x20, 0x31, 0xa, 0x9, 0x9, 0x67, 0x65, 0x6e, 0x28, 0x66, 0x75, 0x6e, 
-	0x63, 0x2c, 0x20, 0x61, 0x73, 0x74, 0x2e, 0x6c, 0x65, 0x66, 0x74, 0x29, 0xa, 0x9, 0x9, 0x67, 
-	0x65, 0x6e, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 0x61, 0x73, 0x74, 0x2e, 0x72, 0x69, 0x67, 
-	0x68, 0x74, 0x29, 0xa, 0x9, 0x9, 0x63, 0x61, 0x6c, 0x6c, 0x5f, 0x6f, 0x72, 0x5f, 0x74, 0x61, 
-	0x69, 0x6c, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 0x74, 0x61, 0x69, 0x6c, 0x2c, 0x20, 0x61, 
-	0x73, 0x74, 0x2e, 0x6c, 0x69, 0x6e, 0x65, 0x2c, 0x20, 0x32, 0x29, 0xa, 0x9, 0x9, 0x72, 0x65, 
-	0x74, 0x75, 0x72, 0x6e, 0xa, 0x9, 0x65, 0x6c, 0x73, 0x65, 0x69, 0x66, 0x20, 0x61, 0x73, 0x74, 
-	0x2e, 0x6f, 0x70, 0x65, 0x72, 0x61, 0x74, 0x6f, 0x72, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x2e, 0x27, 
-	0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x9, 0x9, 0x67, 0x65, 0x6e, 0x28, 0x66, 0x75, 0x6e, 0x63, 
+	0x69, 0x6e, 0x65, 0x2c, 0x20, 0x23, 0x61, 0x73, 0x74, 0x2e, 0x61, 0x72, 0x67, 0x73, 0x2c, 0x20, 
+	0x6e, 0x72, 0x65, 0x74, 0x29, 0xa, 0x65, 0x6e, 0x64, 0xa, 0xa, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 
+	0x20, 0x66, 0x75, 0x6e, 0x63, 0x74, 0x69, 0x6f, 0x6e, 0x20, 0x66, 0x69, 0x6e, 0x64, 0x5f, 0x6c, 
+	0x61, 0x62, 0x6c, 0x65, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 0x6e, 0x61, 0x6d, 0x65, 0x29, 
+	0xa, 0x9, 0x66, 0x6f, 0x72, 0x20, 0x69, 0x20, 0x3d, 0x20, 0x23, 0x66, 0x75, 0x6e, 0x63, 0x2e, 
+	0x6c, 0x61, 0x62, 0x6c, 0x65, 0x73, 0x2c, 0x20, 0x31, 0x2c, 0x20, 0x2d, 0x31, 0x20, 0x64, 0x6f, 
+	0xa, 0x9, 0x9, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x20, 0x76, 0x20, 0x3d, 0x20, 0x66, 0x75, 0x6e, 
+	0x63, 0x2e, 0x6c, 0x61, 0x62, 0x6c, 0x65, 0x73, 0x5b, 0x69, 0x5d, 0xa, 0x9, 0x9, 0x69, 0x66, 
+	0x20, 0x76, 0x5b, 0x31, 0x5d, 0x20, 0x3d, 0x3d, 0x20, 0x6e, 0x61, 0x6d, 0x65, 0x20, 0x74, 0x68, 
+	0x65, 0x6e, 0xa, 0x9, 0x9, 0x9, 0x72, 0x65, 0x74, 0x75, 0x72, 0x6e, 0x20, 0x76, 0xa, 0x9, 
+	0x9, 0x65, 0x6e, 0x64, 0xa, 0x9, 0x65, 0x6e, 0x64, 0xa, 0x65, 0x6e, 0x64, 0xa, 0xa, 0x6c, 
+	0x6f, 0x63, 0x61, 0x6c, 0x20, 0x66, 0x75, 0x6e, 0x63, 0x74, 0x69, 0x6f, 0x6e, 0x20, 0x66, 0x69, 
+	0x6e, 0x64, 0x5f, 0x75, 0x70, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 0x6e, 0x61, 0x6d, 0x65, 
+	0x29, 0xa, 0x9, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x20, 0x69, 0x20, 0x3d, 0x20, 0x30, 0xa, 0x9, 
+	0x77, 0x68, 0x69, 0x6c, 0x65, 0x20, 0x66, 0x75, 0x6e, 0x63, 0x20, 0x64, 0x6f, 0xa, 0x9, 0x9, 
+	0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x20, 0x6c, 0x61, 0x62, 0x6c, 0x65, 0x20, 0x3d, 0x20, 0x66, 0x69, 
+	0x6e, 0x64, 0x5f, 0x6c, 0x61, 0x62, 0x6c, 0x65, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 0x6e, 
+	0x61, 0x6d, 0x65, 0x29, 0xa, 0x9, 0x9, 0x69, 0x66, 0x20, 0x6c, 0x61, 0x62, 0x6c, 0x65, 0x20, 
+	0x74, 0x68, 0x65, 0x6e, 0xa, 0x9, 0x9, 0x9, 0x72, 0x65, 0x74, 0x75, 0x72, 0x6e, 0x20, 0x69, 
+	0x2c, 0x20, 0x6c, 0x61, 0x62, 0x6c, 0x65, 0x5b, 0x32, 0x5d, 0xa, 0x9, 0x9, 0x65, 0x6e, 0x64, 
+	0xa, 0x9, 0x9, 0x69, 0x20, 0x3d, 0x20, 0x69, 0x20, 0x2b, 0x20, 0x31, 0xa, 0x9, 0x9, 0x66, 
+	0x75, 0x6e, 0x63, 0x20, 0x3d, 0x20, 0x66, 0x75, 0x6e, 0x63, 0x2e, 0x70, 0x61, 0x72, 0x65, 0x6e, 
+	0x74, 0xa, 0x9, 0x65, 0x6e, 0x64, 0xa, 0x65, 0x6e, 0x64, 0xa, 0xa, 0x6c, 0x6f, 0x63, 0x61, 
+	0x6c, 0x20, 0x66, 0x75, 0x6e, 0x63, 0x74, 0x69, 0x6f, 0x6e, 0x20, 0x70, 0x75, 0x73, 0x68, 0x5f, 
+	0x63, 0x6f, 0x6e, 0x73, 0x74, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 0x76, 0x61, 0x6c, 0x75, 
+	0x65, 0x29, 0xa, 0x9, 0x66, 0x6f, 0x72, 0x20, 0x69, 0x2c, 0x76, 0x20, 0x69, 0x6e, 0x20, 0x69, 
+	0x70, 0x61, 0x69, 0x72, 0x73, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2e, 0x63, 0x6f, 0x6e, 0x73, 0x74, 
+	0x61, 0x6e, 0x74, 0x73, 0x29, 0x20, 0x64, 0x6f, 0xa, 0x9, 0x9, 0x69, 0x66, 0x20, 0x76, 0x20, 
+	0x3d, 0x3d, 0x20, 0x76, 0x61, 0x6c, 0x75, 0x65, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x9, 0x9, 
+	0x9, 0x72, 0x65, 0x74, 0x75, 0x72, 0x6e, 0x20, 0x69, 0x20, 0x2d, 0x20, 0x31, 0xa, 0x9, 0x9, 
+	0x65, 0x6e, 0x64, 0xa, 0x9, 0x65, 0x6e, 0x64, 0xa, 0x9, 0x74, 0x61, 0x62, 0x6c, 0x65, 0x2e, 
+	0x69, 0x6e, 0x73, 0x65, 0x72, 0x74, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2e, 0x63, 0x6f, 0x6e, 0x73, 
+	0x74, 0x61, 0x6e, 0x74, 0x73, 0x2c, 0x20, 0x76, 0x61, 0x6c, 0x75, 0x65, 0x29, 0xa, 0x9, 0x72, 
+	0x65, 0x74, 0x75, 0x72, 0x6e, 0x20, 0x23, 0x66, 0x75, 0x6e, 0x63, 0x2e, 0x63, 0x6f, 0x6e, 0x73, 
+	0x74, 0x61, 0x6e, 0x74, 0x73, 0x20, 0x2d, 0x20, 0x31, 0xa, 0x65, 0x6e, 0x64, 0xa, 0xa, 0x6c, 
+	0x6f, 0x63, 0x61, 0x6c, 0x20, 0x66, 0x75, 0x6e, 0x63, 0x74, 0x69, 0x6f, 0x6e, 0x20, 0x67, 0x65, 
+	0x6e, 0x5f, 0x63, 0x6f, 0x6e, 0x73, 0x74, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 0x63, 0x6f, 
+	0x6e, 0x73, 0x74, 0x29, 0xa, 0x9, 0x61, 0x73, 0x73, 0x65, 0x72, 0x74, 0x28, 0x63, 0x6f, 0x6e, 
+	0x73, 0x74, 0x2e, 0x74, 0x79, 0x70, 0x65, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x6e, 0x75, 0x6d, 0x62, 
+	0x65, 0x72, 0x27, 0x20, 0x6f, 0x72, 0x20, 0x63, 0x6f, 0x6e, 0x73, 0x74, 0x2e, 0x74, 0x79, 0x70, 
+	0x65, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x62, 0x6f, 0x6f, 0x6c, 0x65, 0x61, 0x6e, 0x27, 0x20, 0x6f, 
+	0x72, 0x20, 0x63, 0x6f, 0x6e, 0x73, 0x74, 0x2e, 0x74, 0x79, 0x70, 0x65, 0x20, 0x3d, 0x3d, 0x20, 
+	0x27, 0x73, 0x74, 0x72, 0x69, 0x6e, 0x67, 0x27, 0x29, 0xa, 0x9, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 
+	0x20, 0x63, 0x6f, 0x6e, 0x73, 0x74, 0x69, 0x64, 0x20, 0x3d, 0x20, 0x70, 0x75, 0x73, 0x68, 0x5f, 
+	0x63, 0x6f, 0x6e, 0x73, 0x74, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 0x63, 0x6f, 0x6e, 0x73, 
+	0x74, 0x2e, 0x76, 0x61, 0x6c, 0x75, 0x65, 0x29, 0xa, 0x9, 0x67, 0x65, 0x6e, 0x5f, 0x69, 0x6e, 
+	0x73, 0x74, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 0x27, 0x50, 0x55, 0x53, 0x48, 0x27, 0x2c, 
+	0x20, 0x63, 0x6f, 0x6e, 0x73, 0x74, 0x2e, 0x6c, 0x69, 0x6e, 0x65, 0x2c, 0x20, 0x63, 0x6f, 0x6e, 
+	0x73, 0x74, 0x69, 0x64, 0x29, 0xa, 0x9, 0x66, 0x75, 0x6e, 0x63, 0x2e, 0x73, 0x74, 0x61, 0x63, 
+	0x6b, 0x5f, 0x70, 0x6f, 0x69, 0x6e, 0x74, 0x65, 0x72, 0x20, 0x3d, 0x20, 0x66, 0x75, 0x6e, 0x63, 
+	0x2e, 0x73, 0x74, 0x61, 0x63, 0x6b, 0x5f, 0x70, 0x6f, 0x69, 0x6e, 0x74, 0x65, 0x72, 0x20, 0x2b, 
+	0x20, 0x31, 0xa, 0x65, 0x6e, 0x64, 0xa, 0xa, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x20, 0x66, 0x75, 
+	0x6e, 0x63, 0x74, 0x69, 0x6f, 0x6e, 0x20, 0x67, 0x65, 0x6e, 0x5f, 0x66, 0x65, 0x74, 0x63, 0x68, 
+	0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 0x69, 0x64, 0x65, 0x6e, 0x74, 0x29, 0xa, 0x9, 0x69, 
+	0x66, 0x20, 0x66, 0x75, 0x6e, 0x63, 0x2e, 0x70, 0x61, 0x72, 0x65, 0x6e, 0x74, 0x20, 0x61, 0x6e, 
+	0x64, 0x20, 0x69, 0x64, 0x65, 0x6e, 0x74, 0x2e, 0x76, 0x61, 0x6c, 0x75, 0x65, 0x20, 0x3d, 0x3d, 
+	0x20, 0x27, 0x72, 0x65, 0x63, 0x27, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x9, 0x9, 0x67, 0x65, 
+	0x6e, 0x5f, 0x69, 0x6e, 0x73, 0x74, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 0x27, 0x4c, 0x4f, 
+	0x41, 0x44, 0x27, 0x2c, 0x20, 0x69, 0x64, 0x65, 0x6e, 0x74, 0x2e, 0x6c, 0x69, 0x6e, 0x65, 0x2c, 
+	0x20, 0x30, 0x29, 0xa, 0x9, 0x65, 0x6c, 0x73, 0x65, 0xa, 0x9, 0x9, 0x6c, 0x6f, 0x63, 0x61, 
+	0x6c, 0x20, 0x6c, 0x76, 0x2c, 0x20, 0x69, 0x64, 0x20, 0x3d, 0x20, 0x66, 0x69, 0x6e, 0x64, 0x5f, 
+	0x75, 0x70, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 0x69, 0x64, 0x65, 0x6e, 0x74, 0x2e, 0x76, 
+	0x61, 0x6c, 0x75, 0x65, 0x29, 0xa, 0x9, 0x9, 0x69, 0x66, 0x20, 0x6e, 0x6f, 0x74, 0x20, 0x6c, 
+	0x76, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x9, 0x9, 0x9, 0x67, 0x65, 0x6e, 0x5f, 0x69, 0x6e, 
+	0x73, 0x74, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 0x27, 0x47, 0x45, 0x54, 0x47, 0x4c, 0x4f, 
+	0x42, 0x41, 0x4c, 0x27, 0x2c, 0x20, 0x69, 0x64, 0x65, 0x6e, 0x74, 0x2e, 0x6c, 0x69, 0x6e, 0x65, 
+	0x2c, 0x20, 0x70, 0x75, 0x73, 0x68, 0x5f, 0x63, 0x6f, 0x6e, 0x73, 0x74, 0x28, 0x66, 0x75, 0x6e, 
+	0x63, 0x2c, 0x20, 0x69, 0x64, 0x65, 0x6e, 0x74, 0x2e, 0x76, 0x61, 0x6c, 0x75, 0x65, 0x29, 0x29, 
+	0xa, 0x9, 0x9, 0x65, 0x6c, 0x73, 0x65, 0x69, 0x66, 0x20, 0x6c, 0x76, 0x20, 0x3d, 0x3d, 0x20, 
+	0x30, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x9, 0x9, 0x9, 0x67, 0x65, 0x6e, 0x5f, 0x69, 0x6e, 
+	0x73, 0x74, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 0x27, 0x4c, 0x4f, 0x41, 0x44, 0x27, 0x2c, 
+	0x20, 0x69, 0x64, 0x65, 0x6e, 0x74, 0x2e, 0x6c, 0x69, 0x6e, 0x65, 0x2c, 0x20, 0x69, 0x64, 0x20, 
+	0x2b, 0x20, 0x31, 0x29, 0xa, 0x9, 0x9, 0x65, 0x6c, 0x73, 0x65, 0xa, 0x9, 0x9, 0x9, 0x74, 
+	0x61, 0x62, 0x6c, 0x65, 0x2e, 0x69, 0x6e, 0x73, 0x65, 0x72, 0x74, 0x28, 0x66, 0x75, 0x6e, 0x63, 
+	0x2e, 0x75, 0x70, 0x2c, 0x20, 0x7b, 0x6c, 0x76, 0x2c, 0x20, 0x69, 0x64, 0x7d, 0x29, 0xa, 0x9, 
+	0x9, 0x9, 0x67, 0x65, 0x6e, 0x5f, 0x69, 0x6e, 0x73, 0x74, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 
+	0x20, 0x27, 0x4c, 0x55, 0x50, 0x27, 0x2c, 0x20, 0x69, 0x64, 0x65, 0x6e, 0x74, 0x2e, 0x6c, 0x69, 
+	0x6e, 0x65, 0x2c, 0x20, 0x23, 0x66, 0x75, 0x6e, 0x63, 0x2e, 0x75, 0x70, 0x20, 0x2d, 0x20, 0x31, 
+	0x29, 0xa, 0x9, 0x9, 0x65, 0x6e, 0x64, 0xa, 0x9, 0x65, 0x6e, 0x64, 0xa, 0x9, 0x66, 0x75, 
+	0x6e, 0x63, 0x2e, 0x73, 0x74, 0x61, 0x63, 0x6b, 0x5f, 0x70, 0x6f, 0x69, 0x6e, 0x74, 0x65, 0x72, 
+	0x20, 0x3d, 0x20, 0x66, 0x75, 0x6e, 0x63, 0x2e, 0x73, 0x74, 0x61, 0x63, 0x6b, 0x5f, 0x70, 0x6f, 
+	0x69, 0x6e, 0x74, 0x65, 0x72, 0x20, 0x2b, 0x20, 0x31, 0xa, 0x65, 0x6e, 0x64, 0xa, 0xa, 0x6c, 
+	0x6f, 0x63, 0x61, 0x6c, 0x20, 0x66, 0x75, 0x6e, 0x63, 0x74, 0x69, 0x6f, 0x6e, 0x20, 0x6f, 0x70, 
+	0x65, 0x72, 0x61, 0x6e, 0x64, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 0x61, 0x73, 0x74, 0x29, 
+	0xa, 0x9, 0x69, 0x66, 0x20, 0x61, 0x73, 0x74, 0x2e, 0x74, 0x79, 0x70, 0x65, 0x20, 0x3d, 0x3d, 
+	0x20, 0x27, 0x6e, 0x75, 0x6d, 0x62, 0x65, 0x72, 0x27, 0x20, 0x6f, 0x72, 0x20, 0x61, 0x73, 0x74, 
+	0x2e, 0x74, 0x79, 0x70, 0x65, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x73, 0x74, 0x72, 0x69, 0x6e, 0x67, 
+	0x27, 0x20, 0x6f, 0x72, 0x20, 0x61, 0x73, 0x74, 0x2e, 0x74, 0x79, 0x70, 0x65, 0x20, 0x3d, 0x3d, 
+	0x20, 0x27, 0x62, 0x6f, 0x6f, 0x6c, 0x65, 0x61, 0x6e, 0x27, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 
+	0x9, 0x9, 0x72, 0x65, 0x74, 0x75, 0x72, 0x6e, 0x20, 0x27, 0x4b, 0x27, 0x2c, 0x20, 0x70, 0x75, 
+	0x73, 0x68, 0x5f, 0x63, 0x6f, 0x6e, 0x73, 0x74, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 0x61, 
+	0x73, 0x74, 0x2e, 0x76, 0x61, 0x6c, 0x75, 0x65, 0x29, 0xa, 0x9, 0x65, 0x6c, 0x73, 0x65, 0x69, 
+	0x66, 0x20, 0x61, 0x73, 0x74, 0x2e, 0x74, 0x79, 0x70, 0x65, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x69, 
+	0x64, 0x65, 0x6e, 0x74, 0x69, 0x66, 0x69, 0x65, 0x72, 0x27, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 
+	0x9, 0x9, 0x69, 0x66, 0x20, 0x61, 0x73, 0x74, 0x2e, 0x76, 0x61, 0x6c, 0x75, 0x65, 0x20, 0x3d, 
+	0x3d, 0x20, 0x27, 0x6e, 0x69, 0x6c, 0x27, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x9, 0x9, 0x9, 
+	0x72, 0x65, 0x74, 0x75, 0x72, 0x6e, 0x20, 0x27, 0x4b, 0x27, 0x2c, 0x20, 0x70, 0x75, 0x73, 0x68, 
+	0x5f, 0x63, 0x6f, 0x6e, 0x73, 0x74, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 0x27, 0x6e, 0x69, 
+	0x6c, 0x27, 0x29, 0xa, 0x9, 0x9, 0x65, 0x6c, 0x73, 0x65, 0x69, 0x66, 0x20, 0x66, 0x75, 0x6e, 
+	0x63, 0x2e, 0x70, 0x61, 0x72, 0x65, 0x6e, 0x74, 0x20, 0x61, 0x6e, 0x64, 0x20, 0x61, 0x73, 0x74, 
+	0x2e, 0x76, 0x61, 0x6c, 0x75, 0x65, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x72, 0x65, 0x63, 0x27, 0x20, 
+	0x74, 0x68, 0x65, 0x6e, 0xa, 0x9, 0x9, 0x9, 0x72, 0x65, 0x74, 0x75, 0x72, 0x6e, 0x20, 0x27, 
+	0x4c, 0x27, 0x2c, 0x20, 0x30, 0xa, 0x9, 0x9, 0x65, 0x6e, 0x64, 0xa, 0x9, 0x9, 0x6c, 0x6f, 
+	0x63, 0x61, 0x6c, 0x20, 0x6c, 0x76, 0x2c, 0x20, 0x69, 0x64, 0x20, 0x3d, 0x20, 0x66, 0x69, 0x6e, 
+	0x64, 0x5f, 0x75, 0x70, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 0x61, 0x73, 0x74, 0x2e, 0x76, 
+	0x61, 0x6c, 0x75, 0x65, 0x29, 0xa, 0x9, 0x9, 0x69, 0x66, 0x20, 0x6c, 0x76, 0x20, 0x3d, 0x3d, 
+	0x20, 0x30, 0x20, 0x61, 0x6e, 0x64, 0x20, 0x69, 0x64, 0x20, 0x2b, 0x20, 0x31, 0x20, 0x3c, 0x3d, 
+	0x20, 0x32, 0x35, 0x35, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x9, 0x9, 0x9, 0x72, 0x65, 0x74, 
+	0x75, 0x72, 0x6e, 0x20, 0x27, 0x4c, 0x27, 0x2c, 0x20, 0x69, 0x64, 0x20, 0x2b, 0x20, 0x31, 0xa, 
+	0x9, 0x9, 0x65, 0x6e, 0x64, 0xa, 0x9, 0x65, 0x6e, 0x64, 0xa, 0x65, 0x6e, 0x64, 0xa, 0xa, 
+	0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x20, 0x66, 0x75, 0x6e, 0x63, 0x74, 0x69, 0x6f, 0x6e, 0x20, 0x67, 
+	0x65, 0x6e, 0x5f, 0x6f, 0x70, 0x65, 0x72, 0x61, 0x6e, 0x64, 0x73, 0x28, 0x66, 0x75, 0x6e, 0x63, 
+	0x2c, 0x20, 0x61, 0x73, 0x74, 0x29, 0xa, 0x9, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x20, 0x69, 0x6e, 
+	0x73, 0x74, 0x20, 0x3d, 0x20, 0x6f, 0x70, 0x65, 0x72, 0x61, 0x6e, 0x64, 0x5f, 0x69, 0x6e, 0x73, 
+	0x74, 0x5b, 0x61, 0x73, 0x74, 0x2e, 0x6f, 0x70, 0x65, 0x72, 0x61, 0x74, 0x6f, 0x72, 0x5d, 0xa, 
+	0x9, 0x69, 0x66, 0x20, 0x6e, 0x6f, 0x74, 0x20, 0x6f, 0x70, 0x74, 0x5f, 0x6f, 0x70, 0x65, 0x72, 
+	0x61, 0x6e, 0x64, 0x73, 0x20, 0x6f, 0x72, 0x20, 0x6e, 0x6f, 0x74, 0x20, 0x69, 0x6e, 0x73, 0x74, 
+	0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x9, 0x9, 0x72, 0x65, 0x74, 0x75, 0x72, 0x6e, 0x20, 0x66, 
+	0x61, 0x6c, 0x73, 0x65, 0xa, 0x9, 0x65, 0x6e, 0x64, 0xa, 0xa, 0x9, 0x6c, 0x6f, 0x63, 0x61, 
+	0x6c, 0x20, 0x6c, 0x65, 0x66, 0x74, 0x2c, 0x20, 0x72, 0x69, 0x67, 0x68, 0x74, 0x20, 0x3d, 0x20, 
+	0x61, 0x73, 0x74, 0x2e, 0x6c, 0x65, 0x66, 0x74, 0x2c, 0x20, 0x61, 0x73, 0x74, 0x2e, 0x72, 0x69, 
+	0x67, 0x68, 0x74, 0xa, 0x9, 0x69, 0x66, 0x20, 0x69, 0x6e, 0x73, 0x74, 0x2e, 0x73, 0x77, 0x61, 
+	0x70, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x9, 0x9, 0x6c, 0x65, 0x66, 0x74, 0x2c, 0x20, 0x72, 
+	0x69, 0x67, 0x68, 0x74, 0x20, 0x3d, 0x20, 0x72, 0x69, 0x67, 0x68, 0x74, 0x2c, 0x20, 0x6c, 0x65, 
+	0x66, 0x74, 0xa, 0x9, 0x65, 0x6e, 0x64, 0xa, 0xa, 0x9, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x20, 
+	0x6c, 0x6b, 0x2c, 0x20, 0x6c, 0x76, 0x20, 0x3d, 0x20, 0x6f, 0x70, 0x65, 0x72, 0x61, 0x6e, 0x64, 
+	0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 0x6c, 0x65, 0x66, 0x74, 0x29, 0xa, 0x9, 0x6c, 0x6f, 
+	0x63, 0x61, 0x6c, 0x20, 0x72, 0x6b, 0x2c, 0x20, 0x72, 0x76, 0x20, 0x3d, 0x20, 0x6f, 0x70, 0x65, 
+	0x72, 0x61, 0x6e, 0x64, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 0x72, 0x69, 0x67, 0x68, 0x74, 
+	0x29, 0xa, 0x9, 0x69, 0x66, 0x20, 0x6e, 0x6f, 0x74, 0x20, 0x6c, 0x6b, 0x20, 0x6f, 0x72, 0x20, 
+	0x6e, 0x6f, 0x74, 0x20, 0x72, 0x6b, 0x20, 0x6f, 0x72, 0x20, 0x28, 0x6c, 0x6b, 0x20, 0x3d, 0x3d, 
+	0x20, 0x27, 0x4b, 0x27, 0x20, 0x61, 0x6e, 0x64, 0x20, 0x72, 0x6b, 0x20, 0x3d, 0x3d, 0x20, 0x27, 
+	0x4b, 0x27, 0x29, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x9, 0x9, 0x72, 0x65, 0x74, 0x75, 0x72, 
+	0x6e, 0x20, 0x66, 0x61, 0x6c, 0x73, 0x65, 0xa, 0x9, 0x65, 0x6e, 0x64, 0xa, 0xa, 0x9, 0x69, 
+	0x66, 0x20, 0x6c, 0x6b, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x4b, 0x27, 0x20, 0x61, 0x6e, 0x64, 0x20, 
+	0x69, 0x6e, 0x73, 0x74, 0x2e, 0x63, 0x6f, 0x6d, 0x6d, 0x75, 0x74, 0x61, 0x74, 0x69, 0x76, 0x65, 
+	0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x9, 0x9, 0x6c, 0x6b, 0x2c, 0x20, 0x6c, 0x76, 0x2c, 0x20, 
+	0x72, 0x6b, 0x2c, 0x20, 0x72, 0x76, 0x20, 0x3d, 0x20, 0x72, 0x6b, 0x2c, 0x20, 0x72, 0x76, 0x2c, 
+	0x20, 0x6c, 0x6b, 0x2c, 0x20, 0x6c, 0x76, 0xa, 0x9, 0x65, 0x6e, 0x64, 0xa, 0xa, 0x9, 0x69, 
+	0x66, 0x20, 0x6c, 0x6b, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x4c, 0x27, 0x20, 0x61, 0x6e, 0x64, 0x20, 
+	0x72, 0x6b, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x4c, 0x27, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x9, 
+	0x9, 0x67, 0x65, 0x6e, 0x5f, 0x69, 0x6e, 0x73, 0x74, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 
+	0x69, 0x6e, 0x73, 0x74, 0x5b, 0x31, 0x5d, 0x20, 0x2e, 0x2e, 0x20, 0x27, 0x5f, 0x4c, 0x4c, 0x27, 
+	0x2c, 0x20, 0x61, 0x73, 0x74, 0x2e, 0x6c, 0x69, 0x6e, 0x65, 0x2c, 0x20, 0x6c, 0x76, 0x2c, 0x20, 
+	0x72, 0x76, 0x29, 0xa, 0x9, 0x65, 0x6c, 0x73, 0x65, 0x69, 0x66, 0x20, 0x6c, 0x6b, 0x20, 0x3d, 
+	0x3d, 0x20, 0x27, 0x4c, 0x27, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x9, 0x9, 0x67, 0x65, 0x6e, 
+	0x5f, 0x69, 0x6e, 0x73, 0x74, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 0x69, 0x6e, 0x73, 0x74, 
+	0x5b, 0x31, 0x5d, 0x20, 0x2e, 0x2e, 0x20, 0x27, 0x5f, 0x4c, 0x4b, 0x27, 0x2c, 0x20, 0x61, 0x73, 
+	0x74, 0x2e, 0x6c, 0x69, 0x6e, 0x65, 0x2c, 0x20, 0x6c, 0x76, 0x2c, 0x20, 0x72, 0x76, 0x29, 0xa, 
+	0x9, 0x65, 0x6c, 0x73, 0x65, 0xa, 0x9, 0x9, 0x67, 0x65, 0x6e, 0x5f, 0x69, 0x6e, 0x73, 0x74, 
+	0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 0x69, 0x6e, 0x73, 0x74, 0x5b, 0x31, 0x5d, 0x20, 0x2e, 
+	0x2e, 0x20, 0x27, 0x5f, 0x4b, 0x4c, 0x27, 0x2c, 0x20, 0x61, 0x73, 0x74, 0x2e, 0x6c, 0x69, 0x6e, 
+	0x65, 0x2c, 0x20, 0x72, 0x76, 0x2c, 0x20, 0x6c, 0x76, 0x29, 0xa, 0x9, 0x65, 0x6e, 0x64, 0xa, 
+	0x9, 0x69, 0x66, 0x20, 0x69, 0x6e, 0x73, 0x74, 0x2e, 0x6e, 0x65, 0x67, 0x61, 0x74, 0x65, 0x20, 
+	0x74, 0x68, 0x65, 0x6e, 0xa, 0x9, 0x9, 0x67, 0x65, 0x6e, 0x5f, 0x69, 0x6e, 0x73, 0x74, 0x28, 
+	0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 0x27, 0x4e, 0x4f, 0x54, 0x27, 0x2c, 0x20, 0x61, 0x73, 0x74, 
+	0x2e, 0x6c, 0x69, 0x6e, 0x65, 0x29, 0xa, 0x9, 0x65, 0x6e, 0x64, 0xa, 0xa, 0x9, 0x66, 0x75, 
+	0x6e, 0x63, 0x2e, 0x73, 0x74, 0x61, 0x63, 0x6b, 0x5f, 0x70, 0x6f, 0x69, 0x6e, 0x74, 0x65, 0x72, 
+	0x20, 0x3d, 0x20, 0x66, 0x75, 0x6e, 0x63, 0x2e, 0x73, 0x74, 0x61, 0x63, 0x6b, 0x5f, 0x70, 0x6f, 
+	0x69, 0x6e, 0x74, 0x65, 0x72, 0x20, 0x2b, 0x20, 0x31, 0xa, 0x9, 0x72, 0x65, 0x74, 0x75, 0x72, 
+	0x6e, 0x20, 0x74, 0x72, 0x75, 0x65, 0xa, 0x65, 0x6e, 0x64, 0xa, 0xa, 0x6c, 0x6f, 0x63, 0x61, 
+	0x6c, 0x20, 0x66, 0x75, 0x6e, 0x63, 0x74, 0x69, 0x6f, 0x6e, 0x20, 0x67, 0x65, 0x6e, 0x5f, 0x61, 
+	0x73, 0x73, 0x69, 0x67, 0x6e, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 0x61, 0x73, 0x74, 0x2c, 
+	0x20, 0x74, 0x61, 0x69, 0x6c, 0x2c, 0x20, 0x64, 0x69, 0x73, 0x63, 0x61, 0x72, 0x64, 0x29, 0xa, 
+	0x9, 0x61, 0x73, 0x73, 0x65, 0x72, 0x74, 0x28, 0x61, 0x73, 0x74, 0x2e, 0x6c, 0x65, 0x66, 0x74, 
+	0x2e, 0x74, 0x79, 0x70, 0x65, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x69, 0x64, 0x65, 0x6e, 0x74, 0x69, 
+	0x66, 0x69, 0x65, 0x72, 0x27, 0x29, 0xa, 0x9, 0x74, 0x61, 0x62, 0x6c, 0x65, 0x2e, 0x69, 0x6e, 
+	0x73, 0x65, 0x72, 0x74, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2e, 0x6c, 0x61, 0x62, 0x6c, 0x65, 0x73, 
+	0x2c, 0x20, 0x7b, 0x61, 0x73, 0x74, 0x2e, 0x6c, 0x65, 0x66, 0x74, 0x2e, 0x76, 0x61, 0x6c, 0x75, 
+	0x65, 0x2c, 0x20, 0x66, 0x75, 0x6e, 0x63, 0x2e, 0x73, 0x74, 0x61, 0x63, 0x6b, 0x5f, 0x70, 0x6f, 
+	0x69, 0x6e, 0x74, 0x65, 0x72, 0x7d, 0x29, 0xa, 0x9, 0x67, 0x65, 0x6e, 0x28, 0x66, 0x75, 0x6e, 
+	0x63, 0x2c, 0x20, 0x61, 0x73, 0x74, 0x2e, 0x72, 0x69, 0x67, 0x68, 0x74, 0x2c, 0x20, 0x74, 0x61, 
+	0x69, 0x6c, 0x29, 0xa, 0x9, 0x69, 0x66, 0x20, 0x6e, 0x6f, 0x74, 0x20, 0x64, 0x69, 0x73, 0x63, 
+	0x61, 0x72, 0x64, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x9, 0x9, 0x67, 0x65, 0x6e, 0x5f, 0x69, 
+	0x6e, 0x73, 0x74, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 0x27, 0x4c, 0x4f, 0x41, 0x44, 0x27, 
+	0x2c, 0x20, 0x61, 0x73, 0x74, 0x2e, 0x6c, 0x69, 0x6e, 0x65, 0x2c, 0x20, 0x66, 0x75, 0x6e, 0x63, 
+	0x2e, 0x73, 0x74, 0x61, 0x63, 0x6b, 0x5f, 0x70, 0x6f, 0x69, 0x6e, 0x74, 0x65, 0x72, 0x29, 0xa, 
+	0x9, 0x9, 0x66, 0x75, 0x6e, 0x63, 0x2e, 0x73, 0x74, 0x61, 0x63, 0x6b, 0x5f, 0x70, 0x6f, 0x69, 
+	0x6e, 0x74, 0x65, 0x72, 0x20, 0x3d, 0x20, 0x66, 0x75, 0x6e, 0x63, 0x2e, 0x73, 0x74, 0x61, 0x63, 
+	0x6b, 0x5f, 0x70, 0x6f, 0x69, 0x6e, 0x74, 0x65, 0x72, 0x20, 0x2b, 0x20, 0x31, 0xa, 0x9, 0x65, 
+	0x6e, 0x64, 0xa, 0x65, 0x6e, 0x64, 0xa, 0xa, 0x2d, 0x2d, 0x20, 0x27, 0x28, 0x61, 0x20, 0x62, 
+	0x29, 0x20, 0x3d, 0x20, 0x66, 0x28, 0x29, 0x27, 0x20, 0x62, 0x69, 0x6e, 0x64, 0x73, 0x20, 0x74, 
+	0x68, 0x65, 0x20, 0x72, 0x65, 0x73, 0x75, 0x6c, 0x74, 0x73, 0x20, 0x6f, 0x66, 0x20, 0x61, 0x20, 
+	0x63, 0x61, 0x6c, 0x6c, 0x20, 0x74, 0x6f, 0x20, 0x6e, 0x65, 0x77, 0x20, 0x6c, 0x6f, 0x63, 0x61, 
+	0x6c, 0x73, 0x2c, 0x20, 0x6d, 0x69, 0x73, 0x73, 0x69, 0x6e, 0x67, 0x20, 0x6f, 0x6e, 0x65, 0x73, 
+	0xa, 0x2d, 0x2d, 0x20, 0x61, 0x72, 0x65, 0x20, 0x6e, 0x69, 0x6c, 0x2e, 0x20, 0x41, 0x6e, 0x79, 
+	0x74, 0x68, 0x69, 0x6e, 0x67, 0x20, 0x62, 0x75, 0x74, 0x20, 0x61, 0x20, 0x63, 0x61, 0x6c, 0x6c, 
+	0x20, 0x68, 0x61, 0x73, 0x20, 0x61, 0x20, 0x73, 0x69, 0x6e, 0x67, 0x6c, 0x65, 0x20, 0x72, 0x65, 
+	0x73, 0x75, 0x6c, 0x74, 0x2e, 0x20, 0x54, 0x68, 0x65, 0x20, 0x76, 0x61, 0x6c, 0x75, 0x65, 0x20, 
+	0x6f, 0x66, 0x20, 0x74, 0x68, 0x65, 0xa, 0x2d, 0x2d, 0x20, 0x65, 0x78, 0x70, 0x72, 0x65, 0x73, 
+	0x73, 0x69, 0x6f, 0x6e, 0x20, 0x69, 0x73, 0x20, 0x74, 0x68, 0x65, 0x20, 0x66, 0x69, 0x72, 0x73, 
+	0x74, 0x20, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x2e, 0xa, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x20, 0x66, 
+	0x75, 0x6e, 0x63, 0x74, 0x69, 0x6f, 0x6e, 0x20, 0x67, 0x65, 0x6e, 0x5f, 0x64, 0x65, 0x73, 0x74, 
+	0x72, 0x75, 0x63, 0x74, 0x75, 0x72, 0x65, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 0x61, 0x73, 
+	0x74, 0x2c, 0x20, 0x64, 0x69, 0x73, 0x63, 0x61, 0x72, 0x64, 0x29, 0xa, 0x9, 0x61, 0x73, 0x73, 
+	0x65, 0x72, 0x74, 0x28, 0x61, 0x73, 0x74, 0x2e, 0x74, 0x79, 0x70, 0x65, 0x20, 0x3d, 0x3d, 0x20, 
+	0x27, 0x64, 0x65, 0x73, 0x74, 0x72, 0x75, 0x63, 0x74, 0x75, 0x72, 0x65, 0x27, 0x29, 0xa, 0x9, 
+	0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x20, 0x73, 0x74, 0x61, 0x63, 0x6b, 0x20, 0x3d, 0x20, 0x66, 0x75, 
+	0x6e, 0x63, 0x2e, 0x73, 0x74, 0x61, 0x63, 0x6b, 0x5f, 0x70, 0x6f, 0x69, 0x6e, 0x74, 0x65, 0x72, 
+	0xa, 0x9, 0x69, 0x66, 0x20, 0x61, 0x73, 0x74, 0x2e, 0x76, 0x61, 0x6c, 0x75, 0x65, 0x2e, 0x74, 
+	0x79, 0x70, 0x65, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x63, 0x61, 0x6c, 0x6c, 0x27, 0x20, 0x74, 0x68, 
+	0x65, 0x6e, 0xa, 0x9, 0x9, 0x67, 0x65, 0x6e, 0x5f, 0x63, 0x61, 0x6c, 0x6c, 0x28, 0x66, 0x75, 
+	0x6e, 0x63, 0x2c, 0x20, 0x61, 0x73, 0x74, 0x2e, 0x76, 0x61, 0x6c, 0x75, 0x65, 0x2c, 0x20, 0x66, 
+	0x61, 0x6c, 0x73, 0x65, 0x2c, 0x20, 0x23, 0x61, 0x73, 0x74, 0x2e, 0x6e, 0x61, 0x6d, 0x65, 0x73, 
+	0x29, 0xa, 0x9, 0x65, 0x6c, 0x73, 0x65, 0xa, 0x9, 0x9, 0x67, 0x65, 0x6e, 0x28, 0x66, 0x75, 
+	0x6e, 0x63, 0x2c, 0x20, 0x61, 0x73, 0x74, 0x2e, 0x76, 0x61, 0x6c, 0x75, 0x65, 0x29, 0xa, 0x9, 
+	0x9, 0x66, 0x6f, 0x72, 0x20, 0x69, 0x20, 0x3d, 0x20, 0x32, 0x2c, 0x20, 0x23, 0x61, 0x73, 0x74, 
+	0x2e, 0x6e, 0x61, 0x6d, 0x65, 0x73, 0x20, 0x64, 0x6f, 0xa, 0x9, 0x9, 0x9, 0x67, 0x65, 0x6e, 
+	0x5f, 0x63, 0x6f, 0x6e, 0x73, 0x74, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 0x7b, 0x74, 0x79, 
+	0x70, 0x65, 0x20, 0x3d, 0x20, 0x27, 0x73, 0x74, 0x72, 0x69, 0x6e, 0x67, 0x27, 0x2c, 0x20, 0x76, 
+	0x61, 0x6c, 0x75, 0x65, 0x20, 0x3d, 0x20, 0x27, 0x6e, 0x69, 0x6c, 0x27, 0x2c, 0x20, 0x6c, 0x69, 
+	0x6e, 0x65, 0x20, 0x3d, 0x20, 0x61, 0x73, 0x74, 0x2e, 0x6c, 0x69, 0x6e, 0x65, 0x7d, 0x29, 0xa, 
+	0x9, 0x9, 0x65, 0x6e, 0x64, 0xa, 0x9, 0x65, 0x6e, 0x64, 0xa, 0x9, 0x66, 0x6f, 0x72, 0x20, 
+	0x69, 0x2c, 0x6e, 0x61, 0x6d, 0x65, 0x20, 0x69, 0x6e, 0x20, 0x69, 0x70, 0x61, 0x69, 0x72, 0x73, 
+	0x28, 0x61, 0x73, 0x74, 0x2e, 0x6e, 0x61, 0x6d, 0x65, 0x73, 0x29, 0x20, 0x64, 0x6f, 0xa, 0x9, 
+	0x9, 0x74, 0x61, 0x62, 0x6c, 0x65, 0x2e, 0x69, 0x6e, 0x73, 0x65, 0x72, 0x74, 0x28, 0x66, 0x75, 
+	0x6e, 0x63, 0x2e, 0x6c, 0x61, 0x62, 0x6c, 0x65, 0x73, 0x2c, 0x20, 0x7b, 0x6e, 0x61, 0x6d, 0x65, 
+	0x2e, 0x76, 0x61, 0x6c, 0x75, 0x65, 0x2c, 0x20, 0x73, 0x74, 0x61, 0x63, 0x6b, 0x20, 0x2b, 0x20, 
+	0x69, 0x20, 0x2d, 0x20, 0x31, 0x7d, 0x29, 0xa, 0x9, 0x65, 0x6e, 0x64, 0xa, 0x9, 0x69, 0x66, 
+	0x20, 0x6e, 0x6f, 0x74, 0x20, 0x64, 0x69, 0x73, 0x63, 0x61, 0x72, 0x64, 0x20, 0x74, 0x68, 0x65, 
+	0x6e, 0xa, 0x9, 0x9, 0x67, 0x65, 0x6e, 0x5f, 0x69, 0x6e, 0x73, 0x74, 0x28, 0x66, 0x75, 0x6e, 
+	0x63, 0x2c, 0x20, 0x27, 0x4c, 0x4f, 0x41, 0x44, 0x27, 0x2c, 0x20, 0x61, 0x73, 0x74, 0x2e, 0x6c, 
+	0x69, 0x6e, 0x65, 0x2c, 0x20, 0x73, 0x74, 0x61, 0x63, 0x6b, 0x20, 0x2b, 0x20, 0x31, 0x29, 0xa, 
+	0x9, 0x9, 0x66, 0x75, 0x6e, 0x63, 0x2e, 0x73, 0x74, 0x61, 0x63, 0x6b, 0x5f, 0x70, 0x6f, 0x69, 
+	0x6e, 0x74, 0x65, 0x72, 0x20, 0x3d, 0x20, 0x66, 0x75, 0x6e, 0x63, 0x2e, 0x73, 0x74, 0x61, 0x63, 
+	0x6b, 0x5f, 0x70, 0x6f, 0x69, 0x6e, 0x74, 0x65, 0x72, 0x20, 0x2b, 0x20, 0x31, 0xa, 0x9, 0x65, 
+	0x6e, 0x64, 0xa, 0x65, 0x6e, 0x64, 0xa, 0xa, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x20, 0x66, 0x75, 
+	0x6e, 0x63, 0x74, 0x69, 0x6f, 0x6e, 0x20, 0x67, 0x65, 0x6e, 0x5f, 0x6f, 0x70, 0x65, 0x72, 0x61, 
+	0x74, 0x6f, 0x72, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 0x61, 0x73, 0x74, 0x2c, 0x20, 0x74, 
+	0x61, 0x69, 0x6c, 0x29, 0xa, 0x9, 0x61, 0x73, 0x73, 0x65, 0x72, 0x74, 0x28, 0x61, 0x73, 0x74, 
+	0x2e, 0x74, 0x79, 0x70, 0x65, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x6f, 0x70, 0x65, 0x72, 0x61, 0x74, 
+	0x6f, 0x72, 0x27, 0x29, 0xa, 0x9, 0x69, 0x66, 0x20, 0x61, 0x73, 0x74, 0x2e, 0x6f, 0x70, 0x65, 
+	0x72, 0x61, 0x74, 0x6f, 0x72, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x3d, 0x27, 0x20, 0x74, 0x68, 0x65, 
+	0x6e, 0xa, 0x9, 0x9, 0x67, 0x65, 0x6e, 0x5f, 0x61, 0x73, 0x73, 0x69, 0x67, 0x6e, 0x28, 0x66, 
+	0x75, 0x6e, 0x63, 0x2c, 0x20, 0x61, 0x73, 0x74, 0x2c, 0x20, 0x74, 0x61, 0x69, 0x6c, 0x29, 0xa, 
+	0x9, 0x9, 0x72, 0x65, 0x74, 0x75, 0x72, 0x6e, 0xa, 0x9, 0x65, 0x6c, 0x73, 0x65, 0x69, 0x66, 
+	0x20, 0x67, 0x65, 0x6e, 0x5f, 0x6f, 0x70, 0x65, 0x72, 0x61, 0x6e, 0x64, 0x73, 0x28, 0x66, 0x75, 
+	0x6e, 0x63, 0x2c, 0x20, 0x61, 0x73, 0x74, 0x29, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x9, 0x9, 
+	0x72, 0x65, 0x74, 0x75, 0x72, 0x6e, 0xa, 0x9, 0x65, 0x6c, 0x73, 0x65, 0x69, 0x66, 0x20, 0x61, 
+	0x73, 0x74, 0x2e, 0x6f, 0x70, 0x65, 0x72, 0x61, 0x74, 0x6f, 0x72, 0x20, 0x3d, 0x3d, 0x20, 0x27, 
+	0x3a, 0x27, 0x20, 0x6f, 0x72, 0x20, 0x61, 0x73, 0x74, 0x2e, 0x6f, 0x70, 0x65, 0x72, 0x61, 0x74, 
+	0x6f, 0x72, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x2e, 0x2e, 0x27, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 
+	0x9, 0x9, 0x67, 0x65, 0x6e, 0x5f, 0x69, 0x6e, 0x73, 0x74, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 
+	0x20, 0x27, 0x47, 0x45, 0x54, 0x47, 0x4c, 0x4f, 0x42, 0x41, 0x4c, 0x27, 0x2c, 0x20, 0x61, 0x73, 
+	0x74, 0x2e, 0x6c, 0x69, 0x6e, 0x65, 0x2c, 0x20, 0x70, 0x75, 0x73, 0x68, 0x5f, 0x63, 0x6f, 0x6e, 
+	0x73, 0x74, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 0x28, 0x61, 0x73, 0x74, 0x2e, 0x6f, 0x70, 
+	0x65, 0x72, 0x61, 0x74, 0x6f, 0x72, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x2e, 0x2e, 0x27, 0x29, 0x20, 
+	0x61, 0x6e, 0x64, 0x20, 0x27, 0x72, 0x61, 0x6e, 0x67, 0x65, 0x27, 0x20, 0x6f, 0x72, 0x20, 0x27, 
+	0x63, 0x6f, 0x6e, 0x73, 0x27, 0x29, 0x29, 0xa, 0x9, 0x9, 0x66, 0x75, 0x6e, 0x63, 0x2e, 0x73, 
+	0x74, 0x61, 0x63, 0x6b, 0x5f, 0x70, 0x6f, 0x69, 0x6e, 0x74, 0x65, 0x72, 0x20, 0x3d, 0x20, 0x66, 
+	0x75, 0x6e, 0x63, 0x2e, 0x73, 0x74, 0x61, 0x63, 0x6b, 0x5f, 0x70, 0x6f, 0x69, 0x6e, 0x74, 0x65, 
+	0x72, 0x20, 0x2b, 0x20, 0x31, 0xa, 0x9, 0x9, 0x67, 0x65, 0x6e, 0x28, 0x66, 0x75, 0x6e, 0x63, 
 	0x2c, 0x20, 0x61, 0x73, 0x74, 0x2e, 0x6c, 0x65, 0x66, 0x74, 0x29, 0xa, 0x9, 0x9, 0x67, 0x65, 
 	0x6e, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 0x61, 0x73, 0x74, 0x2e, 0x72, 0x69, 0x67, 0x68, 
 	0x74, 0x29, 0xa, 0x9, 0x9, 0x63, 0x61, 0x6c, 0x6c, 0x5f, 0x6f, 0x72, 0x5f, 0x74, 0x61, 0x69, 
 	0x6c, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 0x74, 0x61, 0x69, 0x6c, 0x2c, 0x20, 0x61, 0x73, 
-	0x74, 0x2e, 0x6c, 0x69, 0x6e, 0x65, 0x2c, 0x20, 0x31, 0x29, 0xa, 0x9, 0x9, 0x72, 0x65, 0x74, 
+	0x74, 0x2e, 0x6c, 0x69, 0x6e, 0x65, 0x2c, 0x20, 0x32, 0x29, 0xa, 0x9, 0x9, 0x72, 0x65, 0x74, 
 	0x75, 0x72, 0x6e, 0xa, 0x9, 0x65, 0x6c, 0x73, 0x65, 0x69, 0x66, 0x20, 0x61, 0x73, 0x74, 0x2e, 
-	0x6f, 0x70, 0x65, 0x72, 0x61, 0x74, 0x6f, 0x72, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x3e, 0x27, 0x20, 
+	0x6f, 0x70, 0x65, 0x72, 0x61, 0x74, 0x6f, 0x72, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x2e, 0x27, 0x20, 
 	0x74, 0x68, 0x65, 0x6e, 0xa, 0x9, 0x9, 0x67, 0x65, 0x6e, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 
-	0x20, 0x61, 0x73, 0x74, 0x2e, 0x72, 0x69, 0x67, 0x68, 0x74, 0x29, 0xa, 0x9, 0x9, 0x67, 0x65, 
-	0x6e, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 0x61, 0x73, 0x74, 0x2e, 0x6c, 0x65, 0x66, 0x74, 
-	0x29, 0xa, 0x9, 0x9, 0x67, 0x65, 0x6e, 0x5f, 0x69, 0x6e, 0x73, 0x74, 0x28, 0x66, 0x75, 0x6e, 
-	0x63, 0x2c, 0x20, 0x27, 0x4c, 0x45, 0x53, 0x53, 0x27, 0x2c, 0x20, 0x61, 0x73, 0x74, 0x2e, 0x6c, 
-	0x69, 0x6e, 0x65, 0x29, 0xa, 0x9, 0x9, 0x66, 0x75, 0x6e, 0x63, 0x2e, 0x73, 0x74, 0x61, 0x63, 
-	0x6b, 0x5f, 0x70, 0x6f, 0x69, 0x6e, 0x74, 0x65, 0x72, 0x20, 0x3d, 0x20, 0x66, 0x75, 0x6e, 0x63, 
-	0x2e, 0x73, 0x74, 0x61, 0x63, 0x6b, 0x5f, 0x70, 0x6f, 0x69, 0x6e, 0x74, 0x65, 0x72, 0x20, 0x2d, 
-	0x20, 0x31, 0xa, 0x9, 0x9, 0x72, 0x65, 0x74, 0x75, 0x72, 0x6e, 0xa, 0x9, 0x65, 0x6c, 0x73, 
-	0x65, 0x69, 0x66, 0x20, 0x61, 0x73, 0x74, 0x2e, 0x6f, 0x70, 0x65, 0x72, 0x61, 0x74, 0x6f, 0x72, 
-	0x20, 0x3d, 0x3d, 0x20, 0x27, 0x3e, 0x3d, 0x27, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x9, 0x9, 
-	0x67, 0x65, 0x6e, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 0x61, 0x73, 0x74, 0x2e, 0x72, 0x69, 
-	0x67, 0x68, 0x74, 0x29, 0xa, 0x9, 0x9, 0x67, 0x65, 0x6e, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 
 	0x20, 0x61, 0x73, 0x74, 0x2e, 0x6c, 0x65, 0x66, 0x74, 0x29, 0xa, 0x9, 0x9, 0x67, 0x65, 0x6e, 
-	0x5f, 0x69, 0x6e, 0x73, 0x74, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 0x27, 0x4c, 0x45, 0x51, 
-	0x55, 0x41, 0x4c, 0x27, 0x2c, 0x20, 0x61, 0x73, 0x74, 0x2e, 0x6c, 0x69, 0x6e, 0x65, 0x29, 0xa, 
-	0x9, 0x9, 0x66, 0x75, 0x6e, 0x63, 0x2e, 0x73, 0x74, 0x61, 0x63, 0x6b, 0x5f, 0x70, 0x6f, 0x69, 
-	0x6e, 0x74, 0x65, 0x72, 0x20, 0x3d, 0x20, 0x66, 0x75, 0x6e, 0x63, 0x2e, 0x73, 0x74, 0x61, 0x63, 
-	0x6b, 0x5f, 0x70, 0x6f, 0x69, 0x6e, 0x74, 0x65, 0x72, 0x20, 0x2d, 0x20, 0x31, 0xa, 0x9, 0x9, 
-	0x72, 0x65, 0x74, 0x75, 0x72, 0x6e, 0xa, 0x9, 0x65, 0x6e, 0x64, 0xa, 0xa, 0x9, 0x67, 0x65, 
-	0x6e, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 0x61, 0x73, 0x74, 0x2e, 0x6c, 0x65, 0x66, 0x74, 
-	0x29, 0xa, 0x9, 0x67, 0x65, 0x6e, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 0x61, 0x73, 0x74, 
-	0x2e, 0x72, 0x69, 0x67, 0x68, 0x74, 0x29, 0xa, 0xa, 0x9, 0x69, 0x66, 0x20, 0x61, 0x73, 0x74, 
-	0x2e, 0x6f, 0x70, 0x65, 0x72, 0x61, 0x74, 0x6f, 0x72, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x2b, 0x27, 
-	0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x9, 0x9, 0x67, 0x65, 0x6e, 0x5f, 0x69, 0x6e, 0x73, 0x74, 
-	0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 0x27, 0x41, 0x44, 0x44, 0x27, 0x2c, 0x20, 0x61, 0x73, 
-	0x74, 0x2e, 0x6c, 0x69, 0x6e, 0x65, 0x29, 0xa, 0x9, 0x65, 0x6c, 0x73, 0x65, 0x69, 0x66, 0x20, 
-	0x61, 0x73, 0x74, 0x2e, 0x6f, 0x70, 0x65, 0x72, 0x61, 0x74, 0x6f, 0x72, 0x20, 0x3d, 0x3d, 0x20, 
-	0x27, 0x2d, 0x27, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x9, 0x9, 0x67, 0x65, 0x6e, 0x5f, 0x69, 
-	0x6e, 0x73, 0x74, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 0x27, 0x53, 0x55, 0x42, 0x27, 0x2c, 
-	0x20, 0x61, 0x73, 0x74, 0x2e, 0x6c, 0x69, 0x6e, 0x65, 0x29, 0xa, 0x9, 0x65, 0x6c, 0x73, 0x65, 
+	0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 0x61, 0x73, 0x74, 0x2e, 0x72, 0x69, 0x67, 0x68, 0x74, 
+	0x29, 0xa, 0x9, 0x9, 0x63, 0x61, 0x6c, 0x6c, 0x5f, 0x6f, 0x72, 0x5f, 0x74, 0x61, 0x69, 0x6c, 
+	0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 0x74, 0x61, 0x69, 0x6c, 0x2c, 0x20, 0x61, 0x73, 0x74, 
+	0x2e, 0x6c, 0x69, 0x6e, 0x65, 0x2c, 0x20, 0x31, 0x29, 0xa, 0x9, 0x9, 0x72, 0x65, 0x74, 0x75, 
+	0x72, 0x6e, 0xa, 0x9, 0x65, 0x6c, 0x73, 0x65, 0x69, 0x66, 0x20, 0x61, 0x73, 0x74, 0x2e, 0x6f, 
+	0x70, 0x65, 0x72, 0x61, 0x74, 0x6f, 0x72, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x3e, 0x27, 0x20, 0x74, 
+	0x68, 0x65, 0x6e, 0xa, 0x9, 0x9, 0x67, 0x65, 0x6e, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 
+	0x61, 0x73, 0x74, 0x2e, 0x72, 0x69, 0x67, 0x68, 0x74, 0x29, 0xa, 0x9, 0x9, 0x67, 0x65, 0x6e, 
+	0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 0x61, 0x73, 0x74, 0x2e, 0x6c, 0x65, 0x66, 0x74, 0x29, 
+	0xa, 0x9, 0x9, 0x67, 0x65, 0x6e, 0x5f, 0x69, 0x6e, 0x73, 0x74, 0x28, 0x66, 0x75, 0x6e, 0x63, 
+	0x2c, 0x20, 0x27, 0x4c, 0x45, 0x53, 0x53, 0x27, 0x2c, 0x20, 0x61, 0x73, 0x74, 0x2e, 0x6c, 0x69, 
+	0x6e, 0x65, 0x29, 0xa, 0x9, 0x9, 0x66, 0x75, 0x6e, 0x63, 0x2e, 0x73, 0x74, 0x61, 0x63, 0x6b, 
+	0x5f, 0x70, 0x6f, 0x69, 0x6e, 0x74, 0x65, 0x72, 0x20, 0x3d, 0x20, 0x66, 0x75, 0x6e, 0x63, 0x2e, 
+	0x73, 0x74, 0x61, 0x63, 0x6b, 0x5f, 0x70, 0x6f, 0x69, 0x6e, 0x74, 0x65, 0x72, 0x20, 0x2d, 0x20, 
+	0x31, 0xa, 0x9, 0x9, 0x72, 0x65, 0x74, 0x75, 0x72, 0x6e, 0xa, 0x9, 0x65, 0x6c, 0x73, 0x65, 
 	0x69, 0x66, 0x20, 0x61, 0x73, 0x74, 0x2e, 0x6f, 0x70, 0x65, 0x72, 0x61, 0x74, 0x6f, 0x72, 0x20, 
-	0x3d, 0x3d, 0x20, 0x27, 0x2a, 0x27, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x9, 0x9, 0x67, 0x65, 
-	0x6e, 0x5f, 0x69, 0x6e, 0x73, 0x74, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 0x27, 0x4d, 0x55, 
-	0x4c, 0x27, 0x2c, 0x20, 0x61, 0x73, 0x74, 0x2e, 0x6c, 0x69, 0x6e, 0x65, 0x29, 0xa, 0x9, 0x65, 
-	0x6c, 0x73, 0x65, 0x69, 0x66, 0x20, 0x61, 0x73, 0x74, 0x2e, 0x6f, 0x70, 0x65, 0x72, 0x61, 0x74, 
-	0x6f, 0x72, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x2f, 0x27, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x9, 
-	0x9, 0x67, 0x65, 0x6e, 0x5f, 0x69, 0x6e, 0x73, 0x74, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 
-	0x27, 0x44, 0x49, 0x56, 0x27, 0x2c, 0x20, 0x61, 0x73, 0x74, 0x2e, 0x6c, 0x69, 0x6e, 0x65, 0x29, 
-	0xa, 0x9, 0x65, 0x6c, 0x73, 0x65, 0x69, 0x66, 0x20, 0x61, 0x73, 0x74, 0x2e, 0x6f, 0x70, 0x65, 
-	0x72, 0x61, 0x74, 0x6f, 0x72, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x25, 0x27, 0x20, 0x74, 0x68, 0x65, 
-	0x6e, 0xa, 0x9, 0x9, 0x67, 0x65, 0x6e, 0x5f, 0x69, 0x6e, 0x73, 0x74, 0x28, 0x66, 0x75, 0x6e, 
-	0x63, 0x2c, 0x20, 0x27, 0x4d, 0x4f, 0x44, 0x27, 0x2c, 0x20, 0x61, 0x73, 0x74, 0x2e, 0x6c, 0x69, 
-	0x6e, 0x65, 0x29, 0xa, 0x9, 0x65, 0x6c, 0x73, 0x65, 0x69, 0x66, 0x20, 0x61, 0x73, 0x74, 0x2e, 
-	0x6f, 0x70, 0x65, 0x72, 0x61, 0x74, 0x6f, 0x72, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x5e, 0x27, 0x20, 
+	0x3d, 0x3d, 0x20, 0x27, 0x3e, 0x3d, 0x27, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x9, 0x9, 0x67, 
+	0x65, 0x6e, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 0x61, 0x73, 0x74, 0x2e, 0x72, 0x69, 0x67, 
+	0x68, 0x74, 0x29, 0xa, 0x9, 0x9, 0x67, 0x65, 0x6e, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 
+	0x61, 0x73, 0x74, 0x2e, 0x6c, 0x65, 0x66, 0x74, 0x29, 0xa, 0x9, 0x9, 0x67, 0x65, 0x6e, 0x5f, 
+	0x69, 0x6e, 0x73, 0x74, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 0x27, 0x4c, 0x45, 0x51, 0x55, 
+	0x41, 0x4c, 0x27, 0x2c, 0x20, 0x61, 0x73, 0x74, 0x2e, 0x6c, 0x69, 0x6e, 0x65, 0x29, 0xa, 0x9, 
+	0x9, 0x66, 0x75, 0x6e, 0x63, 0x2e, 0x73, 0x74, 0x61, 0x63, 0x6b, 0x5f, 0x70, 0x6f, 0x69, 0x6e, 
+	0x74, 0x65, 0x72, 0x20, 0x3d, 0x20, 0x66, 0x75, 0x6e, 0x63, 0x2e, 0x73, 0x74, 0x61, 0x63, 0x6b, 
+	0x5f, 0x70, 0x6f, 0x69, 0x6e, 0x74, 0x65, 0x72, 0x20, 0x2d, 0x20, 0x31, 0xa, 0x9, 0x9, 0x72, 
+	0x65, 0x74, 0x75, 0x72, 0x6e, 0xa, 0x9, 0x65, 0x6e, 0x64, 0xa, 0xa, 0x9, 0x67, 0x65, 0x6e, 
+	0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 0x61, 0x73, 0x74, 0x2e, 0x6c, 0x65, 0x66, 0x74, 0x29, 
+	0xa, 0x9, 0x67, 0x65, 0x6e, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 0x61, 0x73, 0x74, 0x2e, 
+	0x72, 0x69, 0x67, 0x68, 0x74, 0x29, 0xa, 0xa, 0x9, 0x69, 0x66, 0x20, 0x61, 0x73, 0x74, 0x2e, 
+	0x6f, 0x70, 0x65, 0x72, 0x61, 0x74, 0x6f, 0x72, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x2b, 0x27, 0x20, 
 	0x74, 0x68, 0x65, 0x6e, 0xa, 0x9, 0x9, 0x67, 0x65, 0x6e, 0x5f, 0x69, 0x6e, 0x73, 0x74, 0x28, 
-	0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 0x27, 0x50, 0x4f, 0x57, 0x27, 0x2c, 0x20, 0x61, 0x73, 0x74, 
+	0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 0x27, 0x41, 0x44, 0x44, 0x27, 0x2c, 0x20, 0x61, 0x73, 0x74, 
 	0x2e, 0x6c, 0x69, 0x6e, 0x65, 0x29, 0xa, 0x9, 0x65, 0x6c, 0x73, 0x65, 0x69, 0x66, 0x20, 0x61, 
 	0x73, 0x74, 0x2e, 0x6f, 0x70, 0x65, 0x72, 0x61, 0x74, 0x6f, 0x72, 0x20, 0x3d, 0x3d, 0x20, 0x27, 
-	0x3d, 0x3d, 0x27, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x9, 0x9, 0x67, 0x65, 0x6e, 0x5f, 0x69, 
-	0x6e, 0x73, 0x74, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 0x27, 0x45, 0x51, 0x27, 0x2c, 0x20, 
+	0x2d, 0x27, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x9, 0x9, 0x67, 0x65, 0x6e, 0x5f, 0x69, 0x6e, 
+	0x73, 0x74, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 0x27, 0x53, 0x55, 0x42, 0x27, 0x2c, 0x20, 
 	0x61, 0x73, 0x74, 0x2e, 0x6c, 0x69, 0x6e, 0x65, 0x29, 0xa, 0x9, 0x65, 0x6c, 0x73, 0x65, 0x69, 
 	0x66, 0x20, 0x61, 0x73, 0x74, 0x2e, 0x6f, 0x70, 0x65, 0x72, 0x61, 0x74, 0x6f, 0x72, 0x20, 0x3d, 
-	0x3d, 0x20, 0x27, 0x7e, 0x3d, 0x27, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x9, 0x9, 0x67, 0x65, 
-	0x6e, 0x5f, 0x69, 0x6e, 0x73, 0x74, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 0x27, 0x45, 0x51, 
-	0x27, 0x2c, 0x20, 0x61, 0x73, 0x74, 0x2e, 0x6c, 0x69, 0x6e, 0x65, 0x29, 0xa, 0x9, 0x9, 0x67, 
-	0x65, 0x6e, 0x5f, 0x69, 0x6e, 0x73, 0x74, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 0x27, 0x4e, 
-	0x4f, 0x54, 0x27, 0x2c, 0x20, 0x61, 0x73, 0x74, 0x2e, 0x6c, 0x69, 0x6e, 0x65, 0x29, 0xa, 0x9, 
-	0x65, 0x6c, 0x73, 0x65, 0x69, 0x66, 0x20, 0x61, 0x73, 0x74, 0x2e, 0x6f, 0x70, 0x65, 0x72, 0x61, 
-	0x74, 0x6f, 0x72, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x26, 0x27, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 
-	0x9, 0x9, 0x67, 0x65, 0x6e, 0x5f, 0x69, 0x6e, 0x73, 0x74, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 
-	0x20, 0x27, 0x41, 0x4e, 0x44, 0x27, 0x2c, 0x20, 0x61, 0x73, 0x74, 0x2e, 0x6c, 0x69, 0x6e, 0x65, 
-	0x29, 0xa, 0x9, 0x65, 0x6c, 0x73, 0x65, 0x69, 0x66, 0x20, 0x61, 0x73, 0x74, 0x2e, 0x6f, 0x70, 
-	0x65, 0x72, 0x61, 0x74, 0x6f, 0x72, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x7c, 0x27, 0x20, 0x74, 0x68, 
-	0x65, 0x6e, 0xa, 0x9, 0x9, 0x67, 0x65, 0x6e, 0x5f, 0x69, 0x6e, 0x73, 0x74, 0x28, 0x66, 0x75, 
-	0x6e, 0x63, 0x2c, 0x20, 0x27, 0x4f, 0x52, 0x27, 0x2c, 0x20, 0x61, 0x73, 0x74, 0x2e, 0x6c, 0x69, 
-	0x6e, 0x65, 0x29, 0xa, 0x9, 0x65, 0x6c, 0x73, 0x65, 0x69, 0x66, 0x20, 0x61, 0x73, 0x74, 0x2e, 
-	0x6f, 0x70, 0x65, 0x72, 0x61, 0x74, 0x6f, 0x72, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x3c, 0x27, 0x20, 
-	0x74, 0x68, 0x65, 0x6e, 0xa, 0x9, 0x9, 0x67, 0x65, 0x6e, 0x5f, 0x69, 0x6e, 0x73, 0x74, 0x28, 
-	0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 0x27, 0x4c, 0x45, 0x53, 0x53, 0x27, 0x2c, 0x20, 0x61, 0x73, 
-	0x74, 0x2e, 0x6c, 0x69, 0x6e, 0x65, 0x29, 0xa, 0x9, 0x65, 0x6c, 0x73, 0x65, 0x69, 0x66, 0x20, 
-	0x61, 0x73, 0x74, 0x2e, 0x6f, 0x70, 0x65, 0x72, 0x61, 0x74, 0x6f, 0x72, 0x20, 0x3d, 0x3d, 0x20, 
-	0x27, 0x3c, 0x3d, 0x27, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x9, 0x9, 0x67, 0x65, 0x6e, 0x5f, 
-	0x69, 0x6e, 0x73, 0x74, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 0x27, 0x4c, 0x45, 0x51, 0x55, 
-	0x41, 0x4c, 0x27, 0x2c, 0x20, 0x61, 0x73, 0x74, 0x2e, 0x6c, 0x69, 0x6e, 0x65, 0x29, 0xa, 0x9, 
-	0x65, 0x6c, 0x73, 0x65, 0xa, 0x9, 0x9, 0x65, 0x72, 0x72, 0x6f, 0x72, 0x28, 0x27, 0x49, 0x6e, 
-	0x76, 0x61, 0x6c, 0x69, 0x64, 0x20, 0x6f, 0x70, 0x65, 0x72, 0x61, 0x74, 0x6f, 0x72, 0x3a, 0x20, 
-	0x27, 0x20, 0x2e, 0x2e, 0x20, 0x61, 0x73, 0x74, 0x2e, 0x6f, 0x70, 0x65, 0x72, 0x61, 0x74, 0x6f, 
-	0x72, 0x29, 0xa, 0x9, 0x65, 0x6e, 0x64, 0xa, 0xa, 0x9, 0x66, 0x75, 0x6e, 0x63, 0x2e, 0x73, 
-	0x74, 0x61, 0x63, 0x6b, 0x5f, 0x70, 0x6f, 0x69, 0x6e, 0x74, 0x65, 0x72, 0x20, 0x3d, 0x20, 0x66, 
-	0x75, 0x6e, 0x63, 0x2e, 0x73, 0x74, 0x61, 0x63, 0x6b, 0x5f, 0x70, 0x6f, 0x69, 0x6e, 0x74, 0x65, 
-	0x72, 0x20, 0x2d, 0x20, 0x31, 0xa, 0x9, 0x61, 0x73, 0x73, 0x65, 0x72, 0x74, 0x28, 0x66, 0x75, 
-	0x6e, 0x63, 0x2e, 0x73, 0x74, 0x61, 0x63, 0x6b, 0x5f, 0x70, 0x6f, 0x69, 0x6e, 0x74, 0x65, 0x72, 
-	0x20, 0x3e, 0x20, 0x30, 0x29, 0xa, 0x65, 0x6e, 0x64, 0xa, 0xa, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 
-	0x20, 0x66, 0x75, 0x6e, 0x63, 0x74, 0x69, 0x6f, 0x6e, 0x20, 0x67, 0x65, 0x6e, 0x5f, 0x64, 0x6f, 
-	0x74, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 0x61, 0x73, 0x74, 0x2c, 0x20, 0x74, 0x61, 0x69, 
-	0x6c, 0x29, 0xa, 0x9, 0x61, 0x73, 0x73, 0x65, 0x72, 0x74, 0x28, 0x61, 0x73, 0x74, 0x2e, 0x74, 
-	0x79, 0x70, 0x65, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x64, 0x6f, 0x74, 0x27, 0x29, 0xa, 0x9, 0x67, 
-	0x65, 0x6e, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 0x61, 0x73, 0x74, 0x2e, 0x6c, 0x65, 0x66, 
-	0x74, 0x29, 0xa, 0x9, 0x66, 0x6f, 0x72, 0x20, 0x5f, 0x2c, 0x61, 0x72, 0x67, 0x20, 0x69, 0x6e, 
-	0x20, 0x69, 0x70, 0x61, 0x69, 0x72, 0x73, 0x28, 0x61, 0x73, 0x74, 0x2e, 0x70, 0x61, 0x74, 0x68, 
-	0x29, 0x20, 0x64, 0x6f, 0xa, 0x9, 0x9, 0x67, 0x65, 0x6e, 0x5f, 0x63, 0x6f, 0x6e, 0x73, 0x74, 
-	0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 0x61, 0x72, 0x67, 0x29, 0xa, 0x9, 0x9, 0x63, 0x61, 
-	0x6c, 0x6c, 0x5f, 0x6f, 0x72, 0x5f, 0x74, 0x61, 0x69, 0x6c, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 
-	0x20, 0x66, 0x61, 0x6c, 0x73, 0x65, 0x2c, 0x20, 0x61, 0x73, 0x74, 0x2e, 0x6c, 0x69, 0x6e, 0x65, 
-	0x2c, 0x20, 0x31, 0x29, 0xa, 0x9, 0x65, 0x6e, 0x64, 0xa, 0x65, 0x6e, 0x64, 0xa, 0xa, 0x6c, 
-	0x6f, 0x63, 0x61, 0x6c, 0x20, 0x66, 0x75, 0x6e, 0x63, 0x74, 0x69, 0x6f, 0x6e, 0x20, 0x67, 0x65, 
-	0x6e, 0x5f, 0x63, 0x6f, 0x6c, 0x6c, 0x65, 0x63, 0x74, 0x69, 0x6f, 0x6e, 0x28, 0x66, 0x75, 0x6e, 
-	0x63, 0x2c, 0x20, 0x61, 0x73, 0x74, 0x2c, 0x20, 0x74, 0x61, 0x69, 0x6c, 0x29, 0xa, 0x9, 0x61, 
-	0x73, 0x73, 0x65, 0x72, 0x74, 0x28, 0x61, 0x73, 0x74, 0x2e, 0x74, 0x79, 0x70, 0x65, 0x20, 0x3d, 
-	0x3d, 0x20, 0x27, 0x63, 0x6f, 0x6c, 0x6c, 0x65, 0x63, 0x74, 0x69, 0x6f, 0x6e, 0x27, 0x29, 0xa, 
+	0x3d, 0x20, 0x27, 0x2a, 0x27, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x9, 0x9, 0x67, 0x65, 0x6e, 
+	0x5f, 0x69, 0x6e, 0x73, 0x74, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 0x27, 0x4d, 0x55, 0x4c, 
+	0x27, 0x2c, 0x20, 0x61, 0x73, 0x74, 0x2e, 0x6c, 0x69, 0x6e, 0x65, 0x29, 0xa, 0x9, 0x65, 0x6c, 
+	0x73, 0x65, 0x69, 0x66, 0x20, 0x61, 0x73, 0x74, 0x2e, 0x6f, 0x70, 0x65, 0x72, 0x61, 0x74, 0x6f, 
+	0x72, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x2f, 0x27, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x9, 0x9, 
+	0x67, 0x65, 0x6e, 0x5f, 0x69, 0x6e, 0x73, 0x74, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 0x27, 
+	0x44, 0x49, 0x56, 0x27, 0x2c, 0x20, 0x61, 0x73, 0x74, 0x2e, 0x6c, 0x69, 0x6e, 0x65, 0x29, 0xa, 
+	0x9, 0x65, 0x6c, 0x73, 0x65, 0x69, 0x66, 0x20, 0x61, 0x73, 0x74, 0x2e, 0x6f, 0x70, 0x65, 0x72, 
+	0x61, 0x74, 0x6f, 0x72, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x25, 0x27, 0x20, 0x74, 0x68, 0x65, 0x6e, 
+	0xa, 0x9, 0x9, 0x67, 0x65, 0x6e, 0x5f, 0x69, 0x6e, 0x73, 0x74, 0x28, 0x66, 0x75, 0x6e, 0x63, 
+	0x2c, 0x20, 0x27, 0x4d, 0x4f, 0x44, 0x27, 0x2c, 0x20, 0x61, 0x73, 0x74, 0x2e, 0x6c, 0x69, 0x6e, 
+	0x65, 0x29, 0xa, 0x9, 0x65, 0x6c, 0x73, 0x65, 0x69, 0x66, 0x20, 0x61, 0x73, 0x74, 0x2e, 0x6f, 
+	0x70, 0x65, 0x72, 0x61, 0x74, 0x6f, 0x72, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x5e, 0x27, 0x20, 0x74, 
+	0x68, 0x65, 0x6e, 0xa, 0x9, 0x9, 0x67, 0x65, 0x6e, 0x5f, 0x69, 0x6e, 0x73, 0x74, 0x28, 0x66, 
+	0x75, 0x6e, 0x63, 0x2c, 0x20, 0x27, 0x50, 0x4f, 0x57, 0x27, 0x2c, 0x20, 0x61, 0x73, 0x74, 0x2e, 
+	0x6c, 0x69, 0x6e, 0x65, 0x29, 0xa, 0x9, 0x65, 0x6c, 0x73, 0x65, 0x69, 0x66, 0x20, 0x61, 0x73, 
+	0x74, 0x2e, 0x6f, 0x70, 0x65, 0x72, 0x61, 0x74, 0x6f, 0x72, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x3d, 
+	0x3d, 0x27, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x9, 0x9, 0x67, 0x65, 0x6e, 0x5f, 0x69, 0x6e, 
+	0x73, 0x74, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 0x27, 0x45, 0x51, 0x27, 0x2c, 0x20, 0x61, 
+	0x73, 0x74, 0x2e, 0x6c, 0x69, 0x6e, 0x65, 0x29, 0xa, 0x9, 0x65, 0x6c, 0x73, 0x65, 0x69, 0x66, 
+	0x20, 0x61, 0x73, 0x74, 0x2e, 0x6f, 0x70, 0x65, 0x72, 0x61, 0x74, 0x6f, 0x72, 0x20, 0x3d, 0x3d, 
+	0x20, 0x27, 0x7e, 0x3d, 0x27, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x9, 0x9, 0x67, 0x65, 0x6e, 
+	0x5f, 0x69, 0x6e, 0x73, 0x74, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 0x27, 0x45, 0x51, 0x27, 
+	0x2c, 0x20, 0x61, 0x73, 0x74, 0x2e, 0x6c, 0x69, 0x6e, 0x65, 0x29, 0xa, 0x9, 0x9, 0x67, 0x65, 
+	0x6e, 0x5f, 0x69, 0x6e, 0x73, 0x74, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 0x27, 0x4e, 0x4f, 
+	0x54, 0x27, 0x2c, 0x20, 0x61, 0x73, 0x74, 0x2e, 0x6c, 0x69, 0x6e, 0x65, 0x29, 0xa, 0x9, 0x65, 
+	0x6c, 0x73, 0x65, 0x69, 0x66, 0x20, 0x61, 0x73, 0x74, 0x2e, 0x6f, 0x70, 0x65, 0x72, 0x61, 0x74, 
+	0x6f, 0x72, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x26, 0x27, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x9, 
 	0x9, 0x67, 0x65, 0x6e, 0x5f, 0x69, 0x6e, 0x73, 0x74, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 
-	0x27, 0x47, 0x45, 0x54, 0x47, 0x4c, 0x4f, 0x42, 0x41, 0x4c, 0x27, 0x2c, 0x20, 0x61, 0x73, 0x74, 
-	0x2e, 0x6c, 0x69, 0x6e, 0x65, 0x2c, 0x20, 0x70, 0x75, 0x73, 0x68, 0x5f, 0x63, 0x6f, 0x6e, 0x73, 
-	0x74, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 0x61, 0x73, 0x74, 0x2e, 0x63, 0x6f, 0x6c, 0x6c, 
-	0x65, 0x63, 0x74, 0x69, 0x6f, 0x6e, 0x29, 0x29, 0xa, 0x9, 0x66, 0x75, 0x6e, 0x63, 0x2e, 0x73, 
-	0x74, 0x61, 0x63, 0x6b, 0x5f, 0x70, 0x6f, 0x69, 0x6e, 0x74, 0x65, 0x72, 0x20, 0x3d, 0x20, 0x66, 
-	0x75, 0x6e, 0x63, 0x2e, 0x73, 0x74, 0x61, 0x63, 0x6b, 0x5f, 0x70, 0x6f, 0x69, 0x6e, 0x74, 0x65, 
-	0x72, 0x20, 0x2b, 0x20, 0x31, 0xa, 0x9, 0x66, 0x6f, 0x72, 0x20, 0x5f, 0x2c, 0x61, 0x72, 0x67, 
-	0x20, 0x69, 0x6e, 0x20, 0x69, 0x70, 0x61, 0x69, 0x72, 0x73, 0x28, 0x61, 0x73, 0x74, 0x2e, 0x61, 
-	0x72, 0x67, 0x73, 0x29, 0x20, 0x64, 0x6f, 0xa, 0x9, 0x9, 0x67, 0x65, 0x6e, 0x28, 0x66, 0x75, 
-	0x6e, 0x63, 0x2c, 0x20, 0x61, 0x72, 0x67, 0x29, 0xa, 0x9, 0x65, 0x6e, 0x64, 0xa, 0x9, 0x63, 
-	0x61, 0x6c, 0x6c, 0x5f, 0x6f, 0x72, 0x5f, 0x74, 0x61, 0x69, 0x6c, 0x28, 0x66, 0x75, 0x6e, 0x63, 
-	0x2c, 0x20, 0x74, 0x61, 0x69, 0x6c, 0x2c, 0x20, 0x61, 0x73, 0x74, 0x2e, 0x6c, 0x69, 0x6e, 0x65, 
-	0x2c, 0x20, 0x23, 0x61, 0x73, 0x74, 0x2e, 0x61, 0x72, 0x67, 0x73, 0x29, 0xa, 0x65, 0x6e, 0x64, 
-	0xa, 0xa, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x20, 0x66, 0x75, 0x6e, 0x63, 0x74, 0x69, 0x6f, 0x6e, 
-	0x20, 0x67, 0x65, 0x6e, 0x5f, 0x62, 0x6c, 0x6f, 0x63, 0x6b, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 
-	0x20, 0x61, 0x73, 0x74, 0x2c, 0x20, 0x74, 0x61, 0x69, 0x6c, 0x29, 0xa, 0x9, 0x61, 0x73, 0x73, 
-	0x65, 0x72, 0x74, 0x28, 0x61, 0x73, 0x74, 0x2e, 0x74, 0x79, 0x70, 0x65, 0x20, 0x3d, 0x3d, 0x20, 
-	0x27, 0x62, 0x6c, 0x6f, 0x63, 0x6b, 0x27, 0x29, 0xa, 0x9, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x20, 
-	0x6e, 0x75, 0x6d, 0x20, 0x3d, 0x20, 0x23, 0x61, 0x73, 0x74, 0x2e, 0x62, 0x6f, 0x64, 0x79, 0xa, 
-	0x9, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x20, 0x73, 0x74, 0x61, 0x63, 0x6b, 0x20, 0x3d, 0x20, 0x66, 
-	0x75, 0x6e, 0x63, 0x2e, 0x73, 0x74, 0x61, 0x63, 0x6b, 0x5f, 0x70, 0x6f, 0x69, 0x6e, 0x74, 0x65, 
-	0x72, 0xa, 0x9, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x20, 0x6c, 0x61, 0x62, 0x6c, 0x65, 0x73, 0x20, 
-	0x3d, 0x20, 0x74, 0x61, 0x62, 0x6c, 0x65, 0x5f, 0x63, 0x6c, 0x6f, 0x6e, 0x65, 0x28, 0x66, 0x75, 
-	0x6e, 0x63, 0x2e, 0x6c, 0x61, 0x62, 0x6c, 0x65, 0x73, 0x29, 0xa, 0xa, 0x9, 0x66, 0x6f, 0x72, 
-	0x20, 0x69, 0x20, 0x3d, 0x20, 0x31, 0x2c, 0x20, 0x6e, 0x75, 0x6d, 0x20, 0x2d, 0x20, 0x31, 0x20, 
-	0x64, 0x6f, 0xa, 0x9, 0x9, 0x67, 0x65, 0x6e, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 0x61, 
-	0x73, 0x74, 0x2e, 0x62, 0x6f, 0x64, 0x79, 0x5b, 0x69, 0x5d, 0x29, 0xa, 0x9, 0x9, 0x67, 0x65, 
-	0x6e, 0x5f, 0x70, 0x6f, 0x70, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x29, 0xa, 0x9, 0x65, 0x6e, 0x64, 
-	0xa, 0x9, 0x67, 0x65, 0x6e, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 0x61, 0x73, 0x74, 0x2e, 
-	0x62, 0x6f, 0x64, 0x79, 0x5b, 0x6e, 0x75, 0x6d, 0x5d, 0x2c, 0x20, 0x74, 0x61, 0x69, 0x6c, 0x29, 
-	0xa, 0x9, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x20, 0x73, 0x68, 0x69, 0x66, 0x74, 0x20, 0x3d, 0x20, 
-	0x66, 0x75, 0x6e, 0x63, 0x2e, 0x73, 0x74, 0x61, 0x63, 0x6b, 0x5f, 0x70, 0x6f, 0x69, 0x6e, 0x74, 
-	0x65, 0x72, 0x20, 0x2d, 0x20, 0x28, 0x73, 0x74, 0x61, 0x63, 0x6b, 0x20, 0x2b, 0x20, 0x31, 0x29, 
-	0xa, 0x9, 0x69, 0x66, 0x20, 0x73, 0x68, 0x69, 0x66, 0x74, 0x20, 0x3e, 0x20, 0x30, 0x20, 0x74, 
+	0x27, 0x41, 0x4e, 0x44, 0x27, 0x2c, 0x20, 0x61, 0x73, 0x74, 0x2e, 0x6c, 0x69, 0x6e, 0x65, 0x29, 
+	0xa, 0x9, 0x65, 0x6c, 0x73, 0x65, 0x69, 0x66, 0x20, 0x61, 0x73, 0x74, 0x2e, 0x6f, 0x70, 0x65, 
+	0x72, 0x61, 0x74, 0x6f, 0x72, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x7c, 0x27, 0x20, 0x74, 0x68, 0x65, 
+	0x6e, 0xa, 0x9, 0x9, 0x67, 0x65, 0x6e, 0x5f, 0x69, 0x6e, 0x73, 0x74, 0x28, 0x66, 0x75, 0x6e, 
+	0x63, 0x2c, 0x20, 0x27, 0x4f, 0x52, 0x27, 0x2c, 0x20, 0x61, 0x73, 0x74, 0x2e, 0x6c, 0x69, 0x6e, 
+	0x65, 0x29, 0xa, 0x9, 0x65, 0x6c, 0x73, 0x65, 0x69, 0x66, 0x20, 0x61, 0x73, 0x74, 0x2e, 0x6f, 
+	0x70, 0x65, 0x72, 0x61, 0x74, 0x6f, 0x72, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x3c, 0x27, 0x20, 0x74, 
 	0x68, 0x65, 0x6e, 0xa, 0x9, 0x9, 0x67, 0x65, 0x6e, 0x5f, 0x69, 0x6e, 0x73, 0x74, 0x28, 0x66, 
-	0x75, 0x6e, 0x63, 0x2c, 0x20, 0x27, 0x53, 0x48, 0x49, 0x46, 0x54, 0x27, 0x2c, 0x20, 0x61, 0x73, 
-	0x74, 0x2e, 0x6c, 0x69, 0x6e, 0x65, 0x2c, 0x20, 0x73, 0x68, 0x69, 0x66, 0x74, 0x29, 0xa, 0x9, 
-	0x9, 0x66, 0x75, 0x6e, 0x63, 0x2e, 0x73, 0x74, 0x61, 0x63, 0x6b, 0x5f, 0x70, 0x6f, 0x69, 0x6e, 
-	0x74, 0x65, 0x72, 0x20, 0x3d, 0x20, 0x66, 0x75, 0x6e, 0x63, 0x2e, 0x73, 0x74, 0x61, 0x63, 0x6b, 
-	0x5f, 0x70, 0x6f, 0x69, 0x6e, 0x74, 0x65, 0x72, 0x20, 0x2d, 0x20, 0x73, 0x68, 0x69, 0x66, 0x74, 
-	0xa, 0x9, 0x65, 0x6e, 0x64, 0xa, 0x9, 0x66, 0x75, 0x6e, 0x63, 0x2e, 0x6c, 0x61, 0x62, 0x6c, 
-	0x65, 0x73, 0x20, 0x3d, 0x20, 0x6c, 0x61, 0x62, 0x6c, 0x65, 0x73, 0xa, 0x65, 0x6e, 0x64, 0xa, 
-	0xa, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x20, 0x66, 0x75, 0x6e, 0x63, 0x74, 0x69, 0x6f, 0x6e, 0x20, 
-	0x67, 0x65, 0x6e, 0x5f, 0x63, 0x6f, 0x6e, 0x64, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 0x61, 
-	0x73, 0x74, 0x2c, 0x20, 0x74, 0x61, 0x69, 0x6c, 0x29, 0xa, 0x9, 0x61, 0x73, 0x73, 0x65, 0x72, 
-	0x74, 0x28, 0x61, 0x73, 0x74, 0x2e, 0x74, 0x79, 0x70, 0x65, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x63, 
-	0x6f, 0x6e, 0x64, 0x27, 0x29, 0xa, 0x9, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x20, 0x73, 0x74, 0x61, 
-	0x63, 0x6b, 0x20, 0x3d, 0x20, 0x66, 0x75, 0x6e, 0x63, 0x2e, 0x73, 0x74, 0x61, 0x63, 0x6b, 0x5f, 
-	0x70, 0x6f, 0x69, 0x6e, 0x74, 0x65, 0x72, 0xa, 0x9, 0x67, 0x65, 0x6e, 0x28, 0x66, 0x75, 0x6e, 
-	0x63, 0x2c, 0x20, 0x61, 0x73, 0x74, 0x2e, 0x63, 0x6f, 0x6e, 0x64, 0x29, 0xa, 0x9, 0x66, 0x75, 
+	0x75, 0x6e, 0x63, 0x2c, 0x20, 0x27, 0x4c, 0x45, 0x53, 0x53, 0x27, 0x2c, 0x20, 0x61, 0x73, 0x74, 
+	0x2e, 0x6c, 0x69, 0x6e, 0x65, 0x29, 0xa, 0x9, 0x65, 0x6c, 0x73, 0x65, 0x69, 0x66, 0x20, 0x61, 
+	0x73, 0x74, 0x2e, 0x6f, 0x70, 0x65, 0x72, 0x61, 0x74, 0x6f, 0x72, 0x20, 0x3d, 0x3d, 0x20, 0x27, 
+	0x3c, 0x3d, 0x27, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x9, 0x9, 0x67, 0x65, 0x6e, 0x5f, 0x69, 
+	0x6e, 0x73, 0x74, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 0x27, 0x4c, 0x45, 0x51, 0x55, 0x41, 
+	0x4c, 0x27, 0x2c, 0x20, 0x61, 0x73, 0x74, 0x2e, 0x6c, 0x69, 0x6e, 0x65, 0x29, 0xa, 0x9, 0x65, 
+	0x6c, 0x73, 0x65, 0xa, 0x9, 0x9, 0x65, 0x72, 0x72, 0x6f, 0x72, 0x28, 0x27, 0x49, 0x6e, 0x76, 
+	0x61, 0x6c, 0x69, 0x64, 0x20, 0x6f, 0x70, 0x65, 0x72, 0x61, 0x74, 0x6f, 0x72, 0x3a, 0x20, 0x27, 
+	0x20, 0x2e, 0x2e, 0x20, 0x61, 0x73, 0x74, 0x2e, 0x6f, 0x70, 0x65, 0x72, 0x61, 0x74, 0x6f, 0x72, 
+	0x29, 0xa, 0x9, 0x65, 0x6e, 0x64, 0xa, 0xa, 0x9, 0x66, 0x75, 0x6e, 0x63, 0x2e, 0x73, 0x74, 
+	0x61, 0x63, 0x6b, 0x5f, 0x70, 0x6f, 0x69, 0x6e, 0x74, 0x65, 0x72, 0x20, 0x3d, 0x20, 0x66, 0x75, 
 	0x6e, 0x63, 0x2e, 0x73, 0x74, 0x61, 0x63, 0x6b, 0x5f, 0x70, 0x6f, 0x69, 0x6e, 0x74, 0x65, 0x72, 
-	0x20, 0x3d, 0x20, 0x73, 0x74, 0x61, 0x63, 0x6b, 0xa, 0xa, 0x9, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 
-	0x20, 0x63, 0x6f, 0x6e, 0x64, 0x69, 0x64, 0x78, 0x20, 0x3d, 0x20, 0x23, 0x66, 0x75, 0x6e, 0x63, 
-	0x2e, 0x69, 0x6e, 0x73, 0x74, 0x72, 0x75, 0x63, 0x74, 0x69, 0x6f, 0x6e, 0x73, 0x20, 0x2b, 0x20, 
-	0x31, 0xa, 0x9, 0x66, 0x75, 0x6e, 0x63, 0x2e, 0x69, 0x6e, 0x73, 0x74, 0x72, 0x75, 0x63, 0x74, 
-	0x69, 0x6f, 0x6e, 0x73, 0x5b, 0x63, 0x6f, 0x6e, 0x64, 0x69, 0x64, 0x78, 0x5d, 0x20, 0x3d, 0x20, 
-	0x7b, 0x27, 0x54, 0x45, 0x53, 0x54, 0x27, 0x2c, 0x20, 0x30, 0x2c, 0x20, 0x30, 0x7d, 0xa, 0x9, 
-	0x66, 0x75, 0x6e, 0x63, 0x2e, 0x6c, 0x69, 0x6e, 0x65, 0x6e, 0x72, 0x5b, 0x63, 0x6f, 0x6e, 0x64, 
-	0x69, 0x64, 0x78, 0x5d, 0x20, 0x3d, 0x20, 0x61, 0x73, 0x74, 0x2e, 0x63, 0x6f, 0x6e, 0x64, 0x2e, 
-	0x6c, 0x69, 0x6e, 0x65, 0xa, 0xa, 0x9, 0x69, 0x66, 0x20, 0x61, 0x73, 0x74, 0x2e, 0x5f, 0x65, 
-	0x6c, 0x73, 0x65, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x9, 0x9, 0x67, 0x65, 0x6e, 0x28, 0x66, 
-	0x75, 0x6e, 0x63, 0x2c, 0x20, 0x61, 0x73, 0x74, 0x2e, 0x5f, 0x65, 0x6c, 0x73, 0x65, 0x2c, 0x20, 
-	0x74, 0x61, 0x69, 0x6c, 0x29, 0xa, 0x9, 0x65, 0x6c, 0x73, 0x65, 0xa, 0x9, 0x9, 0x6c, 0x6f, 
-	0x63, 0x61, 0x6c, 0x20, 0x6e, 0x20, 0x3d, 0x20, 0x7b, 0x74, 0x79, 0x70, 0x65, 0x20, 0x3d, 0x20, 
-	0x27, 0x69, 0x64, 0x65, 0x6e, 0x74, 0x69, 0x66, 0x69, 0x65, 0x72, 0x27, 0x2c, 0x20, 0x76, 0x61, 
-	0x6c, 0x75, 0x65, 0x20, 0x3d, 0x20, 0x27, 0x6e, 0x69, 0x6c, 0x27, 0x2c, 0x20, 0x66, 0x69, 0x6c, 
-	0x65, 0x20, 0x3d, 0x20, 0x61, 0x73, 0x74, 0x2e, 0x5f, 0x69, 0x66, 0x2e, 0x66, 0x69, 0x6c, 0x65, 
-	0x2c, 0x20, 0x6c, 0x69, 0x6e, 0x65, 0x20, 0x3d, 0x20, 0x61, 0x73, 0x74, 0x2e, 0x5f, 0x69, 0x66, 
-	0x2e, 0x6c, 0x69, 0x6e, 0x65, 0x7d, 0xa, 0x9, 0x9, 0x67, 0x65, 0x6e, 0x28, 0x66, 0x75, 0x6e, 
-	0x63, 0x2c, 0x20, 0x6e, 0x2c, 0x20, 0x74, 0x61, 0x69, 0x6c, 0x29, 0xa, 0x9, 0x65, 0x6e, 0x64, 
-	0xa, 0xa, 0x9, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x20, 0x6a, 0x6d, 0x70, 0x69, 0x64, 0x78, 0x20, 
-	0x3d, 0x20, 0x23, 0x66, 0x75, 0x6e, 0x63, 0x2e, 0x69, 0x6e, 0x73, 0x74, 0x72, 0x75, 0x63, 0x74, 
-	0x69, 0x6f, 0x6e, 0x73, 0x20, 0x2b, 0x20, 0x31, 0xa, 0x9, 0x66, 0x75, 0x6e, 0x63, 0x2e, 0x69, 
-	0x6e, 0x73, 0x74, 0x72, 0x75, 0x63, 0x74, 0x69, 0x6f, 0x6e, 0x73, 0x5b, 0x6a, 0x6d, 0x70, 0x69, 
-	0x64, 0x78, 0x5d, 0x20, 0x3d, 0x20, 0x7b, 0x27, 0x4a, 0x4d, 0x50, 0x27, 0x2c, 0x20, 0x30, 0x2c, 
-	0x20, 0x30, 0x7d, 0xa, 0x9, 0x66, 0x75, 0x6e, 0x63, 0x2e, 0x6c, 0x69, 0x6e, 0x65, 0x6e, 0x72, 
-	0x5b, 0x6a, 0x6d, 0x70, 0x69, 0x64, 0x78, 0x5d, 0x20, 0x3d, 0x20, 0x61, 0x73, 0x74, 0x2e, 0x5f, 
-	0x65, 0x6c, 0x73, 0x65, 0x20, 0x61, 0x6e, 0x64, 0x20, 0x61, 0x73, 0x74, 0x2e, 0x5f, 0x65, 0x6c, 
-	0x73, 0x65, 0x2e, 0x6c, 0x69, 0x6e, 0x65, 0x20, 0x6f, 0x72, 0x20, 0x61, 0x73, 0x74, 0x2e, 0x5f, 
-	0x69, 0x66, 0x2e, 0x6c, 0x69, 0x6e, 0x65, 0xa, 0xa, 0x9, 0x66, 0x75, 0x6e, 0x63, 0x2e, 0x69, 
-	0x6e, 0x73, 0x74, 0x72, 0x75, 0x63, 0x74, 0x69, 0x6f, 0x6e, 0x73, 0x5b, 0x63, 0x6f, 0x6e, 0x64, 
-	0x69, 0x64, 0x78, 0x5d, 0x5b, 0x33, 0x5d, 0x20, 0x3d, 0x20, 0x23, 0x66, 0x75, 0x6e, 0x63, 0x2e, 
-	0x69, 0x6e, 0x73, 0x74, 0x72, 0x75, 0x63, 0x74, 0x69, 0x6f, 0x6e, 0x73, 0xa, 0xa, 0x9, 0x66, 
-	0x75, 0x6e, 0x63, 0x2e, 0x73, 0x74, 0x61, 0x63, 0x6b, 0x5f, 0x70, 0x6f, 0x69, 0x6e, 0x74, 0x65, 
-	0x72, 0x20, 0x3d, 0x20, 0x73, 0x74, 0x61, 0x63, 0x6b, 0xa, 0x9, 0x67, 0x65, 0x6e, 0x28, 0x66, 
-	0x75, 0x6e, 0x63, 0x2c, 0x20, 0x61, 0x73, 0x74, 0x2e, 0x5f, 0x69, 0x66, 0x2c, 0x20, 0x74, 0x61, 
-	0x69, 0x6c, 0x29, 0xa, 0x9, 0x66, 0x75, 0x6e, 0x63, 0x2e, 0x69, 0x6e, 0x73, 0x74, 0x72, 0x75, 
-	0x63, 0x74, 0x69, 0x6f, 0x6e, 0x73, 0x5b, 0x6a, 0x6d, 0x70, 0x69, 0x64, 0x78, 0x5d, 0x5b, 0x33, 
-	0x5d, 0x20, 0x3d, 0x20, 0x23, 0x66, 0x75, 0x6e, 0x63, 0x2e, 0x69, 0x6e, 0x73, 0x74, 0x72, 0x75, 
-	0x63, 0x74, 0x69, 0x6f, 0x6e, 0x73, 0xa, 0x9, 0x61, 0x73, 0x73, 0x65, 0x72, 0x74, 0x28, 0x23, 
-	0x66, 0x75, 0x6e, 0x63, 0x2e, 0x69, 0x6e, 0x73, 0x74, 0x72, 0x75, 0x63, 0x74, 0x69, 0x6f, 0x6e, 
-	0x73, 0x20, 0x3d, 0x3d, 0x20, 0x23, 0x66, 0x75, 0x6e, 0x63, 0x2e, 0x6c, 0x69, 0x6e, 0x65, 0x6e, 
-	0x72, 0x29, 0xa, 0x65, 0x6e, 0x64, 0xa, 0xa, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x20, 0x66, 0x75, 
-	0x6e, 0x63, 0x74, 0x69, 0x6f, 0x6e, 0x20, 0x67, 0x65, 0x6e, 0x5f, 0x66, 0x6f, 0x72, 0x28, 0x66, 
-	0x75, 0x6e, 0x63, 0x2c, 0x20, 0x61, 0x73, 0x74, 0x2c, 0x20, 0x74, 0x61, 0x69, 0x6c, 0x29, 0xa, 
-	0x9, 0x61, 0x73, 0x73, 0x65, 0x72, 0x74, 0x28, 0x61, 0x73, 0x74, 0x2e, 0x74, 0x79, 0x70, 0x65, 
-	0x20, 0x3d, 0x3d, 0x20, 0x27, 0x66, 0x6f, 0x72, 0x27, 0x29, 0xa, 0xa, 0x9, 0x6c, 0x6f, 0x63, 
-	0x61, 0x6c, 0x20, 0x73, 0x74, 0x61, 0x63, 0x6b, 0x20, 0x3d, 0x20, 0x66, 0x75, 0x6e, 0x63, 0x2e, 
-	0x73, 0x74, 0x61, 0x63, 0x6b, 0x5f, 0x70, 0x6f, 0x69, 0x6e, 0x74, 0x65, 0x72, 0x20, 0x2b, 0x20, 
-	0x31, 0xa, 0x9, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x20, 0x62, 0x69, 0x6e, 0x64, 0x5f, 0x69, 0x64, 
-	0x78, 0x20, 0x3d, 0x20, 0x23, 0x66, 0x75, 0x6e, 0x63, 0x2e, 0x6c, 0x61, 0x62, 0x6c, 0x65, 0x73, 
-	0x20, 0x2b, 0x20, 0x31, 0xa, 0x9, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x20, 0x62, 0x69, 0x6e, 0x64, 
-	0x20, 0x3d, 0x20, 0x7b, 0x61, 0x73, 0x74, 0x2e, 0x6e, 0x61, 0x6d, 0x65, 0x2c, 0x20, 0x73, 0x74, 
-	0x61, 0x63, 0x6b, 0x7d, 0xa, 0xa, 0x9, 0x74, 0x61, 0x62, 0x6c, 0x65, 0x2e, 0x69, 0x6e, 0x73, 
-	0x65, 0x72, 0x74, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2e, 0x6c, 0x61, 0x62, 0x6c, 0x65, 0x73, 0x2c, 
-	0x20, 0x62, 0x69, 0x6e, 0x64, 0x29, 0xa, 0x9, 0x67, 0x65, 0x6e, 0x28, 0x66, 0x75, 0x6e, 0x63, 
-	0x2c, 0x20, 0x61, 0x73, 0x74, 0x2e, 0x76, 0x61, 0x6c, 0x75, 0x65, 0x29, 0xa, 0xa, 0x9, 0x6c, 
-	0x6f, 0x63, 0x61, 0x6c, 0x20, 0x6e, 0x20, 0x3d, 0x20, 0x7b, 0x74, 0x79, 0x70, 0x65, 0x20, 0x3d, 
-	0x20, 0x27, 0x69, 0x64, 0x65, 0x6e, 0x74, 0x69, 0x66, 0x69, 0x65, 0x72, 0x27, 0x2c, 0x20, 0x76, 
-	0x61, 0x6c, 0x75, 0x65, 0x20, 0x3d, 0x20, 0x27, 0x6e, 0x69, 0x6c, 0x27, 0x2c, 0x20, 0x66, 0x69, 
-	0x6c, 0x65, 0x20, 0x3d, 0x20, 0x61, 0x73, 0x74, 0x2e, 0x66, 0x69, 0x6c, 0x65, 0x2c, 0x20, 0x6c, 
-	0x69, 0x6e, 0x65, 0x20, 0x3d, 0x20, 0x61, 0x73, 0x74, 0x2e, 0x6c, 0x69, 0x6e, 0x65, 0x7d, 0xa, 
-	0x9, 0x67, 0x65, 0x6e, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 0x6e, 0x29, 0xa, 0xa, 0x9, 
-	0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x20, 0x66, 0x6f, 0x72, 0x69, 0x64, 0x78, 0x20, 0x3d, 0x20, 0x23, 
-	0x66, 0x75, 0x6e, 0x63, 0x2e, 0x69, 0x6e, 0x73, 0x74, 0x72, 0x75, 0x63, 0x74, 0x69, 0x6f, 0x6e, 
-	0x73, 0x20, 0x2b, 0x20, 0x31, 0xa, 0x9, 0x66, 0x75, 0x6e, 0x63, 0x2e, 0x69, 0x6e, 0x73, 0x74, 
-	0x72, 0x75, 0x63, 0x74, 0x69, 0x6f, 0x6e, 0x73, 0x5b, 0x66, 0x6f, 0x72, 0x69, 0x64, 0x78, 0x5d, 
-	0x20, 0x3d, 0x20, 0x7b, 0x27, 0x46, 0x4f, 0x52, 0x27, 0x2c, 0x20, 0x30, 0x2c, 0x20, 0x30, 0x7d, 
-	0xa, 0x9, 0x66, 0x75, 0x6e, 0x63, 0x2e, 0x6c, 0x69, 0x6e, 0x65, 0x6e, 0x72, 0x5b, 0x66, 0x6f, 
-	0x72, 0x69, 0x64, 0x78, 0x5d, 0x20, 0x3d, 0x20, 0x61, 0x73, 0x74, 0x2e, 0x6c, 0x69, 0x6e, 0x65, 
-	0xa, 0xa, 0x9, 0x67, 0x65, 0x6e, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 0x61, 0x73, 0x74, 
-	0x2e, 0x62, 0x6f, 0x64, 0x79, 0x29, 0xa, 0xa, 0x9, 0x67, 0x65, 0x6e, 0x5f, 0x69, 0x6e, 0x73, 
-	0x74, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 0x27, 0x53, 0x48, 0x49, 0x46, 0x54, 0x27, 0x2c, 
-	0x20, 0x61, 0x73, 0x74, 0x2e, 0x6c, 0x69, 0x6e, 0x65, 0x2c, 0x20, 0x31, 0x29, 0xa, 0x9, 0x66, 
+	0x20, 0x2d, 0x20, 0x31, 0xa, 0x9, 0x61, 0x73, 0x73, 0x65, 0x72, 0x74, 0x28, 0x66, 0x75, 0x6e, 
+	0x63, 0x2e, 0x73, 0x74, 0x61, 0x63, 0x6b, 0x5f, 0x70, 0x6f, 0x69, 0x6e, 0x74, 0x65, 0x72, 0x20, 
+	0x3e, 0x20, 0x30, 0x29, 0xa, 0x65, 0x6e, 0x64, 0xa, 0xa, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x20, 
+	0x66, 0x75, 0x6e, 0x63, 0x74, 0x69, 0x6f, 0x6e, 0x20, 0x67, 0x65, 0x6e, 0x5f, 0x64, 0x6f, 0x74, 
+	0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 0x61, 0x73, 0x74, 0x2c, 0x20, 0x74, 0x61, 0x69, 0x6c, 
+	0x29, 0xa, 0x9, 0x61, 0x73, 0x73, 0x65, 0x72, 0x74, 0x28, 0x61, 0x73, 0x74, 0x2e, 0x74, 0x79, 
+	0x70, 0x65, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x64, 0x6f, 0x74, 0x27, 0x29, 0xa, 0x9, 0x67, 0x65, 
+	0x6e, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 0x61, 0x73, 0x74, 0x2e, 0x6c, 0x65, 0x66, 0x74, 
+	0x29, 0xa, 0x9, 0x66, 0x6f, 0x72, 0x20, 0x5f, 0x2c, 0x61, 0x72, 0x67, 0x20, 0x69, 0x6e, 0x20, 
+	0x69, 0x70, 0x61, 0x69, 0x72, 0x73, 0x28, 0x61, 0x73, 0x74, 0x2e, 0x70, 0x61, 0x74, 0x68, 0x29, 
+	0x20, 0x64, 0x6f, 0xa, 0x9, 0x9, 0x69, 0x66, 0x20, 0x6f, 0x70, 0x74, 0x5f, 0x67, 0x65, 0x74, 
+	0x66, 0x69, 0x65, 0x6c, 0x64, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x9, 0x9, 0x9, 0x67, 0x65, 
+	0x6e, 0x5f, 0x69, 0x6e, 0x73, 0x74, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 0x27, 0x47, 0x45, 
+	0x54, 0x46, 0x49, 0x45, 0x4c, 0x44, 0x27, 0x2c, 0x20, 0x61, 0x73, 0x74, 0x2e, 0x6c, 0x69, 0x6e, 
+	0x65, 0x2c, 0x20, 0x70, 0x75, 0x73, 0x68, 0x5f, 0x63, 0x6f, 0x6e, 0x73, 0x74, 0x28, 0x66, 0x75, 
+	0x6e, 0x63, 0x2c, 0x20, 0x61, 0x72, 0x67, 0x2e, 0x76, 0x61, 0x6c, 0x75, 0x65, 0x29, 0x29, 0xa, 
+	0x9, 0x9, 0x65, 0x6c, 0x73, 0x65, 0xa, 0x9, 0x9, 0x9, 0x67, 0x65, 0x6e, 0x5f, 0x63, 0x6f, 
+	0x6e, 0x73, 0x74, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 0x61, 0x72, 0x67, 0x29, 0xa, 0x9, 
+	0x9, 0x9, 0x63, 0x61, 0x6c, 0x6c, 0x5f, 0x6f, 0x72, 0x5f, 0x74, 0x61, 0x69, 0x6c, 0x28, 0x66, 
+	0x75, 0x6e, 0x63, 0x2c, 0x20, 0x66, 0x61, 0x6c, 0x73, 0x65, 0x2c, 0x20, 0x61, 0x73, 0x74, 0x2e, 
+	0x6c, 0x69, 0x6e, 0x65, 0x2c, 0x20, 0x31, 0x29, 0xa, 0x9, 0x9, 0x65, 0x6e, 0x64, 0xa, 0x9, 
+	0x65, 0x6e, 0x64, 0xa, 0x65, 0x6e, 0x64, 0xa, 0xa, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x20, 0x66, 
+	0x75, 0x6e, 0x63, 0x74, 0x69, 0x6f, 0x6e, 0x20, 0x67, 0x65, 0x6e, 0x5f, 0x63, 0x6f, 0x6c, 0x6c, 
+	0x65, 0x63, 0x74, 0x69, 0x6f, 0x6e, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 0x61, 0x73, 0x74, 
+	0x2c, 0x20, 0x74, 0x61, 0x69, 0x6c, 0x29, 0xa, 0x9, 0x61, 0x73, 0x73, 0x65, 0x72, 0x74, 0x28, 
+	0x61, 0x73, 0x74, 0x2e, 0x74, 0x79, 0x70, 0x65, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x63, 0x6f, 0x6c, 
+	0x6c, 0x65, 0x63, 0x74, 0x69, 0x6f, 0x6e, 0x27, 0x29, 0xa, 0x9, 0x67, 0x65, 0x6e, 0x5f, 0x69, 
+	0x6e, 0x73, 0x74, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 0x27, 0x47, 0x45, 0x54, 0x47, 0x4c, 
+	0x4f, 0x42, 0x41, 0x4c, 0x27, 0x2c, 0x20, 0x61, 0x73, 0x74, 0x2e, 0x6c, 0x69, 0x6e, 0x65, 0x2c, 
+	0x20, 0x70, 0x75, 0x73, 0x68, 0x5f, 0x63, 0x6f, 0x6e, 0x73, 0x74, 0x28, 0x66, 0x75, 0x6e, 0x63, 
+	0x2c, 0x20, 0x61, 0x73, 0x74, 0x2e, 0x63, 0x6f, 0x6c, 0x6c, 0x65, 0x63, 0x74, 0x69, 0x6f, 0x6e, 
+	0x29, 0x29, 0xa, 0x9, 0x66, 0x75, 0x6e, 0x63, 0x2e, 0x73, 0x74, 0x61, 0x63, 0x6b, 0x5f, 0x70, 
+	0x6f, 0x69, 0x6e, 0x74, 0x65, 0x72, 0x20, 0x3d, 0x20, 0x66, 0x75, 0x6e, 0x63, 0x2e, 0x73, 0x74, 
+	0x61, 0x63, 0x6b, 0x5f, 0x70, 0x6f, 0x69, 0x6e, 0x74, 0x65, 0x72, 0x20, 0x2b, 0x20, 0x31, 0xa, 
+	0x9, 0x66, 0x6f, 0x72, 0x20, 0x5f, 0x2c, 0x61, 0x72, 0x67, 0x20, 0x69, 0x6e, 0x20, 0x69, 0x70, 
+	0x61, 0x69, 0x72, 0x73, 0x28, 0x61, 0x73, 0x74, 0x2e, 0x61, 0x72, 0x67, 0x73, 0x29, 0x20, 0x64, 
+	0x6f, 0xa, 0x9, 0x9, 0x67, 0x65, 0x6e, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 0x61, 0x72, 
+	0x67, 0x29, 0xa, 0x9, 0x65, 0x6e, 0x64, 0xa, 0x9, 0x63, 0x61, 0x6c, 0x6c, 0x5f, 0x6f, 0x72, 
+	0x5f, 0x74, 0x61, 0x69, 0x6c, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 0x74, 0x61, 0x69, 0x6c, 
+	0x2c, 0x20, 0x61, 0x73, 0x74, 0x2e, 0x6c, 0x69, 0x6e, 0x65, 0x2c, 0x20, 0x23, 0x61, 0x73, 0x74, 
+	0x2e, 0x61, 0x72, 0x67, 0x73, 0x29, 0xa, 0x65, 0x6e, 0x64, 0xa, 0xa, 0x6c, 0x6f, 0x63, 0x61, 
+	0x6c, 0x20, 0x66, 0x75, 0x6e, 0x63, 0x74, 0x69, 0x6f, 0x6e, 0x20, 0x67, 0x65, 0x6e, 0x5f, 0x62, 
+	0x6c, 0x6f, 0x63, 0x6b, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 0x61, 0x73, 0x74, 0x2c, 0x20, 
+	0x74, 0x61, 0x69, 0x6c, 0x29, 0xa, 0x9, 0x61, 0x73, 0x73, 0x65, 0x72, 0x74, 0x28, 0x61, 0x73, 
+	0x74, 0x2e, 0x74, 0x79, 0x70, 0x65, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x62, 0x6c, 0x6f, 0x63, 0x6b, 
+	0x27, 0x29, 0xa, 0x9, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x20, 0x6e, 0x75, 0x6d, 0x20, 0x3d, 0x20, 
+	0x23, 0x61, 0x73, 0x74, 0x2e, 0x62, 0x6f, 0x64, 0x79, 0xa, 0x9, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 
+	0x20, 0x73, 0x74, 0x61, 0x63, 0x6b, 0x20, 0x3d, 0x20, 0x66, 0x75, 0x6e, 0x63, 0x2e, 0x73, 0x74, 
+	0x61, 0x63, 0x6b, 0x5f, 0x70, 0x6f, 0x69, 0x6e, 0x74, 0x65, 0x72, 0xa, 0x9, 0x6c, 0x6f, 0x63, 
+	0x61, 0x6c, 0x20, 0x6c, 0x61, 0x62, 0x6c, 0x65, 0x73, 0x20, 0x3d, 0x20, 0x74, 0x61, 0x62, 0x6c, 
+	0x65, 0x5f, 0x63, 0x6c, 0x6f, 0x6e, 0x65, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2e, 0x6c, 0x61, 0x62, 
+	0x6c, 0x65, 0x73, 0x29, 0xa, 0xa, 0x9, 0x66, 0x6f, 0x72, 0x20, 0x69, 0x20, 0x3d, 0x20, 0x31, 
+	0x2c, 0x20, 0x6e, 0x75, 0x6d, 0x20, 0x2d, 0x20, 0x31, 0x20, 0x64, 0x6f, 0xa, 0x9, 0x9, 0x6c, 
+	0x6f, 0x63, 0x61, 0x6c, 0x20, 0x65, 0x78, 0x70, 0x72, 0x20, 0x3d, 0x20, 0x61, 0x73, 0x74, 0x2e, 
+	0x62, 0x6f, 0x64, 0x79, 0x5b, 0x69, 0x5d, 0xa, 0x9, 0x9, 0x69, 0x66, 0x20, 0x6f, 0x70, 0x74, 
+	0x5f, 0x6f, 0x70, 0x65, 0x72, 0x61, 0x6e, 0x64, 0x73, 0x20, 0x61, 0x6e, 0x64, 0x20, 0x65, 0x78, 
+	0x70, 0x72, 0x2e, 0x74, 0x79, 0x70, 0x65, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x6f, 0x70, 0x65, 0x72, 
+	0x61, 0x74, 0x6f, 0x72, 0x27, 0x20, 0x61, 0x6e, 0x64, 0x20, 0x65, 0x78, 0x70, 0x72, 0x2e, 0x6f, 
+	0x70, 0x65, 0x72, 0x61, 0x74, 0x6f, 0x72, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x3d, 0x27, 0x20, 0x74, 
+	0x68, 0x65, 0x6e, 0xa, 0x9, 0x9, 0x9, 0x2d, 0x2d, 0x20, 0x54, 0x68, 0x65, 0x20, 0x61, 0x73, 
+	0x73, 0x69, 0x67, 0x6e, 0x65, 0x64, 0x20, 0x76, 0x61, 0x6c, 0x75, 0x65, 0x20, 0x73, 0x74, 0x61, 
+	0x79, 0x73, 0x20, 0x69, 0x6e, 0x20, 0x69, 0x74, 0x73, 0x20, 0x73, 0x6c, 0x6f, 0x74, 0x3b, 0x20, 
+	0x6e, 0x6f, 0x20, 0x63, 0x6f, 0x70, 0x79, 0x20, 0x74, 0x6f, 0x20, 0x64, 0x69, 0x73, 0x63, 0x61, 
+	0x72, 0x64, 0x2e, 0xa, 0x9, 0x9, 0x9, 0x67, 0x65, 0x6e, 0x5f, 0x61, 0x73, 0x73, 0x69, 0x67, 
+	0x6e, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 0x65, 0x78, 0x70, 0x72, 0x2c, 0x20, 0x66, 0x61, 
+	0x6c, 0x73, 0x65, 0x2c, 0x20, 0x74, 0x72, 0x75, 0x65, 0x29, 0xa, 0x9, 0x9, 0x65, 0x6c, 0x73, 
+	0x65, 0x69, 0x66, 0x20, 0x65, 0x78, 0x70, 0x72, 0x2e, 0x74, 0x79, 0x70, 0x65, 0x20, 0x3d, 0x3d, 
+	0x20, 0x27, 0x64, 0x65, 0x73, 0x74, 0x72, 0x75, 0x63, 0x74, 0x75, 0x72, 0x65, 0x27, 0x20, 0x74, 
+	0x68, 0x65, 0x6e, 0xa, 0x9, 0x9, 0x9, 0x67, 0x65, 0x6e, 0x5f, 0x64, 0x65, 0x73, 0x74, 0x72, 
+	0x75, 0x63, 0x74, 0x75, 0x72, 0x65, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 0x65, 0x78, 0x70, 
+	0x72, 0x2c, 0x20, 0x74, 0x72, 0x75, 0x65, 0x29, 0xa, 0x9, 0x9, 0x65, 0x6c, 0x73, 0x65, 0xa, 
+	0x9, 0x9, 0x9, 0x67, 0x65, 0x6e, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 0x65, 0x78, 0x70, 
+	0x72, 0x29, 0xa, 0x9, 0x9, 0x9, 0x67, 0x65, 0x6e, 0x5f, 0x70, 0x6f, 0x70, 0x28, 0x66, 0x75, 
+	0x6e, 0x63, 0x29, 0xa, 0x9, 0x9, 0x65, 0x6e, 0x64, 0xa, 0x9, 0x65, 0x6e, 0x64, 0xa, 0x9, 
+	0x67, 0x65, 0x6e, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 0x61, 0x73, 0x74, 0x2e, 0x62, 0x6f, 
+	0x64, 0x79, 0x5b, 0x6e, 0x75, 0x6d, 0x5d, 0x2c, 0x20, 0x74, 0x61, 0x69, 0x6c, 0x29, 0xa, 0x9, 
+	0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x20, 0x73, 0x68, 0x69, 0x66, 0x74, 0x20, 0x3d, 0x20, 0x66, 0x75, 
+	0x6e, 0x63, 0x2e, 0x73, 0x74, 0x61, 0x63, 0x6b, 0x5f, 0x70, 0x6f, 0x69, 0x6e, 0x74, 0x65, 0x72, 
+	0x20, 0x2d, 0x20, 0x28, 0x73, 0x74, 0x61, 0x63, 0x6b, 0x20, 0x2b, 0x20, 0x31, 0x29, 0xa, 0x9, 
+	0x69, 0x66, 0x20, 0x73, 0x68, 0x69, 0x66, 0x74, 0x20, 0x3e, 0x20, 0x30, 0x20, 0x74, 0x68, 0x65, 
+	0x6e, 0xa, 0x9, 0x9, 0x67, 0x65, 0x6e, 0x5f, 0x69, 0x6e, 0x73, 0x74, 0x28, 0x66, 0x75, 0x6e, 
+	0x63, 0x2c, 0x20, 0x27, 0x53, 0x48, 0x49, 0x46, 0x54, 0x27, 0x2c, 0x20, 0x61, 0x73, 0x74, 0x2e, 
+	0x6c, 0x69, 0x6e, 0x65, 0x2c, 0x20, 0x73, 0x68, 0x69, 0x66, 0x74, 0x29, 0xa, 0x9, 0x9, 0x66, 
 	0x75, 0x6e, 0x63, 0x2e, 0x73, 0x74, 0x61, 0x63, 0x6b, 0x5f, 0x70, 0x6f, 0x69, 0x6e, 0x74, 0x65, 
 	0x72, 0x20, 0x3d, 0x20, 0x66, 0x75, 0x6e, 0x63, 0x2e, 0x73, 0x74, 0x61, 0x63, 0x6b, 0x5f, 0x70, 
-	0x6f, 0x69, 0x6e, 0x74, 0x65, 0x72, 0x20, 0x2d, 0x20, 0x31, 0xa, 0xa, 0x9, 0x6c, 0x6f, 0x63, 
-	0x61, 0x6c, 0x20, 0x6a, 0x6d, 0x70, 0x69, 0x64, 0x78, 0x20, 0x3d, 0x20, 0x23, 0x66, 0x75, 0x6e, 
-	0x63, 0x2e, 0x69, 0x6e, 0x73, 0x74, 0x72, 0x75, 0x63, 0x74, 0x69, 0x6f, 0x6e, 0x73, 0x20, 0x2b, 
-	0x20, 0x31, 0xa, 0x9, 0x66, 0x75, 0x6e, 0x63, 0x2e, 0x69, 0x6e, 0x73, 0x74, 0x72, 0x75, 0x63, 
-	0x74, 0x69, 0x6f, 0x6e, 0x73, 0x5b, 0x6a, 0x6d, 0x70, 0x69, 0x64, 0x78, 0x5d, 0x20, 0x3d, 0x20, 
-	0x7b, 0x27, 0x4a, 0x4d, 0x50, 0x27, 0x2c, 0x20, 0x30, 0x2c, 0x20, 0x66, 0x6f, 0x72, 0x69, 0x64, 
-	0x78, 0x20, 0x2d, 0x20, 0x31, 0x7d, 0xa, 0x9, 0x66, 0x75, 0x6e, 0x63, 0x2e, 0x6c, 0x69, 0x6e, 
-	0x65, 0x6e, 0x72, 0x5b, 0x6a, 0x6d, 0x70, 0x69, 0x64, 0x78, 0x5d, 0x20, 0x3d, 0x20, 0x61, 0x73, 
-	0x74, 0x2e, 0x6c, 0x69, 0x6e, 0x65, 0xa, 0xa, 0x9, 0x66, 0x75, 0x6e, 0x63, 0x2e, 0x69, 0x6e, 
-	0x73, 0x74, 0x72, 0x75, 0x63, 0x74, 0x69, 0x6f, 0x6e, 0x73, 0x5b, 0x66, 0x6f, 0x72, 0x69, 0x64, 
-	0x78, 0x5d, 0x5b, 0x33, 0x5d, 0x20, 0x3d, 0x20, 0x23, 0x66, 0x75, 0x6e, 0x63, 0x2e, 0x69, 0x6e, 
-	0x73, 0x74, 0x72, 0x75, 0x63, 0x74, 0x69, 0x6f, 0x6e, 0x73, 0xa, 0x9, 0x66, 0x75, 0x6e, 0x63, 
+	0x6f, 0x69, 0x6e, 0x74, 0x65, 0x72, 0x20, 0x2d, 0x20, 0x73, 0x68, 0x69, 0x66, 0x74, 0xa, 0x9, 
+	0x65, 0x6e, 0x64, 0xa, 0x9, 0x66, 0x75, 0x6e, 0x63, 0x2e, 0x6c, 0x61, 0x62, 0x6c, 0x65, 0x73, 
+	0x20, 0x3d, 0x20, 0x6c, 0x61, 0x62, 0x6c, 0x65, 0x73, 0xa, 0x65, 0x6e, 0x64, 0xa, 0xa, 0x6c, 
+	0x6f, 0x63, 0x61, 0x6c, 0x20, 0x66, 0x75, 0x6e, 0x63, 0x74, 0x69, 0x6f, 0x6e, 0x20, 0x67, 0x65, 
+	0x6e, 0x5f, 0x63, 0x6f, 0x6e, 0x64, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 0x61, 0x73, 0x74, 
+	0x2c, 0x20, 0x74, 0x61, 0x69, 0x6c, 0x29, 0xa, 0x9, 0x61, 0x73, 0x73, 0x65, 0x72, 0x74, 0x28, 
+	0x61, 0x73, 0x74, 0x2e, 0x74, 0x79, 0x70, 0x65, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x63, 0x6f, 0x6e, 
+	0x64, 0x27, 0x29, 0xa, 0x9, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x20, 0x73, 0x74, 0x61, 0x63, 0x6b, 
+	0x20, 0x3d, 0x20, 0x66, 0x75, 0x6e, 0x63, 0x2e, 0x73, 0x74, 0x61, 0x63, 0x6b, 0x5f, 0x70, 0x6f, 
+	0x69, 0x6e, 0x74, 0x65, 0x72, 0xa, 0x9, 0x67, 0x65, 0x6e, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 
+	0x20, 0x61, 0x73, 0x74, 0x2e, 0x63, 0x6f, 0x6e, 0x64, 0x29, 0xa, 0x9, 0x66, 0x75, 0x6e, 0x63, 
 	0x2e, 0x73, 0x74, 0x61, 0x63, 0x6b, 0x5f, 0x70, 0x6f, 0x69, 0x6e, 0x74, 0x65, 0x72, 0x20, 0x3d, 
-	0x20, 0x73, 0x74, 0x61, 0x63, 0x6b, 0xa, 0xa, 0x9, 0x61, 0x73, 0x73, 0x65, 0x72, 0x74, 0x28, 
+	0x20, 0x73, 0x74, 0x61, 0x63, 0x6b, 0xa, 0xa, 0x9, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x20, 0x63, 
+	0x6f, 0x6e, 0x64, 0x69, 0x64, 0x78, 0x20, 0x3d, 0x20, 0x23, 0x66, 0x75, 0x6e, 0x63, 0x2e, 0x69, 
+	0x6e, 0x73, 0x74, 0x72, 0x75, 0x63, 0x74, 0x69, 0x6f, 0x6e, 0x73, 0x20, 0x2b, 0x20, 0x31, 0xa, 
+	0x9, 0x66, 0x75, 0x6e, 0x63, 0x2e, 0x69, 0x6e, 0x73, 0x74, 0x72, 0x75, 0x63, 0x74, 0x69, 0x6f, 
+	0x6e, 0x73, 0x5b, 0x63, 0x6f, 0x6e, 0x64, 0x69, 0x64, 0x78, 0x5d, 0x20, 0x3d, 0x20, 0x7b, 0x27, 
+	0x54, 0x45, 0x53, 0x54, 0x27, 0x2c, 0x20, 0x30, 0x2c, 0x20, 0x30, 0x7d, 0xa, 0x9, 0x66, 0x75, 
+	0x6e, 0x63, 0x2e, 0x6c, 0x69, 0x6e, 0x65, 0x6e, 0x72, 0x5b, 0x63, 0x6f, 0x6e, 0x64, 0x69, 0x64, 
+	0x78, 0x5d, 0x20, 0x3d, 0x20, 0x61, 0x73, 0x74, 0x2e, 0x63, 0x6f, 0x6e, 0x64, 0x2e, 0x6c, 0x69, 
+	0x6e, 0x65, 0xa, 0xa, 0x9, 0x69, 0x66, 0x20, 0x61, 0x73, 0x74, 0x2e, 0x5f, 0x65, 0x6c, 0x73, 
+	0x65, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x9, 0x9, 0x67, 0x65, 0x6e, 0x28, 0x66, 0x75, 0x6e, 
+	0x63, 0x2c, 0x20, 0x61, 0x73, 0x74, 0x2e, 0x5f, 0x65, 0x6c, 0x73, 0x65, 0x2c, 0x20, 0x74, 0x61, 
+	0x69, 0x6c, 0x29, 0xa, 0x9, 0x65, 0x6c, 0x73, 0x65, 0xa, 0x9, 0x9, 0x6c, 0x6f, 0x63, 0x61, 
+	0x6c, 0x20, 0x6e, 0x20, 0x3d, 0x20, 0x7b, 0x74, 0x79, 0x70, 0x65, 0x20, 0x3d, 0x20, 0x27, 0x69, 
+	0x64, 0x65, 0x6e, 0x74, 0x69, 0x66, 0x69, 0x65, 0x72, 0x27, 0x2c, 0x20, 0x76, 0x61, 0x6c, 0x75, 
+	0x65, 0x20, 0x3d, 0x20, 0x27, 0x6e, 0x69, 0x6c, 0x27, 0x2c, 0x20, 0x66, 0x69, 0x6c, 0x65, 0x20, 
+	0x3d, 0x20, 0x61, 0x73, 0x74, 0x2e, 0x5f, 0x69, 0x66, 0x2e, 0x66, 0x69, 0x6c, 0x65, 0x2c, 0x20, 
+	0x6c, 0x69, 0x6e, 0x65, 0x20, 0x3d, 0x20, 0x61, 0x73, 0x74, 0x2e, 0x5f, 0x69, 0x66, 0x2e, 0x6c, 
+	0x69, 0x6e, 0x65, 0x7d, 0xa, 0x9, 0x9, 0x67, 0x65, 0x6e, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 
+	0x20, 0x6e, 0x2c, 0x20, 0x74, 0x61, 0x69, 0x6c, 0x29, 0xa, 0x9, 0x65, 0x6e, 0x64, 0xa, 0xa, 
+	0x9, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x20, 0x6a, 0x6d, 0x70, 0x69, 0x64, 0x78, 0x20, 0x3d, 0x20, 
 	0x23, 0x66, 0x75, 0x6e, 0x63, 0x2e, 0x69, 0x6e, 0x73, 0x74, 0x72, 0x75, 0x63, 0x74, 0x69, 0x6f, 
-	0x6e, 0x73, 0x20, 0x3d, 0x3d, 0x20, 0x23, 0x66, 0x75, 0x6e, 0x63, 0x2e, 0x6c, 0x69, 0x6e, 0x65, 
-	0x6e, 0x72, 0x29, 0xa, 0x9, 0x61, 0x73, 0x73, 0x65, 0x72, 0x74, 0x28, 0x74, 0x61, 0x62, 0x6c, 
-	0x65, 0x2e, 0x72, 0x65, 0x6d, 0x6f, 0x76, 0x65, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2e, 0x6c, 0x61, 
-	0x62, 0x6c, 0x65, 0x73, 0x2c, 0x20, 0x62, 0x69, 0x6e, 0x64, 0x5f, 0x69, 0x64, 0x78, 0x29, 0x20, 
-	0x3d, 0x3d, 0x20, 0x62, 0x69, 0x6e, 0x64, 0x29, 0xa, 0x65, 0x6e, 0x64, 0xa, 0xa, 0x6c, 0x6f, 
-	0x63, 0x61, 0x6c, 0x20, 0x66, 0x75, 0x6e, 0x63, 0x74, 0x69, 0x6f, 0x6e, 0x20, 0x67, 0x65, 0x6e, 
-	0x5f, 0x6c, 0x61, 0x6d, 0x62, 0x64, 0x61, 0x28, 0x70, 0x61, 0x72, 0x65, 0x6e, 0x74, 0x2c, 0x20, 
-	0x61, 0x73, 0x74, 0x29, 0xa, 0x9, 0x61, 0x73, 0x73, 0x65, 0x72, 0x74, 0x28, 0x61, 0x73, 0x74, 
-	0x2e, 0x74, 0x79, 0x70, 0x65, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x6c, 0x61, 0x6d, 0x62, 0x64, 0x61, 
-	0x27, 0x29, 0xa, 0x9, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x20, 0x66, 0x75, 0x6e, 0x63, 0x20, 0x3d, 
-	0x20, 0x7b, 0xa, 0x9, 0x9, 0x69, 0x6e, 0x73, 0x74, 0x72, 0x75, 0x63, 0x74, 0x69, 0x6f, 0x6e, 
-	0x73, 0x20, 0x3d, 0x20, 0x7b, 0x7d, 0x2c, 0xa, 0x9, 0x9, 0x6c, 0x69, 0x6e, 0x65, 0x6e, 0x72, 
-	0x20, 0x3d, 0x20, 0x7b, 0x7d, 0x2c, 0xa, 0x9, 0x9, 0x6c, 0x61, 0x62, 0x6c, 0x65, 0x73, 0x20, 
-	0x3d, 0x20, 0x7b, 0x7d, 0x2c, 0xa, 0x9, 0x9, 0x70, 0x72, 0x6f, 0x74, 0x6f, 0x74, 0x79, 0x70, 
-	0x65, 0x73, 0x20, 0x3d, 0x20, 0x7b, 0x7d, 0x2c, 0xa, 0x9, 0x9, 0x63, 0x6f, 0x6e, 0x73, 0x74, 
-	0x61, 0x6e, 0x74, 0x73, 0x20, 0x3d, 0x20, 0x7b, 0x7d, 0x2c, 0xa, 0x9, 0x9, 0x75, 0x70, 0x20, 
-	0x3d, 0x20, 0x7b, 0x7d, 0x2c, 0xa, 0x9, 0x9, 0x6e, 0x75, 0x6d, 0x5f, 0x61, 0x72, 0x67, 0x73, 
-	0x20, 0x3d, 0x20, 0x23, 0x61, 0x73, 0x74, 0x2e, 0x61, 0x72, 0x67, 0x73, 0x2c, 0xa, 0x9, 0x9, 
-	0x73, 0x74, 0x61, 0x63, 0x6b, 0x5f, 0x70, 0x6f, 0x69, 0x6e, 0x74, 0x65, 0x72, 0x20, 0x3d, 0x20, 
-	0x30, 0x2c, 0xa, 0x9, 0x9, 0x6e, 0x61, 0x6d, 0x65, 0x20, 0x3d, 0x20, 0x61, 0x73, 0x74, 0x2e, 
-	0x66, 0x69, 0x6c, 0x65, 0x2c, 0xa, 0x9, 0x9, 0x70, 0x61, 0x72, 0x65, 0x6e, 0x74, 0x20, 0x3d, 
-	0x20, 0x70, 0x61, 0x72, 0x65, 0x6e, 0x74, 0xa, 0x9, 0x7d, 0xa, 0xa, 0x9, 0x74, 0x61, 0x62, 
-	0x6c, 0x65, 0x2e, 0x69, 0x6e, 0x73, 0x65, 0x72, 0x74, 0x28, 0x70, 0x61, 0x72, 0x65, 0x6e, 0x74, 
-	0x2e, 0x70, 0x72, 0x6f, 0x74, 0x6f, 0x74, 0x79, 0x70, 0x65, 0x73, 0x2c, 0x20, 0x66, 0x75, 0x6e, 
-	0x63, 0x29, 0xa, 0x9, 0x66, 0x6f, 0x72, 0x20, 0x69, 0x2c, 0x61, 0x72, 0x67, 0x20, 0x69, 0x6e, 
-	0x20, 0x69, 0x70, 0x61, 0x69, 0x72, 0x73, 0x28, 0x61, 0x73, 0x74, 0x2e, 0x61, 0x72, 0x67, 0x73, 
-	0x29, 0x20, 0x64, 0x6f, 0xa, 0x9, 0x9, 0x74, 0x61, 0x62, 0x6c, 0x65, 0x2e, 0x69, 0x6e, 0x73, 
-	0x65, 0x72, 0x74, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2e, 0x6c, 0x61, 0x62, 0x6c, 0x65, 0x73, 0x2c, 
-	0x20, 0x7b, 0x61, 0x72, 0x67, 0x2e, 0x76, 0x61, 0x6c, 0x75, 0x65, 0x2c, 0x20, 0x69, 0x20, 0x2d, 
-	0x20, 0x31, 0x7d, 0x29, 0xa, 0x9, 0x65, 0x6e, 0x64, 0xa, 0x9, 0x66, 0x75, 0x6e, 0x63, 0x2e, 
+	0x6e, 0x73, 0x20, 0x2b, 0x20, 0x31, 0xa, 0x9, 0x66, 0x75, 0x6e, 0x63, 0x2e, 0x69, 0x6e, 0x73, 
+	0x74, 0x72, 0x75, 0x63, 0x74, 0x69, 0x6f, 0x6e, 0x73, 0x5b, 0x6a, 0x6d, 0x70, 0x69, 0x64, 0x78, 
+	0x5d, 0x20, 0x3d, 0x20, 0x7b, 0x27, 0x4a, 0x4d, 0x50, 0x27, 0x2c, 0x20, 0x30, 0x2c, 0x20, 0x30, 
+	0x7d, 0xa, 0x9, 0x66, 0x75, 0x6e, 0x63, 0x2e, 0x6c, 0x69, 0x6e, 0x65, 0x6e, 0x72, 0x5b, 0x6a, 
+	0x6d, 0x70, 0x69, 0x64, 0x78, 0x5d, 0x20, 0x3d, 0x20, 0x61, 0x73, 0x74, 0x2e, 0x5f, 0x65, 0x6c, 
+	0x73, 0x65, 0x20, 0x61, 0x6e, 0x64, 0x20, 0x61, 0x73, 0x74, 0x2e, 0x5f, 0x65, 0x6c, 0x73, 0x65, 
+	0x2e, 0x6c, 0x69, 0x6e, 0x65, 0x20, 0x6f, 0x72, 0x20, 0x61, 0x73, 0x74, 0x2e, 0x5f, 0x69, 0x66, 
+	0x2e, 0x6c, 0x69, 0x6e, 0x65, 0xa, 0xa, 0x9, 0x66, 0x75, 0x6e, 0x63, 0x2e, 0x69, 0x6e, 0x73, 
+	0x74, 0x72, 0x75, 0x63, 0x74, 0x69, 0x6f, 0x6e, 0x73, 0x5b, 0x63, 0x6f, 0x6e, 0x64, 0x69, 0x64, 
+	0x78, 0x5d, 0x5b, 0x33, 0x5d, 0x20, 0x3d, 0x20, 0x23, 0x66, 0x75, 0x6e, 0x63, 0x2e, 0x69, 0x6e, 
+	0x73, 0x74, 0x72, 0x75, 0x63, 0x74, 0x69, 0x6f, 0x6e, 0x73, 0xa, 0xa, 0x9, 0x66, 0x75, 0x6e, 
+	0x63, 0x2e, 0x73, 0x74, 0x61, 0x63, 0x6b, 0x5f, 0x70, 0x6f, 0x69, 0x6e, 0x74, 0x65, 0x72, 0x20, 
+	0x3d, 0x20, 0x73, 0x74, 0x61, 0x63, 0x6b, 0xa, 0x9, 0x67, 0x65, 0x6e, 0x28, 0x66, 0x75, 0x6e, 
+	0x63, 0x2c, 0x20, 0x61, 0x73, 0x74, 0x2e, 0x5f, 0x69, 0x66, 0x2c, 0x20, 0x74, 0x61, 0x69, 0x6c, 
+	0x29, 0xa, 0x9, 0x66, 0x75, 0x6e, 0x63, 0x2e, 0x69, 0x6e, 0x73, 0x74, 0x72, 0x75, 0x63, 0x74, 
+	0x69, 0x6f, 0x6e, 0x73, 0x5b, 0x6a, 0x6d, 0x70, 0x69, 0x64, 0x78, 0x5d, 0x5b, 0x33, 0x5d, 0x20, 
+	0x3d, 0x20, 0x23, 0x66, 0x75, 0x6e, 0x63, 0x2e, 0x69, 0x6e, 0x73, 0x74, 0x72, 0x75, 0x63, 0x74, 
+	0x69, 0x6f, 0x6e, 0x73, 0xa, 0x9, 0x61, 0x73, 0x73, 0x65, 0x72, 0x74, 0x28, 0x23, 0x66, 0x75, 
+	0x6e, 0x63, 0x2e, 0x69, 0x6e, 0x73, 0x74, 0x72, 0x75, 0x63, 0x74, 0x69, 0x6f, 0x6e, 0x73, 0x20, 
+	0x3d, 0x3d, 0x20, 0x23, 0x66, 0x75, 0x6e, 0x63, 0x2e, 0x6c, 0x69, 0x6e, 0x65, 0x6e, 0x72, 0x29, 
+	0xa, 0x65, 0x6e, 0x64, 0xa, 0xa, 0x2d, 0x2d, 0x20, 0x4c, 0x6f, 0x6f, 0x70, 0x20, 0x6f, 0x76, 
+	0x65, 0x72, 0x20, 0x61, 0x20, 0x72, 0x61, 0x6e, 0x67, 0x65, 0x20, 0x6c, 0x69, 0x74, 0x65, 0x72, 
+	0x61, 0x6c, 0x2c, 0x20, 0x27, 0x66, 0x6f, 0x72, 0x20, 0x78, 0x20, 0x3d, 0x20, 0x61, 0x2e, 0x2e, 
+	0x62, 0x27, 0x2e, 0x20, 0x54, 0x68, 0x65, 0x20, 0x63, 0x6f, 0x75, 0x6e, 0x74, 0x65, 0x72, 0x20, 
+	0x6c, 0x69, 0x76, 0x65, 0x73, 0x20, 0x69, 0x6e, 0x20, 0x74, 0x68, 0x65, 0xa, 0x2d, 0x2d, 0x20, 
+	0x6c, 0x61, 0x62, 0x65, 0x6c, 0x20, 0x73, 0x6c, 0x6f, 0x74, 0x20, 0x61, 0x6e, 0x64, 0x20, 0x74, 
+	0x68, 0x65, 0x20, 0x65, 0x6e, 0x64, 0x20, 0x76, 0x61, 0x6c, 0x75, 0x65, 0x20, 0x69, 0x6e, 0x20, 
+	0x74, 0x68, 0x65, 0x20, 0x73, 0x6c, 0x6f, 0x74, 0x20, 0x62, 0x65, 0x6c, 0x6f, 0x77, 0x20, 0x69, 
+	0x74, 0x2c, 0x20, 0x73, 0x6f, 0x20, 0x6e, 0x6f, 0x74, 0x68, 0x69, 0x6e, 0x67, 0x20, 0x69, 0x73, 
+	0xa, 0x2d, 0x2d, 0x20, 0x61, 0x6c, 0x6c, 0x6f, 0x63, 0x61, 0x74, 0x65, 0x64, 0x2e, 0x20, 0x4c, 
+	0x69, 0x6b, 0x65, 0x20, 0x72, 0x61, 0x6e, 0x67, 0x65, 0x2c, 0x20, 0x74, 0x68, 0x65, 0x20, 0x62, 
+	0x6f, 0x75, 0x6e, 0x64, 0x73, 0x20, 0x61, 0x72, 0x65, 0x20, 0x69, 0x6e, 0x63, 0x6c, 0x75, 0x73, 
+	0x69, 0x76, 0x65, 0x20, 0x61, 0x6e, 0x64, 0x20, 0x74, 0x68, 0x65, 0x20, 0x6c, 0x6f, 0x6f, 0x70, 
+	0x20, 0x61, 0x6c, 0x77, 0x61, 0x79, 0x73, 0xa, 0x2d, 0x2d, 0x20, 0x72, 0x75, 0x6e, 0x73, 0x20, 
+	0x61, 0x74, 0x20, 0x6c, 0x65, 0x61, 0x73, 0x74, 0x20, 0x6f, 0x6e, 0x63, 0x65, 0x2e, 0xa, 0x6c, 
+	0x6f, 0x63, 0x61, 0x6c, 0x20, 0x66, 0x75, 0x6e, 0x63, 0x74, 0x69, 0x6f, 0x6e, 0x20, 0x67, 0x65, 
+	0x6e, 0x5f, 0x66, 0x6f, 0x72, 0x5f, 0x72, 0x61, 0x6e, 0x67, 0x65, 0x28, 0x66, 0x75, 0x6e, 0x63, 
+	0x2c, 0x20, 0x61, 0x73, 0x74, 0x29, 0xa, 0x9, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x20, 0x73, 0x74, 
+	0x61, 0x63, 0x6b, 0x20, 0x3d, 0x20, 0x66, 0x75, 0x6e, 0x63, 0x2e, 0x73, 0x74, 0x61, 0x63, 0x6b, 
+	0x5f, 0x70, 0x6f, 0x69, 0x6e, 0x74, 0x65, 0x72, 0x20, 0x2b, 0x20, 0x31, 0xa, 0x9, 0x6c, 0x6f, 
+	0x63, 0x61, 0x6c, 0x20, 0x62, 0x69, 0x6e, 0x64, 0x5f, 0x69, 0x64, 0x78, 0x20, 0x3d, 0x20, 0x23, 
+	0x66, 0x75, 0x6e, 0x63, 0x2e, 0x6c, 0x61, 0x62, 0x6c, 0x65, 0x73, 0x20, 0x2b, 0x20, 0x31, 0xa, 
+	0x9, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x20, 0x62, 0x69, 0x6e, 0x64, 0x20, 0x3d, 0x20, 0x7b, 0x61, 
+	0x73, 0x74, 0x2e, 0x6e, 0x61, 0x6d, 0x65, 0x2c, 0x20, 0x73, 0x74, 0x61, 0x63, 0x6b, 0x7d, 0xa, 
+	0xa, 0x9, 0x74, 0x61, 0x62, 0x6c, 0x65, 0x2e, 0x69, 0x6e, 0x73, 0x65, 0x72, 0x74, 0x28, 0x66, 
+	0x75, 0x6e, 0x63, 0x2e, 0x6c, 0x61, 0x62, 0x6c, 0x65, 0x73, 0x2c, 0x20, 0x62, 0x69, 0x6e, 0x64, 
+	0x29, 0xa, 0x9, 0x67, 0x65, 0x6e, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 0x61, 0x73, 0x74, 
+	0x2e, 0x76, 0x61, 0x6c, 0x75, 0x65, 0x2e, 0x6c, 0x65, 0x66, 0x74, 0x29, 0xa, 0x9, 0x67, 0x65, 
+	0x6e, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 0x61, 0x73, 0x74, 0x2e, 0x76, 0x61, 0x6c, 0x75, 
+	0x65, 0x2e, 0x72, 0x69, 0x67, 0x68, 0x74, 0x29, 0xa, 0x9, 0x67, 0x65, 0x6e, 0x5f, 0x69, 0x6e, 
+	0x73, 0x74, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 0x27, 0x46, 0x4f, 0x52, 0x50, 0x52, 0x45, 
+	0x50, 0x27, 0x2c, 0x20, 0x61, 0x73, 0x74, 0x2e, 0x76, 0x61, 0x6c, 0x75, 0x65, 0x2e, 0x6c, 0x69, 
+	0x6e, 0x65, 0x29, 0xa, 0xa, 0x9, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x20, 0x62, 0x6f, 0x64, 0x79, 
+	0x20, 0x3d, 0x20, 0x23, 0x66, 0x75, 0x6e, 0x63, 0x2e, 0x69, 0x6e, 0x73, 0x74, 0x72, 0x75, 0x63, 
+	0x74, 0x69, 0x6f, 0x6e, 0x73, 0xa, 0x9, 0x67, 0x65, 0x6e, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 
+	0x20, 0x61, 0x73, 0x74, 0x2e, 0x62, 0x6f, 0x64, 0x79, 0x29, 0xa, 0x9, 0x67, 0x65, 0x6e, 0x5f, 
+	0x69, 0x6e, 0x73, 0x74, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 0x27, 0x46, 0x4f, 0x52, 0x4c, 
+	0x4f, 0x4f, 0x50, 0x27, 0x2c, 0x20, 0x61, 0x73, 0x74, 0x2e, 0x6c, 0x69, 0x6e, 0x65, 0x2c, 0x20, 
+	0x30, 0x2c, 0x20, 0x62, 0x6f, 0x64, 0x79, 0x29, 0xa, 0xa, 0x9, 0x66, 0x75, 0x6e, 0x63, 0x2e, 
 	0x73, 0x74, 0x61, 0x63, 0x6b, 0x5f, 0x70, 0x6f, 0x69, 0x6e, 0x74, 0x65, 0x72, 0x20, 0x3d, 0x20, 
-	0x23, 0x61, 0x73, 0x74, 0x2e, 0x61, 0x72, 0x67, 0x73, 0xa, 0x9, 0x67, 0x65, 0x6e, 0x5f, 0x62, 
-	0x6c, 0x6f, 0x63, 0x6b, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 0x61, 0x73, 0x74, 0x2e, 0x62, 
-	0x6f, 0x64, 0x79, 0x2c, 0x20, 0x74, 0x72, 0x75, 0x65, 0x29, 0xa, 0x9, 0x67, 0x65, 0x6e, 0x5f, 
-	0x69, 0x6e, 0x73, 0x74, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 0x27, 0x52, 0x45, 0x54, 0x55, 
-	0x52, 0x4e, 0x27, 0x2c, 0x20, 0x61, 0x73, 0x74, 0x2e, 0x62, 0x6f, 0x64, 0x79, 0x2e, 0x6c, 0x69, 
-	0x6e, 0x65, 0x29, 0xa, 0x9, 0x61, 0x73, 0x73, 0x65, 0x72, 0x74, 0x28, 0x23, 0x66, 0x75, 0x6e, 
-	0x63, 0x2e, 0x69, 0x6e, 0x73, 0x74, 0x72, 0x75, 0x63, 0x74, 0x69, 0x6f, 0x6e, 0x73, 0x20, 0x3d, 
-	0x3d, 0x20, 0x23, 0x66, 0x75, 0x6e, 0x63, 0x2e, 0x6c, 0x69, 0x6e, 0x65, 0x6e, 0x72, 0x29, 0xa, 
-	0xa, 0x9, 0x61, 0x73, 0x73, 0x65, 0x72, 0x74, 0x28, 0x6e, 0x6f, 0x74, 0x20, 0x61, 0x73, 0x74, 
-	0x2e, 0x76, 0x61, 0x72, 0x67, 0x20, 0x6f, 0x72, 0x20, 0x23, 0x61, 0x73, 0x74, 0x2e, 0x61, 0x72, 
-	0x67, 0x73, 0x20, 0x3d, 0x3d, 0x20, 0x31, 0x29, 0xa, 0x9, 0x67, 0x65, 0x6e, 0x5f, 0x69, 0x6e, 
-	0x73, 0x74, 0x28, 0x70, 0x61, 0x72, 0x65, 0x6e, 0x74, 0x2c, 0x20, 0x27, 0x4c, 0x41, 0x4d, 0x42, 
-	0x44, 0x41, 0x27, 0x2c, 0x20, 0x61, 0x73, 0x74, 0x2e, 0x6c, 0x69, 0x6e, 0x65, 0x2c, 0x20, 0x23, 
-	0x70, 0x61, 0x72, 0x65, 0x6e, 0x74, 0x2e, 0x70, 0x72, 0x6f, 0x74, 0x6f, 0x74, 0x79, 0x70, 0x65, 
-	0x73, 0x20, 0x2d, 0x20, 0x31, 0x2c, 0x20, 0x61, 0x73, 0x74, 0x2e, 0x76, 0x61, 0x72, 0x67, 0x20, 
-	0x61, 0x6e, 0x64, 0x20, 0x2d, 0x31, 0x20, 0x6f, 0x72, 0x20, 0x23, 0x61, 0x73, 0x74, 0x2e, 0x61, 
-	0x72, 0x67, 0x73, 0x29, 0xa, 0x9, 0x70, 0x61, 0x72, 0x65, 0x6e, 0x74, 0x2e, 0x73, 0x74, 0x61, 
-	0x63, 0x6b, 0x5f, 0x70, 0x6f, 0x69, 0x6e, 0x74, 0x65, 0x72, 0x20, 0x3d, 0x20, 0x70, 0x61, 0x72, 
-	0x65, 0x6e, 0x74, 0x2e, 0x73, 0x74, 0x61, 0x63, 0x6b, 0x5f, 0x70, 0x6f, 0x69, 0x6e, 0x74, 0x65, 
-	0x72, 0x20, 0x2b, 0x20, 0x31, 0xa, 0x65, 0x6e, 0x64, 0xa, 0xa, 0x66, 0x75, 0x6e, 0x63, 0x74, 
-	0x69, 0x6f, 0x6e, 0x20, 0x67, 0x65, 0x6e, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 0x61, 0x73, 
-	0x74, 0x2c, 0x20, 0x74, 0x61, 0x69, 0x6c, 0x29, 0xa, 0x9, 0x69, 0x66, 0x20, 0x61, 0x73, 0x74, 
-	0x2e, 0x74, 0x79, 0x70, 0x65, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x69, 0x64, 0x65, 0x6e, 0x74, 0x69, 
-	0x66, 0x69, 0x65, 0x72, 0x27, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x9, 0x9, 0x69, 0x66, 0x20, 
-	0x61, 0x73, 0x74, 0x2e, 0x76, 0x61, 0x6c, 0x75, 0x65, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x6e, 0x69, 
-	0x6c, 0x27, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x9, 0x9, 0x9, 0x61, 0x73, 0x74, 0x2e, 0x74, 
-	0x79, 0x70, 0x65, 0x20, 0x3d, 0x20, 0x27, 0x73, 0x74, 0x72, 0x69, 0x6e, 0x67, 0x27, 0xa, 0x9, 
-	0x9, 0x9, 0x61, 0x73, 0x74, 0x2e, 0x76, 0x61, 0x6c, 0x75, 0x65, 0x20, 0x3d, 0x20, 0x27, 0x6e, 
-	0x69, 0x6c, 0x27, 0xa, 0x9, 0x9, 0x9, 0x67, 0x65, 0x6e, 0x5f, 0x63, 0x6f, 0x6e, 0x73, 0x74, 
-	0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 0x61, 0x73, 0x74, 0x29, 0xa, 0x9, 0x9, 0x65, 0x6c, 
-	0x73, 0x65, 0xa, 0x9, 0x9, 0x9, 0x67, 0x65, 0x6e, 0x5f, 0x66, 0x65, 0x74, 0x63, 0x68, 0x28, 
-	0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 0x61, 0x73, 0x74, 0x29, 0xa, 0x9, 0x9, 0x65, 0x6e, 0x64, 
-	0xa, 0x9, 0x65, 0x6c, 0x73, 0x65, 0x69, 0x66, 0x20, 0x61, 0x73, 0x74, 0x2e, 0x74, 0x79, 0x70, 
-	0x65, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x6c, 0x61, 0x6d, 0x62, 0x64, 0x61, 0x27, 0x20, 0x74, 0x68, 
-	0x65, 0x6e, 0xa, 0x9, 0x9, 0x67, 0x65, 0x6e, 0x5f, 0x6c, 0x61, 0x6d, 0x62, 0x64, 0x61, 0x28, 
-	0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 0x61, 0x73, 0x74, 0x29, 0xa, 0x9, 0x65, 0x6c, 0x73, 0x65, 
-	0x69, 0x66, 0x20, 0x61, 0x73, 0x74, 0x2e, 0x74, 0x79, 0x70, 0x65, 0x20, 0x3d, 0x3d, 0x20, 0x27, 
-	0x6f, 0x70, 0x65, 0x72, 0x61, 0x74, 0x6f, 0x72, 0x27, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x9, 
-	0x9, 0x67, 0x65, 0x6e, 0x5f, 0x6f, 0x70, 0x65, 0x72, 0x61, 0x74, 0x6f, 0x72, 0x28, 0x66, 0x75, 
-	0x6e, 0x63, 0x2c, 0x20, 0x61, 0x73, 0x74, 0x2c, 0x20, 0x74, 0x61, 0x69, 0x6c, 0x29, 0xa, 0x9, 
-	0x65, 0x6c, 0x73, 0x65, 0x69, 0x66, 0x20, 0x61, 0x73, 0x74, 0x2e, 0x74, 0x79, 0x70, 0x65, 0x20, 
-	0x3d, 0x3d, 0x20, 0x27, 0x63, 0x61, 0x6c, 0x6c, 0x27, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x9, 
-	0x9, 0x67, 0x65, 0x6e, 0x5f, 0x63, 0x61, 0x6c, 0x6c, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 
-	0x61, 0x73, 0x74, 0x2c, 0x20, 0x74, 0x61, 0x69, 0x6c, 0x29, 0xa, 0x9, 0x65, 0x6c, 0x73, 0x65, 
+	0x73, 0x74, 0x61, 0x63, 0x6b, 0xa, 0x9, 0x61, 0x73, 0x73, 0x65, 0x72, 0x74, 0x28, 0x74, 0x61, 
+	0x62, 0x6c, 0x65, 0x2e, 0x72, 0x65, 0x6d, 0x6f, 0x76, 0x65, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2e, 
+	0x6c, 0x61, 0x62, 0x6c, 0x65, 0x73, 0x2c, 0x20, 0x62, 0x69, 0x6e, 0x64, 0x5f, 0x69, 0x64, 0x78, 
+	0x29, 0x20, 0x3d, 0x3d, 0x20, 0x62, 0x69, 0x6e, 0x64, 0x29, 0xa, 0x65, 0x6e, 0x64, 0xa, 0xa, 
+	0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x20, 0x66, 0x75, 0x6e, 0x63, 0x74, 0x69, 0x6f, 0x6e, 0x20, 0x67, 
+	0x65, 0x6e, 0x5f, 0x66, 0x6f, 0x72, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 0x61, 0x73, 0x74, 
+	0x2c, 0x20, 0x74, 0x61, 0x69, 0x6c, 0x29, 0xa, 0x9, 0x61, 0x73, 0x73, 0x65, 0x72, 0x74, 0x28, 
+	0x61, 0x73, 0x74, 0x2e, 0x74, 0x79, 0x70, 0x65, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x66, 0x6f, 0x72, 
+	0x27, 0x29, 0xa, 0x9, 0x69, 0x66, 0x20, 0x6f, 0x70, 0x74, 0x5f, 0x66, 0x6f, 0x72, 0x72, 0x61, 
+	0x6e, 0x67, 0x65, 0x20, 0x61, 0x6e, 0x64, 0x20, 0x61, 0x73, 0x74, 0x2e, 0x76, 0x61, 0x6c, 0x75, 
+	0x65, 0x2e, 0x74, 0x79, 0x70, 0x65, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x6f, 0x70, 0x65, 0x72, 0x61, 
+	0x74, 0x6f, 0x72, 0x27, 0x20, 0x61, 0x6e, 0x64, 0x20, 0x61, 0x73, 0x74, 0x2e, 0x76, 0x61, 0x6c, 
+	0x75, 0x65, 0x2e, 0x6f, 0x70, 0x65, 0x72, 0x61, 0x74, 0x6f, 0x72, 0x20, 0x3d, 0x3d, 0x20, 0x27, 
+	0x2e, 0x2e, 0x27, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x9, 0x9, 0x67, 0x65, 0x6e, 0x5f, 0x66, 
+	0x6f, 0x72, 0x5f, 0x72, 0x61, 0x6e, 0x67, 0x65, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 0x61, 
+	0x73, 0x74, 0x29, 0xa, 0x9, 0x9, 0x72, 0x65, 0x74, 0x75, 0x72, 0x6e, 0xa, 0x9, 0x65, 0x6e, 
+	0x64, 0xa, 0xa, 0x9, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x20, 0x73, 0x74, 0x61, 0x63, 0x6b, 0x20, 
+	0x3d, 0x20, 0x66, 0x75, 0x6e, 0x63, 0x2e, 0x73, 0x74, 0x61, 0x63, 0x6b, 0x5f, 0x70, 0x6f, 0x69, 
+	0x6e, 0x74, 0x65, 0x72, 0x20, 0x2b, 0x20, 0x31, 0xa, 0x9, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x20, 
+	0x62, 0x69, 0x6e, 0x64, 0x5f, 0x69, 0x64, 0x78, 0x20, 0x3d, 0x20, 0x23, 0x66, 0x75, 0x6e, 0x63, 
+	0x2e, 0x6c, 0x61, 0x62, 0x6c, 0x65, 0x73, 0x20, 0x2b, 0x20, 0x31, 0xa, 0x9, 0x6c, 0x6f, 0x63, 
+	0x61, 0x6c, 0x20, 0x62, 0x69, 0x6e, 0x64, 0x20, 0x3d, 0x20, 0x7b, 0x61, 0x73, 0x74, 0x2e, 0x6e, 
+	0x61, 0x6d, 0x65, 0x2c, 0x20, 0x73, 0x74, 0x61, 0x63, 0x6b, 0x7d, 0xa, 0xa, 0x9, 0x74, 0x61, 
+	0x62, 0x6c, 0x65, 0x2e, 0x69, 0x6e, 0x73, 0x65, 0x72, 0x74, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2e, 
+	0x6c, 0x61, 0x62, 0x6c, 0x65, 0x73, 0x2c, 0x20, 0x62, 0x69, 0x6e, 0x64, 0x29, 0xa, 0x9, 0x67, 
+	0x65, 0x6e, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 0x61, 0x73, 0x74, 0x2e, 0x76, 0x61, 0x6c, 
+	0x75, 0x65, 0x29, 0xa, 0xa, 0x9, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x20, 0x6e, 0x20, 0x3d, 0x20, 
+	0x7b, 0x74, 0x79, 0x70, 0x65, 0x20, 0x3d, 0x20, 0x27, 0x69, 0x64, 0x65, 0x6e, 0x74, 0x69, 0x66, 
+	0x69, 0x65, 0x72, 0x27, 0x2c, 0x20, 0x76, 0x61, 0x6c, 0x75, 0x65, 0x20, 0x3d, 0x20, 0x27, 0x6e, 
+	0x69, 0x6c, 0x27, 0x2c, 0x20, 0x66, 0x69, 0x6c, 0x65, 0x20, 0x3d, 0x20, 0x61, 0x73, 0x74, 0x2e, 
+	0x66, 0x69, 0x6c, 0x65, 0x2c, 0x20, 0x6c, 0x69, 0x6e, 0x65, 0x20, 0x3d, 0x20, 0x61, 0x73, 0x74, 
+	0x2e, 0x6c, 0x69, 0x6e, 0x65, 0x7d, 0xa, 0x9, 0x67, 0x65, 0x6e, 0x28, 0x66, 0x75, 0x6e, 0x63, 
+	0x2c, 0x20, 0x6e, 0x29, 0xa, 0xa, 0x9, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x20, 0x66, 0x6f, 0x72, 
+	0x69, 0x64, 0x78, 0x20, 0x3d, 0x20, 0x23, 0x66, 0x75, 0x6e, 0x63, 0x2e, 0x69, 0x6e, 0x73, 0x74, 
+	0x72, 0x75, 0x63, 0x74, 0x69, 0x6f, 0x6e, 0x73, 0x20, 0x2b, 0x20, 0x31, 0xa, 0x9, 0x66, 0x75, 
+	0x6e, 0x63, 0x2e, 0x69, 0x6e, 0x73, 0x74, 0x72, 0x75, 0x63, 0x74, 0x69, 0x6f, 0x6e, 0x73, 0x5b, 
+	0x66, 0x6f, 0x72, 0x69, 0x64, 0x78, 0x5d, 0x20, 0x3d, 0x20, 0x7b, 0x27, 0x46, 0x4f, 0x52, 0x27, 
+	0x2c, 0x20, 0x30, 0x2c, 0x20, 0x30, 0x7d, 0xa, 0x9, 0x66, 0x75, 0x6e, 0x63, 0x2e, 0x6c, 0x69, 
+	0x6e, 0x65, 0x6e, 0x72, 0x5b, 0x66, 0x6f, 0x72, 0x69, 0x64, 0x78, 0x5d, 0x20, 0x3d, 0x20, 0x61, 
+	0x73, 0x74, 0x2e, 0x6c, 0x69, 0x6e, 0x65, 0xa, 0xa, 0x9, 0x67, 0x65, 0x6e, 0x28, 0x66, 0x75, 
+	0x6e, 0x63, 0x2c, 0x20, 0x61, 0x73, 0x74, 0x2e, 0x62, 0x6f, 0x64, 0x79, 0x29, 0xa, 0xa, 0x9, 
+	0x67, 0x65, 0x6e, 0x5f, 0x69, 0x6e, 0x73, 0x74, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 0x27, 
+	0x53, 0x48, 0x49, 0x46, 0x54, 0x27, 0x2c, 0x20, 0x61, 0x73, 0x74, 0x2e, 0x6c, 0x69, 0x6e, 0x65, 
+	0x2c, 0x20, 0x31, 0x29, 0xa, 0x9, 0x66, 0x75, 0x6e, 0x63, 0x2e, 0x73, 0x74, 0x61, 0x63, 0x6b, 
+	0x5f, 0x70, 0x6f, 0x69, 0x6e, 0x74, 0x65, 0x72, 0x20, 0x3d, 0x20, 0x66, 0x75, 0x6e, 0x63, 0x2e, 
+	0x73, 0x74, 0x61, 0x63, 0x6b, 0x5f, 0x70, 0x6f, 0x69, 0x6e, 0x74, 0x65, 0x72, 0x20, 0x2d, 0x20, 
+	0x31, 0xa, 0xa, 0x9, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x20, 0x6a, 0x6d, 0x70, 0x69, 0x64, 0x78, 
+	0x20, 0x3d, 0x20, 0x23, 0x66, 0x75, 0x6e, 0x63, 0x2e, 0x69, 0x6e, 0x73, 0x74, 0x72, 0x75, 0x63, 
+	0x74, 0x69, 0x6f, 0x6e, 0x73, 0x20, 0x2b, 0x20, 0x31, 0xa, 0x9, 0x66, 0x75, 0x6e, 0x63, 0x2e, 
+	0x69, 0x6e, 0x73, 0x74, 0x72, 0x75, 0x63, 0x74, 0x69, 0x6f, 0x6e, 0x73, 0x5b, 0x6a, 0x6d, 0x70, 
+	0x69, 0x64, 0x78, 0x5d, 0x20, 0x3d, 0x20, 0x7b, 0x27, 0x4a, 0x4d, 0x50, 0x27, 0x2c, 0x20, 0x30, 
+	0x2c, 0x20, 0x66, 0x6f, 0x72, 0x69, 0x64, 0x78, 0x20, 0x2d, 0x20, 0x31, 0x7d, 0xa, 0x9, 0x66, 
+	0x75, 0x6e, 0x63, 0x2e, 0x6c, 0x69, 0x6e, 0x65, 0x6e, 0x72, 0x5b, 0x6a, 0x6d, 0x70, 0x69, 0x64, 
+	0x78, 0x5d, 0x20, 0x3d, 0x20, 0x61, 0x73, 0x74, 0x2e, 0x6c, 0x69, 0x6e, 0x65, 0xa, 0xa, 0x9, 
+	0x66, 0x75, 0x6e, 0x63, 0x2e, 0x69, 0x6e, 0x73, 0x74, 0x72, 0x75, 0x63, 0x74, 0x69, 0x6f, 0x6e, 
+	0x73, 0x5b, 0x66, 0x6f, 0x72, 0x69, 0x64, 0x78, 0x5d, 0x5b, 0x33, 0x5d, 0x20, 0x3d, 0x20, 0x23, 
+	0x66, 0x75, 0x6e, 0x63, 0x2e, 0x69, 0x6e, 0x73, 0x74, 0x72, 0x75, 0x63, 0x74, 0x69, 0x6f, 0x6e, 
+	0x73, 0xa, 0x9, 0x66, 0x75, 0x6e, 0x63, 0x2e, 0x73, 0x74, 0x61, 0x63, 0x6b, 0x5f, 0x70, 0x6f, 
+	0x69, 0x6e, 0x74, 0x65, 0x72, 0x20, 0x3d, 0x20, 0x73, 0x74, 0x61, 0x63, 0x6b, 0xa, 0xa, 0x9, 
+	0x61, 0x73, 0x73, 0x65, 0x72, 0x74, 0x28, 0x23, 0x66, 0x75, 0x6e, 0x63, 0x2e, 0x69, 0x6e, 0x73, 
+	0x74, 0x72, 0x75, 0x63, 0x74, 0x69, 0x6f, 0x6e, 0x73, 0x20, 0x3d, 0x3d, 0x20, 0x23, 0x66, 0x75, 
+	0x6e, 0x63, 0x2e, 0x6c, 0x69, 0x6e, 0x65, 0x6e, 0x72, 0x29, 0xa, 0x9, 0x61, 0x73, 0x73, 0x65, 
+	0x72, 0x74, 0x28, 0x74, 0x61, 0x62, 0x6c, 0x65, 0x2e, 0x72, 0x65, 0x6d, 0x6f, 0x76, 0x65, 0x28, 
+	0x66, 0x75, 0x6e, 0x63, 0x2e, 0x6c, 0x61, 0x62, 0x6c, 0x65, 0x73, 0x2c, 0x20, 0x62, 0x69, 0x6e, 
+	0x64, 0x5f, 0x69, 0x64, 0x78, 0x29, 0x20, 0x3d, 0x3d, 0x20, 0x62, 0x69, 0x6e, 0x64, 0x29, 0xa, 
+	0x65, 0x6e, 0x64, 0xa, 0xa, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x20, 0x66, 0x75, 0x6e, 0x63, 0x74, 
+	0x69, 0x6f, 0x6e, 0x20, 0x67, 0x65, 0x6e, 0x5f, 0x6c, 0x61, 0x6d, 0x62, 0x64, 0x61, 0x28, 0x70, 
+	0x61, 0x72, 0x65, 0x6e, 0x74, 0x2c, 0x20, 0x61, 0x73, 0x74, 0x29, 0xa, 0x9, 0x61, 0x73, 0x73, 
+	0x65, 0x72, 0x74, 0x28, 0x61, 0x73, 0x74, 0x2e, 0x74, 0x79, 0x70, 0x65, 0x20, 0x3d, 0x3d, 0x20, 
+	0x27, 0x6c, 0x61, 0x6d, 0x62, 0x64, 0x61, 0x27, 0x29, 0xa, 0x9, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 
+	0x20, 0x66, 0x75, 0x6e, 0x63, 0x20, 0x3d, 0x20, 0x7b, 0xa, 0x9, 0x9, 0x69, 0x6e, 0x73, 0x74, 
+	0x72, 0x75, 0x63, 0x74, 0x69, 0x6f, 0x6e, 0x73, 0x20, 0x3d, 0x20, 0x7b, 0x7d, 0x2c, 0xa, 0x9, 
+	0x9, 0x6c, 0x69, 0x6e, 0x65, 0x6e, 0x72, 0x20, 0x3d, 0x20, 0x7b, 0x7d, 0x2c, 0xa, 0x9, 0x9, 
+	0x6c, 0x61, 0x62, 0x6c, 0x65, 0x73, 0x20, 0x3d, 0x20, 0x7b, 0x7d, 0x2c, 0xa, 0x9, 0x9, 0x70, 
+	0x72, 0x6f, 0x74, 0x6f, 0x74, 0x79, 0x70, 0x65, 0x73, 0x20, 0x3d, 0x20, 0x7b, 0x7d, 0x2c, 0xa, 
+	0x9, 0x9, 0x63, 0x6f, 0x6e, 0x73, 0x74, 0x61, 0x6e, 0x74, 0x73, 0x20, 0x3d, 0x20, 0x7b, 0x7d, 
+	0x2c, 0xa, 0x9, 0x9, 0x75, 0x70, 0x20, 0x3d, 0x20, 0x7b, 0x7d, 0x2c, 0xa, 0x9, 0x9, 0x6e, 
+	0x75, 0x6d, 0x5f, 0x61, 0x72, 0x67, 0x73, 0x20, 0x3d, 0x20, 0x23, 0x61, 0x73, 0x74, 0x2e, 0x61, 
+	0x72, 0x67, 0x73, 0x2c, 0xa, 0x9, 0x9, 0x76, 0x61, 0x72, 0x67, 0x20, 0x3d, 0x20, 0x61, 0x73, 
+	0x74, 0x2e, 0x76, 0x61, 0x72, 0x67, 0x2c, 0xa, 0x9, 0x9, 0x73, 0x74, 0x61, 0x63, 0x6b, 0x5f, 
+	0x70, 0x6f, 0x69, 0x6e, 0x74, 0x65, 0x72, 0x20, 0x3d, 0x20, 0x30, 0x2c, 0xa, 0x9, 0x9, 0x6e, 
+	0x61, 0x6d, 0x65, 0x20, 0x3d, 0x20, 0x61, 0x73, 0x74, 0x2e, 0x66, 0x69, 0x6c, 0x65, 0x2c, 0xa, 
+	0x9, 0x9, 0x70, 0x61, 0x72, 0x65, 0x6e, 0x74, 0x20, 0x3d, 0x20, 0x70, 0x61, 0x72, 0x65, 0x6e, 
+	0x74, 0xa, 0x9, 0x7d, 0xa, 0xa, 0x9, 0x74, 0x61, 0x62, 0x6c, 0x65, 0x2e, 0x69, 0x6e, 0x73, 
+	0x65, 0x72, 0x74, 0x28, 0x70, 0x61, 0x72, 0x65, 0x6e, 0x74, 0x2e, 0x70, 0x72, 0x6f, 0x74, 0x6f, 
+	0x74, 0x79, 0x70, 0x65, 0x73, 0x2c, 0x20, 0x66, 0x75, 0x6e, 0x63, 0x29, 0xa, 0x9, 0x66, 0x6f, 
+	0x72, 0x20, 0x69, 0x2c, 0x61, 0x72, 0x67, 0x20, 0x69, 0x6e, 0x20, 0x69, 0x70, 0x61, 0x69, 0x72, 
+	0x73, 0x28, 0x61, 0x73, 0x74, 0x2e, 0x61, 0x72, 0x67, 0x73, 0x29, 0x20, 0x64, 0x6f, 0xa, 0x9, 
+	0x9, 0x74, 0x61, 0x62, 0x6c, 0x65, 0x2e, 0x69, 0x6e, 0x73, 0x65, 0x72, 0x74, 0x28, 0x66, 0x75, 
+	0x6e, 0x63, 0x2e, 0x6c, 0x61, 0x62, 0x6c, 0x65, 0x73, 0x2c, 0x20, 0x7b, 0x61, 0x72, 0x67, 0x2e, 
+	0x76, 0x61, 0x6c, 0x75, 0x65, 0x2c, 0x20, 0x69, 0x20, 0x2d, 0x20, 0x31, 0x7d, 0x29, 0xa, 0x9, 
+	0x65, 0x6e, 0x64, 0xa, 0x9, 0x66, 0x75, 0x6e, 0x63, 0x2e, 0x73, 0x74, 0x61, 0x63, 0x6b, 0x5f, 
+	0x70, 0x6f, 0x69, 0x6e, 0x74, 0x65, 0x72, 0x20, 0x3d, 0x20, 0x23, 0x61, 0x73, 0x74, 0x2e, 0x61, 
+	0x72, 0x67, 0x73, 0xa, 0x9, 0x67, 0x65, 0x6e, 0x5f, 0x62, 0x6c, 0x6f, 0x63, 0x6b, 0x28, 0x66, 
+	0x75, 0x6e, 0x63, 0x2c, 0x20, 0x61, 0x73, 0x74, 0x2e, 0x62, 0x6f, 0x64, 0x79, 0x2c, 0x20, 0x74, 
+	0x72, 0x75, 0x65, 0x29, 0xa, 0x9, 0x67, 0x65, 0x6e, 0x5f, 0x69, 0x6e, 0x73, 0x74, 0x28, 0x66, 
+	0x75, 0x6e, 0x63, 0x2c, 0x20, 0x27, 0x52, 0x45, 0x54, 0x55, 0x52, 0x4e, 0x27, 0x2c, 0x20, 0x61, 
+	0x73, 0x74, 0x2e, 0x62, 0x6f, 0x64, 0x79, 0x2e, 0x6c, 0x69, 0x6e, 0x65, 0x29, 0xa, 0x9, 0x61, 
+	0x73, 0x73, 0x65, 0x72, 0x74, 0x28, 0x23, 0x66, 0x75, 0x6e, 0x63, 0x2e, 0x69, 0x6e, 0x73, 0x74, 
+	0x72, 0x75, 0x63, 0x74, 0x69, 0x6f, 0x6e, 0x73, 0x20, 0x3d, 0x3d, 0x20, 0x23, 0x66, 0x75, 0x6e, 
+	0x63, 0x2e, 0x6c, 0x69, 0x6e, 0x65, 0x6e, 0x72, 0x29, 0xa, 0xa, 0x9, 0x61, 0x73, 0x73, 0x65, 
+	0x72, 0x74, 0x28, 0x6e, 0x6f, 0x74, 0x20, 0x61, 0x73, 0x74, 0x2e, 0x76, 0x61, 0x72, 0x67, 0x20, 
+	0x6f, 0x72, 0x20, 0x23, 0x61, 0x73, 0x74, 0x2e, 0x61, 0x72, 0x67, 0x73, 0x20, 0x3d, 0x3d, 0x20, 
+	0x31, 0x29, 0xa, 0x9, 0x67, 0x65, 0x6e, 0x5f, 0x69, 0x6e, 0x73, 0x74, 0x28, 0x70, 0x61, 0x72, 
+	0x65, 0x6e, 0x74, 0x2c, 0x20, 0x27, 0x4c, 0x41, 0x4d, 0x42, 0x44, 0x41, 0x27, 0x2c, 0x20, 0x61, 
+	0x73, 0x74, 0x2e, 0x6c, 0x69, 0x6e, 0x65, 0x2c, 0x20, 0x23, 0x70, 0x61, 0x72, 0x65, 0x6e, 0x74, 
+	0x2e, 0x70, 0x72, 0x6f, 0x74, 0x6f, 0x74, 0x79, 0x70, 0x65, 0x73, 0x20, 0x2d, 0x20, 0x31, 0x2c, 
+	0x20, 0x61, 0x73, 0x74, 0x2e, 0x76, 0x61, 0x72, 0x67, 0x20, 0x61, 0x6e, 0x64, 0x20, 0x2d, 0x31, 
+	0x20, 0x6f, 0x72, 0x20, 0x23, 0x61, 0x73, 0x74, 0x2e, 0x61, 0x72, 0x67, 0x73, 0x29, 0xa, 0x9, 
+	0x70, 0x61, 0x72, 0x65, 0x6e, 0x74, 0x2e, 0x73, 0x74, 0x61, 0x63, 0x6b, 0x5f, 0x70, 0x6f, 0x69, 
+	0x6e, 0x74, 0x65, 0x72, 0x20, 0x3d, 0x20, 0x70, 0x61, 0x72, 0x65, 0x6e, 0x74, 0x2e, 0x73, 0x74, 
+	0x61, 0x63, 0x6b, 0x5f, 0x70, 0x6f, 0x69, 0x6e, 0x74, 0x65, 0x72, 0x20, 0x2b, 0x20, 0x31, 0xa, 
+	0x65, 0x6e, 0x64, 0xa, 0xa, 0x66, 0x75, 0x6e, 0x63, 0x74, 0x69, 0x6f, 0x6e, 0x20, 0x67, 0x65, 
+	0x6e, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 0x61, 0x73, 0x74, 0x2c, 0x20, 0x74, 0x61, 0x69, 
+	0x6c, 0x29, 0xa, 0x9, 0x69, 0x66, 0x20, 0x61, 0x73, 0x74, 0x2e, 0x74, 0x79, 0x70, 0x65, 0x20, 
+	0x3d, 0x3d, 0x20, 0x27, 0x69, 0x64, 0x65, 0x6e, 0x74, 0x69, 0x66, 0x69, 0x65, 0x72, 0x27, 0x20, 
+	0x74, 0x68, 0x65, 0x6e, 0xa, 0x9, 0x9, 0x69, 0x66, 0x20, 0x61, 0x73, 0x74, 0x2e, 0x76, 0x61, 
+	0x6c, 0x75, 0x65, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x6e, 0x69, 0x6c, 0x27, 0x20, 0x74, 0x68, 0x65, 
+	0x6e, 0xa, 0x9, 0x9, 0x9, 0x61, 0x73, 0x74, 0x2e, 0x74, 0x79, 0x70, 0x65, 0x20, 0x3d, 0x20, 
+	0x27, 0x73, 0x74, 0x72, 0x69, 0x6e, 0x67, 0x27, 0xa, 0x9, 0x9, 0x9, 0x61, 0x73, 0x74, 0x2e, 
+	0x76, 0x61, 0x6c, 0x75, 0x65, 0x20, 0x3d, 0x20, 0x27, 0x6e, 0x69, 0x6c, 0x27, 0xa, 0x9, 0x9, 
+	0x9, 0x67, 0x65, 0x6e, 0x5f, 0x63, 0x6f, 0x6e, 0x73, 0x74, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 
+	0x20, 0x61, 0x73, 0x74, 0x29, 0xa, 0x9, 0x9, 0x65, 0x6c, 0x73, 0x65, 0xa, 0x9, 0x9, 0x9, 
+	0x67, 0x65, 0x6e, 0x5f, 0x66, 0x65, 0x74, 0x63, 0x68, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 
+	0x61, 0x73, 0x74, 0x29, 0xa, 0x9, 0x9, 0x65, 0x6e, 0x64, 0xa, 0x9, 0x65, 0x6c, 0x73, 0x65, 
 	0x69, 0x66, 0x20, 0x61, 0x73, 0x74, 0x2e, 0x74, 0x79, 0x70, 0x65, 0x20, 0x3d, 0x3d, 0x20, 0x27, 
-	0x62, 0x6c, 0x6f, 0x63, 0x6b, 0x27, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x9, 0x9, 0x67, 0x65, 
-	0x6e, 0x5f, 0x62, 0x6c, 0x6f, 0x63, 0x6b, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 0x61, 0x73, 
+	0x6c, 0x61, 0x6d, 0x62, 0x64, 0x61, 0x27, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x9, 0x9, 0x67, 
+	0x65, 0x6e, 0x5f, 0x6c, 0x61, 0x6d, 0x62, 0x64, 0x61, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 
+	0x61, 0x73, 0x74, 0x29, 0xa, 0x9, 0x65, 0x6c, 0x73, 0x65, 0x69, 0x66, 0x20, 0x61, 0x73, 0x74, 
+	0x2e, 0x74, 0x79, 0x70, 0x65, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x6f, 0x70, 0x65, 0x72, 0x61, 0x74, 
+	0x6f, 0x72, 0x27, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x9, 0x9, 0x67, 0x65, 0x6e, 0x5f, 0x6f, 
+	0x70, 0x65, 0x72, 0x61, 0x74, 0x6f, 0x72, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 0x61, 0x73, 
 	0x74, 0x2c, 0x20, 0x74, 0x61, 0x69, 0x6c, 0x29, 0xa, 0x9, 0x65, 0x6c, 0x73, 0x65, 0x69, 0x66, 
-	0x20, 0x61, 0x73, 0x74, 0x2e, 0x74, 0x79, 0x70, 0x65, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x63, 0x6f, 
-	0x6e, 0x64, 0x27, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x9, 0x9, 0x67, 0x65, 0x6e, 0x5f, 0x63, 
-	0x6f, 0x6e, 0x64, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 0x61, 0x73, 0x74, 0x2c, 0x20, 0x74, 
+	0x20, 0x61, 0x73, 0x74, 0x2e, 0x74, 0x79, 0x70, 0x65, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x63, 0x61, 
+	0x6c, 0x6c, 0x27, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x9, 0x9, 0x67, 0x65, 0x6e, 0x5f, 0x63, 
+	0x61, 0x6c, 0x6c, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 0x61, 0x73, 0x74, 0x2c, 0x20, 0x74, 
 	0x61, 0x69, 0x6c, 0x29, 0xa, 0x9, 0x65, 0x6c, 0x73, 0x65, 0x69, 0x66, 0x20, 0x61, 0x73, 0x74, 
-	0x2e, 0x74, 0x79, 0x70, 0x65, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x66, 0x6f, 0x72, 0x27, 0x20, 0x74, 
-	0x68, 0x65, 0x6e, 0xa, 0x9, 0x9, 0x67, 0x65, 0x6e, 0x5f, 0x66, 0x6f, 0x72, 0x28, 0x66, 0x75, 
-	0x6e, 0x63, 0x2c, 0x20, 0x61, 0x73, 0x74, 0x2c, 0x20, 0x74, 0x61, 0x69, 0x6c, 0x29, 0xa, 0x9, 
+	0x2e, 0x74, 0x79, 0x70, 0x65, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x64, 0x65, 0x73, 0x74, 0x72, 0x75, 
+	0x63, 0x74, 0x75, 0x72, 0x65, 0x27, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x9, 0x9, 0x67, 0x65, 
+	0x6e, 0x5f, 0x64, 0x65, 0x73, 0x74, 0x72, 0x75, 0x63, 0x74, 0x75, 0x72, 0x65, 0x28, 0x66, 0x75, 
+	0x6e, 0x63, 0x2c, 0x20, 0x61, 0x73, 0x74, 0x29, 0xa, 0x9, 0x65, 0x6c, 0x73, 0x65, 0x69, 0x66, 
+	0x20, 0x61, 0x73, 0x74, 0x2e, 0x74, 0x79, 0x70, 0x65, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x62, 0x6c, 
+	0x6f, 0x63, 0x6b, 0x27, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x9, 0x9, 0x67, 0x65, 0x6e, 0x5f, 
+	0x62, 0x6c, 0x6f, 0x63, 0x6b, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 0x61, 0x73, 0x74, 0x2c, 
+	0x20, 0x74, 0x61, 0x69, 0x6c, 0x29, 0xa, 0x9, 0x65, 0x6c, 0x73, 0x65, 0x69, 0x66, 0x20, 0x61, 
+	0x73, 0x74, 0x2e, 0x74, 0x79, 0x70, 0x65, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x63, 0x6f, 0x6e, 0x64, 
+	0x27, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x9, 0x9, 0x67, 0x65, 0x6e, 0x5f, 0x63, 0x6f, 0x6e, 
+	0x64, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 0x61, 0x73, 0x74, 0x2c, 0x20, 0x74, 0x61, 0x69, 
+	0x6c, 0x29, 0xa, 0x9, 0x65, 0x6c, 0x73, 0x65, 0x69, 0x66, 0x20, 0x61, 0x73, 0x74, 0x2e, 0x74, 
+	0x79, 0x70, 0x65, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x66, 0x6f, 0x72, 0x27, 0x20, 0x74, 0x68, 0x65, 
+	0x6e, 0xa, 0x9, 0x9, 0x67, 0x65, 0x6e, 0x5f, 0x66, 0x6f, 0x72, 0x28, 0x66, 0x75, 0x6e, 0x63, 
+	0x2c, 0x20, 0x61, 0x73, 0x74, 0x2c, 0x20, 0x74, 0x61, 0x69, 0x6c, 0x29, 0xa, 0x9, 0x65, 0x6c, 
+	0x73, 0x65, 0x69, 0x66, 0x20, 0x61, 0x73, 0x74, 0x2e, 0x74, 0x79, 0x70, 0x65, 0x20, 0x3d, 0x3d, 
+	0x20, 0x27, 0x64, 0x6f, 0x74, 0x27, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x9, 0x9, 0x67, 0x65, 
+	0x6e, 0x5f, 0x64, 0x6f, 0x74, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 0x61, 0x73, 0x74, 0x2c, 
+	0x20, 0x74, 0x61, 0x69, 0x6c, 0x29, 0xa, 0x9, 0x65, 0x6c, 0x73, 0x65, 0x69, 0x66, 0x20, 0x61, 
+	0x73, 0x74, 0x2e, 0x74, 0x79, 0x70, 0x65, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x75, 0x6e, 0x6d, 0x27, 
+	0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x9, 0x9, 0x67, 0x65, 0x6e, 0x28, 0x66, 0x75, 0x6e, 0x63, 
+	0x2c, 0x20, 0x61, 0x73, 0x74, 0x2e, 0x61, 0x72, 0x67, 0x2c, 0x20, 0x74, 0x61, 0x69, 0x6c, 0x29, 
+	0xa, 0x9, 0x9, 0x67, 0x65, 0x6e, 0x5f, 0x69, 0x6e, 0x73, 0x74, 0x28, 0x66, 0x75, 0x6e, 0x63, 
+	0x2c, 0x20, 0x27, 0x55, 0x4e, 0x4d, 0x27, 0x2c, 0x20, 0x61, 0x73, 0x74, 0x2e, 0x6c, 0x69, 0x6e, 
+	0x65, 0x29, 0xa, 0x9, 0x65, 0x6c, 0x73, 0x65, 0x69, 0x66, 0x20, 0x61, 0x73, 0x74, 0x2e, 0x74, 
+	0x79, 0x70, 0x65, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x6e, 0x6f, 0x74, 0x27, 0x20, 0x74, 0x68, 0x65, 
+	0x6e, 0xa, 0x9, 0x9, 0x67, 0x65, 0x6e, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 0x61, 0x73, 
+	0x74, 0x2e, 0x61, 0x72, 0x67, 0x2c, 0x20, 0x74, 0x61, 0x69, 0x6c, 0x29, 0xa, 0x9, 0x9, 0x67, 
+	0x65, 0x6e, 0x5f, 0x69, 0x6e, 0x73, 0x74, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 0x27, 0x4e, 
+	0x4f, 0x54, 0x27, 0x2c, 0x20, 0x61, 0x73, 0x74, 0x2e, 0x6c, 0x69, 0x6e, 0x65, 0x29, 0xa, 0x9, 
 	0x65, 0x6c, 0x73, 0x65, 0x69, 0x66, 0x20, 0x61, 0x73, 0x74, 0x2e, 0x74, 0x79, 0x70, 0x65, 0x20, 
-	0x3d, 0x3d, 0x20, 0x27, 0x64, 0x6f, 0x74, 0x27, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x9, 0x9, 
-	0x67, 0x65, 0x6e, 0x5f, 0x64, 0x6f, 0x74, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 0x61, 0x73, 
-	0x74, 0x2c, 0x20, 0x74, 0x61, 0x69, 0x6c, 0x29, 0xa, 0x9, 0x65, 0x6c, 0x73, 0x65, 0x69, 0x66, 
-	0x20, 0x61, 0x73, 0x74, 0x2e, 0x74, 0x79, 0x70, 0x65, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x75, 0x6e, 
-	0x6d, 0x27, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x9, 0x9, 0x67, 0x65, 0x6e, 0x28, 0x66, 0x75, 
-	0x6e, 0x63, 0x2c, 0x20, 0x61, 0x73, 0x74, 0x2e, 0x61, 0x72, 0x67, 0x2c, 0x20, 0x74, 0x61, 0x69, 
-	0x6c, 0x29, 0xa, 0x9, 0x9, 0x67, 0x65, 0x6e, 0x5f, 0x69, 0x6e, 0x73, 0x74, 0x28, 0x66, 0x75, 
-	0x6e, 0x63, 0x2c, 0x20, 0x27, 0x55, 0x4e, 0x4d, 0x27, 0x2c, 0x20, 0x61, 0x73, 0x74, 0x2e, 0x6c, 
-	0x69, 0x6e, 0x65, 0x29, 0xa, 0x9, 0x65, 0x6c, 0x73, 0x65, 0x69, 0x66, 0x20, 0x61, 0x73, 0x74, 
-	0x2e, 0x74, 0x79, 0x70, 0x65, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x6e, 0x6f, 0x74, 0x27, 0x20, 0x74, 
-	0x68, 0x65, 0x6e, 0xa, 0x9, 0x9, 0x67, 0x65, 0x6e, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 
-	0x61, 0x73, 0x74, 0x2e, 0x61, 0x72, 0x67, 0x2c, 0x20, 0x74, 0x61, 0x69, 0x6c, 0x29, 0xa, 0x9, 
-	0x9, 0x67, 0x65, 0x6e, 0x5f, 0x69, 0x6e, 0x73, 0x74, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 
-	0x27, 0x4e, 0x4f, 0x54, 0x27, 0x2c, 0x20, 0x61, 0x73, 0x74, 0x2e, 0x6c, 0x69, 0x6e, 0x65, 0x29, 
-	0xa, 0x9, 0x65, 0x6c, 0x73, 0x65, 0x69, 0x66, 0x20, 0x61, 0x73, 0x74, 0x2e, 0x74, 0x79, 0x70, 
-	0x65, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x75, 0x6e, 0x72, 0x65, 0x66, 0x27, 0x20, 0x74, 0x68, 0x65, 
-	0x6e, 0xa, 0x9, 0x9, 0x67, 0x65, 0x6e, 0x5f, 0x69, 0x6e, 0x73, 0x74, 0x28, 0x66, 0x75, 0x6e, 
-	0x63, 0x2c, 0x20, 0x27, 0x47, 0x45, 0x54, 0x47, 0x4c, 0x4f, 0x42, 0x41, 0x4c, 0x27, 0x2c, 0x20, 
-	0x61, 0x73, 0x74, 0x2e, 0x6c, 0x69, 0x6e, 0x65, 0x2c, 0x20, 0x70, 0x75, 0x73, 0x68, 0x5f, 0x63, 
-	0x6f, 0x6e, 0x73, 0x74, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 0x27, 0x75, 0x6e, 0x72, 0x65, 
-	0x66, 0x27, 0x29, 0x29, 0xa, 0x9, 0x9, 0x66, 0x75, 0x6e, 0x63, 0x2e, 0x73, 0x74, 0x61, 0x63, 
-	0x6b, 0x5f, 0x70, 0x6f, 0x69, 0x6e, 0x74, 0x65, 0x72, 0x20, 0x3d, 0x20, 0x66, 0x75, 0x6e, 0x63, 
-	0x2e, 0x73, 0x74, 0x61, 0x63, 0x6b, 0x5f, 0x70, 0x6f, 0x69, 0x6e, 0x74, 0x65, 0x72, 0x20, 0x2b, 
-	0x20, 0x31, 0xa, 0x9, 0x9, 0x67, 0x65, 0x6e, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 0x61, 
-	0x73, 0x74, 0x2e, 0x61, 0x72, 0x67, 0x29, 0xa, 0x9, 0x9, 0x63, 0x61, 0x6c, 0x6c, 0x5f, 0x6f, 
-	0x72, 0x5f, 0x74, 0x61, 0x69, 0x6c, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 0x74, 0x61, 0x69, 
-	0x6c, 0x2c, 0x20, 0x61, 0x73, 0x74, 0x2e, 0x6c, 0x69, 0x6e, 0x65, 0x2c, 0x20, 0x31, 0x29, 0xa, 
+	0x3d, 0x3d, 0x20, 0x27, 0x75, 0x6e, 0x72, 0x65, 0x66, 0x27, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 
+	0x9, 0x9, 0x67, 0x65, 0x6e, 0x5f, 0x69, 0x6e, 0x73, 0x74, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 
+	0x20, 0x27, 0x47, 0x45, 0x54, 0x47, 0x4c, 0x4f, 0x42, 0x41, 0x4c, 0x27, 0x2c, 0x20, 0x61, 0x73, 
+	0x74, 0x2e, 0x6c, 0x69, 0x6e, 0x65, 0x2c, 0x20, 0x70, 0x75, 0x73, 0x68, 0x5f, 0x63, 0x6f, 0x6e, 
+	0x73, 0x74, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 0x27, 0x75, 0x6e, 0x72, 0x65, 0x66, 0x27, 
+	0x29, 0x29, 0xa, 0x9, 0x9, 0x66, 0x75, 0x6e, 0x63, 0x2e, 0x73, 0x74, 0x61, 0x63, 0x6b, 0x5f, 
+	0x70, 0x6f, 0x69, 0x6e, 0x74, 0x65, 0x72, 0x20, 0x3d, 0x20, 0x66, 0x75, 0x6e, 0x63, 0x2e, 0x73, 
+	0x74, 0x61, 0x63, 0x6b, 0x5f, 0x70, 0x6f, 0x69, 0x6e, 0x74, 0x65, 0x72, 0x20, 0x2b, 0x20, 0x31, 
+	0xa, 0x9, 0x9, 0x67, 0x65, 0x6e, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 0x61, 0x73, 0x74, 
+	0x2e, 0x61, 0x72, 0x67, 0x29, 0xa, 0x9, 0x9, 0x63, 0x61, 0x6c, 0x6c, 0x5f, 0x6f, 0x72, 0x5f, 
+	0x74, 0x61, 0x69, 0x6c, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 0x74, 0x61, 0x69, 0x6c, 0x2c, 
+	0x20, 0x61, 0x73, 0x74, 0x2e, 0x6c, 0x69, 0x6e, 0x65, 0x2c, 0x20, 0x31, 0x29, 0xa, 0x9, 0x65, 
+	0x6c, 0x73, 0x65, 0x69, 0x66, 0x20, 0x61, 0x73, 0x74, 0x2e, 0x74, 0x79, 0x70, 0x65, 0x20, 0x3d, 
+	0x3d, 0x20, 0x27, 0x63, 0x6f, 0x6c, 0x6c, 0x65, 0x63, 0x74, 0x69, 0x6f, 0x6e, 0x27, 0x20, 0x74, 
+	0x68, 0x65, 0x6e, 0xa, 0x9, 0x9, 0x67, 0x65, 0x6e, 0x5f, 0x63, 0x6f, 0x6c, 0x6c, 0x65, 0x63, 
+	0x74, 0x69, 0x6f, 0x6e, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 0x61, 0x73, 0x74, 0x2c, 0x20, 
+	0x74, 0x61, 0x69, 0x6c, 0x29, 0xa, 0x9, 0x65, 0x6c, 0x73, 0x65, 0x69, 0x66, 0x20, 0x61, 0x73, 
+	0x74, 0x2e, 0x74, 0x79, 0x70, 0x65, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x64, 0x65, 0x66, 0x27, 0x20, 
+	0x74, 0x68, 0x65, 0x6e, 0xa, 0x9, 0x9, 0x67, 0x65, 0x6e, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 
+	0x20, 0x61, 0x73, 0x74, 0x2e, 0x76, 0x61, 0x6c, 0x75, 0x65, 0x29, 0xa, 0x9, 0x9, 0x67, 0x65, 
+	0x6e, 0x5f, 0x69, 0x6e, 0x73, 0x74, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 0x27, 0x53, 0x45, 
+	0x54, 0x47, 0x4c, 0x4f, 0x42, 0x41, 0x4c, 0x27, 0x2c, 0x20, 0x61, 0x73, 0x74, 0x2e, 0x6c, 0x69, 
+	0x6e, 0x65, 0x2c, 0x20, 0x70, 0x75, 0x73, 0x68, 0x5f, 0x63, 0x6f, 0x6e, 0x73, 0x74, 0x28, 0x66, 
+	0x75, 0x6e, 0x63, 0x2c, 0x20, 0x61, 0x73, 0x74, 0x2e, 0x6e, 0x61, 0x6d, 0x65, 0x29, 0x29, 0xa, 
 	0x9, 0x65, 0x6c, 0x73, 0x65, 0x69, 0x66, 0x20, 0x61, 0x73, 0x74, 0x2e, 0x74, 0x79, 0x70, 0x65, 
-	0x20, 0x3d, 0x3d, 0x20, 0x27, 0x63, 0x6f, 0x6c, 0x6c, 0x65, 0x63, 0x74, 0x69, 0x6f, 0x6e, 0x27, 
-	0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x9, 0x9, 0x67, 0x65, 0x6e, 0x5f, 0x63, 0x6f, 0x6c, 0x6c, 
-	0x65, 0x63, 0x74, 0x69, 0x6f, 0x6e, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 0x61, 0x73, 0x74, 
-	0x2c, 0x20, 0x74, 0x61, 0x69, 0x6c, 0x29, 0xa, 0x9, 0x65, 0x6c, 0x73, 0x65, 0x69, 0x66, 0x20, 
-	0x61, 0x73, 0x74, 0x2e, 0x74, 0x79, 0x70, 0x65, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x64, 0x65, 0x66, 
-	0x27, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x9, 0x9, 0x67, 0x65, 0x6e, 0x28, 0x66, 0x75, 0x6e, 
-	0x63, 0x2c, 0x20, 0x61, 0x73, 0x74, 0x2e, 0x76, 0x61, 0x6c, 0x75, 0x65, 0x29, 0xa, 0x9, 0x9, 
-	0x67, 0x65, 0x6e, 0x5f, 0x69, 0x6e, 0x73, 0x74, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 0x27, 
-	0x53, 0x45, 0x54, 0x47, 0x4c, 0x4f, 0x42, 0x41, 0x4c, 0x27, 0x2c, 0x20, 0x61, 0x73, 0x74, 0x2e, 
-	0x6c, 0x69, 0x6e, 0x65, 0x2c, 0x20, 0x70, 0x75, 0x73, 0x68, 0x5f, 0x63, 0x6f, 0x6e, 0x73, 0x74, 
-	0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 0x61, 0x73, 0x74, 0x2e, 0x6e, 0x61, 0x6d, 0x65, 0x29, 
-	0x29, 0xa, 0x9, 0x65, 0x6c, 0x73, 0x65, 0x69, 0x66, 0x20, 0x61, 0x73, 0x74, 0x2e, 0x74, 0x79, 
-	0x70, 0x65, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x63, 0x6c, 0x61, 0x6d, 0x62, 0x64, 0x61, 0x27, 0x20, 
-	0x74, 0x68, 0x65, 0x6e, 0xa, 0x9, 0x9, 0x67, 0x65, 0x6e, 0x5f, 0x69, 0x6e, 0x73, 0x74, 0x28, 
-	0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 0x27, 0x4c, 0x43, 0x4c, 0x27, 0x2c, 0x20, 0x61, 0x73, 0x74, 
-	0x2e, 0x6c, 0x69, 0x6e, 0x65, 0x2c, 0x20, 0x30, 0x2c, 0x20, 0x61, 0x73, 0x74, 0x2e, 0x69, 0x64, 
-	0x29, 0xa, 0x9, 0x9, 0x66, 0x75, 0x6e, 0x63, 0x2e, 0x73, 0x74, 0x61, 0x63, 0x6b, 0x5f, 0x70, 
-	0x6f, 0x69, 0x6e, 0x74, 0x65, 0x72, 0x20, 0x3d, 0x20, 0x66, 0x75, 0x6e, 0x63, 0x2e, 0x73, 0x74, 
-	0x61, 0x63, 0x6b, 0x5f, 0x70, 0x6f, 0x69, 0x6e, 0x74, 0x65, 0x72, 0x20, 0x2b, 0x20, 0x31, 0xa, 
-	0x9, 0x65, 0x6c, 0x73, 0x65, 0xa, 0x9, 0x9, 0x67, 0x65, 0x6e, 0x5f, 0x63, 0x6f, 0x6e, 0x73, 
-	0x74, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 0x61, 0x73, 0x74, 0x29, 0xa, 0x9, 0x65, 0x6e, 
-	0x64, 0xa, 0x65, 0x6e, 0x64, 0xa, 0xa, 0x66, 0x75, 0x6e, 0x63, 0x74, 0x69, 0x6f, 0x6e, 0x20, 
-	0x67, 0x65, 0x6e, 0x65, 0x72, 0x61, 0x74, 0x65, 0x28, 0x61, 0x73, 0x74, 0x2c, 0x20, 0x6e, 0x61, 
-	0x6d, 0x65, 0x29, 0xa, 0x9, 0x61, 0x73, 0x73, 0x65, 0x72, 0x74, 0x28, 0x61, 0x73, 0x74, 0x2e, 
-	0x74, 0x79, 0x70, 0x65, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x62, 0x6c, 0x6f, 0x63, 0x6b, 0x27, 0x29, 
-	0xa, 0x9, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x20, 0x66, 0x75, 0x6e, 0x63, 0x20, 0x3d, 0x20, 0x7b, 
-	0xa, 0x9, 0x9, 0x69, 0x6e, 0x73, 0x74, 0x72, 0x75, 0x63, 0x74, 0x69, 0x6f, 0x6e, 0x73, 0x20, 
-	0x3d, 0x20, 0x7b, 0x7d, 0x2c, 0xa, 0x9, 0x9, 0x6c, 0x69, 0x6e, 0x65, 0x6e, 0x72, 0x20, 0x3d, 
-	0x20, 0x7b, 0x7d, 0x2c, 0xa, 0x9, 0x9, 0x6c, 0x61, 0x62, 0x6c, 0x65, 0x73, 0x20, 0x3d, 0x20, 
-	0x7b, 0x7b, 0x27, 0x5f, 0x41, 0x52, 0x47, 0x53, 0x27, 0x2c, 0x20, 0x30, 0x7d, 0x7d, 0x2c, 0xa, 
-	0x9, 0x9, 0x70, 0x72, 0x6f, 0x74, 0x6f, 0x74, 0x79, 0x70, 0x65, 0x73, 0x20, 0x3d, 0x20, 0x7b, 
-	0x7d, 0x2c, 0xa, 0x9, 0x9, 0x63, 0x6f, 0x6e, 0x73, 0x74, 0x61, 0x6e, 0x74, 0x73, 0x20, 0x3d, 
-	0x20, 0x7b, 0x7d, 0x2c, 0xa, 0x9, 0x9, 0x75, 0x70, 0x20, 0x3d, 0x20, 0x7b, 0x7d, 0x2c, 0xa, 
-	0x9, 0x9, 0x6e, 0x75, 0x6d, 0x5f, 0x61, 0x72, 0x67, 0x73, 0x20, 0x3d, 0x20, 0x31, 0x2c, 0xa, 
-	0x9, 0x9, 0x73, 0x74, 0x61, 0x63, 0x6b, 0x5f, 0x70, 0x6f, 0x69, 0x6e, 0x74, 0x65, 0x72, 0x20, 
-	0x3d, 0x20, 0x31, 0x2c, 0xa, 0x9, 0x9, 0x6e, 0x61, 0x6d, 0x65, 0x20, 0x3d, 0x20, 0x6e, 0x61, 
-	0x6d, 0x65, 0x2c, 0xa, 0x9, 0x9, 0x70, 0x61, 0x72, 0x65, 0x6e, 0x74, 0x20, 0x3d, 0x20, 0x70, 
-	0x61, 0x72, 0x65, 0x6e, 0x74, 0xa, 0x9, 0x7d, 0xa, 0x9, 0x67, 0x65, 0x6e, 0x5f, 0x62, 0x6c, 
-	0x6f, 0x63, 0x6b, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 0x61, 0x73, 0x74, 0x29, 0xa, 0x9, 
-	0x67, 0x65, 0x6e, 0x5f, 0x69, 0x6e, 0x73, 0x74, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 0x27, 
-	0x52, 0x45, 0x54, 0x55, 0x52, 0x4e, 0x27, 0x2c, 0x20, 0x61, 0x73, 0x74, 0x2e, 0x6c, 0x69, 0x6e, 
-	0x65, 0x29, 0xa, 0x9, 0x61, 0x73, 0x73, 0x65, 0x72, 0x74, 0x28, 0x23, 0x66, 0x75, 0x6e, 0x63, 
-	0x2e, 0x69, 0x6e, 0x73, 0x74, 0x72, 0x75, 0x63, 0x74, 0x69, 0x6f, 0x6e, 0x73, 0x20, 0x3d, 0x3d, 
-	0x20, 0x23, 0x66, 0x75, 0x6e, 0x63, 0x2e, 0x6c, 0x69, 0x6e, 0x65, 0x6e, 0x72, 0x29, 0xa, 0x9, 
-	0x72, 0x65, 0x74, 0x75, 0x72, 0x6e, 0x20, 0x66, 0x75, 0x6e, 0x63, 0xa, 0x65, 0x6e, 0x64, 0xa, 
-	0xa, 0x66, 0x75, 0x6e, 0x63, 0x74, 0x69, 0x6f, 0x6e, 0x20, 0x67, 0x65, 0x6e, 0x5f, 0x70, 0x72, 
-	0x69, 0x6e, 0x74, 0x28, 0x61, 0x73, 0x6d, 0x2c, 0x20, 0x6c, 0x76, 0x2c, 0x20, 0x6f, 0x75, 0x74, 
-	0x29, 0xa, 0x9, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x20, 0x66, 0x75, 0x6e, 0x63, 0x74, 0x69, 0x6f, 
-	0x6e, 0x20, 0x70, 0x75, 0x74, 0x73, 0x28, 0x6c, 0x76, 0x2c, 0x20, 0x6f, 0x75, 0x74, 0x2c, 0x20, 
-	0x2e, 0x2e, 0x2e, 0x29, 0xa, 0x9, 0x9, 0x66, 0x6f, 0x72, 0x20, 0x69, 0x3d, 0x31, 0x2c, 0x20, 
-	0x6c, 0x76, 0x20, 0x64, 0x6f, 0xa, 0x9, 0x9, 0x9, 0x6f, 0x75, 0x74, 0x3a, 0x77, 0x72, 0x69, 
-	0x74, 0x65, 0x28, 0x27, 0x5c, 0x74, 0x27, 0x29, 0xa, 0x9, 0x9, 0x65, 0x6e, 0x64, 0xa, 0x9, 
-	0x9, 0x66, 0x6f, 0x72, 0x20, 0x5f, 0x2c, 0x76, 0x20, 0x69, 0x6e, 0x20, 0x69, 0x70, 0x61, 0x69, 
-	0x72, 0x73, 0x28, 0x7b, 0x2e, 0x2e, 0x2e, 0x7d, 0x29, 0x20, 0x64, 0x6f, 0xa, 0x9, 0x9, 0x9, 
-	0x6f, 0x75, 0x74, 0x3a, 0x77, 0x72, 0x69, 0x74, 0x65, 0x28, 0x76, 0x20, 0x2e, 0x2e, 0x20, 0x27, 
-	0x5c, 0x74, 0x27, 0x29, 0xa, 0x9, 0x9, 0x65, 0x6e, 0x64, 0xa, 0x9, 0x9, 0x6f, 0x75, 0x74, 
-	0x3a, 0x77, 0x72, 0x69, 0x74, 0x65, 0x28, 0x27, 0x5c, 0x6e, 0x27, 0x29, 0xa, 0x9, 0x65, 0x6e, 
-	0x64, 0xa, 0xa, 0x9, 0x6c, 0x76, 0x20, 0x3d, 0x20, 0x28, 0x6c, 0x76, 0x20, 0x6f, 0x72, 0x20, 
-	0x2d, 0x31, 0x29, 0x20, 0x2b, 0x20, 0x31, 0xa, 0x9, 0x6f, 0x75, 0x74, 0x20, 0x3d, 0x20, 0x6f, 
-	0x75, 0x74, 0x20, 0x6f, 0x72, 0x20, 0x69, 0x6f, 0x2e, 0x6f, 0x75, 0x74, 0x70, 0x75, 0x74, 0x28, 
+	0x20, 0x3d, 0x3d, 0x20, 0x27, 0x63, 0x6c, 0x61, 0x6d, 0x62, 0x64, 0x61, 0x27, 0x20, 0x74, 0x68, 
+	0x65, 0x6e, 0xa, 0x9, 0x9, 0x67, 0x65, 0x6e, 0x5f, 0x69, 0x6e, 0x73, 0x74, 0x28, 0x66, 0x75, 
+	0x6e, 0x63, 0x2c, 0x20, 0x27, 0x4c, 0x43, 0x4c, 0x27, 0x2c, 0x20, 0x61, 0x73, 0x74, 0x2e, 0x6c, 
+	0x69, 0x6e, 0x65, 0x2c, 0x20, 0x30, 0x2c, 0x20, 0x61, 0x73, 0x74, 0x2e, 0x69, 0x64, 0x29, 0xa, 
+	0x9, 0x9, 0x66, 0x75, 0x6e, 0x63, 0x2e, 0x73, 0x74, 0x61, 0x63, 0x6b, 0x5f, 0x70, 0x6f, 0x69, 
+	0x6e, 0x74, 0x65, 0x72, 0x20, 0x3d, 0x20, 0x66, 0x75, 0x6e, 0x63, 0x2e, 0x73, 0x74, 0x61, 0x63, 
+	0x6b, 0x5f, 0x70, 0x6f, 0x69, 0x6e, 0x74, 0x65, 0x72, 0x20, 0x2b, 0x20, 0x31, 0xa, 0x9, 0x65, 
+	0x6c, 0x73, 0x65, 0xa, 0x9, 0x9, 0x67, 0x65, 0x6e, 0x5f, 0x63, 0x6f, 0x6e, 0x73, 0x74, 0x28, 
+	0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 0x61, 0x73, 0x74, 0x29, 0xa, 0x9, 0x65, 0x6e, 0x64, 0xa, 
+	0x65, 0x6e, 0x64, 0xa, 0xa, 0x66, 0x75, 0x6e, 0x63, 0x74, 0x69, 0x6f, 0x6e, 0x20, 0x67, 0x65, 
+	0x6e, 0x65, 0x72, 0x61, 0x74, 0x65, 0x28, 0x61, 0x73, 0x74, 0x2c, 0x20, 0x6e, 0x61, 0x6d, 0x65, 
+	0x29, 0xa, 0x9, 0x61, 0x73, 0x73, 0x65, 0x72, 0x74, 0x28, 0x61, 0x73, 0x74, 0x2e, 0x74, 0x79, 
+	0x70, 0x65, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x62, 0x6c, 0x6f, 0x63, 0x6b, 0x27, 0x29, 0xa, 0x9, 
+	0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x20, 0x66, 0x75, 0x6e, 0x63, 0x20, 0x3d, 0x20, 0x7b, 0xa, 0x9, 
+	0x9, 0x69, 0x6e, 0x73, 0x74, 0x72, 0x75, 0x63, 0x74, 0x69, 0x6f, 0x6e, 0x73, 0x20, 0x3d, 0x20, 
+	0x7b, 0x7d, 0x2c, 0xa, 0x9, 0x9, 0x6c, 0x69, 0x6e, 0x65, 0x6e, 0x72, 0x20, 0x3d, 0x20, 0x7b, 
+	0x7d, 0x2c, 0xa, 0x9, 0x9, 0x6c, 0x61, 0x62, 0x6c, 0x65, 0x73, 0x20, 0x3d, 0x20, 0x7b, 0x7b, 
+	0x27, 0x5f, 0x41, 0x52, 0x47, 0x53, 0x27, 0x2c, 0x20, 0x30, 0x7d, 0x7d, 0x2c, 0xa, 0x9, 0x9, 
+	0x70, 0x72, 0x6f, 0x74, 0x6f, 0x74, 0x79, 0x70, 0x65, 0x73, 0x20, 0x3d, 0x20, 0x7b, 0x7d, 0x2c, 
+	0xa, 0x9, 0x9, 0x63, 0x6f, 0x6e, 0x73, 0x74, 0x61, 0x6e, 0x74, 0x73, 0x20, 0x3d, 0x20, 0x7b, 
+	0x7d, 0x2c, 0xa, 0x9, 0x9, 0x75, 0x70, 0x20, 0x3d, 0x20, 0x7b, 0x7d, 0x2c, 0xa, 0x9, 0x9, 
+	0x6e, 0x75, 0x6d, 0x5f, 0x61, 0x72, 0x67, 0x73, 0x20, 0x3d, 0x20, 0x31, 0x2c, 0xa, 0x9, 0x9, 
+	0x73, 0x74, 0x61, 0x63, 0x6b, 0x5f, 0x70, 0x6f, 0x69, 0x6e, 0x74, 0x65, 0x72, 0x20, 0x3d, 0x20, 
+	0x31, 0x2c, 0xa, 0x9, 0x9, 0x6e, 0x61, 0x6d, 0x65, 0x20, 0x3d, 0x20, 0x6e, 0x61, 0x6d, 0x65, 
+	0x2c, 0xa, 0x9, 0x9, 0x70, 0x61, 0x72, 0x65, 0x6e, 0x74, 0x20, 0x3d, 0x20, 0x70, 0x61, 0x72, 
+	0x65, 0x6e, 0x74, 0xa, 0x9, 0x7d, 0xa, 0x9, 0x67, 0x65, 0x6e, 0x5f, 0x62, 0x6c, 0x6f, 0x63, 
+	0x6b, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 0x61, 0x73, 0x74, 0x29, 0xa, 0x9, 0x67, 0x65, 
+	0x6e, 0x5f, 0x69, 0x6e, 0x73, 0x74, 0x28, 0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 0x27, 0x52, 0x45, 
+	0x54, 0x55, 0x52, 0x4e, 0x27, 0x2c, 0x20, 0x61, 0x73, 0x74, 0x2e, 0x6c, 0x69, 0x6e, 0x65, 0x29, 
+	0xa, 0x9, 0x61, 0x73, 0x73, 0x65, 0x72, 0x74, 0x28, 0x23, 0x66, 0x75, 0x6e, 0x63, 0x2e, 0x69, 
+	0x6e, 0x73, 0x74, 0x72, 0x75, 0x63, 0x74, 0x69, 0x6f, 0x6e, 0x73, 0x20, 0x3d, 0x3d, 0x20, 0x23, 
+	0x66, 0x75, 0x6e, 0x63, 0x2e, 0x6c, 0x69, 0x6e, 0x65, 0x6e, 0x72, 0x29, 0xa, 0x9, 0x72, 0x65, 
+	0x74, 0x75, 0x72, 0x6e, 0x20, 0x66, 0x75, 0x6e, 0x63, 0xa, 0x65, 0x6e, 0x64, 0xa, 0xa, 0x66, 
+	0x75, 0x6e, 0x63, 0x74, 0x69, 0x6f, 0x6e, 0x20, 0x67, 0x65, 0x6e, 0x5f, 0x70, 0x72, 0x69, 0x6e, 
+	0x74, 0x28, 0x61, 0x73, 0x6d, 0x2c, 0x20, 0x6c, 0x76, 0x2c, 0x20, 0x6f, 0x75, 0x74, 0x29, 0xa, 
+	0x9, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x20, 0x66, 0x75, 0x6e, 0x63, 0x74, 0x69, 0x6f, 0x6e, 0x20, 
+	0x70, 0x75, 0x74, 0x73, 0x28, 0x6c, 0x76, 0x2c, 0x20, 0x6f, 0x75, 0x74, 0x2c, 0x20, 0x2e, 0x2e, 
+	0x2e, 0x29, 0xa, 0x9, 0x9, 0x66, 0x6f, 0x72, 0x20, 0x69, 0x3d, 0x31, 0x2c, 0x20, 0x6c, 0x76, 
+	0x20, 0x64, 0x6f, 0xa, 0x9, 0x9, 0x9, 0x6f, 0x75, 0x74, 0x3a, 0x77, 0x72, 0x69, 0x74, 0x65, 
+	0x28, 0x27, 0x5c, 0x74, 0x27, 0x29, 0xa, 0x9, 0x9, 0x65, 0x6e, 0x64, 0xa, 0x9, 0x9, 0x66, 
+	0x6f, 0x72, 0x20, 0x5f, 0x2c, 0x76, 0x20, 0x69, 0x6e, 0x20, 0x69, 0x70, 0x61, 0x69, 0x72, 0x73, 
+	0x28, 0x7b, 0x2e, 0x2e, 0x2e, 0x7d, 0x29, 0x20, 0x64, 0x6f, 0xa, 0x9, 0x9, 0x9, 0x6f, 0x75, 
+	0x74, 0x3a, 0x77, 0x72, 0x69, 0x74, 0x65, 0x28, 0x76, 0x20, 0x2e, 0x2e, 0x20, 0x27, 0x5c, 0x74, 
+	0x27, 0x29, 0xa, 0x9, 0x9, 0x65, 0x6e, 0x64, 0xa, 0x9, 0x9, 0x6f, 0x75, 0x74, 0x3a, 0x77, 
+	0x72, 0x69, 0x74, 0x65, 0x28, 0x27, 0x5c, 0x6e, 0x27, 0x29, 0xa, 0x9, 0x65, 0x6e, 0x64, 0xa, 
+	0xa, 0x9, 0x6c, 0x76, 0x20, 0x3d, 0x20, 0x28, 0x6c, 0x76, 0x20, 0x6f, 0x72, 0x20, 0x2d, 0x31, 
+	0x29, 0x20, 0x2b, 0x20, 0x31, 0xa, 0x9, 0x6f, 0x75, 0x74, 0x20, 0x3d, 0x20, 0x6f, 0x75, 0x74, 
+	0x20, 0x6f, 0x72, 0x20, 0x69, 0x6f, 0x2e, 0x6f, 0x75, 0x74, 0x70, 0x75, 0x74, 0x28, 0x29, 0xa, 
+	0x9, 0x70, 0x75, 0x74, 0x73, 0x28, 0x6c, 0x76, 0x2c, 0x20, 0x6f, 0x75, 0x74, 0x2c, 0x20, 0x27, 
+	0x2d, 0x2d, 0x2d, 0x2d, 0x2d, 0x2d, 0x2d, 0x2d, 0x2d, 0x2d, 0x2d, 0x2d, 0x2d, 0x2d, 0x2d, 0x2d, 
+	0x2d, 0x2d, 0x2d, 0x2d, 0x2d, 0x2d, 0x2d, 0x2d, 0x2d, 0x2d, 0x2d, 0x2d, 0x27, 0x29, 0xa, 0x9, 
+	0x70, 0x75, 0x74, 0x73, 0x28, 0x6c, 0x76, 0x2c, 0x20, 0x6f, 0x75, 0x74, 0x2c, 0x20, 0x61, 0x73, 
+	0x6d, 0x2e, 0x6e, 0x61, 0x6d, 0x65, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x27, 0x20, 0x61, 0x6e, 0x64, 
+	0x20, 0x27, 0x3f, 0x27, 0x20, 0x6f, 0x72, 0x20, 0x61, 0x73, 0x6d, 0x2e, 0x6e, 0x61, 0x6d, 0x65, 
 	0x29, 0xa, 0x9, 0x70, 0x75, 0x74, 0x73, 0x28, 0x6c, 0x76, 0x2c, 0x20, 0x6f, 0x75, 0x74, 0x2c, 
 	0x20, 0x27, 0x2d, 0x2d, 0x2d, 0x2d, 0x2d, 0x2d, 0x2d, 0x2d, 0x2d, 0x2d, 0x2d, 0x2d, 0x2d, 0x2d, 
 	0x2d, 0x2d, 0x2d, 0x2d, 0x2d, 0x2d, 0x2d, 0x2d, 0x2d, 0x2d, 0x2d, 0x2d, 0x2d, 0x2d, 0x27, 0x29, 
-	0xa, 0x9, 0x70, 0x75, 0x74, 0x73, 0x28, 0x6c, 0x76, 0x2c, 0x20, 0x6f, 0x75, 0x74, 0x2c, 0x20, 
-	0x61, 0x73, 0x6d, 0x2e, 0x6e, 0x61, 0x6d, 0x65, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x27, 0x20, 0x61, 
-	0x6e, 0x64, 0x20, 0x27, 0x3f, 0x27, 0x20, 0x6f, 0x72, 0x20, 0x61, 0x73, 0x6d, 0x2e, 0x6e, 0x61, 
-	0x6d, 0x65, 0x29, 0xa, 0x9, 0x70, 0x75, 0x74, 0x73, 0x28, 0x6c, 0x76, 0x2c, 0x20, 0x6f, 0x75, 
-	0x74, 0x2c, 0x20, 0x27, 0x2d, 0x2d, 0x2d, 0x2d, 0x2d, 0x2d, 0x2d, 0x2d, 0x2d, 0x2d, 0x2d, 0x2d, 
-	0x2d, 0x2d, 0x2d, 0x2d, 0x2d, 0x2d, 0x2d, 0x2d, 0x2d, 0x2d, 0x2d, 0x2d, 0x2d, 0x2d, 0x2d, 0x2d, 
-	0x27, 0x29, 0xa, 0x9, 0x66, 0x6f, 0x72, 0x20, 0x69, 0x2c, 0x76, 0x20, 0x69, 0x6e, 0x20, 0x69, 
-	0x70, 0x61, 0x69, 0x72, 0x73, 0x28, 0x61, 0x73, 0x6d, 0x2e, 0x69, 0x6e, 0x73, 0x74, 0x72, 0x75, 
-	0x63, 0x74, 0x69, 0x6f, 0x6e, 0x73, 0x29, 0x20, 0x64, 0x6f, 0xa, 0x9, 0x9, 0x70, 0x75, 0x74, 
-	0x73, 0x28, 0x6c, 0x76, 0x2c, 0x20, 0x6f, 0x75, 0x74, 0x2c, 0x20, 0x61, 0x73, 0x6d, 0x2e, 0x6c, 
-	0x69, 0x6e, 0x65, 0x6e, 0x72, 0x5b, 0x69, 0x5d, 0x20, 0x2e, 0x2e, 0x20, 0x27, 0x3a, 0x27, 0x2c, 
-	0x20, 0x75, 0x6e, 0x70, 0x61, 0x63, 0x6b, 0x28, 0x76, 0x29, 0x29, 0xa, 0x9, 0x9, 0x69, 0x66, 
-	0x20, 0x76, 0x5b, 0x31, 0x5d, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x50, 0x55, 0x53, 0x48, 0x27, 0x20, 
-	0x6f, 0x72, 0x20, 0x76, 0x5b, 0x31, 0x5d, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x47, 0x45, 0x54, 0x47, 
-	0x4c, 0x4f, 0x42, 0x41, 0x4c, 0x27, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x9, 0x9, 0x9, 0x70, 
-	0x75, 0x74, 0x73, 0x28, 0x6c, 0x76, 0x2c, 0x20, 0x6f, 0x75, 0x74, 0x2c, 0x20, 0x27, 0x5c, 0x74, 
-	0x20, 0x2d, 0x3e, 0x20, 0x27, 0x20, 0x2e, 0x2e, 0x20, 0x74, 0x6f, 0x73, 0x74, 0x72, 0x69, 0x6e, 
-	0x67, 0x28, 0x61, 0x73, 0x6d, 0x2e, 0x63, 0x6f, 0x6e, 0x73, 0x74, 0x61, 0x6e, 0x74, 0x73, 0x5b, 
-	0x76, 0x5b, 0x32, 0x5d, 0x20, 0x2b, 0x20, 0x31, 0x5d, 0x29, 0x29, 0xa, 0x9, 0x9, 0x65, 0x6e, 
-	0x64, 0xa, 0x9, 0x65, 0x6e, 0x64, 0xa, 0x9, 0x66, 0x6f, 0x72, 0x20, 0x5f, 0x2c, 0x76, 0x20, 
-	0x69, 0x6e, 0x20, 0x69, 0x70, 0x61, 0x69, 0x72, 0x73, 0x28, 0x61, 0x73, 0x6d, 0x2e, 0x70, 0x72, 
-	0x6f, 0x74, 0x6f, 0x74, 0x79, 0x70, 0x65, 0x73, 0x29, 0x20, 0x64, 0x6f, 0xa, 0x9, 0x9, 0x67, 
-	0x65, 0x6e, 0x5f, 0x70, 0x72, 0x69, 0x6e, 0x74, 0x28, 0x76, 0x2c, 0x20, 0x6c, 0x76, 0x2c, 0x20, 
-	0x6f, 0x75, 0x74, 0x29, 0xa, 0x9, 0x65, 0x6e, 0x64, 0xa, 0x9, 0x70, 0x75, 0x74, 0x73, 0x28, 
-	0x6c, 0x76, 0x2c, 0x20, 0x6f, 0x75, 0x74, 0x2c, 0x20, 0x27, 0x2d, 0x2d, 0x2d, 0x2d, 0x2d, 0x2d, 
+	0xa, 0x9, 0x66, 0x6f, 0x72, 0x20, 0x69, 0x2c, 0x76, 0x20, 0x69, 0x6e, 0x20, 0x69, 0x70, 0x61, 
+	0x69, 0x72, 0x73, 0x28, 0x61, 0x73, 0x6d, 0x2e, 0x69, 0x6e, 0x73, 0x74, 0x72, 0x75, 0x63, 0x74, 
+	0x69, 0x6f, 0x6e, 0x73, 0x29, 0x20, 0x64, 0x6f, 0xa, 0x9, 0x9, 0x70, 0x75, 0x74, 0x73, 0x28, 
+	0x6c, 0x76, 0x2c, 0x20, 0x6f, 0x75, 0x74, 0x2c, 0x20, 0x61, 0x73, 0x6d, 0x2e, 0x6c, 0x69, 0x6e, 
+	0x65, 0x6e, 0x72, 0x5b, 0x69, 0x5d, 0x20, 0x2e, 0x2e, 0x20, 0x27, 0x3a, 0x27, 0x2c, 0x20, 0x75, 
+	0x6e, 0x70, 0x61, 0x63, 0x6b, 0x28, 0x76, 0x29, 0x29, 0xa, 0x9, 0x9, 0x69, 0x66, 0x20, 0x76, 
+	0x5b, 0x31, 0x5d, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x50, 0x55, 0x53, 0x48, 0x27, 0x20, 0x6f, 0x72, 
+	0x20, 0x76, 0x5b, 0x31, 0x5d, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x47, 0x45, 0x54, 0x47, 0x4c, 0x4f, 
+	0x42, 0x41, 0x4c, 0x27, 0x20, 0x6f, 0x72, 0x20, 0x76, 0x5b, 0x31, 0x5d, 0x20, 0x3d, 0x3d, 0x20, 
+	0x27, 0x47, 0x45, 0x54, 0x46, 0x49, 0x45, 0x4c, 0x44, 0x27, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 
+	0x9, 0x9, 0x9, 0x70, 0x75, 0x74, 0x73, 0x28, 0x6c, 0x76, 0x2c, 0x20, 0x6f, 0x75, 0x74, 0x2c, 
+	0x20, 0x27, 0x5c, 0x74, 0x20, 0x2d, 0x3e, 0x20, 0x27, 0x20, 0x2e, 0x2e, 0x20, 0x74, 0x6f, 0x73, 
+	0x74, 0x72, 0x69, 0x6e, 0x67, 0x28, 0x61, 0x73, 0x6d, 0x2e, 0x63, 0x6f, 0x6e, 0x73, 0x74, 0x61, 
+	0x6e, 0x74, 0x73, 0x5b, 0x76, 0x5b, 0x32, 0x5d, 0x20, 0x2b, 0x20, 0x31, 0x5d, 0x29, 0x29, 0xa, 
+	0x9, 0x9, 0x65, 0x6c, 0x73, 0x65, 0x69, 0x66, 0x20, 0x73, 0x74, 0x72, 0x69, 0x6e, 0x67, 0x2e, 
+	0x66, 0x69, 0x6e, 0x64, 0x28, 0x76, 0x5b, 0x31, 0x5d, 0x2c, 0x20, 0x27, 0x5f, 0x5b, 0x4c, 0x4b, 
+	0x5d, 0x4b, 0x24, 0x27, 0x29, 0x20, 0x6f, 0x72, 0x20, 0x73, 0x74, 0x72, 0x69, 0x6e, 0x67, 0x2e, 
+	0x66, 0x69, 0x6e, 0x64, 0x28, 0x76, 0x5b, 0x31, 0x5d, 0x2c, 0x20, 0x27, 0x5f, 0x4b, 0x4c, 0x24, 
+	0x27, 0x29, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x9, 0x9, 0x9, 0x70, 0x75, 0x74, 0x73, 0x28, 
+	0x6c, 0x76, 0x2c, 0x20, 0x6f, 0x75, 0x74, 0x2c, 0x20, 0x27, 0x5c, 0x74, 0x20, 0x2d, 0x3e, 0x20, 
+	0x27, 0x20, 0x2e, 0x2e, 0x20, 0x74, 0x6f, 0x73, 0x74, 0x72, 0x69, 0x6e, 0x67, 0x28, 0x61, 0x73, 
+	0x6d, 0x2e, 0x63, 0x6f, 0x6e, 0x73, 0x74, 0x61, 0x6e, 0x74, 0x73, 0x5b, 0x76, 0x5b, 0x33, 0x5d, 
+	0x20, 0x2b, 0x20, 0x31, 0x5d, 0x29, 0x29, 0xa, 0x9, 0x9, 0x65, 0x6e, 0x64, 0xa, 0x9, 0x65, 
+	0x6e, 0x64, 0xa, 0x9, 0x66, 0x6f, 0x72, 0x20, 0x5f, 0x2c, 0x76, 0x20, 0x69, 0x6e, 0x20, 0x69, 
+	0x70, 0x61, 0x69, 0x72, 0x73, 0x28, 0x61, 0x73, 0x6d, 0x2e, 0x70, 0x72, 0x6f, 0x74, 0x6f, 0x74, 
+	0x79, 0x70, 0x65, 0x73, 0x29, 0x20, 0x64, 0x6f, 0xa, 0x9, 0x9, 0x67, 0x65, 0x6e, 0x5f, 0x70, 
+	0x72, 0x69, 0x6e, 0x74, 0x28, 0x76, 0x2c, 0x20, 0x6c, 0x76, 0x2c, 0x20, 0x6f, 0x75, 0x74, 0x29, 
+	0xa, 0x9, 0x65, 0x6e, 0x64, 0xa, 0x9, 0x70, 0x75, 0x74, 0x73, 0x28, 0x6c, 0x76, 0x2c, 0x20, 
+	0x6f, 0x75, 0x74, 0x2c, 0x20, 0x27, 0x2d, 0x2d, 0x2d, 0x2d, 0x2d, 0x2d, 0x2d, 0x2d, 0x2d, 0x2d, 
 	0x2d, 0x2d, 0x2d, 0x2d, 0x2d, 0x2d, 0x2d, 0x2d, 0x2d, 0x2d, 0x2d, 0x2d, 0x2d, 0x2d, 0x2d, 0x2d, 
-	0x2d, 0x2d, 0x2d, 0x2d, 0x2d, 0x2d, 0x27, 0x29, 0xa, 0x65, 0x6e, 0x64, 0xa, 0xa, 0x65, 0x6e, 
-	0x64, 0xa, 0xa, 0xa, 0x64, 0x6f, 0xa, 0x2d, 0x2d, 0x20, 0x53, 0x20, 0x41, 0x20, 0x55, 0x20, 
-	0x52, 0x20, 0x55, 0x20, 0x53, 0xa, 0x2d, 0x2d, 0x20, 0x43, 0x6f, 0x70, 0x79, 0x72, 0x69, 0x67, 
-	0x68, 0x74, 0x20, 0x28, 0x63, 0x29, 0x20, 0x32, 0x30, 0x30, 0x39, 0x2d, 0x32, 0x30, 0x31, 0x35, 
-	0x20, 0x41, 0x6e, 0x64, 0x72, 0x65, 0x61, 0x73, 0x20, 0x54, 0x20, 0x4a, 0x6f, 0x6e, 0x73, 0x73, 
-	0x6f, 0x6e, 0x20, 0x3c, 0x61, 0x6e, 0x64, 0x72, 0x65, 0x61, 0x73, 0x40, 0x73, 0x61, 0x75, 0x72, 
-	0x75, 0x73, 0x2e, 0x6f, 0x72, 0x67, 0x3e, 0xa, 0x2d, 0x2d, 0xa, 0x2d, 0x2d, 0x20, 0x54, 0x68, 
-	0x69, 0x73, 0x20, 0x53, 0x6f, 0x75, 0x72, 0x63, 0x65, 0x20, 0x43, 0x6f, 0x64, 0x65, 0x20, 0x46, 
-	0x6f, 0x72, 0x6d, 0x20, 0x69, 0x73, 0x20, 0x73, 0x75, 0x62, 0x6a, 0x65, 0x63, 0x74, 0x20, 0x74, 
-	0x6f, 0x20, 0x74, 0x68, 0x65, 0x20, 0x74, 0x65, 0x72, 0x6d, 0x73, 0x20, 0x6f, 0x66, 0x20, 0x74, 
-	0x68, 0x65, 0x20, 0x4d, 0x6f, 0x7a, 0x69, 0x6c, 0x6c, 0x61, 0x20, 0x50, 0x75, 0x62, 0x6c, 0x69, 
-	0x63, 0xa, 0x2d, 0x2d, 0x20, 0x4c, 0x69, 0x63, 0x65, 0x6e, 0x73, 0x65, 0x2c, 0x20, 0x76, 0x2e, 
-	0x20, 0x32, 0x2e, 0x30, 0x2e, 0x20, 0x49, 0x66, 0x20, 0x61, 0x20, 0x63, 0x6f, 0x70, 0x79, 0x20, 
-	0x6f, 0x66, 0x20, 0x74, 0x68, 0x65, 0x20, 0x4d, 0x50, 0x4c, 0x20, 0x77, 0x61, 0x73, 0x20, 0x6e, 
-	0x6f, 0x74, 0x20, 0x64, 0x69, 0x73, 0x74, 0x72, 0x69, 0x62, 0x75, 0x74, 0x65, 0x64, 0x20, 0x77, 
-	0x69, 0x74, 0x68, 0x20, 0x74, 0x68, 0x69, 0x73, 0xa, 0x2d, 0x2d, 0x20, 0x66, 0x69, 0x6c, 0x65, 
-	0x2c, 0x20, 0x59, 0x6f, 0x75, 0x20, 0x63, 0x61, 0x6e, 0x20, 0x6f, 0x62, 0x74, 0x61, 0x69, 0x6e, 
-	0x20, 0x6f, 0x6e, 0x65, 0x20, 0x61, 0x74, 0x20, 0x68, 0x74, 0x74, 0x70, 0x3a, 0x2f, 0x2f, 0x6d, 
-	0x6f, 0x7a, 0x69, 0x6c, 0x6c, 0x61, 0x2e, 0x6f, 0x72, 0x67, 0x2f, 0x4d, 0x50, 0x4c, 0x2f, 0x32, 
-	0x2e, 0x30, 0x2f, 0x2e, 0xa, 0xa, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x20, 0x69, 0x6e, 0x73, 0x74, 
-	0x72, 0x75, 0x63, 0x74, 0x69, 0x6f, 0x6e, 0x5f, 0x73, 0x65, 0x74, 0x20, 0x3d, 0x20, 0x7b, 0xa, 
-	0x9, 0x27, 0x50, 0x55, 0x53, 0x48, 0x27, 0x2c, 0xa, 0x9, 0x27, 0x50, 0x4f, 0x50, 0x27, 0x2c, 
-	0xa, 0x9, 0x27, 0x4c, 0x4f, 0x41, 0x44, 0x27, 0x2c, 0xa, 0x9, 0x27, 0x4c, 0x55, 0x50, 0x27, 
-	0x2c, 0xa, 0x9, 0x27, 0x4c, 0x43, 0x4c, 0x27, 0x2c, 0xa, 0xa, 0x9, 0x27, 0x41, 0x44, 0x44, 
-	0x27, 0x2c, 0xa, 0x9, 0x27, 0x53, 0x55, 0x42, 0x27, 0x2c, 0xa, 0x9, 0x27, 0x4d, 0x55, 0x4c, 
-	0x27, 0x2c, 0xa, 0x9, 0x27, 0x44, 0x49, 0x56, 0x27, 0x2c, 0xa, 0x9, 0x27, 0x4d, 0x4f, 0x44, 
-	0x27, 0x2c, 0xa, 0x9, 0x27, 0x50, 0x4f, 0x57, 0x27, 0x2c, 0xa, 0x9, 0x27, 0x55, 0x4e, 0x4d, 
-	0x27, 0x2c, 0xa, 0xa, 0x9, 0x27, 0x45, 0x51, 0x27, 0x2c, 0xa, 0x9, 0x27, 0x4c, 0x45, 0x53, 
-	0x53, 0x27, 0x2c, 0xa, 0x9, 0x27, 0x4c, 0x45, 0x51, 0x55, 0x41, 0x4c, 0x27, 0x2c, 0xa, 0xa, 
-	0x9, 0x27, 0x4e, 0x4f, 0x54, 0x27, 0x2c, 0xa, 0x9, 0x27, 0x41, 0x4e, 0x44, 0x27, 0x2c, 0xa, 
-	0x9, 0x27, 0x4f, 0x52, 0x27, 0x2c, 0xa, 0xa, 0x9, 0x27, 0x54, 0x45, 0x53, 0x54, 0x27, 0x2c, 
-	0xa, 0x9, 0x27, 0x46, 0x4f, 0x52, 0x27, 0x2c, 0xa, 0x9, 0x27, 0x4a, 0x4d, 0x50, 0x27, 0x2c, 
-	0xa, 0xa, 0x9, 0x27, 0x52, 0x45, 0x54, 0x55, 0x52, 0x4e, 0x27, 0x2c, 0xa, 0x9, 0x27, 0x53, 
-	0x48, 0x49, 0x46, 0x54, 0x27, 0x2c, 0xa, 0x9, 0x27, 0x43, 0x41, 0x4c, 0x4c, 0x27, 0x2c, 0xa, 
-	0x9, 0x27, 0x54, 0x43, 0x41, 0x4c, 0x4c, 0x27, 0x2c, 0xa, 0x9, 0x27, 0x4c, 0x41, 0x4d, 0x42, 
-	0x44, 0x41, 0x27, 0x2c, 0xa, 0xa, 0x9, 0x27, 0x47, 0x45, 0x54, 0x47, 0x4c, 0x4f, 0x42, 0x41, 
-	0x4c, 0x27, 0x2c, 0xa, 0x9, 0x27, 0x53, 0x45, 0x54, 0x47, 0x4c, 0x4f, 0x42, 0x41, 0x4c, 0x27, 
-	0xa, 0x7d, 0xa, 0xa, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x20, 0x69, 0x6e, 0x73, 0x74, 0x72, 0x75, 
-	0x63, 0x74, 0x69, 0x6f, 0x6e, 0x5f, 0x6d, 0x61, 0x74, 0x72, 0x69, 0x78, 0x20, 0x3d, 0x20, 0x7b, 
-	0x7d, 0xa, 0x66, 0x6f, 0x72, 0x20, 0x69, 0x2c, 0x76, 0x20, 0x69, 0x6e, 0x20, 0x69, 0x70, 0x61, 
-	0x69, 0x72, 0x73, 0x28, 0x69, 0x6e, 0x73, 0x74, 0x72, 0x75, 0x63, 0x74, 0x69, 0x6f, 0x6e, 0x5f, 
-	0x73, 0x65, 0x74, 0x29, 0x20, 0x64, 0x6f, 0xa, 0x9, 0x61, 0x73, 0x73, 0x65, 0x72, 0x74, 0x28, 
-	0x6e, 0x6f, 0x74, 0x20, 0x69, 0x6e, 0x73, 0x74, 0x72, 0x75, 0x63, 0x74, 0x69, 0x6f, 0x6e, 0x5f, 
-	0x6d, 0x61, 0x74, 0x72, 0x69, 0x78, 0x5b, 0x76, 0x5d, 0x29, 0xa, 0x9, 0x69, 0x6e, 0x73, 0x74, 
+	0x2d, 0x2d, 0x27, 0x29, 0xa, 0x65, 0x6e, 0x64, 0xa, 0xa, 0x65, 0x6e, 0x64, 0xa, 0xa, 0xa, 
+	0x64, 0x6f, 0xa, 0x2d, 0x2d, 0x20, 0x53, 0x20, 0x41, 0x20, 0x55, 0x20, 0x52, 0x20, 0x55, 0x20, 
+	0x53, 0xa, 0x2d, 0x2d, 0x20, 0x43, 0x6f, 0x70, 0x79, 0x72, 0x69, 0x67, 0x68, 0x74, 0x20, 0x28, 
+	0x63, 0x29, 0x20, 0x32, 0x30, 0x30, 0x39, 0x2d, 0x32, 0x30, 0x31, 0x35, 0x20, 0x41, 0x6e, 0x64, 
+	0x72, 0x65, 0x61, 0x73, 0x20, 0x54, 0x20, 0x4a, 0x6f, 0x6e, 0x73, 0x73, 0x6f, 0x6e, 0x20, 0x3c, 
+	0x61, 0x6e, 0x64, 0x72, 0x65, 0x61, 0x73, 0x40, 0x73, 0x61, 0x75, 0x72, 0x75, 0x73, 0x2e, 0x6f, 
+	0x72, 0x67, 0x3e, 0xa, 0x2d, 0x2d, 0xa, 0x2d, 0x2d, 0x20, 0x54, 0x68, 0x69, 0x73, 0x20, 0x53, 
+	0x6f, 0x75, 0x72, 0x63, 0x65, 0x20, 0x43, 0x6f, 0x64, 0x65, 0x20, 0x46, 0x6f, 0x72, 0x6d, 0x20, 
+	0x69, 0x73, 0x20, 0x73, 0x75, 0x62, 0x6a, 0x65, 0x63, 0x74, 0x20, 0x74, 0x6f, 0x20, 0x74, 0x68, 
+	0x65, 0x20, 0x74, 0x65, 0x72, 0x6d, 0x73, 0x20, 0x6f, 0x66, 0x20, 0x74, 0x68, 0x65, 0x20, 0x4d, 
+	0x6f, 0x7a, 0x69, 0x6c, 0x6c, 0x61, 0x20, 0x50, 0x75, 0x62, 0x6c, 0x69, 0x63, 0xa, 0x2d, 0x2d, 
+	0x20, 0x4c, 0x69, 0x63, 0x65, 0x6e, 0x73, 0x65, 0x2c, 0x20, 0x76, 0x2e, 0x20, 0x32, 0x2e, 0x30, 
+	0x2e, 0x20, 0x49, 0x66, 0x20, 0x61, 0x20, 0x63, 0x6f, 0x70, 0x79, 0x20, 0x6f, 0x66, 0x20, 0x74, 
+	0x68, 0x65, 0x20, 0x4d, 0x50, 0x4c, 0x20, 0x77, 0x61, 0x73, 0x20, 0x6e, 0x6f, 0x74, 0x20, 0x64, 
+	0x69, 0x73, 0x74, 0x72, 0x69, 0x62, 0x75, 0x74, 0x65, 0x64, 0x20, 0x77, 0x69, 0x74, 0x68, 0x20, 
+	0x74, 0x68, 0x69, 0x73, 0xa, 0x2d, 0x2d, 0x20, 0x66, 0x69, 0x6c, 0x65, 0x2c, 0x20, 0x59, 0x6f, 
+	0x75, 0x20, 0x63, 0x61, 0x6e, 0x20, 0x6f, 0x62, 0x74, 0x61, 0x69, 0x6e, 0x20, 0x6f, 0x6e, 0x65, 
+	0x20, 0x61, 0x74, 0x20, 0x68, 0x74, 0x74, 0x70, 0x3a, 0x2f, 0x2f, 0x6d, 0x6f, 0x7a, 0x69, 0x6c, 
+	0x6c, 0x61, 0x2e, 0x6f, 0x72, 0x67, 0x2f, 0x4d, 0x50, 0x4c, 0x2f, 0x32, 0x2e, 0x30, 0x2f, 0x2e, 
+	0xa, 0xa, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x20, 0x69, 0x6e, 0x73, 0x74, 0x72, 0x75, 0x63, 0x74, 
+	0x69, 0x6f, 0x6e, 0x5f, 0x73, 0x65, 0x74, 0x20, 0x3d, 0x20, 0x7b, 0xa, 0x9, 0x27, 0x50, 0x55, 
+	0x53, 0x48, 0x27, 0x2c, 0xa, 0x9, 0x27, 0x50, 0x4f, 0x50, 0x27, 0x2c, 0xa, 0x9, 0x27, 0x4c, 
+	0x4f, 0x41, 0x44, 0x27, 0x2c, 0xa, 0x9, 0x27, 0x4c, 0x55, 0x50, 0x27, 0x2c, 0xa, 0x9, 0x27, 
+	0x4c, 0x43, 0x4c, 0x27, 0x2c, 0xa, 0xa, 0x9, 0x27, 0x41, 0x44, 0x44, 0x27, 0x2c, 0xa, 0x9, 
+	0x27, 0x53, 0x55, 0x42, 0x27, 0x2c, 0xa, 0x9, 0x27, 0x4d, 0x55, 0x4c, 0x27, 0x2c, 0xa, 0x9, 
+	0x27, 0x44, 0x49, 0x56, 0x27, 0x2c, 0xa, 0x9, 0x27, 0x4d, 0x4f, 0x44, 0x27, 0x2c, 0xa, 0x9, 
+	0x27, 0x50, 0x4f, 0x57, 0x27, 0x2c, 0xa, 0x9, 0x27, 0x55, 0x4e, 0x4d, 0x27, 0x2c, 0xa, 0xa, 
+	0x9, 0x27, 0x45, 0x51, 0x27, 0x2c, 0xa, 0x9, 0x27, 0x4c, 0x45, 0x53, 0x53, 0x27, 0x2c, 0xa, 
+	0x9, 0x27, 0x4c, 0x45, 0x51, 0x55, 0x41, 0x4c, 0x27, 0x2c, 0xa, 0xa, 0x9, 0x27, 0x4e, 0x4f, 
+	0x54, 0x27, 0x2c, 0xa, 0x9, 0x27, 0x41, 0x4e, 0x44, 0x27, 0x2c, 0xa, 0x9, 0x27, 0x4f, 0x52, 
+	0x27, 0x2c, 0xa, 0xa, 0x9, 0x27, 0x54, 0x45, 0x53, 0x54, 0x27, 0x2c, 0xa, 0x9, 0x27, 0x46, 
+	0x4f, 0x52, 0x27, 0x2c, 0xa, 0x9, 0x27, 0x4a, 0x4d, 0x50, 0x27, 0x2c, 0xa, 0xa, 0x9, 0x27, 
+	0x52, 0x45, 0x54, 0x55, 0x52, 0x4e, 0x27, 0x2c, 0xa, 0x9, 0x27, 0x53, 0x48, 0x49, 0x46, 0x54, 
+	0x27, 0x2c, 0xa, 0x9, 0x27, 0x43, 0x41, 0x4c, 0x4c, 0x27, 0x2c, 0xa, 0x9, 0x27, 0x54, 0x43, 
+	0x41, 0x4c, 0x4c, 0x27, 0x2c, 0xa, 0x9, 0x27, 0x4c, 0x41, 0x4d, 0x42, 0x44, 0x41, 0x27, 0x2c, 
+	0xa, 0xa, 0x9, 0x27, 0x47, 0x45, 0x54, 0x47, 0x4c, 0x4f, 0x42, 0x41, 0x4c, 0x27, 0x2c, 0xa, 
+	0x9, 0x27, 0x53, 0x45, 0x54, 0x47, 0x4c, 0x4f, 0x42, 0x41, 0x4c, 0x27, 0x2c, 0xa, 0x9, 0x27, 
+	0x47, 0x45, 0x54, 0x46, 0x49, 0x45, 0x4c, 0x44, 0x27, 0x2c, 0xa, 0x9, 0x27, 0x46, 0x4f, 0x52, 
+	0x50, 0x52, 0x45, 0x50, 0x27, 0x2c, 0xa, 0x9, 0x27, 0x46, 0x4f, 0x52, 0x4c, 0x4f, 0x4f, 0x50, 
+	0x27, 0x2c, 0xa, 0x9, 0x27, 0x53, 0x54, 0x4f, 0x52, 0x45, 0x27, 0x2c, 0xa, 0xa, 0x9, 0x27, 
+	0x41, 0x44, 0x44, 0x5f, 0x4c, 0x4c, 0x27, 0x2c, 0xa, 0x9, 0x27, 0x41, 0x44, 0x44, 0x5f, 0x4c, 
+	0x4b, 0x27, 0x2c, 0xa, 0x9, 0x27, 0x53, 0x55, 0x42, 0x5f, 0x4c, 0x4c, 0x27, 0x2c, 0xa, 0x9, 
+	0x27, 0x53, 0x55, 0x42, 0x5f, 0x4c, 0x4b, 0x27, 0x2c, 0xa, 0x9, 0x27, 0x53, 0x55, 0x42, 0x5f, 
+	0x4b, 0x4c, 0x27, 0x2c, 0xa, 0x9, 0x27, 0x4d, 0x55, 0x4c, 0x5f, 0x4c, 0x4c, 0x27, 0x2c, 0xa, 
+	0x9, 0x27, 0x4d, 0x55, 0x4c, 0x5f, 0x4c, 0x4b, 0x27, 0x2c, 0xa, 0x9, 0x27, 0x45, 0x51, 0x5f, 
+	0x4c, 0x4c, 0x27, 0x2c, 0xa, 0x9, 0x27, 0x45, 0x51, 0x5f, 0x4c, 0x4b, 0x27, 0x2c, 0xa, 0x9, 
+	0x27, 0x4c, 0x45, 0x53, 0x53, 0x5f, 0x4c, 0x4c, 0x27, 0x2c, 0xa, 0x9, 0x27, 0x4c, 0x45, 0x53, 
+	0x53, 0x5f, 0x4c, 0x4b, 0x27, 0x2c, 0xa, 0x9, 0x27, 0x4c, 0x45, 0x53, 0x53, 0x5f, 0x4b, 0x4c, 
+	0x27, 0x2c, 0xa, 0x9, 0x27, 0x4c, 0x45, 0x51, 0x55, 0x41, 0x4c, 0x5f, 0x4c, 0x4c, 0x27, 0x2c, 
+	0xa, 0x9, 0x27, 0x4c, 0x45, 0x51, 0x55, 0x41, 0x4c, 0x5f, 0x4c, 0x4b, 0x27, 0x2c, 0xa, 0x9, 
+	0x27, 0x4c, 0x45, 0x51, 0x55, 0x41, 0x4c, 0x5f, 0x4b, 0x4c, 0x27, 0x2c, 0xa, 0xa, 0x9, 0x27, 
+	0x45, 0x51, 0x5f, 0x4c, 0x4c, 0x5f, 0x54, 0x45, 0x53, 0x54, 0x27, 0x2c, 0xa, 0x9, 0x27, 0x45, 
+	0x51, 0x5f, 0x4c, 0x4b, 0x5f, 0x54, 0x45, 0x53, 0x54, 0x27, 0x2c, 0xa, 0x9, 0x27, 0x4c, 0x45, 
+	0x53, 0x53, 0x5f, 0x4c, 0x4c, 0x5f, 0x54, 0x45, 0x53, 0x54, 0x27, 0x2c, 0xa, 0x9, 0x27, 0x4c, 
+	0x45, 0x53, 0x53, 0x5f, 0x4c, 0x4b, 0x5f, 0x54, 0x45, 0x53, 0x54, 0x27, 0x2c, 0xa, 0x9, 0x27, 
+	0x4c, 0x45, 0x53, 0x53, 0x5f, 0x4b, 0x4c, 0x5f, 0x54, 0x45, 0x53, 0x54, 0x27, 0x2c, 0xa, 0x9, 
+	0x27, 0x4c, 0x45, 0x51, 0x55, 0x41, 0x4c, 0x5f, 0x4c, 0x4c, 0x5f, 0x54, 0x45, 0x53, 0x54, 0x27, 
+	0x2c, 0xa, 0x9, 0x27, 0x4c, 0x45, 0x51, 0x55, 0x41, 0x4c, 0x5f, 0x4c, 0x4b, 0x5f, 0x54, 0x45, 
+	0x53, 0x54, 0x27, 0x2c, 0xa, 0x9, 0x27, 0x4c, 0x45, 0x51, 0x55, 0x41, 0x4c, 0x5f, 0x4b, 0x4c, 
+	0x5f, 0x54, 0x45, 0x53, 0x54, 0x27, 0x2c, 0xa, 0x9, 0x27, 0x53, 0x48, 0x49, 0x46, 0x54, 0x5f, 
+	0x4a, 0x4d, 0x50, 0x27, 0x2c, 0xa, 0x9, 0x27, 0x4c, 0x4f, 0x41, 0x44, 0x5f, 0x4c, 0x4f, 0x41, 
+	0x44, 0x27, 0x2c, 0xa, 0xa, 0x9, 0x27, 0x41, 0x44, 0x44, 0x5f, 0x4e, 0x4e, 0x27, 0x2c, 0xa, 
+	0x9, 0x27, 0x53, 0x55, 0x42, 0x5f, 0x4e, 0x4e, 0x27, 0x2c, 0xa, 0x9, 0x27, 0x4d, 0x55, 0x4c, 
+	0x5f, 0x4e, 0x4e, 0x27, 0x2c, 0xa, 0x9, 0x27, 0x4c, 0x45, 0x53, 0x53, 0x5f, 0x4e, 0x4e, 0x27, 
+	0x2c, 0xa, 0x9, 0x27, 0x4c, 0x45, 0x51, 0x55, 0x41, 0x4c, 0x5f, 0x4e, 0x4e, 0x27, 0xa, 0x7d, 
+	0xa, 0xa, 0x2d, 0x2d, 0x20, 0x48, 0x65, 0x61, 0x64, 0x65, 0x72, 0x20, 0x66, 0x6c, 0x61, 0x67, 
+	0x73, 0x2c, 0x20, 0x6d, 0x75, 0x73, 0x74, 0x20, 0x6d, 0x61, 0x74, 0x63, 0x68, 0x20, 0x74, 0x68, 
+	0x65, 0x20, 0x56, 0x4d, 0x2e, 0xa, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x20, 0x48, 0x45, 0x41, 0x44, 
+	0x45, 0x52, 0x5f, 0x4f, 0x50, 0x45, 0x52, 0x41, 0x4e, 0x44, 0x53, 0x20, 0x3d, 0x20, 0x30, 0x78, 
+	0x31, 0xa, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x20, 0x48, 0x45, 0x41, 0x44, 0x45, 0x52, 0x5f, 0x53, 
+	0x55, 0x50, 0x45, 0x52, 0x49, 0x4e, 0x53, 0x54, 0x20, 0x3d, 0x20, 0x30, 0x78, 0x32, 0xa, 0xa, 
+	0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x20, 0x6f, 0x70, 0x74, 0x5f, 0x73, 0x75, 0x70, 0x65, 0x72, 0x69, 
+	0x6e, 0x73, 0x74, 0x20, 0x3d, 0x20, 0x6e, 0x6f, 0x74, 0x20, 0x6f, 0x73, 0x2e, 0x67, 0x65, 0x74, 
+	0x65, 0x6e, 0x76, 0x28, 0x27, 0x53, 0x55, 0x5f, 0x4f, 0x50, 0x54, 0x5f, 0x4e, 0x4f, 0x5f, 0x53, 
+	0x55, 0x50, 0x45, 0x52, 0x49, 0x4e, 0x53, 0x54, 0x27, 0x29, 0xa, 0xa, 0x2d, 0x2d, 0x20, 0x4f, 
+	0x70, 0x63, 0x6f, 0x64, 0x65, 0x20, 0x70, 0x61, 0x69, 0x72, 0x73, 0x20, 0x66, 0x75, 0x73, 0x65, 
+	0x64, 0x20, 0x69, 0x6e, 0x74, 0x6f, 0x20, 0x61, 0x20, 0x73, 0x75, 0x70, 0x65, 0x72, 0x69, 0x6e, 
+	0x73, 0x74, 0x72, 0x75, 0x63, 0x74, 0x69, 0x6f, 0x6e, 0x2c, 0x20, 0x70, 0x69, 0x63, 0x6b, 0x65, 
+	0x64, 0x20, 0x66, 0x72, 0x6f, 0x6d, 0x20, 0x74, 0x68, 0x65, 0x20, 0x70, 0x61, 0x69, 0x72, 0xa, 
+	0x2d, 0x2d, 0x20, 0x68, 0x69, 0x73, 0x74, 0x6f, 0x67, 0x72, 0x61, 0x6d, 0x20, 0x6f, 0x66, 0x20, 
+	0x61, 0x20, 0x56, 0x4d, 0x20, 0x62, 0x75, 0x69, 0x6c, 0x74, 0x20, 0x77, 0x69, 0x74, 0x68, 0x20, 
+	0x53, 0x55, 0x5f, 0x4f, 0x50, 0x54, 0x5f, 0x56, 0x4d, 0x5f, 0x53, 0x54, 0x41, 0x54, 0x53, 0x20, 
+	0x28, 0x74, 0x6f, 0x6f, 0x6c, 0x73, 0x2f, 0x62, 0x65, 0x6e, 0x63, 0x68, 0x2f, 0x70, 0x61, 0x69, 
+	0x72, 0x73, 0x2e, 0x73, 0x68, 0x29, 0x2e, 0xa, 0x2d, 0x2d, 0x20, 0x54, 0x68, 0x65, 0x20, 0x73, 
+	0x65, 0x63, 0x6f, 0x6e, 0x64, 0x20, 0x69, 0x6e, 0x73, 0x74, 0x72, 0x75, 0x63, 0x74, 0x69, 0x6f, 
+	0x6e, 0x20, 0x69, 0x73, 0x20, 0x6c, 0x65, 0x66, 0x74, 0x20, 0x69, 0x6e, 0x20, 0x70, 0x6c, 0x61, 
+	0x63, 0x65, 0x20, 0x61, 0x73, 0x20, 0x61, 0x6e, 0x20, 0x6f, 0x70, 0x65, 0x72, 0x61, 0x6e, 0x64, 
+	0x20, 0x77, 0x6f, 0x72, 0x64, 0x2c, 0x20, 0x73, 0x6f, 0x20, 0x74, 0x68, 0x65, 0xa, 0x2d, 0x2d, 
+	0x20, 0x69, 0x6e, 0x73, 0x74, 0x72, 0x75, 0x63, 0x74, 0x69, 0x6f, 0x6e, 0x20, 0x63, 0x6f, 0x75, 
+	0x6e, 0x74, 0x2c, 0x20, 0x6a, 0x75, 0x6d, 0x70, 0x20, 0x74, 0x61, 0x72, 0x67, 0x65, 0x74, 0x73, 
+	0x20, 0x61, 0x6e, 0x64, 0x20, 0x6c, 0x69, 0x6e, 0x65, 0x20, 0x69, 0x6e, 0x66, 0x6f, 0x20, 0x61, 
+	0x72, 0x65, 0x20, 0x75, 0x6e, 0x63, 0x68, 0x61, 0x6e, 0x67, 0x65, 0x64, 0x20, 0x61, 0x6e, 0x64, 
+	0x20, 0x61, 0xa, 0x2d, 0x2d, 0x20, 0x6a, 0x75, 0x6d, 0x70, 0x20, 0x74, 0x6f, 0x20, 0x74, 0x68, 
+	0x65, 0x20, 0x73, 0x65, 0x63, 0x6f, 0x6e, 0x64, 0x20, 0x69, 0x6e, 0x73, 0x74, 0x72, 0x75, 0x63, 
+	0x74, 0x69, 0x6f, 0x6e, 0x20, 0x73, 0x74, 0x69, 0x6c, 0x6c, 0x20, 0x65, 0x78, 0x65, 0x63, 0x75, 
+	0x74, 0x65, 0x73, 0x20, 0x69, 0x74, 0x20, 0x6f, 0x6e, 0x20, 0x69, 0x74, 0x73, 0x20, 0x6f, 0x77, 
+	0x6e, 0x2e, 0xa, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x20, 0x73, 0x75, 0x70, 0x65, 0x72, 0x69, 0x6e, 
+	0x73, 0x74, 0x20, 0x3d, 0x20, 0x7b, 0xa, 0x9, 0x45, 0x51, 0x5f, 0x4c, 0x4c, 0x20, 0x3d, 0x20, 
+	0x7b, 0x20, 0x54, 0x45, 0x53, 0x54, 0x20, 0x3d, 0x20, 0x27, 0x45, 0x51, 0x5f, 0x4c, 0x4c, 0x5f, 
+	0x54, 0x45, 0x53, 0x54, 0x27, 0x20, 0x7d, 0x2c, 0xa, 0x9, 0x45, 0x51, 0x5f, 0x4c, 0x4b, 0x20, 
+	0x3d, 0x20, 0x7b, 0x20, 0x54, 0x45, 0x53, 0x54, 0x20, 0x3d, 0x20, 0x27, 0x45, 0x51, 0x5f, 0x4c, 
+	0x4b, 0x5f, 0x54, 0x45, 0x53, 0x54, 0x27, 0x20, 0x7d, 0x2c, 0xa, 0x9, 0x4c, 0x45, 0x53, 0x53, 
+	0x5f, 0x4c, 0x4c, 0x20, 0x3d, 0x20, 0x7b, 0x20, 0x54, 0x45, 0x53, 0x54, 0x20, 0x3d, 0x20, 0x27, 
+	0x4c, 0x45, 0x53, 0x53, 0x5f, 0x4c, 0x4c, 0x5f, 0x54, 0x45, 0x53, 0x54, 0x27, 0x20, 0x7d, 0x2c, 
+	0xa, 0x9, 0x4c, 0x45, 0x53, 0x53, 0x5f, 0x4c, 0x4b, 0x20, 0x3d, 0x20, 0x7b, 0x20, 0x54, 0x45, 
+	0x53, 0x54, 0x20, 0x3d, 0x20, 0x27, 0x4c, 0x45, 0x53, 0x53, 0x5f, 0x4c, 0x4b, 0x5f, 0x54, 0x45, 
+	0x53, 0x54, 0x27, 0x20, 0x7d, 0x2c, 0xa, 0x9, 0x4c, 0x45, 0x53, 0x53, 0x5f, 0x4b, 0x4c, 0x20, 
+	0x3d, 0x20, 0x7b, 0x20, 0x54, 0x45, 0x53, 0x54, 0x20, 0x3d, 0x20, 0x27, 0x4c, 0x45, 0x53, 0x53, 
+	0x5f, 0x4b, 0x4c, 0x5f, 0x54, 0x45, 0x53, 0x54, 0x27, 0x20, 0x7d, 0x2c, 0xa, 0x9, 0x4c, 0x45, 
+	0x51, 0x55, 0x41, 0x4c, 0x5f, 0x4c, 0x4c, 0x20, 0x3d, 0x20, 0x7b, 0x20, 0x54, 0x45, 0x53, 0x54, 
+	0x20, 0x3d, 0x20, 0x27, 0x4c, 0x45, 0x51, 0x55, 0x41, 0x4c, 0x5f, 0x4c, 0x4c, 0x5f, 0x54, 0x45, 
+	0x53, 0x54, 0x27, 0x20, 0x7d, 0x2c, 0xa, 0x9, 0x4c, 0x45, 0x51, 0x55, 0x41, 0x4c, 0x5f, 0x4c, 
+	0x4b, 0x20, 0x3d, 0x20, 0x7b, 0x20, 0x54, 0x45, 0x53, 0x54, 0x20, 0x3d, 0x20, 0x27, 0x4c, 0x45, 
+	0x51, 0x55, 0x41, 0x4c, 0x5f, 0x4c, 0x4b, 0x5f, 0x54, 0x45, 0x53, 0x54, 0x27, 0x20, 0x7d, 0x2c, 
+	0xa, 0x9, 0x4c, 0x45, 0x51, 0x55, 0x41, 0x4c, 0x5f, 0x4b, 0x4c, 0x20, 0x3d, 0x20, 0x7b, 0x20, 
+	0x54, 0x45, 0x53, 0x54, 0x20, 0x3d, 0x20, 0x27, 0x4c, 0x45, 0x51, 0x55, 0x41, 0x4c, 0x5f, 0x4b, 
+	0x4c, 0x5f, 0x54, 0x45, 0x53, 0x54, 0x27, 0x20, 0x7d, 0x2c, 0xa, 0x9, 0x53, 0x48, 0x49, 0x46, 
+	0x54, 0x20, 0x3d, 0x20, 0x7b, 0x20, 0x4a, 0x4d, 0x50, 0x20, 0x3d, 0x20, 0x27, 0x53, 0x48, 0x49, 
+	0x46, 0x54, 0x5f, 0x4a, 0x4d, 0x50, 0x27, 0x20, 0x7d, 0x2c, 0xa, 0x9, 0x4c, 0x4f, 0x41, 0x44, 
+	0x20, 0x3d, 0x20, 0x7b, 0x20, 0x4c, 0x4f, 0x41, 0x44, 0x20, 0x3d, 0x20, 0x27, 0x4c, 0x4f, 0x41, 
+	0x44, 0x5f, 0x4c, 0x4f, 0x41, 0x44, 0x27, 0x20, 0x7d, 0xa, 0x7d, 0xa, 0xa, 0x6c, 0x6f, 0x63, 
+	0x61, 0x6c, 0x20, 0x69, 0x6e, 0x73, 0x74, 0x72, 0x75, 0x63, 0x74, 0x69, 0x6f, 0x6e, 0x5f, 0x6d, 
+	0x61, 0x74, 0x72, 0x69, 0x78, 0x20, 0x3d, 0x20, 0x7b, 0x7d, 0xa, 0x66, 0x6f, 0x72, 0x20, 0x69, 
+	0x2c, 0x76, 0x20, 0x69, 0x6e, 0x20, 0x69, 0x70, 0x61, 0x69, 0x72, 0x73, 0x28, 0x69, 0x6e, 0x73, 
+	0x74, 0x72, 0x75, 0x63, 0x74, 0x69, 0x6f, 0x6e, 0x5f, 0x73, 0x65, 0x74, 0x29, 0x20, 0x64, 0x6f, 
+	0xa, 0x9, 0x61, 0x73, 0x73, 0x65, 0x72, 0x74, 0x28, 0x6e, 0x6f, 0x74, 0x20, 0x69, 0x6e, 0x73, 
+	0x74, 0x72, 0x75, 0x63, 0x74, 0x69, 0x6f, 0x6e, 0x5f, 0x6d, 0x61, 0x74, 0x72, 0x69, 0x78, 0x5b, 
+	0x76, 0x5d, 0x29, 0xa, 0x9, 0x69, 0x6e, 0x73, 0x74, 0x72, 0x75, 0x63, 0x74, 0x69, 0x6f, 0x6e, 
+	0x5f, 0x6d, 0x61, 0x74, 0x72, 0x69, 0x78, 0x5b, 0x76, 0x5d, 0x20, 0x3d, 0x20, 0x69, 0x20, 0x2d, 
+	0x20, 0x31, 0xa, 0x65, 0x6e, 0x64, 0xa, 0xa, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x20, 0x66, 0x75, 
+	0x6e, 0x63, 0x74, 0x69, 0x6f, 0x6e, 0x20, 0x61, 0x73, 0x6d, 0x5f, 0x65, 0x72, 0x72, 0x6f, 0x72, 
+	0x28, 0x66, 0x69, 0x6c, 0x65, 0x2c, 0x20, 0x6c, 0x69, 0x6e, 0x65, 0x2c, 0x20, 0x2e, 0x2e, 0x2e, 
+	0x29, 0xa, 0x9, 0x73, 0x61, 0x75, 0x72, 0x75, 0x73, 0x5f, 0x65, 0x72, 0x72, 0x6f, 0x72, 0x20, 
+	0x3d, 0x20, 0x73, 0x74, 0x72, 0x69, 0x6e, 0x67, 0x2e, 0x66, 0x6f, 0x72, 0x6d, 0x61, 0x74, 0x28, 
+	0x2e, 0x2e, 0x2e, 0x29, 0x20, 0x2e, 0x2e, 0x20, 0x73, 0x74, 0x72, 0x69, 0x6e, 0x67, 0x2e, 0x66, 
+	0x6f, 0x72, 0x6d, 0x61, 0x74, 0x28, 0x27, 0x20, 0x65, 0x72, 0x72, 0x6f, 0x72, 0x3a, 0x20, 0x25, 
+	0x73, 0x3a, 0x25, 0x69, 0x27, 0x2c, 0x20, 0x66, 0x69, 0x6c, 0x65, 0x2c, 0x20, 0x6c, 0x69, 0x6e, 
+	0x65, 0x29, 0xa, 0x9, 0x2d, 0x2d, 0x70, 0x72, 0x69, 0x6e, 0x74, 0x28, 0x64, 0x65, 0x62, 0x75, 
+	0x67, 0x2e, 0x74, 0x72, 0x61, 0x63, 0x65, 0x62, 0x61, 0x63, 0x6b, 0x28, 0x29, 0x29, 0xa, 0x9, 
+	0x65, 0x72, 0x72, 0x6f, 0x72, 0x28, 0x73, 0x61, 0x75, 0x72, 0x75, 0x73, 0x5f, 0x65, 0x72, 0x72, 
+	0x6f, 0x72, 0x29, 0xa, 0x65, 0x6e, 0x64, 0xa, 0xa, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x20, 0x66, 
+	0x75, 0x6e, 0x63, 0x74, 0x69, 0x6f, 0x6e, 0x20, 0x66, 0x75, 0x73, 0x65, 0x28, 0x69, 0x6e, 0x73, 
+	0x74, 0x72, 0x75, 0x63, 0x74, 0x69, 0x6f, 0x6e, 0x73, 0x29, 0xa, 0x9, 0x66, 0x6f, 0x72, 0x20, 
+	0x69, 0x20, 0x3d, 0x20, 0x31, 0x2c, 0x20, 0x23, 0x69, 0x6e, 0x73, 0x74, 0x72, 0x75, 0x63, 0x74, 
+	0x69, 0x6f, 0x6e, 0x73, 0x20, 0x2d, 0x20, 0x31, 0x20, 0x64, 0x6f, 0xa, 0x9, 0x9, 0x6c, 0x6f, 
+	0x63, 0x61, 0x6c, 0x20, 0x70, 0x61, 0x69, 0x72, 0x20, 0x3d, 0x20, 0x73, 0x75, 0x70, 0x65, 0x72, 
+	0x69, 0x6e, 0x73, 0x74, 0x5b, 0x69, 0x6e, 0x73, 0x74, 0x72, 0x75, 0x63, 0x74, 0x69, 0x6f, 0x6e, 
+	0x73, 0x5b, 0x69, 0x5d, 0x5b, 0x31, 0x5d, 0x5d, 0xa, 0x9, 0x9, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 
+	0x20, 0x66, 0x75, 0x73, 0x65, 0x64, 0x20, 0x3d, 0x20, 0x70, 0x61, 0x69, 0x72, 0x20, 0x61, 0x6e, 
+	0x64, 0x20, 0x70, 0x61, 0x69, 0x72, 0x5b, 0x69, 0x6e, 0x73, 0x74, 0x72, 0x75, 0x63, 0x74, 0x69, 
+	0x6f, 0x6e, 0x73, 0x5b, 0x69, 0x20, 0x2b, 0x20, 0x31, 0x5d, 0x5b, 0x31, 0x5d, 0x5d, 0xa, 0x9, 
+	0x9, 0x69, 0x66, 0x20, 0x66, 0x75, 0x73, 0x65, 0x64, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x9, 
+	0x9, 0x9, 0x69, 0x6e, 0x73, 0x74, 0x72, 0x75, 0x63, 0x74, 0x69, 0x6f, 0x6e, 0x73, 0x5b, 0x69, 
+	0x5d, 0x5b, 0x31, 0x5d, 0x20, 0x3d, 0x20, 0x66, 0x75, 0x73, 0x65, 0x64, 0xa, 0x9, 0x9, 0x65, 
+	0x6e, 0x64, 0xa, 0x9, 0x65, 0x6e, 0x64, 0xa, 0x65, 0x6e, 0x64, 0xa, 0xa, 0x66, 0x75, 0x6e, 
+	0x63, 0x74, 0x69, 0x6f, 0x6e, 0x20, 0x61, 0x73, 0x6d, 0x5f, 0x66, 0x75, 0x6e, 0x63, 0x28, 0x61, 
+	0x73, 0x6d, 0x2c, 0x20, 0x62, 0x69, 0x6e, 0x29, 0xa, 0x9, 0x69, 0x66, 0x20, 0x6f, 0x70, 0x74, 
+	0x5f, 0x73, 0x75, 0x70, 0x65, 0x72, 0x69, 0x6e, 0x73, 0x74, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 
+	0x9, 0x9, 0x66, 0x75, 0x73, 0x65, 0x28, 0x61, 0x73, 0x6d, 0x2e, 0x69, 0x6e, 0x73, 0x74, 0x72, 
+	0x75, 0x63, 0x74, 0x69, 0x6f, 0x6e, 0x73, 0x29, 0xa, 0x9, 0x65, 0x6e, 0x64, 0xa, 0xa, 0x9, 
+	0x62, 0x69, 0x6e, 0x3a, 0x77, 0x72, 0x69, 0x74, 0x65, 0x28, 0x77, 0x72, 0x69, 0x74, 0x65, 0x62, 
+	0x69, 0x6e, 0x2e, 0x75, 0x69, 0x6e, 0x74, 0x33, 0x32, 0x28, 0x23, 0x61, 0x73, 0x6d, 0x2e, 0x69, 
+	0x6e, 0x73, 0x74, 0x72, 0x75, 0x63, 0x74, 0x69, 0x6f, 0x6e, 0x73, 0x29, 0x29, 0xa, 0x9, 0x66, 
+	0x6f, 0x72, 0x20, 0x69, 0x2c, 0x76, 0x20, 0x69, 0x6e, 0x20, 0x69, 0x70, 0x61, 0x69, 0x72, 0x73, 
+	0x28, 0x61, 0x73, 0x6d, 0x2e, 0x69, 0x6e, 0x73, 0x74, 0x72, 0x75, 0x63, 0x74, 0x69, 0x6f, 0x6e, 
+	0x73, 0x29, 0x20, 0x64, 0x6f, 0xa, 0x9, 0x9, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x20, 0x69, 0x6e, 
+	0x73, 0x74, 0x20, 0x3d, 0x20, 0x61, 0x73, 0x73, 0x65, 0x72, 0x74, 0x28, 0x69, 0x6e, 0x73, 0x74, 
 	0x72, 0x75, 0x63, 0x74, 0x69, 0x6f, 0x6e, 0x5f, 0x6d, 0x61, 0x74, 0x72, 0x69, 0x78, 0x5b, 0x76, 
-	0x5d, 0x20, 0x3d, 0x20, 0x69, 0x20, 0x2d, 0x20, 0x31, 0xa, 0x65, 0x6e, 0x64, 0xa, 0xa, 0x6c, 
-	0x6f, 0x63, 0x61, 0x6c, 0x20, 0x66, 0x75, 0x6e, 0x63, 0x74, 0x69, 0x6f, 0x6e, 0x20, 0x61, 0x73, 
-	0x6d, 0x5f, 0x65, 0x72, 0x72, 0x6f, 0x72, 0x28, 0x66, 0x69, 0x6c, 0x65, 0x2c, 0x20, 0x6c, 0x69, 
-	0x6e, 0x65, 0x2c, 0x20, 0x2e, 0x2e, 0x2e, 0x29, 0xa, 0x9, 0x73, 0x61, 0x75, 0x72, 0x75, 0x73, 
-	0x5f, 0x65, 0x72, 0x72, 0x6f, 0x72, 0x20, 0x3d, 0x20, 0x73, 0x74, 0x72, 0x69, 0x6e, 0x67, 0x2e, 
-	0x66, 0x6f, 0x72, 0x6d, 0x61, 0x74, 0x28, 0x2e, 0x2e, 0x2e, 0x29, 0x20, 0x2e, 0x2e, 0x20, 0x73, 
-	0x74, 0x72, 0x69, 0x6e, 0x67, 0x2e, 0x66, 0x6f, 0x72, 0x6d, 0x61, 0x74, 0x28, 0x27, 0x20, 0x65, 
-	0x72, 0x72, 0x6f, 0x72, 0x3a, 0x20, 0x25, 0x73, 0x3a, 0x25, 0x69, 0x27, 0x2c, 0x20, 0x66, 0x69, 
-	0x6c, 0x65, 0x2c, 0x20, 0x6c, 0x69, 0x6e, 0x65, 0x29, 0xa, 0x9, 0x2d, 0x2d, 0x70, 0x72, 0x69, 
-	0x6e, 0x74, 0x28, 0x64, 0x65, 0x62, 0x75, 0x67, 0x2e, 0x74, 0x72, 0x61, 0x63, 0x65, 0x62, 0x61, 
-	0x63, 0x6b, 0x28, 0x29, 0x29, 0xa, 0x9, 0x65, 0x72, 0x72, 0x6f, 0x72, 0x28, 0x73, 0x61, 0x75, 
-	0x72, 0x75, 0x73, 0x5f, 0x65, 0x72, 0x72, 0x6f, 0x72, 0x29, 0xa, 0x65, 0x6e, 0x64, 0xa, 0xa, 
-	0x66, 0x75, 0x6e, 0x63, 0x74, 0x69, 0x6f, 0x6e, 0x20, 0x61, 0x73, 0x6d, 0x5f, 0x66, 0x75, 0x6e, 
-	0x63, 0x28, 0x61, 0x73, 0x6d, 0x2c, 0x20, 0x62, 0x69, 0x6e, 0x29, 0xa, 0x9, 0x62, 0x69, 0x6e, 
+	0x5b, 0x31, 0x5d, 0x5d, 0x2c, 0x20, 0x27, 0x49, 0x6e, 0x76, 0x61, 0x6c, 0x69, 0x64, 0x20, 0x69, 
+	0x6e, 0x73, 0x74, 0x72, 0x75, 0x63, 0x74, 0x69, 0x6f, 0x6e, 0x3a, 0x20, 0x27, 0x20, 0x2e, 0x2e, 
+	0x20, 0x76, 0x5b, 0x31, 0x5d, 0x29, 0xa, 0x9, 0x9, 0x76, 0x5b, 0x32, 0x5d, 0x20, 0x3d, 0x20, 
+	0x76, 0x5b, 0x32, 0x5d, 0x20, 0x6f, 0x72, 0x20, 0x30, 0xa, 0x9, 0x9, 0x76, 0x5b, 0x33, 0x5d, 
+	0x20, 0x3d, 0x20, 0x76, 0x5b, 0x33, 0x5d, 0x20, 0x6f, 0x72, 0x20, 0x30, 0xa, 0xa, 0x9, 0x9, 
+	0x69, 0x66, 0x20, 0x76, 0x5b, 0x32, 0x5d, 0x20, 0x3e, 0x20, 0x32, 0x35, 0x35, 0x20, 0x6f, 0x72, 
+	0x20, 0x76, 0x5b, 0x33, 0x5d, 0x20, 0x3e, 0x20, 0x28, 0x32, 0x20, 0x5e, 0x20, 0x31, 0x35, 0x29, 
+	0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x9, 0x9, 0x9, 0x61, 0x73, 0x6d, 0x5f, 0x65, 0x72, 0x72, 
+	0x6f, 0x72, 0x28, 0x61, 0x73, 0x6d, 0x2e, 0x6e, 0x61, 0x6d, 0x65, 0x2c, 0x20, 0x61, 0x73, 0x6d, 
+	0x2e, 0x6c, 0x69, 0x6e, 0x65, 0x6e, 0x72, 0x5b, 0x69, 0x5d, 0x2c, 0x20, 0x22, 0x6f, 0x75, 0x74, 
+	0x20, 0x6f, 0x66, 0x20, 0x72, 0x65, 0x67, 0x69, 0x73, 0x74, 0x65, 0x72, 0x20, 0x73, 0x70, 0x61, 
+	0x63, 0x65, 0x20, 0x28, 0x69, 0x3d, 0x25, 0x73, 0x20, 0x61, 0x3d, 0x25, 0x69, 0x2c, 0x20, 0x62, 
+	0x3d, 0x25, 0x69, 0x29, 0x22, 0x2c, 0x20, 0x76, 0x5b, 0x31, 0x5d, 0x2c, 0x20, 0x76, 0x5b, 0x32, 
+	0x5d, 0x2c, 0x20, 0x76, 0x5b, 0x33, 0x5d, 0x29, 0xa, 0x9, 0x9, 0x65, 0x6e, 0x64, 0xa, 0xa, 
+	0x9, 0x9, 0x62, 0x69, 0x6e, 0x3a, 0x77, 0x72, 0x69, 0x74, 0x65, 0x28, 0x77, 0x72, 0x69, 0x74, 
+	0x65, 0x62, 0x69, 0x6e, 0x2e, 0x75, 0x69, 0x6e, 0x74, 0x38, 0x28, 0x69, 0x6e, 0x73, 0x74, 0x29, 
+	0x29, 0xa, 0x9, 0x9, 0x62, 0x69, 0x6e, 0x3a, 0x77, 0x72, 0x69, 0x74, 0x65, 0x28, 0x77, 0x72, 
+	0x69, 0x74, 0x65, 0x62, 0x69, 0x6e, 0x2e, 0x75, 0x69, 0x6e, 0x74, 0x38, 0x28, 0x76, 0x5b, 0x32, 
+	0x5d, 0x20, 0x6f, 0x72, 0x20, 0x30, 0x29, 0x29, 0xa, 0x9, 0x9, 0x62, 0x69, 0x6e, 0x3a, 0x77, 
+	0x72, 0x69, 0x74, 0x65, 0x28, 0x77, 0x72, 0x69, 0x74, 0x65, 0x62, 0x69, 0x6e, 0x2e, 0x69, 0x6e, 
+	0x74, 0x31, 0x36, 0x28, 0x76, 0x5b, 0x33, 0x5d, 0x20, 0x6f, 0x72, 0x20, 0x30, 0x29, 0x29, 0xa, 
+	0x9, 0x65, 0x6e, 0x64, 0xa, 0xa, 0x9, 0x62, 0x69, 0x6e, 0x3a, 0x77, 0x72, 0x69, 0x74, 0x65, 
+	0x28, 0x77, 0x72, 0x69, 0x74, 0x65, 0x62, 0x69, 0x6e, 0x2e, 0x75, 0x69, 0x6e, 0x74, 0x33, 0x32, 
+	0x28, 0x23, 0x61, 0x73, 0x6d, 0x2e, 0x63, 0x6f, 0x6e, 0x73, 0x74, 0x61, 0x6e, 0x74, 0x73, 0x29, 
+	0x29, 0xa, 0x9, 0x66, 0x6f, 0x72, 0x20, 0x5f, 0x2c, 0x76, 0x20, 0x69, 0x6e, 0x20, 0x69, 0x70, 
+	0x61, 0x69, 0x72, 0x73, 0x28, 0x61, 0x73, 0x6d, 0x2e, 0x63, 0x6f, 0x6e, 0x73, 0x74, 0x61, 0x6e, 
+	0x74, 0x73, 0x29, 0x20, 0x64, 0x6f, 0xa, 0x9, 0x9, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x20, 0x74, 
+	0x20, 0x3d, 0x20, 0x74, 0x79, 0x70, 0x65, 0x28, 0x76, 0x29, 0xa, 0x9, 0x9, 0x69, 0x66, 0x20, 
+	0x74, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x73, 0x74, 0x72, 0x69, 0x6e, 0x67, 0x27, 0x20, 0x74, 0x68, 
+	0x65, 0x6e, 0xa, 0x9, 0x9, 0x9, 0x69, 0x66, 0x20, 0x76, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x6e, 
+	0x69, 0x6c, 0x27, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x9, 0x9, 0x9, 0x9, 0x62, 0x69, 0x6e, 
 	0x3a, 0x77, 0x72, 0x69, 0x74, 0x65, 0x28, 0x77, 0x72, 0x69, 0x74, 0x65, 0x62, 0x69, 0x6e, 0x2e, 
-	0x75, 0x69, 0x6e, 0x74, 0x33, 0x32, 0x28, 0x23, 0x61, 0x73, 0x6d, 0x2e, 0x69, 0x6e, 0x73, 0x74, 
-	0x72, 0x75, 0x63, 0x74, 0x69, 0x6f, 0x6e, 0x73, 0x29, 0x29, 0xa, 0x9, 0x66, 0x6f, 0x72, 0x20, 
-	0x69, 0x2c, 0x76, 0x20, 0x69, 0x6e, 0x20, 0x69, 0x70, 0x61, 0x69, 0x72, 0x73, 0x28, 0x61, 0x73, 
-	0x6d, 0x2e, 0x69, 0x6e, 0x73, 0x74, 0x72, 0x75, 0x63, 0x74, 0x69, 0x6f, 0x6e, 0x73, 0x29, 0x20, 
-	0x64, 0x6f, 0xa, 0x9, 0x9, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x20, 0x69, 0x6e, 0x73, 0x74, 0x20, 
-	0x3d, 0x20, 0x61, 0x73, 0x73, 0x65, 0x72, 0x74, 0x28, 0x69, 0x6e, 0x73, 0x74, 0x72, 0x75, 0x63, 
-	0x74, 0x69, 0x6f, 0x6e, 0x5f, 0x6d, 0x61, 0x74, 0x72, 0x69, 0x78, 0x5b, 0x76, 0x5b, 0x31, 0x5d, 
-	0x5d, 0x2c, 0x20, 0x27, 0x49, 0x6e, 0x76, 0x61, 0x6c, 0x69, 0x64, 0x20, 0x69, 0x6e, 0x73, 0x74, 
-	0x72, 0x75, 0x63, 0x74, 0x69, 0x6f, 0x6e, 0x3a, 0x20, 0x27, 0x20, 0x2e, 0x2e, 0x20, 0x76, 0x5b, 
-	0x31, 0x5d, 0x29, 0xa, 0x9, 0x9, 0x76, 0x5b, 0x32, 0x5d, 0x20, 0x3d, 0x20, 0x76, 0x5b, 0x32, 
-	0x5d, 0x20, 0x6f, 0x72, 0x20, 0x30, 0xa, 0x9, 0x9, 0x76, 0x5b, 0x33, 0x5d, 0x20, 0x3d, 0x20, 
-	0x76, 0x5b, 0x33, 0x5d, 0x20, 0x6f, 0x72, 0x20, 0x30, 0xa, 0xa, 0x9, 0x9, 0x69, 0x66, 0x20, 
-	0x76, 0x5b, 0x32, 0x5d, 0x20, 0x3e, 0x20, 0x32, 0x35, 0x35, 0x20, 0x6f, 0x72, 0x20, 0x76, 0x5b, 
-	0x33, 0x5d, 0x20, 0x3e, 0x20, 0x28, 0x32, 0x20, 0x5e, 0x20, 0x31, 0x35, 0x29, 0x20, 0x74, 0x68, 
-	0x65, 0x6e, 0xa, 0x9, 0x9, 0x9, 0x61, 0x73, 0x6d, 0x5f, 0x65, 0x72, 0x72, 0x6f, 0x72, 0x28, 
-	0x61, 0x73, 0x6d, 0x2e, 0x6e, 0x61, 0x6d, 0x65, 0x2c, 0x20, 0x61, 0x73, 0x6d, 0x2e, 0x6c, 0x69, 
-	0x6e, 0x65, 0x6e, 0x72, 0x5b, 0x69, 0x5d, 0x2c, 0x20, 0x22, 0x6f, 0x75, 0x74, 0x20, 0x6f, 0x66, 
-	0x20, 0x72, 0x65, 0x67, 0x69, 0x73, 0x74, 0x65, 0x72, 0x20, 0x73, 0x70, 0x61, 0x63, 0x65, 0x20, 
-	0x28, 0x69, 0x3d, 0x25, 0x73, 0x20, 0x61, 0x3d, 0x25, 0x69, 0x2c, 0x20, 0x62, 0x3d, 0x25, 0x69, 
-	0x29, 0x22, 0x2c, 0x20, 0x76, 0x5b, 0x31, 0x5d, 0x2c, 0x20, 0x76, 0x5b, 0x32, 0x5d, 0x2c, 0x20, 
-	0x76, 0x5b, 0x33, 0x5d, 0x29, 0xa, 0x9, 0x9, 0x65, 0x6e, 0x64, 0xa, 0xa, 0x9, 0x9, 0x62, 
+	0x75, 0x69, 0x6e, 0x74, 0x38, 0x28, 0x30, 0x29, 0x29, 0xa, 0x9, 0x9, 0x9, 0x65, 0x6c, 0x73, 
+	0x65, 0xa, 0x9, 0x9, 0x9, 0x9, 0x62, 0x69, 0x6e, 0x3a, 0x77, 0x72, 0x69, 0x74, 0x65, 0x28, 
+	0x77, 0x72, 0x69, 0x74, 0x65, 0x62, 0x69, 0x6e, 0x2e, 0x75, 0x69, 0x6e, 0x74, 0x38, 0x28, 0x34, 
+	0x29, 0x29, 0xa, 0x9, 0x9, 0x9, 0x9, 0x62, 0x69, 0x6e, 0x3a, 0x77, 0x72, 0x69, 0x74, 0x65, 
+	0x28, 0x77, 0x72, 0x69, 0x74, 0x65, 0x62, 0x69, 0x6e, 0x2e, 0x73, 0x74, 0x72, 0x69, 0x6e, 0x67, 
+	0x28, 0x76, 0x29, 0x29, 0xa, 0x9, 0x9, 0x9, 0x65, 0x6e, 0x64, 0xa, 0x9, 0x9, 0x65, 0x6c, 
+	0x73, 0x65, 0x69, 0x66, 0x20, 0x74, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x6e, 0x75, 0x6d, 0x62, 0x65, 
+	0x72, 0x27, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x9, 0x9, 0x9, 0x62, 0x69, 0x6e, 0x3a, 0x77, 
+	0x72, 0x69, 0x74, 0x65, 0x28, 0x77, 0x72, 0x69, 0x74, 0x65, 0x62, 0x69, 0x6e, 0x2e, 0x75, 0x69, 
+	0x6e, 0x74, 0x38, 0x28, 0x33, 0x29, 0x29, 0xa, 0x9, 0x9, 0x9, 0x62, 0x69, 0x6e, 0x3a, 0x77, 
+	0x72, 0x69, 0x74, 0x65, 0x28, 0x77, 0x72, 0x69, 0x74, 0x65, 0x62, 0x69, 0x6e, 0x2e, 0x6e, 0x75, 
+	0x6d, 0x62, 0x65, 0x72, 0x28, 0x76, 0x29, 0x29, 0xa, 0x9, 0x9, 0x65, 0x6c, 0x73, 0x65, 0x69, 
+	0x66, 0x20, 0x74, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x62, 0x6f, 0x6f, 0x6c, 0x65, 0x61, 0x6e, 0x27, 
+	0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x9, 0x9, 0x9, 0x62, 0x69, 0x6e, 0x3a, 0x77, 0x72, 0x69, 
+	0x74, 0x65, 0x28, 0x77, 0x72, 0x69, 0x74, 0x65, 0x62, 0x69, 0x6e, 0x2e, 0x75, 0x69, 0x6e, 0x74, 
+	0x38, 0x28, 0x76, 0x20, 0x61, 0x6e, 0x64, 0x20, 0x32, 0x20, 0x6f, 0x72, 0x20, 0x31, 0x29, 0x29, 
+	0xa, 0x9, 0x9, 0x65, 0x6c, 0x73, 0x65, 0xa, 0x9, 0x9, 0x9, 0x65, 0x72, 0x72, 0x6f, 0x72, 
+	0x28, 0x27, 0x49, 0x6e, 0x76, 0x61, 0x6c, 0x69, 0x64, 0x20, 0x74, 0x79, 0x70, 0x65, 0x21, 0x27, 
+	0x29, 0xa, 0x9, 0x9, 0x65, 0x6e, 0x64, 0xa, 0x9, 0x65, 0x6e, 0x64, 0xa, 0xa, 0x9, 0x62, 
 	0x69, 0x6e, 0x3a, 0x77, 0x72, 0x69, 0x74, 0x65, 0x28, 0x77, 0x72, 0x69, 0x74, 0x65, 0x62, 0x69, 
-	0x6e, 0x2e, 0x75, 0x69, 0x6e, 0x74, 0x38, 0x28, 0x69, 0x6e, 0x73, 0x74, 0x29, 0x29, 0xa, 0x9, 
-	0x9, 0x62, 0x69, 0x6e, 0x3a, 0x77, 0x72, 0x69, 0x74, 0x65, 0x28, 0x77, 0x72, 0x69, 0x74, 0x65, 
-	0x62, 0x69, 0x6e, 0x2e, 0x75, 0x69, 0x6e, 0x74, 0x38, 0x28, 0x76, 0x5b, 0x32, 0x5d, 0x20, 0x6f, 
-	0x72, 0x20, 0x30, 0x29, 0x29, 0xa, 0x9, 0x9, 0x62, 0x69, 0x6e, 0x3a, 0x77, 0x72, 0x69, 0x74, 
-	0x65, 0x28, 0x77, 0x72, 0x69, 0x74, 0x65, 0x62, 0x69, 0x6e, 0x2e, 0x69, 0x6e, 0x74, 0x31, 0x36, 
-	0x28, 0x76, 0x5b, 0x33, 0x5d, 0x20, 0x6f, 0x72, 0x20, 0x30, 0x29, 0x29, 0xa, 0x9, 0x65, 0x6e, 
-	0x64, 0xa, 0xa, 0x9, 0x62, 0x69, 0x6e, 0x3a, 0x77, 0x72, 0x69, 0x74, 0x65, 0x28, 0x77, 0x72, 
-	0x69, 0x74, 0x65, 0x62, 0x69, 0x6e, 0x2e, 0x75, 0x69, 0x6e, 0x74, 0x33, 0x32, 0x28, 0x23, 0x61, 
-	0x73, 0x6d, 0x2e, 0x63, 0x6f, 0x6e, 0x73, 0x74, 0x61, 0x6e, 0x74, 0x73, 0x29, 0x29, 0xa, 0x9, 
-	0x66, 0x6f, 0x72, 0x20, 0x5f, 0x2c, 0x76, 0x20, 0x69, 0x6e, 0x20, 0x69, 0x70, 0x61, 0x69, 0x72, 
-	0x73, 0x28, 0x61, 0x73, 0x6d, 0x2e, 0x63, 0x6f, 0x6e, 0x73, 0x74, 0x61, 0x6e, 0x74, 0x73, 0x29, 
-	0x20, 0x64, 0x6f, 0xa, 0x9, 0x9, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x20, 0x74, 0x20, 0x3d, 0x20, 
-	0x74, 0x79, 0x70, 0x65, 0x28, 0x76, 0x29, 0xa, 0x9, 0x9, 0x69, 0x66, 0x20, 0x74, 0x20, 0x3d, 
-	0x3d, 0x20, 0x27, 0x73, 0x74, 0x72, 0x69, 0x6e, 0x67, 0x27, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 
-	0x9, 0x9, 0x9, 0x69, 0x66, 0x20, 0x76, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x6e, 0x69, 0x6c, 0x27, 
-	0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x9, 0x9, 0x9, 0x9, 0x62, 0x69, 0x6e, 0x3a, 0x77, 0x72, 
-	0x69, 0x74, 0x65, 0x28, 0x77, 0x72, 0x69, 0x74, 0x65, 0x62, 0x69, 0x6e, 0x2e, 0x75, 0x69, 0x6e, 
-	0x74, 0x38, 0x28, 0x30, 0x29, 0x29, 0xa, 0x9, 0x9, 0x9, 0x65, 0x6c, 0x73, 0x65, 0xa, 0x9, 
-	0x9, 0x9, 0x9, 0x62, 0x69, 0x6e, 0x3a, 0x77, 0x72, 0x69, 0x74, 0x65, 0x28, 0x77, 0x72, 0x69, 
-	0x74, 0x65, 0x62, 0x69, 0x6e, 0x2e, 0x75, 0x69, 0x6e, 0x74, 0x38, 0x28, 0x34, 0x29, 0x29, 0xa, 
-	0x9, 0x9, 0x9, 0x9, 0x62, 0x69, 0x6e, 0x3a, 0x77, 0x72, 0x69, 0x74, 0x65, 0x28, 0x77, 0x72, 
-	0x69, 0x74, 0x65, 0x62, 0x69, 0x6e, 0x2e, 0x73, 0x74, 0x72, 0x69, 0x6e, 0x67, 0x28, 0x76, 0x29, 
-	0x29, 0xa, 0x9, 0x9, 0x9, 0x65, 0x6e, 0x64, 0xa, 0x9, 0x9, 0x65, 0x6c, 0x73, 0x65, 0x69, 
-	0x66, 0x20, 0x74, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x6e, 0x75, 0x6d, 0x62, 0x65, 0x72, 0x27, 0x20, 
-	0x74, 0x68, 0x65, 0x6e, 0xa, 0x9, 0x9, 0x9, 0x62, 0x69, 0x6e, 0x3a, 0x77, 0x72, 0x69, 0x74, 
-	0x65, 0x28, 0x77, 0x72, 0x69, 0x74, 0x65, 0x62, 0x69, 0x6e, 0x2e, 0x75, 0x69, 0x6e, 0x74, 0x38, 
-	0x28, 0x33, 0x29, 0x29, 0xa, 0x9, 0x9, 0x9, 0x62, 0x69, 0x6e, 0x3a, 0x77, 0x72, 0x69, 0x74, 
-	0x65, 0x28, 0x77, 0x72, 0x69, 0x74, 0x65, 0x62, 0x69, 0x6e, 0x2e, 0x6e, 0x75, 0x6d, 0x62, 0x65, 
-	0x72, 0x28, 0x76, 0x29, 0x29, 0xa, 0x9, 0x9, 0x65, 0x6c, 0x73, 0x65, 0x69, 0x66, 0x20, 0x74, 
-	0x20, 0x3d, 0x3d, 0x20, 0x27, 0x62, 0x6f, 0x6f, 0x6c, 0x65, 0x61, 0x6e, 0x27, 0x20, 0x74, 0x68, 
-	0x65, 0x6e, 0xa, 0x9, 0x9, 0x9, 0x62, 0x69, 0x6e, 0x3a, 0x77, 0x72, 0x69, 0x74, 0x65, 0x28, 
-	0x77, 0x72, 0x69, 0x74, 0x65, 0x62, 0x69, 0x6e, 0x2e, 0x75, 0x69, 0x6e, 0x74, 0x38, 0x28, 0x76, 
-	0x20, 0x61, 0x6e, 0x64, 0x20, 0x32, 0x20, 0x6f, 0x72, 0x20, 0x31, 0x29, 0x29, 0xa, 0x9, 0x9, 
-	0x65, 0x6c, 0x73, 0x65, 0xa, 0x9, 0x9, 0x9, 0x65, 0x72, 0x72, 0x6f, 0x72, 0x28, 0x27, 0x49, 
-	0x6e, 0x76, 0x61, 0x6c, 0x69, 0x64, 0x20, 0x74, 0x79, 0x70, 0x65, 0x21, 0x27, 0x29, 0xa, 0x9, 
-	0x9, 0x65, 0x6e, 0x64, 0xa, 0x9, 0x65, 0x6e, 0x64, 0xa, 0xa, 0x9, 0x62, 0x69, 0x6e, 0x3a, 
+	0x6e, 0x2e, 0x75, 0x69, 0x6e, 0x74, 0x33, 0x32, 0x28, 0x23, 0x61, 0x73, 0x6d, 0x2e, 0x75, 0x70, 
+	0x29, 0x29, 0xa, 0x9, 0x66, 0x6f, 0x72, 0x20, 0x5f, 0x2c, 0x76, 0x20, 0x69, 0x6e, 0x20, 0x69, 
+	0x70, 0x61, 0x69, 0x72, 0x73, 0x28, 0x61, 0x73, 0x6d, 0x2e, 0x75, 0x70, 0x29, 0x20, 0x64, 0x6f, 
+	0xa, 0x9, 0x9, 0x62, 0x69, 0x6e, 0x3a, 0x77, 0x72, 0x69, 0x74, 0x65, 0x28, 0x77, 0x72, 0x69, 
+	0x74, 0x65, 0x62, 0x69, 0x6e, 0x2e, 0x75, 0x69, 0x6e, 0x74, 0x31, 0x36, 0x28, 0x76, 0x5b, 0x31, 
+	0x5d, 0x29, 0x29, 0xa, 0x9, 0x9, 0x62, 0x69, 0x6e, 0x3a, 0x77, 0x72, 0x69, 0x74, 0x65, 0x28, 
+	0x77, 0x72, 0x69, 0x74, 0x65, 0x62, 0x69, 0x6e, 0x2e, 0x75, 0x69, 0x6e, 0x74, 0x31, 0x36, 0x28, 
+	0x76, 0x5b, 0x32, 0x5d, 0x29, 0x29, 0xa, 0x9, 0x65, 0x6e, 0x64, 0xa, 0xa, 0x9, 0x62, 0x69, 
+	0x6e, 0x3a, 0x77, 0x72, 0x69, 0x74, 0x65, 0x28, 0x77, 0x72, 0x69, 0x74, 0x65, 0x62, 0x69, 0x6e, 
+	0x2e, 0x75, 0x69, 0x6e, 0x74, 0x33, 0x32, 0x28, 0x23, 0x61, 0x73, 0x6d, 0x2e, 0x70, 0x72, 0x6f, 
+	0x74, 0x6f, 0x74, 0x79, 0x70, 0x65, 0x73, 0x29, 0x29, 0xa, 0x9, 0x66, 0x6f, 0x72, 0x20, 0x5f, 
+	0x2c, 0x76, 0x20, 0x69, 0x6e, 0x20, 0x69, 0x70, 0x61, 0x69, 0x72, 0x73, 0x28, 0x61, 0x73, 0x6d, 
+	0x2e, 0x70, 0x72, 0x6f, 0x74, 0x6f, 0x74, 0x79, 0x70, 0x65, 0x73, 0x29, 0x20, 0x64, 0x6f, 0xa, 
+	0x9, 0x9, 0x61, 0x73, 0x6d, 0x5f, 0x66, 0x75, 0x6e, 0x63, 0x28, 0x76, 0x2c, 0x20, 0x62, 0x69, 
+	0x6e, 0x29, 0xa, 0x9, 0x65, 0x6e, 0x64, 0xa, 0xa, 0x9, 0x62, 0x69, 0x6e, 0x3a, 0x77, 0x72, 
+	0x69, 0x74, 0x65, 0x28, 0x77, 0x72, 0x69, 0x74, 0x65, 0x62, 0x69, 0x6e, 0x2e, 0x73, 0x74, 0x72, 
+	0x69, 0x6e, 0x67, 0x28, 0x61, 0x73, 0x6d, 0x2e, 0x6e, 0x61, 0x6d, 0x65, 0x29, 0x29, 0xa, 0x9, 
+	0x62, 0x69, 0x6e, 0x3a, 0x77, 0x72, 0x69, 0x74, 0x65, 0x28, 0x77, 0x72, 0x69, 0x74, 0x65, 0x62, 
+	0x69, 0x6e, 0x2e, 0x75, 0x69, 0x6e, 0x74, 0x33, 0x32, 0x28, 0x23, 0x61, 0x73, 0x6d, 0x2e, 0x6c, 
+	0x69, 0x6e, 0x65, 0x6e, 0x72, 0x29, 0x29, 0xa, 0x9, 0x66, 0x6f, 0x72, 0x20, 0x5f, 0x2c, 0x76, 
+	0x20, 0x69, 0x6e, 0x20, 0x69, 0x70, 0x61, 0x69, 0x72, 0x73, 0x28, 0x61, 0x73, 0x6d, 0x2e, 0x6c, 
+	0x69, 0x6e, 0x65, 0x6e, 0x72, 0x29, 0x20, 0x64, 0x6f, 0xa, 0x9, 0x9, 0x62, 0x69, 0x6e, 0x3a, 
 	0x77, 0x72, 0x69, 0x74, 0x65, 0x28, 0x77, 0x72, 0x69, 0x74, 0x65, 0x62, 0x69, 0x6e, 0x2e, 0x75, 
-	0x69, 0x6e, 0x74, 0x33, 0x32, 0x28, 0x23, 0x61, 0x73, 0x6d, 0x2e, 0x75, 0x70, 0x29, 0x29, 0xa, 
+	0x69, 0x6e, 0x74, 0x33, 0x32, 0x28, 0x76, 0x29, 0x29, 0xa, 0x9, 0x65, 0x6e, 0x64, 0xa, 0x65, 
+	0x6e, 0x64, 0xa, 0xa, 0x66, 0x75, 0x6e, 0x63, 0x74, 0x69, 0x6f, 0x6e, 0x20, 0x61, 0x73, 0x73, 
+	0x65, 0x6d, 0x62, 0x6c, 0x65, 0x28, 0x61, 0x73, 0x6d, 0x2c, 0x20, 0x64, 0x65, 0x73, 0x74, 0x29, 
+	0xa, 0x9, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x20, 0x62, 0x69, 0x6e, 0x20, 0x3d, 0x20, 0x7b, 0xa, 
+	0x9, 0x9, 0x64, 0x61, 0x74, 0x61, 0x20, 0x3d, 0x20, 0x27, 0x27, 0x2c, 0xa, 0x9, 0x9, 0x77, 
+	0x72, 0x69, 0x74, 0x65, 0x20, 0x3d, 0x20, 0x66, 0x75, 0x6e, 0x63, 0x74, 0x69, 0x6f, 0x6e, 0x28, 
+	0x73, 0x65, 0x6c, 0x66, 0x2c, 0x20, 0x73, 0x74, 0x72, 0x29, 0xa, 0x9, 0x9, 0x9, 0x73, 0x65, 
+	0x6c, 0x66, 0x2e, 0x64, 0x61, 0x74, 0x61, 0x20, 0x3d, 0x20, 0x73, 0x65, 0x6c, 0x66, 0x2e, 0x64, 
+	0x61, 0x74, 0x61, 0x20, 0x2e, 0x2e, 0x20, 0x73, 0x74, 0x72, 0xa, 0x9, 0x9, 0x65, 0x6e, 0x64, 
+	0xa, 0x9, 0x7d, 0xa, 0xa, 0x9, 0x62, 0x69, 0x6e, 0x3a, 0x77, 0x72, 0x69, 0x74, 0x65, 0x28, 
+	0x77, 0x72, 0x69, 0x74, 0x65, 0x62, 0x69, 0x6e, 0x2e, 0x68, 0x65, 0x61, 0x64, 0x65, 0x72, 0x28, 
+	0x53, 0x41, 0x55, 0x52, 0x55, 0x53, 0x5f, 0x56, 0x45, 0x52, 0x53, 0x49, 0x4f, 0x4e, 0x5b, 0x31, 
+	0x5d, 0x2c, 0x20, 0x53, 0x41, 0x55, 0x52, 0x55, 0x53, 0x5f, 0x56, 0x45, 0x52, 0x53, 0x49, 0x4f, 
+	0x4e, 0x5b, 0x32, 0x5d, 0x2c, 0x20, 0x48, 0x45, 0x41, 0x44, 0x45, 0x52, 0x5f, 0x4f, 0x50, 0x45, 
+	0x52, 0x41, 0x4e, 0x44, 0x53, 0x20, 0x2b, 0x20, 0x48, 0x45, 0x41, 0x44, 0x45, 0x52, 0x5f, 0x53, 
+	0x55, 0x50, 0x45, 0x52, 0x49, 0x4e, 0x53, 0x54, 0x29, 0x29, 0xa, 0x9, 0x61, 0x73, 0x6d, 0x5f, 
+	0x66, 0x75, 0x6e, 0x63, 0x28, 0x61, 0x73, 0x6d, 0x2c, 0x20, 0x62, 0x69, 0x6e, 0x29, 0xa, 0x9, 
+	0x72, 0x65, 0x74, 0x75, 0x72, 0x6e, 0x20, 0x62, 0x69, 0x6e, 0x2e, 0x64, 0x61, 0x74, 0x61, 0xa, 
+	0x65, 0x6e, 0x64, 0xa, 0xa, 0x65, 0x6e, 0x64, 0xa, 0xa, 0xa, 0x64, 0x6f, 0xa, 0x2d, 0x2d, 
+	0x20, 0x53, 0x20, 0x41, 0x20, 0x55, 0x20, 0x52, 0x20, 0x55, 0x20, 0x53, 0xa, 0x2d, 0x2d, 0x20, 
+	0x43, 0x6f, 0x70, 0x79, 0x72, 0x69, 0x67, 0x68, 0x74, 0x20, 0x28, 0x63, 0x29, 0x20, 0x32, 0x30, 
+	0x30, 0x39, 0x2d, 0x32, 0x30, 0x31, 0x35, 0x20, 0x41, 0x6e, 0x64, 0x72, 0x65, 0x61, 0x73, 0x20, 
+	0x54, 0x20, 0x4a, 0x6f, 0x6e, 0x73, 0x73, 0x6f, 0x6e, 0x20, 0x3c, 0x61, 0x6e, 0x64, 0x72, 0x65, 
+	0x61, 0x73, 0x40, 0x73, 0x61, 0x75, 0x72, 0x75, 0x73, 0x2e, 0x6f, 0x72, 0x67, 0x3e, 0xa, 0x2d, 
+	0x2d, 0xa, 0x2d, 0x2d, 0x20, 0x54, 0x68, 0x69, 0x73, 0x20, 0x53, 0x6f, 0x75, 0x72, 0x63, 0x65, 
+	0x20, 0x43, 0x6f, 0x64, 0x65, 0x20, 0x46, 0x6f, 0x72, 0x6d, 0x20, 0x69, 0x73, 0x20, 0x73, 0x75, 
+	0x62, 0x6a, 0x65, 0x63, 0x74, 0x20, 0x74, 0x6f, 0x20, 0x74, 0x68, 0x65, 0x20, 0x74, 0x65, 0x72, 
+	0x6d, 0x73, 0x20, 0x6f, 0x66, 0x20, 0x74, 0x68, 0x65, 0x20, 0x4d, 0x6f, 0x7a, 0x69, 0x6c, 0x6c, 
+	0x61, 0x20, 0x50, 0x75, 0x62, 0x6c, 0x69, 0x63, 0xa, 0x2d, 0x2d, 0x20, 0x4c, 0x69, 0x63, 0x65, 
+	0x6e, 0x73, 0x65, 0x2c, 0x20, 0x76, 0x2e, 0x20, 0x32, 0x2e, 0x30, 0x2e, 0x20, 0x49, 0x66, 0x20, 
+	0x61, 0x20, 0x63, 0x6f, 0x70, 0x79, 0x20, 0x6f, 0x66, 0x20, 0x74, 0x68, 0x65, 0x20, 0x4d, 0x50, 
+	0x4c, 0x20, 0x77, 0x61, 0x73, 0x20, 0x6e, 0x6f, 0x74, 0x20, 0x64, 0x69, 0x73, 0x74, 0x72, 0x69, 
+	0x62, 0x75, 0x74, 0x65, 0x64, 0x20, 0x77, 0x69, 0x74, 0x68, 0x20, 0x74, 0x68, 0x69, 0x73, 0xa, 
+	0x2d, 0x2d, 0x20, 0x66, 0x69, 0x6c, 0x65, 0x2c, 0x20, 0x59, 0x6f, 0x75, 0x20, 0x63, 0x61, 0x6e, 
+	0x20, 0x6f, 0x62, 0x74, 0x61, 0x69, 0x6e, 0x20, 0x6f, 0x6e, 0x65, 0x20, 0x61, 0x74, 0x20, 0x68, 
+	0x74, 0x74, 0x70, 0x3a, 0x2f, 0x2f, 0x6d, 0x6f, 0x7a, 0x69, 0x6c, 0x6c, 0x61, 0x2e, 0x6f, 0x72, 
+	0x67, 0x2f, 0x4d, 0x50, 0x4c, 0x2f, 0x32, 0x2e, 0x30, 0x2f, 0x2e, 0xa, 0xa, 0x2d, 0x2d, 0x20, 
+	0x50, 0x72, 0x6f, 0x66, 0x69, 0x6c, 0x65, 0x20, 0x67, 0x75, 0x69, 0x64, 0x65, 0x64, 0x20, 0x73, 
+	0x70, 0x65, 0x63, 0x69, 0x61, 0x6c, 0x69, 0x73, 0x61, 0x74, 0x69, 0x6f, 0x6e, 0x2e, 0x20, 0x53, 
+	0x55, 0x5f, 0x4f, 0x50, 0x54, 0x5f, 0x50, 0x52, 0x4f, 0x46, 0x49, 0x4c, 0x45, 0x20, 0x6e, 0x61, 
+	0x6d, 0x65, 0x73, 0x20, 0x61, 0x20, 0x70, 0x72, 0x6f, 0x66, 0x69, 0x6c, 0x65, 0x20, 0x77, 0x72, 
+	0x69, 0x74, 0x74, 0x65, 0x6e, 0x20, 0x62, 0x79, 0xa, 0x2d, 0x2d, 0x20, 0x61, 0x20, 0x56, 0x4d, 
+	0x20, 0x62, 0x75, 0x69, 0x6c, 0x74, 0x20, 0x77, 0x69, 0x74, 0x68, 0x20, 0x53, 0x55, 0x5f, 0x4f, 
+	0x50, 0x54, 0x5f, 0x50, 0x52, 0x4f, 0x46, 0x49, 0x4c, 0x45, 0x20, 0x28, 0x73, 0x75, 0x5f, 0x70, 
+	0x72, 0x6f, 0x66, 0x69, 0x6c, 0x65, 0x2c, 0x20, 0x6f, 0x72, 0x20, 0x53, 0x55, 0x5f, 0x50, 0x52, 
+	0x4f, 0x46, 0x49, 0x4c, 0x45, 0x3d, 0x3c, 0x66, 0x69, 0x6c, 0x65, 0x3e, 0x20, 0x77, 0x69, 0x74, 
+	0x68, 0x20, 0x74, 0x68, 0x65, 0xa, 0x2d, 0x2d, 0x20, 0x52, 0x45, 0x50, 0x4c, 0x29, 0x2e, 0x20, 
+	0x45, 0x61, 0x63, 0x68, 0x20, 0x6c, 0x69, 0x6e, 0x65, 0x20, 0x69, 0x73, 0xa, 0x2d, 0x2d, 0xa, 
+	0x2d, 0x2d, 0x20, 0x20, 0x20, 0x3c, 0x66, 0x69, 0x6c, 0x65, 0x3e, 0x20, 0x3c, 0x70, 0x72, 0x6f, 
+	0x74, 0x6f, 0x74, 0x79, 0x70, 0x65, 0x3e, 0x20, 0x3c, 0x70, 0x63, 0x3e, 0x20, 0x3c, 0x6f, 0x70, 
+	0x63, 0x6f, 0x64, 0x65, 0x3e, 0x20, 0x3c, 0x74, 0x79, 0x70, 0x65, 0x73, 0x3e, 0x20, 0x5b, 0x3c, 
+	0x63, 0x61, 0x6c, 0x6c, 0x65, 0x65, 0x20, 0x70, 0x72, 0x6f, 0x74, 0x6f, 0x74, 0x79, 0x70, 0x65, 
+	0x3e, 0x5d, 0xa, 0x2d, 0x2d, 0xa, 0x2d, 0x2d, 0x20, 0x73, 0x65, 0x70, 0x61, 0x72, 0x61, 0x74, 
+	0x65, 0x64, 0x20, 0x62, 0x79, 0x20, 0x74, 0x61, 0x62, 0x73, 0x2c, 0x20, 0x77, 0x68, 0x65, 0x72, 
+	0x65, 0x20, 0x70, 0x72, 0x6f, 0x74, 0x6f, 0x74, 0x79, 0x70, 0x65, 0x73, 0x20, 0x61, 0x72, 0x65, 
+	0x20, 0x6e, 0x75, 0x6d, 0x62, 0x65, 0x72, 0x65, 0x64, 0x20, 0x64, 0x65, 0x70, 0x74, 0x68, 0x20, 
+	0x66, 0x69, 0x72, 0x73, 0x74, 0x20, 0x66, 0x72, 0x6f, 0x6d, 0x20, 0x74, 0x68, 0x65, 0x20, 0x74, 
+	0x6f, 0x70, 0xa, 0x2d, 0x2d, 0x20, 0x6c, 0x65, 0x76, 0x65, 0x6c, 0x20, 0x63, 0x68, 0x75, 0x6e, 
+	0x6b, 0x2e, 0x20, 0x53, 0x69, 0x74, 0x65, 0x73, 0x20, 0x74, 0x68, 0x61, 0x74, 0x20, 0x6f, 0x6e, 
+	0x6c, 0x79, 0x20, 0x65, 0x76, 0x65, 0x72, 0x20, 0x73, 0x61, 0x77, 0x20, 0x6e, 0x75, 0x6d, 0x62, 
+	0x65, 0x72, 0x73, 0x20, 0x67, 0x65, 0x74, 0x20, 0x74, 0x68, 0x65, 0x20, 0x71, 0x75, 0x69, 0x63, 
+	0x6b, 0x65, 0x6e, 0x65, 0x64, 0x20, 0x6f, 0x70, 0x63, 0x6f, 0x64, 0x65, 0x20, 0x75, 0x70, 0xa, 
+	0x2d, 0x2d, 0x20, 0x66, 0x72, 0x6f, 0x6e, 0x74, 0x2e, 0x20, 0x41, 0x20, 0x73, 0x69, 0x74, 0x65, 
+	0x20, 0x69, 0x73, 0x20, 0x6f, 0x6e, 0x6c, 0x79, 0x20, 0x74, 0x6f, 0x75, 0x63, 0x68, 0x65, 0x64, 
+	0x20, 0x69, 0x66, 0x20, 0x69, 0x74, 0x73, 0x20, 0x6f, 0x70, 0x63, 0x6f, 0x64, 0x65, 0x20, 0x73, 
+	0x74, 0x69, 0x6c, 0x6c, 0x20, 0x6d, 0x61, 0x74, 0x63, 0x68, 0x65, 0x73, 0x2c, 0x20, 0x73, 0x6f, 
+	0x20, 0x61, 0x20, 0x73, 0x74, 0x61, 0x6c, 0x65, 0xa, 0x2d, 0x2d, 0x20, 0x70, 0x72, 0x6f, 0x66, 
+	0x69, 0x6c, 0x65, 0x20, 0x69, 0x73, 0x20, 0x68, 0x61, 0x72, 0x6d, 0x6c, 0x65, 0x73, 0x73, 0x2e, 
+	0xa, 0xa, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x20, 0x6f, 0x70, 0x74, 0x5f, 0x70, 0x72, 0x6f, 0x66, 
+	0x69, 0x6c, 0x65, 0x20, 0x3d, 0x20, 0x6f, 0x73, 0x2e, 0x67, 0x65, 0x74, 0x65, 0x6e, 0x76, 0x28, 
+	0x27, 0x53, 0x55, 0x5f, 0x4f, 0x50, 0x54, 0x5f, 0x50, 0x52, 0x4f, 0x46, 0x49, 0x4c, 0x45, 0x27, 
+	0x29, 0xa, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x20, 0x6c, 0x6f, 0x61, 0x64, 0x65, 0x64, 0xa, 0xa, 
+	0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x20, 0x71, 0x75, 0x69, 0x63, 0x6b, 0x65, 0x6e, 0x65, 0x64, 0x20, 
+	0x3d, 0x20, 0x7b, 0xa, 0x9, 0x41, 0x44, 0x44, 0x20, 0x3d, 0x20, 0x27, 0x41, 0x44, 0x44, 0x5f, 
+	0x4e, 0x4e, 0x27, 0x2c, 0xa, 0x9, 0x53, 0x55, 0x42, 0x20, 0x3d, 0x20, 0x27, 0x53, 0x55, 0x42, 
+	0x5f, 0x4e, 0x4e, 0x27, 0x2c, 0xa, 0x9, 0x4d, 0x55, 0x4c, 0x20, 0x3d, 0x20, 0x27, 0x4d, 0x55, 
+	0x4c, 0x5f, 0x4e, 0x4e, 0x27, 0x2c, 0xa, 0x9, 0x4c, 0x45, 0x53, 0x53, 0x20, 0x3d, 0x20, 0x27, 
+	0x4c, 0x45, 0x53, 0x53, 0x5f, 0x4e, 0x4e, 0x27, 0x2c, 0xa, 0x9, 0x4c, 0x45, 0x51, 0x55, 0x41, 
+	0x4c, 0x20, 0x3d, 0x20, 0x27, 0x4c, 0x45, 0x51, 0x55, 0x41, 0x4c, 0x5f, 0x4e, 0x4e, 0x27, 0xa, 
+	0x7d, 0xa, 0xa, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x20, 0x66, 0x75, 0x6e, 0x63, 0x74, 0x69, 0x6f, 
+	0x6e, 0x20, 0x6c, 0x6f, 0x61, 0x64, 0x5f, 0x70, 0x72, 0x6f, 0x66, 0x69, 0x6c, 0x65, 0x28, 0x70, 
+	0x61, 0x74, 0x68, 0x29, 0xa, 0x9, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x20, 0x66, 0x70, 0x20, 0x3d, 
+	0x20, 0x69, 0x6f, 0x2e, 0x6f, 0x70, 0x65, 0x6e, 0x28, 0x70, 0x61, 0x74, 0x68, 0x2c, 0x20, 0x27, 
+	0x72, 0x62, 0x27, 0x29, 0xa, 0x9, 0x69, 0x66, 0x20, 0x6e, 0x6f, 0x74, 0x20, 0x66, 0x70, 0x20, 
+	0x74, 0x68, 0x65, 0x6e, 0xa, 0x9, 0x9, 0x73, 0x61, 0x75, 0x72, 0x75, 0x73, 0x5f, 0x65, 0x72, 
+	0x72, 0x6f, 0x72, 0x20, 0x3d, 0x20, 0x27, 0x43, 0x6f, 0x75, 0x6c, 0x64, 0x20, 0x6e, 0x6f, 0x74, 
+	0x20, 0x6f, 0x70, 0x65, 0x6e, 0x20, 0x70, 0x72, 0x6f, 0x66, 0x69, 0x6c, 0x65, 0x3a, 0x20, 0x27, 
+	0x20, 0x2e, 0x2e, 0x20, 0x70, 0x61, 0x74, 0x68, 0xa, 0x9, 0x9, 0x65, 0x72, 0x72, 0x6f, 0x72, 
+	0x28, 0x73, 0x61, 0x75, 0x72, 0x75, 0x73, 0x5f, 0x65, 0x72, 0x72, 0x6f, 0x72, 0x29, 0xa, 0x9, 
+	0x65, 0x6e, 0x64, 0xa, 0xa, 0x9, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x20, 0x73, 0x69, 0x74, 0x65, 
+	0x73, 0x20, 0x3d, 0x20, 0x7b, 0x7d, 0xa, 0x9, 0x66, 0x6f, 0x72, 0x20, 0x6c, 0x69, 0x6e, 0x65, 
+	0x20, 0x69, 0x6e, 0x20, 0x66, 0x70, 0x3a, 0x6c, 0x69, 0x6e, 0x65, 0x73, 0x28, 0x29, 0x20, 0x64, 
+	0x6f, 0xa, 0x9, 0x9, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x20, 0x66, 0x69, 0x6c, 0x65, 0x2c, 0x20, 
+	0x70, 0x72, 0x6f, 0x74, 0x2c, 0x20, 0x70, 0x63, 0x2c, 0x20, 0x6f, 0x70, 0x2c, 0x20, 0x74, 0x79, 
+	0x70, 0x65, 0x73, 0x20, 0x3d, 0x20, 0x73, 0x74, 0x72, 0x69, 0x6e, 0x67, 0x2e, 0x6d, 0x61, 0x74, 
+	0x63, 0x68, 0x28, 0x6c, 0x69, 0x6e, 0x65, 0x2c, 0x20, 0x27, 0x5e, 0x28, 0x2e, 0x2d, 0x29, 0x5c, 
+	0x74, 0x28, 0x25, 0x64, 0x2b, 0x29, 0x5c, 0x74, 0x28, 0x25, 0x64, 0x2b, 0x29, 0x5c, 0x74, 0x28, 
+	0x25, 0x53, 0x2b, 0x29, 0x5c, 0x74, 0x28, 0x5b, 0x5e, 0x5c, 0x74, 0x5d, 0x2a, 0x29, 0x27, 0x29, 
+	0xa, 0x9, 0x9, 0x69, 0x66, 0x20, 0x66, 0x69, 0x6c, 0x65, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 
+	0x9, 0x9, 0x9, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x20, 0x6b, 0x65, 0x79, 0x20, 0x3d, 0x20, 0x73, 
+	0x74, 0x72, 0x69, 0x6e, 0x67, 0x2e, 0x66, 0x6f, 0x72, 0x6d, 0x61, 0x74, 0x28, 0x27, 0x25, 0x73, 
+	0x5c, 0x74, 0x25, 0x73, 0x5c, 0x74, 0x25, 0x73, 0x27, 0x2c, 0x20, 0x66, 0x69, 0x6c, 0x65, 0x2c, 
+	0x20, 0x70, 0x72, 0x6f, 0x74, 0x2c, 0x20, 0x70, 0x63, 0x29, 0xa, 0x9, 0x9, 0x9, 0x73, 0x69, 
+	0x74, 0x65, 0x73, 0x5b, 0x6b, 0x65, 0x79, 0x5d, 0x20, 0x3d, 0x20, 0x7b, 0x6f, 0x70, 0x20, 0x3d, 
+	0x20, 0x6f, 0x70, 0x2c, 0x20, 0x74, 0x79, 0x70, 0x65, 0x73, 0x20, 0x3d, 0x20, 0x74, 0x79, 0x70, 
+	0x65, 0x73, 0x7d, 0xa, 0x9, 0x9, 0x65, 0x6e, 0x64, 0xa, 0x9, 0x65, 0x6e, 0x64, 0xa, 0x9, 
+	0x66, 0x70, 0x3a, 0x63, 0x6c, 0x6f, 0x73, 0x65, 0x28, 0x29, 0xa, 0x9, 0x72, 0x65, 0x74, 0x75, 
+	0x72, 0x6e, 0x20, 0x73, 0x69, 0x74, 0x65, 0x73, 0xa, 0x65, 0x6e, 0x64, 0xa, 0xa, 0x6c, 0x6f, 
+	0x63, 0x61, 0x6c, 0x20, 0x66, 0x75, 0x6e, 0x63, 0x74, 0x69, 0x6f, 0x6e, 0x20, 0x73, 0x70, 0x65, 
+	0x63, 0x69, 0x61, 0x6c, 0x69, 0x73, 0x65, 0x28, 0x61, 0x73, 0x6d, 0x2c, 0x20, 0x73, 0x69, 0x74, 
+	0x65, 0x73, 0x2c, 0x20, 0x69, 0x6e, 0x64, 0x65, 0x78, 0x29, 0xa, 0x9, 0x6c, 0x6f, 0x63, 0x61, 
+	0x6c, 0x20, 0x70, 0x72, 0x6f, 0x74, 0x20, 0x3d, 0x20, 0x69, 0x6e, 0x64, 0x65, 0x78, 0xa, 0x9, 
+	0x66, 0x6f, 0x72, 0x20, 0x70, 0x63, 0x2c, 0x76, 0x20, 0x69, 0x6e, 0x20, 0x69, 0x70, 0x61, 0x69, 
+	0x72, 0x73, 0x28, 0x61, 0x73, 0x6d, 0x2e, 0x69, 0x6e, 0x73, 0x74, 0x72, 0x75, 0x63, 0x74, 0x69, 
+	0x6f, 0x6e, 0x73, 0x29, 0x20, 0x64, 0x6f, 0xa, 0x9, 0x9, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x20, 
+	0x73, 0x69, 0x74, 0x65, 0x20, 0x3d, 0x20, 0x73, 0x69, 0x74, 0x65, 0x73, 0x5b, 0x73, 0x74, 0x72, 
+	0x69, 0x6e, 0x67, 0x2e, 0x66, 0x6f, 0x72, 0x6d, 0x61, 0x74, 0x28, 0x27, 0x25, 0x73, 0x5c, 0x74, 
+	0x25, 0x69, 0x5c, 0x74, 0x25, 0x69, 0x27, 0x2c, 0x20, 0x61, 0x73, 0x6d, 0x2e, 0x6e, 0x61, 0x6d, 
+	0x65, 0x2c, 0x20, 0x70, 0x72, 0x6f, 0x74, 0x2c, 0x20, 0x70, 0x63, 0x20, 0x2d, 0x20, 0x31, 0x29, 
+	0x5d, 0xa, 0x9, 0x9, 0x69, 0x66, 0x20, 0x73, 0x69, 0x74, 0x65, 0x20, 0x61, 0x6e, 0x64, 0x20, 
+	0x73, 0x69, 0x74, 0x65, 0x2e, 0x6f, 0x70, 0x20, 0x3d, 0x3d, 0x20, 0x76, 0x5b, 0x31, 0x5d, 0x20, 
+	0x61, 0x6e, 0x64, 0x20, 0x73, 0x69, 0x74, 0x65, 0x2e, 0x74, 0x79, 0x70, 0x65, 0x73, 0x20, 0x3d, 
+	0x3d, 0x20, 0x27, 0x6e, 0x75, 0x6d, 0x62, 0x65, 0x72, 0x27, 0x20, 0x61, 0x6e, 0x64, 0x20, 0x71, 
+	0x75, 0x69, 0x63, 0x6b, 0x65, 0x6e, 0x65, 0x64, 0x5b, 0x76, 0x5b, 0x31, 0x5d, 0x5d, 0x20, 0x74, 
+	0x68, 0x65, 0x6e, 0xa, 0x9, 0x9, 0x9, 0x76, 0x5b, 0x31, 0x5d, 0x20, 0x3d, 0x20, 0x71, 0x75, 
+	0x69, 0x63, 0x6b, 0x65, 0x6e, 0x65, 0x64, 0x5b, 0x76, 0x5b, 0x31, 0x5d, 0x5d, 0xa, 0x9, 0x9, 
+	0x65, 0x6e, 0x64, 0xa, 0x9, 0x65, 0x6e, 0x64, 0xa, 0x9, 0x66, 0x6f, 0x72, 0x20, 0x5f, 0x2c, 
+	0x76, 0x20, 0x69, 0x6e, 0x20, 0x69, 0x70, 0x61, 0x69, 0x72, 0x73, 0x28, 0x61, 0x73, 0x6d, 0x2e, 
+	0x70, 0x72, 0x6f, 0x74, 0x6f, 0x74, 0x79, 0x70, 0x65, 0x73, 0x29, 0x20, 0x64, 0x6f, 0xa, 0x9, 
+	0x9, 0x69, 0x6e, 0x64, 0x65, 0x78, 0x20, 0x3d, 0x20, 0x73, 0x70, 0x65, 0x63, 0x69, 0x61, 0x6c, 
+	0x69, 0x73, 0x65, 0x28, 0x76, 0x2c, 0x20, 0x73, 0x69, 0x74, 0x65, 0x73, 0x2c, 0x20, 0x69, 0x6e, 
+	0x64, 0x65, 0x78, 0x20, 0x2b, 0x20, 0x31, 0x29, 0xa, 0x9, 0x65, 0x6e, 0x64, 0xa, 0x9, 0x72, 
+	0x65, 0x74, 0x75, 0x72, 0x6e, 0x20, 0x69, 0x6e, 0x64, 0x65, 0x78, 0xa, 0x65, 0x6e, 0x64, 0xa, 
+	0xa, 0x66, 0x75, 0x6e, 0x63, 0x74, 0x69, 0x6f, 0x6e, 0x20, 0x70, 0x72, 0x6f, 0x66, 0x69, 0x6c, 
+	0x65, 0x28, 0x61, 0x73, 0x6d, 0x29, 0xa, 0x9, 0x69, 0x66, 0x20, 0x6f, 0x70, 0x74, 0x5f, 0x70, 
+	0x72, 0x6f, 0x66, 0x69, 0x6c, 0x65, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x9, 0x9, 0x6c, 0x6f, 
+	0x61, 0x64, 0x65, 0x64, 0x20, 0x3d, 0x20, 0x6c, 0x6f, 0x61, 0x64, 0x65, 0x64, 0x20, 0x6f, 0x72, 
+	0x20, 0x6c, 0x6f, 0x61, 0x64, 0x5f, 0x70, 0x72, 0x6f, 0x66, 0x69, 0x6c, 0x65, 0x28, 0x6f, 0x70, 
+	0x74, 0x5f, 0x70, 0x72, 0x6f, 0x66, 0x69, 0x6c, 0x65, 0x29, 0xa, 0x9, 0x9, 0x73, 0x70, 0x65, 
+	0x63, 0x69, 0x61, 0x6c, 0x69, 0x73, 0x65, 0x28, 0x61, 0x73, 0x6d, 0x2c, 0x20, 0x6c, 0x6f, 0x61, 
+	0x64, 0x65, 0x64, 0x2c, 0x20, 0x30, 0x29, 0xa, 0x9, 0x65, 0x6e, 0x64, 0xa, 0x65, 0x6e, 0x64, 
+	0xa, 0xa, 0x65, 0x6e, 0x64, 0xa, 0xa, 0xa, 0x64, 0x6f, 0xa, 0x2d, 0x2d, 0x20, 0x53, 0x20, 
+	0x41, 0x20, 0x55, 0x20, 0x52, 0x20, 0x55, 0x20, 0x53, 0xa, 0x2d, 0x2d, 0x20, 0x43, 0x6f, 0x70, 
+	0x79, 0x72, 0x69, 0x67, 0x68, 0x74, 0x20, 0x28, 0x63, 0x29, 0x20, 0x32, 0x30, 0x30, 0x39, 0x2d, 
+	0x32, 0x30, 0x31, 0x35, 0x20, 0x41, 0x6e, 0x64, 0x72, 0x65, 0x61, 0x73, 0x20, 0x54, 0x20, 0x4a, 
+	0x6f, 0x6e, 0x73, 0x73, 0x6f, 0x6e, 0x20, 0x3c, 0x61, 0x6e, 0x64, 0x72, 0x65, 0x61, 0x73, 0x40, 
+	0x73, 0x61, 0x75, 0x72, 0x75, 0x73, 0x2e, 0x6f, 0x72, 0x67, 0x3e, 0xa, 0x2d, 0x2d, 0xa, 0x2d, 
+	0x2d, 0x20, 0x54, 0x68, 0x69, 0x73, 0x20, 0x53, 0x6f, 0x75, 0x72, 0x63, 0x65, 0x20, 0x43, 0x6f, 
+	0x64, 0x65, 0x20, 0x46, 0x6f, 0x72, 0x6d, 0x20, 0x69, 0x73, 0x20, 0x73, 0x75, 0x62, 0x6a, 0x65, 
+	0x63, 0x74, 0x20, 0x74, 0x6f, 0x20, 0x74, 0x68, 0x65, 0x20, 0x74, 0x65, 0x72, 0x6d, 0x73, 0x20, 
+	0x6f, 0x66, 0x20, 0x74, 0x68, 0x65, 0x20, 0x4d, 0x6f, 0x7a, 0x69, 0x6c, 0x6c, 0x61, 0x20, 0x50, 
+	0x75, 0x62, 0x6c, 0x69, 0x63, 0xa, 0x2d, 0x2d, 0x20, 0x4c, 0x69, 0x63, 0x65, 0x6e, 0x73, 0x65, 
+	0x2c, 0x20, 0x76, 0x2e, 0x20, 0x32, 0x2e, 0x30, 0x2e, 0x20, 0x49, 0x66, 0x20, 0x61, 0x20, 0x63, 
+	0x6f, 0x70, 0x79, 0x20, 0x6f, 0x66, 0x20, 0x74, 0x68, 0x65, 0x20, 0x4d, 0x50, 0x4c, 0x20, 0x77, 
+	0x61, 0x73, 0x20, 0x6e, 0x6f, 0x74, 0x20, 0x64, 0x69, 0x73, 0x74, 0x72, 0x69, 0x62, 0x75, 0x74, 
+	0x65, 0x64, 0x20, 0x77, 0x69, 0x74, 0x68, 0x20, 0x74, 0x68, 0x69, 0x73, 0xa, 0x2d, 0x2d, 0x20, 
+	0x66, 0x69, 0x6c, 0x65, 0x2c, 0x20, 0x59, 0x6f, 0x75, 0x20, 0x63, 0x61, 0x6e, 0x20, 0x6f, 0x62, 
+	0x74, 0x61, 0x69, 0x6e, 0x20, 0x6f, 0x6e, 0x65, 0x20, 0x61, 0x74, 0x20, 0x68, 0x74, 0x74, 0x70, 
+	0x3a, 0x2f, 0x2f, 0x6d, 0x6f, 0x7a, 0x69, 0x6c, 0x6c, 0x61, 0x2e, 0x6f, 0x72, 0x67, 0x2f, 0x4d, 
+	0x50, 0x4c, 0x2f, 0x32, 0x2e, 0x30, 0x2f, 0x2e, 0xa, 0xa, 0x2d, 0x2d, 0x20, 0x41, 0x68, 0x65, 
+	0x61, 0x64, 0x2d, 0x6f, 0x66, 0x2d, 0x74, 0x69, 0x6d, 0x65, 0x20, 0x74, 0x72, 0x61, 0x6e, 0x73, 
+	0x6c, 0x61, 0x74, 0x69, 0x6f, 0x6e, 0x20, 0x6f, 0x66, 0x20, 0x6c, 0x61, 0x6d, 0x62, 0x64, 0x61, 
+	0x73, 0x20, 0x74, 0x6f, 0x20, 0x43, 0x2c, 0x20, 0x65, 0x6e, 0x61, 0x62, 0x6c, 0x65, 0x64, 0x20, 
+	0x77, 0x69, 0x74, 0x68, 0x20, 0x74, 0x68, 0x65, 0x20, 0x27, 0x2d, 0x61, 0x27, 0x20, 0x6f, 0x70, 
+	0x74, 0x69, 0x6f, 0x6e, 0xa, 0x2d, 0x2d, 0x20, 0x77, 0x68, 0x65, 0x6e, 0x20, 0x63, 0x6f, 0x6d, 
+	0x70, 0x69, 0x6c, 0x69, 0x6e, 0x67, 0x20, 0x74, 0x6f, 0x20, 0x61, 0x20, 0x2e, 0x63, 0x20, 0x66, 
+	0x69, 0x6c, 0x65, 0x2e, 0x20, 0x41, 0x20, 0x6c, 0x61, 0x6d, 0x62, 0x64, 0x61, 0x20, 0x77, 0x69, 
+	0x74, 0x68, 0x6f, 0x75, 0x74, 0x20, 0x75, 0x70, 0x76, 0x61, 0x6c, 0x75, 0x65, 0x73, 0x2c, 0x20, 
+	0x77, 0x68, 0x6f, 0x73, 0x65, 0x20, 0x6e, 0x65, 0x73, 0x74, 0x65, 0x64, 0xa, 0x2d, 0x2d, 0x20, 
+	0x6c, 0x61, 0x6d, 0x62, 0x64, 0x61, 0x73, 0x20, 0x61, 0x72, 0x65, 0x20, 0x74, 0x72, 0x61, 0x6e, 
+	0x73, 0x6c, 0x61, 0x74, 0x65, 0x64, 0x20, 0x74, 0x6f, 0x6f, 0x2c, 0x20, 0x62, 0x65, 0x63, 0x6f, 
+	0x6d, 0x65, 0x73, 0x20, 0x61, 0x20, 0x43, 0x20, 0x66, 0x75, 0x6e, 0x63, 0x74, 0x69, 0x6f, 0x6e, 
+	0x20, 0x6f, 0x6e, 0x20, 0x74, 0x68, 0x65, 0x20, 0x73, 0x75, 0x5f, 0x2a, 0x20, 0x41, 0x50, 0x49, 
+	0x20, 0x74, 0x68, 0x61, 0x74, 0x20, 0x69, 0x73, 0xa, 0x2d, 0x2d, 0x20, 0x72, 0x65, 0x67, 0x69, 
+	0x73, 0x74, 0x65, 0x72, 0x65, 0x64, 0x20, 0x6c, 0x69, 0x6b, 0x65, 0x20, 0x61, 0x20, 0x27, 0x63, 
+	0x66, 0x75, 0x6e, 0x27, 0x20, 0x61, 0x6e, 0x64, 0x20, 0x70, 0x75, 0x73, 0x68, 0x65, 0x64, 0x20, 
+	0x77, 0x69, 0x74, 0x68, 0x20, 0x4c, 0x43, 0x4c, 0x2e, 0x20, 0x45, 0x76, 0x65, 0x72, 0x79, 0x74, 
+	0x68, 0x69, 0x6e, 0x67, 0x20, 0x65, 0x6c, 0x73, 0x65, 0x2c, 0x20, 0x61, 0x6e, 0x64, 0x20, 0x74, 
+	0x68, 0x65, 0xa, 0x2d, 0x2d, 0x20, 0x74, 0x6f, 0x70, 0x20, 0x6c, 0x65, 0x76, 0x65, 0x6c, 0x20, 
+	0x63, 0x68, 0x75, 0x6e, 0x6b, 0x2c, 0x20, 0x73, 0x74, 0x61, 0x79, 0x73, 0x20, 0x62, 0x79, 0x74, 
+	0x65, 0x63, 0x6f, 0x64, 0x65, 0x2e, 0xa, 0xa, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x20, 0x70, 0x72, 
+	0x65, 0x6c, 0x75, 0x64, 0x65, 0x5f, 0x61, 0x74, 0xa, 0xa, 0x2d, 0x2d, 0x20, 0x52, 0x75, 0x6e, 
+	0x74, 0x69, 0x6d, 0x65, 0x20, 0x68, 0x65, 0x6c, 0x70, 0x65, 0x72, 0x73, 0x20, 0x66, 0x6f, 0x72, 
+	0x20, 0x74, 0x68, 0x65, 0x20, 0x74, 0x72, 0x61, 0x6e, 0x73, 0x6c, 0x61, 0x74, 0x65, 0x64, 0x20, 
+	0x63, 0x6f, 0x64, 0x65, 0x2c, 0x20, 0x6f, 0x6e, 0x6c, 0x79, 0x20, 0x74, 0x68, 0x6f, 0x73, 0x65, 
+	0x20, 0x69, 0x74, 0x20, 0x63, 0x61, 0x6c, 0x6c, 0x73, 0x20, 0x61, 0x72, 0x65, 0x20, 0x77, 0x72, 
+	0x69, 0x74, 0x74, 0x65, 0x6e, 0xa, 0x2d, 0x2d, 0x20, 0x73, 0x6f, 0x20, 0x74, 0x68, 0x65, 0x20, 
+	0x43, 0x20, 0x63, 0x6f, 0x6d, 0x70, 0x69, 0x6c, 0x65, 0x72, 0x20, 0x64, 0x6f, 0x65, 0x73, 0x6e, 
+	0x27, 0x74, 0x20, 0x77, 0x61, 0x72, 0x6e, 0x20, 0x61, 0x62, 0x6f, 0x75, 0x74, 0x20, 0x75, 0x6e, 
+	0x75, 0x73, 0x65, 0x64, 0x20, 0x66, 0x75, 0x6e, 0x63, 0x74, 0x69, 0x6f, 0x6e, 0x73, 0x2e, 0x20, 
+	0x4c, 0x61, 0x74, 0x65, 0x72, 0x20, 0x6f, 0x6e, 0x65, 0x73, 0x20, 0x6d, 0x61, 0x79, 0xa, 0x2d, 
+	0x2d, 0x20, 0x63, 0x61, 0x6c, 0x6c, 0x20, 0x65, 0x61, 0x72, 0x6c, 0x69, 0x65, 0x72, 0x20, 0x6f, 
+	0x6e, 0x65, 0x73, 0x2e, 0xa, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x20, 0x61, 0x6f, 0x74, 0x5f, 0x68, 
+	0x65, 0x6c, 0x70, 0x65, 0x72, 0x73, 0x20, 0x3d, 0x20, 0x7b, 0xa, 0x9, 0x7b, 0x27, 0x5f, 0x5f, 
+	0x5f, 0x61, 0x6f, 0x74, 0x5f, 0x6e, 0x75, 0x6d, 0x62, 0x65, 0x72, 0x27, 0x2c, 0x20, 0x5b, 0x5b, 
+	0xa, 0x73, 0x74, 0x61, 0x74, 0x69, 0x63, 0x20, 0x64, 0x6f, 0x75, 0x62, 0x6c, 0x65, 0x20, 0x5f, 
+	0x5f, 0x5f, 0x61, 0x6f, 0x74, 0x5f, 0x6e, 0x75, 0x6d, 0x62, 0x65, 0x72, 0x28, 0x73, 0x75, 0x5f, 
+	0x73, 0x74, 0x61, 0x74, 0x65, 0x20, 0x2a, 0x73, 0x2c, 0x20, 0x69, 0x6e, 0x74, 0x20, 0x69, 0x64, 
+	0x78, 0x29, 0x20, 0x7b, 0xa, 0x9, 0x73, 0x75, 0x5f, 0x63, 0x68, 0x65, 0x63, 0x6b, 0x5f, 0x74, 
+	0x79, 0x70, 0x65, 0x28, 0x73, 0x2c, 0x20, 0x69, 0x64, 0x78, 0x2c, 0x20, 0x53, 0x55, 0x5f, 0x4e, 
+	0x55, 0x4d, 0x42, 0x45, 0x52, 0x29, 0x3b, 0xa, 0x9, 0x72, 0x65, 0x74, 0x75, 0x72, 0x6e, 0x20, 
+	0x73, 0x75, 0x5f, 0x74, 0x6f, 0x6e, 0x75, 0x6d, 0x62, 0x65, 0x72, 0x28, 0x73, 0x2c, 0x20, 0x69, 
+	0x64, 0x78, 0x29, 0x3b, 0xa, 0x7d, 0xa, 0xa, 0x5d, 0x5d, 0x7d, 0x2c, 0xa, 0x9, 0x7b, 0x27, 
+	0x5f, 0x5f, 0x5f, 0x61, 0x6f, 0x74, 0x5f, 0x74, 0x72, 0x75, 0x65, 0x27, 0x2c, 0x20, 0x5b, 0x5b, 
+	0xa, 0x73, 0x74, 0x61, 0x74, 0x69, 0x63, 0x20, 0x69, 0x6e, 0x74, 0x20, 0x5f, 0x5f, 0x5f, 0x61, 
+	0x6f, 0x74, 0x5f, 0x74, 0x72, 0x75, 0x65, 0x28, 0x73, 0x75, 0x5f, 0x73, 0x74, 0x61, 0x74, 0x65, 
+	0x20, 0x2a, 0x73, 0x2c, 0x20, 0x69, 0x6e, 0x74, 0x20, 0x69, 0x64, 0x78, 0x29, 0x20, 0x7b, 0xa, 
+	0x9, 0x73, 0x75, 0x5f, 0x6f, 0x62, 0x6a, 0x65, 0x63, 0x74, 0x5f, 0x74, 0x79, 0x70, 0x65, 0x5f, 
+	0x74, 0x20, 0x74, 0x20, 0x3d, 0x20, 0x73, 0x75, 0x5f, 0x74, 0x79, 0x70, 0x65, 0x28, 0x73, 0x2c, 
+	0x20, 0x69, 0x64, 0x78, 0x29, 0x3b, 0xa, 0x9, 0x72, 0x65, 0x74, 0x75, 0x72, 0x6e, 0x20, 0x74, 
+	0x20, 0x21, 0x3d, 0x20, 0x53, 0x55, 0x5f, 0x4e, 0x49, 0x4c, 0x20, 0x26, 0x26, 0x20, 0x28, 0x74, 
+	0x20, 0x21, 0x3d, 0x20, 0x53, 0x55, 0x5f, 0x42, 0x4f, 0x4f, 0x4c, 0x45, 0x41, 0x4e, 0x20, 0x7c, 
+	0x7c, 0x20, 0x73, 0x75, 0x5f, 0x74, 0x6f, 0x62, 0x6f, 0x6f, 0x6c, 0x65, 0x61, 0x6e, 0x28, 0x73, 
+	0x2c, 0x20, 0x69, 0x64, 0x78, 0x29, 0x29, 0x3b, 0xa, 0x7d, 0xa, 0xa, 0x5d, 0x5d, 0x7d, 0x2c, 
+	0xa, 0x9, 0x7b, 0x27, 0x5f, 0x5f, 0x5f, 0x61, 0x6f, 0x74, 0x5f, 0x70, 0x6f, 0x70, 0x5f, 0x74, 
+	0x72, 0x75, 0x65, 0x27, 0x2c, 0x20, 0x5b, 0x5b, 0xa, 0x73, 0x74, 0x61, 0x74, 0x69, 0x63, 0x20, 
+	0x69, 0x6e, 0x74, 0x20, 0x5f, 0x5f, 0x5f, 0x61, 0x6f, 0x74, 0x5f, 0x70, 0x6f, 0x70, 0x5f, 0x74, 
+	0x72, 0x75, 0x65, 0x28, 0x73, 0x75, 0x5f, 0x73, 0x74, 0x61, 0x74, 0x65, 0x20, 0x2a, 0x73, 0x29, 
+	0x20, 0x7b, 0xa, 0x9, 0x69, 0x6e, 0x74, 0x20, 0x72, 0x20, 0x3d, 0x20, 0x5f, 0x5f, 0x5f, 0x61, 
+	0x6f, 0x74, 0x5f, 0x74, 0x72, 0x75, 0x65, 0x28, 0x73, 0x2c, 0x20, 0x2d, 0x31, 0x29, 0x3b, 0xa, 
+	0x9, 0x73, 0x75, 0x5f, 0x70, 0x6f, 0x70, 0x28, 0x73, 0x2c, 0x20, 0x31, 0x29, 0x3b, 0xa, 0x9, 
+	0x72, 0x65, 0x74, 0x75, 0x72, 0x6e, 0x20, 0x72, 0x3b, 0xa, 0x7d, 0xa, 0xa, 0x5d, 0x5d, 0x7d, 
+	0x2c, 0xa, 0x9, 0x7b, 0x27, 0x5f, 0x5f, 0x5f, 0x61, 0x6f, 0x74, 0x5f, 0x67, 0x65, 0x74, 0x67, 
+	0x6c, 0x6f, 0x62, 0x61, 0x6c, 0x27, 0x2c, 0x20, 0x5b, 0x5b, 0xa, 0x73, 0x74, 0x61, 0x74, 0x69, 
+	0x63, 0x20, 0x76, 0x6f, 0x69, 0x64, 0x20, 0x5f, 0x5f, 0x5f, 0x61, 0x6f, 0x74, 0x5f, 0x67, 0x65, 
+	0x74, 0x67, 0x6c, 0x6f, 0x62, 0x61, 0x6c, 0x28, 0x73, 0x75, 0x5f, 0x73, 0x74, 0x61, 0x74, 0x65, 
+	0x20, 0x2a, 0x73, 0x2c, 0x20, 0x63, 0x6f, 0x6e, 0x73, 0x74, 0x20, 0x63, 0x68, 0x61, 0x72, 0x20, 
+	0x2a, 0x6e, 0x61, 0x6d, 0x65, 0x29, 0x20, 0x7b, 0xa, 0x9, 0x69, 0x66, 0x20, 0x28, 0x21, 0x73, 
+	0x75, 0x5f, 0x67, 0x65, 0x74, 0x67, 0x6c, 0x6f, 0x62, 0x61, 0x6c, 0x28, 0x73, 0x2c, 0x20, 0x6e, 
+	0x61, 0x6d, 0x65, 0x29, 0x29, 0xa, 0x9, 0x9, 0x73, 0x75, 0x5f, 0x65, 0x72, 0x72, 0x6f, 0x72, 
+	0x28, 0x73, 0x2c, 0x20, 0x22, 0x55, 0x6e, 0x64, 0x65, 0x66, 0x69, 0x6e, 0x65, 0x64, 0x20, 0x67, 
+	0x6c, 0x6f, 0x62, 0x61, 0x6c, 0x20, 0x76, 0x61, 0x72, 0x69, 0x61, 0x62, 0x6c, 0x65, 0x3a, 0x20, 
+	0x25, 0x73, 0x22, 0x2c, 0x20, 0x6e, 0x61, 0x6d, 0x65, 0x29, 0x3b, 0xa, 0x7d, 0xa, 0xa, 0x5d, 
+	0x5d, 0x7d, 0xa, 0x7d, 0xa, 0xa, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x20, 0x66, 0x75, 0x6e, 0x63, 
+	0x74, 0x69, 0x6f, 0x6e, 0x20, 0x61, 0x6f, 0x74, 0x5f, 0x70, 0x72, 0x65, 0x6c, 0x75, 0x64, 0x65, 
+	0x28, 0x63, 0x6f, 0x64, 0x65, 0x29, 0xa, 0x9, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x20, 0x75, 0x73, 
+	0x65, 0x64, 0x20, 0x3d, 0x20, 0x7b, 0x7d, 0xa, 0x9, 0x66, 0x6f, 0x72, 0x20, 0x69, 0x20, 0x3d, 
+	0x20, 0x23, 0x61, 0x6f, 0x74, 0x5f, 0x68, 0x65, 0x6c, 0x70, 0x65, 0x72, 0x73, 0x2c, 0x20, 0x31, 
+	0x2c, 0x20, 0x2d, 0x31, 0x20, 0x64, 0x6f, 0xa, 0x9, 0x9, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x20, 
+	0x6e, 0x61, 0x6d, 0x65, 0x2c, 0x20, 0x68, 0x65, 0x6c, 0x70, 0x65, 0x72, 0x20, 0x3d, 0x20, 0x75, 
+	0x6e, 0x70, 0x61, 0x63, 0x6b, 0x28, 0x61, 0x6f, 0x74, 0x5f, 0x68, 0x65, 0x6c, 0x70, 0x65, 0x72, 
+	0x73, 0x5b, 0x69, 0x5d, 0x29, 0xa, 0x9, 0x9, 0x69, 0x66, 0x20, 0x73, 0x74, 0x72, 0x69, 0x6e, 
+	0x67, 0x2e, 0x66, 0x69, 0x6e, 0x64, 0x28, 0x63, 0x6f, 0x64, 0x65, 0x2c, 0x20, 0x6e, 0x61, 0x6d, 
+	0x65, 0x20, 0x2e, 0x2e, 0x20, 0x27, 0x28, 0x27, 0x2c, 0x20, 0x31, 0x2c, 0x20, 0x74, 0x72, 0x75, 
+	0x65, 0x29, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x9, 0x9, 0x9, 0x74, 0x61, 0x62, 0x6c, 0x65, 
+	0x2e, 0x69, 0x6e, 0x73, 0x65, 0x72, 0x74, 0x28, 0x75, 0x73, 0x65, 0x64, 0x2c, 0x20, 0x31, 0x2c, 
+	0x20, 0x68, 0x65, 0x6c, 0x70, 0x65, 0x72, 0x29, 0xa, 0x9, 0x9, 0x9, 0x63, 0x6f, 0x64, 0x65, 
+	0x20, 0x3d, 0x20, 0x63, 0x6f, 0x64, 0x65, 0x20, 0x2e, 0x2e, 0x20, 0x68, 0x65, 0x6c, 0x70, 0x65, 
+	0x72, 0xa, 0x9, 0x9, 0x65, 0x6e, 0x64, 0xa, 0x9, 0x65, 0x6e, 0x64, 0xa, 0x9, 0x72, 0x65, 
+	0x74, 0x75, 0x72, 0x6e, 0x20, 0x27, 0x23, 0x69, 0x6e, 0x63, 0x6c, 0x75, 0x64, 0x65, 0x20, 0x3c, 
+	0x6d, 0x61, 0x74, 0x68, 0x2e, 0x68, 0x3e, 0x5c, 0x6e, 0x5c, 0x6e, 0x27, 0x20, 0x2e, 0x2e, 0x20, 
+	0x74, 0x61, 0x62, 0x6c, 0x65, 0x2e, 0x63, 0x6f, 0x6e, 0x63, 0x61, 0x74, 0x28, 0x75, 0x73, 0x65, 
+	0x64, 0x29, 0xa, 0x65, 0x6e, 0x64, 0xa, 0xa, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x20, 0x61, 0x72, 
+	0x69, 0x74, 0x68, 0x20, 0x3d, 0x20, 0x7b, 0xa, 0x9, 0x41, 0x44, 0x44, 0x20, 0x3d, 0x20, 0x27, 
+	0x2b, 0x27, 0x2c, 0x20, 0x41, 0x44, 0x44, 0x5f, 0x4c, 0x4c, 0x20, 0x3d, 0x20, 0x27, 0x2b, 0x27, 
+	0x2c, 0x20, 0x41, 0x44, 0x44, 0x5f, 0x4c, 0x4b, 0x20, 0x3d, 0x20, 0x27, 0x2b, 0x27, 0x2c, 0xa, 
+	0x9, 0x53, 0x55, 0x42, 0x20, 0x3d, 0x20, 0x27, 0x2d, 0x27, 0x2c, 0x20, 0x53, 0x55, 0x42, 0x5f, 
+	0x4c, 0x4c, 0x20, 0x3d, 0x20, 0x27, 0x2d, 0x27, 0x2c, 0x20, 0x53, 0x55, 0x42, 0x5f, 0x4c, 0x4b, 
+	0x20, 0x3d, 0x20, 0x27, 0x2d, 0x27, 0x2c, 0x20, 0x53, 0x55, 0x42, 0x5f, 0x4b, 0x4c, 0x20, 0x3d, 
+	0x20, 0x27, 0x2d, 0x27, 0x2c, 0xa, 0x9, 0x4d, 0x55, 0x4c, 0x20, 0x3d, 0x20, 0x27, 0x2a, 0x27, 
+	0x2c, 0x20, 0x4d, 0x55, 0x4c, 0x5f, 0x4c, 0x4c, 0x20, 0x3d, 0x20, 0x27, 0x2a, 0x27, 0x2c, 0x20, 
+	0x4d, 0x55, 0x4c, 0x5f, 0x4c, 0x4b, 0x20, 0x3d, 0x20, 0x27, 0x2a, 0x27, 0x2c, 0xa, 0x9, 0x44, 
+	0x49, 0x56, 0x20, 0x3d, 0x20, 0x27, 0x2f, 0x27, 0x2c, 0xa, 0x9, 0x4c, 0x45, 0x53, 0x53, 0x20, 
+	0x3d, 0x20, 0x27, 0x3c, 0x27, 0x2c, 0x20, 0x4c, 0x45, 0x53, 0x53, 0x5f, 0x4c, 0x4c, 0x20, 0x3d, 
+	0x20, 0x27, 0x3c, 0x27, 0x2c, 0x20, 0x4c, 0x45, 0x53, 0x53, 0x5f, 0x4c, 0x4b, 0x20, 0x3d, 0x20, 
+	0x27, 0x3c, 0x27, 0x2c, 0x20, 0x4c, 0x45, 0x53, 0x53, 0x5f, 0x4b, 0x4c, 0x20, 0x3d, 0x20, 0x27, 
+	0x3c, 0x27, 0x2c, 0xa, 0x9, 0x4c, 0x45, 0x51, 0x55, 0x41, 0x4c, 0x20, 0x3d, 0x20, 0x27, 0x3c, 
+	0x3d, 0x27, 0x2c, 0x20, 0x4c, 0x45, 0x51, 0x55, 0x41, 0x4c, 0x5f, 0x4c, 0x4c, 0x20, 0x3d, 0x20, 
+	0x27, 0x3c, 0x3d, 0x27, 0x2c, 0x20, 0x4c, 0x45, 0x51, 0x55, 0x41, 0x4c, 0x5f, 0x4c, 0x4b, 0x20, 
+	0x3d, 0x20, 0x27, 0x3c, 0x3d, 0x27, 0x2c, 0x20, 0x4c, 0x45, 0x51, 0x55, 0x41, 0x4c, 0x5f, 0x4b, 
+	0x4c, 0x20, 0x3d, 0x20, 0x27, 0x3c, 0x3d, 0x27, 0xa, 0x7d, 0xa, 0xa, 0x2d, 0x2d, 0x20, 0x51, 
+	0x75, 0x69, 0x63, 0x6b, 0x65, 0x6e, 0x65, 0x64, 0x20, 0x66, 0x6f, 0x72, 0x6d, 0x73, 0x20, 0x66, 
+	0x72, 0x6f, 0x6d, 0x20, 0x61, 0x20, 0x70, 0x72, 0x6f, 0x66, 0x69, 0x6c, 0x65, 0x20, 0x74, 0x72, 
+	0x61, 0x6e, 0x73, 0x6c, 0x61, 0x74, 0x65, 0x20, 0x6c, 0x69, 0x6b, 0x65, 0x20, 0x74, 0x68, 0x65, 
+	0x69, 0x72, 0x20, 0x67, 0x65, 0x6e, 0x65, 0x72, 0x69, 0x63, 0x20, 0x66, 0x6f, 0x72, 0x6d, 0x2e, 
+	0xa, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x20, 0x67, 0x65, 0x6e, 0x65, 0x72, 0x69, 0x63, 0x20, 0x3d, 
+	0x20, 0x7b, 0xa, 0x9, 0x41, 0x44, 0x44, 0x5f, 0x4e, 0x4e, 0x20, 0x3d, 0x20, 0x27, 0x41, 0x44, 
+	0x44, 0x27, 0x2c, 0x20, 0x53, 0x55, 0x42, 0x5f, 0x4e, 0x4e, 0x20, 0x3d, 0x20, 0x27, 0x53, 0x55, 
+	0x42, 0x27, 0x2c, 0x20, 0x4d, 0x55, 0x4c, 0x5f, 0x4e, 0x4e, 0x20, 0x3d, 0x20, 0x27, 0x4d, 0x55, 
+	0x4c, 0x27, 0x2c, 0x20, 0x4c, 0x45, 0x53, 0x53, 0x5f, 0x4e, 0x4e, 0x20, 0x3d, 0x20, 0x27, 0x4c, 
+	0x45, 0x53, 0x53, 0x27, 0x2c, 0x20, 0x4c, 0x45, 0x51, 0x55, 0x41, 0x4c, 0x5f, 0x4e, 0x4e, 0x20, 
+	0x3d, 0x20, 0x27, 0x4c, 0x45, 0x51, 0x55, 0x41, 0x4c, 0x27, 0xa, 0x7d, 0xa, 0xa, 0x6c, 0x6f, 
+	0x63, 0x61, 0x6c, 0x20, 0x66, 0x75, 0x6e, 0x63, 0x74, 0x69, 0x6f, 0x6e, 0x20, 0x63, 0x5f, 0x73, 
+	0x74, 0x72, 0x69, 0x6e, 0x67, 0x28, 0x73, 0x74, 0x72, 0x29, 0xa, 0x9, 0x72, 0x65, 0x74, 0x75, 
+	0x72, 0x6e, 0x20, 0x27, 0x22, 0x27, 0x20, 0x2e, 0x2e, 0x20, 0x73, 0x74, 0x72, 0x69, 0x6e, 0x67, 
+	0x2e, 0x67, 0x73, 0x75, 0x62, 0x28, 0x73, 0x74, 0x72, 0x2c, 0x20, 0x27, 0x5b, 0x25, 0x63, 0x22, 
+	0x5c, 0x5c, 0x3f, 0x5c, 0x31, 0x32, 0x38, 0x2d, 0x5c, 0x32, 0x35, 0x35, 0x5d, 0x27, 0x2c, 0x20, 
+	0x66, 0x75, 0x6e, 0x63, 0x74, 0x69, 0x6f, 0x6e, 0x28, 0x63, 0x29, 0xa, 0x9, 0x9, 0x72, 0x65, 
+	0x74, 0x75, 0x72, 0x6e, 0x20, 0x73, 0x74, 0x72, 0x69, 0x6e, 0x67, 0x2e, 0x66, 0x6f, 0x72, 0x6d, 
+	0x61, 0x74, 0x28, 0x27, 0x5c, 0x5c, 0x25, 0x30, 0x33, 0x6f, 0x27, 0x2c, 0x20, 0x73, 0x74, 0x72, 
+	0x69, 0x6e, 0x67, 0x2e, 0x62, 0x79, 0x74, 0x65, 0x28, 0x63, 0x29, 0x29, 0xa, 0x9, 0x65, 0x6e, 
+	0x64, 0x29, 0x20, 0x2e, 0x2e, 0x20, 0x27, 0x22, 0x27, 0xa, 0x65, 0x6e, 0x64, 0xa, 0xa, 0x6c, 
+	0x6f, 0x63, 0x61, 0x6c, 0x20, 0x66, 0x75, 0x6e, 0x63, 0x74, 0x69, 0x6f, 0x6e, 0x20, 0x63, 0x5f, 
+	0x6e, 0x75, 0x6d, 0x62, 0x65, 0x72, 0x28, 0x6e, 0x29, 0xa, 0x9, 0x72, 0x65, 0x74, 0x75, 0x72, 
+	0x6e, 0x20, 0x73, 0x74, 0x72, 0x69, 0x6e, 0x67, 0x2e, 0x66, 0x6f, 0x72, 0x6d, 0x61, 0x74, 0x28, 
+	0x27, 0x25, 0x2e, 0x31, 0x37, 0x67, 0x27, 0x2c, 0x20, 0x6e, 0x29, 0xa, 0x65, 0x6e, 0x64, 0xa, 
+	0xa, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x20, 0x66, 0x75, 0x6e, 0x63, 0x74, 0x69, 0x6f, 0x6e, 0x20, 
+	0x69, 0x73, 0x5f, 0x6e, 0x75, 0x6d, 0x62, 0x65, 0x72, 0x5f, 0x63, 0x6f, 0x6e, 0x73, 0x74, 0x28, 
+	0x61, 0x73, 0x6d, 0x2c, 0x20, 0x6b, 0x29, 0xa, 0x9, 0x72, 0x65, 0x74, 0x75, 0x72, 0x6e, 0x20, 
+	0x74, 0x79, 0x70, 0x65, 0x28, 0x61, 0x73, 0x6d, 0x2e, 0x63, 0x6f, 0x6e, 0x73, 0x74, 0x61, 0x6e, 
+	0x74, 0x73, 0x5b, 0x6b, 0x20, 0x2b, 0x20, 0x31, 0x5d, 0x29, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x6e, 
+	0x75, 0x6d, 0x62, 0x65, 0x72, 0x27, 0xa, 0x65, 0x6e, 0x64, 0xa, 0xa, 0x6c, 0x6f, 0x63, 0x61, 
+	0x6c, 0x20, 0x66, 0x75, 0x6e, 0x63, 0x74, 0x69, 0x6f, 0x6e, 0x20, 0x70, 0x75, 0x73, 0x68, 0x5f, 
+	0x63, 0x6f, 0x6e, 0x73, 0x74, 0x28, 0x61, 0x73, 0x6d, 0x2c, 0x20, 0x6b, 0x29, 0xa, 0x9, 0x6c, 
+	0x6f, 0x63, 0x61, 0x6c, 0x20, 0x76, 0x20, 0x3d, 0x20, 0x61, 0x73, 0x6d, 0x2e, 0x63, 0x6f, 0x6e, 
+	0x73, 0x74, 0x61, 0x6e, 0x74, 0x73, 0x5b, 0x6b, 0x20, 0x2b, 0x20, 0x31, 0x5d, 0xa, 0x9, 0x69, 
+	0x66, 0x20, 0x76, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x6e, 0x69, 0x6c, 0x27, 0x20, 0x74, 0x68, 0x65, 
+	0x6e, 0xa, 0x9, 0x9, 0x72, 0x65, 0x74, 0x75, 0x72, 0x6e, 0x20, 0x27, 0x73, 0x75, 0x5f, 0x70, 
+	0x75, 0x73, 0x68, 0x6e, 0x69, 0x6c, 0x28, 0x73, 0x29, 0x3b, 0x27, 0xa, 0x9, 0x65, 0x6c, 0x73, 
+	0x65, 0x69, 0x66, 0x20, 0x74, 0x79, 0x70, 0x65, 0x28, 0x76, 0x29, 0x20, 0x3d, 0x3d, 0x20, 0x27, 
+	0x6e, 0x75, 0x6d, 0x62, 0x65, 0x72, 0x27, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x9, 0x9, 0x72, 
+	0x65, 0x74, 0x75, 0x72, 0x6e, 0x20, 0x73, 0x74, 0x72, 0x69, 0x6e, 0x67, 0x2e, 0x66, 0x6f, 0x72, 
+	0x6d, 0x61, 0x74, 0x28, 0x27, 0x73, 0x75, 0x5f, 0x70, 0x75, 0x73, 0x68, 0x6e, 0x75, 0x6d, 0x62, 
+	0x65, 0x72, 0x28, 0x73, 0x2c, 0x20, 0x25, 0x73, 0x29, 0x3b, 0x27, 0x2c, 0x20, 0x63, 0x5f, 0x6e, 
+	0x75, 0x6d, 0x62, 0x65, 0x72, 0x28, 0x76, 0x29, 0x29, 0xa, 0x9, 0x65, 0x6c, 0x73, 0x65, 0x69, 
+	0x66, 0x20, 0x74, 0x79, 0x70, 0x65, 0x28, 0x76, 0x29, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x62, 0x6f, 
+	0x6f, 0x6c, 0x65, 0x61, 0x6e, 0x27, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x9, 0x9, 0x72, 0x65, 
+	0x74, 0x75, 0x72, 0x6e, 0x20, 0x73, 0x74, 0x72, 0x69, 0x6e, 0x67, 0x2e, 0x66, 0x6f, 0x72, 0x6d, 
+	0x61, 0x74, 0x28, 0x27, 0x73, 0x75, 0x5f, 0x70, 0x75, 0x73, 0x68, 0x62, 0x6f, 0x6f, 0x6c, 0x65, 
+	0x61, 0x6e, 0x28, 0x73, 0x2c, 0x20, 0x25, 0x69, 0x29, 0x3b, 0x27, 0x2c, 0x20, 0x76, 0x20, 0x61, 
+	0x6e, 0x64, 0x20, 0x31, 0x20, 0x6f, 0x72, 0x20, 0x30, 0x29, 0xa, 0x9, 0x65, 0x6e, 0x64, 0xa, 
+	0x9, 0x72, 0x65, 0x74, 0x75, 0x72, 0x6e, 0x20, 0x73, 0x74, 0x72, 0x69, 0x6e, 0x67, 0x2e, 0x66, 
+	0x6f, 0x72, 0x6d, 0x61, 0x74, 0x28, 0x27, 0x73, 0x75, 0x5f, 0x70, 0x75, 0x73, 0x68, 0x62, 0x79, 
+	0x74, 0x65, 0x73, 0x28, 0x73, 0x2c, 0x20, 0x25, 0x73, 0x2c, 0x20, 0x25, 0x69, 0x29, 0x3b, 0x27, 
+	0x2c, 0x20, 0x63, 0x5f, 0x73, 0x74, 0x72, 0x69, 0x6e, 0x67, 0x28, 0x76, 0x29, 0x2c, 0x20, 0x23, 
+	0x76, 0x29, 0xa, 0x65, 0x6e, 0x64, 0xa, 0xa, 0x2d, 0x2d, 0x20, 0x4f, 0x70, 0x65, 0x72, 0x61, 
+	0x6e, 0x64, 0x73, 0x20, 0x6f, 0x66, 0x20, 0x74, 0x68, 0x65, 0x20, 0x5f, 0x4c, 0x4c, 0x2c, 0x20, 
+	0x5f, 0x4c, 0x4b, 0x20, 0x61, 0x6e, 0x64, 0x20, 0x5f, 0x4b, 0x4c, 0x20, 0x66, 0x6f, 0x72, 0x6d, 
+	0x73, 0x20, 0x61, 0x73, 0x20, 0x43, 0x20, 0x65, 0x78, 0x70, 0x72, 0x65, 0x73, 0x73, 0x69, 0x6f, 
+	0x6e, 0x73, 0x2c, 0x20, 0x69, 0x6e, 0x20, 0x74, 0x68, 0x65, 0x20, 0x6f, 0x72, 0x64, 0x65, 0x72, 
+	0xa, 0x2d, 0x2d, 0x20, 0x74, 0x68, 0x65, 0x20, 0x56, 0x4d, 0x20, 0x72, 0x65, 0x61, 0x64, 0x73, 
+	0x20, 0x74, 0x68, 0x65, 0x6d, 0x2e, 0x20, 0x4e, 0x69, 0x6c, 0x20, 0x69, 0x66, 0x20, 0x61, 0x20, 
+	0x63, 0x6f, 0x6e, 0x73, 0x74, 0x61, 0x6e, 0x74, 0x20, 0x6f, 0x70, 0x65, 0x72, 0x61, 0x6e, 0x64, 
+	0x20, 0x69, 0x73, 0x20, 0x6e, 0x6f, 0x74, 0x20, 0x61, 0x20, 0x6e, 0x75, 0x6d, 0x62, 0x65, 0x72, 
+	0x2e, 0xa, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x20, 0x66, 0x75, 0x6e, 0x63, 0x74, 0x69, 0x6f, 0x6e, 
+	0x20, 0x6e, 0x75, 0x6d, 0x62, 0x65, 0x72, 0x5f, 0x6f, 0x70, 0x65, 0x72, 0x61, 0x6e, 0x64, 0x73, 
+	0x28, 0x61, 0x73, 0x6d, 0x2c, 0x20, 0x69, 0x6e, 0x73, 0x74, 0x2c, 0x20, 0x64, 0x65, 0x70, 0x74, 
+	0x68, 0x29, 0xa, 0x9, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x20, 0x6f, 0x70, 0x2c, 0x20, 0x61, 0x2c, 
+	0x20, 0x62, 0x20, 0x3d, 0x20, 0x69, 0x6e, 0x73, 0x74, 0x5b, 0x31, 0x5d, 0x2c, 0x20, 0x69, 0x6e, 
+	0x73, 0x74, 0x5b, 0x32, 0x5d, 0x20, 0x6f, 0x72, 0x20, 0x30, 0x2c, 0x20, 0x69, 0x6e, 0x73, 0x74, 
+	0x5b, 0x33, 0x5d, 0x20, 0x6f, 0x72, 0x20, 0x30, 0xa, 0x9, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x20, 
+	0x6c, 0x6f, 0x63, 0x20, 0x3d, 0x20, 0x66, 0x75, 0x6e, 0x63, 0x74, 0x69, 0x6f, 0x6e, 0x28, 0x69, 
+	0x29, 0x20, 0x72, 0x65, 0x74, 0x75, 0x72, 0x6e, 0x20, 0x73, 0x74, 0x72, 0x69, 0x6e, 0x67, 0x2e, 
+	0x66, 0x6f, 0x72, 0x6d, 0x61, 0x74, 0x28, 0x27, 0x5f, 0x5f, 0x5f, 0x61, 0x6f, 0x74, 0x5f, 0x6e, 
+	0x75, 0x6d, 0x62, 0x65, 0x72, 0x28, 0x73, 0x2c, 0x20, 0x25, 0x69, 0x29, 0x27, 0x2c, 0x20, 0x69, 
+	0x20, 0x2d, 0x20, 0x64, 0x65, 0x70, 0x74, 0x68, 0x29, 0x20, 0x65, 0x6e, 0x64, 0xa, 0x9, 0x69, 
+	0x66, 0x20, 0x73, 0x74, 0x72, 0x69, 0x6e, 0x67, 0x2e, 0x66, 0x69, 0x6e, 0x64, 0x28, 0x6f, 0x70, 
+	0x2c, 0x20, 0x27, 0x5f, 0x4c, 0x4c, 0x24, 0x27, 0x29, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x9, 
+	0x9, 0x72, 0x65, 0x74, 0x75, 0x72, 0x6e, 0x20, 0x6c, 0x6f, 0x63, 0x28, 0x61, 0x29, 0x2c, 0x20, 
+	0x6c, 0x6f, 0x63, 0x28, 0x62, 0x29, 0xa, 0x9, 0x65, 0x6c, 0x73, 0x65, 0x69, 0x66, 0x20, 0x6e, 
+	0x6f, 0x74, 0x20, 0x69, 0x73, 0x5f, 0x6e, 0x75, 0x6d, 0x62, 0x65, 0x72, 0x5f, 0x63, 0x6f, 0x6e, 
+	0x73, 0x74, 0x28, 0x61, 0x73, 0x6d, 0x2c, 0x20, 0x62, 0x29, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 
+	0x9, 0x9, 0x72, 0x65, 0x74, 0x75, 0x72, 0x6e, 0x20, 0x6e, 0x69, 0x6c, 0xa, 0x9, 0x65, 0x6c, 
+	0x73, 0x65, 0x69, 0x66, 0x20, 0x73, 0x74, 0x72, 0x69, 0x6e, 0x67, 0x2e, 0x66, 0x69, 0x6e, 0x64, 
+	0x28, 0x6f, 0x70, 0x2c, 0x20, 0x27, 0x5f, 0x4b, 0x4c, 0x24, 0x27, 0x29, 0x20, 0x74, 0x68, 0x65, 
+	0x6e, 0xa, 0x9, 0x9, 0x72, 0x65, 0x74, 0x75, 0x72, 0x6e, 0x20, 0x63, 0x5f, 0x6e, 0x75, 0x6d, 
+	0x62, 0x65, 0x72, 0x28, 0x61, 0x73, 0x6d, 0x2e, 0x63, 0x6f, 0x6e, 0x73, 0x74, 0x61, 0x6e, 0x74, 
+	0x73, 0x5b, 0x62, 0x20, 0x2b, 0x20, 0x31, 0x5d, 0x29, 0x2c, 0x20, 0x6c, 0x6f, 0x63, 0x28, 0x61, 
+	0x29, 0xa, 0x9, 0x65, 0x6e, 0x64, 0xa, 0x9, 0x72, 0x65, 0x74, 0x75, 0x72, 0x6e, 0x20, 0x6c, 
+	0x6f, 0x63, 0x28, 0x61, 0x29, 0x2c, 0x20, 0x63, 0x5f, 0x6e, 0x75, 0x6d, 0x62, 0x65, 0x72, 0x28, 
+	0x61, 0x73, 0x6d, 0x2e, 0x63, 0x6f, 0x6e, 0x73, 0x74, 0x61, 0x6e, 0x74, 0x73, 0x5b, 0x62, 0x20, 
+	0x2b, 0x20, 0x31, 0x5d, 0x29, 0xa, 0x65, 0x6e, 0x64, 0xa, 0xa, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 
+	0x20, 0x66, 0x75, 0x6e, 0x63, 0x74, 0x69, 0x6f, 0x6e, 0x20, 0x6a, 0x75, 0x6d, 0x70, 0x5f, 0x74, 
+	0x61, 0x72, 0x67, 0x65, 0x74, 0x73, 0x28, 0x61, 0x73, 0x6d, 0x29, 0xa, 0x9, 0x6c, 0x6f, 0x63, 
+	0x61, 0x6c, 0x20, 0x74, 0x61, 0x72, 0x67, 0x65, 0x74, 0x73, 0x20, 0x3d, 0x20, 0x7b, 0x7d, 0xa, 
 	0x9, 0x66, 0x6f, 0x72, 0x20, 0x5f, 0x2c, 0x76, 0x20, 0x69, 0x6e, 0x20, 0x69, 0x70, 0x61, 0x69, 
-	0x72, 0x73, 0x28, 0x61, 0x73, 0x6d, 0x2e, 0x75, 0x70, 0x29, 0x20, 0x64, 0x6f, 0xa, 0x9, 0x9, 
-	0x62, 0x69, 0x6e, 0x3a, 0x77, 0x72, 0x69, 0x74, 0x65, 0x28, 0x77, 0x72, 0x69, 0x74, 0x65, 0x62, 
-	0x69, 0x6e, 0x2e, 0x75, 0x69, 0x6e, 0x74, 0x31, 0x36, 0x28, 0x76, 0x5b, 0x31, 0x5d, 0x29, 0x29, 
-	0xa, 0x9, 0x9, 0x62, 0x69, 0x6e, 0x3a, 0x77, 0x72, 0x69, 0x74, 0x65, 0x28, 0x77, 0x72, 0x69, 
-	0x74, 0x65, 0x62, 0x69, 0x6e, 0x2e, 0x75, 0x69, 0x6e, 0x74, 0x31, 0x36, 0x28, 0x76, 0x5b, 0x32, 
-	0x5d, 0x29, 0x29, 0xa, 0x9, 0x65, 0x6e, 0x64, 0xa, 0xa, 0x9, 0x62, 0x69, 0x6e, 0x3a, 0x77, 
-	0x72, 0x69, 0x74, 0x65, 0x28, 0x77, 0x72, 0x69, 0x74, 0x65, 0x62, 0x69, 0x6e, 0x2e, 0x75, 0x69, 
-	0x6e, 0x74, 0x33, 0x32, 0x28, 0x23, 0x61, 0x73, 0x6d, 0x2e, 0x70, 0x72, 0x6f, 0x74, 0x6f, 0x74, 
-	0x79, 0x70, 0x65, 0x73, 0x29, 0x29, 0xa, 0x9, 0x66, 0x6f, 0x72, 0x20, 0x5f, 0x2c, 0x76, 0x20, 
-	0x69, 0x6e, 0x20, 0x69, 0x70, 0x61, 0x69, 0x72, 0x73, 0x28, 0x61, 0x73, 0x6d, 0x2e, 0x70, 0x72, 
-	0x6f, 0x74, 0x6f, 0x74, 0x79, 0x70, 0x65, 0x73, 0x29, 0x20, 0x64, 0x6f, 0xa, 0x9, 0x9, 0x61, 
-	0x73, 0x6d, 0x5f, 0x66, 0x75, 0x6e, 0x63, 0x28, 0x76, 0x2c, 0x20, 0x62, 0x69, 0x6e, 0x29, 0xa, 
-	0x9, 0x65, 0x6e, 0x64, 0xa, 0xa, 0x9, 0x62, 0x69, 0x6e, 0x3a, 0x77, 0x72, 0x69, 0x74, 0x65, 
-	0x28, 0x77, 0x72, 0x69, 0x74, 0x65, 0x62, 0x69, 0x6e, 0x2e, 0x73, 0x74, 0x72, 0x69, 0x6e, 0x67, 
-	0x28, 0x61, 0x73, 0x6d, 0x2e, 0x6e, 0x61, 0x6d, 0x65, 0x29, 0x29, 0xa, 0x9, 0x62, 0x69, 0x6e, 
-	0x3a, 0x77, 0x72, 0x69, 0x74, 0x65, 0x28, 0x77, 0x72, 0x69, 0x74, 0x65, 0x62, 0x69, 0x6e, 0x2e, 
-	0x75, 0x69, 0x6e, 0x74, 0x33, 0x32, 0x28, 0x23, 0x61, 0x73, 0x6d, 0x2e, 0x6c, 0x69, 0x6e, 0x65, 
-	0x6e, 0x72, 0x29, 0x29, 0xa, 0x9, 0x66, 0x6f, 0x72, 0x20, 0x5f, 0x2c, 0x76, 0x20, 0x69, 0x6e, 
-	0x20, 0x69, 0x70, 0x61, 0x69, 0x72, 0x73, 0x28, 0x61, 0x73, 0x6d, 0x2e, 0x6c, 0x69, 0x6e, 0x65, 
-	0x6e, 0x72, 0x29, 0x20, 0x64, 0x6f, 0xa, 0x9, 0x9, 0x62, 0x69, 0x6e, 0x3a, 0x77, 0x72, 0x69, 
-	0x74, 0x65, 0x28, 0x77, 0x72, 0x69, 0x74, 0x65, 0x62, 0x69, 0x6e, 0x2e, 0x75, 0x69, 0x6e, 0x74, 
-	0x33, 0x32, 0x28, 0x76, 0x29, 0x29, 0xa, 0x9, 0x65, 0x6e, 0x64, 0xa, 0x65, 0x6e, 0x64, 0xa, 
-	0xa, 0x66, 0x75, 0x6e, 0x63, 0x74, 0x69, 0x6f, 0x6e, 0x20, 0x61, 0x73, 0x73, 0x65, 0x6d, 0x62, 
-	0x6c, 0x65, 0x28, 0x61, 0x73, 0x6d, 0x2c, 0x20, 0x64, 0x65, 0x73, 0x74, 0x29, 0xa, 0x9, 0x6c, 
-	0x6f, 0x63, 0x61, 0x6c, 0x20, 0x62, 0x69, 0x6e, 0x20, 0x3d, 0x20, 0x7b, 0xa, 0x9, 0x9, 0x64, 
-	0x61, 0x74, 0x61, 0x20, 0x3d, 0x20, 0x27, 0x27, 0x2c, 0xa, 0x9, 0x9, 0x77, 0x72, 0x69, 0x74, 
-	0x65, 0x20, 0x3d, 0x20, 0x66, 0x75, 0x6e, 0x63, 0x74, 0x69, 0x6f, 0x6e, 0x28, 0x73, 0x65, 0x6c, 
-	0x66, 0x2c, 0x20, 0x73, 0x74, 0x72, 0x29, 0xa, 0x9, 0x9, 0x9, 0x73, 0x65, 0x6c, 0x66, 0x2e, 
-	0x64, 0x61, 0x74, 0x61, 0x20, 0x3d, 0x20, 0x73, 0x65, 0x6c, 0x66, 0x2e, 0x64, 0x61, 0x74, 0x61, 
-	0x20, 0x2e, 0x2e, 0x20, 0x73, 0x74, 0x72, 0xa, 0x9, 0x9, 0x65, 0x6e, 0x64, 0xa, 0x9, 0x7d, 
-	0xa, 0xa, 0x9, 0x62, 0x69, 0x6e, 0x3a, 0x77, 0x72, 0x69, 0x74, 0x65, 0x28, 0x77, 0x72, 0x69, 
-	0x74, 0x65, 0x62, 0x69, 0x6e, 0x2e, 0x68, 0x65, 0x61, 0x64, 0x65, 0x72, 0x28, 0x53, 0x41, 0x55, 
-	0x52, 0x55, 0x53, 0x5f, 0x56, 0x45, 0x52, 0x53, 0x49, 0x4f, 0x4e, 0x5b, 0x31, 0x5d, 0x2c, 0x20, 
-	0x53, 0x41, 0x55, 0x52, 0x55, 0x53, 0x5f, 0x56, 0x45, 0x52, 0x53, 0x49, 0x4f, 0x4e, 0x5b, 0x32, 
-	0x5d, 0x29, 0x29, 0xa, 0x9, 0x61, 0x73, 0x6d, 0x5f, 0x66, 0x75, 0x6e, 0x63, 0x28, 0x61, 0x73, 
-	0x6d, 0x2c, 0x20, 0x62, 0x69, 0x6e, 0x29, 0xa, 0x9, 0x72, 0x65, 0x74, 0x75, 0x72, 0x6e, 0x20, 
-	0x62, 0x69, 0x6e, 0x2e, 0x64, 0x61, 0x74, 0x61, 0xa, 0x65, 0x6e, 0x64, 0xa, 0xa, 0x65, 0x6e, 
-	0x64, 0xa, 0xa, 0xa, 0x53, 0x41, 0x55, 0x52, 0x55, 0x53, 0x5f, 0x56, 0x45, 0x52, 0x53, 0x49, 
-	0x4f, 0x4e, 0x20, 0x3d, 0x20, 0x7b, 0x30, 0x2c, 0x20, 0x30, 0x2c, 0x20, 0x31, 0x7d, 0xa, 0x53, 
-	0x41, 0x55, 0x52, 0x55, 0x53, 0x5f, 0x56, 0x45, 0x52, 0x53, 0x49, 0x4f, 0x4e, 0x5f, 0x53, 0x54, 
-	0x52, 0x49, 0x4e, 0x47, 0x20, 0x3d, 0x20, 0x73, 0x74, 0x72, 0x69, 0x6e, 0x67, 0x2e, 0x66, 0x6f, 
-	0x72, 0x6d, 0x61, 0x74, 0x28, 0x27, 0x25, 0x69, 0x2e, 0x25, 0x69, 0x2e, 0x25, 0x69, 0x27, 0x2c, 
-	0x20, 0x75, 0x6e, 0x70, 0x61, 0x63, 0x6b, 0x28, 0x53, 0x41, 0x55, 0x52, 0x55, 0x53, 0x5f, 0x56, 
-	0x45, 0x52, 0x53, 0x49, 0x4f, 0x4e, 0x29, 0x29, 0xa, 0xa, 0x66, 0x75, 0x6e, 0x63, 0x74, 0x69, 
-	0x6f, 0x6e, 0x20, 0x67, 0x65, 0x74, 0x5f, 0x66, 0x69, 0x6c, 0x65, 0x5f, 0x70, 0x61, 0x74, 0x68, 
-	0x28, 0x73, 0x74, 0x72, 0x29, 0xa, 0x9, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x20, 0x72, 0x6f, 0x6f, 
-	0x74, 0x5f, 0x70, 0x61, 0x74, 0x68, 0x20, 0x3d, 0x20, 0x73, 0x74, 0x72, 0xa, 0x9, 0x69, 0x66, 
-	0x20, 0x73, 0x74, 0x72, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x9, 0x9, 0x6c, 0x6f, 0x63, 0x61, 
-	0x6c, 0x20, 0x69, 0x6e, 0x64, 0x65, 0x78, 0x20, 0x3d, 0x20, 0x73, 0x74, 0x72, 0x3a, 0x72, 0x65, 
-	0x76, 0x65, 0x72, 0x73, 0x65, 0x28, 0x29, 0x3a, 0x66, 0x69, 0x6e, 0x64, 0x28, 0x27, 0x2f, 0x27, 
-	0x2c, 0x20, 0x31, 0x2c, 0x20, 0x74, 0x72, 0x75, 0x65, 0x29, 0xa, 0x9, 0x9, 0x72, 0x6f, 0x6f, 
-	0x74, 0x5f, 0x70, 0x61, 0x74, 0x68, 0x20, 0x3d, 0x20, 0x69, 0x6e, 0x64, 0x65, 0x78, 0x20, 0x61, 
-	0x6e, 0x64, 0x20, 0x73, 0x74, 0x72, 0x3a, 0x73, 0x75, 0x62, 0x28, 0x31, 0x2c, 0x20, 0x2d, 0x69, 
-	0x6e, 0x64, 0x65, 0x78, 0x29, 0x20, 0x6f, 0x72, 0x20, 0x27, 0x2e, 0x27, 0xa, 0x9, 0x65, 0x6e, 
-	0x64, 0xa, 0x9, 0x72, 0x65, 0x74, 0x75, 0x72, 0x6e, 0x20, 0x72, 0x6f, 0x6f, 0x74, 0x5f, 0x70, 
-	0x61, 0x74, 0x68, 0xa, 0x65, 0x6e, 0x64, 0xa, 0xa, 0x66, 0x75, 0x6e, 0x63, 0x74, 0x69, 0x6f, 
-	0x6e, 0x20, 0x72, 0x65, 0x70, 0x6c, 0x28, 0x73, 0x72, 0x63, 0x2c, 0x20, 0x6e, 0x61, 0x6d, 0x65, 
-	0x2c, 0x20, 0x70, 0x61, 0x74, 0x68, 0x2c, 0x20, 0x61, 0x73, 0x6d, 0x5f, 0x6f, 0x75, 0x74, 0x29, 
+	0x72, 0x73, 0x28, 0x61, 0x73, 0x6d, 0x2e, 0x69, 0x6e, 0x73, 0x74, 0x72, 0x75, 0x63, 0x74, 0x69, 
+	0x6f, 0x6e, 0x73, 0x29, 0x20, 0x64, 0x6f, 0xa, 0x9, 0x9, 0x69, 0x66, 0x20, 0x76, 0x5b, 0x31, 
+	0x5d, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x54, 0x45, 0x53, 0x54, 0x27, 0x20, 0x6f, 0x72, 0x20, 0x76, 
+	0x5b, 0x31, 0x5d, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x4a, 0x4d, 0x50, 0x27, 0x20, 0x6f, 0x72, 0x20, 
+	0x76, 0x5b, 0x31, 0x5d, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x46, 0x4f, 0x52, 0x27, 0x20, 0x6f, 0x72, 
+	0x20, 0x76, 0x5b, 0x31, 0x5d, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x46, 0x4f, 0x52, 0x4c, 0x4f, 0x4f, 
+	0x50, 0x27, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x9, 0x9, 0x9, 0x74, 0x61, 0x72, 0x67, 0x65, 
+	0x74, 0x73, 0x5b, 0x76, 0x5b, 0x33, 0x5d, 0x5d, 0x20, 0x3d, 0x20, 0x74, 0x72, 0x75, 0x65, 0xa, 
+	0x9, 0x9, 0x65, 0x6e, 0x64, 0xa, 0x9, 0x65, 0x6e, 0x64, 0xa, 0x9, 0x72, 0x65, 0x74, 0x75, 
+	0x72, 0x6e, 0x20, 0x74, 0x61, 0x72, 0x67, 0x65, 0x74, 0x73, 0xa, 0x65, 0x6e, 0x64, 0xa, 0xa, 
+	0x2d, 0x2d, 0x20, 0x54, 0x68, 0x65, 0x20, 0x43, 0x20, 0x65, 0x78, 0x70, 0x72, 0x65, 0x73, 0x73, 
+	0x69, 0x6f, 0x6e, 0x20, 0x66, 0x6f, 0x72, 0x20, 0x61, 0x20, 0x63, 0x6f, 0x6d, 0x70, 0x61, 0x72, 
+	0x65, 0x20, 0x6f, 0x72, 0x20, 0x45, 0x51, 0x20, 0x6f, 0x70, 0x65, 0x72, 0x61, 0x6e, 0x64, 0x20, 
+	0x66, 0x6f, 0x72, 0x6d, 0x2c, 0x20, 0x66, 0x6f, 0x72, 0x20, 0x66, 0x75, 0x73, 0x69, 0x6e, 0x67, 
+	0x20, 0x77, 0x69, 0x74, 0x68, 0x20, 0x61, 0xa, 0x2d, 0x2d, 0x20, 0x66, 0x6f, 0x6c, 0x6c, 0x6f, 
+	0x77, 0x69, 0x6e, 0x67, 0x20, 0x54, 0x45, 0x53, 0x54, 0x2e, 0x20, 0x4e, 0x69, 0x6c, 0x20, 0x69, 
+	0x66, 0x20, 0x74, 0x68, 0x65, 0x20, 0x66, 0x6f, 0x72, 0x6d, 0x20, 0x68, 0x61, 0x73, 0x20, 0x6e, 
+	0x6f, 0x20, 0x65, 0x78, 0x70, 0x72, 0x65, 0x73, 0x73, 0x69, 0x6f, 0x6e, 0x2e, 0xa, 0x6c, 0x6f, 
+	0x63, 0x61, 0x6c, 0x20, 0x66, 0x75, 0x6e, 0x63, 0x74, 0x69, 0x6f, 0x6e, 0x20, 0x63, 0x6f, 0x6e, 
+	0x64, 0x69, 0x74, 0x69, 0x6f, 0x6e, 0x28, 0x61, 0x73, 0x6d, 0x2c, 0x20, 0x69, 0x6e, 0x73, 0x74, 
+	0x2c, 0x20, 0x64, 0x65, 0x70, 0x74, 0x68, 0x29, 0xa, 0x9, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x20, 
+	0x6f, 0x70, 0x20, 0x3d, 0x20, 0x69, 0x6e, 0x73, 0x74, 0x5b, 0x31, 0x5d, 0xa, 0x9, 0x69, 0x66, 
+	0x20, 0x6f, 0x70, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x45, 0x51, 0x5f, 0x4c, 0x4c, 0x27, 0x20, 0x74, 
+	0x68, 0x65, 0x6e, 0xa, 0x9, 0x9, 0x72, 0x65, 0x74, 0x75, 0x72, 0x6e, 0x20, 0x73, 0x74, 0x72, 
+	0x69, 0x6e, 0x67, 0x2e, 0x66, 0x6f, 0x72, 0x6d, 0x61, 0x74, 0x28, 0x27, 0x73, 0x75, 0x5f, 0x65, 
+	0x71, 0x75, 0x61, 0x6c, 0x28, 0x73, 0x2c, 0x20, 0x25, 0x69, 0x2c, 0x20, 0x25, 0x69, 0x29, 0x27, 
+	0x2c, 0x20, 0x69, 0x6e, 0x73, 0x74, 0x5b, 0x32, 0x5d, 0x20, 0x2d, 0x20, 0x64, 0x65, 0x70, 0x74, 
+	0x68, 0x2c, 0x20, 0x69, 0x6e, 0x73, 0x74, 0x5b, 0x33, 0x5d, 0x20, 0x2d, 0x20, 0x64, 0x65, 0x70, 
+	0x74, 0x68, 0x29, 0xa, 0x9, 0x65, 0x6c, 0x73, 0x65, 0x69, 0x66, 0x20, 0x6f, 0x70, 0x20, 0x3d, 
+	0x3d, 0x20, 0x27, 0x45, 0x51, 0x5f, 0x4c, 0x4b, 0x27, 0x20, 0x61, 0x6e, 0x64, 0x20, 0x69, 0x73, 
+	0x5f, 0x6e, 0x75, 0x6d, 0x62, 0x65, 0x72, 0x5f, 0x63, 0x6f, 0x6e, 0x73, 0x74, 0x28, 0x61, 0x73, 
+	0x6d, 0x2c, 0x20, 0x69, 0x6e, 0x73, 0x74, 0x5b, 0x33, 0x5d, 0x29, 0x20, 0x74, 0x68, 0x65, 0x6e, 
+	0xa, 0x9, 0x9, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x20, 0x69, 0x64, 0x78, 0x20, 0x3d, 0x20, 0x69, 
+	0x6e, 0x73, 0x74, 0x5b, 0x32, 0x5d, 0x20, 0x2d, 0x20, 0x64, 0x65, 0x70, 0x74, 0x68, 0xa, 0x9, 
+	0x9, 0x72, 0x65, 0x74, 0x75, 0x72, 0x6e, 0x20, 0x73, 0x74, 0x72, 0x69, 0x6e, 0x67, 0x2e, 0x66, 
+	0x6f, 0x72, 0x6d, 0x61, 0x74, 0x28, 0x27, 0x28, 0x73, 0x75, 0x5f, 0x74, 0x79, 0x70, 0x65, 0x28, 
+	0x73, 0x2c, 0x20, 0x25, 0x69, 0x29, 0x20, 0x3d, 0x3d, 0x20, 0x53, 0x55, 0x5f, 0x4e, 0x55, 0x4d, 
+	0x42, 0x45, 0x52, 0x20, 0x26, 0x26, 0x20, 0x73, 0x75, 0x5f, 0x74, 0x6f, 0x6e, 0x75, 0x6d, 0x62, 
+	0x65, 0x72, 0x28, 0x73, 0x2c, 0x20, 0x25, 0x69, 0x29, 0x20, 0x3d, 0x3d, 0x20, 0x25, 0x73, 0x29, 
+	0x27, 0x2c, 0x20, 0x69, 0x64, 0x78, 0x2c, 0x20, 0x69, 0x64, 0x78, 0x2c, 0x20, 0x63, 0x5f, 0x6e, 
+	0x75, 0x6d, 0x62, 0x65, 0x72, 0x28, 0x61, 0x73, 0x6d, 0x2e, 0x63, 0x6f, 0x6e, 0x73, 0x74, 0x61, 
+	0x6e, 0x74, 0x73, 0x5b, 0x69, 0x6e, 0x73, 0x74, 0x5b, 0x33, 0x5d, 0x20, 0x2b, 0x20, 0x31, 0x5d, 
+	0x29, 0x29, 0xa, 0x9, 0x65, 0x6c, 0x73, 0x65, 0x69, 0x66, 0x20, 0x73, 0x74, 0x72, 0x69, 0x6e, 
+	0x67, 0x2e, 0x66, 0x69, 0x6e, 0x64, 0x28, 0x6f, 0x70, 0x2c, 0x20, 0x27, 0x5e, 0x4c, 0x45, 0x53, 
+	0x53, 0x5f, 0x27, 0x29, 0x20, 0x6f, 0x72, 0x20, 0x73, 0x74, 0x72, 0x69, 0x6e, 0x67, 0x2e, 0x66, 
+	0x69, 0x6e, 0x64, 0x28, 0x6f, 0x70, 0x2c, 0x20, 0x27, 0x5e, 0x4c, 0x45, 0x51, 0x55, 0x41, 0x4c, 
+	0x5f, 0x27, 0x29, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x9, 0x9, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 
+	0x20, 0x61, 0x2c, 0x20, 0x62, 0x20, 0x3d, 0x20, 0x6e, 0x75, 0x6d, 0x62, 0x65, 0x72, 0x5f, 0x6f, 
+	0x70, 0x65, 0x72, 0x61, 0x6e, 0x64, 0x73, 0x28, 0x61, 0x73, 0x6d, 0x2c, 0x20, 0x69, 0x6e, 0x73, 
+	0x74, 0x2c, 0x20, 0x64, 0x65, 0x70, 0x74, 0x68, 0x29, 0xa, 0x9, 0x9, 0x69, 0x66, 0x20, 0x61, 
+	0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x9, 0x9, 0x9, 0x72, 0x65, 0x74, 0x75, 0x72, 0x6e, 0x20, 
+	0x73, 0x74, 0x72, 0x69, 0x6e, 0x67, 0x2e, 0x66, 0x6f, 0x72, 0x6d, 0x61, 0x74, 0x28, 0x27, 0x25, 
+	0x73, 0x20, 0x25, 0x73, 0x20, 0x25, 0x73, 0x27, 0x2c, 0x20, 0x61, 0x2c, 0x20, 0x61, 0x72, 0x69, 
+	0x74, 0x68, 0x5b, 0x6f, 0x70, 0x5d, 0x2c, 0x20, 0x62, 0x29, 0xa, 0x9, 0x9, 0x65, 0x6e, 0x64, 
+	0xa, 0x9, 0x65, 0x6e, 0x64, 0xa, 0x65, 0x6e, 0x64, 0xa, 0xa, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 
+	0x20, 0x66, 0x75, 0x6e, 0x63, 0x74, 0x69, 0x6f, 0x6e, 0x20, 0x74, 0x72, 0x61, 0x6e, 0x73, 0x6c, 
+	0x61, 0x74, 0x61, 0x62, 0x6c, 0x65, 0x28, 0x61, 0x73, 0x6d, 0x29, 0xa, 0x9, 0x69, 0x66, 0x20, 
+	0x6e, 0x6f, 0x74, 0x20, 0x61, 0x73, 0x6d, 0x2e, 0x70, 0x61, 0x72, 0x65, 0x6e, 0x74, 0x20, 0x6f, 
+	0x72, 0x20, 0x23, 0x61, 0x73, 0x6d, 0x2e, 0x75, 0x70, 0x20, 0x3e, 0x20, 0x30, 0x20, 0x6f, 0x72, 
+	0x20, 0x23, 0x61, 0x73, 0x6d, 0x2e, 0x70, 0x72, 0x6f, 0x74, 0x6f, 0x74, 0x79, 0x70, 0x65, 0x73, 
+	0x20, 0x3e, 0x20, 0x30, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x9, 0x9, 0x72, 0x65, 0x74, 0x75, 
+	0x72, 0x6e, 0x20, 0x66, 0x61, 0x6c, 0x73, 0x65, 0xa, 0x9, 0x65, 0x6e, 0x64, 0xa, 0x9, 0x66, 
+	0x6f, 0x72, 0x20, 0x5f, 0x2c, 0x76, 0x20, 0x69, 0x6e, 0x20, 0x69, 0x70, 0x61, 0x69, 0x72, 0x73, 
+	0x28, 0x61, 0x73, 0x6d, 0x2e, 0x69, 0x6e, 0x73, 0x74, 0x72, 0x75, 0x63, 0x74, 0x69, 0x6f, 0x6e, 
+	0x73, 0x29, 0x20, 0x64, 0x6f, 0xa, 0x9, 0x9, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x20, 0x6f, 0x70, 
+	0x20, 0x3d, 0x20, 0x76, 0x5b, 0x31, 0x5d, 0xa, 0x9, 0x9, 0x2d, 0x2d, 0x20, 0x41, 0x20, 0x6e, 
+	0x61, 0x74, 0x69, 0x76, 0x65, 0x20, 0x63, 0x61, 0x6e, 0x27, 0x74, 0x20, 0x68, 0x61, 0x6e, 0x64, 
+	0x20, 0x61, 0x20, 0x74, 0x61, 0x69, 0x6c, 0x20, 0x63, 0x61, 0x6c, 0x6c, 0x20, 0x62, 0x61, 0x63, 
+	0x6b, 0x20, 0x74, 0x6f, 0x20, 0x74, 0x68, 0x65, 0x20, 0x56, 0x4d, 0x2c, 0x20, 0x73, 0x6f, 0x20, 
+	0x61, 0x20, 0x6c, 0x61, 0x6d, 0x62, 0x64, 0x61, 0x20, 0x74, 0x68, 0x61, 0x74, 0xa, 0x9, 0x9, 
+	0x2d, 0x2d, 0x20, 0x6d, 0x61, 0x6b, 0x65, 0x73, 0x20, 0x6f, 0x6e, 0x65, 0x20, 0x73, 0x74, 0x61, 
+	0x79, 0x73, 0x20, 0x62, 0x79, 0x74, 0x65, 0x63, 0x6f, 0x64, 0x65, 0x20, 0x61, 0x6e, 0x64, 0x20, 
+	0x74, 0x68, 0x65, 0x20, 0x63, 0x61, 0x6c, 0x6c, 0x20, 0x73, 0x74, 0x61, 0x79, 0x73, 0x20, 0x70, 
+	0x72, 0x6f, 0x70, 0x65, 0x72, 0x2e, 0xa, 0x9, 0x9, 0x69, 0x66, 0x20, 0x6f, 0x70, 0x20, 0x3d, 
+	0x3d, 0x20, 0x27, 0x4c, 0x55, 0x50, 0x27, 0x20, 0x6f, 0x72, 0x20, 0x6f, 0x70, 0x20, 0x3d, 0x3d, 
+	0x20, 0x27, 0x4c, 0x41, 0x4d, 0x42, 0x44, 0x41, 0x27, 0x20, 0x6f, 0x72, 0x20, 0x6f, 0x70, 0x20, 
+	0x3d, 0x3d, 0x20, 0x27, 0x54, 0x43, 0x41, 0x4c, 0x4c, 0x27, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 
+	0x9, 0x9, 0x9, 0x72, 0x65, 0x74, 0x75, 0x72, 0x6e, 0x20, 0x66, 0x61, 0x6c, 0x73, 0x65, 0xa, 
+	0x9, 0x9, 0x65, 0x6c, 0x73, 0x65, 0x69, 0x66, 0x20, 0x61, 0x72, 0x69, 0x74, 0x68, 0x5b, 0x6f, 
+	0x70, 0x5d, 0x20, 0x61, 0x6e, 0x64, 0x20, 0x73, 0x74, 0x72, 0x69, 0x6e, 0x67, 0x2e, 0x66, 0x69, 
+	0x6e, 0x64, 0x28, 0x6f, 0x70, 0x2c, 0x20, 0x27, 0x5f, 0x5b, 0x4c, 0x4b, 0x5d, 0x5b, 0x4c, 0x4b, 
+	0x5d, 0x24, 0x27, 0x29, 0x20, 0x61, 0x6e, 0x64, 0x20, 0x6e, 0x6f, 0x74, 0x20, 0x6e, 0x75, 0x6d, 
+	0x62, 0x65, 0x72, 0x5f, 0x6f, 0x70, 0x65, 0x72, 0x61, 0x6e, 0x64, 0x73, 0x28, 0x61, 0x73, 0x6d, 
+	0x2c, 0x20, 0x76, 0x2c, 0x20, 0x30, 0x29, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x9, 0x9, 0x9, 
+	0x72, 0x65, 0x74, 0x75, 0x72, 0x6e, 0x20, 0x66, 0x61, 0x6c, 0x73, 0x65, 0xa, 0x9, 0x9, 0x65, 
+	0x6e, 0x64, 0xa, 0x9, 0x65, 0x6e, 0x64, 0xa, 0x9, 0x72, 0x65, 0x74, 0x75, 0x72, 0x6e, 0x20, 
+	0x74, 0x72, 0x75, 0x65, 0xa, 0x65, 0x6e, 0x64, 0xa, 0xa, 0x2d, 0x2d, 0x20, 0x45, 0x6d, 0x69, 
+	0x74, 0x73, 0x20, 0x74, 0x68, 0x65, 0x20, 0x62, 0x6f, 0x64, 0x79, 0x20, 0x6f, 0x66, 0x20, 0x6f, 
+	0x6e, 0x65, 0x20, 0x6c, 0x61, 0x6d, 0x62, 0x64, 0x61, 0x2e, 0x20, 0x54, 0x68, 0x65, 0x20, 0x56, 
+	0x4d, 0x20, 0x73, 0x74, 0x61, 0x63, 0x6b, 0x20, 0x64, 0x65, 0x70, 0x74, 0x68, 0x20, 0x72, 0x65, 
+	0x6c, 0x61, 0x74, 0x69, 0x76, 0x65, 0x20, 0x74, 0x6f, 0x20, 0x74, 0x68, 0x65, 0x20, 0x66, 0x72, 
+	0x61, 0x6d, 0x65, 0xa, 0x2d, 0x2d, 0x20, 0x62, 0x61, 0x73, 0x65, 0x20, 0x69, 0x73, 0x20, 0x6b, 
+	0x6e, 0x6f, 0x77, 0x6e, 0x20, 0x61, 0x74, 0x20, 0x65, 0x76, 0x65, 0x72, 0x79, 0x20, 0x69, 0x6e, 
+	0x73, 0x74, 0x72, 0x75, 0x63, 0x74, 0x69, 0x6f, 0x6e, 0x2c, 0x20, 0x73, 0x6f, 0x20, 0x6c, 0x6f, 
+	0x63, 0x61, 0x6c, 0x73, 0x20, 0x62, 0x65, 0x63, 0x6f, 0x6d, 0x65, 0x20, 0x66, 0x69, 0x78, 0x65, 
+	0x64, 0x20, 0x6e, 0x65, 0x67, 0x61, 0x74, 0x69, 0x76, 0x65, 0xa, 0x2d, 0x2d, 0x20, 0x69, 0x6e, 
+	0x64, 0x69, 0x63, 0x65, 0x73, 0x2e, 0xa, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x20, 0x66, 0x75, 0x6e, 
+	0x63, 0x74, 0x69, 0x6f, 0x6e, 0x20, 0x74, 0x72, 0x61, 0x6e, 0x73, 0x6c, 0x61, 0x74, 0x65, 0x28, 
+	0x61, 0x73, 0x6d, 0x2c, 0x20, 0x6e, 0x61, 0x6d, 0x65, 0x29, 0xa, 0x9, 0x6c, 0x6f, 0x63, 0x61, 
+	0x6c, 0x20, 0x63, 0x6f, 0x64, 0x65, 0x20, 0x3d, 0x20, 0x7b, 0x7d, 0xa, 0x9, 0x6c, 0x6f, 0x63, 
+	0x61, 0x6c, 0x20, 0x64, 0x65, 0x70, 0x74, 0x68, 0x20, 0x3d, 0x20, 0x7b, 0x7d, 0xa, 0x9, 0x6c, 
+	0x6f, 0x63, 0x61, 0x6c, 0x20, 0x74, 0x61, 0x72, 0x67, 0x65, 0x74, 0x73, 0x20, 0x3d, 0x20, 0x6a, 
+	0x75, 0x6d, 0x70, 0x5f, 0x74, 0x61, 0x72, 0x67, 0x65, 0x74, 0x73, 0x28, 0x61, 0x73, 0x6d, 0x29, 
+	0xa, 0x9, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x20, 0x6a, 0x75, 0x6d, 0x70, 0x65, 0x64, 0x20, 0x3d, 
+	0x20, 0x7b, 0x7d, 0xa, 0x9, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x20, 0x6c, 0x61, 0x62, 0x65, 0x6c, 
+	0x73, 0x20, 0x3d, 0x20, 0x7b, 0x7d, 0xa, 0x9, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x20, 0x6c, 0x69, 
+	0x6e, 0x65, 0xa, 0xa, 0x9, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x20, 0x66, 0x75, 0x6e, 0x63, 0x74, 
+	0x69, 0x6f, 0x6e, 0x20, 0x65, 0x6d, 0x69, 0x74, 0x28, 0x66, 0x6d, 0x74, 0x2c, 0x20, 0x2e, 0x2e, 
+	0x2e, 0x29, 0xa, 0x9, 0x9, 0x74, 0x61, 0x62, 0x6c, 0x65, 0x2e, 0x69, 0x6e, 0x73, 0x65, 0x72, 
+	0x74, 0x28, 0x63, 0x6f, 0x64, 0x65, 0x2c, 0x20, 0x27, 0x5c, 0x74, 0x27, 0x20, 0x2e, 0x2e, 0x20, 
+	0x73, 0x74, 0x72, 0x69, 0x6e, 0x67, 0x2e, 0x66, 0x6f, 0x72, 0x6d, 0x61, 0x74, 0x28, 0x66, 0x6d, 
+	0x74, 0x2c, 0x20, 0x2e, 0x2e, 0x2e, 0x29, 0x29, 0xa, 0x9, 0x65, 0x6e, 0x64, 0xa, 0xa, 0x9, 
+	0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x20, 0x66, 0x75, 0x6e, 0x63, 0x74, 0x69, 0x6f, 0x6e, 0x20, 0x72, 
+	0x65, 0x61, 0x63, 0x68, 0x28, 0x70, 0x63, 0x2c, 0x20, 0x64, 0x29, 0xa, 0x9, 0x9, 0x61, 0x73, 
+	0x73, 0x65, 0x72, 0x74, 0x28, 0x6e, 0x6f, 0x74, 0x20, 0x64, 0x65, 0x70, 0x74, 0x68, 0x5b, 0x70, 
+	0x63, 0x5d, 0x20, 0x6f, 0x72, 0x20, 0x64, 0x65, 0x70, 0x74, 0x68, 0x5b, 0x70, 0x63, 0x5d, 0x20, 
+	0x3d, 0x3d, 0x20, 0x64, 0x2c, 0x20, 0x27, 0x41, 0x4f, 0x54, 0x20, 0x73, 0x74, 0x61, 0x63, 0x6b, 
+	0x20, 0x64, 0x65, 0x70, 0x74, 0x68, 0x20, 0x6d, 0x69, 0x73, 0x6d, 0x61, 0x74, 0x63, 0x68, 0x27, 
+	0x29, 0xa, 0x9, 0x9, 0x64, 0x65, 0x70, 0x74, 0x68, 0x5b, 0x70, 0x63, 0x5d, 0x20, 0x3d, 0x20, 
+	0x64, 0xa, 0x9, 0x65, 0x6e, 0x64, 0xa, 0xa, 0x9, 0x2d, 0x2d, 0x20, 0x4c, 0x69, 0x6b, 0x65, 
+	0x20, 0x72, 0x65, 0x61, 0x63, 0x68, 0x2c, 0x20, 0x66, 0x6f, 0x72, 0x20, 0x74, 0x68, 0x65, 0x20, 
+	0x74, 0x61, 0x72, 0x67, 0x65, 0x74, 0x20, 0x6f, 0x66, 0x20, 0x61, 0x20, 0x6a, 0x75, 0x6d, 0x70, 
+	0x20, 0x74, 0x68, 0x61, 0x74, 0x20, 0x69, 0x73, 0x20, 0x65, 0x6d, 0x69, 0x74, 0x74, 0x65, 0x64, 
+	0x2e, 0xa, 0x9, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x20, 0x66, 0x75, 0x6e, 0x63, 0x74, 0x69, 0x6f, 
+	0x6e, 0x20, 0x62, 0x72, 0x61, 0x6e, 0x63, 0x68, 0x28, 0x70, 0x63, 0x2c, 0x20, 0x64, 0x29, 0xa, 
+	0x9, 0x9, 0x6a, 0x75, 0x6d, 0x70, 0x65, 0x64, 0x5b, 0x70, 0x63, 0x5d, 0x20, 0x3d, 0x20, 0x74, 
+	0x72, 0x75, 0x65, 0xa, 0x9, 0x9, 0x72, 0x65, 0x61, 0x63, 0x68, 0x28, 0x70, 0x63, 0x2c, 0x20, 
+	0x64, 0x29, 0xa, 0x9, 0x65, 0x6e, 0x64, 0xa, 0xa, 0x9, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x20, 
+	0x66, 0x75, 0x6e, 0x63, 0x74, 0x69, 0x6f, 0x6e, 0x20, 0x67, 0x6f, 0x74, 0x6f, 0x5f, 0x70, 0x63, 
+	0x28, 0x66, 0x72, 0x6f, 0x6d, 0x2c, 0x20, 0x74, 0x6f, 0x29, 0xa, 0x9, 0x9, 0x69, 0x66, 0x20, 
+	0x74, 0x6f, 0x20, 0x3c, 0x3d, 0x20, 0x66, 0x72, 0x6f, 0x6d, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 
+	0x9, 0x9, 0x9, 0x65, 0x6d, 0x69, 0x74, 0x28, 0x27, 0x73, 0x75, 0x5f, 0x73, 0x61, 0x66, 0x65, 
+	0x70, 0x6f, 0x69, 0x6e, 0x74, 0x28, 0x73, 0x29, 0x3b, 0x27, 0x29, 0xa, 0x9, 0x9, 0x65, 0x6e, 
+	0x64, 0xa, 0x9, 0x9, 0x65, 0x6d, 0x69, 0x74, 0x28, 0x27, 0x67, 0x6f, 0x74, 0x6f, 0x20, 0x4c, 
+	0x25, 0x69, 0x3b, 0x27, 0x2c, 0x20, 0x74, 0x6f, 0x29, 0xa, 0x9, 0x65, 0x6e, 0x64, 0xa, 0xa, 
+	0x9, 0x74, 0x61, 0x62, 0x6c, 0x65, 0x2e, 0x69, 0x6e, 0x73, 0x65, 0x72, 0x74, 0x28, 0x63, 0x6f, 
+	0x64, 0x65, 0x2c, 0x20, 0x73, 0x74, 0x72, 0x69, 0x6e, 0x67, 0x2e, 0x66, 0x6f, 0x72, 0x6d, 0x61, 
+	0x74, 0x28, 0x27, 0x73, 0x74, 0x61, 0x74, 0x69, 0x63, 0x20, 0x69, 0x6e, 0x74, 0x20, 0x5f, 0x5f, 
+	0x5f, 0x25, 0x73, 0x28, 0x73, 0x75, 0x5f, 0x73, 0x74, 0x61, 0x74, 0x65, 0x20, 0x2a, 0x73, 0x2c, 
+	0x20, 0x69, 0x6e, 0x74, 0x20, 0x6e, 0x61, 0x72, 0x67, 0x29, 0x20, 0x7b, 0x27, 0x2c, 0x20, 0x6e, 
+	0x61, 0x6d, 0x65, 0x29, 0x29, 0xa, 0x9, 0x69, 0x66, 0x20, 0x61, 0x73, 0x6d, 0x2e, 0x76, 0x61, 
+	0x72, 0x67, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x9, 0x9, 0x65, 0x6d, 0x69, 0x74, 0x28, 0x27, 
+	0x73, 0x75, 0x5f, 0x76, 0x65, 0x63, 0x74, 0x6f, 0x72, 0x28, 0x73, 0x2c, 0x20, 0x6e, 0x61, 0x72, 
+	0x67, 0x29, 0x3b, 0x27, 0x29, 0xa, 0x9, 0x65, 0x6c, 0x73, 0x65, 0xa, 0x9, 0x9, 0x65, 0x6d, 
+	0x69, 0x74, 0x28, 0x27, 0x69, 0x66, 0x20, 0x28, 0x6e, 0x61, 0x72, 0x67, 0x20, 0x21, 0x3d, 0x20, 
+	0x25, 0x69, 0x29, 0x20, 0x73, 0x75, 0x5f, 0x65, 0x72, 0x72, 0x6f, 0x72, 0x28, 0x73, 0x2c, 0x20, 
+	0x22, 0x42, 0x61, 0x64, 0x20, 0x6e, 0x75, 0x6d, 0x62, 0x65, 0x72, 0x20, 0x6f, 0x66, 0x20, 0x61, 
+	0x72, 0x67, 0x75, 0x6d, 0x65, 0x6e, 0x74, 0x73, 0x20, 0x74, 0x6f, 0x20, 0x66, 0x75, 0x6e, 0x63, 
+	0x74, 0x69, 0x6f, 0x6e, 0x21, 0x20, 0x45, 0x78, 0x70, 0x65, 0x63, 0x74, 0x65, 0x64, 0x20, 0x25, 
+	0x25, 0x69, 0x2c, 0x20, 0x62, 0x75, 0x74, 0x20, 0x67, 0x6f, 0x74, 0x20, 0x25, 0x25, 0x69, 0x2e, 
+	0x22, 0x2c, 0x20, 0x25, 0x69, 0x2c, 0x20, 0x6e, 0x61, 0x72, 0x67, 0x29, 0x3b, 0x27, 0x2c, 0x20, 
+	0x61, 0x73, 0x6d, 0x2e, 0x6e, 0x75, 0x6d, 0x5f, 0x61, 0x72, 0x67, 0x73, 0x2c, 0x20, 0x61, 0x73, 
+	0x6d, 0x2e, 0x6e, 0x75, 0x6d, 0x5f, 0x61, 0x72, 0x67, 0x73, 0x29, 0xa, 0x9, 0x65, 0x6e, 0x64, 
+	0xa, 0x9, 0x72, 0x65, 0x61, 0x63, 0x68, 0x28, 0x30, 0x2c, 0x20, 0x61, 0x73, 0x6d, 0x2e, 0x6e, 
+	0x75, 0x6d, 0x5f, 0x61, 0x72, 0x67, 0x73, 0x20, 0x2b, 0x20, 0x31, 0x29, 0xa, 0xa, 0x9, 0x6c, 
+	0x6f, 0x63, 0x61, 0x6c, 0x20, 0x69, 0x20, 0x3d, 0x20, 0x31, 0xa, 0x9, 0x77, 0x68, 0x69, 0x6c, 
+	0x65, 0x20, 0x69, 0x20, 0x3c, 0x3d, 0x20, 0x23, 0x61, 0x73, 0x6d, 0x2e, 0x69, 0x6e, 0x73, 0x74, 
+	0x72, 0x75, 0x63, 0x74, 0x69, 0x6f, 0x6e, 0x73, 0x20, 0x64, 0x6f, 0xa, 0x9, 0x9, 0x6c, 0x6f, 
+	0x63, 0x61, 0x6c, 0x20, 0x70, 0x63, 0x20, 0x3d, 0x20, 0x69, 0x20, 0x2d, 0x20, 0x31, 0xa, 0x9, 
+	0x9, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x20, 0x69, 0x6e, 0x73, 0x74, 0x20, 0x3d, 0x20, 0x61, 0x73, 
+	0x6d, 0x2e, 0x69, 0x6e, 0x73, 0x74, 0x72, 0x75, 0x63, 0x74, 0x69, 0x6f, 0x6e, 0x73, 0x5b, 0x69, 
+	0x5d, 0xa, 0x9, 0x9, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x20, 0x6f, 0x70, 0x2c, 0x20, 0x61, 0x2c, 
+	0x20, 0x62, 0x20, 0x3d, 0x20, 0x67, 0x65, 0x6e, 0x65, 0x72, 0x69, 0x63, 0x5b, 0x69, 0x6e, 0x73, 
+	0x74, 0x5b, 0x31, 0x5d, 0x5d, 0x20, 0x6f, 0x72, 0x20, 0x69, 0x6e, 0x73, 0x74, 0x5b, 0x31, 0x5d, 
+	0x2c, 0x20, 0x69, 0x6e, 0x73, 0x74, 0x5b, 0x32, 0x5d, 0x20, 0x6f, 0x72, 0x20, 0x30, 0x2c, 0x20, 
+	0x69, 0x6e, 0x73, 0x74, 0x5b, 0x33, 0x5d, 0x20, 0x6f, 0x72, 0x20, 0x30, 0xa, 0x9, 0x9, 0x6c, 
+	0x6f, 0x63, 0x61, 0x6c, 0x20, 0x64, 0x20, 0x3d, 0x20, 0x64, 0x65, 0x70, 0x74, 0x68, 0x5b, 0x70, 
+	0x63, 0x5d, 0xa, 0x9, 0x9, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x20, 0x6e, 0x65, 0x78, 0x74, 0x5f, 
+	0x64, 0x20, 0x3d, 0x20, 0x64, 0xa, 0x9, 0x9, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x20, 0x73, 0x69, 
+	0x7a, 0x65, 0x20, 0x3d, 0x20, 0x31, 0xa, 0xa, 0x9, 0x9, 0x69, 0x66, 0x20, 0x64, 0x20, 0x74, 
+	0x68, 0x65, 0x6e, 0xa, 0x9, 0x9, 0x9, 0x69, 0x66, 0x20, 0x74, 0x61, 0x72, 0x67, 0x65, 0x74, 
+	0x73, 0x5b, 0x70, 0x63, 0x5d, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x9, 0x9, 0x9, 0x9, 0x74, 
+	0x61, 0x62, 0x6c, 0x65, 0x2e, 0x69, 0x6e, 0x73, 0x65, 0x72, 0x74, 0x28, 0x63, 0x6f, 0x64, 0x65, 
+	0x2c, 0x20, 0x73, 0x74, 0x72, 0x69, 0x6e, 0x67, 0x2e, 0x66, 0x6f, 0x72, 0x6d, 0x61, 0x74, 0x28, 
+	0x27, 0x4c, 0x25, 0x69, 0x3a, 0x27, 0x2c, 0x20, 0x70, 0x63, 0x29, 0x29, 0xa, 0x9, 0x9, 0x9, 
+	0x9, 0x6c, 0x61, 0x62, 0x65, 0x6c, 0x73, 0x5b, 0x23, 0x63, 0x6f, 0x64, 0x65, 0x5d, 0x20, 0x3d, 
+	0x20, 0x70, 0x63, 0xa, 0x9, 0x9, 0x9, 0x65, 0x6e, 0x64, 0xa, 0x9, 0x9, 0x9, 0x69, 0x66, 
+	0x20, 0x61, 0x73, 0x6d, 0x2e, 0x6c, 0x69, 0x6e, 0x65, 0x6e, 0x72, 0x5b, 0x69, 0x5d, 0x20, 0x7e, 
+	0x3d, 0x20, 0x6c, 0x69, 0x6e, 0x65, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x9, 0x9, 0x9, 0x9, 
+	0x6c, 0x69, 0x6e, 0x65, 0x20, 0x3d, 0x20, 0x61, 0x73, 0x6d, 0x2e, 0x6c, 0x69, 0x6e, 0x65, 0x6e, 
+	0x72, 0x5b, 0x69, 0x5d, 0xa, 0x9, 0x9, 0x9, 0x9, 0x74, 0x61, 0x62, 0x6c, 0x65, 0x2e, 0x69, 
+	0x6e, 0x73, 0x65, 0x72, 0x74, 0x28, 0x63, 0x6f, 0x64, 0x65, 0x2c, 0x20, 0x73, 0x74, 0x72, 0x69, 
+	0x6e, 0x67, 0x2e, 0x66, 0x6f, 0x72, 0x6d, 0x61, 0x74, 0x28, 0x27, 0x23, 0x69, 0x66, 0x64, 0x65, 
+	0x66, 0x20, 0x53, 0x55, 0x5f, 0x4f, 0x50, 0x54, 0x5f, 0x43, 0x5f, 0x4c, 0x49, 0x4e, 0x45, 0x5c, 
+	0x6e, 0x5c, 0x74, 0x23, 0x6c, 0x69, 0x6e, 0x65, 0x20, 0x25, 0x69, 0x20, 0x22, 0x25, 0x73, 0x22, 
+	0x5c, 0x6e, 0x23, 0x65, 0x6e, 0x64, 0x69, 0x66, 0x27, 0x2c, 0x20, 0x6c, 0x69, 0x6e, 0x65, 0x2c, 
+	0x20, 0x61, 0x73, 0x6d, 0x2e, 0x6e, 0x61, 0x6d, 0x65, 0x29, 0x29, 0xa, 0x9, 0x9, 0x9, 0x65, 
+	0x6e, 0x64, 0xa, 0xa, 0x9, 0x9, 0x9, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x20, 0x6e, 0x78, 0x74, 
+	0x20, 0x3d, 0x20, 0x61, 0x73, 0x6d, 0x2e, 0x69, 0x6e, 0x73, 0x74, 0x72, 0x75, 0x63, 0x74, 0x69, 
+	0x6f, 0x6e, 0x73, 0x5b, 0x69, 0x20, 0x2b, 0x20, 0x31, 0x5d, 0xa, 0x9, 0x9, 0x9, 0x6c, 0x6f, 
+	0x63, 0x61, 0x6c, 0x20, 0x63, 0x6f, 0x6e, 0x64, 0x20, 0x3d, 0x20, 0x6e, 0x78, 0x74, 0x20, 0x61, 
+	0x6e, 0x64, 0x20, 0x6e, 0x78, 0x74, 0x5b, 0x31, 0x5d, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x54, 0x45, 
+	0x53, 0x54, 0x27, 0x20, 0x61, 0x6e, 0x64, 0x20, 0x63, 0x6f, 0x6e, 0x64, 0x69, 0x74, 0x69, 0x6f, 
+	0x6e, 0x28, 0x61, 0x73, 0x6d, 0x2c, 0x20, 0x69, 0x6e, 0x73, 0x74, 0x2c, 0x20, 0x64, 0x29, 0xa, 
+	0xa, 0x9, 0x9, 0x9, 0x69, 0x66, 0x20, 0x63, 0x6f, 0x6e, 0x64, 0x20, 0x74, 0x68, 0x65, 0x6e, 
+	0xa, 0x9, 0x9, 0x9, 0x9, 0x2d, 0x2d, 0x20, 0x41, 0x20, 0x63, 0x6f, 0x6d, 0x70, 0x61, 0x72, 
+	0x65, 0x20, 0x66, 0x6f, 0x6c, 0x6c, 0x6f, 0x77, 0x65, 0x64, 0x20, 0x62, 0x79, 0x20, 0x54, 0x45, 
+	0x53, 0x54, 0x20, 0x62, 0x72, 0x61, 0x6e, 0x63, 0x68, 0x65, 0x73, 0x20, 0x77, 0x69, 0x74, 0x68, 
+	0x6f, 0x75, 0x74, 0x20, 0x70, 0x75, 0x73, 0x68, 0x69, 0x6e, 0x67, 0x20, 0x74, 0x68, 0x65, 0x20, 
+	0x72, 0x65, 0x73, 0x75, 0x6c, 0x74, 0x2e, 0xa, 0x9, 0x9, 0x9, 0x9, 0x65, 0x6d, 0x69, 0x74, 
+	0x28, 0x27, 0x69, 0x66, 0x20, 0x28, 0x25, 0x73, 0x29, 0x20, 0x67, 0x6f, 0x74, 0x6f, 0x20, 0x4c, 
+	0x25, 0x69, 0x3b, 0x27, 0x2c, 0x20, 0x63, 0x6f, 0x6e, 0x64, 0x2c, 0x20, 0x6e, 0x78, 0x74, 0x5b, 
+	0x33, 0x5d, 0x29, 0xa, 0x9, 0x9, 0x9, 0x9, 0x62, 0x72, 0x61, 0x6e, 0x63, 0x68, 0x28, 0x6e, 
+	0x78, 0x74, 0x5b, 0x33, 0x5d, 0x2c, 0x20, 0x64, 0x29, 0xa, 0x9, 0x9, 0x9, 0x9, 0x69, 0x66, 
+	0x20, 0x74, 0x61, 0x72, 0x67, 0x65, 0x74, 0x73, 0x5b, 0x70, 0x63, 0x20, 0x2b, 0x20, 0x31, 0x5d, 
+	0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x9, 0x9, 0x9, 0x9, 0x9, 0x2d, 0x2d, 0x20, 0x53, 0x6f, 
+	0x6d, 0x65, 0x74, 0x68, 0x69, 0x6e, 0x67, 0x20, 0x6a, 0x75, 0x6d, 0x70, 0x73, 0x20, 0x74, 0x6f, 
+	0x20, 0x74, 0x68, 0x65, 0x20, 0x54, 0x45, 0x53, 0x54, 0x2c, 0x20, 0x77, 0x68, 0x69, 0x63, 0x68, 
+	0x20, 0x74, 0x68, 0x65, 0x6e, 0x20, 0x72, 0x75, 0x6e, 0x73, 0x20, 0x6f, 0x6e, 0x20, 0x69, 0x74, 
+	0x73, 0x20, 0x6f, 0x77, 0x6e, 0x2e, 0xa, 0x9, 0x9, 0x9, 0x9, 0x9, 0x65, 0x6d, 0x69, 0x74, 
+	0x28, 0x27, 0x67, 0x6f, 0x74, 0x6f, 0x20, 0x4c, 0x25, 0x69, 0x3b, 0x27, 0x2c, 0x20, 0x70, 0x63, 
+	0x20, 0x2b, 0x20, 0x32, 0x29, 0xa, 0x9, 0x9, 0x9, 0x9, 0x9, 0x74, 0x61, 0x72, 0x67, 0x65, 
+	0x74, 0x73, 0x5b, 0x70, 0x63, 0x20, 0x2b, 0x20, 0x32, 0x5d, 0x20, 0x3d, 0x20, 0x74, 0x72, 0x75, 
+	0x65, 0xa, 0x9, 0x9, 0x9, 0x9, 0x9, 0x62, 0x72, 0x61, 0x6e, 0x63, 0x68, 0x28, 0x70, 0x63, 
+	0x20, 0x2b, 0x20, 0x32, 0x2c, 0x20, 0x64, 0x29, 0xa, 0x9, 0x9, 0x9, 0x9, 0x9, 0x72, 0x65, 
+	0x61, 0x63, 0x68, 0x28, 0x70, 0x63, 0x20, 0x2b, 0x20, 0x31, 0x2c, 0x20, 0x64, 0x20, 0x2b, 0x20, 
+	0x31, 0x29, 0xa, 0x9, 0x9, 0x9, 0x9, 0x9, 0x6e, 0x65, 0x78, 0x74, 0x5f, 0x64, 0x20, 0x3d, 
+	0x20, 0x6e, 0x69, 0x6c, 0xa, 0x9, 0x9, 0x9, 0x9, 0x65, 0x6c, 0x73, 0x65, 0xa, 0x9, 0x9, 
+	0x9, 0x9, 0x9, 0x73, 0x69, 0x7a, 0x65, 0x20, 0x3d, 0x20, 0x32, 0xa, 0x9, 0x9, 0x9, 0x9, 
+	0x65, 0x6e, 0x64, 0xa, 0x9, 0x9, 0x9, 0x65, 0x6c, 0x73, 0x65, 0x69, 0x66, 0x20, 0x6f, 0x70, 
+	0x20, 0x3d, 0x3d, 0x20, 0x27, 0x50, 0x55, 0x53, 0x48, 0x27, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 
+	0x9, 0x9, 0x9, 0x9, 0x65, 0x6d, 0x69, 0x74, 0x28, 0x27, 0x25, 0x73, 0x27, 0x2c, 0x20, 0x70, 
+	0x75, 0x73, 0x68, 0x5f, 0x63, 0x6f, 0x6e, 0x73, 0x74, 0x28, 0x61, 0x73, 0x6d, 0x2c, 0x20, 0x61, 
+	0x29, 0x29, 0xa, 0x9, 0x9, 0x9, 0x9, 0x6e, 0x65, 0x78, 0x74, 0x5f, 0x64, 0x20, 0x3d, 0x20, 
+	0x64, 0x20, 0x2b, 0x20, 0x31, 0xa, 0x9, 0x9, 0x9, 0x65, 0x6c, 0x73, 0x65, 0x69, 0x66, 0x20, 
+	0x6f, 0x70, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x50, 0x4f, 0x50, 0x27, 0x20, 0x74, 0x68, 0x65, 0x6e, 
+	0xa, 0x9, 0x9, 0x9, 0x9, 0x65, 0x6d, 0x69, 0x74, 0x28, 0x27, 0x73, 0x75, 0x5f, 0x70, 0x6f, 
+	0x70, 0x28, 0x73, 0x2c, 0x20, 0x25, 0x69, 0x29, 0x3b, 0x27, 0x2c, 0x20, 0x61, 0x29, 0xa, 0x9, 
+	0x9, 0x9, 0x9, 0x6e, 0x65, 0x78, 0x74, 0x5f, 0x64, 0x20, 0x3d, 0x20, 0x64, 0x20, 0x2d, 0x20, 
+	0x61, 0xa, 0x9, 0x9, 0x9, 0x65, 0x6c, 0x73, 0x65, 0x69, 0x66, 0x20, 0x6f, 0x70, 0x20, 0x3d, 
+	0x3d, 0x20, 0x27, 0x4c, 0x4f, 0x41, 0x44, 0x27, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x9, 0x9, 
+	0x9, 0x9, 0x65, 0x6d, 0x69, 0x74, 0x28, 0x27, 0x73, 0x75, 0x5f, 0x63, 0x6f, 0x70, 0x79, 0x28, 
+	0x73, 0x2c, 0x20, 0x25, 0x69, 0x29, 0x3b, 0x27, 0x2c, 0x20, 0x61, 0x20, 0x2d, 0x20, 0x64, 0x29, 
+	0xa, 0x9, 0x9, 0x9, 0x9, 0x6e, 0x65, 0x78, 0x74, 0x5f, 0x64, 0x20, 0x3d, 0x20, 0x64, 0x20, 
+	0x2b, 0x20, 0x31, 0xa, 0x9, 0x9, 0x9, 0x65, 0x6c, 0x73, 0x65, 0x69, 0x66, 0x20, 0x6f, 0x70, 
+	0x20, 0x3d, 0x3d, 0x20, 0x27, 0x4c, 0x43, 0x4c, 0x27, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x9, 
+	0x9, 0x9, 0x9, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x20, 0x66, 0x20, 0x3d, 0x20, 0x63, 0x5f, 0x66, 
+	0x75, 0x6e, 0x63, 0x5b, 0x62, 0x20, 0x2b, 0x20, 0x31, 0x5d, 0xa, 0x9, 0x9, 0x9, 0x9, 0x69, 
+	0x66, 0x20, 0x66, 0x2e, 0x65, 0x6e, 0x75, 0x6d, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x9, 0x9, 
+	0x9, 0x9, 0x9, 0x65, 0x6d, 0x69, 0x74, 0x28, 0x27, 0x73, 0x75, 0x5f, 0x70, 0x75, 0x73, 0x68, 
+	0x6e, 0x75, 0x6d, 0x62, 0x65, 0x72, 0x28, 0x73, 0x2c, 0x20, 0x28, 0x64, 0x6f, 0x75, 0x62, 0x6c, 
+	0x65, 0x29, 0x25, 0x73, 0x29, 0x3b, 0x27, 0x2c, 0x20, 0x66, 0x2e, 0x65, 0x6e, 0x75, 0x6d, 0x29, 
+	0xa, 0x9, 0x9, 0x9, 0x9, 0x65, 0x6c, 0x73, 0x65, 0xa, 0x9, 0x9, 0x9, 0x9, 0x9, 0x65, 
+	0x6d, 0x69, 0x74, 0x28, 0x27, 0x73, 0x75, 0x5f, 0x70, 0x75, 0x73, 0x68, 0x66, 0x75, 0x6e, 0x63, 
+	0x74, 0x69, 0x6f, 0x6e, 0x28, 0x73, 0x2c, 0x20, 0x26, 0x5f, 0x5f, 0x5f, 0x25, 0x73, 0x29, 0x3b, 
+	0x27, 0x2c, 0x20, 0x66, 0x2e, 0x6e, 0x61, 0x6d, 0x65, 0x29, 0xa, 0x9, 0x9, 0x9, 0x9, 0x65, 
+	0x6e, 0x64, 0xa, 0x9, 0x9, 0x9, 0x9, 0x6e, 0x65, 0x78, 0x74, 0x5f, 0x64, 0x20, 0x3d, 0x20, 
+	0x64, 0x20, 0x2b, 0x20, 0x31, 0xa, 0x9, 0x9, 0x9, 0x65, 0x6c, 0x73, 0x65, 0x69, 0x66, 0x20, 
+	0x6f, 0x70, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x41, 0x44, 0x44, 0x27, 0x20, 0x6f, 0x72, 0x20, 0x6f, 
+	0x70, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x53, 0x55, 0x42, 0x27, 0x20, 0x6f, 0x72, 0x20, 0x6f, 0x70, 
+	0x20, 0x3d, 0x3d, 0x20, 0x27, 0x4d, 0x55, 0x4c, 0x27, 0x20, 0x6f, 0x72, 0x20, 0x6f, 0x70, 0x20, 
+	0x3d, 0x3d, 0x20, 0x27, 0x44, 0x49, 0x56, 0x27, 0x20, 0x6f, 0x72, 0x20, 0x6f, 0x70, 0x20, 0x3d, 
+	0x3d, 0x20, 0x27, 0x4d, 0x4f, 0x44, 0x27, 0x20, 0x6f, 0x72, 0x20, 0x6f, 0x70, 0x20, 0x3d, 0x3d, 
+	0x20, 0x27, 0x50, 0x4f, 0x57, 0x27, 0xa, 0x9, 0x9, 0x9, 0x9, 0x6f, 0x72, 0x20, 0x6f, 0x70, 
+	0x20, 0x3d, 0x3d, 0x20, 0x27, 0x4c, 0x45, 0x53, 0x53, 0x27, 0x20, 0x6f, 0x72, 0x20, 0x6f, 0x70, 
+	0x20, 0x3d, 0x3d, 0x20, 0x27, 0x4c, 0x45, 0x51, 0x55, 0x41, 0x4c, 0x27, 0x20, 0x74, 0x68, 0x65, 
+	0x6e, 0xa, 0x9, 0x9, 0x9, 0x9, 0x65, 0x6d, 0x69, 0x74, 0x28, 0x27, 0x7b, 0x27, 0x29, 0xa, 
+	0x9, 0x9, 0x9, 0x9, 0x65, 0x6d, 0x69, 0x74, 0x28, 0x27, 0x5c, 0x74, 0x64, 0x6f, 0x75, 0x62, 
+	0x6c, 0x65, 0x20, 0x61, 0x20, 0x3d, 0x20, 0x5f, 0x5f, 0x5f, 0x61, 0x6f, 0x74, 0x5f, 0x6e, 0x75, 
+	0x6d, 0x62, 0x65, 0x72, 0x28, 0x73, 0x2c, 0x20, 0x2d, 0x32, 0x29, 0x3b, 0x27, 0x29, 0xa, 0x9, 
+	0x9, 0x9, 0x9, 0x65, 0x6d, 0x69, 0x74, 0x28, 0x27, 0x5c, 0x74, 0x64, 0x6f, 0x75, 0x62, 0x6c, 
+	0x65, 0x20, 0x62, 0x20, 0x3d, 0x20, 0x5f, 0x5f, 0x5f, 0x61, 0x6f, 0x74, 0x5f, 0x6e, 0x75, 0x6d, 
+	0x62, 0x65, 0x72, 0x28, 0x73, 0x2c, 0x20, 0x2d, 0x31, 0x29, 0x3b, 0x27, 0x29, 0xa, 0x9, 0x9, 
+	0x9, 0x9, 0x65, 0x6d, 0x69, 0x74, 0x28, 0x27, 0x5c, 0x74, 0x73, 0x75, 0x5f, 0x70, 0x6f, 0x70, 
+	0x28, 0x73, 0x2c, 0x20, 0x32, 0x29, 0x3b, 0x27, 0x29, 0xa, 0x9, 0x9, 0x9, 0x9, 0x69, 0x66, 
+	0x20, 0x6f, 0x70, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x44, 0x49, 0x56, 0x27, 0x20, 0x74, 0x68, 0x65, 
+	0x6e, 0xa, 0x9, 0x9, 0x9, 0x9, 0x9, 0x65, 0x6d, 0x69, 0x74, 0x28, 0x27, 0x5c, 0x74, 0x73, 
+	0x75, 0x5f, 0x61, 0x73, 0x73, 0x65, 0x72, 0x74, 0x28, 0x73, 0x2c, 0x20, 0x62, 0x20, 0x21, 0x3d, 
+	0x20, 0x30, 0x2e, 0x30, 0x2c, 0x20, 0x22, 0x44, 0x69, 0x76, 0x69, 0x73, 0x69, 0x6f, 0x6e, 0x20, 
+	0x62, 0x79, 0x20, 0x7a, 0x65, 0x72, 0x6f, 0x21, 0x22, 0x29, 0x3b, 0x27, 0x29, 0xa, 0x9, 0x9, 
+	0x9, 0x9, 0x65, 0x6e, 0x64, 0xa, 0x9, 0x9, 0x9, 0x9, 0x69, 0x66, 0x20, 0x6f, 0x70, 0x20, 
+	0x3d, 0x3d, 0x20, 0x27, 0x4d, 0x4f, 0x44, 0x27, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x9, 0x9, 
+	0x9, 0x9, 0x9, 0x65, 0x6d, 0x69, 0x74, 0x28, 0x27, 0x5c, 0x74, 0x73, 0x75, 0x5f, 0x70, 0x75, 
+	0x73, 0x68, 0x6e, 0x75, 0x6d, 0x62, 0x65, 0x72, 0x28, 0x73, 0x2c, 0x20, 0x28, 0x64, 0x6f, 0x75, 
+	0x62, 0x6c, 0x65, 0x29, 0x28, 0x28, 0x69, 0x6e, 0x74, 0x29, 0x61, 0x20, 0x25, 0x25, 0x20, 0x28, 
+	0x69, 0x6e, 0x74, 0x29, 0x62, 0x29, 0x29, 0x3b, 0x27, 0x29, 0xa, 0x9, 0x9, 0x9, 0x9, 0x65, 
+	0x6c, 0x73, 0x65, 0x69, 0x66, 0x20, 0x6f, 0x70, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x50, 0x4f, 0x57, 
+	0x27, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x9, 0x9, 0x9, 0x9, 0x9, 0x65, 0x6d, 0x69, 0x74, 
+	0x28, 0x27, 0x5c, 0x74, 0x73, 0x75, 0x5f, 0x70, 0x75, 0x73, 0x68, 0x6e, 0x75, 0x6d, 0x62, 0x65, 
+	0x72, 0x28, 0x73, 0x2c, 0x20, 0x70, 0x6f, 0x77, 0x28, 0x61, 0x2c, 0x20, 0x62, 0x29, 0x29, 0x3b, 
+	0x27, 0x29, 0xa, 0x9, 0x9, 0x9, 0x9, 0x65, 0x6c, 0x73, 0x65, 0x69, 0x66, 0x20, 0x6f, 0x70, 
+	0x20, 0x3d, 0x3d, 0x20, 0x27, 0x4c, 0x45, 0x53, 0x53, 0x27, 0x20, 0x6f, 0x72, 0x20, 0x6f, 0x70, 
+	0x20, 0x3d, 0x3d, 0x20, 0x27, 0x4c, 0x45, 0x51, 0x55, 0x41, 0x4c, 0x27, 0x20, 0x74, 0x68, 0x65, 
+	0x6e, 0xa, 0x9, 0x9, 0x9, 0x9, 0x9, 0x65, 0x6d, 0x69, 0x74, 0x28, 0x27, 0x5c, 0x74, 0x73, 
+	0x75, 0x5f, 0x70, 0x75, 0x73, 0x68, 0x62, 0x6f, 0x6f, 0x6c, 0x65, 0x61, 0x6e, 0x28, 0x73, 0x2c, 
+	0x20, 0x61, 0x20, 0x25, 0x73, 0x20, 0x62, 0x29, 0x3b, 0x27, 0x2c, 0x20, 0x61, 0x72, 0x69, 0x74, 
+	0x68, 0x5b, 0x6f, 0x70, 0x5d, 0x29, 0xa, 0x9, 0x9, 0x9, 0x9, 0x65, 0x6c, 0x73, 0x65, 0xa, 
+	0x9, 0x9, 0x9, 0x9, 0x9, 0x65, 0x6d, 0x69, 0x74, 0x28, 0x27, 0x5c, 0x74, 0x73, 0x75, 0x5f, 
+	0x70, 0x75, 0x73, 0x68, 0x6e, 0x75, 0x6d, 0x62, 0x65, 0x72, 0x28, 0x73, 0x2c, 0x20, 0x61, 0x20, 
+	0x25, 0x73, 0x20, 0x62, 0x29, 0x3b, 0x27, 0x2c, 0x20, 0x61, 0x72, 0x69, 0x74, 0x68, 0x5b, 0x6f, 
+	0x70, 0x5d, 0x29, 0xa, 0x9, 0x9, 0x9, 0x9, 0x65, 0x6e, 0x64, 0xa, 0x9, 0x9, 0x9, 0x9, 
+	0x65, 0x6d, 0x69, 0x74, 0x28, 0x27, 0x7d, 0x27, 0x29, 0xa, 0x9, 0x9, 0x9, 0x9, 0x6e, 0x65, 
+	0x78, 0x74, 0x5f, 0x64, 0x20, 0x3d, 0x20, 0x64, 0x20, 0x2d, 0x20, 0x31, 0xa, 0x9, 0x9, 0x9, 
+	0x65, 0x6c, 0x73, 0x65, 0x69, 0x66, 0x20, 0x6f, 0x70, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x55, 0x4e, 
+	0x4d, 0x27, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x9, 0x9, 0x9, 0x9, 0x65, 0x6d, 0x69, 0x74, 
+	0x28, 0x27, 0x7b, 0x20, 0x64, 0x6f, 0x75, 0x62, 0x6c, 0x65, 0x20, 0x61, 0x20, 0x3d, 0x20, 0x5f, 
+	0x5f, 0x5f, 0x61, 0x6f, 0x74, 0x5f, 0x6e, 0x75, 0x6d, 0x62, 0x65, 0x72, 0x28, 0x73, 0x2c, 0x20, 
+	0x2d, 0x31, 0x29, 0x3b, 0x20, 0x73, 0x75, 0x5f, 0x70, 0x6f, 0x70, 0x28, 0x73, 0x2c, 0x20, 0x31, 
+	0x29, 0x3b, 0x20, 0x73, 0x75, 0x5f, 0x70, 0x75, 0x73, 0x68, 0x6e, 0x75, 0x6d, 0x62, 0x65, 0x72, 
+	0x28, 0x73, 0x2c, 0x20, 0x2d, 0x61, 0x29, 0x3b, 0x20, 0x7d, 0x27, 0x29, 0xa, 0x9, 0x9, 0x9, 
+	0x65, 0x6c, 0x73, 0x65, 0x69, 0x66, 0x20, 0x6f, 0x70, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x45, 0x51, 
+	0x27, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x9, 0x9, 0x9, 0x9, 0x65, 0x6d, 0x69, 0x74, 0x28, 
+	0x27, 0x7b, 0x20, 0x69, 0x6e, 0x74, 0x20, 0x72, 0x20, 0x3d, 0x20, 0x73, 0x75, 0x5f, 0x65, 0x71, 
+	0x75, 0x61, 0x6c, 0x28, 0x73, 0x2c, 0x20, 0x2d, 0x32, 0x2c, 0x20, 0x2d, 0x31, 0x29, 0x3b, 0x20, 
+	0x73, 0x75, 0x5f, 0x70, 0x6f, 0x70, 0x28, 0x73, 0x2c, 0x20, 0x32, 0x29, 0x3b, 0x20, 0x73, 0x75, 
+	0x5f, 0x70, 0x75, 0x73, 0x68, 0x62, 0x6f, 0x6f, 0x6c, 0x65, 0x61, 0x6e, 0x28, 0x73, 0x2c, 0x20, 
+	0x72, 0x29, 0x3b, 0x20, 0x7d, 0x27, 0x29, 0xa, 0x9, 0x9, 0x9, 0x9, 0x6e, 0x65, 0x78, 0x74, 
+	0x5f, 0x64, 0x20, 0x3d, 0x20, 0x64, 0x20, 0x2d, 0x20, 0x31, 0xa, 0x9, 0x9, 0x9, 0x65, 0x6c, 
+	0x73, 0x65, 0x69, 0x66, 0x20, 0x6f, 0x70, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x4e, 0x4f, 0x54, 0x27, 
+	0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x9, 0x9, 0x9, 0x9, 0x65, 0x6d, 0x69, 0x74, 0x28, 0x27, 
+	0x73, 0x75, 0x5f, 0x70, 0x75, 0x73, 0x68, 0x62, 0x6f, 0x6f, 0x6c, 0x65, 0x61, 0x6e, 0x28, 0x73, 
+	0x2c, 0x20, 0x21, 0x5f, 0x5f, 0x5f, 0x61, 0x6f, 0x74, 0x5f, 0x70, 0x6f, 0x70, 0x5f, 0x74, 0x72, 
+	0x75, 0x65, 0x28, 0x73, 0x29, 0x29, 0x3b, 0x27, 0x29, 0xa, 0x9, 0x9, 0x9, 0x65, 0x6c, 0x73, 
+	0x65, 0x69, 0x66, 0x20, 0x6f, 0x70, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x41, 0x4e, 0x44, 0x27, 0x20, 
+	0x74, 0x68, 0x65, 0x6e, 0xa, 0x9, 0x9, 0x9, 0x9, 0x65, 0x6d, 0x69, 0x74, 0x28, 0x27, 0x69, 
+	0x66, 0x20, 0x28, 0x5f, 0x5f, 0x5f, 0x61, 0x6f, 0x74, 0x5f, 0x74, 0x72, 0x75, 0x65, 0x28, 0x73, 
+	0x2c, 0x20, 0x2d, 0x32, 0x29, 0x20, 0x26, 0x26, 0x20, 0x5f, 0x5f, 0x5f, 0x61, 0x6f, 0x74, 0x5f, 
+	0x74, 0x72, 0x75, 0x65, 0x28, 0x73, 0x2c, 0x20, 0x2d, 0x31, 0x29, 0x29, 0x20, 0x7b, 0x20, 0x73, 
+	0x75, 0x5f, 0x73, 0x77, 0x61, 0x70, 0x28, 0x73, 0x2c, 0x20, 0x2d, 0x32, 0x2c, 0x20, 0x2d, 0x31, 
+	0x29, 0x3b, 0x20, 0x73, 0x75, 0x5f, 0x70, 0x6f, 0x70, 0x28, 0x73, 0x2c, 0x20, 0x31, 0x29, 0x3b, 
+	0x20, 0x7d, 0x27, 0x29, 0xa, 0x9, 0x9, 0x9, 0x9, 0x65, 0x6d, 0x69, 0x74, 0x28, 0x27, 0x65, 
+	0x6c, 0x73, 0x65, 0x20, 0x7b, 0x20, 0x73, 0x75, 0x5f, 0x70, 0x6f, 0x70, 0x28, 0x73, 0x2c, 0x20, 
+	0x32, 0x29, 0x3b, 0x20, 0x73, 0x75, 0x5f, 0x70, 0x75, 0x73, 0x68, 0x62, 0x6f, 0x6f, 0x6c, 0x65, 
+	0x61, 0x6e, 0x28, 0x73, 0x2c, 0x20, 0x30, 0x29, 0x3b, 0x20, 0x7d, 0x27, 0x29, 0xa, 0x9, 0x9, 
+	0x9, 0x9, 0x6e, 0x65, 0x78, 0x74, 0x5f, 0x64, 0x20, 0x3d, 0x20, 0x64, 0x20, 0x2d, 0x20, 0x31, 
+	0xa, 0x9, 0x9, 0x9, 0x65, 0x6c, 0x73, 0x65, 0x69, 0x66, 0x20, 0x6f, 0x70, 0x20, 0x3d, 0x3d, 
+	0x20, 0x27, 0x4f, 0x52, 0x27, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x9, 0x9, 0x9, 0x9, 0x65, 
+	0x6d, 0x69, 0x74, 0x28, 0x27, 0x69, 0x66, 0x20, 0x28, 0x5f, 0x5f, 0x5f, 0x61, 0x6f, 0x74, 0x5f, 
+	0x74, 0x72, 0x75, 0x65, 0x28, 0x73, 0x2c, 0x20, 0x2d, 0x32, 0x29, 0x29, 0x20, 0x7b, 0x20, 0x73, 
+	0x75, 0x5f, 0x70, 0x6f, 0x70, 0x28, 0x73, 0x2c, 0x20, 0x31, 0x29, 0x3b, 0x20, 0x7d, 0x27, 0x29, 
+	0xa, 0x9, 0x9, 0x9, 0x9, 0x65, 0x6d, 0x69, 0x74, 0x28, 0x27, 0x65, 0x6c, 0x73, 0x65, 0x20, 
+	0x69, 0x66, 0x20, 0x28, 0x5f, 0x5f, 0x5f, 0x61, 0x6f, 0x74, 0x5f, 0x74, 0x72, 0x75, 0x65, 0x28, 
+	0x73, 0x2c, 0x20, 0x2d, 0x31, 0x29, 0x29, 0x20, 0x7b, 0x20, 0x73, 0x75, 0x5f, 0x73, 0x77, 0x61, 
+	0x70, 0x28, 0x73, 0x2c, 0x20, 0x2d, 0x32, 0x2c, 0x20, 0x2d, 0x31, 0x29, 0x3b, 0x20, 0x73, 0x75, 
+	0x5f, 0x70, 0x6f, 0x70, 0x28, 0x73, 0x2c, 0x20, 0x31, 0x29, 0x3b, 0x20, 0x7d, 0x27, 0x29, 0xa, 
+	0x9, 0x9, 0x9, 0x9, 0x65, 0x6d, 0x69, 0x74, 0x28, 0x27, 0x65, 0x6c, 0x73, 0x65, 0x20, 0x7b, 
+	0x20, 0x73, 0x75, 0x5f, 0x70, 0x6f, 0x70, 0x28, 0x73, 0x2c, 0x20, 0x32, 0x29, 0x3b, 0x20, 0x73, 
+	0x75, 0x5f, 0x70, 0x75, 0x73, 0x68, 0x62, 0x6f, 0x6f, 0x6c, 0x65, 0x61, 0x6e, 0x28, 0x73, 0x2c, 
+	0x20, 0x30, 0x29, 0x3b, 0x20, 0x7d, 0x27, 0x29, 0xa, 0x9, 0x9, 0x9, 0x9, 0x6e, 0x65, 0x78, 
+	0x74, 0x5f, 0x64, 0x20, 0x3d, 0x20, 0x64, 0x20, 0x2d, 0x20, 0x31, 0xa, 0x9, 0x9, 0x9, 0x65, 
+	0x6c, 0x73, 0x65, 0x69, 0x66, 0x20, 0x6f, 0x70, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x54, 0x45, 0x53, 
+	0x54, 0x27, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x9, 0x9, 0x9, 0x9, 0x65, 0x6d, 0x69, 0x74, 
+	0x28, 0x27, 0x69, 0x66, 0x20, 0x28, 0x5f, 0x5f, 0x5f, 0x61, 0x6f, 0x74, 0x5f, 0x70, 0x6f, 0x70, 
+	0x5f, 0x74, 0x72, 0x75, 0x65, 0x28, 0x73, 0x29, 0x29, 0x20, 0x67, 0x6f, 0x74, 0x6f, 0x20, 0x4c, 
+	0x25, 0x69, 0x3b, 0x27, 0x2c, 0x20, 0x62, 0x29, 0xa, 0x9, 0x9, 0x9, 0x9, 0x6e, 0x65, 0x78, 
+	0x74, 0x5f, 0x64, 0x20, 0x3d, 0x20, 0x64, 0x20, 0x2d, 0x20, 0x31, 0xa, 0x9, 0x9, 0x9, 0x9, 
+	0x62, 0x72, 0x61, 0x6e, 0x63, 0x68, 0x28, 0x62, 0x2c, 0x20, 0x6e, 0x65, 0x78, 0x74, 0x5f, 0x64, 
+	0x29, 0xa, 0x9, 0x9, 0x9, 0x65, 0x6c, 0x73, 0x65, 0x69, 0x66, 0x20, 0x6f, 0x70, 0x20, 0x3d, 
+	0x3d, 0x20, 0x27, 0x46, 0x4f, 0x52, 0x27, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x9, 0x9, 0x9, 
+	0x9, 0x65, 0x6d, 0x69, 0x74, 0x28, 0x27, 0x69, 0x66, 0x20, 0x28, 0x73, 0x75, 0x5f, 0x74, 0x79, 
+	0x70, 0x65, 0x28, 0x73, 0x2c, 0x20, 0x2d, 0x32, 0x29, 0x20, 0x3d, 0x3d, 0x20, 0x53, 0x55, 0x5f, 
+	0x4e, 0x49, 0x4c, 0x29, 0x20, 0x7b, 0x20, 0x73, 0x75, 0x5f, 0x73, 0x77, 0x61, 0x70, 0x28, 0x73, 
+	0x2c, 0x20, 0x2d, 0x32, 0x2c, 0x20, 0x2d, 0x31, 0x29, 0x3b, 0x20, 0x73, 0x75, 0x5f, 0x70, 0x6f, 
+	0x70, 0x28, 0x73, 0x2c, 0x20, 0x31, 0x29, 0x3b, 0x20, 0x67, 0x6f, 0x74, 0x6f, 0x20, 0x4c, 0x25, 
+	0x69, 0x3b, 0x20, 0x7d, 0x27, 0x2c, 0x20, 0x62, 0x29, 0xa, 0x9, 0x9, 0x9, 0x9, 0x65, 0x6d, 
+	0x69, 0x74, 0x28, 0x27, 0x73, 0x75, 0x5f, 0x70, 0x6f, 0x70, 0x28, 0x73, 0x2c, 0x20, 0x31, 0x29, 
+	0x3b, 0x27, 0x29, 0xa, 0x9, 0x9, 0x9, 0x9, 0x65, 0x6d, 0x69, 0x74, 0x28, 0x27, 0x73, 0x75, 
+	0x5f, 0x63, 0x68, 0x65, 0x63, 0x6b, 0x5f, 0x74, 0x79, 0x70, 0x65, 0x28, 0x73, 0x2c, 0x20, 0x2d, 
+	0x31, 0x2c, 0x20, 0x53, 0x55, 0x5f, 0x53, 0x45, 0x51, 0x29, 0x3b, 0x27, 0x29, 0xa, 0x9, 0x9, 
+	0x9, 0x9, 0x65, 0x6d, 0x69, 0x74, 0x28, 0x27, 0x73, 0x75, 0x5f, 0x72, 0x65, 0x73, 0x74, 0x28, 
+	0x73, 0x2c, 0x20, 0x2d, 0x31, 0x29, 0x3b, 0x20, 0x73, 0x75, 0x5f, 0x73, 0x77, 0x61, 0x70, 0x28, 
+	0x73, 0x2c, 0x20, 0x2d, 0x32, 0x2c, 0x20, 0x2d, 0x31, 0x29, 0x3b, 0x20, 0x73, 0x75, 0x5f, 0x66, 
+	0x69, 0x72, 0x73, 0x74, 0x28, 0x73, 0x2c, 0x20, 0x2d, 0x31, 0x29, 0x3b, 0x20, 0x73, 0x75, 0x5f, 
+	0x73, 0x77, 0x61, 0x70, 0x28, 0x73, 0x2c, 0x20, 0x2d, 0x32, 0x2c, 0x20, 0x2d, 0x31, 0x29, 0x3b, 
+	0x20, 0x73, 0x75, 0x5f, 0x70, 0x6f, 0x70, 0x28, 0x73, 0x2c, 0x20, 0x31, 0x29, 0x3b, 0x27, 0x29, 
+	0xa, 0x9, 0x9, 0x9, 0x9, 0x62, 0x72, 0x61, 0x6e, 0x63, 0x68, 0x28, 0x62, 0x2c, 0x20, 0x64, 
+	0x20, 0x2d, 0x20, 0x31, 0x29, 0xa, 0x9, 0x9, 0x9, 0x65, 0x6c, 0x73, 0x65, 0x69, 0x66, 0x20, 
+	0x6f, 0x70, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x4a, 0x4d, 0x50, 0x27, 0x20, 0x74, 0x68, 0x65, 0x6e, 
+	0xa, 0x9, 0x9, 0x9, 0x9, 0x67, 0x6f, 0x74, 0x6f, 0x5f, 0x70, 0x63, 0x28, 0x70, 0x63, 0x2c, 
+	0x20, 0x62, 0x29, 0xa, 0x9, 0x9, 0x9, 0x9, 0x62, 0x72, 0x61, 0x6e, 0x63, 0x68, 0x28, 0x62, 
+	0x2c, 0x20, 0x64, 0x29, 0xa, 0x9, 0x9, 0x9, 0x9, 0x6e, 0x65, 0x78, 0x74, 0x5f, 0x64, 0x20, 
+	0x3d, 0x20, 0x6e, 0x69, 0x6c, 0xa, 0x9, 0x9, 0x9, 0x65, 0x6c, 0x73, 0x65, 0x69, 0x66, 0x20, 
+	0x6f, 0x70, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x52, 0x45, 0x54, 0x55, 0x52, 0x4e, 0x27, 0x20, 0x74, 
+	0x68, 0x65, 0x6e, 0xa, 0x9, 0x9, 0x9, 0x9, 0x65, 0x6d, 0x69, 0x74, 0x28, 0x27, 0x72, 0x65, 
+	0x74, 0x75, 0x72, 0x6e, 0x20, 0x31, 0x3b, 0x27, 0x29, 0xa, 0x9, 0x9, 0x9, 0x9, 0x6e, 0x65, 
+	0x78, 0x74, 0x5f, 0x64, 0x20, 0x3d, 0x20, 0x6e, 0x69, 0x6c, 0xa, 0x9, 0x9, 0x9, 0x65, 0x6c, 
+	0x73, 0x65, 0x69, 0x66, 0x20, 0x6f, 0x70, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x53, 0x48, 0x49, 0x46, 
+	0x54, 0x27, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x9, 0x9, 0x9, 0x9, 0x69, 0x66, 0x20, 0x61, 
+	0x20, 0x3e, 0x20, 0x30, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x9, 0x9, 0x9, 0x9, 0x9, 0x65, 
+	0x6d, 0x69, 0x74, 0x28, 0x27, 0x73, 0x75, 0x5f, 0x73, 0x77, 0x61, 0x70, 0x28, 0x73, 0x2c, 0x20, 
+	0x25, 0x69, 0x2c, 0x20, 0x2d, 0x31, 0x29, 0x3b, 0x20, 0x73, 0x75, 0x5f, 0x70, 0x6f, 0x70, 0x28, 
+	0x73, 0x2c, 0x20, 0x25, 0x69, 0x29, 0x3b, 0x27, 0x2c, 0x20, 0x2d, 0x28, 0x61, 0x20, 0x2b, 0x20, 
+	0x31, 0x29, 0x2c, 0x20, 0x61, 0x29, 0xa, 0x9, 0x9, 0x9, 0x9, 0x65, 0x6e, 0x64, 0xa, 0x9, 
+	0x9, 0x9, 0x9, 0x6e, 0x65, 0x78, 0x74, 0x5f, 0x64, 0x20, 0x3d, 0x20, 0x64, 0x20, 0x2d, 0x20, 
+	0x61, 0xa, 0x9, 0x9, 0x9, 0x65, 0x6c, 0x73, 0x65, 0x69, 0x66, 0x20, 0x6f, 0x70, 0x20, 0x3d, 
+	0x3d, 0x20, 0x27, 0x43, 0x41, 0x4c, 0x4c, 0x27, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x9, 0x9, 
+	0x9, 0x9, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x20, 0x6e, 0x72, 0x65, 0x74, 0x20, 0x3d, 0x20, 0x62, 
+	0x20, 0x3e, 0x20, 0x30, 0x20, 0x61, 0x6e, 0x64, 0x20, 0x62, 0x20, 0x6f, 0x72, 0x20, 0x31, 0xa, 
+	0x9, 0x9, 0x9, 0x9, 0x65, 0x6d, 0x69, 0x74, 0x28, 0x27, 0x73, 0x75, 0x5f, 0x63, 0x61, 0x6c, 
+	0x6c, 0x28, 0x73, 0x2c, 0x20, 0x25, 0x69, 0x2c, 0x20, 0x25, 0x69, 0x29, 0x3b, 0x27, 0x2c, 0x20, 
+	0x61, 0x2c, 0x20, 0x6e, 0x72, 0x65, 0x74, 0x29, 0xa, 0x9, 0x9, 0x9, 0x9, 0x6e, 0x65, 0x78, 
+	0x74, 0x5f, 0x64, 0x20, 0x3d, 0x20, 0x64, 0x20, 0x2d, 0x20, 0x61, 0x20, 0x2d, 0x20, 0x31, 0x20, 
+	0x2b, 0x20, 0x6e, 0x72, 0x65, 0x74, 0xa, 0x9, 0x9, 0x9, 0x65, 0x6c, 0x73, 0x65, 0x69, 0x66, 
+	0x20, 0x6f, 0x70, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x47, 0x45, 0x54, 0x47, 0x4c, 0x4f, 0x42, 0x41, 
+	0x4c, 0x27, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x9, 0x9, 0x9, 0x9, 0x65, 0x6d, 0x69, 0x74, 
+	0x28, 0x27, 0x5f, 0x5f, 0x5f, 0x61, 0x6f, 0x74, 0x5f, 0x67, 0x65, 0x74, 0x67, 0x6c, 0x6f, 0x62, 
+	0x61, 0x6c, 0x28, 0x73, 0x2c, 0x20, 0x25, 0x73, 0x29, 0x3b, 0x27, 0x2c, 0x20, 0x63, 0x5f, 0x73, 
+	0x74, 0x72, 0x69, 0x6e, 0x67, 0x28, 0x61, 0x73, 0x6d, 0x2e, 0x63, 0x6f, 0x6e, 0x73, 0x74, 0x61, 
+	0x6e, 0x74, 0x73, 0x5b, 0x61, 0x20, 0x2b, 0x20, 0x31, 0x5d, 0x29, 0x29, 0xa, 0x9, 0x9, 0x9, 
+	0x9, 0x6e, 0x65, 0x78, 0x74, 0x5f, 0x64, 0x20, 0x3d, 0x20, 0x64, 0x20, 0x2b, 0x20, 0x31, 0xa, 
+	0x9, 0x9, 0x9, 0x65, 0x6c, 0x73, 0x65, 0x69, 0x66, 0x20, 0x6f, 0x70, 0x20, 0x3d, 0x3d, 0x20, 
+	0x27, 0x53, 0x45, 0x54, 0x47, 0x4c, 0x4f, 0x42, 0x41, 0x4c, 0x27, 0x20, 0x74, 0x68, 0x65, 0x6e, 
+	0xa, 0x9, 0x9, 0x9, 0x9, 0x65, 0x6d, 0x69, 0x74, 0x28, 0x27, 0x73, 0x75, 0x5f, 0x63, 0x6f, 
+	0x70, 0x79, 0x28, 0x73, 0x2c, 0x20, 0x2d, 0x31, 0x29, 0x3b, 0x20, 0x73, 0x75, 0x5f, 0x73, 0x65, 
+	0x74, 0x67, 0x6c, 0x6f, 0x62, 0x61, 0x6c, 0x28, 0x73, 0x2c, 0x20, 0x25, 0x73, 0x29, 0x3b, 0x27, 
+	0x2c, 0x20, 0x63, 0x5f, 0x73, 0x74, 0x72, 0x69, 0x6e, 0x67, 0x28, 0x61, 0x73, 0x6d, 0x2e, 0x63, 
+	0x6f, 0x6e, 0x73, 0x74, 0x61, 0x6e, 0x74, 0x73, 0x5b, 0x61, 0x20, 0x2b, 0x20, 0x31, 0x5d, 0x29, 
+	0x29, 0xa, 0x9, 0x9, 0x9, 0x65, 0x6c, 0x73, 0x65, 0x69, 0x66, 0x20, 0x6f, 0x70, 0x20, 0x3d, 
+	0x3d, 0x20, 0x27, 0x47, 0x45, 0x54, 0x46, 0x49, 0x45, 0x4c, 0x44, 0x27, 0x20, 0x74, 0x68, 0x65, 
+	0x6e, 0xa, 0x9, 0x9, 0x9, 0x9, 0x65, 0x6d, 0x69, 0x74, 0x28, 0x27, 0x25, 0x73, 0x20, 0x73, 
+	0x75, 0x5f, 0x63, 0x61, 0x6c, 0x6c, 0x28, 0x73, 0x2c, 0x20, 0x31, 0x2c, 0x20, 0x31, 0x29, 0x3b, 
+	0x27, 0x2c, 0x20, 0x70, 0x75, 0x73, 0x68, 0x5f, 0x63, 0x6f, 0x6e, 0x73, 0x74, 0x28, 0x61, 0x73, 
+	0x6d, 0x2c, 0x20, 0x61, 0x29, 0x29, 0xa, 0x9, 0x9, 0x9, 0x65, 0x6c, 0x73, 0x65, 0x69, 0x66, 
+	0x20, 0x6f, 0x70, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x46, 0x4f, 0x52, 0x50, 0x52, 0x45, 0x50, 0x27, 
+	0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x9, 0x9, 0x9, 0x9, 0x65, 0x6d, 0x69, 0x74, 0x28, 0x27, 
+	0x7b, 0x27, 0x29, 0xa, 0x9, 0x9, 0x9, 0x9, 0x65, 0x6d, 0x69, 0x74, 0x28, 0x27, 0x5c, 0x74, 
+	0x69, 0x6e, 0x74, 0x20, 0x69, 0x20, 0x3d, 0x20, 0x28, 0x69, 0x6e, 0x74, 0x29, 0x5f, 0x5f, 0x5f, 
+	0x61, 0x6f, 0x74, 0x5f, 0x6e, 0x75, 0x6d, 0x62, 0x65, 0x72, 0x28, 0x73, 0x2c, 0x20, 0x2d, 0x32, 
+	0x29, 0x2c, 0x20, 0x6a, 0x20, 0x3d, 0x20, 0x28, 0x69, 0x6e, 0x74, 0x29, 0x5f, 0x5f, 0x5f, 0x61, 
+	0x6f, 0x74, 0x5f, 0x6e, 0x75, 0x6d, 0x62, 0x65, 0x72, 0x28, 0x73, 0x2c, 0x20, 0x2d, 0x31, 0x29, 
+	0x3b, 0x27, 0x29, 0xa, 0x9, 0x9, 0x9, 0x9, 0x65, 0x6d, 0x69, 0x74, 0x28, 0x27, 0x5c, 0x74, 
+	0x6a, 0x20, 0x2b, 0x3d, 0x20, 0x28, 0x6a, 0x20, 0x2d, 0x20, 0x69, 0x20, 0x3e, 0x20, 0x30, 0x29, 
+	0x20, 0x3f, 0x20, 0x31, 0x20, 0x3a, 0x20, 0x2d, 0x31, 0x3b, 0x27, 0x29, 0xa, 0x9, 0x9, 0x9, 
+	0x9, 0x65, 0x6d, 0x69, 0x74, 0x28, 0x27, 0x5c, 0x74, 0x73, 0x75, 0x5f, 0x70, 0x6f, 0x70, 0x28, 
+	0x73, 0x2c, 0x20, 0x32, 0x29, 0x3b, 0x20, 0x73, 0x75, 0x5f, 0x70, 0x75, 0x73, 0x68, 0x6e, 0x75, 
+	0x6d, 0x62, 0x65, 0x72, 0x28, 0x73, 0x2c, 0x20, 0x28, 0x64, 0x6f, 0x75, 0x62, 0x6c, 0x65, 0x29, 
+	0x6a, 0x29, 0x3b, 0x20, 0x73, 0x75, 0x5f, 0x70, 0x75, 0x73, 0x68, 0x6e, 0x75, 0x6d, 0x62, 0x65, 
+	0x72, 0x28, 0x73, 0x2c, 0x20, 0x28, 0x64, 0x6f, 0x75, 0x62, 0x6c, 0x65, 0x29, 0x69, 0x29, 0x3b, 
+	0x27, 0x29, 0xa, 0x9, 0x9, 0x9, 0x9, 0x65, 0x6d, 0x69, 0x74, 0x28, 0x27, 0x7d, 0x27, 0x29, 
+	0xa, 0x9, 0x9, 0x9, 0x65, 0x6c, 0x73, 0x65, 0x69, 0x66, 0x20, 0x6f, 0x70, 0x20, 0x3d, 0x3d, 
+	0x20, 0x27, 0x46, 0x4f, 0x52, 0x4c, 0x4f, 0x4f, 0x50, 0x27, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 
+	0x9, 0x9, 0x9, 0x9, 0x65, 0x6d, 0x69, 0x74, 0x28, 0x27, 0x7b, 0x27, 0x29, 0xa, 0x9, 0x9, 
+	0x9, 0x9, 0x65, 0x6d, 0x69, 0x74, 0x28, 0x27, 0x5c, 0x74, 0x64, 0x6f, 0x75, 0x62, 0x6c, 0x65, 
+	0x20, 0x65, 0x20, 0x3d, 0x20, 0x73, 0x75, 0x5f, 0x74, 0x6f, 0x6e, 0x75, 0x6d, 0x62, 0x65, 0x72, 
+	0x28, 0x73, 0x2c, 0x20, 0x2d, 0x33, 0x29, 0x2c, 0x20, 0x63, 0x20, 0x3d, 0x20, 0x73, 0x75, 0x5f, 
+	0x74, 0x6f, 0x6e, 0x75, 0x6d, 0x62, 0x65, 0x72, 0x28, 0x73, 0x2c, 0x20, 0x2d, 0x32, 0x29, 0x3b, 
+	0x27, 0x29, 0xa, 0x9, 0x9, 0x9, 0x9, 0x65, 0x6d, 0x69, 0x74, 0x28, 0x27, 0x5c, 0x74, 0x63, 
+	0x20, 0x2b, 0x3d, 0x20, 0x28, 0x65, 0x20, 0x3e, 0x20, 0x63, 0x29, 0x20, 0x3f, 0x20, 0x31, 0x2e, 
+	0x30, 0x20, 0x3a, 0x20, 0x2d, 0x31, 0x2e, 0x30, 0x3b, 0x27, 0x29, 0xa, 0x9, 0x9, 0x9, 0x9, 
+	0x65, 0x6d, 0x69, 0x74, 0x28, 0x27, 0x5c, 0x74, 0x69, 0x66, 0x20, 0x28, 0x63, 0x20, 0x21, 0x3d, 
+	0x20, 0x65, 0x29, 0x20, 0x7b, 0x20, 0x73, 0x75, 0x5f, 0x70, 0x6f, 0x70, 0x28, 0x73, 0x2c, 0x20, 
+	0x32, 0x29, 0x3b, 0x20, 0x73, 0x75, 0x5f, 0x70, 0x75, 0x73, 0x68, 0x6e, 0x75, 0x6d, 0x62, 0x65, 
+	0x72, 0x28, 0x73, 0x2c, 0x20, 0x63, 0x29, 0x3b, 0x20, 0x73, 0x75, 0x5f, 0x73, 0x61, 0x66, 0x65, 
+	0x70, 0x6f, 0x69, 0x6e, 0x74, 0x28, 0x73, 0x29, 0x3b, 0x20, 0x67, 0x6f, 0x74, 0x6f, 0x20, 0x4c, 
+	0x25, 0x69, 0x3b, 0x20, 0x7d, 0x27, 0x2c, 0x20, 0x62, 0x29, 0xa, 0x9, 0x9, 0x9, 0x9, 0x65, 
+	0x6d, 0x69, 0x74, 0x28, 0x27, 0x5c, 0x74, 0x73, 0x75, 0x5f, 0x73, 0x77, 0x61, 0x70, 0x28, 0x73, 
+	0x2c, 0x20, 0x2d, 0x33, 0x2c, 0x20, 0x2d, 0x31, 0x29, 0x3b, 0x20, 0x73, 0x75, 0x5f, 0x70, 0x6f, 
+	0x70, 0x28, 0x73, 0x2c, 0x20, 0x32, 0x29, 0x3b, 0x27, 0x29, 0xa, 0x9, 0x9, 0x9, 0x9, 0x65, 
+	0x6d, 0x69, 0x74, 0x28, 0x27, 0x7d, 0x27, 0x29, 0xa, 0x9, 0x9, 0x9, 0x9, 0x62, 0x72, 0x61, 
+	0x6e, 0x63, 0x68, 0x28, 0x62, 0x2c, 0x20, 0x64, 0x20, 0x2d, 0x20, 0x31, 0x29, 0xa, 0x9, 0x9, 
+	0x9, 0x9, 0x6e, 0x65, 0x78, 0x74, 0x5f, 0x64, 0x20, 0x3d, 0x20, 0x64, 0x20, 0x2d, 0x20, 0x32, 
+	0xa, 0x9, 0x9, 0x9, 0x65, 0x6c, 0x73, 0x65, 0x69, 0x66, 0x20, 0x6f, 0x70, 0x20, 0x3d, 0x3d, 
+	0x20, 0x27, 0x53, 0x54, 0x4f, 0x52, 0x45, 0x27, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x9, 0x9, 
+	0x9, 0x9, 0x66, 0x6f, 0x72, 0x20, 0x6b, 0x20, 0x3d, 0x20, 0x30, 0x2c, 0x20, 0x61, 0x20, 0x2d, 
+	0x20, 0x31, 0x20, 0x64, 0x6f, 0xa, 0x9, 0x9, 0x9, 0x9, 0x9, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 
+	0x20, 0x64, 0x73, 0x74, 0x2c, 0x20, 0x73, 0x72, 0x63, 0x20, 0x3d, 0x20, 0x62, 0x20, 0x2b, 0x20, 
+	0x6b, 0x2c, 0x20, 0x64, 0x20, 0x2d, 0x20, 0x61, 0x20, 0x2b, 0x20, 0x6b, 0xa, 0x9, 0x9, 0x9, 
+	0x9, 0x9, 0x69, 0x66, 0x20, 0x64, 0x73, 0x74, 0x20, 0x7e, 0x3d, 0x20, 0x73, 0x72, 0x63, 0x20, 
+	0x74, 0x68, 0x65, 0x6e, 0xa, 0x9, 0x9, 0x9, 0x9, 0x9, 0x9, 0x65, 0x6d, 0x69, 0x74, 0x28, 
+	0x27, 0x73, 0x75, 0x5f, 0x73, 0x77, 0x61, 0x70, 0x28, 0x73, 0x2c, 0x20, 0x25, 0x69, 0x2c, 0x20, 
+	0x25, 0x69, 0x29, 0x3b, 0x27, 0x2c, 0x20, 0x64, 0x73, 0x74, 0x20, 0x2d, 0x20, 0x64, 0x2c, 0x20, 
+	0x73, 0x72, 0x63, 0x20, 0x2d, 0x20, 0x64, 0x29, 0xa, 0x9, 0x9, 0x9, 0x9, 0x9, 0x65, 0x6e, 
+	0x64, 0xa, 0x9, 0x9, 0x9, 0x9, 0x65, 0x6e, 0x64, 0xa, 0x9, 0x9, 0x9, 0x9, 0x69, 0x66, 
+	0x20, 0x64, 0x20, 0x2d, 0x20, 0x28, 0x62, 0x20, 0x2b, 0x20, 0x61, 0x29, 0x20, 0x3e, 0x20, 0x30, 
+	0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x9, 0x9, 0x9, 0x9, 0x9, 0x65, 0x6d, 0x69, 0x74, 0x28, 
+	0x27, 0x73, 0x75, 0x5f, 0x70, 0x6f, 0x70, 0x28, 0x73, 0x2c, 0x20, 0x25, 0x69, 0x29, 0x3b, 0x27, 
+	0x2c, 0x20, 0x64, 0x20, 0x2d, 0x20, 0x28, 0x62, 0x20, 0x2b, 0x20, 0x61, 0x29, 0x29, 0xa, 0x9, 
+	0x9, 0x9, 0x9, 0x65, 0x6e, 0x64, 0xa, 0x9, 0x9, 0x9, 0x9, 0x6e, 0x65, 0x78, 0x74, 0x5f, 
+	0x64, 0x20, 0x3d, 0x20, 0x62, 0x20, 0x2b, 0x20, 0x61, 0xa, 0x9, 0x9, 0x9, 0x65, 0x6c, 0x73, 
+	0x65, 0x69, 0x66, 0x20, 0x61, 0x72, 0x69, 0x74, 0x68, 0x5b, 0x6f, 0x70, 0x5d, 0x20, 0x74, 0x68, 
+	0x65, 0x6e, 0xa, 0x9, 0x9, 0x9, 0x9, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x20, 0x78, 0x2c, 0x20, 
+	0x79, 0x20, 0x3d, 0x20, 0x6e, 0x75, 0x6d, 0x62, 0x65, 0x72, 0x5f, 0x6f, 0x70, 0x65, 0x72, 0x61, 
+	0x6e, 0x64, 0x73, 0x28, 0x61, 0x73, 0x6d, 0x2c, 0x20, 0x69, 0x6e, 0x73, 0x74, 0x2c, 0x20, 0x64, 
+	0x29, 0xa, 0x9, 0x9, 0x9, 0x9, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x20, 0x70, 0x75, 0x73, 0x68, 
+	0x20, 0x3d, 0x20, 0x28, 0x73, 0x74, 0x72, 0x69, 0x6e, 0x67, 0x2e, 0x66, 0x69, 0x6e, 0x64, 0x28, 
+	0x6f, 0x70, 0x2c, 0x20, 0x27, 0x5e, 0x4c, 0x45, 0x53, 0x53, 0x27, 0x29, 0x20, 0x6f, 0x72, 0x20, 
+	0x73, 0x74, 0x72, 0x69, 0x6e, 0x67, 0x2e, 0x66, 0x69, 0x6e, 0x64, 0x28, 0x6f, 0x70, 0x2c, 0x20, 
+	0x27, 0x5e, 0x4c, 0x45, 0x51, 0x55, 0x41, 0x4c, 0x27, 0x29, 0x29, 0x20, 0x61, 0x6e, 0x64, 0x20, 
+	0x27, 0x73, 0x75, 0x5f, 0x70, 0x75, 0x73, 0x68, 0x62, 0x6f, 0x6f, 0x6c, 0x65, 0x61, 0x6e, 0x27, 
+	0x20, 0x6f, 0x72, 0x20, 0x27, 0x73, 0x75, 0x5f, 0x70, 0x75, 0x73, 0x68, 0x6e, 0x75, 0x6d, 0x62, 
+	0x65, 0x72, 0x27, 0xa, 0x9, 0x9, 0x9, 0x9, 0x65, 0x6d, 0x69, 0x74, 0x28, 0x27, 0x7b, 0x20, 
+	0x64, 0x6f, 0x75, 0x62, 0x6c, 0x65, 0x20, 0x61, 0x20, 0x3d, 0x20, 0x25, 0x73, 0x3b, 0x20, 0x64, 
+	0x6f, 0x75, 0x62, 0x6c, 0x65, 0x20, 0x62, 0x20, 0x3d, 0x20, 0x25, 0x73, 0x3b, 0x20, 0x25, 0x73, 
+	0x28, 0x73, 0x2c, 0x20, 0x61, 0x20, 0x25, 0x73, 0x20, 0x62, 0x29, 0x3b, 0x20, 0x7d, 0x27, 0x2c, 
+	0x20, 0x78, 0x2c, 0x20, 0x79, 0x2c, 0x20, 0x70, 0x75, 0x73, 0x68, 0x2c, 0x20, 0x61, 0x72, 0x69, 
+	0x74, 0x68, 0x5b, 0x6f, 0x70, 0x5d, 0x29, 0xa, 0x9, 0x9, 0x9, 0x9, 0x6e, 0x65, 0x78, 0x74, 
+	0x5f, 0x64, 0x20, 0x3d, 0x20, 0x64, 0x20, 0x2b, 0x20, 0x31, 0xa, 0x9, 0x9, 0x9, 0x65, 0x6c, 
+	0x73, 0x65, 0x69, 0x66, 0x20, 0x6f, 0x70, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x45, 0x51, 0x5f, 0x4c, 
+	0x4c, 0x27, 0x20, 0x6f, 0x72, 0x20, 0x6f, 0x70, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x45, 0x51, 0x5f, 
+	0x4c, 0x4b, 0x27, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x9, 0x9, 0x9, 0x9, 0x69, 0x66, 0x20, 
+	0x6f, 0x70, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x45, 0x51, 0x5f, 0x4c, 0x4c, 0x27, 0x20, 0x74, 0x68, 
+	0x65, 0x6e, 0xa, 0x9, 0x9, 0x9, 0x9, 0x9, 0x65, 0x6d, 0x69, 0x74, 0x28, 0x27, 0x73, 0x75, 
+	0x5f, 0x70, 0x75, 0x73, 0x68, 0x62, 0x6f, 0x6f, 0x6c, 0x65, 0x61, 0x6e, 0x28, 0x73, 0x2c, 0x20, 
+	0x73, 0x75, 0x5f, 0x65, 0x71, 0x75, 0x61, 0x6c, 0x28, 0x73, 0x2c, 0x20, 0x25, 0x69, 0x2c, 0x20, 
+	0x25, 0x69, 0x29, 0x29, 0x3b, 0x27, 0x2c, 0x20, 0x61, 0x20, 0x2d, 0x20, 0x64, 0x2c, 0x20, 0x62, 
+	0x20, 0x2d, 0x20, 0x64, 0x29, 0xa, 0x9, 0x9, 0x9, 0x9, 0x65, 0x6c, 0x73, 0x65, 0xa, 0x9, 
+	0x9, 0x9, 0x9, 0x9, 0x65, 0x6d, 0x69, 0x74, 0x28, 0x27, 0x7b, 0x20, 0x69, 0x6e, 0x74, 0x20, 
+	0x72, 0x3b, 0x20, 0x25, 0x73, 0x20, 0x72, 0x20, 0x3d, 0x20, 0x73, 0x75, 0x5f, 0x65, 0x71, 0x75, 
+	0x61, 0x6c, 0x28, 0x73, 0x2c, 0x20, 0x25, 0x69, 0x2c, 0x20, 0x2d, 0x31, 0x29, 0x3b, 0x20, 0x73, 
+	0x75, 0x5f, 0x70, 0x6f, 0x70, 0x28, 0x73, 0x2c, 0x20, 0x31, 0x29, 0x3b, 0x20, 0x73, 0x75, 0x5f, 
+	0x70, 0x75, 0x73, 0x68, 0x62, 0x6f, 0x6f, 0x6c, 0x65, 0x61, 0x6e, 0x28, 0x73, 0x2c, 0x20, 0x72, 
+	0x29, 0x3b, 0x20, 0x7d, 0x27, 0x2c, 0x20, 0x70, 0x75, 0x73, 0x68, 0x5f, 0x63, 0x6f, 0x6e, 0x73, 
+	0x74, 0x28, 0x61, 0x73, 0x6d, 0x2c, 0x20, 0x62, 0x29, 0x2c, 0x20, 0x61, 0x20, 0x2d, 0x20, 0x64, 
+	0x20, 0x2d, 0x20, 0x31, 0x29, 0xa, 0x9, 0x9, 0x9, 0x9, 0x65, 0x6e, 0x64, 0xa, 0x9, 0x9, 
+	0x9, 0x9, 0x6e, 0x65, 0x78, 0x74, 0x5f, 0x64, 0x20, 0x3d, 0x20, 0x64, 0x20, 0x2b, 0x20, 0x31, 
+	0xa, 0x9, 0x9, 0x9, 0x65, 0x6c, 0x73, 0x65, 0xa, 0x9, 0x9, 0x9, 0x9, 0x65, 0x72, 0x72, 
+	0x6f, 0x72, 0x28, 0x27, 0x49, 0x6e, 0x76, 0x61, 0x6c, 0x69, 0x64, 0x20, 0x41, 0x4f, 0x54, 0x20, 
+	0x69, 0x6e, 0x73, 0x74, 0x72, 0x75, 0x63, 0x74, 0x69, 0x6f, 0x6e, 0x3a, 0x20, 0x27, 0x20, 0x2e, 
+	0x2e, 0x20, 0x6f, 0x70, 0x29, 0xa, 0x9, 0x9, 0x9, 0x65, 0x6e, 0x64, 0xa, 0x9, 0x9, 0x65, 
+	0x6e, 0x64, 0xa, 0xa, 0x9, 0x9, 0x69, 0x66, 0x20, 0x6e, 0x65, 0x78, 0x74, 0x5f, 0x64, 0x20, 
+	0x61, 0x6e, 0x64, 0x20, 0x69, 0x20, 0x2b, 0x20, 0x73, 0x69, 0x7a, 0x65, 0x20, 0x3c, 0x3d, 0x20, 
+	0x23, 0x61, 0x73, 0x6d, 0x2e, 0x69, 0x6e, 0x73, 0x74, 0x72, 0x75, 0x63, 0x74, 0x69, 0x6f, 0x6e, 
+	0x73, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x9, 0x9, 0x9, 0x72, 0x65, 0x61, 0x63, 0x68, 0x28, 
+	0x70, 0x63, 0x20, 0x2b, 0x20, 0x73, 0x69, 0x7a, 0x65, 0x2c, 0x20, 0x6e, 0x65, 0x78, 0x74, 0x5f, 
+	0x64, 0x29, 0xa, 0x9, 0x9, 0x65, 0x6e, 0x64, 0xa, 0x9, 0x9, 0x69, 0x20, 0x3d, 0x20, 0x69, 
+	0x20, 0x2b, 0x20, 0x73, 0x69, 0x7a, 0x65, 0xa, 0x9, 0x65, 0x6e, 0x64, 0xa, 0xa, 0x9, 0x2d, 
+	0x2d, 0x20, 0x41, 0x20, 0x62, 0x72, 0x61, 0x6e, 0x63, 0x68, 0x20, 0x74, 0x68, 0x61, 0x74, 0x20, 
+	0x69, 0x73, 0x20, 0x6e, 0x65, 0x76, 0x65, 0x72, 0x20, 0x72, 0x65, 0x61, 0x63, 0x68, 0x65, 0x64, 
+	0x2c, 0x20, 0x6c, 0x69, 0x6b, 0x65, 0x20, 0x74, 0x68, 0x65, 0x20, 0x4a, 0x4d, 0x50, 0x20, 0x61, 
+	0x66, 0x74, 0x65, 0x72, 0x20, 0x61, 0x20, 0x73, 0x65, 0x6c, 0x66, 0x20, 0x74, 0x61, 0x69, 0x6c, 
+	0x20, 0x63, 0x61, 0x6c, 0x6c, 0x2c, 0xa, 0x9, 0x2d, 0x2d, 0x20, 0x65, 0x6d, 0x69, 0x74, 0x73, 
+	0x20, 0x6e, 0x6f, 0x20, 0x67, 0x6f, 0x74, 0x6f, 0x2c, 0x20, 0x73, 0x6f, 0x20, 0x69, 0x74, 0x73, 
+	0x20, 0x74, 0x61, 0x72, 0x67, 0x65, 0x74, 0x20, 0x69, 0x73, 0x20, 0x6f, 0x6e, 0x6c, 0x79, 0x20, 
+	0x6b, 0x6e, 0x6f, 0x77, 0x6e, 0x20, 0x74, 0x6f, 0x20, 0x62, 0x65, 0x20, 0x75, 0x6e, 0x75, 0x73, 
+	0x65, 0x64, 0x20, 0x61, 0x74, 0x20, 0x74, 0x68, 0x65, 0x20, 0x65, 0x6e, 0x64, 0x2e, 0xa, 0x9, 
+	0x66, 0x6f, 0x72, 0x20, 0x6b, 0x20, 0x3d, 0x20, 0x23, 0x63, 0x6f, 0x64, 0x65, 0x2c, 0x20, 0x31, 
+	0x2c, 0x20, 0x2d, 0x31, 0x20, 0x64, 0x6f, 0xa, 0x9, 0x9, 0x69, 0x66, 0x20, 0x6c, 0x61, 0x62, 
+	0x65, 0x6c, 0x73, 0x5b, 0x6b, 0x5d, 0x20, 0x61, 0x6e, 0x64, 0x20, 0x6e, 0x6f, 0x74, 0x20, 0x6a, 
+	0x75, 0x6d, 0x70, 0x65, 0x64, 0x5b, 0x6c, 0x61, 0x62, 0x65, 0x6c, 0x73, 0x5b, 0x6b, 0x5d, 0x5d, 
+	0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x9, 0x9, 0x9, 0x74, 0x61, 0x62, 0x6c, 0x65, 0x2e, 0x72, 
+	0x65, 0x6d, 0x6f, 0x76, 0x65, 0x28, 0x63, 0x6f, 0x64, 0x65, 0x2c, 0x20, 0x6b, 0x29, 0xa, 0x9, 
+	0x9, 0x65, 0x6e, 0x64, 0xa, 0x9, 0x65, 0x6e, 0x64, 0xa, 0xa, 0x9, 0x74, 0x61, 0x62, 0x6c, 
+	0x65, 0x2e, 0x69, 0x6e, 0x73, 0x65, 0x72, 0x74, 0x28, 0x63, 0x6f, 0x64, 0x65, 0x2c, 0x20, 0x27, 
+	0x7d, 0x5c, 0x6e, 0x5c, 0x6e, 0x27, 0x29, 0xa, 0x9, 0x72, 0x65, 0x74, 0x75, 0x72, 0x6e, 0x20, 
+	0x74, 0x61, 0x62, 0x6c, 0x65, 0x2e, 0x63, 0x6f, 0x6e, 0x63, 0x61, 0x74, 0x28, 0x63, 0x6f, 0x64, 
+	0x65, 0x2c, 0x20, 0x27, 0x5c, 0x6e, 0x27, 0x29, 0xa, 0x65, 0x6e, 0x64, 0xa, 0xa, 0x2d, 0x2d, 
+	0x20, 0x54, 0x72, 0x61, 0x6e, 0x73, 0x6c, 0x61, 0x74, 0x65, 0x73, 0x20, 0x6e, 0x65, 0x73, 0x74, 
+	0x65, 0x64, 0x20, 0x6c, 0x61, 0x6d, 0x62, 0x64, 0x61, 0x73, 0x20, 0x62, 0x6f, 0x74, 0x74, 0x6f, 
+	0x6d, 0x20, 0x75, 0x70, 0x20, 0x61, 0x6e, 0x64, 0x20, 0x72, 0x65, 0x77, 0x72, 0x69, 0x74, 0x65, 
+	0x73, 0x20, 0x74, 0x68, 0x65, 0x20, 0x4c, 0x41, 0x4d, 0x42, 0x44, 0x41, 0x20, 0x69, 0x6e, 0x73, 
+	0x74, 0x72, 0x75, 0x63, 0x74, 0x69, 0x6f, 0x6e, 0x73, 0xa, 0x2d, 0x2d, 0x20, 0x74, 0x68, 0x61, 
+	0x74, 0x20, 0x63, 0x72, 0x65, 0x61, 0x74, 0x65, 0x20, 0x74, 0x68, 0x65, 0x6d, 0x20, 0x74, 0x6f, 
+	0x20, 0x4c, 0x43, 0x4c, 0x2e, 0xa, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x20, 0x66, 0x75, 0x6e, 0x63, 
+	0x74, 0x69, 0x6f, 0x6e, 0x20, 0x61, 0x6f, 0x74, 0x5f, 0x66, 0x75, 0x6e, 0x63, 0x28, 0x61, 0x73, 
+	0x6d, 0x29, 0xa, 0x9, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x20, 0x70, 0x72, 0x6f, 0x74, 0x6f, 0x74, 
+	0x79, 0x70, 0x65, 0x73, 0x20, 0x3d, 0x20, 0x7b, 0x7d, 0xa, 0x9, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 
+	0x20, 0x6d, 0x61, 0x70, 0x20, 0x3d, 0x20, 0x7b, 0x7d, 0xa, 0xa, 0x9, 0x66, 0x6f, 0x72, 0x20, 
+	0x69, 0x2c, 0x76, 0x20, 0x69, 0x6e, 0x20, 0x69, 0x70, 0x61, 0x69, 0x72, 0x73, 0x28, 0x61, 0x73, 
+	0x6d, 0x2e, 0x70, 0x72, 0x6f, 0x74, 0x6f, 0x74, 0x79, 0x70, 0x65, 0x73, 0x29, 0x20, 0x64, 0x6f, 
+	0xa, 0x9, 0x9, 0x61, 0x6f, 0x74, 0x5f, 0x66, 0x75, 0x6e, 0x63, 0x28, 0x76, 0x29, 0xa, 0x9, 
+	0x9, 0x69, 0x66, 0x20, 0x74, 0x72, 0x61, 0x6e, 0x73, 0x6c, 0x61, 0x74, 0x61, 0x62, 0x6c, 0x65, 
+	0x28, 0x76, 0x29, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x9, 0x9, 0x9, 0x6c, 0x6f, 0x63, 0x61, 
+	0x6c, 0x20, 0x6e, 0x61, 0x6d, 0x65, 0x20, 0x3d, 0x20, 0x27, 0x61, 0x6f, 0x74, 0x27, 0x20, 0x2e, 
+	0x2e, 0x20, 0x74, 0x6f, 0x73, 0x74, 0x72, 0x69, 0x6e, 0x67, 0x28, 0x23, 0x63, 0x5f, 0x66, 0x75, 
+	0x6e, 0x63, 0x29, 0xa, 0x9, 0x9, 0x9, 0x74, 0x61, 0x62, 0x6c, 0x65, 0x2e, 0x69, 0x6e, 0x73, 
+	0x65, 0x72, 0x74, 0x28, 0x63, 0x5f, 0x66, 0x75, 0x6e, 0x63, 0x2c, 0x20, 0x7b, 0x6e, 0x61, 0x6d, 
+	0x65, 0x20, 0x3d, 0x20, 0x6e, 0x61, 0x6d, 0x65, 0x7d, 0x29, 0xa, 0x9, 0x9, 0x9, 0x63, 0x5f, 
+	0x63, 0x6f, 0x64, 0x65, 0x20, 0x3d, 0x20, 0x63, 0x5f, 0x63, 0x6f, 0x64, 0x65, 0x20, 0x6f, 0x72, 
+	0x20, 0x27, 0x27, 0xa, 0x9, 0x9, 0x9, 0x70, 0x72, 0x65, 0x6c, 0x75, 0x64, 0x65, 0x5f, 0x61, 
+	0x74, 0x20, 0x3d, 0x20, 0x70, 0x72, 0x65, 0x6c, 0x75, 0x64, 0x65, 0x5f, 0x61, 0x74, 0x20, 0x6f, 
+	0x72, 0x20, 0x23, 0x63, 0x5f, 0x63, 0x6f, 0x64, 0x65, 0xa, 0x9, 0x9, 0x9, 0x63, 0x5f, 0x63, 
+	0x6f, 0x64, 0x65, 0x20, 0x3d, 0x20, 0x63, 0x5f, 0x63, 0x6f, 0x64, 0x65, 0x20, 0x2e, 0x2e, 0x20, 
+	0x74, 0x72, 0x61, 0x6e, 0x73, 0x6c, 0x61, 0x74, 0x65, 0x28, 0x76, 0x2c, 0x20, 0x6e, 0x61, 0x6d, 
+	0x65, 0x29, 0xa, 0x9, 0x9, 0x9, 0x6d, 0x61, 0x70, 0x5b, 0x69, 0x20, 0x2d, 0x20, 0x31, 0x5d, 
+	0x20, 0x3d, 0x20, 0x7b, 0x27, 0x4c, 0x43, 0x4c, 0x27, 0x2c, 0x20, 0x30, 0x2c, 0x20, 0x23, 0x63, 
+	0x5f, 0x66, 0x75, 0x6e, 0x63, 0x20, 0x2d, 0x20, 0x31, 0x7d, 0xa, 0x9, 0x9, 0x65, 0x6c, 0x73, 
+	0x65, 0xa, 0x9, 0x9, 0x9, 0x74, 0x61, 0x62, 0x6c, 0x65, 0x2e, 0x69, 0x6e, 0x73, 0x65, 0x72, 
+	0x74, 0x28, 0x70, 0x72, 0x6f, 0x74, 0x6f, 0x74, 0x79, 0x70, 0x65, 0x73, 0x2c, 0x20, 0x76, 0x29, 
+	0xa, 0x9, 0x9, 0x9, 0x6d, 0x61, 0x70, 0x5b, 0x69, 0x20, 0x2d, 0x20, 0x31, 0x5d, 0x20, 0x3d, 
+	0x20, 0x23, 0x70, 0x72, 0x6f, 0x74, 0x6f, 0x74, 0x79, 0x70, 0x65, 0x73, 0x20, 0x2d, 0x20, 0x31, 
+	0xa, 0x9, 0x9, 0x65, 0x6e, 0x64, 0xa, 0x9, 0x65, 0x6e, 0x64, 0xa, 0xa, 0x9, 0x66, 0x6f, 
+	0x72, 0x20, 0x69, 0x2c, 0x76, 0x20, 0x69, 0x6e, 0x20, 0x69, 0x70, 0x61, 0x69, 0x72, 0x73, 0x28, 
+	0x61, 0x73, 0x6d, 0x2e, 0x69, 0x6e, 0x73, 0x74, 0x72, 0x75, 0x63, 0x74, 0x69, 0x6f, 0x6e, 0x73, 
+	0x29, 0x20, 0x64, 0x6f, 0xa, 0x9, 0x9, 0x69, 0x66, 0x20, 0x76, 0x5b, 0x31, 0x5d, 0x20, 0x3d, 
+	0x3d, 0x20, 0x27, 0x4c, 0x41, 0x4d, 0x42, 0x44, 0x41, 0x27, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 
+	0x9, 0x9, 0x9, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x20, 0x6d, 0x20, 0x3d, 0x20, 0x6d, 0x61, 0x70, 
+	0x5b, 0x76, 0x5b, 0x32, 0x5d, 0x5d, 0xa, 0x9, 0x9, 0x9, 0x69, 0x66, 0x20, 0x74, 0x79, 0x70, 
+	0x65, 0x28, 0x6d, 0x29, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x74, 0x61, 0x62, 0x6c, 0x65, 0x27, 0x20, 
+	0x74, 0x68, 0x65, 0x6e, 0xa, 0x9, 0x9, 0x9, 0x9, 0x61, 0x73, 0x6d, 0x2e, 0x69, 0x6e, 0x73, 
+	0x74, 0x72, 0x75, 0x63, 0x74, 0x69, 0x6f, 0x6e, 0x73, 0x5b, 0x69, 0x5d, 0x20, 0x3d, 0x20, 0x6d, 
+	0xa, 0x9, 0x9, 0x9, 0x65, 0x6c, 0x73, 0x65, 0xa, 0x9, 0x9, 0x9, 0x9, 0x76, 0x5b, 0x32, 
+	0x5d, 0x20, 0x3d, 0x20, 0x6d, 0xa, 0x9, 0x9, 0x9, 0x65, 0x6e, 0x64, 0xa, 0x9, 0x9, 0x65, 
+	0x6e, 0x64, 0xa, 0x9, 0x65, 0x6e, 0x64, 0xa, 0x9, 0x61, 0x73, 0x6d, 0x2e, 0x70, 0x72, 0x6f, 
+	0x74, 0x6f, 0x74, 0x79, 0x70, 0x65, 0x73, 0x20, 0x3d, 0x20, 0x70, 0x72, 0x6f, 0x74, 0x6f, 0x74, 
+	0x79, 0x70, 0x65, 0x73, 0xa, 0x65, 0x6e, 0x64, 0xa, 0xa, 0x66, 0x75, 0x6e, 0x63, 0x74, 0x69, 
+	0x6f, 0x6e, 0x20, 0x61, 0x6f, 0x74, 0x28, 0x61, 0x73, 0x6d, 0x29, 0xa, 0x9, 0x70, 0x72, 0x65, 
+	0x6c, 0x75, 0x64, 0x65, 0x5f, 0x61, 0x74, 0x20, 0x3d, 0x20, 0x6e, 0x69, 0x6c, 0xa, 0x9, 0x61, 
+	0x6f, 0x74, 0x5f, 0x66, 0x75, 0x6e, 0x63, 0x28, 0x61, 0x73, 0x6d, 0x29, 0xa, 0x9, 0x69, 0x66, 
+	0x20, 0x70, 0x72, 0x65, 0x6c, 0x75, 0x64, 0x65, 0x5f, 0x61, 0x74, 0x20, 0x74, 0x68, 0x65, 0x6e, 
+	0xa, 0x9, 0x9, 0x63, 0x5f, 0x63, 0x6f, 0x64, 0x65, 0x20, 0x3d, 0x20, 0x73, 0x74, 0x72, 0x69, 
+	0x6e, 0x67, 0x2e, 0x73, 0x75, 0x62, 0x28, 0x63, 0x5f, 0x63, 0x6f, 0x64, 0x65, 0x2c, 0x20, 0x31, 
+	0x2c, 0x20, 0x70, 0x72, 0x65, 0x6c, 0x75, 0x64, 0x65, 0x5f, 0x61, 0x74, 0x29, 0x20, 0x2e, 0x2e, 
+	0x20, 0x61, 0x6f, 0x74, 0x5f, 0x70, 0x72, 0x65, 0x6c, 0x75, 0x64, 0x65, 0x28, 0x63, 0x5f, 0x63, 
+	0x6f, 0x64, 0x65, 0x29, 0x20, 0x2e, 0x2e, 0x20, 0x73, 0x74, 0x72, 0x69, 0x6e, 0x67, 0x2e, 0x73, 
+	0x75, 0x62, 0x28, 0x63, 0x5f, 0x63, 0x6f, 0x64, 0x65, 0x2c, 0x20, 0x70, 0x72, 0x65, 0x6c, 0x75, 
+	0x64, 0x65, 0x5f, 0x61, 0x74, 0x20, 0x2b, 0x20, 0x31, 0x29, 0xa, 0x9, 0x65, 0x6e, 0x64, 0xa, 
+	0x65, 0x6e, 0x64, 0xa, 0xa, 0x65, 0x6e, 0x64, 0xa, 0xa, 0xa, 0x53, 0x41, 0x55, 0x52, 0x55, 
+	0x53, 0x5f, 0x56, 0x45, 0x52, 0x53, 0x49, 0x4f, 0x4e, 0x20, 0x3d, 0x20, 0x7b, 0x30, 0x2c, 0x20, 
+	0x30, 0x2c, 0x20, 0x31, 0x7d, 0xa, 0x53, 0x41, 0x55, 0x52, 0x55, 0x53, 0x5f, 0x56, 0x45, 0x52, 
+	0x53, 0x49, 0x4f, 0x4e, 0x5f, 0x53, 0x54, 0x52, 0x49, 0x4e, 0x47, 0x20, 0x3d, 0x20, 0x73, 0x74, 
+	0x72, 0x69, 0x6e, 0x67, 0x2e, 0x66, 0x6f, 0x72, 0x6d, 0x61, 0x74, 0x28, 0x27, 0x25, 0x69, 0x2e, 
+	0x25, 0x69, 0x2e, 0x25, 0x69, 0x27, 0x2c, 0x20, 0x75, 0x6e, 0x70, 0x61, 0x63, 0x6b, 0x28, 0x53, 
+	0x41, 0x55, 0x52, 0x55, 0x53, 0x5f, 0x56, 0x45, 0x52, 0x53, 0x49, 0x4f, 0x4e, 0x29, 0x29, 0xa, 
+	0xa, 0x66, 0x75, 0x6e, 0x63, 0x74, 0x69, 0x6f, 0x6e, 0x20, 0x67, 0x65, 0x74, 0x5f, 0x66, 0x69, 
+	0x6c, 0x65, 0x5f, 0x70, 0x61, 0x74, 0x68, 0x28, 0x73, 0x74, 0x72, 0x29, 0xa, 0x9, 0x6c, 0x6f, 
+	0x63, 0x61, 0x6c, 0x20, 0x72, 0x6f, 0x6f, 0x74, 0x5f, 0x70, 0x61, 0x74, 0x68, 0x20, 0x3d, 0x20, 
+	0x73, 0x74, 0x72, 0xa, 0x9, 0x69, 0x66, 0x20, 0x73, 0x74, 0x72, 0x20, 0x74, 0x68, 0x65, 0x6e, 
+	0xa, 0x9, 0x9, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x20, 0x69, 0x6e, 0x64, 0x65, 0x78, 0x20, 0x3d, 
+	0x20, 0x73, 0x74, 0x72, 0x3a, 0x72, 0x65, 0x76, 0x65, 0x72, 0x73, 0x65, 0x28, 0x29, 0x3a, 0x66, 
+	0x69, 0x6e, 0x64, 0x28, 0x27, 0x2f, 0x27, 0x2c, 0x20, 0x31, 0x2c, 0x20, 0x74, 0x72, 0x75, 0x65, 
+	0x29, 0xa, 0x9, 0x9, 0x72, 0x6f, 0x6f, 0x74, 0x5f, 0x70, 0x61, 0x74, 0x68, 0x20, 0x3d, 0x20, 
+	0x69, 0x6e, 0x64, 0x65, 0x78, 0x20, 0x61, 0x6e, 0x64, 0x20, 0x73, 0x74, 0x72, 0x3a, 0x73, 0x75, 
+	0x62, 0x28, 0x31, 0x2c, 0x20, 0x2d, 0x69, 0x6e, 0x64, 0x65, 0x78, 0x29, 0x20, 0x6f, 0x72, 0x20, 
+	0x27, 0x2e, 0x27, 0xa, 0x9, 0x65, 0x6e, 0x64, 0xa, 0x9, 0x72, 0x65, 0x74, 0x75, 0x72, 0x6e, 
+	0x20, 0x72, 0x6f, 0x6f, 0x74, 0x5f, 0x70, 0x61, 0x74, 0x68, 0xa, 0x65, 0x6e, 0x64, 0xa, 0xa, 
+	0x66, 0x75, 0x6e, 0x63, 0x74, 0x69, 0x6f, 0x6e, 0x20, 0x72, 0x65, 0x70, 0x6c, 0x28, 0x73, 0x72, 
+	0x63, 0x2c, 0x20, 0x6e, 0x61, 0x6d, 0x65, 0x2c, 0x20, 0x70, 0x61, 0x74, 0x68, 0x2c, 0x20, 0x61, 
+	0x73, 0x6d, 0x5f, 0x6f, 0x75, 0x74, 0x2c, 0x20, 0x61, 0x6f, 0x74, 0x5f, 0x6f, 0x75, 0x74, 0x29, 
 	0xa, 0x9, 0x63, 0x5f, 0x67, 0x75, 0x61, 0x72, 0x64, 0x20, 0x3d, 0x20, 0x7b, 0x7d, 0xa, 0x9, 
 	0x63, 0x5f, 0x66, 0x75, 0x6e, 0x63, 0x20, 0x3d, 0x20, 0x7b, 0x7d, 0xa, 0x9, 0x63, 0x5f, 0x63, 
 	0x6f, 0x64, 0x65, 0x20, 0x3d, 0x20, 0x6e, 0x69, 0x6c, 0xa, 0xa, 0x9, 0x6c, 0x6f, 0x63, 0x61, 
@@ -2567,118 +4029,124 @@ const char compiler_code[] = {
 	0x5f, 0x70, 0x72, 0x69, 0x6e, 0x74, 0x28, 0x61, 0x73, 0x74, 0x29, 0xa, 0xa, 0x9, 0x6c, 0x6f, 
 	0x63, 0x61, 0x6c, 0x20, 0x61, 0x73, 0x6d, 0x20, 0x3d, 0x20, 0x67, 0x65, 0x6e, 0x65, 0x72, 0x61, 
 	0x74, 0x65, 0x28, 0x61, 0x73, 0x74, 0x2c, 0x20, 0x6e, 0x61, 0x6d, 0x65, 0x20, 0x6f, 0x72, 0x20, 
-	0x27, 0x3f, 0x27, 0x29, 0xa, 0x9, 0x69, 0x66, 0x20, 0x61, 0x73, 0x6d, 0x5f, 0x6f, 0x75, 0x74, 
-	0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x9, 0x9, 0x67, 0x65, 0x6e, 0x5f, 0x70, 0x72, 0x69, 0x6e, 
-	0x74, 0x28, 0x61, 0x73, 0x6d, 0x2c, 0x20, 0x6e, 0x69, 0x6c, 0x2c, 0x20, 0x61, 0x73, 0x6d, 0x5f, 
-	0x6f, 0x75, 0x74, 0x29, 0xa, 0x9, 0x9, 0x72, 0x65, 0x74, 0x75, 0x72, 0x6e, 0xa, 0x9, 0x65, 
-	0x6e, 0x64, 0xa, 0x9, 0x72, 0x65, 0x74, 0x75, 0x72, 0x6e, 0x20, 0x61, 0x73, 0x73, 0x65, 0x6d, 
-	0x62, 0x6c, 0x65, 0x28, 0x61, 0x73, 0x6d, 0x2c, 0x20, 0x64, 0x65, 0x73, 0x74, 0x29, 0xa, 0x65, 
-	0x6e, 0x64, 0xa, 0xa, 0x66, 0x75, 0x6e, 0x63, 0x74, 0x69, 0x6f, 0x6e, 0x20, 0x63, 0x6f, 0x6d, 
-	0x70, 0x69, 0x6c, 0x65, 0x28, 0x73, 0x72, 0x63, 0x2c, 0x20, 0x64, 0x65, 0x73, 0x74, 0x2c, 0x20, 
-	0x63, 0x6f, 0x6d, 0x70, 0x69, 0x6c, 0x65, 0x29, 0xa, 0x9, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x20, 
-	0x66, 0x70, 0x20, 0x3d, 0x20, 0x69, 0x6f, 0x2e, 0x6f, 0x70, 0x65, 0x6e, 0x28, 0x73, 0x72, 0x63, 
-	0x2c, 0x20, 0x27, 0x72, 0x62, 0x27, 0x29, 0xa, 0x9, 0x69, 0x66, 0x20, 0x6e, 0x6f, 0x74, 0x20, 
-	0x66, 0x70, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x9, 0x9, 0x73, 0x61, 0x75, 0x72, 0x75, 0x73, 
-	0x5f, 0x65, 0x72, 0x72, 0x6f, 0x72, 0x20, 0x3d, 0x20, 0x27, 0x43, 0x6f, 0x75, 0x6c, 0x64, 0x20, 
-	0x6e, 0x6f, 0x74, 0x20, 0x6f, 0x70, 0x65, 0x6e, 0x3a, 0x20, 0x27, 0x20, 0x2e, 0x2e, 0x20, 0x73, 
-	0x72, 0x63, 0xa, 0x9, 0x9, 0x65, 0x72, 0x72, 0x6f, 0x72, 0x28, 0x73, 0x61, 0x75, 0x72, 0x75, 
-	0x73, 0x5f, 0x65, 0x72, 0x72, 0x6f, 0x72, 0x29, 0xa, 0x9, 0x65, 0x6e, 0x64, 0xa, 0xa, 0x9, 
-	0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x20, 0x6f, 0x75, 0x74, 0x5f, 0x66, 0x70, 0x20, 0x3d, 0x20, 0x69, 
-	0x6f, 0x2e, 0x6f, 0x70, 0x65, 0x6e, 0x28, 0x64, 0x65, 0x73, 0x74, 0x2c, 0x20, 0x27, 0x77, 0x62, 
-	0x27, 0x29, 0xa, 0x9, 0x69, 0x66, 0x20, 0x6e, 0x6f, 0x74, 0x20, 0x66, 0x70, 0x20, 0x74, 0x68, 
-	0x65, 0x6e, 0xa, 0x9, 0x9, 0x73, 0x61, 0x75, 0x72, 0x75, 0x73, 0x5f, 0x65, 0x72, 0x72, 0x6f, 
-	0x72, 0x20, 0x3d, 0x20, 0x27, 0x43, 0x6f, 0x75, 0x6c, 0x64, 0x20, 0x6e, 0x6f, 0x74, 0x20, 0x6f, 
-	0x70, 0x65, 0x6e, 0x3a, 0x20, 0x27, 0x20, 0x2e, 0x2e, 0x20, 0x64, 0x65, 0x73, 0x74, 0xa, 0x9, 
-	0x9, 0x65, 0x72, 0x72, 0x6f, 0x72, 0x28, 0x73, 0x61, 0x75, 0x72, 0x75, 0x73, 0x5f, 0x65, 0x72, 
-	0x72, 0x6f, 0x72, 0x29, 0xa, 0x9, 0x65, 0x6e, 0x64, 0xa, 0xa, 0x9, 0x6c, 0x6f, 0x63, 0x61, 
-	0x6c, 0x20, 0x61, 0x73, 0x6d, 0x5f, 0x6f, 0x75, 0x74, 0x20, 0x3d, 0x20, 0x63, 0x6f, 0x6d, 0x70, 
-	0x69, 0x6c, 0x65, 0x20, 0x61, 0x6e, 0x64, 0x20, 0x73, 0x74, 0x72, 0x69, 0x6e, 0x67, 0x2e, 0x73, 
-	0x75, 0x62, 0x28, 0x64, 0x65, 0x73, 0x74, 0x2c, 0x20, 0x2d, 0x34, 0x29, 0x20, 0x3d, 0x3d, 0x20, 
-	0x27, 0x2e, 0x73, 0x75, 0x61, 0x27, 0xa, 0x9, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x20, 0x72, 0x65, 
-	0x73, 0x20, 0x3d, 0x20, 0x72, 0x65, 0x70, 0x6c, 0x28, 0x66, 0x70, 0x3a, 0x72, 0x65, 0x61, 0x64, 
-	0x28, 0x27, 0x2a, 0x61, 0x27, 0x29, 0x2c, 0x20, 0x73, 0x72, 0x63, 0x2c, 0x20, 0x67, 0x65, 0x74, 
-	0x5f, 0x66, 0x69, 0x6c, 0x65, 0x5f, 0x70, 0x61, 0x74, 0x68, 0x28, 0x73, 0x72, 0x63, 0x29, 0x2c, 
-	0x20, 0x61, 0x73, 0x6d, 0x5f, 0x6f, 0x75, 0x74, 0x20, 0x61, 0x6e, 0x64, 0x20, 0x6f, 0x75, 0x74, 
-	0x5f, 0x66, 0x70, 0x29, 0xa, 0xa, 0x9, 0x66, 0x70, 0x3a, 0x63, 0x6c, 0x6f, 0x73, 0x65, 0x28, 
-	0x29, 0xa, 0x9, 0x66, 0x70, 0x20, 0x3d, 0x20, 0x6f, 0x75, 0x74, 0x5f, 0x66, 0x70, 0xa, 0xa, 
-	0x9, 0x69, 0x66, 0x20, 0x63, 0x6f, 0x6d, 0x70, 0x69, 0x6c, 0x65, 0x20, 0x61, 0x6e, 0x64, 0x20, 
-	0x73, 0x74, 0x72, 0x69, 0x6e, 0x67, 0x2e, 0x73, 0x75, 0x62, 0x28, 0x64, 0x65, 0x73, 0x74, 0x2c, 
-	0x20, 0x2d, 0x32, 0x29, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x2e, 0x63, 0x27, 0x20, 0x74, 0x68, 0x65, 
-	0x6e, 0xa, 0x9, 0x9, 0x66, 0x70, 0x3a, 0x77, 0x72, 0x69, 0x74, 0x65, 0x28, 0x73, 0x74, 0x72, 
-	0x69, 0x6e, 0x67, 0x2e, 0x66, 0x6f, 0x72, 0x6d, 0x61, 0x74, 0x28, 0x27, 0x2f, 0x2a, 0x5c, 0x6e, 
-	0x20, 0x2a, 0x20, 0x47, 0x65, 0x6e, 0x65, 0x72, 0x61, 0x74, 0x65, 0x64, 0x20, 0x77, 0x69, 0x74, 
-	0x68, 0x20, 0x53, 0x61, 0x75, 0x72, 0x75, 0x73, 0x20, 0x76, 0x20, 0x25, 0x73, 0x5c, 0x6e, 0x27, 
-	0x2c, 0x20, 0x53, 0x41, 0x55, 0x52, 0x55, 0x53, 0x5f, 0x56, 0x45, 0x52, 0x53, 0x49, 0x4f, 0x4e, 
-	0x5f, 0x53, 0x54, 0x52, 0x49, 0x4e, 0x47, 0x29, 0x29, 0xa, 0x9, 0x9, 0x66, 0x70, 0x3a, 0x77, 
-	0x72, 0x69, 0x74, 0x65, 0x28, 0x73, 0x74, 0x72, 0x69, 0x6e, 0x67, 0x2e, 0x66, 0x6f, 0x72, 0x6d, 
-	0x61, 0x74, 0x28, 0x27, 0x20, 0x2a, 0x20, 0x68, 0x74, 0x74, 0x70, 0x3a, 0x2f, 0x2f, 0x77, 0x77, 
-	0x77, 0x2e, 0x73, 0x61, 0x75, 0x72, 0x75, 0x73, 0x2e, 0x6f, 0x72, 0x67, 0x5c, 0x6e, 0x20, 0x2a, 
-	0x2f, 0x5c, 0x6e, 0x5c, 0x6e, 0x27, 0x2c, 0x20, 0x73, 0x72, 0x63, 0x29, 0x29, 0xa, 0x9, 0x9, 
+	0x27, 0x3f, 0x27, 0x29, 0xa, 0x9, 0x70, 0x72, 0x6f, 0x66, 0x69, 0x6c, 0x65, 0x28, 0x61, 0x73, 
+	0x6d, 0x29, 0xa, 0x9, 0x69, 0x66, 0x20, 0x61, 0x73, 0x6d, 0x5f, 0x6f, 0x75, 0x74, 0x20, 0x74, 
+	0x68, 0x65, 0x6e, 0xa, 0x9, 0x9, 0x67, 0x65, 0x6e, 0x5f, 0x70, 0x72, 0x69, 0x6e, 0x74, 0x28, 
+	0x61, 0x73, 0x6d, 0x2c, 0x20, 0x6e, 0x69, 0x6c, 0x2c, 0x20, 0x61, 0x73, 0x6d, 0x5f, 0x6f, 0x75, 
+	0x74, 0x29, 0xa, 0x9, 0x9, 0x72, 0x65, 0x74, 0x75, 0x72, 0x6e, 0xa, 0x9, 0x65, 0x6e, 0x64, 
+	0xa, 0x9, 0x69, 0x66, 0x20, 0x61, 0x6f, 0x74, 0x5f, 0x6f, 0x75, 0x74, 0x20, 0x74, 0x68, 0x65, 
+	0x6e, 0xa, 0x9, 0x9, 0x61, 0x6f, 0x74, 0x28, 0x61, 0x73, 0x6d, 0x29, 0xa, 0x9, 0x65, 0x6e, 
+	0x64, 0xa, 0x9, 0x72, 0x65, 0x74, 0x75, 0x72, 0x6e, 0x20, 0x61, 0x73, 0x73, 0x65, 0x6d, 0x62, 
+	0x6c, 0x65, 0x28, 0x61, 0x73, 0x6d, 0x2c, 0x20, 0x64, 0x65, 0x73, 0x74, 0x29, 0xa, 0x65, 0x6e, 
+	0x64, 0xa, 0xa, 0x66, 0x75, 0x6e, 0x63, 0x74, 0x69, 0x6f, 0x6e, 0x20, 0x63, 0x6f, 0x6d, 0x70, 
+	0x69, 0x6c, 0x65, 0x28, 0x73, 0x72, 0x63, 0x2c, 0x20, 0x64, 0x65, 0x73, 0x74, 0x2c, 0x20, 0x63, 
+	0x6f, 0x6d, 0x70, 0x69, 0x6c, 0x65, 0x2c, 0x20, 0x74, 0x72, 0x61, 0x6e, 0x73, 0x6c, 0x61, 0x74, 
+	0x65, 0x29, 0xa, 0x9, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x20, 0x66, 0x70, 0x20, 0x3d, 0x20, 0x69, 
+	0x6f, 0x2e, 0x6f, 0x70, 0x65, 0x6e, 0x28, 0x73, 0x72, 0x63, 0x2c, 0x20, 0x27, 0x72, 0x62, 0x27, 
+	0x29, 0xa, 0x9, 0x69, 0x66, 0x20, 0x6e, 0x6f, 0x74, 0x20, 0x66, 0x70, 0x20, 0x74, 0x68, 0x65, 
+	0x6e, 0xa, 0x9, 0x9, 0x73, 0x61, 0x75, 0x72, 0x75, 0x73, 0x5f, 0x65, 0x72, 0x72, 0x6f, 0x72, 
+	0x20, 0x3d, 0x20, 0x27, 0x43, 0x6f, 0x75, 0x6c, 0x64, 0x20, 0x6e, 0x6f, 0x74, 0x20, 0x6f, 0x70, 
+	0x65, 0x6e, 0x3a, 0x20, 0x27, 0x20, 0x2e, 0x2e, 0x20, 0x73, 0x72, 0x63, 0xa, 0x9, 0x9, 0x65, 
+	0x72, 0x72, 0x6f, 0x72, 0x28, 0x73, 0x61, 0x75, 0x72, 0x75, 0x73, 0x5f, 0x65, 0x72, 0x72, 0x6f, 
+	0x72, 0x29, 0xa, 0x9, 0x65, 0x6e, 0x64, 0xa, 0xa, 0x9, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x20, 
+	0x6f, 0x75, 0x74, 0x5f, 0x66, 0x70, 0x20, 0x3d, 0x20, 0x69, 0x6f, 0x2e, 0x6f, 0x70, 0x65, 0x6e, 
+	0x28, 0x64, 0x65, 0x73, 0x74, 0x2c, 0x20, 0x27, 0x77, 0x62, 0x27, 0x29, 0xa, 0x9, 0x69, 0x66, 
+	0x20, 0x6e, 0x6f, 0x74, 0x20, 0x66, 0x70, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x9, 0x9, 0x73, 
+	0x61, 0x75, 0x72, 0x75, 0x73, 0x5f, 0x65, 0x72, 0x72, 0x6f, 0x72, 0x20, 0x3d, 0x20, 0x27, 0x43, 
+	0x6f, 0x75, 0x6c, 0x64, 0x20, 0x6e, 0x6f, 0x74, 0x20, 0x6f, 0x70, 0x65, 0x6e, 0x3a, 0x20, 0x27, 
+	0x20, 0x2e, 0x2e, 0x20, 0x64, 0x65, 0x73, 0x74, 0xa, 0x9, 0x9, 0x65, 0x72, 0x72, 0x6f, 0x72, 
+	0x28, 0x73, 0x61, 0x75, 0x72, 0x75, 0x73, 0x5f, 0x65, 0x72, 0x72, 0x6f, 0x72, 0x29, 0xa, 0x9, 
+	0x65, 0x6e, 0x64, 0xa, 0xa, 0x9, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x20, 0x61, 0x73, 0x6d, 0x5f, 
+	0x6f, 0x75, 0x74, 0x20, 0x3d, 0x20, 0x63, 0x6f, 0x6d, 0x70, 0x69, 0x6c, 0x65, 0x20, 0x61, 0x6e, 
+	0x64, 0x20, 0x73, 0x74, 0x72, 0x69, 0x6e, 0x67, 0x2e, 0x73, 0x75, 0x62, 0x28, 0x64, 0x65, 0x73, 
+	0x74, 0x2c, 0x20, 0x2d, 0x34, 0x29, 0x20, 0x3d, 0x3d, 0x20, 0x27, 0x2e, 0x73, 0x75, 0x61, 0x27, 
+	0xa, 0x9, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x20, 0x63, 0x5f, 0x6f, 0x75, 0x74, 0x20, 0x3d, 0x20, 
+	0x63, 0x6f, 0x6d, 0x70, 0x69, 0x6c, 0x65, 0x20, 0x61, 0x6e, 0x64, 0x20, 0x73, 0x74, 0x72, 0x69, 
+	0x6e, 0x67, 0x2e, 0x73, 0x75, 0x62, 0x28, 0x64, 0x65, 0x73, 0x74, 0x2c, 0x20, 0x2d, 0x32, 0x29, 
+	0x20, 0x3d, 0x3d, 0x20, 0x27, 0x2e, 0x63, 0x27, 0xa, 0x9, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x20, 
+	0x72, 0x65, 0x73, 0x20, 0x3d, 0x20, 0x72, 0x65, 0x70, 0x6c, 0x28, 0x66, 0x70, 0x3a, 0x72, 0x65, 
+	0x61, 0x64, 0x28, 0x27, 0x2a, 0x61, 0x27, 0x29, 0x2c, 0x20, 0x73, 0x72, 0x63, 0x2c, 0x20, 0x67, 
+	0x65, 0x74, 0x5f, 0x66, 0x69, 0x6c, 0x65, 0x5f, 0x70, 0x61, 0x74, 0x68, 0x28, 0x73, 0x72, 0x63, 
+	0x29, 0x2c, 0x20, 0x61, 0x73, 0x6d, 0x5f, 0x6f, 0x75, 0x74, 0x20, 0x61, 0x6e, 0x64, 0x20, 0x6f, 
+	0x75, 0x74, 0x5f, 0x66, 0x70, 0x2c, 0x20, 0x63, 0x5f, 0x6f, 0x75, 0x74, 0x20, 0x61, 0x6e, 0x64, 
+	0x20, 0x74, 0x72, 0x61, 0x6e, 0x73, 0x6c, 0x61, 0x74, 0x65, 0x29, 0xa, 0xa, 0x9, 0x66, 0x70, 
+	0x3a, 0x63, 0x6c, 0x6f, 0x73, 0x65, 0x28, 0x29, 0xa, 0x9, 0x66, 0x70, 0x20, 0x3d, 0x20, 0x6f, 
+	0x75, 0x74, 0x5f, 0x66, 0x70, 0xa, 0xa, 0x9, 0x69, 0x66, 0x20, 0x63, 0x5f, 0x6f, 0x75, 0x74, 
+	0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x9, 0x9, 0x66, 0x70, 0x3a, 0x77, 0x72, 0x69, 0x74, 0x65, 
+	0x28, 0x73, 0x74, 0x72, 0x69, 0x6e, 0x67, 0x2e, 0x66, 0x6f, 0x72, 0x6d, 0x61, 0x74, 0x28, 0x27, 
+	0x2f, 0x2a, 0x5c, 0x6e, 0x20, 0x2a, 0x20, 0x47, 0x65, 0x6e, 0x65, 0x72, 0x61, 0x74, 0x65, 0x64, 
+	0x20, 0x77, 0x69, 0x74, 0x68, 0x20, 0x53, 0x61, 0x75, 0x72, 0x75, 0x73, 0x20, 0x76, 0x20, 0x25, 
+	0x73, 0x5c, 0x6e, 0x27, 0x2c, 0x20, 0x53, 0x41, 0x55, 0x52, 0x55, 0x53, 0x5f, 0x56, 0x45, 0x52, 
+	0x53, 0x49, 0x4f, 0x4e, 0x5f, 0x53, 0x54, 0x52, 0x49, 0x4e, 0x47, 0x29, 0x29, 0xa, 0x9, 0x9, 
 	0x66, 0x70, 0x3a, 0x77, 0x72, 0x69, 0x74, 0x65, 0x28, 0x73, 0x74, 0x72, 0x69, 0x6e, 0x67, 0x2e, 
-	0x66, 0x6f, 0x72, 0x6d, 0x61, 0x74, 0x28, 0x27, 0x2f, 0x2a, 0x20, 0x25, 0x73, 0x20, 0x2a, 0x2f, 
-	0x5c, 0x6e, 0x5c, 0x6e, 0x23, 0x69, 0x6e, 0x63, 0x6c, 0x75, 0x64, 0x65, 0x20, 0x3c, 0x73, 0x61, 
-	0x75, 0x72, 0x75, 0x73, 0x2e, 0x68, 0x3e, 0x5c, 0x6e, 0x5c, 0x6e, 0x27, 0x2c, 0x20, 0x73, 0x72, 
-	0x63, 0x29, 0x29, 0xa, 0xa, 0x9, 0x9, 0x69, 0x66, 0x20, 0x63, 0x5f, 0x63, 0x6f, 0x64, 0x65, 
-	0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x9, 0x9, 0x9, 0x66, 0x70, 0x3a, 0x77, 0x72, 0x69, 0x74, 
-	0x65, 0x28, 0x27, 0x73, 0x74, 0x61, 0x74, 0x69, 0x63, 0x20, 0x69, 0x6e, 0x74, 0x20, 0x5f, 0x5f, 
-	0x5f, 0x73, 0x61, 0x75, 0x72, 0x75, 0x73, 0x28, 0x73, 0x75, 0x5f, 0x73, 0x74, 0x61, 0x74, 0x65, 
-	0x20, 0x2a, 0x73, 0x29, 0x3b, 0x5c, 0x6e, 0x5c, 0x6e, 0x27, 0x29, 0xa, 0x9, 0x9, 0x9, 0x66, 
-	0x70, 0x3a, 0x77, 0x72, 0x69, 0x74, 0x65, 0x28, 0x73, 0x74, 0x72, 0x69, 0x6e, 0x67, 0x2e, 0x66, 
-	0x6f, 0x72, 0x6d, 0x61, 0x74, 0x28, 0x27, 0x25, 0x73, 0x5c, 0x6e, 0x27, 0x2c, 0x20, 0x63, 0x5f, 
-	0x63, 0x6f, 0x64, 0x65, 0x29, 0x29, 0xa, 0x9, 0x9, 0x65, 0x6e, 0x64, 0xa, 0xa, 0x9, 0x9, 
-	0x66, 0x70, 0x3a, 0x77, 0x72, 0x69, 0x74, 0x65, 0x28, 0x5b, 0x5b, 0xa, 0x73, 0x74, 0x61, 0x74, 
-	0x69, 0x63, 0x20, 0x69, 0x6e, 0x74, 0x20, 0x5f, 0x5f, 0x5f, 0x73, 0x61, 0x75, 0x72, 0x75, 0x73, 
-	0x28, 0x73, 0x75, 0x5f, 0x73, 0x74, 0x61, 0x74, 0x65, 0x20, 0x2a, 0x73, 0x29, 0x20, 0x7b, 0xa, 
-	0x9, 0x63, 0x6f, 0x6e, 0x73, 0x74, 0x20, 0x63, 0x68, 0x61, 0x72, 0x20, 0x63, 0x6f, 0x64, 0x65, 
-	0x5b, 0x5d, 0x20, 0x3d, 0x20, 0x7b, 0x5d, 0x5d, 0x29, 0xa, 0xa, 0x9, 0x9, 0x66, 0x70, 0x3a, 
-	0x77, 0x72, 0x69, 0x74, 0x65, 0x28, 0x27, 0x5c, 0x6e, 0x5c, 0x74, 0x5c, 0x74, 0x27, 0x29, 0xa, 
-	0x9, 0x9, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x20, 0x6c, 0x65, 0x6e, 0x20, 0x3d, 0x20, 0x23, 0x72, 
-	0x65, 0x73, 0xa, 0x9, 0x9, 0x66, 0x6f, 0x72, 0x20, 0x69, 0x20, 0x3d, 0x20, 0x31, 0x2c, 0x20, 
-	0x6c, 0x65, 0x6e, 0x20, 0x2d, 0x20, 0x31, 0x20, 0x64, 0x6f, 0xa, 0x9, 0x9, 0x9, 0x66, 0x70, 
-	0x3a, 0x77, 0x72, 0x69, 0x74, 0x65, 0x28, 0x73, 0x74, 0x72, 0x69, 0x6e, 0x67, 0x2e, 0x66, 0x6f, 
-	0x72, 0x6d, 0x61, 0x74, 0x28, 0x27, 0x25, 0x69, 0x2c, 0x27, 0x2c, 0x20, 0x73, 0x74, 0x72, 0x69, 
-	0x6e, 0x67, 0x2e, 0x62, 0x79, 0x74, 0x65, 0x28, 0x73, 0x74, 0x72, 0x69, 0x6e, 0x67, 0x2e, 0x73, 
-	0x75, 0x62, 0x28, 0x72, 0x65, 0x73, 0x2c, 0x20, 0x69, 0x2c, 0x20, 0x69, 0x29, 0x29, 0x29, 0x29, 
-	0xa, 0x9, 0x9, 0x9, 0x69, 0x66, 0x20, 0x69, 0x20, 0x25, 0x20, 0x32, 0x30, 0x20, 0x3d, 0x3d, 
-	0x20, 0x30, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x9, 0x9, 0x9, 0x9, 0x66, 0x70, 0x3a, 0x77, 
-	0x72, 0x69, 0x74, 0x65, 0x28, 0x27, 0x5c, 0x6e, 0x5c, 0x74, 0x5c, 0x74, 0x27, 0x29, 0xa, 0x9, 
-	0x9, 0x9, 0x65, 0x6e, 0x64, 0xa, 0x9, 0x9, 0x65, 0x6e, 0x64, 0xa, 0xa, 0x9, 0x9, 0x66, 
-	0x70, 0x3a, 0x77, 0x72, 0x69, 0x74, 0x65, 0x28, 0x73, 0x74, 0x72, 0x69, 0x6e, 0x67, 0x2e, 0x66, 
-	0x6f, 0x72, 0x6d, 0x61, 0x74, 0x28, 0x27, 0x25, 0x69, 0x5c, 0x6e, 0x27, 0x2c, 0x20, 0x73, 0x74, 
-	0x72, 0x69, 0x6e, 0x67, 0x2e, 0x62, 0x79, 0x74, 0x65, 0x28, 0x73, 0x74, 0x72, 0x69, 0x6e, 0x67, 
-	0x2e, 0x73, 0x75, 0x62, 0x28, 0x72, 0x65, 0x73, 0x2c, 0x20, 0x6c, 0x65, 0x6e, 0x2c, 0x20, 0x6c, 
-	0x65, 0x6e, 0x29, 0x29, 0x29, 0x29, 0xa, 0x9, 0x9, 0x66, 0x70, 0x3a, 0x77, 0x72, 0x69, 0x74, 
-	0x65, 0x28, 0x27, 0x5c, 0x74, 0x7d, 0x3b, 0x5c, 0x6e, 0x5c, 0x6e, 0x27, 0x29, 0xa, 0xa, 0x9, 
-	0x9, 0x66, 0x6f, 0x72, 0x20, 0x5f, 0x2c, 0x66, 0x20, 0x69, 0x6e, 0x20, 0x69, 0x70, 0x61, 0x69, 
-	0x72, 0x73, 0x28, 0x63, 0x5f, 0x66, 0x75, 0x6e, 0x63, 0x29, 0x20, 0x64, 0x6f, 0xa, 0x9, 0x9, 
-	0x9, 0x69, 0x66, 0x20, 0x66, 0x2e, 0x65, 0x6e, 0x75, 0x6d, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 
-	0x9, 0x9, 0x9, 0x9, 0x66, 0x70, 0x3a, 0x77, 0x72, 0x69, 0x74, 0x65, 0x28, 0x73, 0x74, 0x72, 
-	0x69, 0x6e, 0x67, 0x2e, 0x66, 0x6f, 0x72, 0x6d, 0x61, 0x74, 0x28, 0x27, 0x5c, 0x74, 0x73, 0x75, 
-	0x5f, 0x70, 0x75, 0x73, 0x68, 0x6e, 0x75, 0x6d, 0x62, 0x65, 0x72, 0x28, 0x73, 0x2c, 0x20, 0x28, 
-	0x64, 0x6f, 0x75, 0x62, 0x6c, 0x65, 0x29, 0x25, 0x73, 0x29, 0x3b, 0x5c, 0x6e, 0x27, 0x2c, 0x20, 
-	0x66, 0x2e, 0x65, 0x6e, 0x75, 0x6d, 0x29, 0x29, 0xa, 0x9, 0x9, 0x9, 0x9, 0x66, 0x70, 0x3a, 
-	0x77, 0x72, 0x69, 0x74, 0x65, 0x28, 0x27, 0x5c, 0x74, 0x73, 0x75, 0x5f, 0x63, 0x6c, 0x61, 0x6d, 
-	0x62, 0x64, 0x61, 0x28, 0x73, 0x2c, 0x20, 0x4e, 0x55, 0x4c, 0x4c, 0x29, 0x3b, 0x5c, 0x6e, 0x27, 
-	0x29, 0xa, 0x9, 0x9, 0x9, 0x65, 0x6c, 0x73, 0x65, 0xa, 0x9, 0x9, 0x9, 0x9, 0x66, 0x70, 
-	0x3a, 0x77, 0x72, 0x69, 0x74, 0x65, 0x28, 0x73, 0x74, 0x72, 0x69, 0x6e, 0x67, 0x2e, 0x66, 0x6f, 
-	0x72, 0x6d, 0x61, 0x74, 0x28, 0x27, 0x5c, 0x74, 0x73, 0x75, 0x5f, 0x63, 0x6c, 0x61, 0x6d, 0x62, 
-	0x64, 0x61, 0x28, 0x73, 0x2c, 0x20, 0x26, 0x5f, 0x5f, 0x5f, 0x25, 0x73, 0x29, 0x3b, 0x5c, 0x6e, 
-	0x27, 0x2c, 0x20, 0x66, 0x2e, 0x6e, 0x61, 0x6d, 0x65, 0x29, 0x29, 0xa, 0x9, 0x9, 0x9, 0x65, 
-	0x6e, 0x64, 0xa, 0x9, 0x9, 0x65, 0x6e, 0x64, 0xa, 0xa, 0x9, 0x9, 0x66, 0x70, 0x3a, 0x77, 
-	0x72, 0x69, 0x74, 0x65, 0x28, 0x5b, 0x5b, 0xa, 0xa, 0x9, 0x69, 0x66, 0x20, 0x28, 0x73, 0x75, 
-	0x5f, 0x6c, 0x6f, 0x61, 0x64, 0x28, 0x73, 0x2c, 0x20, 0x4e, 0x55, 0x4c, 0x4c, 0x2c, 0x20, 0x28, 
-	0x76, 0x6f, 0x69, 0x64, 0x2a, 0x29, 0x63, 0x6f, 0x64, 0x65, 0x29, 0x29, 0xa, 0x9, 0x9, 0x72, 
-	0x65, 0x74, 0x75, 0x72, 0x6e, 0x20, 0x2d, 0x31, 0x3b, 0xa, 0x9, 0x72, 0x65, 0x74, 0x75, 0x72, 
-	0x6e, 0x20, 0x30, 0x3b, 0xa, 0x7d, 0xa, 0x5d, 0x5d, 0x29, 0xa, 0xa, 0x9, 0x65, 0x6c, 0x73, 
-	0x65, 0x69, 0x66, 0x20, 0x61, 0x73, 0x6d, 0x5f, 0x6f, 0x75, 0x74, 0x20, 0x74, 0x68, 0x65, 0x6e, 
-	0xa, 0x9, 0x9, 0x2d, 0x2d, 0x20, 0x44, 0x6f, 0x20, 0x6e, 0x6f, 0x74, 0x68, 0x69, 0x6e, 0x67, 
-	0x2e, 0xa, 0x9, 0x65, 0x6c, 0x73, 0x65, 0xa, 0x9, 0x9, 0x69, 0x66, 0x20, 0x63, 0x5f, 0x63, 
-	0x6f, 0x64, 0x65, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x9, 0x9, 0x9, 0x73, 0x61, 0x75, 0x72, 
-	0x75, 0x73, 0x5f, 0x65, 0x72, 0x72, 0x6f, 0x72, 0x20, 0x3d, 0x20, 0x27, 0x2e, 0x73, 0x75, 0x63, 
-	0x20, 0x64, 0x6f, 0x65, 0x73, 0x20, 0x6e, 0x6f, 0x74, 0x20, 0x73, 0x75, 0x70, 0x70, 0x6f, 0x72, 
-	0x74, 0x20, 0x43, 0x20, 0x69, 0x6e, 0x6c, 0x69, 0x6e, 0x65, 0x20, 0x63, 0x6f, 0x64, 0x65, 0x27, 
-	0xa, 0x9, 0x9, 0x9, 0x65, 0x72, 0x72, 0x6f, 0x72, 0x28, 0x73, 0x61, 0x75, 0x72, 0x75, 0x73, 
-	0x5f, 0x65, 0x72, 0x72, 0x6f, 0x72, 0x29, 0xa, 0x9, 0x9, 0x65, 0x6e, 0x64, 0xa, 0x9, 0x9, 
-	0x66, 0x70, 0x3a, 0x77, 0x72, 0x69, 0x74, 0x65, 0x28, 0x72, 0x65, 0x73, 0x29, 0xa, 0x9, 0x65, 
-	0x6e, 0x64, 0xa, 0x9, 0x66, 0x70, 0x3a, 0x63, 0x6c, 0x6f, 0x73, 0x65, 0x28, 0x29, 0xa, 0x65, 
-	0x6e, 0x64, 0xa, 0x0};
+	0x66, 0x6f, 0x72, 0x6d, 0x61, 0x74, 0x28, 0x27, 0x20, 0x2a, 0x20, 0x68, 0x74, 0x74, 0x70, 0x3a, 
+	0x2f, 0x2f, 0x77, 0x77, 0x77, 0x2e, 0x73, 0x61, 0x75, 0x72, 0x75, 0x73, 0x2e, 0x6f, 0x72, 0x67, 
+	0x5c, 0x6e, 0x20, 0x2a, 0x2f, 0x5c, 0x6e, 0x5c, 0x6e, 0x27, 0x2c, 0x20, 0x73, 0x72, 0x63, 0x29, 
+	0x29, 0xa, 0x9, 0x9, 0x66, 0x70, 0x3a, 0x77, 0x72, 0x69, 0x74, 0x65, 0x28, 0x73, 0x74, 0x72, 
+	0x69, 0x6e, 0x67, 0x2e, 0x66, 0x6f, 0x72, 0x6d, 0x61, 0x74, 0x28, 0x27, 0x2f, 0x2a, 0x20, 0x25, 
+	0x73, 0x20, 0x2a, 0x2f, 0x5c, 0x6e, 0x5c, 0x6e, 0x23, 0x69, 0x6e, 0x63, 0x6c, 0x75, 0x64, 0x65, 
+	0x20, 0x3c, 0x73, 0x61, 0x75, 0x72, 0x75, 0x73, 0x2e, 0x68, 0x3e, 0x5c, 0x6e, 0x5c, 0x6e, 0x27, 
+	0x2c, 0x20, 0x73, 0x72, 0x63, 0x29, 0x29, 0xa, 0xa, 0x9, 0x9, 0x69, 0x66, 0x20, 0x63, 0x5f, 
+	0x63, 0x6f, 0x64, 0x65, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x9, 0x9, 0x9, 0x66, 0x70, 0x3a, 
+	0x77, 0x72, 0x69, 0x74, 0x65, 0x28, 0x27, 0x73, 0x74, 0x61, 0x74, 0x69, 0x63, 0x20, 0x69, 0x6e, 
+	0x74, 0x20, 0x5f, 0x5f, 0x5f, 0x73, 0x61, 0x75, 0x72, 0x75, 0x73, 0x28, 0x73, 0x75, 0x5f, 0x73, 
+	0x74, 0x61, 0x74, 0x65, 0x20, 0x2a, 0x73, 0x29, 0x3b, 0x5c, 0x6e, 0x5c, 0x6e, 0x27, 0x29, 0xa, 
+	0x9, 0x9, 0x9, 0x66, 0x70, 0x3a, 0x77, 0x72, 0x69, 0x74, 0x65, 0x28, 0x73, 0x74, 0x72, 0x69, 
+	0x6e, 0x67, 0x2e, 0x66, 0x6f, 0x72, 0x6d, 0x61, 0x74, 0x28, 0x27, 0x25, 0x73, 0x5c, 0x6e, 0x27, 
+	0x2c, 0x20, 0x63, 0x5f, 0x63, 0x6f, 0x64, 0x65, 0x29, 0x29, 0xa, 0x9, 0x9, 0x65, 0x6e, 0x64, 
+	0xa, 0xa, 0x9, 0x9, 0x66, 0x70, 0x3a, 0x77, 0x72, 0x69, 0x74, 0x65, 0x28, 0x5b, 0x5b, 0xa, 
+	0x73, 0x74, 0x61, 0x74, 0x69, 0x63, 0x20, 0x69, 0x6e, 0x74, 0x20, 0x5f, 0x5f, 0x5f, 0x73, 0x61, 
+	0x75, 0x72, 0x75, 0x73, 0x28, 0x73, 0x75, 0x5f, 0x73, 0x74, 0x61, 0x74, 0x65, 0x20, 0x2a, 0x73, 
+	0x29, 0x20, 0x7b, 0xa, 0x9, 0x63, 0x6f, 0x6e, 0x73, 0x74, 0x20, 0x63, 0x68, 0x61, 0x72, 0x20, 
+	0x63, 0x6f, 0x64, 0x65, 0x5b, 0x5d, 0x20, 0x3d, 0x20, 0x7b, 0x5d, 0x5d, 0x29, 0xa, 0xa, 0x9, 
+	0x9, 0x66, 0x70, 0x3a, 0x77, 0x72, 0x69, 0x74, 0x65, 0x28, 0x27, 0x5c, 0x6e, 0x5c, 0x74, 0x5c, 
+	0x74, 0x27, 0x29, 0xa, 0x9, 0x9, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x20, 0x6c, 0x65, 0x6e, 0x20, 
+	0x3d, 0x20, 0x23, 0x72, 0x65, 0x73, 0xa, 0x9, 0x9, 0x66, 0x6f, 0x72, 0x20, 0x69, 0x20, 0x3d, 
+	0x20, 0x31, 0x2c, 0x20, 0x6c, 0x65, 0x6e, 0x20, 0x2d, 0x20, 0x31, 0x20, 0x64, 0x6f, 0xa, 0x9, 
+	0x9, 0x9, 0x66, 0x70, 0x3a, 0x77, 0x72, 0x69, 0x74, 0x65, 0x28, 0x73, 0x74, 0x72, 0x69, 0x6e, 
+	0x67, 0x2e, 0x66, 0x6f, 0x72, 0x6d, 0x61, 0x74, 0x28, 0x27, 0x25, 0x69, 0x2c, 0x27, 0x2c, 0x20, 
+	0x73, 0x74, 0x72, 0x69, 0x6e, 0x67, 0x2e, 0x62, 0x79, 0x74, 0x65, 0x28, 0x73, 0x74, 0x72, 0x69, 
+	0x6e, 0x67, 0x2e, 0x73, 0x75, 0x62, 0x28, 0x72, 0x65, 0x73, 0x2c, 0x20, 0x69, 0x2c, 0x20, 0x69, 
+	0x29, 0x29, 0x29, 0x29, 0xa, 0x9, 0x9, 0x9, 0x69, 0x66, 0x20, 0x69, 0x20, 0x25, 0x20, 0x32, 
+	0x30, 0x20, 0x3d, 0x3d, 0x20, 0x30, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x9, 0x9, 0x9, 0x9, 
+	0x66, 0x70, 0x3a, 0x77, 0x72, 0x69, 0x74, 0x65, 0x28, 0x27, 0x5c, 0x6e, 0x5c, 0x74, 0x5c, 0x74, 
+	0x27, 0x29, 0xa, 0x9, 0x9, 0x9, 0x65, 0x6e, 0x64, 0xa, 0x9, 0x9, 0x65, 0x6e, 0x64, 0xa, 
+	0xa, 0x9, 0x9, 0x66, 0x70, 0x3a, 0x77, 0x72, 0x69, 0x74, 0x65, 0x28, 0x73, 0x74, 0x72, 0x69, 
+	0x6e, 0x67, 0x2e, 0x66, 0x6f, 0x72, 0x6d, 0x61, 0x74, 0x28, 0x27, 0x25, 0x69, 0x5c, 0x6e, 0x27, 
+	0x2c, 0x20, 0x73, 0x74, 0x72, 0x69, 0x6e, 0x67, 0x2e, 0x62, 0x79, 0x74, 0x65, 0x28, 0x73, 0x74, 
+	0x72, 0x69, 0x6e, 0x67, 0x2e, 0x73, 0x75, 0x62, 0x28, 0x72, 0x65, 0x73, 0x2c, 0x20, 0x6c, 0x65, 
+	0x6e, 0x2c, 0x20, 0x6c, 0x65, 0x6e, 0x29, 0x29, 0x29, 0x29, 0xa, 0x9, 0x9, 0x66, 0x70, 0x3a, 
+	0x77, 0x72, 0x69, 0x74, 0x65, 0x28, 0x27, 0x5c, 0x74, 0x7d, 0x3b, 0x5c, 0x6e, 0x5c, 0x6e, 0x27, 
+	0x29, 0xa, 0xa, 0x9, 0x9, 0x66, 0x6f, 0x72, 0x20, 0x5f, 0x2c, 0x66, 0x20, 0x69, 0x6e, 0x20, 
+	0x69, 0x70, 0x61, 0x69, 0x72, 0x73, 0x28, 0x63, 0x5f, 0x66, 0x75, 0x6e, 0x63, 0x29, 0x20, 0x64, 
+	0x6f, 0xa, 0x9, 0x9, 0x9, 0x69, 0x66, 0x20, 0x66, 0x2e, 0x65, 0x6e, 0x75, 0x6d, 0x20, 0x74, 
+	0x68, 0x65, 0x6e, 0xa, 0x9, 0x9, 0x9, 0x9, 0x66, 0x70, 0x3a, 0x77, 0x72, 0x69, 0x74, 0x65, 
+	0x28, 0x73, 0x74, 0x72, 0x69, 0x6e, 0x67, 0x2e, 0x66, 0x6f, 0x72, 0x6d, 0x61, 0x74, 0x28, 0x27, 
+	0x5c, 0x74, 0x73, 0x75, 0x5f, 0x70, 0x75, 0x73, 0x68, 0x6e, 0x75, 0x6d, 0x62, 0x65, 0x72, 0x28, 
+	0x73, 0x2c, 0x20, 0x28, 0x64, 0x6f, 0x75, 0x62, 0x6c, 0x65, 0x29, 0x25, 0x73, 0x29, 0x3b, 0x5c, 
+	0x6e, 0x27, 0x2c, 0x20, 0x66, 0x2e, 0x65, 0x6e, 0x75, 0x6d, 0x29, 0x29, 0xa, 0x9, 0x9, 0x9, 
+	0x9, 0x66, 0x70, 0x3a, 0x77, 0x72, 0x69, 0x74, 0x65, 0x28, 0x27, 0x5c, 0x74, 0x73, 0x75, 0x5f, 
+	0x63, 0x6c, 0x61, 0x6d, 0x62, 0x64, 0x61, 0x28, 0x73, 0x2c, 0x20, 0x4e, 0x55, 0x4c, 0x4c, 0x29, 
+	0x3b, 0x5c, 0x6e, 0x27, 0x29, 0xa, 0x9, 0x9, 0x9, 0x65, 0x6c, 0x73, 0x65, 0xa, 0x9, 0x9, 
+	0x9, 0x9, 0x66, 0x70, 0x3a, 0x77, 0x72, 0x69, 0x74, 0x65, 0x28, 0x73, 0x74, 0x72, 0x69, 0x6e, 
+	0x67, 0x2e, 0x66, 0x6f, 0x72, 0x6d, 0x61, 0x74, 0x28, 0x27, 0x5c, 0x74, 0x73, 0x75, 0x5f, 0x63, 
+	0x6c, 0x61, 0x6d, 0x62, 0x64, 0x61, 0x28, 0x73, 0x2c, 0x20, 0x26, 0x5f, 0x5f, 0x5f, 0x25, 0x73, 
+	0x29, 0x3b, 0x5c, 0x6e, 0x27, 0x2c, 0x20, 0x66, 0x2e, 0x6e, 0x61, 0x6d, 0x65, 0x29, 0x29, 0xa, 
+	0x9, 0x9, 0x9, 0x65, 0x6e, 0x64, 0xa, 0x9, 0x9, 0x65, 0x6e, 0x64, 0xa, 0xa, 0x9, 0x9, 
+	0x66, 0x70, 0x3a, 0x77, 0x72, 0x69, 0x74, 0x65, 0x28, 0x5b, 0x5b, 0xa, 0xa, 0x9, 0x69, 0x66, 
+	0x20, 0x28, 0x73, 0x75, 0x5f, 0x6c, 0x6f, 0x61, 0x64, 0x28, 0x73, 0x2c, 0x20, 0x4e, 0x55, 0x4c, 
+	0x4c, 0x2c, 0x20, 0x28, 0x76, 0x6f, 0x69, 0x64, 0x2a, 0x29, 0x63, 0x6f, 0x64, 0x65, 0x29, 0x29, 
+	0xa, 0x9, 0x9, 0x72, 0x65, 0x74, 0x75, 0x72, 0x6e, 0x20, 0x2d, 0x31, 0x3b, 0xa, 0x9, 0x72, 
+	0x65, 0x74, 0x75, 0x72, 0x6e, 0x20, 0x30, 0x3b, 0xa, 0x7d, 0xa, 0x5d, 0x5d, 0x29, 0xa, 0xa, 
+	0x9, 0x65, 0x6c, 0x73, 0x65, 0x69, 0x66, 0x20, 0x61, 0x73, 0x6d, 0x5f, 0x6f, 0x75, 0x74, 0x20, 
+	0x74, 0x68, 0x65, 0x6e, 0xa, 0x9, 0x9, 0x2d, 0x2d, 0x20, 0x44, 0x6f, 0x20, 0x6e, 0x6f, 0x74, 
+	0x68, 0x69, 0x6e, 0x67, 0x2e, 0xa, 0x9, 0x65, 0x6c, 0x73, 0x65, 0xa, 0x9, 0x9, 0x69, 0x66, 
+	0x20, 0x63, 0x5f, 0x63, 0x6f, 0x64, 0x65, 0x20, 0x74, 0x68, 0x65, 0x6e, 0xa, 0x9, 0x9, 0x9, 
+	0x73, 0x61, 0x75, 0x72, 0x75, 0x73, 0x5f, 0x65, 0x72, 0x72, 0x6f, 0x72, 0x20, 0x3d, 0x20, 0x27, 
+	0x2e, 0x73, 0x75, 0x63, 0x20, 0x64, 0x6f, 0x65, 0x73, 0x20, 0x6e, 0x6f, 0x74, 0x20, 0x73, 0x75, 
+	0x70, 0x70, 0x6f, 0x72, 0x74, 0x20, 0x43, 0x20, 0x69, 0x6e, 0x6c, 0x69, 0x6e, 0x65, 0x20, 0x63, 
+	0x6f, 0x64, 0x65, 0x27, 0xa, 0x9, 0x9, 0x9, 0x65, 0x72, 0x72, 0x6f, 0x72, 0x28, 0x73, 0x61, 
+	0x75, 0x72, 0x75, 0x73, 0x5f, 0x65, 0x72, 0x72, 0x6f, 0x72, 0x29, 0xa, 0x9, 0x9, 0x65, 0x6e, 
+	0x64, 0xa, 0x9, 0x9, 0x66, 0x70, 0x3a, 0x77, 0x72, 0x69, 0x74, 0x65, 0x28, 0x72, 0x65, 0x73, 
+	0x29, 0xa, 0x9, 0x65, 0x6e, 0x64, 0xa, 0x9, 0x66, 0x70, 0x3a, 0x63, 0x6c, 0x6f, 0x73, 0x65, 
+	0x28, 0x29, 0xa, 0x65, 0x6e, 0x64, 0xa, 0x0};
@@ -728,6 +728,40 @@ local function read_lambda(stream, varg)
     return {type = 'lambda', args = args_to_identifiers(arguments), body = block, varg = varg, file = tok.file, line = line}
 end
 
+-- Destructuring assignment, '(a b) = f()'.
+local function read_destructure(stream)
+    local line = stream.line
+    local tokens, names = {}, {}
+
+    while true do
+        local tok = next_token(stream)
+        table.insert(tokens, tok)
+        if not tok or type(tok.value) ~= 'table' then
+            if not tok or tok.token ~= ')' or #names == 0 then
+                while #tokens > 0 do
+                    revert_token(stream, table.remove(tokens, 1))
+                end
+                return
+            end
+            break
+        end
+        table.insert(names, tok)
+    end
+
+    local tok = next_token(stream)
+    if not tok or tok.token ~= '=' then
+        while #tokens > 0 do
+            revert_token(stream, table.remove(tokens, 1))
+        end
+        revert_token(stream, tok)
+        return
+    end
+
+    local expr = read_expression(stream)
+    parser_assert(expr, stream, 'assignment expected right side expression')
+    return {type = 'destructure', names = args_to_identifiers(names), value = expr, file = tok.file, line = line}
+end
+
 function read_expression(stream, read_op)
     local ret
     local tok = next_token(stream)
@@ -817,7 +851,7 @@ function read_expression(stream, read_op)
     elseif tok.token == '[' then
         ret = read_collection(stream, 'vector')
     elseif tok.token == '(' then
-        ret = read_lambda(stream)
+        ret = read_lambda(stream) or read_destructure(stream)
         if not ret then
             ret = read_expression(stream)
             local tok2 = next_token(stream)
@@ -956,6 +990,13 @@ function ast_print(node, lv)
     elseif node.type == 'def' then
         puts(lv, string.format('def %s:', node.name))
         ast_print(node.value, lv)
+    elseif node.type == 'destructure' then
+        local names = {}
+        for _,v in ipairs(node.names) do
+            table.insert(names, v.value)
+        end
+        puts(lv, string.format('(%s) =', table.concat(names, ' ')))
+        ast_print(node.value, lv)
     elseif node.type == 'seq' or node.type == 'unm' or node.type == 'not' then
         puts(lv, string.format('%s:', node.type))
         ast_print(node.arg, lv)
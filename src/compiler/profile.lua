@@ -0,0 +1,68 @@
+-- S A U R U S
+-- Copyright (c) 2009-2015 Andreas T Jonsson <andreas@saurus.org>
+--
+-- This Source Code Form is subject to the terms of the Mozilla Public
+-- License, v. 2.0. If a copy of the MPL was not distributed with this
+-- file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+-- Profile guided specialisation. SU_OPT_PROFILE names a profile written by
+-- a VM built with SU_OPT_PROFILE (su_profile, or SU_PROFILE=<file> with the
+-- REPL). Each line is
+--
+--   <file> <prototype> <pc> <opcode> <types> [<callee prototype>]
+--
+-- separated by tabs, where prototypes are numbered depth first from the top
+-- level chunk. Sites that only ever saw numbers get the quickened opcode up
+-- front. A site is only touched if its opcode still matches, so a stale
+-- profile is harmless.
+
+local opt_profile = os.getenv('SU_OPT_PROFILE')
+local loaded
+
+local quickened = {
+	ADD = 'ADD_NN',
+	SUB = 'SUB_NN',
+	MUL = 'MUL_NN',
+	LESS = 'LESS_NN',
+	LEQUAL = 'LEQUAL_NN'
+}
+
+local function load_profile(path)
+	local fp = io.open(path, 'rb')
+	if not fp then
+		saurus_error = 'Could not open profile: ' .. path
+		error(saurus_error)
+	end
+
+	local sites = {}
+	for line in fp:lines() do
+		local file, prot, pc, op, types = string.match(line, '^(.-)\t(%d+)\t(%d+)\t(%S+)\t([^\t]*)')
+		if file then
+			local key = string.format('%s\t%s\t%s', file, prot, pc)
+			sites[key] = {op = op, types = types}
+		end
+	end
+	fp:close()
+	return sites
+end
+
+local function specialise(asm, sites, index)
+	local prot = index
+	for pc,v in ipairs(asm.instructions) do
+		local site = sites[string.format('%s\t%i\t%i', asm.name, prot, pc - 1)]
+		if site and site.op == v[1] and site.types == 'number' and quickened[v[1]] then
+			v[1] = quickened[v[1]]
+		end
+	end
+	for _,v in ipairs(asm.prototypes) do
+		index = specialise(v, sites, index + 1)
+	end
+	return index
+end
+
+function profile(asm)
+	if opt_profile then
+		loaded = loaded or load_profile(opt_profile)
+		specialise(asm, loaded, 0)
+	end
+end
@@ -19,13 +19,14 @@ static int ___saurus(su_state *s);
     #include <lauxlib.h>
 
     #include <stdio.h>
+    #include <stdlib.h>
     #include <string.h>
     #include <assert.h>
 
 
 
 #ifdef SU_OPT_C_LINE
-	#line 19 "src/repl/saurus.su"
+	#line 20 "src/repl/saurus.su"
 #endif
 
     #define BUFFER_SIZE 512
@@ -47,7 +48,7 @@ static int ___saurus(su_state *s);
 
 
 #ifdef SU_OPT_C_LINE
-	#line 37 "src/repl/saurus.su"
+	#line 38 "src/repl/saurus.su"
 #endif
 
     void shutdown() {
@@ -57,12 +58,27 @@ static int ___saurus(su_state *s);
 
 
 #ifdef SU_OPT_C_LINE
-	#line 43 "src/repl/saurus.su"
+	#line 44 "src/repl/saurus.su"
+#endif
+
+    static void write_profile(su_state *s) {
+        const char *path = getenv("SU_PROFILE");
+        FILE *fp = path ? fopen(path, "w") : NULL;
+        if (fp) {
+            su_profile(s, fp);
+            fclose(fp);
+        }
+    }
+
+
+
+#ifdef SU_OPT_C_LINE
+	#line 55 "src/repl/saurus.su"
 #endif
 
     int main(int argc, char *argv[]) {
     	int ret, i;
-    	int compile;
+    	int compile, translate;
     	FILE *fp;
     	jmp_buf err;
     	su_state *s;
@@ -81,7 +97,7 @@ static int ___saurus(su_state *s);
     	if (!pipe && (argc <= 1 || print_help)) {
     		printf("S A U R U S\nCopyright (c) 2009-2015 Andreas T Jonsson <andreas@saurus.org>\nVersion: %s\n\n", su_version(NULL, NULL, NULL));
     		if (print_help) {
-    			puts("Usage: saurus <options> <input.su> <output.suc>\n\tOptions:\n\t\t'-c' Compile source file to binary file.\n\t\t'--' read from STDIN.");
+    			puts("Usage: saurus <options> <input.su> <output.suc>\n\tOptions:\n\t\t'-c' Compile source file to binary file.\n\t\t'-a' Compile source file to C, translating lambdas ahead-of-time.\n\t\t'--' read from STDIN.");
     			return 0;
     		}
     	}
@@ -170,7 +186,8 @@ static int ___saurus(su_state *s);
     			su_pop(s, 1);
     		}
     	} else {
-    		compile = !strcmp(argv[1], "-c");
+    		translate = !strcmp(argv[1], "-a");
+    		compile = translate || !strcmp(argv[1], "-c");
     		input = compile ? argv[2] : argv[1];
 
     		if (compile) {
@@ -207,6 +224,7 @@ static int ___saurus(su_state *s);
                         su_call(s, argc - 1, 1);
                         if (su_type(s, -1) == SU_NUMBER)
                             ret = (int)su_tonumber(s, -1);
+                        write_profile(s);
 
     					su_close(s);
     					lua_close(L);
@@ -224,7 +242,8 @@ static int ___saurus(su_state *s);
     		lua_pushstring(L, input);
     		lua_pushstring(L, output);
     		lua_pushboolean(L, compile);
-    		if (lua_pcall(L, 3, 0, 0)) {
+    		lua_pushboolean(L, translate);
+    		if (lua_pcall(L, 4, 0, 0)) {
     			lua_getglobal(L, "saurus_error");
     			if (lua_isnil(L, -1))
     				lua_pop(L, 1);
@@ -262,6 +281,7 @@ static int ___saurus(su_state *s);
                 su_call(s, argc - 1, 1);
     			if (su_type(s, -1) == SU_NUMBER)
                     ret = (int)su_tonumber(s, -1);
+                write_profile(s);
     		}
     	}
 
@@ -274,12 +294,13 @@ static int ___saurus(su_state *s);
 
 static int ___saurus(su_state *s) {
 	const char code[] = {
-		27,115,117,99,0,0,0,0,8,0,0,0,0,0,0,0,1,1,0,0,
+		27,115,117,99,0,0,3,0,10,0,0,0,0,0,0,0,1,1,0,0,
 		0,0,0,0,1,1,0,0,0,0,0,0,1,1,0,0,0,0,0,0,
-		21,0,0,0,1,0,0,0,0,0,0,0,0,0,0,0,0,18,0,0,
-		0,115,114,99,47,114,101,112,108,47,115,97,117,114,117,115,46,115,117,8,
-		0,0,0,10,0,0,0,10,0,0,0,20,0,0,0,20,0,0,0,38,
-		0,0,0,38,0,0,0,44,0,0,0,1,0,0,0
+		1,1,0,0,0,0,0,0,21,0,0,0,1,0,0,0,0,0,0,0,
+		0,0,0,0,0,18,0,0,0,115,114,99,47,114,101,112,108,47,115,97,
+		117,114,117,115,46,115,117,10,0,0,0,10,0,0,0,10,0,0,0,21,
+		0,0,0,21,0,0,0,39,0,0,0,39,0,0,0,45,0,0,0,45,
+		0,0,0,56,0,0,0,1,0,0,0
 	};
 
 
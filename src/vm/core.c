@@ -11,6 +11,7 @@
 #include "ref.h"
 #include "seq.h"
 #include "gc.h"
+#include "jit.h"
 
 #include <stdlib.h>
 #include <stdio.h>
@@ -21,51 +22,34 @@
 #include <stdarg.h>
 
 #define MAIN_STATE_ONLY_MSG "Can only do this from the main-state!"
+#define TRACE_DEPTH 16
 
 static aint_t print_spin_lock = {0};
 
 enum {
-	OP_PUSH,
-	OP_POP,
-	OP_LOAD,
-	OP_LUP,
-	OP_LCL,
-
-	OP_ADD,
-	OP_SUB,
-	OP_MUL,
-	OP_DIV,
-	OP_MOD,
-	OP_POW,
-	OP_UNM,
-
-	OP_EQ,
-	OP_LESS,
-	OP_LEQUAL,
-
-	OP_NOT,
-	OP_AND,
-	OP_OR,
-
-	OP_TEST,
-	OP_FOR,
-	OP_JMP,
-
-	OP_RETURN,
-	OP_SHIFT,
-	OP_CALL,
-	OP_TCALL,
-	OP_LAMBDA,
-
-	OP_GETGLOBAL,
-	OP_SETGLOBAL
+	HEADER_OPERANDS = 0x1,
+	HEADER_SUPERINST = 0x2
 };
 
-struct instruction {
-	unsigned char id;
-	unsigned char a;
-	short b;
+#if defined(SU_OPT_VM_STATS) || defined(SU_OPT_PROFILE)
+static const char *op_names[NUM_OPS] = {
+	"PUSH", "POP", "LOAD", "LUP", "LCL",
+	"ADD", "SUB", "MUL", "DIV", "MOD", "POW", "UNM",
+	"EQ", "LESS", "LEQUAL",
+	"NOT", "AND", "OR",
+	"TEST", "FOR", "JMP",
+	"RETURN", "SHIFT", "CALL", "TCALL", "LAMBDA",
+	"GETGLOBAL", "SETGLOBAL", "GETFIELD",
+	"FORPREP", "FORLOOP", "STORE",
+	"ADD_LL", "ADD_LK", "SUB_LL", "SUB_LK", "SUB_KL", "MUL_LL", "MUL_LK",
+	"EQ_LL", "EQ_LK", "LESS_LL", "LESS_LK", "LESS_KL",
+	"LEQUAL_LL", "LEQUAL_LK", "LEQUAL_KL",
+	"EQ_LL_TEST", "EQ_LK_TEST", "LESS_LL_TEST", "LESS_LK_TEST", "LESS_KL_TEST",
+	"LEQUAL_LL_TEST", "LEQUAL_LK_TEST", "LEQUAL_KL_TEST",
+	"SHIFT_JMP", "LOAD_LOAD",
+	"ADD_NN", "SUB_NN", "MUL_NN", "LESS_NN", "LEQUAL_NN"
 };
+#endif
 
 struct upvalue {
 	unsigned short lv;
@@ -126,24 +110,75 @@ void *su_allocate(su_state *s, void *p, size_t n) {
 	}
 }
 
+/* The collector reads the stacks of other threads while marking, so a
+   stack only moves while this thread holds the collector lock. Pointers
+   into the stack do not survive anything that can push or call. */
+static void grow_stack(su_state *s, int size) {
+	value_t *stack;
+	int n = s->stack_size;
+	main_state_internal_t *msi = s->msi;
+
+	su_assert(s, size <= s->stack_limit, "Stack overflow!");
+	while (n < size)
+		n *= 2;
+	if (n > s->stack_limit)
+		n = s->stack_limit;
+
+	su_thread_indisposable(s);
+	while (!spin_try_lock(&msi->gc_lock))
+		thread_sleep(0);
+	su_thread_disposable(s);
+
+	stack = (value_t*)s->alloc(s->stack, sizeof(value_t) * n);
+	if (stack) {
+		s->stack = stack;
+		s->stack_size = n;
+	}
+	spin_unlock(&msi->gc_lock);
+	su_assert(s, stack != NULL, "Out of memory!");
+}
+
+static void grow_frames(su_state *s) {
+	frame_t *frames;
+	int n = s->frame_size * 2;
+
+	su_assert(s, s->frame_size < s->frame_limit, "Stack overflow!");
+	if (n > s->frame_limit)
+		n = s->frame_limit;
+	frames = (frame_t*)su_allocate(s, s->frames, sizeof(frame_t) * n);
+	s->frame = frames + (s->frame - s->frames);
+	s->frames = frames;
+	s->frame_size = n;
+}
+
 void push_value(su_state *s, value_t *v) {
-	su_assert(s, s->stack_top < STACK_SIZE, "Stack overflow!");
+	value_t tmp;
+	if (s->stack_top >= s->stack_size) {
+		tmp = *v;
+		grow_stack(s, s->stack_top + 1);
+		v = &tmp;
+	}
 	s->stack[s->stack_top++] = *v;
 }
 
 int value_eq(value_t *a, value_t *b) {
-	if (a->type != b->type)
+	if (VAL_TYPE(a) != VAL_TYPE(b))
 		return 0;
-	if (a->type == SU_BOOLEAN && a->obj.b == b->obj.b)
-		return 1;
-	if (a->type == SU_NUMBER && a->obj.num == b->obj.num)
-		return 1;
-	if (a->type == SU_STRING &&
-		(a->obj.str == b->obj.str ||
-		(a->obj.str->hash == b->obj.str->hash && a->obj.str->size == b->obj.str->size && !memcmp(a->obj.str->str, b->obj.str->str, a->obj.str->size)))
-	)
-		return 1;
-	return a->obj.ptr == b->obj.ptr;
+	switch (VAL_TYPE(a)) {
+		case SU_INV:
+		case SU_NIL:
+			return 1;
+		case SU_BOOLEAN:
+			return VAL_BOOL(a) == VAL_BOOL(b);
+		case SU_NUMBER:
+			return VAL_NUM(a) == VAL_NUM(b);
+		case SU_STRING:
+			return VAL_STR(a) == VAL_STR(b) ||
+				(VAL_STR(a)->hash == VAL_STR(b)->hash && VAL_STR(a)->size == VAL_STR(b)->size && !memcmp(VAL_STR(a)->str, VAL_STR(b)->str, VAL_STR(a)->size));
+		case SU_NATIVEFUNC:
+			return VAL_NFUNC(a) == VAL_NFUNC(b);
+	}
+	return VAL_PTR(a) == VAL_PTR(b);
 }
 
 char *su_scratchpad(su_state *s) {
@@ -170,11 +205,13 @@ int su_top(su_state *s) {
 }
 
 void su_range(su_state *s, int idx) {
-	value_t v = range_create(s, STK(TOP(idx))->obj.num, STK(-1)->obj.num);
+	value_t v = range_create(s, VAL_NUM(STK(TOP(idx))), VAL_NUM(STK(-1)));
 	push_value(s, &v);
 }
 
 void su_copy_range(su_state *s, int idx, int num) {
+	if (s->stack_top + num > s->stack_size)
+		grow_stack(s, s->stack_top + num);
 	memcpy(&s->stack[s->stack_top], STK(TOP(idx)), sizeof(value_t) * num);
 	s->stack_top += num;
 }
@@ -243,7 +280,7 @@ static int verify_header(su_state *s, reader_buffer_t *buffer) {
 		return -1;
 
 	buffer_read(s, buffer, &flags, sizeof(flags));
-	if (flags != 0)
+	if (flags & ~(HEADER_OPERANDS | HEADER_SUPERINST))
 		return -1;
 
 	return 0;
@@ -277,29 +314,36 @@ unsigned murmur(const void *key, int len, unsigned seed) {
 }
 
 unsigned hash_value(value_t *v) {
-	switch (v->type) {
+	void *ptr;
+	switch (VAL_TYPE(v)) {
 		case SU_NIL:
 			return (unsigned)SU_NIL;
 		case SU_BOOLEAN:
-			return (unsigned)v->obj.b + (unsigned)SU_BOOLEAN;
+			return (unsigned)VAL_BOOL(v) + (unsigned)SU_BOOLEAN;
 		case SU_NUMBER:
-			return murmur(&v->obj.num, sizeof(double), (unsigned)SU_NUMBER);
+			return murmur(&VAL_NUM(v), sizeof(double), (unsigned)SU_NUMBER);
 		case SU_STRING:
-			return v->obj.str->hash;
+			return VAL_STR(v)->hash;
 		default:
-			return murmur(&v->obj.ptr, sizeof(void*), (unsigned)v->type);
+			ptr = VAL_PTR(v);
+			return murmur(&ptr, sizeof(void*), (unsigned)VAL_TYPE(v));
 	}
 }
 
+/* New objects go on the allocating thread's own list, no lock is taken.
+   The global count lags behind by less than GC_COUNT_BATCH per thread. */
 gc_t *gc_insert_object(su_state *s, gc_t *obj, su_object_type_t type) {
 	obj->type = type;
-	obj->flags = GC_FLAG_BLACK;
+	obj->flags = GC_FLAG_WHITE;
 	obj->usr = 0;
-	spin_lock(&s->msi->gc_list_lock);
-	obj->next = s->msi->gc_root;
-	s->msi->gc_root = obj;
-	atomic_add(&s->msi->num_objects, 1);
-	spin_unlock(&s->msi->gc_list_lock);
+	obj->next = s->gc_list;
+	if (!s->gc_list)
+		s->gc_list_tail = obj;
+	s->gc_list = obj;
+	if (++s->gc_list_count == GC_COUNT_BATCH) {
+		atomic_add(&s->msi->num_objects, GC_COUNT_BATCH);
+		s->gc_list_count = 0;
+	}
 	return obj;
 }
 
@@ -319,75 +363,74 @@ gc_t *string_from_cache(su_state *s, const char *str, unsigned size) {
 		}
 	}
 	
-	v.type = SU_STRING;
-	v.obj.ptr = su_allocate(s, NULL, sizeof(string_t) + size);
-	v.obj.str->size = size;
-	memcpy(v.obj.str->str, str, size);
-	v.obj.str->str[size] = '\0';
-	v.obj.str->hash = hash;
+	SET_OBJ(&v, SU_STRING, gc_allocate(s, sizeof(string_t) + size));
+	VAL_STR(&v)->size = size;
+	memcpy(VAL_STR(&v)->str, str, size);
+	VAL_STR(&v)->str[size] = '\0';
+	VAL_STR(&v)->hash = hash;
 	
 	if (index < 16) {
 		entry.hash = hash;
-		entry.str = v.obj.str;
+		entry.str = VAL_STR(&v);
 		entries[s->string_cache_head[index]] = entry;
 		s->string_cache_head[index] = (s->string_cache_head[index] + 1) % STRING_CACHE_SIZE;
 	}
 	
-	gc_insert_object(s, v.obj.gc_object, SU_STRING);
-	return v.obj.gc_object;
+	gc_insert_object(s, VAL_GC(&v), SU_STRING);
+	return VAL_GC(&v);
 }
 
 gc_t *string_build_from_cache(su_state *s) {
 	value_t v;
-	v.type = SU_STRING;
-	v.obj.str = s->string_builder;
+	SET_OBJ(&v, SU_STRING, s->string_builder);
 	s->string_builder->str[s->string_builder->size] = '\0';
-	gc_insert_object(s, v.obj.gc_object, SU_STRING);
-	return v.obj.gc_object;
+	s->string_builder->gc.slab = 0; /* Grown with su_allocate. */
+	gc_insert_object(s, VAL_GC(&v), SU_STRING);
+	return VAL_GC(&v);
 }
 
 const char *stringify(su_state *s, value_t *v) {
 	int tmp;
-	switch (v->type) {
+	switch (VAL_TYPE(v)) {
 		case SU_NIL:
 			return "nil";
 		case SU_BOOLEAN:
-			return v->obj.b ? "true" : "false";
+			return VAL_BOOL(v) ? "true" : "false";
 		case SU_NUMBER:
-			tmp = (int)v->obj.num;
-			if (v->obj.num == (double)tmp)
+			tmp = (int)VAL_NUM(v);
+			if (VAL_NUM(v) == (double)tmp)
 				sprintf(s->scratch_pad, "%i", tmp);
 			else
-				sprintf(s->scratch_pad, "%f", v->obj.num);
+				sprintf(s->scratch_pad, "%f", VAL_NUM(v));
 			break;
 		case SU_STRING:
-			return ((string_t*)v->obj.gc_object)->str;
+			return ((string_t*)VAL_GC(v))->str;
 		case SU_FUNCTION:
-			sprintf(s->scratch_pad, "<function %p>", (void*)v->obj.func);
+			sprintf(s->scratch_pad, "<function %p>", (void*)VAL_FUNC(v));
 			break;
 		case SU_NATIVEFUNC:
-			sprintf(s->scratch_pad, "<native-function %p>", (void*)v->obj.nfunc);
+			sprintf(s->scratch_pad, "<native-function %p>", (void*)VAL_NFUNC(v));
 			break;
 		case SU_NATIVEPTR:
-			sprintf(s->scratch_pad, "<native-pointer %p>", v->obj.ptr);
+			sprintf(s->scratch_pad, "<native-pointer %p>", VAL_PTR(v));
 			break;
 		case SU_NATIVEDATA:
-			if (v->obj.data->vt && v->obj.data->vt->name)
-				sprintf(s->scratch_pad, "<%s>", v->obj.data->vt->name);
+			if (VAL_DATA(v)->vt && VAL_DATA(v)->vt->name)
+				sprintf(s->scratch_pad, "<%s>", VAL_DATA(v)->vt->name);
 			else
-				sprintf(s->scratch_pad, "<native-data %p>", v->obj.ptr);
+				sprintf(s->scratch_pad, "<native-data %p>", VAL_PTR(v));
 			break;
 		case SU_VECTOR:
-			sprintf(s->scratch_pad, "<vector %p>", v->obj.ptr);
+			sprintf(s->scratch_pad, "<vector %p>", VAL_PTR(v));
 			break;
 		case SU_MAP:
-			sprintf(s->scratch_pad, "<hashmap %p>", v->obj.ptr);
+			sprintf(s->scratch_pad, "<hashmap %p>", VAL_PTR(v));
 			break;
 		case SU_LOCAL:
-			sprintf(s->scratch_pad, "<local-reference %p>", v->obj.ptr);
+			sprintf(s->scratch_pad, "<local-reference %p>", VAL_PTR(v));
 			break;
 		case SU_GLOBAL:
-			sprintf(s->scratch_pad, "<global-reference %p>", v->obj.ptr);
+			sprintf(s->scratch_pad, "<global-reference %p>", VAL_PTR(v));
 			break;
 		case SU_INV:
 			sprintf(s->scratch_pad, "<invalid>");
@@ -397,7 +440,7 @@ const char *stringify(su_state *s, value_t *v) {
 		case TREE_SEQ:
 		case RANGE_SEQ:
 		case LAZY_SEQ:
-			sprintf(s->scratch_pad, "<sequence %p>", v->obj.ptr);
+			sprintf(s->scratch_pad, "<sequence %p>", VAL_PTR(v));
 			break;
 		default:
 			assert(0);
@@ -411,39 +454,36 @@ const char *su_stringify(su_state *s, int idx) {
 
 static value_t init_globals(su_state *s) {
 	value_t key, m, tmp;
-	key.type = SU_STRING;
-	key.obj.gc_object = string_from_cache(s, "_G", 2);
+	SET_OBJ(&key, SU_STRING, string_from_cache(s, "_G", 2));
 	
-	tmp.type = SU_NIL;
+	SET_NIL(&tmp);
 	
 	m = map_create_empty(s);
 	tmp = ref_local(s, &tmp);
-	m = map_insert(s, m.obj.m, &key, hash_value(&key), &tmp);
-	set_local(s, tmp.obj.loc, &m);
+	m = map_insert(s, VAL_MAP(&m), &key, hash_value(&key), &tmp);
+	set_local(s, VAL_LOC(&tmp), &m);
 	return tmp;
 }
 
 static void set_global(su_state *s, const char *var, unsigned hash, int size, value_t *val) {
 	value_t key, m;
-	key.type = SU_STRING;
-	key.obj.gc_object = string_from_cache(s, var, size);
+	SET_OBJ(&key, SU_STRING, string_from_cache(s, var, size));
 	
-	m = unref_local(s, s->stack[SU_GLOBAL_INDEX].obj.loc);
-	m = map_insert(s, m.obj.m, &key, hash, val);
-	set_local(s, s->stack[SU_GLOBAL_INDEX].obj.loc, &m);
+	m = unref_local(s, VAL_LOC(&s->stack[SU_GLOBAL_INDEX]));
+	m = map_insert(s, VAL_MAP(&m), &key, hash, val);
+	set_local(s, VAL_LOC(&s->stack[SU_GLOBAL_INDEX]), &m);
 }
 
 static value_t get_global(su_state *s, const char *var, unsigned hash, int size) {
 	value_t key, m;
-	key.type = SU_STRING;
-	key.obj.gc_object = string_from_cache(s, var, size);
+	SET_OBJ(&key, SU_STRING, string_from_cache(s, var, size));
 	
-	m = unref_local(s, s->stack[SU_GLOBAL_INDEX].obj.loc);
-	return map_get(s, m.obj.m, &key, hash);
+	m = unref_local(s, VAL_LOC(&s->stack[SU_GLOBAL_INDEX]));
+	return map_get(s, VAL_MAP(&m), &key, hash);
 }
 
 static int isseq(su_state *s, value_t *v) {
-	switch (v->type) {
+	switch (VAL_TYPE(v)) {
 		case IT_SEQ:
 		case CELL_SEQ:
 		case TREE_SEQ:
@@ -457,21 +497,75 @@ static int isseq(su_state *s, value_t *v) {
 
 void su_pushnil(su_state *s) {
 	value_t v;
-	v.type = SU_NIL;
+	SET_NIL(&v);
 	push_value(s, &v);
 }
 
 void su_pushfunction(su_state *s, su_nativefunc f) {
 	value_t v;
-	v.type = SU_NATIVEFUNC;
-	v.obj.nfunc = f;
+	SET_NFUNC(&v, f);
 	push_value(s, &v);
 }
 
+/* Open addressing on the function address. Signatures are only added by the
+   main state and never removed, so threads read the table without locking. */
+static native_sig_t *native_sig(su_state *s, su_nativefunc f) {
+	native_sig_t *sig;
+	unsigned i = (unsigned)(((size_t)f >> 4) % NATIVE_SIG_SIZE);
+	for (;;) {
+		sig = &s->msi->native_sigs[i];
+		if (sig->func == f || !sig->func)
+			return sig;
+		i = (i + 1) % NATIVE_SIG_SIZE;
+	}
+}
+
+static unsigned accepted_types(su_object_type_t t) {
+	switch ((unsigned)t) {
+		case SU_INV:
+		case SU_NIL:
+			return ~0u;
+		case SU_SEQ:
+			return (1u << RANGE_SEQ) | (1u << LAZY_SEQ) | (1u << CELL_SEQ) | (1u << TREE_SEQ) | (1u << IT_SEQ);
+		default:
+			return 1u << t;
+	}
+}
+
+void su_pushnative(su_state *s, const su_native_sig *sig) {
+	int i;
+	native_sig_t *ns = native_sig(s, sig->func);
+	su_assert(s, s->main_state == s, MAIN_STATE_ONLY_MSG);
+
+	if (ns->func != sig->func) {
+		su_assert(s, s->msi->num_native_sigs < NATIVE_SIG_SIZE - 1, "Too many native signatures!");
+		s->msi->num_native_sigs++;
+	}
+	ns->sig = sig;
+	ns->max_narg = (unsigned)sig->max_narg;
+	ns->num_typed = 0;
+	for (i = 0; i < SU_SIG_ARGS; i++) {
+		ns->accept[i] = accepted_types(sig->args[i]);
+		if (ns->accept[i] != ~0u)
+			ns->num_typed = i + 1;
+	}
+	rw_barrier();
+	ns->func = sig->func;
+	su_pushfunction(s, sig->func);
+}
+
+void su_pushnatives(su_state *s, const su_native_sig *sigs, int num) {
+	int i;
+	for (i = 0; i < num; i++) {
+		su_pushstring(s, sigs[i].name);
+		su_pushnative(s, &sigs[i]);
+	}
+}
+
 su_nativefunc su_tofunction(su_state *s, int idx) {
 	value_t *v = STK(TOP(idx));
-	if (v->type == SU_NATIVEFUNC)
-		return v->obj.nfunc;
+	if (VAL_TYPE(v) == SU_NATIVEFUNC)
+		return VAL_NFUNC(v);
 	return NULL;
 }
 
@@ -481,8 +575,7 @@ int su_clambda(su_state *s, su_nativefunc f) {
 	su_assert(s, s->main_state == s, MAIN_STATE_ONLY_MSG);
 	s->msi->c_lambdas = (value_t*)su_allocate(s, s->msi->c_lambdas, sizeof(value_t) * (++s->msi->num_c_lambdas));
 	if (f) {
-		v.type = SU_NATIVEFUNC;
-		v.obj.nfunc = f;
+		SET_NFUNC(&v, f);
 		s->msi->c_lambdas[id] = v;
 	} else {
 		s->msi->c_lambdas[id] = *STK(-1);
@@ -493,47 +586,46 @@ int su_clambda(su_state *s, su_nativefunc f) {
 
 void su_pushnumber(su_state *s, double n) {
 	value_t v;
-	v.type = SU_NUMBER;
-	v.obj.num = n;
+	SET_NUM(&v, n);
 	push_value(s, &v);
 }
 
 double su_tonumber(su_state *s, int idx) {
 	value_t *v = STK(TOP(idx));
-	if (v->type == SU_NUMBER)
-		return v->obj.num;
+	if (VAL_IS_NUMBER(v))
+		return VAL_NUM(v);
 	return 0.0;
 }
 
 void su_pushpointer(su_state *s, void *ptr) {
 	value_t v;
-	v.type = SU_NATIVEPTR;
-	v.obj.ptr = ptr;
+	SET_OBJ(&v, SU_NATIVEPTR, ptr);
 	push_value(s, &v);
 }
 
 void *su_topointer(su_state *s, int idx) {
 	value_t *v = STK(TOP(idx));
-	if (v->type == SU_NATIVEPTR)
-		return v->obj.ptr;
+	if (VAL_TYPE(v) == SU_NATIVEPTR)
+		return VAL_PTR(v);
 	return NULL;
 }
 
 void *su_newdata(su_state *s, unsigned size, const su_data_class_t *vt) {
 	value_t v;
-	v.type = SU_NATIVEDATA;
-	v.obj.data = (native_data_t*)su_allocate(s, NULL, sizeof(native_data_t) + size - 1);
-	v.obj.data->vt = (su_data_class_t*)vt;
-	gc_insert_object(s, v.obj.gc_object, SU_NATIVEDATA);
+	SET_OBJ(&v, SU_NATIVEDATA, (native_data_t*)gc_allocate(s, sizeof(native_data_t) + size - 1));
+	VAL_DATA(&v)->vt = (su_data_class_t*)vt;
+	if (vt && vt->trace_callback)
+		atomic_add(&s->msi->gc_traced_natives, 1);
+	gc_insert_object(s, VAL_GC(&v), SU_NATIVEDATA);
 	push_value(s, &v);
-	return (void*)v.obj.data->data;
+	return (void*)VAL_DATA(&v)->data;
 }
 
 void *su_todata(su_state *s, const su_data_class_t **vt, int idx) {
 	value_t *v = STK(TOP(idx));
-	if (v->type == SU_NATIVEDATA) {
-		if (vt) *vt = v->obj.data->vt;
-		return (void*)v->obj.data->data;
+	if (VAL_TYPE(v) == SU_NATIVEDATA) {
+		if (vt) *vt = VAL_DATA(v)->vt;
+		return (void*)VAL_DATA(v)->data;
 	}
 	return NULL;
 }
@@ -548,22 +640,20 @@ int su_tointeger(su_state *s, int idx) {
 
 void su_pushboolean(su_state *s, int b) {
 	value_t v;
-	v.type = SU_BOOLEAN;
-	v.obj.b = b == 0 ? 0 : 1;
+	SET_BOOL(&v, b == 0 ? 0 : 1);
 	push_value(s, &v);
 }
 
 int su_toboolean(su_state *s, int idx) {
 	value_t *v = STK(TOP(idx));
-	if (v->type == SU_BOOLEAN)
-		return v->obj.b;
+	if (VAL_TYPE(v) == SU_BOOLEAN)
+		return VAL_BOOL(v);
 	return 0;
 }
 
 void su_pushbytes(su_state *s, const char *ptr, unsigned size) {
 	value_t v;
-	v.type = SU_STRING;
-	v.obj.gc_object = string_from_cache(s, ptr, size);
+	SET_OBJ(&v, SU_STRING, string_from_cache(s, ptr, size));
 	push_value(s, &v);
 }
 
@@ -574,8 +664,8 @@ void su_pushstring(su_state *s, const char *str) {
 const char *su_tostring(su_state *s, int idx, unsigned *size) {
 	string_t *str;
 	value_t *v = STK(TOP(idx));
-	if (v->type == SU_STRING) {
-		str = (string_t*)v->obj.gc_object;
+	if (VAL_TYPE(v) == SU_STRING) {
+		str = (string_t*)VAL_GC(v);
 		if (size) *size = str->size;
 		return str->str;
 	}
@@ -630,9 +720,8 @@ void su_string_ch(su_state *s, char ch) {
 void su_string_push(su_state *s) {
 	value_t v;
 	assert(s->string_builder);
-	v.type = SU_STRING;
 	s->string_builder->hash = murmur(s->string_builder->str, s->string_builder->size, 0);
-	v.obj.gc_object = string_build_from_cache(s);
+	SET_OBJ(&v, SU_STRING, string_build_from_cache(s));
 	push_value(s, &v);
 	s->string_builder = NULL;
 }
@@ -660,6 +749,11 @@ void error(su_state *s, const char *fmt, va_list args) {
 	fprintf(s->fstderr, "\nThread: %x\n", s->tid);
 	
 	for (i = s->frame_top - 1; i >= 0; i--) {
+		/* Deep recursion only shows the innermost and outermost calls. */
+		if (i == s->frame_top - 1 - TRACE_DEPTH && i >= TRACE_DEPTH) {
+			fprintf(s->fstderr, "...\n");
+			i = TRACE_DEPTH - 1;
+		}
 		prot = (i == s->frame_top - 1) ? s->prot : s->frames[i].func->prot;
 		pc = (i == s->frame_top - 1) ? s->pc : s->frames[i + 1].ret_addr;
 		str = prot->name;
@@ -733,7 +827,7 @@ static const char *type_name(su_object_type_t type) {
 }
 
 const char *su_type_name(su_state *s, int idx) {
-	return type_name(STK(TOP(idx))->type);
+	return type_name(VAL_TYPE(STK(TOP(idx))));
 }
 
 void su_map(su_state *s, int num) {
@@ -743,26 +837,26 @@ void su_map(su_state *s, int num) {
 	for (i = num * 2; i > 0; i -= 2) {
 		k = *STK(-i);
 		v = *STK(-i + 1);
-		m = map_insert(s, m.obj.m, &k, hash_value(&k), &v);
+		m = map_insert(s, VAL_MAP(&m), &k, hash_value(&k), &v);
 	}
 	s->stack_top -= num * 2;
 	push_value(s, &m);
 }
 
 int su_map_length(su_state *s, int idx) {
-	return map_length(STK(TOP(idx))->obj.m);
+	return map_length(VAL_MAP(STK(TOP(idx))));
 }
 
 void su_map_cat(su_state *s) {
-	s->stack[s->stack_top - 2] = map_cat(s, STK(-2)->obj.m, STK(-1)->obj.m);
+	s->stack[s->stack_top - 2] = map_cat(s, VAL_MAP(STK(-2)), VAL_MAP(STK(-1)));
 	s->stack_top--;
 }
 
 int su_map_get(su_state *s, int idx) {
 	value_t v = *STK(-1);
 	unsigned hash = hash_value(&v);
-	v = map_get(s, STK(TOP(idx))->obj.m, &v, hash);
-	if (v.type == SU_INV) {
+	v = map_get(s, VAL_MAP(STK(TOP(idx))), &v, hash);
+	if (VAL_TYPE(&v) == SU_INV) {
 		s->stack_top--;
 		return 0;
 	}
@@ -773,22 +867,22 @@ int su_map_get(su_state *s, int idx) {
 void su_map_insert(su_state *s, int idx) {
 	value_t key = *STK(-2);
 	unsigned hash = hash_value(&key);
-	s->stack[s->stack_top - 2] = map_insert(s, STK(TOP(idx))->obj.m, &key, hash, STK(-1));
+	s->stack[s->stack_top - 2] = map_insert(s, VAL_MAP(STK(TOP(idx))), &key, hash, STK(-1));
 	s->stack_top--;
 }
 
 void su_map_remove(su_state *s, int idx) {
 	value_t key = *STK(-1);
 	unsigned hash = hash_value(&key);
-	s->stack[s->stack_top - 1] = map_remove(s, STK(TOP(idx))->obj.m, &key, hash);
+	s->stack[s->stack_top - 1] = map_remove(s, VAL_MAP(STK(TOP(idx))), &key, hash);
 }
 
 int su_map_has(su_state *s, int idx) {
 	value_t v = *STK(-1);
 	unsigned hash = hash_value(&v);
-	v = map_get(s, STK(TOP(idx))->obj.m, &v, hash);
+	v = map_get(s, VAL_MAP(STK(TOP(idx))), &v, hash);
 	s->stack_top--;
-	return v.type != SU_INV;
+	return VAL_TYPE(&v) != SU_INV;
 }
 
 void su_list(su_state *s, int num) {
@@ -798,12 +892,12 @@ void su_list(su_state *s, int num) {
 }
 
 void su_first(su_state *s, int idx) {
-	value_t v = seq_first(s, STK(TOP(idx))->obj.q);
+	value_t v = seq_first(s, VAL_SEQ(STK(TOP(idx))));
 	push_value(s, &v);
 }
 
 void su_rest(su_state *s, int idx) {
-	value_t v = seq_rest(s, STK(TOP(idx))->obj.q);
+	value_t v = seq_rest(s, VAL_SEQ(STK(TOP(idx))));
 	push_value(s, &v);
 }
 
@@ -836,13 +930,13 @@ void su_seq(su_state *s, int idx, int reverse) {
 			su_pushnil(s);
 			return;
 		case SU_VECTOR:
-			v = it_create_vector(s, seq->obj.vec, reverse);
+			v = it_create_vector(s, VAL_VEC(seq), reverse);
 			break;
 		case SU_MAP:
-			v = tree_create_map(s, seq->obj.m);
+			v = tree_create_map(s, VAL_MAP(seq));
 			break;
 		case SU_STRING:
-			v = it_create_string(s, seq->obj.str, reverse);
+			v = it_create_string(s, VAL_STR(seq), reverse);
 			break;
 		case SU_SEQ:
 			if (reverse) {
@@ -854,9 +948,9 @@ void su_seq(su_state *s, int idx, int reverse) {
 			break;
 		case SU_NUMBER:
 			if (reverse)
-				v = range_create(s, (int)seq->obj.num, 0);
+				v = range_create(s, (int)VAL_NUM(seq), 0);
 			else
-				v = range_create(s, 0, (int)seq->obj.num);
+				v = range_create(s, 0, (int)VAL_NUM(seq));
 			break;
 		case SU_FUNCTION:
 		case SU_NATIVEFUNC:
@@ -865,7 +959,7 @@ void su_seq(su_state *s, int idx, int reverse) {
 				break;
 			}
 		default:
-			su_error(s, "Can't sequence object of type: %s", type_name((su_object_type_t)seq->type));
+			su_error(s, "Can't sequence object of type: %s", type_name((su_object_type_t)VAL_TYPE(seq)));
 	}
 	push_value(s, &v);
 }
@@ -875,9 +969,9 @@ int su_unpack_seq(su_state *s, int idx) {
 	value_t tmp;
 	value_t v = *STK(TOP(idx));
 	while (isseq(s, &v)) {
-		tmp = v.obj.q->vt->first(s, v.obj.q);
+		tmp = VAL_SEQ(&v)->vt->first(s, VAL_SEQ(&v));
 		push_value(s, &tmp);
-		v = v.obj.q->vt->rest(s, v.obj.q);
+		v = VAL_SEQ(&v)->vt->rest(s, VAL_SEQ(&v));
 		num++;
 	}
 	return num;
@@ -889,10 +983,10 @@ void su_cat_seq(su_state *s) {
 	su_seq_reverse(s, -2);
 	r = *STK(-1);
 	
-	while (v.type != SU_NIL) {
-		f = seq_first(s, v.obj.q);
+	while (VAL_TYPE(&v) != SU_NIL) {
+		f = seq_first(s, VAL_SEQ(&v));
 		r = cell_create(s, &f, &r);
-		v = seq_rest(s, v.obj.q);
+		v = seq_rest(s, VAL_SEQ(&v));
 	}
 	
 	s->stack[s->stack_top - 3] = r;
@@ -903,29 +997,26 @@ void su_cat_seq(su_state *s) {
 }
 
 void su_vector(su_state *s, int num) {
-	int i;
-	value_t vec = vector_create_empty(s);
-	for (i = 0; i < num; i++)
-		vec = vector_push(s, vec.obj.vec, STK(-(num - i)));
+	value_t vec = vector_create_array(s, STK(-num), num);
 	s->stack_top -= num;
 	push_value(s, &vec);
 }
 
 void su_vector_cat(su_state *s) {
-	s->stack[s->stack_top - 2] = vector_cat(s, STK(-2)->obj.vec, STK(-1)->obj.vec);
+	s->stack[s->stack_top - 2] = vector_cat(s, VAL_VEC(STK(-2)), VAL_VEC(STK(-1)));
 	s->stack_top--;
 }
 
 int su_vector_length(su_state *s, int idx) {
-	return vector_length(STK(TOP(idx))->obj.vec);
+	return vector_length(VAL_VEC(STK(TOP(idx))));
 }
 
 void su_vector_index(su_state *s, int idx) {
-	s->stack[s->stack_top - 1] = vector_index(s, STK(TOP(idx))->obj.vec, (int)STK(-1)->obj.num);
+	s->stack[s->stack_top - 1] = vector_index(s, VAL_VEC(STK(TOP(idx))), (int)VAL_NUM(STK(-1)));
 }
 
 void su_vector_set(su_state *s, int idx) {
-	s->stack[s->stack_top - 2] = vector_set(s, STK(TOP(idx))->obj.vec, (int)STK(-2)->obj.num, STK(-1));
+	s->stack[s->stack_top - 2] = vector_set(s, VAL_VEC(STK(TOP(idx))), (int)VAL_NUM(STK(-2)), STK(-1));
 	su_pop(s, 1);
 }
 
@@ -933,23 +1024,24 @@ void su_vector_push(su_state *s, int idx, int num) {
 	int i;
 	value_t vec = *STK(TOP(idx));
 	for (i = 0; i < num; i++)
-		vec = vector_push(s, vec.obj.vec, STK(-(num - i)));
+		vec = vector_push(s, VAL_VEC(&vec), STK(-(num - i)));
 	s->stack_top -= num;
 	push_value(s, &vec);
 }
 
 void su_vector_pop(su_state *s, int idx, int num) {
 	int i;
-	int n = (int)STK(TOP(num))->obj.num;
+	int n = (int)VAL_NUM(STK(TOP(num)));
 	value_t vec = *STK(TOP(idx));
 	for (i = 0; i < n; i++)
-		vec = vector_pop(s, vec.obj.vec);
+		vec = vector_pop(s, VAL_VEC(&vec));
 	push_value(s, &vec);
 }
 
 void su_check_type(su_state *s, int idx, su_object_type_t t) {
 	value_t *v = STK(TOP(idx));
-	su_assert(s, t == SU_SEQ ? isseq(s, v) : v->type == t, "Bad argument: Expected %s, but got %s.", type_name(t), type_name((su_object_type_t)v->type));
+	if (!(t == SU_SEQ ? isseq(s, v) : VAL_TYPE(v) == t))
+		su_error(s, "Bad argument: Expected %s, but got %s.", type_name(t), type_name((su_object_type_t)VAL_TYPE(v)));
 }
 
 void su_seterror(su_state *s, jmp_buf jmp, int flag) {
@@ -957,23 +1049,29 @@ void su_seterror(su_state *s, jmp_buf jmp, int flag) {
 	if (flag && s->errtop >= 0) {
 		s->stack_top = s->errtop;
 		s->frame_top = s->ferrtop;
+		s->native_top = s->nerrtop;
 	} else if (flag < 0) {
 		s->errtop = -1;
 		s->ferrtop = -1;
 	} else {
 		s->errtop = s->stack_top;
 		s->ferrtop = s->frame_top;
+		s->nerrtop = s->native_top;
 	}
 }
 
 su_object_type_t su_type(su_state *s, int idx) {
-	return isseq(s, STK(TOP(idx))) ? SU_SEQ : (su_object_type_t)STK(idx)->type;
+	return isseq(s, STK(TOP(idx))) ? SU_SEQ : (su_object_type_t)VAL_TYPE(STK(idx));
+}
+
+int su_equal(su_state *s, int a, int b) {
+	return value_eq(STK(TOP(a)), STK(TOP(b)));
 }
 
 int su_getglobal(su_state *s, const char *name) {
 	int size = strlen(name);
 	value_t v = get_global(s, name, murmur(name, size, 0), size);
-	if (v.type == SU_INV)
+	if (VAL_TYPE(&v) == SU_INV)
 		return 0;
 	push_value(s, &v);
 	return 1;
@@ -982,8 +1080,7 @@ int su_getglobal(su_state *s, const char *name) {
 void su_setglobal(su_state *s, const char *name) {
 	value_t v;
 	unsigned size = strlen(name);
-	v.type = SU_STRING;
-	v.obj.gc_object = string_from_cache(s, name, size);
+	SET_OBJ(&v, SU_STRING, string_from_cache(s, name, size));
 	set_global(s, name, hash_value(&v), size, STK(-1));
 	su_pop(s, 1);
 }
@@ -992,23 +1089,21 @@ void *su_reg_reference(su_state *s, int idx) {
 	value_t key;
 	unsigned hash;
 	su_assert(s, s->main_state == s, MAIN_STATE_ONLY_MSG);
-	key.type = SU_NATIVEPTR;
-	key.obj.ptr = (void*)s->msi->ref_counter;
+	SET_OBJ(&key, SU_NATIVEPTR, (void*)s->msi->ref_counter);
 	hash = hash_value(&key);
-	s->stack[SU_REGISTRY_INDEX] = map_insert(s, s->stack[SU_REGISTRY_INDEX].obj.m, &key, hash, STK(TOP(idx)));
+	s->stack[SU_REGISTRY_INDEX] = map_insert(s, VAL_MAP(&s->stack[SU_REGISTRY_INDEX]), &key, hash, STK(TOP(idx)));
 	s->msi->ref_counter++;
 	assert(s->msi->ref_counter);
-	return key.obj.ptr;
+	return VAL_PTR(&key);
 }
 
 void su_unreg_reference(su_state *s, void *ref) {
 	value_t key;
 	unsigned hash;
 	su_assert(s, s->main_state == s, MAIN_STATE_ONLY_MSG);
-	key.type = SU_NATIVEPTR;
-	key.obj.ptr = ref;
+	SET_OBJ(&key, SU_NATIVEPTR, ref);
 	hash = hash_value(&key);
-	s->stack[SU_REGISTRY_INDEX] = map_remove(s, s->stack[SU_REGISTRY_INDEX].obj.m, &key, hash);
+	s->stack[SU_REGISTRY_INDEX] = map_remove(s, VAL_MAP(&s->stack[SU_REGISTRY_INDEX]), &key, hash);
 	s->stack_top--;
 }
 
@@ -1019,27 +1114,129 @@ void su_debug(su_state *s, int mask, su_debugfunc f, void *data) {
 	thread_interrupt(s, IBREAK);
 }
 
+#ifdef SU_OPT_PROFILE
+static const char *feedback_names[] = {"number", "other", "function", "native", "poly"};
+
+/* Callees are only remembered within the same root, so the pointer lives as
+   long as the caller does. */
+static void feedback_call(su_state *s, feedback_t *fb, int op, value_t *f) {
+	prototype_t *callee;
+	fb->op = op;
+	switch (VAL_TYPE(f)) {
+		case SU_FUNCTION:
+			fb->types |= FB_FUNCTION;
+			callee = VAL_FUNC(f)->prot;
+			if (callee->root != s->prot->root)
+				break;
+			if (!fb->callee)
+				fb->callee = callee;
+			else if (fb->callee != callee)
+				fb->types |= FB_POLY;
+			break;
+		case SU_NATIVEFUNC:
+			fb->types |= FB_NATIVE;
+			break;
+		default:
+			fb->types |= FB_OTHER;
+	}
+}
+
+/* Prototypes are numbered depth first from their root, the same order the
+   compiler writes them in. */
+static int prototype_index(prototype_t *prot, prototype_t *p, int *index) {
+	unsigned i;
+	int ret;
+	if (prot == p)
+		return *index;
+	for (i = 0; i < prot->num_prot; i++) {
+		++*index;
+		if ((ret = prototype_index(&prot->prot[i], p, index)) >= 0)
+			return ret;
+	}
+	return -1;
+}
+
+static void write_profile(FILE *fp, prototype_t *root, prototype_t *prot, int *index) {
+	unsigned i, j;
+	int n, self = *index;
+	feedback_t *fb;
+
+	for (i = 0; i < prot->num_inst; i++) {
+		fb = &prot->feedback[i];
+		if (!fb->types)
+			continue;
+		fprintf(fp, "%s\t%i\t%u\t%s\t", prot->name->str, self, i, op_names[fb->op]);
+		for (j = 0; j < sizeof(feedback_names) / sizeof(feedback_names[0]); j++) {
+			if (fb->types & (1 << j))
+				fprintf(fp, (fb->types & ((1 << j) - 1)) ? " %s" : "%s", feedback_names[j]);
+		}
+		if (fb->callee && !(fb->types & FB_POLY)) {
+			n = 0;
+			fprintf(fp, "\t%i", prototype_index(root, fb->callee, &n));
+		}
+		fputs("\n", fp);
+	}
+
+	for (i = 0; i < prot->num_prot; i++) {
+		++*index;
+		write_profile(fp, root, &prot->prot[i], index);
+	}
+}
+#endif
+
+#ifdef SU_OPT_PROFILE
+static void write_profiles(FILE *fp, gc_t *obj, int skip_white) {
+	int index;
+	for (; obj; obj = obj->next) {
+		if (obj->type == PROTOTYPE && !(skip_white && obj->flags == GC_FLAG_WHITE)) {
+			index = 0;
+			write_profile(fp, (prototype_t*)obj, (prototype_t*)obj, &index);
+		}
+	}
+}
+#endif
+
+/* Threads that are still running only have their prototypes written once a
+   collection has merged their object lists. */
+void su_profile(su_state *s, FILE *fp) {
+#ifdef SU_OPT_PROFILE
+	int i;
+	su_state *thread;
+	main_state_internal_t *msi = s->msi;
+
+	su_thread_indisposable(s);
+	spin_lock(&msi->thread_pool_lock);
+	su_thread_disposable(s);
+
+	/* White objects waiting for the lazy sweep are dead. */
+	write_profiles(fp, msi->gc_root, 0);
+	write_profiles(fp, msi->gc_sweep, 1);
+	for (i = 0; i < SU_OPT_MAX_THREADS; i++) {
+		thread = &msi->threads[i];
+		if (thread == s || atomic_get(&thread->thread_finished))
+			write_profiles(fp, thread->gc_list, 0);
+	}
+	spin_unlock(&msi->thread_pool_lock);
+#endif
+}
+
 value_t create_value(su_state *s, const_t *constant) {
 	value_t v;
 	switch (constant->id) {
 		case CSTRING:
-			v.type = SU_STRING;
-			v.obj.gc_object = string_from_cache(s, constant->obj.str->str, constant->obj.str->size);
+			SET_OBJ(&v, SU_STRING, string_from_cache(s, constant->obj.str->str, constant->obj.str->size));
 			break;
 		case CNUMBER:
-			v.type = SU_NUMBER;
-			v.obj.num = constant->obj.num;
+			SET_NUM(&v, constant->obj.num);
 			break;
 		case CTRUE:
-			v.type = SU_BOOLEAN;
-			v.obj.b = SU_TRUE;
+			SET_BOOL(&v, SU_TRUE);
 			break;
 		case CFALSE:
-			v.type = SU_BOOLEAN;
-			v.obj.b = SU_FALSE;
+			SET_BOOL(&v, SU_FALSE);
 			break;
 		case CNIL:
-			v.type = SU_NIL;
+			SET_NIL(&v);
 			break;
 		default:
 			assert(0);
@@ -1067,7 +1264,8 @@ static const_string_t *read_string(su_state *s, reader_buffer_t *buffer) {
 
 int read_prototype(su_state *s, reader_buffer_t *buffer, prototype_t *prot) {
 	unsigned i;
-	memset(prot, 0, sizeof(prototype_t));
+	/* The header keeps the slot the root prototype was allocated from. */
+	memset((char*)prot + sizeof(gc_t), 0, sizeof(prototype_t) - sizeof(gc_t));
 
 	assert(sizeof(unsigned) == 4);
 	assert(sizeof(instruction_t) == 4);
@@ -1129,35 +1327,63 @@ error:
 
 #undef READ
 
-void lambda(su_state *s, prototype_t *prot, int narg) {
-	unsigned i, tmp;
-	value_t v;
-	function_t *func = su_allocate(s, NULL, sizeof(function_t));
-
+static function_t *new_function(su_state *s, prototype_t *prot, int narg) {
+	function_t *func = gc_allocate(s, sizeof(function_t));
 	func->narg = narg;
 	func->prot = prot;
-	func->num_const = prot->num_const;
 	func->num_ups = prot->num_ups;
-	func->constants = su_allocate(s, NULL, sizeof(value_t) * prot->num_const);
-	func->upvalues = su_allocate(s, NULL, sizeof(value_t) * prot->num_ups);
+	func->upvalues = prot->num_ups ? su_allocate(s, NULL, sizeof(value_t) * prot->num_ups) : NULL;
+	gc_insert_object(s, (gc_t*)func, SU_FUNCTION);
+	return func;
+}
 
-	for (i = 0; i < func->num_const; i++)
-		func->constants[i] = create_value(s, &prot->constants[i]);
+/* Constants are created once per prototype and shared by all its closures.
+   Nested prototypes are not GC objects, they are kept alive by their root.
+   Lambdas without upvalues are all alike, so one closure is created up front
+   and reused by every OP_LAMBDA of that prototype. */
+static void init_prototype(su_state *s, prototype_t *prot, prototype_t *root) {
+	unsigned i;
+	prototype_t *p;
+	prot->root = root;
+	prot->closure = NULL;
+#ifdef SU_OPT_PROFILE
+	prot->feedback = su_allocate(s, NULL, sizeof(feedback_t) * prot->num_inst);
+	memset(prot->feedback, 0, sizeof(feedback_t) * prot->num_inst);
+#endif
+	prot->values = su_allocate(s, NULL, sizeof(value_t) * prot->num_const);
+	for (i = 0; i < prot->num_const; i++)
+		prot->values[i] = create_value(s, &prot->constants[i]);
+	for (i = 0; i < prot->num_prot; i++)
+		init_prototype(s, &prot->prot[i], root);
+	for (i = 0; i < prot->num_inst; i++) {
+		if (prot->inst[i].id != OP_LAMBDA || prot->inst[i].a >= prot->num_prot)
+			continue;
+		p = &prot->prot[prot->inst[i].a];
+		if (p->num_ups == 0 && !p->closure)
+			p->closure = new_function(s, p, prot->inst[i].b);
+	}
+}
 
-	for (i = 0; i < func->num_ups; i++) {
-		tmp = s->frame_top - prot->upvalues[i].lv;
-		tmp = s->frames[tmp].stack_top + prot->upvalues[i].idx + 1;
-		func->upvalues[i] = s->stack[tmp];
+void lambda(su_state *s, prototype_t *prot, int narg) {
+	unsigned i, tmp;
+	value_t v;
+	function_t *func = prot->closure;
+
+	if (!func || func->narg != narg) {
+		func = new_function(s, prot, narg);
+		for (i = 0; i < func->num_ups; i++) {
+			tmp = s->frame_top - prot->upvalues[i].lv;
+			tmp = s->frames[tmp].stack_top + prot->upvalues[i].idx + 1;
+			func->upvalues[i] = s->stack[tmp];
+		}
 	}
 
-	gc_insert_object(s, (gc_t*)func, SU_FUNCTION);
-	v.type = SU_FUNCTION;
-	v.obj.func = func;
+	SET_OBJ(&v, SU_FUNCTION, func);
 	push_value(s, &v);
 }
 
 int su_load(su_state *s, su_reader reader, void *data) {
-	prototype_t *prot = su_allocate(s, NULL, sizeof(prototype_t));
+	prototype_t *prot = gc_allocate(s, sizeof(prototype_t));
 	reader_buffer_t *buffer = buffer_open(s, reader, data);
 
 	if (verify_header(s, buffer)) {
@@ -1165,12 +1391,13 @@ int su_load(su_state *s, su_reader reader, void *data) {
 		return -1;
 	}
 
-	if (read_prototype(s, buffer, prot)) {
+	if (read_prototype(s, buffer, prot) || verify_prototype(s, prot, -1)) {
 		buffer_close(s, buffer);
 		return -1;
 	}
 
 	buffer_close(s, buffer);
+	init_prototype(s, prot, prot);
 	gc_insert_object(s, &prot->gc, PROTOTYPE);
 	lambda(s, prot, -1);
 	return 0;
@@ -1212,328 +1439,843 @@ void su_check_arguments(su_state *s, int num, ...) {
 }
 
 static void global_error(su_state *s, const char *msg, value_t *constant) {
-	assert(constant->type == SU_STRING);
-	fprintf(s->fstderr, "%s: %s\n", msg, ((string_t*)constant->obj.gc_object)->str);
+	assert(VAL_TYPE(constant) == SU_STRING);
+	fprintf(s->fstderr, "%s: %s\n", msg, VAL_STR(constant)->str);
 	su_error(s, NULL);
 }
 
+static map_t *global_map(su_state *s) {
+	local_t *loc = VAL_LOC(&s->stack[SU_GLOBAL_INDEX]);
+	assert(loc->tid == s->tid);
+	return VAL_MAP(&loc->v);
+}
+
+/* Inline caches are per thread and indexed by instruction address. An entry
+   is keyed on the map it was read from, the globals map for OP_GETGLOBAL and
+   the root node for OP_GETFIELD. Maps are immutable, so OP_SETGLOBAL and
+   su_setglobal, which install a new map, make every older entry miss. The
+   GC cycle guards against a freed map or prototype being reallocated at the
+   same address. */
+static inline_cache_t *inline_cache(su_state *s, const instruction_t *inst) {
+	return &s->inline_cache[((size_t)inst / sizeof(instruction_t)) % INLINE_CACHE_SIZE];
+}
+
+static void set_inline_cache(su_state *s, inline_cache_t *ic, const instruction_t *inst, const void *key, value_t *v) {
+	ic->inst = inst;
+	ic->key = key;
+	ic->gc_cycle = s->msi->gc_cycle;
+	ic->value = *v;
+}
+
+static void operand_error(su_state *s, value_t *v) {
+	su_error(s, "Bad argument: Expected %s, but got %s.", type_name(SU_NUMBER), type_name((su_object_type_t)VAL_TYPE(v)));
+}
+
+/* Services pending collection and GC interrupts. The interpreter does this at
+   its safepoints, native code that loops for long should call it too. */
+void su_safepoint(su_state *s) {
+	int in = s->interrupt | atomic_get(&s->msi->interrupt);
+	if ((in & ISCOLLECT) == ISCOLLECT) {
+		su_thread_indisposable(s);
+		su_thread_disposable(s);
+	}
+	if ((in & IGC) == IGC) {
+		unmask_thread_interrupt(s, IGC);
+		gc_trace(s);
+	}
+}
+
+static void native_arity_error(su_state *s, const su_native_sig *sig, int narg) {
+	if (sig->min_narg == sig->max_narg)
+		su_error(s, "Bad number of arguments to function. Expected %i but got %i.", sig->min_narg, narg);
+	else if (narg < sig->min_narg)
+		su_error(s, "To few arguments passed to function. Expected at least %i but got %i.", sig->min_narg, narg);
+	else
+		su_error(s, "To many arguments passed to function. Expected at most %i but got %i.", sig->max_narg, narg);
+}
+
+/* Checks the narg values on top of the stack against the signature of f, if
+   it has one. Arity is two compares and each typed argument a mask test. */
+static void check_native(su_state *s, su_nativefunc f, int narg) {
+	int i, n;
+	value_t *args;
+	native_sig_t *sig = native_sig(s, f);
+
+	if (sig->func != f)
+		return;
+	if (narg < sig->sig->min_narg || (unsigned)narg > sig->max_narg)
+		native_arity_error(s, sig->sig, narg);
+
+	args = STK(-narg);
+	n = narg < sig->num_typed ? narg : sig->num_typed;
+	for (i = 0; i < n; i++) {
+		if (!((1u << VAL_TYPE(&args[i])) & sig->accept[i])) {
+			su_error(s, "Expected argument %i to be of type '%s', but it is of type '%s'.", i,
+				type_name(sig->sig->args[i]), type_name(isseq(s, &args[i]) ? SU_SEQ : (su_object_type_t)VAL_TYPE(&args[i])));
+		}
+	}
+}
+
+/* Moves the first nret of the num results on top of the stack to index f,
+   padding with nil. The caller makes sure there is room for them. */
+static void set_results(su_state *s, int f, int num, int nret) {
+	int i;
+	memmove(&s->stack[f], STK(-num), sizeof(value_t) * (num < nret ? num : nret));
+	for (i = num; i < nret; i++)
+		SET_NIL(&s->stack[f + i]);
+	s->stack_top = f + nret;
+}
+
+/* Calls the native function at stack index f with the narg values above it,
+   leaving nret results in place of the function. */
+static void call_native(su_state *s, int f, int narg, int nret) {
+	int tmp = s->narg;
+	check_native(s, VAL_NFUNC(&s->stack[f]), narg);
+	s->narg = narg;
+	set_results(s, f, VAL_NFUNC(&s->stack[f])(s, narg), nret);
+	s->narg = tmp;
+}
+
+/* Applies a value that is not a bytecode function at stack index tmp to the
+   narg values above it, leaving nret results in its place. Only natives
+   can return more than one. */
+static void apply(su_state *s, int tmp, int narg, int nret) {
+	value_t tmpv, tmpv2;
+	int i, j, k;
+	const char *tmpcs;
+
+	switch (VAL_TYPE(&s->stack[tmp])) {
+		case SU_NATIVEFUNC:
+			call_native(s, tmp, narg, nret);
+			return;
+		case SU_VECTOR:
+			if (narg == 1) {
+				su_check_type(s, -1, SU_NUMBER);
+				tmpv = vector_index(s, VAL_VEC(&s->stack[tmp]), su_tointeger(s, -1));
+				su_pop(s, 2);
+				push_value(s, &tmpv);
+			} else {
+				for (i = -narg, j = 0; i; i++, j++) {
+					su_check_type(s, i - j, SU_NUMBER);
+					tmpv = vector_index(s, VAL_VEC(&s->stack[tmp]), su_tointeger(s, i - j));
+					push_value(s, &tmpv);
+				}
+				su_vector(s, narg);
+				s->stack[tmp] = s->stack[s->stack_top - 1];
+				s->stack_top -= narg + 1;
+			}
+			break;
+		case SU_MAP:
+			if (narg == 1) {
+				tmpv2 = *STK(-1);
+				tmpv = map_get(s, VAL_MAP(&s->stack[tmp]), &tmpv2, hash_value(&tmpv2));
+				su_assert(s, VAL_TYPE(&tmpv) != SU_INV, "No value with key: %s", stringify(s, &tmpv2));
+				su_pop(s, 2);
+				push_value(s, &tmpv);
+			} else {
+				for (i = -narg, j = 0; i; i++, j += 2) {
+					tmpv2 = *STK(i - j);
+					push_value(s, &tmpv2);
+					tmpv = map_get(s, VAL_MAP(&s->stack[tmp]), &tmpv2, hash_value(&tmpv2));
+					su_assert(s, VAL_TYPE(&tmpv) != SU_INV, "No value with key: %s", stringify(s, &tmpv2));
+					push_value(s, &tmpv);
+				}
+				su_map(s, narg);
+				s->stack[tmp] = s->stack[s->stack_top - 1];
+				s->stack_top -= narg + 1;
+			}
+			break;
+		case SU_STRING:
+			if (narg == 1) {
+				su_check_type(s, -1, SU_NUMBER);
+				j = su_tointeger(s, -1);
+				su_assert(s, j < VAL_STR(&s->stack[tmp])->size, "Out of range!");
+				s->scratch_pad[0] = VAL_STR(&s->stack[tmp])->str[j];
+				su_pop(s, 2);
+				su_pushbytes(s, s->scratch_pad, 1);
+			} else {
+				k = 0;
+				for (i = -narg; i; i++) {
+					su_check_type(s, i, SU_NUMBER);
+					j = su_tointeger(s, i);
+					su_assert(s, j < VAL_STR(&s->stack[tmp])->size, "Out of range!");
+					s->scratch_pad[k++] = VAL_STR(&s->stack[tmp])->str[j];
+					assert(k < SU_SCRATCHPAD_SIZE);
+				}
+				su_pushbytes(s, s->scratch_pad, k);
+				s->stack[tmp] = s->stack[s->stack_top - 1];
+				s->stack_top -= narg + 1;
+			}
+			break;
+		case SU_NATIVEDATA:
+			tmpv = s->stack[tmp];
+			if (VAL_DATA(&tmpv)->vt && VAL_DATA(&tmpv)->vt->call) {
+				k = s->narg;
+				s->narg = narg;
+				set_results(s, tmp, VAL_DATA(&tmpv)->vt->call(s, (void*)VAL_DATA(&tmpv)->data, narg), nret);
+				s->narg = k;
+				return;
+			}
+		default:
+			if (narg == 1 && isseq(s, &s->stack[tmp])) {
+				su_check_type(s, -1, SU_STRING);
+				tmpcs = su_tostring(s, -1, NULL);
+				if (!strcmp(tmpcs, "first")) {
+					tmpv = seq_first(s, VAL_SEQ(STK(-2)));
+					s->stack[(--s->stack_top) - 1] = tmpv;
+					break;
+				} else if (!strcmp(tmpcs, "rest")) {
+					tmpv = seq_rest(s, VAL_SEQ(STK(-2)));
+					s->stack[(--s->stack_top) - 1] = tmpv;
+					break;
+				}
+			}
+			su_error(s, "Can't apply '%s'.", type_name(VAL_TYPE(&s->stack[tmp])));
+	}
+	if (nret != 1)
+		set_results(s, tmp, 1, nret);
+}
+
+#ifdef SU_JIT
+
+#define JIT_SAVE_STATE() { s->pc = ctx->pc; s->stack_top = (int)(ctx->sp - s->stack); }
+
+void jit_getglobal(jit_context_t *ctx) {
+	su_state *s = ctx->s;
+	instruction_t *inst = &s->prot->inst[ctx->pc];
+	map_t *m = global_map(s);
+	inline_cache_t *ic = inline_cache(s, inst);
+	value_t v;
+
+	if (ic->inst == inst && ic->key == m && ic->gc_cycle == s->msi->gc_cycle) {
+		*ctx->sp++ = ic->value;
+		return;
+	}
+	JIT_SAVE_STATE();
+	v = ctx->constants[inst->a];
+	su_assert(s, VAL_TYPE(&v) == SU_STRING, "Global key must be a string!");
+	v = map_get(s, m, &v, hash_value(&v));
+	if (VAL_TYPE(&v) == SU_INV)
+		global_error(s, "Undefined global variable", &ctx->constants[inst->a]);
+	set_inline_cache(s, ic, inst, m, &v);
+	*ctx->sp++ = v;
+}
+
+void jit_getfield(jit_context_t *ctx) {
+	su_state *s = ctx->s;
+	instruction_t *inst = &s->prot->inst[ctx->pc];
+	value_t *key = &ctx->constants[inst->a];
+	map_t *m = VAL_MAP(&ctx->sp[-1]);
+	inline_cache_t *ic = inline_cache(s, inst);
+	value_t v;
+
+	if (ic->inst == inst && ic->key == m->root && ic->gc_cycle == s->msi->gc_cycle) {
+		ctx->sp[-1] = ic->value;
+		return;
+	}
+	JIT_SAVE_STATE();
+	v = map_get(s, m, key, hash_value(key));
+	su_assert(s, VAL_TYPE(&v) != SU_INV, "No value with key: %s", stringify(s, key));
+	set_inline_cache(s, ic, inst, m->root, &v);
+	ctx->sp[-1] = v;
+}
+
+void jit_call(jit_context_t *ctx) {
+	su_state *s = ctx->s;
+	int narg = s->prot->inst[ctx->pc].a;
+	int base = (int)(ctx->base - s->stack);
+	JIT_SAVE_STATE();
+	call_native(s, s->stack_top - narg - 1, narg, 1);
+	ctx->sp = &s->stack[s->stack_top];
+	ctx->base = &s->stack[base];
+	ctx->stack_end = &s->stack[s->stack_size];
+}
+
+#undef JIT_SAVE_STATE
+
+#endif
+
 static void vm_loop(su_state *s, function_t *func) {
 	value_t tmpv, tmpv2;
+	value_t *opa, *opb;
+	map_t *m;
+	inline_cache_t *ic;
 	instruction_t inst;
-	int tmp, narg, i, j, k;
-	const char *tmpcs;
+	int tmp, i, j, nret = 1;
 	su_debug_data dbg;
 
-	s->frame = FRAME();
-	s->prot = func->prot;
+	/* Interpreter registers. These shadow s->pc and s->stack_top and must be
+	   written back with SAVE_STATE before calling anything that can see them.
+	   Anything that can push may also move the stack, so sp, base and
+	   stack_end are reloaded with LOAD_SP afterwards. */
+	int pc, num_inst;
+	instruction_t *code;
+	value_t *sp, *base, *constants, *stack_end;
+
+	#ifdef SU_COMPUTED_GOTO
+		static const void *dispatch_table[256] = {
+			[0 ... 255] = &&vm_invalid,
+			[OP_PUSH] = &&L_OP_PUSH, [OP_POP] = &&L_OP_POP, [OP_LOAD] = &&L_OP_LOAD,
+			[OP_LUP] = &&L_OP_LUP, [OP_LCL] = &&L_OP_LCL,
+			[OP_ADD] = &&L_OP_ADD, [OP_SUB] = &&L_OP_SUB, [OP_MUL] = &&L_OP_MUL,
+			[OP_DIV] = &&L_OP_DIV, [OP_MOD] = &&L_OP_MOD, [OP_POW] = &&L_OP_POW,
+			[OP_UNM] = &&L_OP_UNM,
+			[OP_EQ] = &&L_OP_EQ, [OP_LESS] = &&L_OP_LESS, [OP_LEQUAL] = &&L_OP_LEQUAL,
+			[OP_NOT] = &&L_OP_NOT, [OP_AND] = &&L_OP_AND, [OP_OR] = &&L_OP_OR,
+			[OP_TEST] = &&L_OP_TEST, [OP_FOR] = &&L_OP_FOR, [OP_JMP] = &&L_OP_JMP,
+			[OP_RETURN] = &&L_OP_RETURN, [OP_SHIFT] = &&L_OP_SHIFT,
+			[OP_CALL] = &&L_OP_CALL, [OP_TCALL] = &&L_OP_TCALL,
+			[OP_LAMBDA] = &&L_OP_LAMBDA,
+			[OP_GETGLOBAL] = &&L_OP_GETGLOBAL, [OP_SETGLOBAL] = &&L_OP_SETGLOBAL, [OP_GETFIELD] = &&L_OP_GETFIELD,
+			[OP_FORPREP] = &&L_OP_FORPREP, [OP_FORLOOP] = &&L_OP_FORLOOP,
+			[OP_STORE] = &&L_OP_STORE,
+			[OP_ADD_LL] = &&L_OP_ADD_LL, [OP_ADD_LK] = &&L_OP_ADD_LK,
+			[OP_SUB_LL] = &&L_OP_SUB_LL, [OP_SUB_LK] = &&L_OP_SUB_LK, [OP_SUB_KL] = &&L_OP_SUB_KL,
+			[OP_MUL_LL] = &&L_OP_MUL_LL, [OP_MUL_LK] = &&L_OP_MUL_LK,
+			[OP_EQ_LL] = &&L_OP_EQ_LL, [OP_EQ_LK] = &&L_OP_EQ_LK,
+			[OP_LESS_LL] = &&L_OP_LESS_LL, [OP_LESS_LK] = &&L_OP_LESS_LK, [OP_LESS_KL] = &&L_OP_LESS_KL,
+			[OP_LEQUAL_LL] = &&L_OP_LEQUAL_LL, [OP_LEQUAL_LK] = &&L_OP_LEQUAL_LK, [OP_LEQUAL_KL] = &&L_OP_LEQUAL_KL,
+			[OP_EQ_LL_TEST] = &&L_OP_EQ_LL_TEST, [OP_EQ_LK_TEST] = &&L_OP_EQ_LK_TEST,
+			[OP_LESS_LL_TEST] = &&L_OP_LESS_LL_TEST, [OP_LESS_LK_TEST] = &&L_OP_LESS_LK_TEST, [OP_LESS_KL_TEST] = &&L_OP_LESS_KL_TEST,
+			[OP_LEQUAL_LL_TEST] = &&L_OP_LEQUAL_LL_TEST, [OP_LEQUAL_LK_TEST] = &&L_OP_LEQUAL_LK_TEST, [OP_LEQUAL_KL_TEST] = &&L_OP_LEQUAL_KL_TEST,
+			[OP_SHIFT_JMP] = &&L_OP_SHIFT_JMP, [OP_LOAD_LOAD] = &&L_OP_LOAD_LOAD,
+			[OP_ADD_NN] = &&L_OP_ADD_NN, [OP_SUB_NN] = &&L_OP_SUB_NN, [OP_MUL_NN] = &&L_OP_MUL_NN,
+			[OP_LESS_NN] = &&L_OP_LESS_NN, [OP_LEQUAL_NN] = &&L_OP_LEQUAL_NN
+		};
+		#define VM_CASE(op) case op: L_##op:
+		#define VM_DISPATCH() goto *dispatch_table[inst.id]
+	#else
+		#define VM_CASE(op) case op:
+		#define VM_DISPATCH() goto vm_switch
+	#endif
+
+	#define SAVE_STATE() { s->pc = pc; s->stack_top = (int)(sp - s->stack); }
+	#define LOAD_BASE() { \
+		base = s->frame_top ? &s->stack[s->frame->stack_top] : s->stack; \
+		stack_end = &s->stack[s->stack_size]; \
+	}
+	#define LOAD_SP() { sp = &s->stack[s->stack_top]; LOAD_BASE() }
+	#define LOAD_FRAME() { \
+		code = s->prot->inst; \
+		num_inst = (int)s->prot->num_inst; \
+		constants = s->prot->values; \
+		LOAD_BASE() \
+	}
+
+	#ifdef SU_OPT_VM_STATS
+		#define VM_STAT() \
+			s->stats.op_count[inst.id]++; \
+			s->stats.pair_count[s->stats.last_op][inst.id]++; \
+			s->stats.last_op = inst.id;
+	#else
+		#define VM_STAT()
+	#endif
+
+	/* Feedback is recorded by the generic forms only. A quickened instruction
+	   that misses falls back to the generic form, which records the miss. */
+	#ifdef SU_OPT_PROFILE
+		#define VM_FEEDBACK() \
+			s->prot->feedback[pc].op = inst.id; \
+			s->prot->feedback[pc].types |= (VAL_IS_NUMBER(&sp[-2]) && VAL_IS_NUMBER(&sp[-1])) ? FB_NUMBER : FB_OTHER;
+		#define VM_FEEDBACK_CALL(op) \
+			if (inst.id == (op)) \
+				feedback_call(s, &s->prot->feedback[pc], inst.id, sp - inst.a - 1);
+	#else
+		#define VM_FEEDBACK()
+		#define VM_FEEDBACK_CALL(op)
+	#endif
+
+	#define VM_NEXT() { \
+		if (++pc >= num_inst) goto vm_exit; \
+		inst = code[pc]; \
+		VM_STAT() \
+		VM_DISPATCH(); \
+	}
+
+	/* Hot prototypes are compiled on their first safepoint past the threshold
+	   and entered at any later safepoint with a compiled instruction. The
+	   compiled code returns the pc it stopped at and the interpreter resumes
+	   from there without entering it again. */
+	#ifdef SU_JIT
+		#define VM_JIT() \
+			if (!s->prot->jit && ++s->prot->jit_hotness == SU_OPT_JIT_THRESHOLD) \
+				jit_compile(s, s->prot); \
+			if (s->prot->jit && s->prot->jit->entry[pc]) { \
+				pc = jit_run(s, s->prot->jit, pc, &sp, base, constants, func->upvalues); \
+				LOAD_BASE() \
+				if (pc >= num_inst) goto vm_exit; \
+			}
+	#else
+		#define VM_JIT()
+	#endif
+
+	/* Interrupts are only polled at safepoints: function entry, backward
+	   jumps and after instructions that can call out or allocate. */
+	#define VM_SAFEPOINT() { \
+		if (++pc >= num_inst) goto vm_exit; \
+		VM_JIT() \
+		inst = code[pc]; \
+		VM_STAT() \
+		if (s->interrupt | atomic_get(&s->msi->interrupt)) goto vm_interrupt; \
+		VM_DISPATCH(); \
+	}
+
+	/* Returning is a safepoint when the caller may continue in compiled code. */
+	#ifdef SU_JIT
+		#define VM_RETURN() VM_SAFEPOINT()
+	#else
+		#define VM_RETURN() VM_NEXT()
+	#endif
+
+	/* Loaded code is verified, operands are in range and the stack never grows
+	   past max_stack, which is reserved once when a function is entered. */
+	#define VM_RESERVE(b, prot) \
+		if ((b) + (prot)->max_stack > stack_end) { \
+			SAVE_STATE(); \
+			grow_stack(s, (int)((b) - s->stack) + (prot)->max_stack); \
+			LOAD_SP(); \
+		}
+
+	#define VM_PUSH(v) *sp++ = *(v);
+
+	/* The generic forms quicken themselves on number operands. Prototypes
+	   are shared between threads, but both forms do the same thing, so a
+	   racing rewrite of the opcode byte is harmless. */
+	#define QUICKEN(quick) \
+		if (!VAL_IS_NUMBER(&sp[-2]) || !VAL_IS_NUMBER(&sp[-1])) { \
+			SAVE_STATE(); \
+			su_check_type(s, -2, SU_NUMBER); \
+			su_check_type(s, -1, SU_NUMBER); \
+		} \
+		code[pc].id = (quick);
+
+	/* A type miss de-quickens and reruns the generic form, which reports it. */
+	#define NUMBER_GUARD(generic) \
+		if (!VAL_IS_NUMBER(&sp[-2]) || !VAL_IS_NUMBER(&sp[-1])) { \
+			code[pc].id = inst.id = (generic); \
+			VM_DISPATCH(); \
+		}
 
 	#define ARITH_OP(op) \
-		su_check_type(s, -2, SU_NUMBER); \
-		su_check_type(s, -1, SU_NUMBER); \
-		STK(-2)->obj.num = STK(-2)->obj.num op STK(-1)->obj.num; \
-		su_pop(s, 1); \
-		break;
+		SET_NUM(&sp[-2], VAL_NUM(&sp[-2]) op VAL_NUM(&sp[-1])); \
+		sp--; \
+		VM_NEXT();
 
 	#define LOG_OP(op) \
-		su_check_type(s, -2, SU_NUMBER); \
-		su_check_type(s, -1, SU_NUMBER); \
-		STK(-2)->type = SU_BOOLEAN; \
-		STK(-2)->obj.b = STK(-2)->obj.num op STK(-1)->obj.num; \
-		su_pop(s, 1); \
-		break;
-
-	for (s->pc = 0; s->pc < s->prot->num_inst; s->pc++) {
-		tmp = s->interrupt | atomic_get(&s->msi->interrupt);
-		if (tmp) {
-			if ((tmp & ISCOLLECT) == ISCOLLECT) {
-				su_thread_indisposable(s);
-				su_thread_disposable(s);
+		SET_BOOL(&sp[-2], VAL_NUM(&sp[-2]) op VAL_NUM(&sp[-1])); \
+		sp--; \
+		VM_NEXT();
+
+	#define IS_TRUE(v) VAL_IS_TRUE(v)
+
+	#define OPERANDS_LL() \
+		opa = &base[inst.a]; \
+		opb = &base[inst.b];
+
+	#define OPERANDS_LK() \
+		opa = &base[inst.a]; \
+		opb = &constants[inst.b];
+
+	#define OPERANDS_KL() \
+		opa = &constants[inst.b]; \
+		opb = &base[inst.a];
+
+	#define PUSH_OPERAND_RESULT(set, expr) \
+		set(sp, (expr)); \
+		sp++; \
+		VM_NEXT();
+
+	#define NUMBER_OPERANDS() \
+		if (!VAL_IS_NUMBER(opa) || !VAL_IS_NUMBER(opb)) { \
+			SAVE_STATE(); \
+			operand_error(s, !VAL_IS_NUMBER(opa) ? opa : opb); \
+		}
+
+	#define ARITH_OPERANDS(op) \
+		NUMBER_OPERANDS() \
+		PUSH_OPERAND_RESULT(SET_NUM, VAL_NUM(opa) op VAL_NUM(opb))
+
+	#define LOG_OPERANDS(op) \
+		NUMBER_OPERANDS() \
+		PUSH_OPERAND_RESULT(SET_BOOL, VAL_NUM(opa) op VAL_NUM(opb))
+
+	/* Compare and TEST, the branch target is in the TEST word at pc + 1. */
+	#define BRANCH_OPERANDS(expr) \
+		pc = (expr) ? code[pc + 1].b - 1 : pc + 1; \
+		VM_NEXT();
+
+	#define LOG_BRANCH_OPERANDS(op) \
+		NUMBER_OPERANDS() \
+		BRANCH_OPERANDS(VAL_NUM(opa) op VAL_NUM(opb))
+
+	s->frame = FRAME();
+	s->prot = func->prot;
+	LOAD_FRAME();
+	LOAD_SP();
+	pc = -1;
+	VM_RESERVE(base, s->prot);
+	VM_SAFEPOINT();
+
+vm_interrupt:
+	SAVE_STATE();
+	tmp = s->interrupt | atomic_get(&s->msi->interrupt);
+	su_safepoint(s);
+	if ((tmp & IBREAK) == IBREAK) {
+		unmask_thread_interrupt(s, IBREAK);
+		dbg.file = s->prot->name->str;
+		dbg.line = s->prot->lineinf[pc];
+		s->debug_cb(s, &dbg, s->debug_cb_data);
+		LOAD_SP();
+	}
+
+#ifndef SU_COMPUTED_GOTO
+vm_switch:
+#endif
+	switch (inst.id) {
+		VM_CASE(OP_PUSH)
+			VM_PUSH(&constants[inst.a]);
+			VM_NEXT();
+		VM_CASE(OP_POP)
+			sp -= inst.a;
+			VM_NEXT();
+		VM_CASE(OP_ADD) VM_FEEDBACK() QUICKEN(OP_ADD_NN) ARITH_OP(+)
+		VM_CASE(OP_SUB) VM_FEEDBACK() QUICKEN(OP_SUB_NN) ARITH_OP(-)
+		VM_CASE(OP_MUL) VM_FEEDBACK() QUICKEN(OP_MUL_NN) ARITH_OP(*)
+		VM_CASE(OP_DIV)
+			VM_FEEDBACK()
+			SAVE_STATE();
+			su_check_type(s, -2, SU_NUMBER);
+			su_check_type(s, -1, SU_NUMBER);
+			su_assert(s, VAL_NUM(&sp[-1]) != 0.0, "Division by zero!");
+			SET_NUM(&sp[-2], VAL_NUM(&sp[-2]) / VAL_NUM(&sp[-1]));
+			sp--;
+			VM_NEXT();
+		VM_CASE(OP_MOD)
+			VM_FEEDBACK()
+			SAVE_STATE();
+			su_check_type(s, -2, SU_NUMBER);
+			su_check_type(s, -1, SU_NUMBER);
+			SET_NUM(&sp[-2], (double)((int)VAL_NUM(&sp[-2]) % (int)VAL_NUM(&sp[-1])));
+			sp--;
+			VM_NEXT();
+		VM_CASE(OP_POW)
+			VM_FEEDBACK()
+			SAVE_STATE();
+			su_check_type(s, -2, SU_NUMBER);
+			su_check_type(s, -1, SU_NUMBER);
+			SET_NUM(&sp[-2], pow(VAL_NUM(&sp[-2]), VAL_NUM(&sp[-1])));
+			sp--;
+			VM_NEXT();
+		VM_CASE(OP_UNM)
+			SAVE_STATE();
+			su_check_type(s, -1, SU_NUMBER);
+			SET_NUM(&sp[-1], -VAL_NUM(&sp[-1]));
+			VM_NEXT();
+		VM_CASE(OP_EQ)
+			VM_FEEDBACK()
+			SET_BOOL(&sp[-2], value_eq(&sp[-2], &sp[-1]));
+			sp--;
+			VM_NEXT();
+		VM_CASE(OP_LESS) VM_FEEDBACK() QUICKEN(OP_LESS_NN) LOG_OP(<)
+		VM_CASE(OP_LEQUAL) VM_FEEDBACK() QUICKEN(OP_LEQUAL_NN) LOG_OP(<=)
+		VM_CASE(OP_NOT)
+			if (VAL_TYPE(&sp[-1]) == SU_BOOLEAN) {
+				SET_BOOL(&sp[-1], !VAL_BOOL(&sp[-1]));
+			} else {
+				SET_BOOL(&sp[-1], (VAL_TYPE(&sp[-1]) == SU_NIL) ? 1 : 0);
 			}
-			if ((tmp & IGC) == IGC) {
-				unmask_thread_interrupt(s, IGC);
-				gc_trace(s);
+			VM_NEXT();
+		VM_CASE(OP_AND)
+			if (IS_TRUE(&sp[-2]) && IS_TRUE(&sp[-1])) {
+				sp[-2] = sp[-1];
+			} else {
+				SET_BOOL(&sp[-2], 0);
 			}
-			if ((tmp & IBREAK) == IBREAK) {
-				unmask_thread_interrupt(s, IBREAK);
-				dbg.file = s->prot->name->str;
-				dbg.line = s->prot->lineinf[s->pc];
-				s->debug_cb(s, &dbg, s->debug_cb_data);
+			sp--;
+			VM_NEXT();
+		VM_CASE(OP_OR)
+			if (IS_TRUE(&sp[-2])) {
+				/* return -2 */
+			} else if (IS_TRUE(&sp[-1])) {
+				sp[-2] = sp[-1];
+			} else {
+				SET_BOOL(&sp[-2], 0);
 			}
-		}
-		inst = s->prot->inst[s->pc];
-		switch (inst.id) {
-			case OP_PUSH:
-				push_value(s, &func->constants[inst.a]);
-				break;
-			case OP_POP:
-				su_pop(s, inst.a);
-				break;
-			case OP_ADD: ARITH_OP(+)
-			case OP_SUB: ARITH_OP(-)
-			case OP_MUL: ARITH_OP(*)
-			case OP_DIV:
-				su_check_type(s, -2, SU_NUMBER);
-				su_check_type(s, -1, SU_NUMBER);
-				su_assert(s, STK(-1)->obj.num != 0.0, "Division by zero!");
-				STK(-2)->obj.num = STK(-2)->obj.num / STK(-1)->obj.num;
-				su_pop(s, 1);
-				break;
-			case OP_MOD:
-				su_check_type(s, -2, SU_NUMBER);
-				su_check_type(s, -1, SU_NUMBER);
-				STK(-2)->obj.num = (double)((int)STK(-2)->obj.num % (int)STK(-1)->obj.num);
-				su_pop(s, 1);
-				break;
-			case OP_POW:
-				su_check_type(s, -2, SU_NUMBER);
-				su_check_type(s, -1, SU_NUMBER);
-				STK(-2)->obj.num = pow(STK(-2)->obj.num, STK(-1)->obj.num);
-				su_pop(s, 1);
-				break;
-			case OP_UNM:
-				su_check_type(s, -1, SU_NUMBER);
-				STK(-1)->obj.num = -STK(-1)->obj.num;
-				break;
-			case OP_EQ:
-				STK(-2)->obj.b = value_eq(STK(-2), STK(-1));
-				STK(-2)->type = SU_BOOLEAN;
-				su_pop(s, 1);
-				break;
-			case OP_LESS: LOG_OP(<);
-			case OP_LEQUAL: LOG_OP(<=);
-			case OP_NOT:
-				if (STK(-1)->type == SU_BOOLEAN) {
-					STK(-1)->obj.b = !STK(-1)->obj.b;
-				} else {
-					STK(-1)->obj.b = (STK(-1)->type == SU_NIL) ? 1 : 0;
-					STK(-1)->type = SU_BOOLEAN;
-				}
-				break;
-			case OP_AND:
-				tmp = STK(-2)->type != SU_NIL && (STK(-2)->type != SU_BOOLEAN || STK(-2)->obj.b);
-				if (tmp && STK(-1)->type != SU_NIL && (STK(-1)->type != SU_BOOLEAN || STK(-1)->obj.b)) {
-					s->stack[s->stack_top - 2] = *STK(-1);
-				} else {
-					STK(-2)->obj.b = 0;
-					STK(-2)->type = SU_BOOLEAN;
-				}
-				su_pop(s, 1);
-				break;
-			case OP_OR:
-				if (STK(-2)->type != SU_NIL && (STK(-2)->type != SU_BOOLEAN || STK(-2)->obj.b)) {
-					/* return -2 */
-				} else if (STK(-1)->type != SU_NIL && (STK(-1)->type != SU_BOOLEAN || STK(-1)->obj.b)) {
-					s->stack[s->stack_top - 2] = *STK(-1);
-				} else {
-					STK(-2)->obj.b = 0;
-					STK(-2)->type = SU_BOOLEAN;
-				}
-				su_pop(s, 1);
-				break;
-			case OP_TEST:
-				if (STK(-1)->type != SU_NIL && (STK(-1)->type != SU_BOOLEAN || STK(-1)->obj.b))
-					s->pc = inst.b - 1;
-				su_pop(s, 1);
-				break;
-			case OP_FOR:
-				if (STK(-2)->type == SU_NIL) {
-					su_swap(s, -2, -1);
-					s->stack_top--;
-					s->pc = inst.b - 1;
-				} else {
-					s->stack_top--;
-					su_check_type(s, -1, SU_SEQ);
-					su_rest(s, -1);
-					su_swap(s, -2, -1);
-					su_first(s, -1);
-					su_swap(s, -2, -1);
-					s->stack_top--;
+			sp--;
+			VM_NEXT();
+		VM_CASE(OP_TEST)
+			if (IS_TRUE(&sp[-1]))
+				pc = inst.b - 1;
+			sp--;
+			VM_NEXT();
+		VM_CASE(OP_FOR)
+			if (VAL_TYPE(&sp[-2]) == SU_NIL) {
+				sp[-2] = sp[-1];
+				sp--;
+				pc = inst.b - 1;
+				VM_NEXT();
+			}
+			sp--;
+			SAVE_STATE();
+			su_check_type(s, -1, SU_SEQ);
+			su_rest(s, -1);
+			su_swap(s, -2, -1);
+			su_first(s, -1);
+			su_swap(s, -2, -1);
+			s->stack_top--;
+			LOAD_SP();
+			VM_SAFEPOINT();
+		VM_CASE(OP_JMP)
+			if (inst.b > pc) {
+				pc = inst.b - 1;
+				VM_NEXT();
+			}
+			pc = inst.b - 1;
+			VM_SAFEPOINT();
+		VM_CASE(OP_RETURN)
+			pc = s->frame->ret_addr - 1;
+			func = s->frame->func;
+			s->prot = func->prot;
+
+			/* A function body has one value, the rest are nil. Only a tail
+			   call can return more. */
+			*base = sp[-1];
+			sp = base + 1;
+			for (tmp = s->frame->nret; tmp > 1; tmp--)
+				SET_NIL(sp++);
+			s->frame_top--;
+			s->frame = FRAME();
+			LOAD_FRAME();
+			VM_RETURN();
+		VM_CASE(OP_TCALL)
+			VM_FEEDBACK_CALL(OP_TCALL)
+			nret = s->frame->nret;
+			pc = s->frame->ret_addr - 1;
+			func = s->frame->func;
+			s->prot = func->prot;
+
+			memmove(base, sp - (inst.a + 1), sizeof(value_t) * (inst.a + 1));
+			sp = base + inst.a + 1;
+			s->frame_top--;
+			s->frame = FRAME();
+			LOAD_FRAME();
+
+			/* Do a normal call. */
+		VM_CASE(OP_CALL)
+			VM_FEEDBACK_CALL(OP_CALL)
+			/* The results wanted by a call, a tail call passes on its own. */
+			if (inst.id == OP_CALL)
+				nret = inst.b ? inst.b : 1;
+			tmp = (int)(sp - s->stack) - inst.a - 1;
+			if (VAL_TYPE(&s->stack[tmp]) == SU_FUNCTION) {
+				VM_RESERVE(&s->stack[tmp], VAL_FUNC(&s->stack[tmp])->prot);
+				if (s->frame_top == s->frame_size) {
+					SAVE_STATE();
+					grow_frames(s);
 				}
-				break;
-			case OP_JMP:
-				s->pc = inst.b - 1;
-				break;
-			case OP_RETURN:
-				s->pc = s->frame->ret_addr - 1;
-				s->prot = s->frame->func->prot;
-				func = s->frame->func;
-
-				s->stack[s->frame->stack_top] = *STK(-1);
-				s->stack_top = s->frame->stack_top + 1;
-				s->frame_top--;
-				s->frame = FRAME();
-				break;
-			case OP_TCALL:
-				s->pc = s->frame->ret_addr - 1;
-				s->prot = s->frame->func->prot;
-				func = s->frame->func;
-
-				memmove(&s->stack[s->frame->stack_top], &s->stack[s->stack_top - (inst.a + 1)], sizeof(value_t) * (inst.a + 1));
-				s->stack_top = s->frame->stack_top + inst.a + 1;
-				s->frame_top--;
-				s->frame = FRAME();
-
-				/* Do a normal call. */
-			case OP_CALL:
-				tmp = s->stack_top - inst.a - 1;
-				switch (s->stack[tmp].type) {
-					case SU_FUNCTION:
-						s->frame = &s->frames[s->frame_top++];
-						assert(s->frame_top <= MAX_CALLS);
-						s->frame->ret_addr = s->pc + 1;
-						s->frame->func = func;
-						s->frame->stack_top = tmp;
-
-						func = s->stack[tmp].obj.func;
-						if (func->narg < 0)
-							su_vector(s, inst.a);
-						else if (func->narg != inst.a)
-							su_error(s, "Bad number of arguments to function! Expected %i, but got %i.", (int)func->narg, (int)inst.a);
-
-						s->prot = func->prot;
-						s->pc = -1;
-						break;
-					case SU_NATIVEFUNC:
-						narg = s->narg;
-						s->narg = inst.a;
-						if (s->stack[tmp].obj.nfunc(s, inst.a)) {
-							s->stack[tmp] = *STK(-1);
-						} else {
-							s->stack[tmp].type = SU_NIL;
-						}
-						s->stack_top = tmp + 1;
-						s->narg = narg;
-						break;
-					case SU_VECTOR:
-						if (inst.a == 1) {
-							su_check_type(s, -1, SU_NUMBER);
-							tmpv = vector_index(s, s->stack[tmp].obj.vec, su_tointeger(s, -1));
-							su_pop(s, 2);
-							push_value(s, &tmpv);
-						} else {
-							for (i = -inst.a, j = 0; i; i++, j++) {
-								su_check_type(s, i - j, SU_NUMBER);
-								tmpv = vector_index(s, s->stack[tmp].obj.vec, su_tointeger(s, i - j));
-								push_value(s, &tmpv);
-							}
-							su_vector(s, inst.a);
-							s->stack[tmp] = s->stack[s->stack_top - 1];
-							s->stack_top -= inst.a + 1;
-						}
-						break;
-					case SU_MAP:
-						if (inst.a == 1) {
-							tmpv2 = *STK(-1);
-							tmpv = map_get(s, s->stack[tmp].obj.m, &tmpv2, hash_value(&tmpv2));
-							su_assert(s, tmpv.type != SU_INV, "No value with key: %s", stringify(s, &tmpv2));
-							su_pop(s, 2);
-							push_value(s, &tmpv);
-						} else {
-							for (i = -inst.a, j = 0; i; i++, j += 2) {
-								tmpv2 = *STK(i - j);
-								push_value(s, &tmpv2);
-								tmpv = map_get(s, s->stack[tmp].obj.m, &tmpv2, hash_value(&tmpv2));
-								su_assert(s, tmpv.type != SU_INV, "No value with key: %s", stringify(s, &tmpv2));
-								push_value(s, &tmpv);
-							}
-							su_map(s, inst.a);
-							s->stack[tmp] = s->stack[s->stack_top - 1];
-							s->stack_top -= inst.a + 1;
-						}
-						break;
-					case SU_STRING:
-						if (inst.a == 1) {
-							su_check_type(s, -1, SU_NUMBER);
-							j = su_tointeger(s, -1);
-							su_assert(s, j < s->stack[tmp].obj.str->size, "Out of range!");
-							s->scratch_pad[0] = s->stack[tmp].obj.str->str[j];
-							su_pop(s, 2);
-							su_pushbytes(s, s->scratch_pad, 1);
-						} else {
-							k = 0;
-							for (i = -inst.a; i; i++) {
-								su_check_type(s, i, SU_NUMBER);
-								j = su_tointeger(s, i);
-								su_assert(s, j < s->stack[tmp].obj.str->size, "Out of range!");
-								s->scratch_pad[k++] = s->stack[tmp].obj.str->str[j];
-								assert(k < SU_SCRATCHPAD_SIZE);
-							}
-							su_pushbytes(s, s->scratch_pad, k);
-							s->stack[tmp] = s->stack[s->stack_top - 1];
-							s->stack_top -= inst.a + 1;
-						}
-						break;
-					case SU_NATIVEDATA:
-						tmpv = s->stack[tmp];
-						if (tmpv.obj.data->vt && tmpv.obj.data->vt->call) {
-							narg = s->narg;
-							s->narg = inst.a;
-							if (tmpv.obj.data->vt->call(s, (void*)tmpv.obj.data->data, inst.a))
-								s->stack[tmp] = *STK(-1);
-							else
-								s->stack[tmp].type = SU_NIL;
-							s->stack_top = tmp + 1;
-							s->narg = narg;
-							break;
-						}
-					default:
-						if (inst.a == 1 && isseq(s, &s->stack[tmp])) {
-							su_check_type(s, -1, SU_STRING);
-							tmpcs = su_tostring(s, -1, NULL);
-							if (!strcmp(tmpcs, "first")) {
-								s->stack[(--s->stack_top) - 1] = seq_first(s, STK(-1)->obj.q);
-								break;
-							} else if (!strcmp(tmpcs, "rest")) {
-								s->stack[(--s->stack_top) - 1] = seq_rest(s, STK(-1)->obj.q);
-								break;
-							}
-						}
-						su_error(s, "Can't apply '%s'.", type_name(s->stack[tmp].type));
+				s->frame = &s->frames[s->frame_top++];
+				s->frame->ret_addr = pc + 1;
+				s->frame->func = func;
+				s->frame->stack_top = tmp;
+				s->frame->nret = nret;
+
+				func = VAL_FUNC(&s->stack[tmp]);
+				if (func->narg < 0) {
+					SAVE_STATE();
+					su_vector(s, inst.a);
+					LOAD_SP();
+				} else if (func->narg != inst.a) {
+					SAVE_STATE();
+					su_error(s, "Bad number of arguments to function! Expected %i, but got %i.", (int)func->narg, (int)inst.a);
 				}
-				break;
-			case OP_LAMBDA:
-				assert(inst.a < s->prot->num_prot);
-				lambda(s, &s->prot->prot[inst.a], inst.b);
-				break;
-			case OP_GETGLOBAL:
-				tmpv = func->constants[inst.a];
-				su_assert(s, tmpv.type == SU_STRING, "Global key must be a string!");
-				tmpv = map_get(s, unref_local(s, s->stack[SU_GLOBAL_INDEX].obj.loc).obj.m, &tmpv, hash_value(&tmpv));
-				if (tmpv.type == SU_INV)
-					global_error(s, "Undefined global variable", &func->constants[inst.a]);
-				push_value(s, &tmpv);
-				break;
-			case OP_SETGLOBAL:
-				tmpv = func->constants[inst.a];
-				su_assert(s, tmpv.type == SU_STRING, "Global key must be a string!");
-				i = hash_value(&tmpv);
-				tmpv2 = unref_local(s, s->stack[SU_GLOBAL_INDEX].obj.loc);
-				tmpv = map_insert(s, tmpv2.obj.m, &tmpv, i, STK(-1));
-				set_local(s, s->stack[SU_GLOBAL_INDEX].obj.loc, &tmpv);
-				break;
-			case OP_SHIFT:
-				s->stack[s->stack_top - (inst.a + 1)] = *STK(-1);
-				s->stack_top -= inst.a;
-				break;
-			case OP_LOAD:
-				assert(FRAME()->stack_top + inst.a < s->stack_top);
-				push_value(s, &s->stack[FRAME()->stack_top + inst.a]);
-				break;
-			case OP_LUP:
-				assert(inst.a < func->num_ups);
-				push_value(s, &func->upvalues[inst.a]);
-				break;
-			case OP_LCL:
-				assert(inst.b < s->msi->num_c_lambdas);
-				push_value(s, &s->msi->c_lambdas[inst.b]);
-				break;
-			default:
-				assert(0);
-		}
 
-		#undef ARITH_OP
-		#undef LOG_OP
+				s->prot = func->prot;
+				LOAD_FRAME();
+				pc = -1;
+				VM_SAFEPOINT();
+			}
+
+			SAVE_STATE();
+			apply(s, tmp, inst.a, nret);
+			LOAD_SP();
+			VM_SAFEPOINT();
+		VM_CASE(OP_LAMBDA)
+			SAVE_STATE();
+			lambda(s, &s->prot->prot[inst.a], inst.b);
+			LOAD_SP();
+			VM_SAFEPOINT();
+		VM_CASE(OP_GETGLOBAL)
+			m = global_map(s);
+			ic = inline_cache(s, &code[pc]);
+			if (ic->inst == &code[pc] && ic->key == m && ic->gc_cycle == s->msi->gc_cycle) {
+				VM_PUSH(&ic->value);
+				VM_NEXT();
+			}
+			SAVE_STATE();
+			tmpv = map_get(s, m, &constants[inst.a], hash_value(&constants[inst.a]));
+			if (VAL_TYPE(&tmpv) == SU_INV)
+				global_error(s, "Undefined global variable", &constants[inst.a]);
+			set_inline_cache(s, ic, &code[pc], m, &tmpv);
+			VM_PUSH(&tmpv);
+			VM_NEXT();
+		VM_CASE(OP_GETFIELD)
+			if (VAL_TYPE(&sp[-1]) != SU_MAP) {
+				/* Anything but a map takes the generic path, as 'PUSH k; CALL 1'. */
+				VM_PUSH(&constants[inst.a]);
+				inst.id = OP_CALL;
+				inst.a = 1;
+				inst.b = 1;
+				VM_DISPATCH();
+			}
+			m = VAL_MAP(&sp[-1]);
+			ic = inline_cache(s, &code[pc]);
+			if (ic->inst == &code[pc] && ic->key == m->root && ic->gc_cycle == s->msi->gc_cycle) {
+				sp[-1] = ic->value;
+				VM_NEXT();
+			}
+			SAVE_STATE();
+			tmpv = map_get(s, m, &constants[inst.a], hash_value(&constants[inst.a]));
+			su_assert(s, VAL_TYPE(&tmpv) != SU_INV, "No value with key: %s", stringify(s, &constants[inst.a]));
+			set_inline_cache(s, ic, &code[pc], m->root, &tmpv);
+			sp[-1] = tmpv;
+			VM_NEXT();
+		VM_CASE(OP_FORPREP)
+			/* [from, to] becomes [end, counter], with the bounds of range_create. */
+			if (!VAL_IS_NUMBER(&sp[-2]) || !VAL_IS_NUMBER(&sp[-1])) {
+				/* Report the error as range would. */
+				SAVE_STATE();
+				s->narg = 2;
+				su_check_arguments(s, 2, SU_NUMBER, SU_NUMBER);
+			}
+			i = (int)VAL_NUM(&sp[-2]);
+			j = (int)VAL_NUM(&sp[-1]);
+			j += (j - i > 0) ? 1 : -1;
+			SET_NUM(&sp[-2], (double)j);
+			SET_NUM(&sp[-1], (double)i);
+			VM_NEXT();
+		VM_CASE(OP_FORLOOP)
+			/* [end, counter, result], the counter always steps towards the end. */
+			opa = &sp[-3];
+			opb = &sp[-2];
+			SET_NUM(opb, VAL_NUM(opb) + ((VAL_NUM(opa) > VAL_NUM(opb)) ? 1.0 : -1.0));
+			if (VAL_NUM(opb) == VAL_NUM(opa)) {
+				sp[-3] = sp[-1];
+				sp -= 2;
+				VM_NEXT();
+			}
+			sp--;
+			pc = inst.b - 1;
+			VM_SAFEPOINT();
+		VM_CASE(OP_STORE)
+			for (i = 0; i < inst.a; i++)
+				base[inst.b + i] = sp[i - inst.a];
+			sp = &base[inst.b + inst.a];
+			VM_NEXT();
+		VM_CASE(OP_SETGLOBAL)
+			SAVE_STATE();
+			tmpv = constants[inst.a];
+			i = hash_value(&tmpv);
+			tmpv2 = unref_local(s, VAL_LOC(&s->stack[SU_GLOBAL_INDEX]));
+			tmpv = map_insert(s, VAL_MAP(&tmpv2), &tmpv, i, &sp[-1]);
+			set_local(s, VAL_LOC(&s->stack[SU_GLOBAL_INDEX]), &tmpv);
+			VM_SAFEPOINT();
+		VM_CASE(OP_SHIFT)
+			sp[-(inst.a + 1)] = sp[-1];
+			sp -= inst.a;
+			VM_NEXT();
+		VM_CASE(OP_LOAD)
+			VM_PUSH(&base[inst.a]);
+			VM_NEXT();
+		VM_CASE(OP_LUP)
+			VM_PUSH(&func->upvalues[inst.a]);
+			VM_NEXT();
+		VM_CASE(OP_LCL)
+			VM_PUSH(&s->msi->c_lambdas[inst.b]);
+			VM_NEXT();
+		VM_CASE(OP_ADD_LL) OPERANDS_LL() ARITH_OPERANDS(+)
+		VM_CASE(OP_ADD_LK) OPERANDS_LK() ARITH_OPERANDS(+)
+		VM_CASE(OP_SUB_LL) OPERANDS_LL() ARITH_OPERANDS(-)
+		VM_CASE(OP_SUB_LK) OPERANDS_LK() ARITH_OPERANDS(-)
+		VM_CASE(OP_SUB_KL) OPERANDS_KL() ARITH_OPERANDS(-)
+		VM_CASE(OP_MUL_LL) OPERANDS_LL() ARITH_OPERANDS(*)
+		VM_CASE(OP_MUL_LK) OPERANDS_LK() ARITH_OPERANDS(*)
+		VM_CASE(OP_EQ_LL) OPERANDS_LL() PUSH_OPERAND_RESULT(SET_BOOL, value_eq(opa, opb))
+		VM_CASE(OP_EQ_LK) OPERANDS_LK() PUSH_OPERAND_RESULT(SET_BOOL, value_eq(opa, opb))
+		VM_CASE(OP_LESS_LL) OPERANDS_LL() LOG_OPERANDS(<)
+		VM_CASE(OP_LESS_LK) OPERANDS_LK() LOG_OPERANDS(<)
+		VM_CASE(OP_LESS_KL) OPERANDS_KL() LOG_OPERANDS(<)
+		VM_CASE(OP_LEQUAL_LL) OPERANDS_LL() LOG_OPERANDS(<=)
+		VM_CASE(OP_LEQUAL_LK) OPERANDS_LK() LOG_OPERANDS(<=)
+		VM_CASE(OP_LEQUAL_KL) OPERANDS_KL() LOG_OPERANDS(<=)
+		VM_CASE(OP_EQ_LL_TEST) OPERANDS_LL() BRANCH_OPERANDS(value_eq(opa, opb))
+		VM_CASE(OP_EQ_LK_TEST) OPERANDS_LK() BRANCH_OPERANDS(value_eq(opa, opb))
+		VM_CASE(OP_LESS_LL_TEST) OPERANDS_LL() LOG_BRANCH_OPERANDS(<)
+		VM_CASE(OP_LESS_LK_TEST) OPERANDS_LK() LOG_BRANCH_OPERANDS(<)
+		VM_CASE(OP_LESS_KL_TEST) OPERANDS_KL() LOG_BRANCH_OPERANDS(<)
+		VM_CASE(OP_LEQUAL_LL_TEST) OPERANDS_LL() LOG_BRANCH_OPERANDS(<=)
+		VM_CASE(OP_LEQUAL_LK_TEST) OPERANDS_LK() LOG_BRANCH_OPERANDS(<=)
+		VM_CASE(OP_LEQUAL_KL_TEST) OPERANDS_KL() LOG_BRANCH_OPERANDS(<=)
+		VM_CASE(OP_SHIFT_JMP)
+			sp[-(inst.a + 1)] = sp[-1];
+			sp -= inst.a;
+			tmp = code[pc + 1].b;
+			if (tmp > pc + 1) {
+				pc = tmp - 1;
+				VM_NEXT();
+			}
+			pc = tmp - 1;
+			VM_SAFEPOINT();
+		VM_CASE(OP_LOAD_LOAD)
+			sp[0] = base[inst.a];
+			sp[1] = base[code[pc + 1].a];
+			sp += 2;
+			pc++;
+			VM_NEXT();
+		VM_CASE(OP_ADD_NN) NUMBER_GUARD(OP_ADD) ARITH_OP(+)
+		VM_CASE(OP_SUB_NN) NUMBER_GUARD(OP_SUB) ARITH_OP(-)
+		VM_CASE(OP_MUL_NN) NUMBER_GUARD(OP_MUL) ARITH_OP(*)
+		VM_CASE(OP_LESS_NN) NUMBER_GUARD(OP_LESS) LOG_OP(<)
+		VM_CASE(OP_LEQUAL_NN) NUMBER_GUARD(OP_LEQUAL) LOG_OP(<=)
+		default:
+		#ifdef SU_COMPUTED_GOTO
+			vm_invalid:
+		#endif
+			assert(0);
+			VM_NEXT();
 	}
+
+vm_exit:
+	SAVE_STATE();
+
+	#undef VM_CASE
+	#undef VM_DISPATCH
+	#undef SAVE_STATE
+	#undef LOAD_BASE
+	#undef LOAD_SP
+	#undef LOAD_FRAME
+	#undef VM_NEXT
+	#undef VM_SAFEPOINT
+	#undef VM_JIT
+	#undef VM_RETURN
+	#undef VM_RESERVE
+	#undef VM_PUSH
+	#undef QUICKEN
+	#undef NUMBER_GUARD
+	#undef ARITH_OP
+	#undef LOG_OP
+	#undef IS_TRUE
+	#undef VM_STAT
+	#undef VM_FEEDBACK
+	#undef VM_FEEDBACK_CALL
+	#undef OPERANDS_LL
+	#undef OPERANDS_LK
+	#undef OPERANDS_KL
+	#undef PUSH_OPERAND_RESULT
+	#undef NUMBER_OPERANDS
+	#undef ARITH_OPERANDS
+	#undef LOG_OPERANDS
+	#undef BRANCH_OPERANDS
+	#undef LOG_BRANCH_OPERANDS
 }
 
 int su_num_threads(su_state *s) {
@@ -1546,8 +2288,10 @@ int su_num_cores(su_state *s) {
 
 void su_thread_disposable(su_state *s) {
 	if (atomic_get(&s->thread_indisposable)) {
-		while ((atomic_get(&s->msi->interrupt) & ISCOLLECT) == ISCOLLECT)
-			thread_sleep(0);
+		while ((atomic_get(&s->msi->interrupt) & ISCOLLECT) == ISCOLLECT) {
+			if (!gc_mark_help(s))
+				thread_sleep(0);
+		}
 		atomic_set(&s->thread_indisposable, 0);
 	}
 }
@@ -1568,13 +2312,86 @@ static void *thread_boot(su_state *s) {
 	return NULL;
 }
 
+#ifdef SU_OPT_VM_STATS
+static void add_vm_stats(vm_stats_t *dest, vm_stats_t *src) {
+	int i, j;
+	for (i = 0; i < VM_STATS_OPS; i++) {
+		dest->op_count[i] += src->op_count[i];
+		for (j = 0; j < VM_STATS_OPS; j++)
+			dest->pair_count[i][j] += src->pair_count[i][j];
+	}
+}
+#endif
+
 static su_state *new_state(su_state *s) {
-	int i;
+	int i, stack_size, frame_size, gc_list_count;
+	unsigned gray_size, gray_cap;
+	value_t *stack;
+	frame_t *frames;
+	gc_t **gray, *gc_list, *gc_list_tail;
+	gc_t *slab_cache[SLAB_CLASSES];
+	slab_page_t *slab_fresh[SLAB_CLASSES];
 	su_state *ns;
 	for (i = 1; i < SU_OPT_MAX_THREADS; i++) {
 		ns = &s->msi->threads[i];
 		if (atomic_cas(&ns->thread_finished, 1, 0)) {
+			#ifdef SU_OPT_VM_STATS
+				add_vm_stats(&s->stats, &ns->stats);
+			#endif
+			/* A slot keeps its stacks between threads. They start out as a
+			   copy of the parent's, and nothing scans an empty stack while
+			   it is replaced. */
+			stack = ns->stack;
+			stack_size = ns->stack_size;
+			frames = ns->frames;
+			frame_size = ns->frame_size;
+			
+			/* So do its gray stack and object list, which may still hold
+			   entries from the last thread for the next collection, and its
+			   slab caches. */
+			gray = ns->gray;
+			gray_size = ns->gray_size;
+			gray_cap = ns->gray_cap;
+			gc_list = ns->gc_list;
+			gc_list_tail = ns->gc_list_tail;
+			gc_list_count = ns->gc_list_count;
+			memcpy(slab_cache, ns->slab_cache, sizeof(slab_cache));
+			memcpy(slab_fresh, ns->slab_fresh, sizeof(slab_fresh));
+			
 			memcpy(ns, s, sizeof(su_state));
+			ns->stack_top = ns->frame_top = ns->native_top = 0;
+			
+			if (stack_size < s->stack_top) {
+				stack = (value_t*)su_allocate(s, stack, sizeof(value_t) * s->stack_size);
+				stack_size = s->stack_size;
+			}
+			if (!frames || frame_size < s->frame_top) {
+				frames = (frame_t*)su_allocate(s, frames, sizeof(frame_t) * s->frame_size);
+				frame_size = s->frame_size;
+			}
+			memcpy(stack, s->stack, sizeof(value_t) * s->stack_top);
+			memcpy(frames, s->frames, sizeof(frame_t) * s->frame_top);
+			
+			ns->stack = stack;
+			ns->stack_size = stack_size;
+			ns->frames = frames;
+			ns->frame_size = frame_size;
+			ns->frame = &frames[s->frame_top - 1];
+			ns->frame_top = s->frame_top;
+			ns->stack_top = s->stack_top;
+			
+			ns->gray = gray;
+			ns->gray_size = gray_size;
+			ns->gray_cap = gray_cap;
+			ns->gc_list = gc_list;
+			ns->gc_list_tail = gc_list_tail;
+			ns->gc_list_count = gc_list_count;
+			memcpy(ns->slab_cache, slab_cache, sizeof(slab_cache));
+			memcpy(ns->slab_fresh, slab_fresh, sizeof(slab_fresh));
+			ns->thread_finished.value = 0;
+			#ifdef SU_OPT_VM_STATS
+				memset(&ns->stats, 0, sizeof(vm_stats_t));
+			#endif
 			atomic_add(&s->msi->thread_count, 1);
 			ns->tid = atomic_add(&s->msi->tid_count, 1);
 			assert(ns->tid > 0);
@@ -1589,7 +2406,6 @@ void su_fork(su_state *s, int narg) {
 	su_state *ns;
  
 	narg++;
-	v.type = SU_BOOLEAN;
 	su_thread_indisposable(s);
 	spin_lock(&s->msi->thread_pool_lock);
 	su_thread_disposable(s);
@@ -1597,7 +2413,7 @@ void su_fork(su_state *s, int narg) {
 	
 	if (!ns) {
 		s->stack_top -= narg;
-		v.obj.b = 0;
+		SET_BOOL(&v, 0);
 		push_value(s, &v);
 		spin_unlock(&s->msi->thread_pool_lock);
 		return;
@@ -1610,57 +2426,70 @@ void su_fork(su_state *s, int narg) {
 	ns->string_builder = NULL;
 	ns->errtop = ns->ferrtop = -1;
 	
-	ns->stack[SU_GLOBAL_INDEX] = s->stack[SU_GLOBAL_INDEX];
+	/* Locals are owned by a single thread, so the new thread gets its own
+	   globals local, starting from the parent's current globals map. */
+	v = unref_local(s, VAL_LOC(&s->stack[SU_GLOBAL_INDEX]));
+	ns->stack[SU_GLOBAL_INDEX] = ref_local(ns, &v);
 	
 	su_assert(s, !thread_init(&thread_boot, (void*)ns), "Could not create thread!");
 	s->stack_top -= narg;
 	
-	v.obj.b = 1;
+	SET_BOOL(&v, 1);
 	push_value(s, &v);
 	
 	spin_unlock(&s->msi->thread_pool_lock);
 }
 
 void su_call(su_state *s, int narg, int nret) {
-	int pc, tmp, fret;
+	int pc, tmp, n;
 	prototype_t *prot;
+	frame_t *frame;
+	function_t *func;
 	int top = s->stack_top - narg - 1;
-	value_t *f = &s->stack[top];
-	frame_t *frame = &s->frames[s->frame_top++];
-	assert(s->frame_top <= MAX_CALLS);
+	value_t *f;
 
-	frame->ret_addr = 0xffff;
-	frame->func = f->obj.func;
-	frame->stack_top = top;
+	/* The callee only reserves stack for itself, make room for the results. */
+	if (top + nret > s->stack_size)
+		grow_stack(s, top + nret);
+	f = &s->stack[top];
 
 	pc = s->pc;
 	prot = s->prot;
 	tmp = s->narg;
 	s->narg = narg;
 
-	if (f->type == SU_FUNCTION) {
-		if (f->obj.func->narg < 0) {
+	/* Only bytecode functions get a frame, native calls are invisible to the
+	   stack trace and the collector just like when the VM makes them. They
+	   still count against the call limit, and against a tighter one since
+	   natives calling back in here recurse on the C stack. */
+	if (VAL_TYPE(f) == SU_FUNCTION) {
+		func = VAL_FUNC(f);
+		if (s->frame_top == s->frame_size)
+			grow_frames(s);
+		frame = &s->frames[s->frame_top++];
+		frame->ret_addr = 0xffff;
+		frame->func = func;
+		frame->stack_top = top;
+		frame->nret = nret ? nret : 1;
+
+		if (func->narg < 0) {
 			su_vector(s, narg);
 			s->narg = narg = 1;
 		} else {
-			su_assert(s, f->obj.func->narg == narg, "Bad number of argument to function!");
+			su_assert(s, func->narg == narg, "Bad number of argument to function!");
 		}
-		vm_loop(s, f->obj.func);
+		vm_loop(s, func);
 		if (nret == 0)
 			su_pop(s, 1);
-	} else if (f->type == SU_NATIVEFUNC) {
-		fret = f->obj.nfunc(s, narg);
-		if (nret > 0 && fret > 0) {
-			s->stack[top] = *STK(-1);
-			su_pop(s, narg);
-		} else {
-			s->stack_top = top;
-			if (nret > 0)
-				su_pushnil(s);
-		}
-		s->frame_top--;
+	} else if (VAL_TYPE(f) == SU_NATIVEFUNC) {
+		check_native(s, VAL_NFUNC(f), narg);
+		su_assert(s, s->native_top < SU_OPT_NATIVE_LIMIT && s->frame_top + s->native_top < s->frame_limit, "Stack overflow!");
+		s->native_top++;
+		n = VAL_NFUNC(f)(s, narg);
+		s->native_top--;
+		set_results(s, top, n, nret);
 	} else {
-		assert(0);
+		apply(s, top, narg, nret);
 	}
 
 	s->narg = tmp;
@@ -1675,6 +2504,13 @@ void su_set_stdout(su_state *s, FILE *fp) { s->fstdout = fp; }
 void su_set_stdin(su_state *s, FILE *fp) { s->fstdin = fp; }
 void su_set_stderr(su_state *s, FILE *fp) { s->fstderr = fp; }
 
+/* Limits are per state and inherited by forked threads. Stacks grow on
+   demand up to them but never shrink. */
+void su_set_stack_limit(su_state *s, int values, int calls) {
+	s->stack_limit = values > s->stack_size ? values : s->stack_size;
+	s->frame_limit = calls > s->frame_size ? calls : s->frame_size;
+}
+
 static void *default_alloc(void *ptr, size_t size) {
 	if (size) return realloc(ptr, size);
 	free(ptr);
@@ -1689,14 +2525,21 @@ su_state *su_init(su_alloc alloc) {
 	main_state_internal_t *msi;
 	
 	assert(sizeof(value_t) <= SU_VALUE_SIZE);
-	assert(sizeof(value_t) > SU_VALUE_DATA_SIZE);
+	assert(sizeof(value_t) >= SU_VALUE_DATA_SIZE);
+	#ifdef SU_OPT_VM_STATS
+		assert(NUM_OPS <= VM_STATS_OPS);
+	#endif
 	
 	mf = alloc ? alloc : default_alloc;
 	msi = (main_state_internal_t*)mf(NULL, sizeof(main_state_internal_t));
 	s = &msi->threads[0];
 	memset(msi, 0, sizeof(main_state_internal_t));
+	#ifdef SU_OPT_NAN_BOXING
+		assert(((uintptr_t)msi & ~(uintptr_t)NAN_BOX_PAYLOAD) == 0);
+	#endif
 	
-	for (i = 0; i < SU_OPT_MAX_THREADS; i++)
+	/* Every slot but the main thread's is free. */
+	for (i = 1; i < SU_OPT_MAX_THREADS; i++)
 		msi->threads[i].thread_finished.value = 1;
 	
 	s->alloc = mf;
@@ -1704,12 +2547,21 @@ su_state *su_init(su_alloc alloc) {
 	s->main_state = s;
 
 	msi->gc_state = GC_STATE_SWEEP;
+	msi->gc_mark_cores = num_cores();
 
 	s->fstdin = stdin;
 	s->fstdout = stdout;
 	s->fstderr = stderr;
 	s->errtop = s->ferrtop = -1;
 
+	s->stack_limit = SU_OPT_STACK_LIMIT;
+	s->frame_limit = SU_OPT_CALL_LIMIT;
+	s->stack_size = STACK_SIZE;
+	s->frame_size = FRAME_SIZE;
+	s->stack = (value_t*)mf(NULL, sizeof(value_t) * STACK_SIZE);
+	s->frames = (frame_t*)mf(NULL, sizeof(frame_t) * FRAME_SIZE);
+	s->frame = s->frames;
+
 	s->pc = 0xffff;
 	s->msi->ref_counter = 0x1;
 	s->msi->tid_count.value = 1;
@@ -1725,27 +2577,102 @@ su_state *su_init(su_alloc alloc) {
 	return s;
 }
 
+#ifdef SU_OPT_VM_STATS
+typedef struct {
+	unsigned long count;
+	int first, second;
+} op_pair_t;
+
+static int compare_op_pairs(const void *a, const void *b) {
+	unsigned long ca = ((const op_pair_t*)a)->count;
+	unsigned long cb = ((const op_pair_t*)b)->count;
+	return (ca < cb) - (ca > cb);
+}
+
+static void print_vm_stats(su_state *s) {
+	int i, j;
+	vm_stats_t total;
+	unsigned long dispatched = 0;
+	op_pair_t pairs[NUM_OPS * NUM_OPS];
+	const char *pause_names[2] = {"gc major", "gc minor"};
+	gc_pause_t *p;
+
+	memset(&total, 0, sizeof(vm_stats_t));
+	for (i = 0; i < SU_OPT_MAX_THREADS; i++)
+		add_vm_stats(&total, &s->msi->threads[i].stats);
+
+	for (i = 0; i < NUM_OPS; i++)
+		dispatched += total.op_count[i];
+	if (!dispatched)
+		return;
+
+	for (i = 0; i < NUM_OPS; i++) {
+		if (total.op_count[i])
+			fprintf(s->fstderr, "%-12s %lu\n", op_names[i], total.op_count[i]);
+		for (j = 0; j < NUM_OPS; j++) {
+			pairs[i * NUM_OPS + j].count = total.pair_count[i][j];
+			pairs[i * NUM_OPS + j].first = i;
+			pairs[i * NUM_OPS + j].second = j;
+		}
+	}
+	fprintf(s->fstderr, "%-12s %lu\n", "dispatched", dispatched);
+	for (i = 0; i < 2; i++) {
+		p = &s->msi->gc_pauses[i];
+		if (p->count)
+			fprintf(s->fstderr, "%-12s %lu pauses, %lu us total, %lu us max\n", pause_names[i], p->count, p->total_us, p->max_us);
+	}
+
+	qsort(pairs, NUM_OPS * NUM_OPS, sizeof(op_pair_t), &compare_op_pairs);
+	for (i = 0; i < 20 && pairs[i].count; i++)
+		fprintf(s->fstderr, "pair %-12s %-12s %lu\n", op_names[pairs[i].first], op_names[pairs[i].second], pairs[i].count);
+}
+#endif
+
 void su_close(su_state *s) {
-	int i;
+	int i, num;
+	gc_t *obj;
 	s->stack_top = 0;
 	su_thread_indisposable(s);
 	
 	while (atomic_get(&s->msi->thread_count) > 1)
 		thread_sleep(0);
+
+	#ifdef SU_OPT_VM_STATS
+		print_vm_stats(s);
+	#endif
 	
 	for (i = 0; i < SU_OPT_MAX_THREADS; i++) {
 		su_state *thread = &s->msi->threads[i];
 		memset(thread->string_cache, 0, sizeof(thread->string_cache));
 		if (thread->string_builder) thread->alloc(s->string_builder, 0);
 		
-		if (thread->fstdin != stdin) fclose(thread->fstdin);
-		if (thread->fstdout != stdout) fclose(thread->fstdout);
-		if (thread->fstderr != stderr) fclose(thread->fstderr);
+		if (thread->fstdin && thread->fstdin != stdin) fclose(thread->fstdin);
+		if (thread->fstdout && thread->fstdout != stdout) fclose(thread->fstdout);
+		if (thread->fstderr && thread->fstderr != stderr) fclose(thread->fstderr);
 	}
 	
-	while (atomic_get(&s->msi->num_objects) > 1)
+	/* Counts are only exact once a collection has merged every thread, and
+	   locals marked by another thread survive one more collection. */
+	do {
+		num = atomic_get(&s->msi->num_objects);
 		su_gc(s);
-	gc_free_object(s, s->msi->gc_root);
+	} while (atomic_get(&s->msi->num_objects) && atomic_get(&s->msi->num_objects) < num);
+	while ((obj = s->msi->gc_root)) {
+		s->msi->gc_root = obj->next;
+		gc_free_object(s, obj);
+	}
+	gc_free_slabs(s);
+
+	for (i = 0; i < SU_OPT_MAX_THREADS; i++) {
+		su_state *thread = &s->msi->threads[i];
+		if (thread->stack) thread->alloc(thread->stack, 0);
+		if (thread->frames) thread->alloc(thread->frames, 0);
+		if (thread->gray) thread->alloc(thread->gray, 0);
+	}
+	if (s->msi->gc_gray)
+		s->alloc(s->msi->gc_gray, 0);
+	if (s->msi->gc_young)
+		s->alloc(s->msi->gc_young, 0);
 
 	if (s->msi->c_lambdas)
 		s->alloc(s->msi->c_lambdas, 0);
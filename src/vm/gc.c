@@ -11,22 +11,167 @@
 #include "seq.h"
 #include "ref.h"
 #include "gc.h"
+#include "jit.h"
 
 #include <assert.h>
+#include <limits.h>
+#include <string.h>
+
+#define SLAB_HEADER ((sizeof(slab_page_t) + 15) & ~(size_t)15)
 
 static void free_prot(su_state *s, prototype_t *prot);
 
+static slab_page_t *slab_page_of(gc_t *obj) {
+	return (slab_page_t*)((char*)obj - (size_t)obj->slot * obj->slab * 16 - SLAB_HEADER);
+}
+
+static void link_page(slab_page_t **head, slab_page_t *page) {
+	page->prev = NULL;
+	page->next = *head;
+	if (*head)
+		(*head)->prev = page;
+	*head = page;
+}
+
+static void unlink_page(slab_page_t **head, slab_page_t *page) {
+	if (page->prev)
+		page->prev->next = page->next;
+	else
+		*head = page->next;
+	if (page->next)
+		page->next->prev = page->prev;
+}
+
+/* Takes the next slot of the page the thread is carving. Otherwise the
+   thread takes every free slot of a partial page, or starts a new page
+   when the class has none. */
+static gc_t *slab_refill(su_state *s, unsigned c) {
+	gc_t *obj;
+	slab_page_t *page = s->slab_fresh[c - 1];
+	main_state_internal_t *msi = s->msi;
+	
+	if (!page) {
+		spin_lock(&msi->slab_lock);
+		page = msi->slab_pages[c - 1];
+		if (page) {
+			unlink_page(&msi->slab_pages[c - 1], page);
+			obj = page->free;
+			page->free = NULL;
+			page->num_free = 0;
+			spin_unlock(&msi->slab_lock);
+			s->slab_cache[c - 1] = obj->next;
+			return obj;
+		}
+		spin_unlock(&msi->slab_lock);
+		
+		page = (slab_page_t*)s->alloc(NULL, SLAB_PAGE_SIZE);
+		su_assert(s, page != NULL, "Out of memory!");
+		page->next = page->prev = NULL;
+		page->free = NULL;
+		page->num_free = page->num_carved = 0;
+		page->num_slots = (unsigned)((SLAB_PAGE_SIZE - SLAB_HEADER) / (c * 16));
+		s->slab_fresh[c - 1] = page;
+	}
+	
+	obj = (gc_t*)((char*)page + SLAB_HEADER + page->num_carved * c * 16);
+	obj->slab = (unsigned char)c;
+	obj->slot = (unsigned short)page->num_carved;
+	if (++page->num_carved == page->num_slots)
+		s->slab_fresh[c - 1] = NULL;
+	return obj;
+}
+
+/* Returns a slot to its page. A page that is entirely free is released
+   unless it is the only one left in its class. */
+static void slab_free(su_state *s, gc_t *obj) {
+	slab_page_t *page = slab_page_of(obj);
+	slab_page_t **head = &s->msi->slab_pages[obj->slab - 1];
+	
+	spin_lock(&s->msi->slab_lock);
+	obj->next = page->free;
+	page->free = obj;
+	if (++page->num_free == 1)
+		link_page(head, page);
+	if (page->num_free == page->num_slots && (page->next || page->prev)) {
+		unlink_page(head, page);
+		s->alloc(page, 0);
+	}
+	spin_unlock(&s->msi->slab_lock);
+}
+
+/* Objects that fit a size class come from the thread's slab cache, larger
+   ones from the allocator. Either way the header's slab field tells
+   gc_free_object where to return them. */
+void *gc_allocate(su_state *s, size_t n) {
+	gc_t *obj;
+	unsigned c = (unsigned)((n + 15) / 16);
+	
+	if (c > SLAB_CLASSES) {
+		obj = (gc_t*)su_allocate(s, NULL, n);
+		obj->slab = 0;
+		return obj;
+	}
+	
+	thread_interrupt(s, IGC);
+	obj = s->slab_cache[c - 1];
+	if (!obj)
+		return slab_refill(s, c);
+	s->slab_cache[c - 1] = obj->next;
+	return obj;
+}
+
+/* Called from su_close once every object is freed. */
+void gc_free_slabs(su_state *s) {
+	int i, c;
+	gc_t *obj;
+	slab_page_t *page;
+	main_state_internal_t *msi = s->msi;
+	
+	for (i = 0; i < SU_OPT_MAX_THREADS; i++) {
+		su_state *thread = &msi->threads[i];
+		for (c = 0; c < SLAB_CLASSES; c++) {
+			while ((obj = thread->slab_cache[c])) {
+				thread->slab_cache[c] = obj->next;
+				slab_free(s, obj);
+			}
+			/* A page being carved is only linked if some slot came back. */
+			page = thread->slab_fresh[c];
+			if (page && !page->num_free)
+				s->alloc(page, 0);
+			thread->slab_fresh[c] = NULL;
+		}
+	}
+	
+	for (c = 0; c < SLAB_CLASSES; c++) {
+		while ((page = msi->slab_pages[c])) {
+			msi->slab_pages[c] = page->next;
+			s->alloc(page, 0);
+		}
+	}
+}
+
+typedef void (*visit_t)(su_state *s, gc_t *obj);
+
+static gc_t **grow_gray(su_state *s, gc_t **gray, unsigned *cap) {
+	unsigned n = *cap ? *cap * 2 : GC_GRAY_SIZE;
+	gray = (gc_t**)s->alloc(gray, sizeof(gc_t*) * n);
+	su_assert(s, gray != NULL, "Out of memory!");
+	*cap = n;
+	return gray;
+}
+
 static void add_to_gray(su_state *s, gc_t *obj) {
 	main_state_internal_t *msi = s->msi;
 	if (obj->flags != GC_FLAG_WHITE)
 		return;
-	assert(msi->gc_gray_size <= GC_GRAY_SIZE);
+	if (msi->gc_gray_size == msi->gc_gray_cap)
+		msi->gc_gray = grow_gray(s, msi->gc_gray, &msi->gc_gray_cap);
 	obj->flags = GC_FLAG_GRAY;
 	msi->gc_gray[msi->gc_gray_size++] = obj;
 }
 
 static gc_t *get_gc_object(value_t *v) {
-	switch (v->type) {
+	switch (VAL_TYPE(v)) {
 		case SU_INV:
 		case SU_NIL:
 		case SU_BOOLEAN:
@@ -35,45 +180,56 @@ static gc_t *get_gc_object(value_t *v) {
 		case SU_NATIVEPTR:
 			return NULL;
 	}
-	assert((int)v->type == (int)v->obj.gc_object->type);
-	return v->obj.gc_object;
+	assert((int)VAL_TYPE(v) == (int)VAL_GC(v)->type);
+	return VAL_GC(v);
 }
 
-static void gray_value(su_state *s, value_t *v) {
+static void visit_value(su_state *s, value_t *v, visit_t visit) {
 	gc_t *obj = get_gc_object(v);
 	if (obj)
-		add_to_gray(s, obj);
+		visit(s, obj);
+}
+
+static void gray_value(su_state *s, value_t *v) {
+	visit_value(s, v, &add_to_gray);
 }
 
-static void gray_vector(su_state *s, gc_t *obj) {
+static void gray_vector(su_state *s, gc_t *obj, visit_t visit) {
 	vector_t *v = (vector_t*)obj;
-	add_to_gray(s, (gc_t*)v->root);
-	add_to_gray(s, (gc_t*)v->tail);
+	visit(s, (gc_t*)v->root);
+	visit(s, (gc_t*)v->tail);
 }
 
-static void gray_vector_node(su_state *s, gc_t *obj) {
+static void gray_vector_node(su_state *s, gc_t *obj, visit_t visit) {
 	int i;
 	vector_node_t *node = (vector_node_t*)obj;
 	for (i = 0; i < (int)node->len; i++)
-		gray_value(s, &node->data[i]);
+		visit_value(s, &node->data[i], visit);
 }
 
-static void gray_tree_seq(su_state *s, gc_t *obj) {
+static void gray_tree_seq(su_state *s, gc_t *obj, visit_t visit) {
 	int i;
 	tree_seq_t *ts = (tree_seq_t*)obj;
 	for (i = 0; i < ts->nlinks; i++)
-		add_to_gray(s, (gc_t*)ts->links[i].n);
+		visit(s, (gc_t*)ts->links[i].n);
 }
 
-static void gray_function(su_state *s, gc_t *obj) {
+static void gray_function(su_state *s, gc_t *obj, visit_t visit) {
 	int i;
 	function_t *func = (function_t*)obj;
-	if (func->prot->gc.type != SU_INV)
-		add_to_gray(s, &func->prot->gc);
-	for (i = 0; i < (int)func->num_const; i++)
-		gray_value(s, &func->constants[i]);
+	visit(s, &func->prot->root->gc);
 	for (i = 0; i < (int)func->num_ups; i++)
-		gray_value(s, &func->upvalues[i]);
+		visit_value(s, &func->upvalues[i], visit);
+}
+
+static void gray_prototype(su_state *s, prototype_t *prot, visit_t visit) {
+	int i;
+	for (i = 0; i < (int)prot->num_const; i++)
+		visit_value(s, &prot->values[i], visit);
+	if (prot->closure)
+		visit(s, &prot->closure->gc);
+	for (i = 0; i < (int)prot->num_prot; i++)
+		gray_prototype(s, &prot->prot[i], visit);
 }
 
 static void free_prot(su_state *s, prototype_t *prot) {
@@ -87,24 +243,84 @@ static void free_prot(su_state *s, prototype_t *prot) {
 			su_allocate(s, prot->constants[i].obj.str, 0);
 	}
 	su_allocate(s, prot->constants, 0);
+	su_allocate(s, prot->values, 0);
 	su_allocate(s, prot->name, 0);
 
+#ifdef SU_JIT
+	if (prot->jit)
+		jit_free(s, prot->jit);
+#endif
+
+#ifdef SU_OPT_PROFILE
+	su_allocate(s, prot->feedback, 0);
+#endif
+
 	for (i = 0; i < prot->num_prot; i++)
 		free_prot(s, &prot->prot[i]);
 	su_allocate(s, prot->prot, 0);
 }
 
 static void trace_cb(su_state *s, su_value_t *v) {
-	gc_t *tmp;
-	value_t *val = (value_t*)v;
-	tmp = get_gc_object(val);
-	if (tmp)
-		add_to_gray(s, tmp);
+	gray_value(s, (value_t*)v);
+}
+
+/* Visits everything obj refers to. Locals and native data are left to the
+   caller, the two collectors treat them differently. */
+static void trace_object(su_state *s, gc_t *obj, visit_t visit) {
+	map_t *m;
+	switch (obj->type) {
+		case SU_GLOBAL:
+			m = (map_t*)atomic_get_ptr(&((global_t*)obj)->value);
+			if (m)
+				visit(s, &m->gc);
+			break;
+		case SU_VECTOR:
+			gray_vector(s, obj, visit);
+			break;
+		case VECTOR_NODE:
+			gray_vector_node(s, obj, visit);
+			break;
+		case SU_FUNCTION:
+			gray_function(s, obj, visit);
+			break;
+		case PROTOTYPE:
+			gray_prototype(s, (prototype_t*)obj, visit);
+			break;
+		case SU_MAP:
+			visit(s, &((map_t*)obj)->root->gc);
+			break;
+		case MAP_COLLISION:
+			visit(s, &((node_collision_t*)obj)->leaves->gc);
+			break;
+		case MAP_FULL:
+			visit(s, &((node_full_t*)obj)->nodes->gc);
+			break;
+		case MAP_IDX:
+			visit(s, &((node_idx_t*)obj)->nodes->gc);
+			break;
+		case MAP_LEAF:
+			visit_value(s, &((node_leaf_t*)obj)->key, visit);
+			visit_value(s, &((node_leaf_t*)obj)->val, visit);
+			break;
+		case CELL_SEQ:
+			visit_value(s, &((cell_seq_t*)obj)->first, visit);
+			visit_value(s, &((cell_seq_t*)obj)->rest, visit);
+			break;
+		case TREE_SEQ:
+			gray_tree_seq(s, obj, visit);
+			break;
+		case IT_SEQ:
+			visit(s, ((it_seq_t*)obj)->obj);
+			break;
+		case LAZY_SEQ:
+			visit_value(s, &((lazy_seq_t*)obj)->f, visit);
+			visit_value(s, &((lazy_seq_t*)obj)->d, visit);
+			break;
+	}
 }
 
 static void mark(su_state *s) {
 	gc_t *obj;
-	map_t *m;
 	local_t *loc;
 	native_data_t *nd;
 	main_state_internal_t *msi = s->msi;
@@ -116,81 +332,223 @@ static void mark(su_state *s) {
 			goto mark_object;
 		
 		obj->flags = GC_FLAG_BLACK;
-		switch (obj->type) {
-			case SU_NATIVEDATA:
-				nd = (native_data_t*)obj;
-				if (nd->vt && nd->vt->trace_callback)
-					nd->vt->trace_callback(s, (void*)nd->data, &trace_cb);
-				break;
-			case SU_LOCAL:
-				loc = (local_t*)obj;
-				if (loc->tid == s->tid)
-					gray_value(s, &loc->v);
-				else
-					gc_gray_mutable(s, obj);
-				break;
-			case SU_GLOBAL:
-				m = (map_t*)atomic_get_ptr(&((global_t*)obj)->value);
-				if (m)
-					add_to_gray(s, &m->gc);
-				break;
-			case SU_VECTOR:
-				gray_vector(s, obj);
-				break;
-			case VECTOR_NODE:
-				gray_vector_node(s, obj);
-				break;
-			case SU_FUNCTION:
-				gray_function(s, obj);
-				break;
-			case SU_MAP:
-				add_to_gray(s, &((map_t*)obj)->root->gc);
-				break;
-			case MAP_COLLISION:
-				add_to_gray(s, &((node_collision_t*)obj)->leaves->gc);
-				break;
-			case MAP_FULL:
-				add_to_gray(s, &((node_full_t*)obj)->nodes->gc);
-				break;
-			case MAP_IDX:
-				add_to_gray(s, &((node_idx_t*)obj)->nodes->gc);
-				break;
-			case MAP_LEAF:
-				gray_value(s, &((node_leaf_t*)obj)->key);
-				gray_value(s, &((node_leaf_t*)obj)->val);
-				break;
-			case CELL_SEQ:
-				gray_value(s, &((cell_seq_t*)obj)->first);
-				gray_value(s, &((cell_seq_t*)obj)->rest);
-				break;
-			case TREE_SEQ:
-				gray_tree_seq(s, obj);
-				break;
-			case IT_SEQ:
-				add_to_gray(s, ((it_seq_t*)obj)->obj);
-				break;
-			case LAZY_SEQ:
-				gray_value(s, &((lazy_seq_t*)obj)->f);
-				gray_value(s, &((lazy_seq_t*)obj)->d);
-				break;
+		if (obj->type == SU_NATIVEDATA) {
+			nd = (native_data_t*)obj;
+			if (nd->vt && nd->vt->trace_callback)
+				nd->vt->trace_callback(s, (void*)nd->data, &trace_cb);
+		} else if (obj->type == SU_LOCAL) {
+			loc = (local_t*)obj;
+			if (loc->tid == s->tid)
+				gray_value(s, &loc->v);
+			else
+				gc_gray_mutable(s, obj);
+		} else {
+			trace_object(s, obj, &add_to_gray);
 		}
 	} else {
 		msi->gc_state = GC_STATE_SWEEP;
 	}
 }
 
-static void collect_stack(su_state *s) {
+static void collect_stack(su_state *s, visit_t visit) {
 	int i, j;
 	for (i = 0; i < s->stack_top; i++)
-		gray_value(s, &s->stack[i]);
+		visit_value(s, &s->stack[i], visit);
 	for (i = 0; i < 16; i++) {
 		for (j = 0; j < STRING_CACHE_SIZE; j++) {
 			if (s->string_cache[i][j].str)
-				add_to_gray(s, &s->string_cache[i][j].str->gc);
+				visit(s, &s->string_cache[i][j].str->gc);
 		}
 	}
 }
 
+/* Grays a root for the next marking phase. Survivors of the last one are
+   still black until the lazy sweep gets to them. */
+static void seed_gray(su_state *s, gc_t *obj) {
+	main_state_internal_t *msi = s->msi;
+	if (obj->flags == GC_FLAG_GRAY)
+		return;
+	if (msi->gc_gray_size == msi->gc_gray_cap)
+		msi->gc_gray = grow_gray(s, msi->gc_gray, &msi->gc_gray_cap);
+	obj->flags = GC_FLAG_GRAY;
+	msi->gc_gray[msi->gc_gray_size++] = obj;
+}
+
+/* --------------------------------- Parallel marking --------------------------------- */
+
+/* The marking left for a pause is shared with the threads parked in
+   su_thread_disposable, one per spare core. Every marker works from a
+   private stack and hands the older half of it to its shared stack when
+   another marker is idle, idle markers steal from the shared stacks.
+   Objects are grayed with a compare and swap, so only one marker pushes
+   each. The world is stopped, so locals are read whoever owns them. */
+
+#define MARK_SHARE_SIZE 64
+
+static void push_mark(su_state *s, gc_t *obj) {
+	if (obj->flags != GC_FLAG_WHITE || !atomic_cas_char(&obj->flags, GC_FLAG_WHITE, GC_FLAG_GRAY))
+		return;
+	if (s->mark_size == s->mark_cap)
+		s->mark = grow_gray(s, s->mark, &s->mark_cap);
+	s->mark[s->mark_size++] = obj;
+}
+
+static void mark_trace_cb(su_state *s, su_value_t *v) {
+	visit_value(s, (value_t*)v, &push_mark);
+}
+
+/* The bottom of the stack is nearest the roots and holds the most work. */
+static void share_mark(su_state *s) {
+	unsigned n = s->mark_size / 2;
+	
+	spin_lock(&s->mark_lock);
+	while (s->mark_shared_size + n > s->mark_shared_cap)
+		s->mark_shared = grow_gray(s, s->mark_shared, &s->mark_shared_cap);
+	memcpy(&s->mark_shared[s->mark_shared_size], s->mark, sizeof(gc_t*) * n);
+	s->mark_shared_size += n;
+	spin_unlock(&s->mark_lock);
+	
+	s->mark_size -= n;
+	memmove(s->mark, &s->mark[n], sizeof(gc_t*) * s->mark_size);
+}
+
+/* Takes half of the first shared stack with work, starting with our own. */
+static int steal_mark(su_state *s) {
+	int i;
+	unsigned n;
+	su_state *victim;
+	main_state_internal_t *msi = s->msi;
+	int self = (int)(s - msi->threads);
+	
+	for (i = 0; i < SU_OPT_MAX_THREADS; i++) {
+		victim = &msi->threads[(self + i) % SU_OPT_MAX_THREADS];
+		if (!victim->mark_shared_size)
+			continue;
+		
+		spin_lock(&victim->mark_lock);
+		n = (victim->mark_shared_size + 1) / 2;
+		if (victim->mark_shared_size) {
+			while (s->mark_size + n > s->mark_cap)
+				s->mark = grow_gray(s, s->mark, &s->mark_cap);
+			victim->mark_shared_size -= n;
+			memcpy(&s->mark[s->mark_size], &victim->mark_shared[victim->mark_shared_size], sizeof(gc_t*) * n);
+			s->mark_size += n;
+		}
+		spin_unlock(&victim->mark_lock);
+		if (s->mark_size)
+			return 1;
+	}
+	return 0;
+}
+
+static int mark_shared(main_state_internal_t *msi) {
+	int i;
+	for (i = 0; i < SU_OPT_MAX_THREADS; i++) {
+		if (msi->threads[i].mark_shared_size)
+			return 1;
+	}
+	return 0;
+}
+
+/* Runs until no marker holds work. A marker only goes idle with empty
+   stacks, and only busy markers share, so once none is busy the marking
+   is done. */
+static void mark_work(su_state *s) {
+	gc_t *obj;
+	native_data_t *nd;
+	main_state_internal_t *msi = s->msi;
+	
+	for (;;) {
+		while (s->mark_size) {
+			obj = s->mark[--s->mark_size];
+			if (obj->flags == GC_FLAG_BLACK)
+				continue;
+			
+			obj->flags = GC_FLAG_BLACK;
+			if (obj->type == SU_NATIVEDATA) {
+				nd = (native_data_t*)obj;
+				if (nd->vt && nd->vt->trace_callback)
+					nd->vt->trace_callback(s, (void*)nd->data, &mark_trace_cb);
+			} else if (obj->type == SU_LOCAL) {
+				visit_value(s, &((local_t*)obj)->v, &push_mark);
+			} else {
+				trace_object(s, obj, &push_mark);
+			}
+			
+			if (s->mark_size >= MARK_SHARE_SIZE && !s->mark_shared_size && atomic_get(&msi->gc_mark_active) <= atomic_get(&msi->gc_mark_helpers))
+				share_mark(s);
+		}
+		
+		if (steal_mark(s))
+			continue;
+		
+		atomic_add(&msi->gc_mark_active, -1);
+		for (;;) {
+			if (!atomic_get(&msi->gc_mark_active))
+				return;
+			if (mark_shared(msi)) {
+				atomic_add(&msi->gc_mark_active, 1);
+				if (steal_mark(s))
+					break;
+				atomic_add(&msi->gc_mark_active, -1);
+			}
+			thread_sleep(0);
+		}
+	}
+}
+
+static void free_mark(su_state *s) {
+	if (s->mark)
+		s->alloc(s->mark, 0);
+	if (s->mark_shared)
+		s->alloc(s->mark_shared, 0);
+	s->mark = s->mark_shared = NULL;
+	s->mark_size = s->mark_cap = 0;
+	s->mark_shared_size = s->mark_shared_cap = 0;
+}
+
+/* Drains the gray stack with the help of parked threads. It becomes the
+   collecting thread's private stack meanwhile. */
+static void mark_parallel(su_state *s) {
+	main_state_internal_t *msi = s->msi;
+	
+	s->mark = msi->gc_gray;
+	s->mark_size = msi->gc_gray_size;
+	s->mark_cap = msi->gc_gray_cap;
+	msi->gc_gray = NULL;
+	msi->gc_gray_size = msi->gc_gray_cap = 0;
+	
+	atomic_set(&msi->gc_mark_active, 1);
+	atomic_set(&msi->gc_mark_slots, msi->gc_mark_cores - 1);
+	mark_work(s);
+	atomic_set(&msi->gc_mark_slots, 0);
+	while (atomic_get(&msi->gc_mark_helpers))
+		thread_sleep(0);
+	
+	msi->gc_gray = s->mark;
+	msi->gc_gray_cap = s->mark_cap;
+	s->mark = NULL;
+	free_mark(s);
+}
+
+/* Called by threads waiting for a pause to end. Returns nonzero if the
+   thread took part in marking. */
+int gc_mark_help(su_state *s) {
+	main_state_internal_t *msi = s->msi;
+	int helped = 0;
+	
+	if (!atomic_get(&msi->gc_mark_slots))
+		return 0;
+	if (atomic_add(&msi->gc_mark_helpers, 1) < atomic_get(&msi->gc_mark_slots)) {
+		atomic_add(&msi->gc_mark_active, 1);
+		mark_work(s);
+		free_mark(s);
+		helped = 1;
+	}
+	atomic_add(&msi->gc_mark_helpers, -1);
+	return helped;
+}
+
 static void scan_mutated(su_state *s) {
 	int i;
 	gc_t *obj;
@@ -199,7 +557,11 @@ static void scan_mutated(su_state *s) {
 	
 	for (i = 0; i < SU_OPT_MAX_THREADS; i++) {
 		su_state *thread = &msi->threads[i];
-		collect_stack(thread);
+		/* A finished thread's stack is empty and its string cache is
+		   replaced before the slot is used again. Its gray stack may
+		   still hold locals it mutated. */
+		if (!atomic_get(&thread->thread_finished))
+			collect_stack(thread, &add_to_gray);
 		while (thread->gray_size) {
 			obj = thread->gray[--thread->gray_size];
 			if (obj->type == SU_LOCAL) {
@@ -214,46 +576,88 @@ static void scan_mutated(su_state *s) {
 		}
 	}
 	
-	msi->gc_state = GC_STATE_MARK;
-	while (msi->gc_state != GC_STATE_SWEEP)
-		mark(s);
+	mark_parallel(s);
 	assert(!msi->gc_gray_size);
 }
 
+/* Moves every thread's object list onto gc_root and adds the objects not
+   yet counted. All threads are parked or finished, and the thread pool is
+   locked so no slot is handed out meanwhile. */
+static void merge_objects(su_state *s) {
+	int i, num = 0;
+	main_state_internal_t *msi = s->msi;
+	
+	for (i = 0; i < SU_OPT_MAX_THREADS; i++) {
+		su_state *thread = &msi->threads[i];
+		if (thread->gc_list) {
+			thread->gc_list_tail->next = msi->gc_root;
+			msi->gc_root = thread->gc_list;
+			thread->gc_list = thread->gc_list_tail = NULL;
+		}
+		num += thread->gc_list_count;
+		thread->gc_list_count = 0;
+	}
+	atomic_add(&msi->num_objects, num);
+}
+
+/* Ends a marking phase. Dead objects are freed later by sweep_step, so
+   the pause does not grow with the heap. */
 static void collect(su_state *s) {
-	gc_t *tmp;
-	gc_t *prev = NULL;
 	main_state_internal_t *msi = s->msi;
-	gc_t *obj = msi->gc_root;
-	int num_freed = 0;
-	int alive;
 	
 	scan_mutated(s);
+	merge_objects(s);
 	
-	obj->flags = GC_FLAG_WHITE;
-	while (obj) {
-		if (obj->flags == GC_FLAG_WHITE && prev) {
-			prev->next = obj->next;
-			tmp = obj;
-			obj = obj->next;
+	msi->gc_sweep = msi->gc_root;
+	msi->gc_root = NULL;
+	msi->gc_num_old = atomic_get(&msi->num_objects);
+	msi->gc_cycle++;
+	
+	/* Nothing but the nursery starts a collection before the sweep is done. */
+	atomic_set(&msi->gc_throttle, INT_MAX);
+}
+
+/* Frees up to n dead objects left by the last marking phase and puts the
+   survivors back on gc_root. The thread pool lock keeps su_profile off the
+   lists meanwhile. */
+static void sweep_step(su_state *s, int n) {
+	gc_t *obj;
+	int num_freed = 0;
+	int alive;
+	main_state_internal_t *msi = s->msi;
+	
+	spin_lock(&msi->thread_pool_lock);
+	while (n-- > 0 && (obj = msi->gc_sweep)) {
+		msi->gc_sweep = obj->next;
+		if (obj->flags == GC_FLAG_WHITE) {
+			gc_free_object(s, obj);
 			num_freed++;
-			gc_free_object(s, tmp);
 		} else {
-			obj->flags = GC_FLAG_WHITE;
-			prev = obj;
-			obj = obj->next;
+			/* Roots grayed for the next phase stay gray. */
+			if (obj->flags == GC_FLAG_BLACK)
+				obj->flags = GC_FLAG_WHITE;
+			obj->usr |= GC_USR_OLD;
+			obj->next = msi->gc_root;
+			msi->gc_root = obj;
 		}
 	}
+	spin_unlock(&msi->thread_pool_lock);
 	
-	alive = msi->gc_num_objects - num_freed;
-	atomic_set(&msi->gc_throttle, alive + (alive / SU_OPT_GC_OVERHEAD_DIVISOR) * atomic_get(&msi->thread_count));
 	atomic_add(&msi->num_objects, -num_freed);
+	msi->gc_num_old -= num_freed;
+	
+	if (!msi->gc_sweep) {
+		/* Room for a full nursery on top of what minor collections promote. */
+		alive = msi->gc_num_old;
+		atomic_set(&msi->gc_throttle, alive + (alive / SU_OPT_GC_OVERHEAD_DIVISOR) * atomic_get(&msi->thread_count) + SU_OPT_GC_NURSERY_SIZE * 2);
+	}
 }
 
-static void sweep(su_state *s) {
+/* Parks every other thread, they wait in su_thread_disposable or at their
+   next interrupt check until resume_world. */
+static void stop_world(su_state *s) {
 	int i;
 	main_state_internal_t *msi = s->msi;
-	assert(msi->gc_state == GC_STATE_SWEEP);
 	
 	spin_lock(&msi->thread_pool_lock);
 	interrupt(s, ISCOLLECT);
@@ -263,22 +667,171 @@ static void sweep(su_state *s) {
 		su_state *thread = &msi->threads[i];
 		while (!atomic_get(&thread->thread_finished) && !atomic_get(&thread->thread_indisposable));
 	}
+}
+
+static void resume_world(su_state *s) {
+	s->thread_indisposable.value = 0;
+	unmask_interrupt(s, ISCOLLECT);
+	spin_unlock(&s->msi->thread_pool_lock);
+}
+
+#ifdef SU_OPT_VM_STATS
+static void add_pause(gc_pause_t *p, unsigned long start) {
+	unsigned long us = time_us() - start;
+	p->count++;
+	p->total_us += us;
+	if (us > p->max_us)
+		p->max_us = us;
+}
+#endif
+
+static void sweep(su_state *s) {
+	int i;
+	main_state_internal_t *msi = s->msi;
+#ifdef SU_OPT_VM_STATS
+	unsigned long start = time_us();
+#endif
+	assert(msi->gc_state == GC_STATE_SWEEP);
 	
+	stop_world(s);
 	collect(s);
 	
 	for (i = 0; i < SU_OPT_MAX_THREADS; i++) {
 		su_state *thread = &msi->threads[i];
 		if (!atomic_get(&thread->thread_finished))
-			collect_stack(thread);
+			collect_stack(thread, &seed_gray);
 	}
 	
-	msi->gc_num_objects = atomic_get(&msi->num_objects);
-	s->thread_indisposable.value = 0;
+	resume_world(s);
+	msi->gc_state = GC_STATE_MARK;
+#ifdef SU_OPT_VM_STATS
+	add_pause(&msi->gc_pauses[0], start);
+#endif
+}
+
+/* --------------------------------- Minor collection --------------------------------- */
+
+/* Objects allocated since the last collection are young and still sit on
+   their thread's list. Older objects are immutable or mutated through
+   gc_gray_mutable, so the only references from old to young objects are
+   in locals and globals on the gray stacks. A minor collection marks the
+   young objects reachable from the thread stacks and those, frees the rest
+   and promotes the survivors to gc_root without moving them. It only runs
+   between major marking phases, so every young object is still white. */
+
+static void add_to_young(su_state *s, gc_t *obj) {
+	main_state_internal_t *msi = s->msi;
+	if (obj->usr & (GC_USR_OLD | GC_USR_LIVE))
+		return;
+	if (msi->gc_young_size == msi->gc_young_cap)
+		msi->gc_young = grow_gray(s, msi->gc_young, &msi->gc_young_cap);
+	obj->usr |= GC_USR_LIVE;
+	msi->gc_young[msi->gc_young_size++] = obj;
+}
+
+static void young_trace_cb(su_state *s, su_value_t *v) {
+	visit_value(s, (value_t*)v, &add_to_young);
+}
+
+static void young_roots(su_state *s) {
+	int i, j;
+	gc_t *obj;
+	main_state_internal_t *msi = s->msi;
 	
-	unmask_interrupt(s, ISCOLLECT);
-	spin_unlock(&msi->thread_pool_lock);
+	for (i = 0; i < SU_OPT_MAX_THREADS; i++) {
+		su_state *thread = &msi->threads[i];
+		if (!atomic_get(&thread->thread_finished)) {
+			for (j = 0; j < thread->stack_top; j++)
+				visit_value(s, &thread->stack[j], &add_to_young);
+			for (j = 0; j < 16 * STRING_CACHE_SIZE; j++) {
+				if (thread->string_cache[j / STRING_CACHE_SIZE][j % STRING_CACHE_SIZE].str)
+					add_to_young(s, &thread->string_cache[j / STRING_CACHE_SIZE][j % STRING_CACHE_SIZE].str->gc);
+			}
+		}
+		
+		/* The gray stacks are left for the next major collection. */
+		for (j = 0; j < (int)thread->gray_size; j++) {
+			obj = thread->gray[j];
+			if (!(obj->usr & GC_USR_OLD))
+				add_to_young(s, obj);
+			else if (obj->type == SU_LOCAL)
+				visit_value(s, &((local_t*)obj)->v, &add_to_young);
+			else
+				trace_object(s, obj, &add_to_young);
+		}
+	}
+}
+
+static void mark_young(su_state *s) {
+	gc_t *obj;
+	native_data_t *nd;
+	main_state_internal_t *msi = s->msi;
 	
-	msi->gc_state = GC_STATE_MARK;
+	while (msi->gc_young_size) {
+		obj = msi->gc_young[--msi->gc_young_size];
+		if (obj->type == SU_NATIVEDATA) {
+			nd = (native_data_t*)obj;
+			if (nd->vt && nd->vt->trace_callback)
+				nd->vt->trace_callback(s, (void*)nd->data, &young_trace_cb);
+		} else if (obj->type == SU_LOCAL) {
+			visit_value(s, &((local_t*)obj)->v, &add_to_young);
+		} else {
+			trace_object(s, obj, &add_to_young);
+		}
+	}
+}
+
+static void sweep_young(su_state *s) {
+	int i, num = 0, num_freed = 0, num_promoted = 0;
+	gc_t *obj, *next;
+	gc_t *head = NULL, *tail = NULL;
+	main_state_internal_t *msi = s->msi;
+	
+	for (i = 0; i < SU_OPT_MAX_THREADS; i++) {
+		su_state *thread = &msi->threads[i];
+		for (obj = thread->gc_list; obj; obj = next) {
+			next = obj->next;
+			assert(obj->flags == GC_FLAG_WHITE);
+			if (obj->usr & GC_USR_LIVE) {
+				obj->usr = (obj->usr & ~GC_USR_LIVE) | GC_USR_OLD;
+				obj->next = head;
+				if (!tail)
+					tail = obj;
+				head = obj;
+				num_promoted++;
+			} else {
+				gc_free_object(s, obj);
+				num_freed++;
+			}
+		}
+		thread->gc_list = thread->gc_list_tail = NULL;
+		num += thread->gc_list_count;
+		thread->gc_list_count = 0;
+	}
+	
+	if (head) {
+		tail->next = msi->gc_root;
+		msi->gc_root = head;
+	}
+	msi->gc_num_old += num_promoted;
+	atomic_add(&msi->num_objects, num - num_freed);
+}
+
+static void minor(su_state *s) {
+#ifdef SU_OPT_VM_STATS
+	unsigned long start = time_us();
+#endif
+	stop_world(s);
+	young_roots(s);
+	mark_young(s);
+	sweep_young(s);
+	
+	/* Inline caches may point at freed objects. */
+	s->msi->gc_cycle++;
+	resume_world(s);
+#ifdef SU_OPT_VM_STATS
+	add_pause(&s->msi->gc_pauses[1], start);
+#endif
 }
 
 void gc_free_object(su_state *s, gc_t *obj) {
@@ -287,7 +840,6 @@ void gc_free_object(su_state *s, gc_t *obj) {
 	
 	if (obj->type == SU_FUNCTION) {
 		func = (function_t*)obj;
-		su_allocate(s, func->constants, 0);
 		su_allocate(s, func->upvalues, 0);
 	} else if (obj->type == PROTOTYPE) {
 		free_prot(s, (prototype_t*)obj);
@@ -295,8 +847,13 @@ void gc_free_object(su_state *s, gc_t *obj) {
 		nd = (native_data_t*)obj;
 		if (nd->vt && nd->vt->gc_callback)
 			nd->vt->gc_callback(s, (void*)nd->data);
+		if (nd->vt && nd->vt->trace_callback)
+			atomic_add(&s->msi->gc_traced_natives, -1);
 	}
-	su_allocate(s, obj, 0);
+	if (obj->slab)
+		slab_free(s, obj);
+	else
+		su_allocate(s, obj, 0);
 }
 
 void gc_gray_mutable(su_state *s, gc_t *obj) {
@@ -304,14 +861,30 @@ void gc_gray_mutable(su_state *s, gc_t *obj) {
 	if ((obj->usr & GC_USR_GRAY) == GC_USR_GRAY)
 		return;
 	
-	assert(s->gray_size <= GC_GRAY_SIZE);
+	if (s->gray_size == s->gray_cap)
+		s->gray = grow_gray(s, s->gray, &s->gray_cap);
 	obj->usr |= GC_USR_GRAY;
 	s->gray[s->gray_size++] = obj;
 }
 
+/* Native data can hold values the write barrier never sees, so minor
+   collections stop while any of it is traced. Marking only starts once
+   num_objects passes the throttle, and the count does not drop until the
+   sweep, so checking it again under the lock keeps minor collections out
+   of a major marking phase. Neither starts before the lazy sweep is done,
+   a full nursery finishes it at once. */
 void gc_trace(su_state *s) {
 	main_state_internal_t *msi = s->msi;
-	if (atomic_get(&msi->num_objects) > atomic_get(&msi->gc_throttle)) {
+	int num = atomic_get(&msi->num_objects);
+	int nursery = SU_OPT_GC_NURSERY_SIZE && num - msi->gc_num_old > SU_OPT_GC_NURSERY_SIZE;
+	
+	if (msi->gc_sweep) {
+		if (spin_try_lock(&msi->gc_lock)) {
+			if (msi->gc_sweep)
+				sweep_step(s, nursery ? INT_MAX : GC_SWEEP_STEP);
+			spin_unlock(&msi->gc_lock);
+		}
+	} else if (num > atomic_get(&msi->gc_throttle)) {
 		if (spin_try_lock(&msi->gc_lock)) {
 			if (msi->gc_state == GC_STATE_MARK)
 				mark(s);
@@ -319,6 +892,12 @@ void gc_trace(su_state *s) {
 				sweep(s);
 			spin_unlock(&msi->gc_lock);
 		}
+	} else if (nursery && !atomic_get(&msi->gc_traced_natives)) {
+		if (spin_try_lock(&msi->gc_lock)) {
+			if (!msi->gc_sweep && atomic_get(&msi->num_objects) <= atomic_get(&msi->gc_throttle))
+				minor(s);
+			spin_unlock(&msi->gc_lock);
+		}
 	}
 }
 
@@ -330,13 +909,13 @@ void su_gc(su_state *s) {
 		thread_sleep(0);
 	su_thread_disposable(s);
 	
-	if (msi->gc_state == GC_STATE_SWEEP) {
-		sweep(s);
-	} else {
-		while (msi->gc_state == GC_STATE_MARK)
-			mark(s);
-		sweep(s);
-	}
+	if (msi->gc_sweep)
+		sweep_step(s, INT_MAX);
+	
+	/* Marking is left to the pause, where parked threads can help. */
+	msi->gc_state = GC_STATE_SWEEP;
+	sweep(s);
+	sweep_step(s, INT_MAX);
 	
 	assert(msi->gc_state == GC_STATE_MARK);
 	spin_unlock(&msi->gc_lock);
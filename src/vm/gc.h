@@ -20,7 +20,9 @@ enum {
 };
 
 enum {
-	GC_USR_GRAY = 0x1
+	GC_USR_GRAY = 0x1,
+	GC_USR_OLD = 0x2,
+	GC_USR_LIVE = 0x4
 };
 
 enum {
@@ -30,6 +32,8 @@ enum {
 
 void gc_trace(su_state *s);
 void gc_free_object(su_state *s, gc_t *obj);
+void gc_free_slabs(su_state *s);
 void gc_gray_mutable(su_state *s, gc_t *obj);
+int gc_mark_help(su_state *s);
 
 #endif
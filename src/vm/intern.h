@@ -16,10 +16,22 @@
 #include <stdio.h>
 #include <setjmp.h>
 
-#define MAX_CALLS 128
-#define STACK_SIZE 512
-#define GC_GRAY_SIZE 512
+#ifdef SU_OPT_NAN_BOXING
+	#include <stdint.h>
+#endif
+
+#define STACK_SIZE 64 /* Initial size, stacks grow on demand up to the state's limit. */
+#define FRAME_SIZE 16
+#define GC_GRAY_SIZE 512 /* Initial size, gray stacks double when full. */
+#define GC_COUNT_BATCH 64 /* Objects a thread allocates before it adds them to num_objects. */
+#define GC_SWEEP_STEP 256 /* Objects the lazy sweep visits per gc_trace. */
+#define SLAB_PAGE_SIZE 32768 /* Objects up to SLAB_MAX_SIZE bytes are carved from pages this size. */
+#define SLAB_MAX_SIZE 576
+#define SLAB_CLASSES (SLAB_MAX_SIZE / 16)
 #define STRING_CACHE_SIZE 128
+#define INLINE_CACHE_SIZE 128
+#define NATIVE_SIG_SIZE 256
+#define VM_STATS_OPS 64
 
 #define STK(n) (&s->stack[s->stack_top + (n)])
 #define TOP(n) ((n) < 0 ? (n) : (n) - s->stack_top)
@@ -39,6 +51,7 @@ typedef struct function function_t;
 typedef struct prototype prototype_t;
 typedef struct instruction instruction_t;
 typedef struct upvalue upvalue_t;
+typedef struct jit jit_t;
 
 typedef struct local local_t;
 typedef struct seq seq_t;
@@ -55,6 +68,7 @@ typedef struct node_idx node_idx_t;
 typedef struct node_collision node_collision_t;
 
 typedef struct main_state_internal main_state_internal_t;
+typedef struct slab_page slab_page_t;
 
 typedef void (*thread_entry_t)(su_state*);
 
@@ -87,11 +101,115 @@ enum {
 	IBREAK		= 0x4
 };
 
+enum {
+	OP_PUSH,
+	OP_POP,
+	OP_LOAD,
+	OP_LUP,
+	OP_LCL,
+
+	OP_ADD,
+	OP_SUB,
+	OP_MUL,
+	OP_DIV,
+	OP_MOD,
+	OP_POW,
+	OP_UNM,
+
+	OP_EQ,
+	OP_LESS,
+	OP_LEQUAL,
+
+	OP_NOT,
+	OP_AND,
+	OP_OR,
+
+	OP_TEST,
+	OP_FOR,
+	OP_JMP,
+
+	OP_RETURN,
+	OP_SHIFT,
+	OP_CALL,
+	OP_TCALL,
+	OP_LAMBDA,
+
+	OP_GETGLOBAL,
+	OP_SETGLOBAL,
+	OP_GETFIELD,
+
+	/* Counted loop over a range literal. */
+	OP_FORPREP,
+	OP_FORLOOP,
+
+	/* Moves the top a values to slots b and up, dropping the rest. */
+	OP_STORE,
+
+	/* Operand forms, reading frame slots (L) and constants (K) directly. */
+	OP_ADD_LL,
+	OP_ADD_LK,
+	OP_SUB_LL,
+	OP_SUB_LK,
+	OP_SUB_KL,
+	OP_MUL_LL,
+	OP_MUL_LK,
+	OP_EQ_LL,
+	OP_EQ_LK,
+	OP_LESS_LL,
+	OP_LESS_LK,
+	OP_LESS_KL,
+	OP_LEQUAL_LL,
+	OP_LEQUAL_LK,
+	OP_LEQUAL_KL,
+
+	/* Superinstructions, the next instruction word is read as operands. */
+	OP_EQ_LL_TEST,
+	OP_EQ_LK_TEST,
+	OP_LESS_LL_TEST,
+	OP_LESS_LK_TEST,
+	OP_LESS_KL_TEST,
+	OP_LEQUAL_LL_TEST,
+	OP_LEQUAL_LK_TEST,
+	OP_LEQUAL_KL_TEST,
+	OP_SHIFT_JMP,
+	OP_LOAD_LOAD,
+
+	/* Quickened forms. The VM rewrites the generic instruction in place once
+	   it has seen number operands, the compiler only emits them from a profile. */
+	OP_ADD_NN,
+	OP_SUB_NN,
+	OP_MUL_NN,
+	OP_LESS_NN,
+	OP_LEQUAL_NN,
+
+	NUM_OPS
+};
+
+struct instruction {
+	unsigned char id;
+	unsigned char a;
+	short b;
+};
+
 struct gc {
 	gc_t *next;
 	unsigned char type;
 	unsigned char flags;
 	unsigned char usr;
+	unsigned char slab; /* Size class in 16 byte steps, 0 if not from a slab page. */
+	unsigned short slot;
+};
+
+/* Header of a slab page, followed by its slots. Slots are carved in order
+   by the thread that allocated the page, pages with free slots are linked
+   per size class. */
+struct slab_page {
+	slab_page_t *next;
+	slab_page_t *prev;
+	gc_t *free;
+	unsigned num_free;
+	unsigned num_carved;
+	unsigned num_slots;
 };
 
 typedef struct {
@@ -125,6 +243,48 @@ typedef struct {
 	aptr_t value;
 } global_t;
 
+#ifdef SU_OPT_NAN_BOXING
+
+/* Values are packed into 8 bytes. Anything up to and including -inf is a
+   double; NaNs are canonicalised to a positive quiet NaN on store so the
+   negative NaN space is free. There the five bits above the 47-bit payload
+   hold the type plus one, and the payload holds a pointer or a boolean.
+   This assumes user space pointers fit in 47 bits, as on x86-64 and AArch64. */
+struct value {
+	union {
+		double num;
+		uint64_t bits;
+	} u;
+};
+
+#define NAN_BOX_NUMBER_MAX 0xFFF0000000000000ull
+#define NAN_BOX_CANONICAL 0x7FF8000000000000ull
+#define NAN_BOX_PAYLOAD 0x00007FFFFFFFFFFFull
+#define NAN_BOX(t, p) (NAN_BOX_NUMBER_MAX | ((uint64_t)((t) + 1) << 47) | (uint64_t)(p))
+
+static INLINE uint64_t nan_box_number(double n) {
+	value_t v;
+	v.u.num = n;
+	return n == n ? v.u.bits : NAN_BOX_CANONICAL;
+}
+
+#define VAL_TYPE(v) ((v)->u.bits <= NAN_BOX_NUMBER_MAX ? SU_NUMBER : (int)(((v)->u.bits >> 47) & 0x1F) - 1)
+#define VAL_NUM(v) ((v)->u.num)
+#define VAL_BOOL(v) ((int)((v)->u.bits & 1))
+#define VAL_PTR(v) ((void*)(uintptr_t)((v)->u.bits & NAN_BOX_PAYLOAD))
+#define VAL_NFUNC(v) ((su_nativefunc)(uintptr_t)((v)->u.bits & NAN_BOX_PAYLOAD))
+#define VAL_IS_NUMBER(v) ((v)->u.bits <= NAN_BOX_NUMBER_MAX)
+#define VAL_IS_TRUE(v) ((v)->u.bits != NAN_BOX(SU_NIL, 0) && (v)->u.bits != NAN_BOX(SU_BOOLEAN, 0))
+
+#define SET_NIL(v) ((v)->u.bits = NAN_BOX(SU_NIL, 0))
+#define SET_INV(v) ((v)->u.bits = NAN_BOX(SU_INV, 0))
+#define SET_BOOL(v, x) ((v)->u.bits = NAN_BOX(SU_BOOLEAN, (x) ? 1 : 0))
+#define SET_NUM(v, x) ((v)->u.bits = nan_box_number(x))
+#define SET_OBJ(v, t, p) ((v)->u.bits = NAN_BOX((t), (uintptr_t)(p)))
+#define SET_NFUNC(v, f) SET_OBJ((v), SU_NATIVEFUNC, (f))
+
+#else
+
 struct value {
 	union {
 		int b;
@@ -147,23 +307,92 @@ struct value {
 	unsigned char type;
 };
 
+#define VAL_TYPE(v) ((v)->type)
+#define VAL_NUM(v) ((v)->obj.num)
+#define VAL_BOOL(v) ((v)->obj.b)
+#define VAL_PTR(v) ((v)->obj.ptr)
+#define VAL_NFUNC(v) ((v)->obj.nfunc)
+#define VAL_IS_NUMBER(v) ((v)->type == SU_NUMBER)
+#define VAL_IS_TRUE(v) ((v)->type != SU_NIL && ((v)->type != SU_BOOLEAN || (v)->obj.b))
+
+#define SET_NIL(v) ((v)->type = SU_NIL)
+#define SET_INV(v) ((v)->type = SU_INV)
+#define SET_BOOL(v, x) ((v)->obj.b = (x), (v)->type = SU_BOOLEAN)
+#define SET_NUM(v, x) ((v)->obj.num = (x), (v)->type = SU_NUMBER)
+#define SET_OBJ(v, t, p) ((v)->obj.ptr = (void*)(p), (v)->type = (t))
+#define SET_NFUNC(v, f) ((v)->obj.nfunc = (f), (v)->type = SU_NATIVEFUNC)
+
+#endif
+
+#define VAL_GC(v) ((gc_t*)VAL_PTR(v))
+#define VAL_STR(v) ((string_t*)VAL_PTR(v))
+#define VAL_FUNC(v) ((function_t*)VAL_PTR(v))
+#define VAL_VEC(v) ((vector_t*)VAL_PTR(v))
+#define VAL_VNODE(v) ((vector_node_t*)VAL_PTR(v))
+#define VAL_SEQ(v) ((seq_t*)VAL_PTR(v))
+#define VAL_MAP(v) ((map_t*)VAL_PTR(v))
+#define VAL_MNODE(v) ((node_t*)VAL_PTR(v))
+#define VAL_LOC(v) ((local_t*)VAL_PTR(v))
+#define VAL_GLOB(v) ((global_t*)VAL_PTR(v))
+#define VAL_DATA(v) ((native_data_t*)VAL_PTR(v))
+
 typedef struct {
 	function_t *func;
 	int stack_top;
 	int ret_addr;
+	int nret;
 } frame_t;
 
+/* A registered signature, each argument as a mask of accepted value types. */
+typedef struct {
+	su_nativefunc func;
+	const su_native_sig *sig;
+	unsigned max_narg;
+	int num_typed;
+	unsigned accept[SU_SIG_ARGS];
+} native_sig_t;
+
+#ifdef SU_OPT_PROFILE
+/* Type feedback bits, or'ed together per instruction. */
+enum {
+	FB_NUMBER = 0x1, /* Number operands. */
+	FB_OTHER = 0x2, /* Anything else, or a callee that is not a function. */
+	FB_FUNCTION = 0x4, /* Bytecode callee. */
+	FB_NATIVE = 0x8, /* Native callee. */
+	FB_POLY = 0x10 /* More than one bytecode callee. */
+};
+
+typedef struct {
+	unsigned char op; /* Generic opcode that recorded it. */
+	unsigned char types;
+	prototype_t *callee; /* First bytecode callee, only if it has the same root. */
+} feedback_t;
+#endif
+
 struct prototype {
 	gc_t gc;
 	
 	unsigned num_inst;
 	instruction_t *inst;
+	unsigned max_stack; /* Slots above the frame base, set by verify_prototype. */
 	unsigned num_const;
 	const_t *constants;
+	value_t *values;
 	unsigned num_ups;
 	upvalue_t *upvalues;
 	unsigned num_prot;
 	prototype_t *prot;
+	prototype_t *root;
+	function_t *closure;
+	
+#ifdef SU_JIT
+	jit_t *jit;
+	unsigned jit_hotness;
+#endif
+
+#ifdef SU_OPT_PROFILE
+	feedback_t *feedback;
+#endif
 	
 	const_string_t *name;
 	unsigned num_lineinf;
@@ -174,8 +403,6 @@ struct function {
 	gc_t gc;
 	int narg;
 	prototype_t *prot;
-	unsigned num_const;
-	value_t *constants;
 	unsigned num_ups;
 	value_t *upvalues;
 };
@@ -185,6 +412,25 @@ typedef struct {
 	string_t *str;
 } string_cache_t;
 
+typedef struct {
+	const instruction_t *inst;
+	const void *key;
+	unsigned gc_cycle;
+	value_t value;
+} inline_cache_t;
+
+typedef struct {
+	unsigned long count;
+	unsigned long total_us;
+	unsigned long max_us;
+} gc_pause_t;
+
+typedef struct {
+	unsigned char last_op;
+	unsigned long op_count[VM_STATS_OPS];
+	unsigned long pair_count[VM_STATS_OPS][VM_STATS_OPS];
+} vm_stats_t;
+
 struct state {
 	gc_t gc;
 	
@@ -195,8 +441,33 @@ struct state {
 	string_cache_t string_cache[16][STRING_CACHE_SIZE];
 	int string_cache_head[16];
 	
-	gc_t *gray[GC_GRAY_SIZE];
+	inline_cache_t inline_cache[INLINE_CACHE_SIZE];
+	
+	gc_t **gray;
 	unsigned gray_size;
+	unsigned gray_cap;
+	
+	/* Only used while the thread marks in a pause. Others steal from the
+	   shared stack. */
+	gc_t **mark;
+	unsigned mark_size;
+	unsigned mark_cap;
+	gc_t **mark_shared;
+	unsigned mark_shared_size;
+	unsigned mark_shared_cap;
+	aint_t mark_lock;
+	
+	/* Objects allocated by this thread, merged into gc_root by the next
+	   collection. The list belongs to the thread slot and outlives the
+	   thread, like the stacks. */
+	gc_t *gc_list;
+	gc_t *gc_list_tail;
+	int gc_list_count;
+	
+	/* Free slots per size class, refilled a page at a time, and the pages
+	   this thread is still carving. */
+	gc_t *slab_cache[SLAB_CLASSES];
+	slab_page_t *slab_fresh[SLAB_CLASSES];
 	
 	int debug_mask;
 	void *debug_cb_data;
@@ -208,6 +479,7 @@ struct state {
 	jmp_buf err;
 	int errtop;
 	int ferrtop;
+	int nerrtop;
 	
 	frame_t *frame;
 	prototype_t *prot;
@@ -218,32 +490,70 @@ struct state {
 	aint_t thread_finished;
 	int tid;
 	
+#ifdef SU_OPT_VM_STATS
+	vm_stats_t stats;
+#endif
+	
 	int frame_top;
-	frame_t frames[MAX_CALLS];
+	int native_top;
+	int frame_size;
+	int frame_limit;
+	frame_t *frames;
 	
 	int stack_top;
-	value_t stack[STACK_SIZE];
+	int stack_size;
+	int stack_limit;
+	value_t *stack;
 	
 	main_state_internal_t *msi;
 };
 
 struct main_state_internal {
 	aint_t gc_lock;
-	aint_t gc_list_lock;
 	gc_t *gc_root;
-	gc_t *gc_gray[GC_GRAY_SIZE];
+	gc_t *gc_sweep; /* Objects of the last marking phase not yet swept. */
+	gc_t **gc_gray;
 	int gc_state;
+	unsigned gc_cycle;
 	unsigned gc_gray_size;
+	unsigned gc_gray_cap;
 	aint_t gc_throttle;
-	int gc_num_objects;
 	aint_t num_objects;
 	
+	/* Objects on gc_root, the rest are young. */
+	int gc_num_old;
+	gc_t **gc_young;
+	unsigned gc_young_size;
+	unsigned gc_young_cap;
+	aint_t gc_traced_natives;
+	
+	/* Parallel marking in a pause, see mark_parallel. Helper slots are only
+	   open while the pause marks. */
+	int gc_mark_cores;
+	aint_t gc_mark_slots;
+	aint_t gc_mark_helpers;
+	aint_t gc_mark_active;
+	
+#ifdef SU_OPT_VM_STATS
+	gc_pause_t gc_pauses[2]; /* Stop-the-world time of major and minor collections. */
+#endif
+	
+	aint_t slab_lock;
+	slab_page_t *slab_pages[SLAB_CLASSES];
+	
 	int num_c_lambdas;
 	value_t *c_lambdas;
 	
+	int num_native_sigs;
+	native_sig_t native_sigs[NATIVE_SIG_SIZE];
+	
 	aint_t interrupt;
 	char *ref_counter;
 	
+#ifdef SU_JIT
+	aint_t jit_lock;
+#endif
+	
 	aint_t tid_count;
 	aint_t thread_count;
 	aint_t thread_pool_lock;
@@ -255,6 +565,8 @@ unsigned hash_value(value_t *v);
 void push_value(su_state *s, value_t *v);
 int value_eq(value_t *a, value_t *b);
 int read_prototype(su_state *s, reader_buffer_t *buffer, prototype_t *prot);
+int verify_prototype(su_state *s, prototype_t *prot, int narg);
+void *gc_allocate(su_state *s, size_t n);
 gc_t *gc_insert_object(su_state *s, gc_t *obj, su_object_type_t type);
 gc_t *string_from_cache(su_state *s, const char *str, unsigned size);
 unsigned murmur(const void *key, int len, unsigned seed);
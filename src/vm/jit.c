@@ -0,0 +1,811 @@
+/*
+ * S A U R U S
+ * Copyright (c) 2009-2015 Andreas T Jonsson <andreas@saurus.org>
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#include "saurus.h"
+#include "jit.h"
+
+#ifdef SU_JIT
+
+#include <stddef.h>
+#include <string.h>
+#include <assert.h>
+#include <sys/mman.h>
+
+/*
+ * Baseline compiler for x86-64. Every instruction is translated from a fixed
+ * template that works on the interpreter stack in memory, so any instruction
+ * boundary is a valid entry point and the interpreter can take over at any pc.
+ * Instructions without a template, and templates whose guards fail, exit with
+ * the pc of the instruction and let the interpreter run it, which also makes
+ * the interpreter responsible for all error reporting.
+ *
+ * Pinned registers:
+ *   rbx  sp
+ *   r12  base
+ *   r13  constants
+ *   r14  context
+ *   r15  stack end
+ */
+
+enum {
+	RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+	R8, R9, R10, R11, R12, R13, R14, R15
+};
+
+enum {
+	CC_AE = 0x3, CC_E = 0x4, CC_NE = 0x5,
+	CC_A = 0x7, CC_P = 0xA,
+	CC_JMP = -1
+};
+
+#define SP RBX
+#define BASE R12
+#define CONSTANTS R13
+#define CTX R14
+#define STACK_END R15
+
+#define SLOT(n) ((int)(n) * (int)sizeof(value_t))
+#define TYPE_OFFSET (int)offsetof(value_t, type)
+#define CTX_OFFSET(field) (int)offsetof(jit_context_t, field)
+
+typedef struct {
+	int offset;
+	int target;
+	int exit;
+} fixup_t;
+
+typedef struct {
+	prototype_t *prot;
+	void *(*alloc)(void*, size_t);
+	unsigned char *buf;
+	size_t size, cap;
+	int *label;
+	int *exit;
+	fixup_t *fixups;
+	int num_fixups, max_fixups;
+	int epilogue;
+	int failed;
+} emitter_t;
+
+/* A value operand, a frame slot, a constant or a slot relative to sp. */
+typedef struct {
+	int base;
+	int disp;
+} operand_t;
+
+static void emit_byte(emitter_t *e, int b) {
+	unsigned char *buf;
+	if (e->failed)
+		return;
+	if (e->size == e->cap) {
+		buf = (unsigned char*)e->alloc(e->buf, e->cap * 2);
+		if (!buf) {
+			e->failed = 1;
+			return;
+		}
+		e->buf = buf;
+		e->cap *= 2;
+	}
+	e->buf[e->size++] = (unsigned char)b;
+}
+
+static void emit_u32(emitter_t *e, unsigned v) {
+	emit_byte(e, v & 0xFF);
+	emit_byte(e, (v >> 8) & 0xFF);
+	emit_byte(e, (v >> 16) & 0xFF);
+	emit_byte(e, (v >> 24) & 0xFF);
+}
+
+static void emit_u64(emitter_t *e, unsigned long long v) {
+	emit_u32(e, (unsigned)v);
+	emit_u32(e, (unsigned)(v >> 32));
+}
+
+static void patch_u32(emitter_t *e, int offset, unsigned v) {
+	if (e->failed)
+		return;
+	e->buf[offset] = v & 0xFF;
+	e->buf[offset + 1] = (v >> 8) & 0xFF;
+	e->buf[offset + 2] = (v >> 16) & 0xFF;
+	e->buf[offset + 3] = (v >> 24) & 0xFF;
+}
+
+static void emit_opcode(emitter_t *e, int prefix, int w, int reg, int rm, int op1, int op2) {
+	int rex = 0x40 | (w ? 8 : 0) | ((reg & 8) ? 4 : 0) | ((rm & 8) ? 1 : 0);
+	if (prefix >= 0)
+		emit_byte(e, prefix);
+	if (rex != 0x40)
+		emit_byte(e, rex);
+	emit_byte(e, op1);
+	if (op2 >= 0)
+		emit_byte(e, op2);
+}
+
+/* op reg, [base + disp32] */
+static void emit_mem(emitter_t *e, int prefix, int w, int op1, int op2, int reg, int base, int disp) {
+	emit_opcode(e, prefix, w, reg, base, op1, op2);
+	emit_byte(e, 0x80 | ((reg & 7) << 3) | (base & 7));
+	if ((base & 7) == RSP)
+		emit_byte(e, 0x24);
+	emit_u32(e, (unsigned)disp);
+}
+
+/* op reg, rm */
+static void emit_reg(emitter_t *e, int prefix, int w, int op1, int op2, int reg, int rm) {
+	emit_opcode(e, prefix, w, reg, rm, op1, op2);
+	emit_byte(e, 0xC0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+#define MOV_LOAD(e, r, b, d)        emit_mem((e), -1, 1, 0x8B, -1, (r), (b), (d))
+#define MOV_STORE(e, b, d, r)       emit_mem((e), -1, 1, 0x89, -1, (r), (b), (d))
+#define MOV32_LOAD(e, r, b, d)      emit_mem((e), -1, 0, 0x8B, -1, (r), (b), (d))
+#define MOV32_STORE(e, b, d, r)     emit_mem((e), -1, 0, 0x89, -1, (r), (b), (d))
+#define OR32_LOAD(e, r, b, d)       emit_mem((e), -1, 0, 0x0B, -1, (r), (b), (d))
+#define LEA(e, r, b, d)             emit_mem((e), -1, 1, 0x8D, -1, (r), (b), (d))
+#define MOVZX8_LOAD(e, r, b, d)     emit_mem((e), -1, 0, 0x0F, 0xB6, (r), (b), (d))
+#define MOVUPS_LOAD(e, x, b, d)     emit_mem((e), -1, 0, 0x0F, 0x10, (x), (b), (d))
+#define MOVUPS_STORE(e, b, d, x)    emit_mem((e), -1, 0, 0x0F, 0x11, (x), (b), (d))
+#define MOVSD_LOAD(e, x, b, d)      emit_mem((e), 0xF2, 0, 0x0F, 0x10, (x), (b), (d))
+#define MOVSD_STORE(e, b, d, x)     emit_mem((e), 0xF2, 0, 0x0F, 0x11, (x), (b), (d))
+#define SSE_OP(e, op, x, b, d)      emit_mem((e), 0xF2, 0, 0x0F, (op), (x), (b), (d))
+#define UCOMISD(e, x, b, d)         emit_mem((e), 0x66, 0, 0x0F, 0x2E, (x), (b), (d))
+#define UCOMISD_REG(e, x, y)        emit_reg((e), 0x66, 0, 0x0F, 0x2E, (x), (y))
+#define MOV_REG(e, dst, src)        emit_reg((e), -1, 1, 0x89, -1, (src), (dst))
+#define CMP_REG(e, a, b)            emit_reg((e), -1, 1, 0x39, -1, (b), (a))
+
+#define SSE_ADD 0x58
+#define SSE_MUL 0x59
+#define SSE_SUB 0x5C
+#define SSE_DIV 0x5E
+
+static void emit_store_byte(emitter_t *e, int base, int disp, int imm) {
+	emit_mem(e, -1, 0, 0xC6, -1, 0, base, disp);
+	emit_byte(e, imm);
+}
+
+static void emit_store_u32(emitter_t *e, int base, int disp, int imm) {
+	emit_mem(e, -1, 0, 0xC7, -1, 0, base, disp);
+	emit_u32(e, (unsigned)imm);
+}
+
+static void emit_cmp_byte(emitter_t *e, int base, int disp, int imm) {
+	emit_mem(e, -1, 0, 0x80, -1, 7, base, disp);
+	emit_byte(e, imm);
+}
+
+static void emit_cmp_u32(emitter_t *e, int base, int disp, int imm) {
+	emit_mem(e, -1, 0, 0x81, -1, 7, base, disp);
+	emit_u32(e, (unsigned)imm);
+}
+
+/* add/sub reg, imm32 */
+static void emit_add_imm(emitter_t *e, int reg, int imm) {
+	if (imm == 0)
+		return;
+	emit_reg(e, -1, 1, 0x81, -1, imm > 0 ? 0 : 5, reg);
+	emit_u32(e, (unsigned)(imm > 0 ? imm : -imm));
+}
+
+static void emit_call(emitter_t *e, const void *fn) {
+	emit_opcode(e, -1, 1, 0, RAX, 0xB8, -1);
+	emit_u64(e, (unsigned long long)(size_t)fn);
+	emit_reg(e, -1, 0, 0xFF, -1, 2, RAX);
+}
+
+/* Record a rel32 to an instruction label or to an exit stub. */
+static void emit_jump(emitter_t *e, int cc, int target, int exit) {
+	if (cc == CC_JMP) {
+		emit_byte(e, 0xE9);
+	} else {
+		emit_byte(e, 0x0F);
+		emit_byte(e, 0x80 | cc);
+	}
+	if (e->failed)
+		return;
+	if (e->num_fixups == e->max_fixups) {
+		fixup_t *fixups = (fixup_t*)e->alloc(e->fixups, sizeof(fixup_t) * e->max_fixups * 2);
+		if (!fixups) {
+			e->failed = 1;
+			return;
+		}
+		e->fixups = fixups;
+		e->max_fixups *= 2;
+	}
+	e->fixups[e->num_fixups].offset = (int)e->size;
+	e->fixups[e->num_fixups].target = target;
+	e->fixups[e->num_fixups].exit = exit;
+	e->num_fixups++;
+	emit_u32(e, 0);
+}
+
+/* Jumps within a template, patched with patch_local once the target is known. */
+static int emit_local(emitter_t *e, int cc) {
+	if (cc == CC_JMP) {
+		emit_byte(e, 0xE9);
+	} else {
+		emit_byte(e, 0x0F);
+		emit_byte(e, 0x80 | cc);
+	}
+	emit_u32(e, 0);
+	return (int)e->size - 4;
+}
+
+static void patch_local(emitter_t *e, int offset) {
+	patch_u32(e, offset, (unsigned)((int)e->size - (offset + 4)));
+}
+
+static void emit_exit(emitter_t *e, int cc, int pc) {
+	emit_jump(e, cc, pc, 1);
+}
+
+/* Same safepoint check as the interpreter, exiting with the pc to resume at. */
+static void emit_poll(emitter_t *e, int pc) {
+	MOV_LOAD(e, RAX, CTX, CTX_OFFSET(interrupt));
+	MOV32_LOAD(e, RAX, RAX, 0);
+	MOV_LOAD(e, RCX, CTX, CTX_OFFSET(global_interrupt));
+	OR32_LOAD(e, RAX, RCX, 0);
+	emit_exit(e, CC_NE, pc);
+}
+
+static void emit_goto(emitter_t *e, int from, int target) {
+	if (target <= from)
+		emit_poll(e, target);
+	emit_jump(e, CC_JMP, target, 0);
+}
+
+static void emit_branch(emitter_t *e, int cc, int from, int target) {
+	int skip;
+	if (target > from) {
+		emit_jump(e, cc, target, 0);
+	} else {
+		skip = emit_local(e, cc ^ 1);
+		emit_goto(e, from, target);
+		patch_local(e, skip);
+	}
+}
+
+static void emit_check_stack(emitter_t *e, int slots, int pc) {
+	LEA(e, RAX, SP, SLOT(slots - 1));
+	CMP_REG(e, RAX, STACK_END);
+	emit_exit(e, CC_AE, pc);
+}
+
+static void emit_copy(emitter_t *e, operand_t dst, operand_t src) {
+	MOVUPS_LOAD(e, 0, src.base, src.disp);
+	MOVUPS_STORE(e, dst.base, dst.disp, 0);
+}
+
+/* Constants are immutable, so their type is checked while compiling. */
+static void emit_guard(emitter_t *e, operand_t v, int type, int pc) {
+	if (v.base == CONSTANTS) {
+		if (VAL_TYPE(&e->prot->values[v.disp / SLOT(1)]) != type)
+			emit_exit(e, CC_JMP, pc);
+	} else {
+		emit_cmp_byte(e, v.base, v.disp + TYPE_OFFSET, type);
+		emit_exit(e, CC_NE, pc);
+	}
+}
+
+static void emit_set_bool(emitter_t *e, operand_t dst) {
+	emit_reg(e, -1, 0, 0x0F, 0xB6, RAX, RAX);
+	MOV32_STORE(e, dst.base, dst.disp, RAX);
+	emit_store_byte(e, dst.base, dst.disp + TYPE_OFFSET, SU_BOOLEAN);
+}
+
+/* a < b and a <= b as b > a and b >= a, which are false when unordered. */
+static void emit_compare(emitter_t *e, operand_t a, operand_t b) {
+	MOVSD_LOAD(e, 0, b.base, b.disp);
+	UCOMISD(e, 0, a.base, a.disp);
+}
+
+static void emit_setcc(emitter_t *e, int cc) {
+	emit_byte(e, 0x0F);
+	emit_byte(e, 0x90 | cc);
+	emit_byte(e, 0xC0);
+}
+
+static void emit_value_eq(emitter_t *e, operand_t a, operand_t b) {
+	LEA(e, RDI, a.base, a.disp);
+	LEA(e, RSI, b.base, b.disp);
+	emit_call(e, (const void*)value_eq);
+}
+
+static void emit_helper(emitter_t *e, void (*helper)(jit_context_t*), int pc) {
+	MOV_STORE(e, CTX, CTX_OFFSET(sp), SP);
+	emit_store_u32(e, CTX, CTX_OFFSET(pc), pc);
+	MOV_REG(e, RDI, CTX);
+	emit_call(e, (const void*)helper);
+	MOV_LOAD(e, SP, CTX, CTX_OFFSET(sp));
+}
+
+static operand_t operand(int base, int disp) {
+	operand_t v;
+	v.base = base;
+	v.disp = disp;
+	return v;
+}
+
+static int arith_op(int id) {
+	switch (id) {
+		case OP_ADD: case OP_ADD_NN: case OP_ADD_LL: case OP_ADD_LK:
+			return SSE_ADD;
+		case OP_SUB: case OP_SUB_NN: case OP_SUB_LL: case OP_SUB_LK: case OP_SUB_KL:
+			return SSE_SUB;
+		default:
+			return SSE_MUL;
+	}
+}
+
+static int is_lequal(int id) {
+	switch (id) {
+		case OP_LEQUAL: case OP_LEQUAL_NN: case OP_LEQUAL_LL: case OP_LEQUAL_LK: case OP_LEQUAL_KL:
+		case OP_LEQUAL_LL_TEST: case OP_LEQUAL_LK_TEST: case OP_LEQUAL_KL_TEST:
+			return 1;
+	}
+	return 0;
+}
+
+/* Operands of the _LL, _LK and _KL forms, in the order the interpreter reads them. */
+static void operands(int id, instruction_t inst, operand_t *a, operand_t *b) {
+	switch (id) {
+		case OP_ADD_LL: case OP_SUB_LL: case OP_MUL_LL: case OP_EQ_LL: case OP_LESS_LL: case OP_LEQUAL_LL:
+		case OP_EQ_LL_TEST: case OP_LESS_LL_TEST: case OP_LEQUAL_LL_TEST:
+			*a = operand(BASE, SLOT(inst.a));
+			*b = operand(BASE, SLOT(inst.b));
+			break;
+		case OP_SUB_KL: case OP_LESS_KL: case OP_LEQUAL_KL: case OP_LESS_KL_TEST: case OP_LEQUAL_KL_TEST:
+			*a = operand(CONSTANTS, SLOT(inst.b));
+			*b = operand(BASE, SLOT(inst.a));
+			break;
+		default:
+			*a = operand(BASE, SLOT(inst.a));
+			*b = operand(CONSTANTS, SLOT(inst.b));
+	}
+}
+
+/* Emits the template for code[pc] as instruction id, returns zero if there
+   is none. */
+static int emit_instruction(emitter_t *e, instruction_t *code, int pc, int id) {
+	instruction_t inst = code[pc];
+	operand_t a, b, top = operand(SP, 0);
+	int i, skip, done;
+
+	inst.id = (unsigned char)id;
+	switch (inst.id) {
+		case OP_PUSH:
+			emit_check_stack(e, 1, pc);
+			emit_copy(e, top, operand(CONSTANTS, SLOT(inst.a)));
+			emit_add_imm(e, SP, SLOT(1));
+			return 1;
+		case OP_POP:
+			emit_add_imm(e, SP, -SLOT(inst.a));
+			return 1;
+		case OP_LOAD:
+			emit_check_stack(e, 1, pc);
+			emit_copy(e, top, operand(BASE, SLOT(inst.a)));
+			emit_add_imm(e, SP, SLOT(1));
+			return 1;
+		case OP_LOAD_LOAD:
+			emit_check_stack(e, 2, pc);
+			emit_copy(e, top, operand(BASE, SLOT(inst.a)));
+			emit_copy(e, operand(SP, SLOT(1)), operand(BASE, SLOT(code[pc + 1].a)));
+			emit_add_imm(e, SP, SLOT(2));
+			return 1;
+		case OP_LUP:
+			emit_check_stack(e, 1, pc);
+			MOV_LOAD(e, RAX, CTX, CTX_OFFSET(upvalues));
+			emit_copy(e, top, operand(RAX, SLOT(inst.a)));
+			emit_add_imm(e, SP, SLOT(1));
+			return 1;
+		case OP_STORE:
+			for (i = 0; i < inst.a; i++)
+				emit_copy(e, operand(BASE, SLOT(inst.b + i)), operand(SP, SLOT(i - inst.a)));
+			LEA(e, SP, BASE, SLOT(inst.b + inst.a));
+			return 1;
+		case OP_SHIFT:
+		case OP_SHIFT_JMP:
+			if (inst.a) {
+				emit_copy(e, operand(SP, -SLOT(inst.a + 1)), operand(SP, -SLOT(1)));
+				emit_add_imm(e, SP, -SLOT(inst.a));
+			}
+			if (inst.id == OP_SHIFT_JMP)
+				emit_goto(e, pc, code[pc + 1].b);
+			return 1;
+		case OP_JMP:
+			emit_goto(e, pc, inst.b);
+			return 1;
+		case OP_TEST:
+			emit_add_imm(e, SP, -SLOT(1));
+			MOVZX8_LOAD(e, RAX, SP, TYPE_OFFSET);
+			emit_byte(e, 0x3C); emit_byte(e, SU_NIL);
+			skip = emit_local(e, CC_E);
+			emit_byte(e, 0x3C); emit_byte(e, SU_BOOLEAN);
+			i = emit_local(e, CC_NE);
+			emit_cmp_u32(e, SP, 0, 0);
+			done = emit_local(e, CC_E);
+			patch_local(e, i);
+			emit_goto(e, pc, inst.b);
+			patch_local(e, skip);
+			patch_local(e, done);
+			return 1;
+		case OP_ADD: case OP_ADD_NN:
+		case OP_SUB: case OP_SUB_NN:
+		case OP_MUL: case OP_MUL_NN:
+			emit_guard(e, operand(SP, -SLOT(2)), SU_NUMBER, pc);
+			emit_guard(e, operand(SP, -SLOT(1)), SU_NUMBER, pc);
+			MOVSD_LOAD(e, 0, SP, -SLOT(2));
+			SSE_OP(e, arith_op(inst.id), 0, SP, -SLOT(1));
+			MOVSD_STORE(e, SP, -SLOT(2), 0);
+			emit_add_imm(e, SP, -SLOT(1));
+			return 1;
+		case OP_DIV:
+			emit_guard(e, operand(SP, -SLOT(2)), SU_NUMBER, pc);
+			emit_guard(e, operand(SP, -SLOT(1)), SU_NUMBER, pc);
+			MOVSD_LOAD(e, 1, SP, -SLOT(1));
+			emit_reg(e, -1, 0, 0x0F, 0x57, 2, 2);
+			UCOMISD_REG(e, 1, 2);
+			skip = emit_local(e, CC_P);
+			emit_exit(e, CC_E, pc);
+			patch_local(e, skip);
+			MOVSD_LOAD(e, 0, SP, -SLOT(2));
+			emit_reg(e, 0xF2, 0, 0x0F, SSE_DIV, 0, 1);
+			MOVSD_STORE(e, SP, -SLOT(2), 0);
+			emit_add_imm(e, SP, -SLOT(1));
+			return 1;
+		case OP_UNM:
+			emit_guard(e, operand(SP, -SLOT(1)), SU_NUMBER, pc);
+			MOV_LOAD(e, RAX, SP, -SLOT(1));
+			emit_reg(e, -1, 1, 0x0F, 0xBA, 7, RAX);
+			emit_byte(e, 63);
+			MOV_STORE(e, SP, -SLOT(1), RAX);
+			return 1;
+		case OP_LESS: case OP_LESS_NN:
+		case OP_LEQUAL: case OP_LEQUAL_NN:
+			a = operand(SP, -SLOT(2));
+			b = operand(SP, -SLOT(1));
+			emit_guard(e, a, SU_NUMBER, pc);
+			emit_guard(e, b, SU_NUMBER, pc);
+			emit_compare(e, a, b);
+			emit_setcc(e, is_lequal(inst.id) ? CC_AE : CC_A);
+			emit_set_bool(e, a);
+			emit_add_imm(e, SP, -SLOT(1));
+			return 1;
+		case OP_EQ:
+			emit_value_eq(e, operand(SP, -SLOT(2)), operand(SP, -SLOT(1)));
+			emit_set_bool(e, operand(SP, -SLOT(2)));
+			emit_add_imm(e, SP, -SLOT(1));
+			return 1;
+		case OP_NOT:
+			a = operand(SP, -SLOT(1));
+			MOVZX8_LOAD(e, RCX, SP, -SLOT(1) + TYPE_OFFSET);
+			emit_byte(e, 0x80); emit_byte(e, 0xF9); emit_byte(e, SU_BOOLEAN);
+			skip = emit_local(e, CC_NE);
+			emit_cmp_u32(e, a.base, a.disp, 0);
+			emit_setcc(e, CC_E);
+			done = emit_local(e, CC_JMP);
+			patch_local(e, skip);
+			emit_byte(e, 0x80); emit_byte(e, 0xF9); emit_byte(e, SU_NIL);
+			emit_setcc(e, CC_E);
+			patch_local(e, done);
+			emit_set_bool(e, a);
+			return 1;
+		case OP_ADD_LL: case OP_ADD_LK:
+		case OP_SUB_LL: case OP_SUB_LK: case OP_SUB_KL:
+		case OP_MUL_LL: case OP_MUL_LK:
+			operands(inst.id, inst, &a, &b);
+			emit_guard(e, a, SU_NUMBER, pc);
+			emit_guard(e, b, SU_NUMBER, pc);
+			emit_check_stack(e, 1, pc);
+			MOVSD_LOAD(e, 0, a.base, a.disp);
+			SSE_OP(e, arith_op(inst.id), 0, b.base, b.disp);
+			MOVSD_STORE(e, SP, 0, 0);
+			emit_store_byte(e, SP, TYPE_OFFSET, SU_NUMBER);
+			emit_add_imm(e, SP, SLOT(1));
+			return 1;
+		case OP_LESS_LL: case OP_LESS_LK: case OP_LESS_KL:
+		case OP_LEQUAL_LL: case OP_LEQUAL_LK: case OP_LEQUAL_KL:
+			operands(inst.id, inst, &a, &b);
+			emit_guard(e, a, SU_NUMBER, pc);
+			emit_guard(e, b, SU_NUMBER, pc);
+			emit_check_stack(e, 1, pc);
+			emit_compare(e, a, b);
+			emit_setcc(e, is_lequal(inst.id) ? CC_AE : CC_A);
+			emit_set_bool(e, top);
+			emit_add_imm(e, SP, SLOT(1));
+			return 1;
+		case OP_EQ_LL: case OP_EQ_LK:
+			operands(inst.id, inst, &a, &b);
+			emit_check_stack(e, 1, pc);
+			emit_value_eq(e, a, b);
+			emit_set_bool(e, top);
+			emit_add_imm(e, SP, SLOT(1));
+			return 1;
+		case OP_LESS_LL_TEST: case OP_LESS_LK_TEST: case OP_LESS_KL_TEST:
+		case OP_LEQUAL_LL_TEST: case OP_LEQUAL_LK_TEST: case OP_LEQUAL_KL_TEST:
+			operands(inst.id, inst, &a, &b);
+			emit_guard(e, a, SU_NUMBER, pc);
+			emit_guard(e, b, SU_NUMBER, pc);
+			emit_compare(e, a, b);
+			emit_branch(e, is_lequal(inst.id) ? CC_AE : CC_A, pc, code[pc + 1].b);
+			return 1;
+		case OP_EQ_LL_TEST: case OP_EQ_LK_TEST:
+			operands(inst.id, inst, &a, &b);
+			emit_value_eq(e, a, b);
+			emit_reg(e, -1, 0, 0x85, -1, RAX, RAX);
+			emit_branch(e, CC_NE, pc, code[pc + 1].b);
+			return 1;
+		case OP_FORLOOP:
+			/* [end, counter, result], see the interpreter. */
+			MOVSD_LOAD(e, 0, SP, -SLOT(3));
+			MOVSD_LOAD(e, 1, SP, -SLOT(2));
+			emit_opcode(e, -1, 1, 0, RAX, 0xB8, -1);
+			emit_u64(e, 0x3FF0000000000000ull);
+			emit_reg(e, 0x66, 1, 0x0F, 0x6E, 2, RAX);
+			UCOMISD_REG(e, 0, 1);
+			skip = emit_local(e, CC_A);
+			emit_reg(e, 0xF2, 0, 0x0F, SSE_SUB, 1, 2);
+			done = emit_local(e, CC_JMP);
+			patch_local(e, skip);
+			emit_reg(e, 0xF2, 0, 0x0F, SSE_ADD, 1, 2);
+			patch_local(e, done);
+			MOVSD_STORE(e, SP, -SLOT(2), 1);
+			UCOMISD_REG(e, 1, 0);
+			skip = emit_local(e, CC_NE);
+			i = emit_local(e, CC_P);
+			emit_copy(e, operand(SP, -SLOT(3)), operand(SP, -SLOT(1)));
+			emit_add_imm(e, SP, -SLOT(2));
+			done = emit_local(e, CC_JMP);
+			patch_local(e, skip);
+			patch_local(e, i);
+			emit_add_imm(e, SP, -SLOT(1));
+			emit_goto(e, pc, inst.b);
+			patch_local(e, done);
+			return 1;
+		case OP_GETGLOBAL:
+			emit_check_stack(e, 1, pc);
+			emit_helper(e, jit_getglobal, pc);
+			return 1;
+		case OP_GETFIELD:
+			emit_guard(e, operand(SP, -SLOT(1)), SU_MAP, pc);
+			emit_helper(e, jit_getfield, pc);
+			return 1;
+		case OP_CALL:
+			/* Only native callees with a single result, anything else needs a
+			   new frame. */
+			if (inst.b > 1)
+				return 0;
+			emit_guard(e, operand(SP, -SLOT(inst.a + 1)), SU_NATIVEFUNC, pc);
+			emit_helper(e, jit_call, pc);
+			/* The callee may have grown the stack. */
+			MOV_LOAD(e, BASE, CTX, CTX_OFFSET(base));
+			MOV_LOAD(e, STACK_END, CTX, CTX_OFFSET(stack_end));
+			emit_poll(e, pc + 1);
+			return 1;
+	}
+	return 0;
+}
+
+static int instruction_size(int id) {
+	switch (id) {
+		case OP_EQ_LL_TEST: case OP_EQ_LK_TEST:
+		case OP_LESS_LL_TEST: case OP_LESS_LK_TEST: case OP_LESS_KL_TEST:
+		case OP_LEQUAL_LL_TEST: case OP_LEQUAL_LK_TEST: case OP_LEQUAL_KL_TEST:
+		case OP_SHIFT_JMP: case OP_LOAD_LOAD:
+			return 2;
+	}
+	return 1;
+}
+
+/* The first instruction of a superinstruction pair. */
+static int unfused(int id) {
+	switch (id) {
+		case OP_EQ_LL_TEST: return OP_EQ_LL;
+		case OP_EQ_LK_TEST: return OP_EQ_LK;
+		case OP_LESS_LL_TEST: return OP_LESS_LL;
+		case OP_LESS_LK_TEST: return OP_LESS_LK;
+		case OP_LESS_KL_TEST: return OP_LESS_KL;
+		case OP_LEQUAL_LL_TEST: return OP_LEQUAL_LL;
+		case OP_LEQUAL_LK_TEST: return OP_LEQUAL_LK;
+		case OP_LEQUAL_KL_TEST: return OP_LEQUAL_KL;
+		case OP_SHIFT_JMP: return OP_SHIFT;
+		case OP_LOAD_LOAD: return OP_LOAD;
+	}
+	return id;
+}
+
+static int jump_target(instruction_t *code, int pc) {
+	switch (code[pc].id) {
+		case OP_JMP: case OP_TEST: case OP_FOR: case OP_FORLOOP:
+			return code[pc].b;
+	}
+	if (instruction_size(code[pc].id) == 2 && code[pc].id != OP_LOAD_LOAD)
+		return code[pc + 1].b;
+	return -1;
+}
+
+static const int saved_regs[] = { RBP, RBX, R12, R13, R14, R15 };
+
+static void emit_prologue(emitter_t *e) {
+	int i;
+	for (i = 0; i < 6; i++) {
+		if (saved_regs[i] & 8)
+			emit_byte(e, 0x41);
+		emit_byte(e, 0x50 | (saved_regs[i] & 7));
+	}
+	emit_add_imm(e, RSP, -8);
+	MOV_REG(e, CTX, RDI);
+	MOV_LOAD(e, SP, CTX, CTX_OFFSET(sp));
+	MOV_LOAD(e, BASE, CTX, CTX_OFFSET(base));
+	MOV_LOAD(e, CONSTANTS, CTX, CTX_OFFSET(constants));
+	MOV_LOAD(e, STACK_END, CTX, CTX_OFFSET(stack_end));
+	emit_reg(e, -1, 0, 0xFF, -1, 4, RSI);
+
+	e->epilogue = (int)e->size;
+	MOV_STORE(e, CTX, CTX_OFFSET(sp), SP);
+	MOV32_LOAD(e, RAX, CTX, CTX_OFFSET(pc));
+	emit_add_imm(e, RSP, 8);
+	for (i = 5; i >= 0; i--) {
+		if (saved_regs[i] & 8)
+			emit_byte(e, 0x41);
+		emit_byte(e, 0x58 | (saved_regs[i] & 7));
+	}
+	emit_byte(e, 0xC3);
+}
+
+static void emit_exit_stub(emitter_t *e, int pc) {
+	e->exit[pc] = (int)e->size;
+	emit_store_u32(e, CTX, CTX_OFFSET(pc), pc);
+	emit_byte(e, 0xE9);
+	emit_u32(e, (unsigned)(e->epilogue - ((int)e->size + 4)));
+}
+
+static jit_t *compile(su_state *s, prototype_t *prot) {
+	emitter_t e;
+	jit_t *jit = NULL;
+	int i, n, id, target, num_inst = (int)prot->num_inst;
+	unsigned char *code = NULL;
+
+	memset(&e, 0, sizeof(emitter_t));
+	e.prot = prot;
+	e.alloc = s->alloc;
+	e.cap = 4096;
+	e.max_fixups = 64;
+	e.buf = (unsigned char*)s->alloc(NULL, e.cap);
+	e.fixups = (fixup_t*)s->alloc(NULL, sizeof(fixup_t) * e.max_fixups);
+	e.label = (int*)s->alloc(NULL, sizeof(int) * (num_inst + 1));
+	e.exit = (int*)s->alloc(NULL, sizeof(int) * (num_inst + 1));
+	jit = (jit_t*)s->alloc(NULL, sizeof(jit_t));
+	if (jit) memset(jit, 0, sizeof(jit_t));
+	if (jit) jit->entry = (const void**)s->alloc(NULL, sizeof(void*) * num_inst);
+	if (!e.buf || !e.fixups || !e.label || !e.exit || !jit || !jit->entry)
+		goto error;
+
+	for (i = 0; i <= num_inst; i++)
+		e.label[i] = e.exit[i] = -1;
+	memset(jit->entry, 0, sizeof(void*) * num_inst);
+
+	/* Jumps may land on the operand word of a pair, which then needs a label
+	   of its own. Such pairs are compiled as two instructions. Labels mark
+	   the targets until code is emitted. */
+	for (i = 0; i < num_inst; i++) {
+		target = jump_target(prot->inst, i);
+		if (target >= 0 && target < num_inst)
+			e.label[target] = 0;
+	}
+
+	/* Entries hold code offsets until the code has been placed. */
+	emit_prologue(&e);
+	for (i = 0; i < num_inst; i += n) {
+		id = prot->inst[i].id;
+		n = instruction_size(id);
+		if (n == 2 && !e.label[i + 1]) {
+			id = unfused(id);
+			n = 1;
+		}
+		e.label[i] = (int)e.size;
+		if (emit_instruction(&e, prot->inst, i, id))
+			jit->entry[i] = (const void*)(size_t)e.label[i];
+		else
+			emit_exit(&e, CC_JMP, i);
+	}
+	e.label[num_inst] = (int)e.size;
+	emit_exit_stub(&e, num_inst);
+
+	for (i = 0; i < e.num_fixups; i++) {
+		target = e.fixups[i].target;
+		if (e.fixups[i].exit && e.exit[target] < 0)
+			emit_exit_stub(&e, target);
+	}
+	if (e.failed)
+		goto error;
+
+	for (i = 0; i < e.num_fixups; i++) {
+		target = e.fixups[i].target;
+		target = e.fixups[i].exit ? e.exit[target] : e.label[target];
+		assert(target >= 0);
+		patch_u32(&e, e.fixups[i].offset, (unsigned)(target - (e.fixups[i].offset + 4)));
+	}
+
+	code = (unsigned char*)mmap(NULL, e.size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (code == MAP_FAILED) {
+		code = NULL;
+		goto error;
+	}
+	memcpy(code, e.buf, e.size);
+	if (mprotect(code, e.size, PROT_READ | PROT_EXEC))
+		goto error;
+
+	for (i = 0; i < num_inst; i++) {
+		if (jit->entry[i])
+			jit->entry[i] = code + (size_t)jit->entry[i];
+	}
+	jit->run = (int (*)(jit_context_t*, const void*))(void*)code;
+	jit->code = code;
+	jit->size = e.size;
+
+	s->alloc(e.buf, 0);
+	s->alloc(e.fixups, 0);
+	s->alloc(e.label, 0);
+	s->alloc(e.exit, 0);
+	return jit;
+
+error:
+	if (code) munmap(code, e.size);
+	if (jit) {
+		s->alloc(jit->entry, 0);
+		s->alloc(jit, 0);
+	}
+	s->alloc(e.buf, 0);
+	s->alloc(e.fixups, 0);
+	s->alloc(e.label, 0);
+	s->alloc(e.exit, 0);
+	return NULL;
+}
+
+/* Prototypes are shared between threads, only one of them compiles. A
+   failed compilation leaves the prototype to the interpreter. */
+void jit_compile(su_state *s, prototype_t *prot) {
+	spin_lock(&s->msi->jit_lock);
+	if (!prot->jit)
+		prot->jit = compile(s, prot);
+	spin_unlock(&s->msi->jit_lock);
+}
+
+int jit_run(su_state *s, jit_t *jit, int pc, value_t **sp, value_t *base, value_t *constants, value_t *upvalues) {
+	jit_context_t ctx;
+	ctx.sp = *sp;
+	ctx.base = base;
+	ctx.constants = constants;
+	ctx.stack_end = &s->stack[s->stack_size];
+	ctx.upvalues = upvalues;
+	ctx.s = s;
+	ctx.interrupt = &s->interrupt;
+	ctx.global_interrupt = &s->msi->interrupt.value;
+	ctx.pc = pc;
+	pc = jit->run(&ctx, jit->entry[pc]);
+	*sp = ctx.sp;
+	return pc;
+}
+
+void jit_free(su_state *s, jit_t *jit) {
+	munmap(jit->code, jit->size);
+	s->alloc(jit->entry, 0);
+	s->alloc(jit, 0);
+}
+
+#undef SP
+#undef BASE
+#undef CONSTANTS
+#undef CTX
+#undef STACK_END
+#undef SLOT
+#undef TYPE_OFFSET
+#undef CTX_OFFSET
+
+#endif
@@ -0,0 +1,49 @@
+/*
+ * S A U R U S
+ * Copyright (c) 2009-2015 Andreas T Jonsson <andreas@saurus.org>
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef _JIT_H_
+#define _JIT_H_
+
+#include "saurus.h"
+#include "intern.h"
+
+#ifdef SU_JIT
+
+/* Interpreter registers as seen by compiled code. */
+typedef struct {
+	value_t *sp;
+	value_t *base;
+	value_t *constants;
+	value_t *stack_end;
+	value_t *upvalues;
+	su_state *s;
+	int *interrupt;
+	int *global_interrupt;
+	int pc;
+} jit_context_t;
+
+struct jit {
+	int (*run)(jit_context_t *ctx, const void *entry);
+	const void **entry;
+	unsigned char *code;
+	size_t size;
+};
+
+void jit_compile(su_state *s, prototype_t *prot);
+int jit_run(su_state *s, jit_t *jit, int pc, value_t **sp, value_t *base, value_t *constants, value_t *upvalues);
+void jit_free(su_state *s, jit_t *jit);
+
+/* Slow paths in core.c. Compiled code stores ctx->sp and ctx->pc before the call. */
+void jit_getglobal(jit_context_t *ctx);
+void jit_getfield(jit_context_t *ctx);
+void jit_call(jit_context_t *ctx);
+
+#endif
+
+#endif
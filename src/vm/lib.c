@@ -62,7 +62,6 @@ static const void *reader(size_t *size, void *data) {
 
 static int load(su_state *s, int narg) {
 	buffer_and_size bas;
-	su_check_arguments(s, 1, SU_STRING);
 	bas.buffer = su_tostring(s, -1, &bas.size);
 	if (su_load(s, &reader, &bas))
 		su_pushnil(s);
@@ -75,11 +74,9 @@ static int compile(su_state *s, int narg) {
 	char *res;
 	
 	if (narg == 1) {
-		su_check_arguments(s, 1, SU_STRING);
 		code = su_tostring(s, -1, NULL);
 		name = NULL;
 	} else {
-		su_check_arguments(s, 2, SU_STRING, SU_STRING);
 		code = su_tostring(s, -2, NULL);
 		name = su_tostring(s, -1, NULL);
 	}
@@ -99,27 +96,19 @@ static int loadlib(su_state *s, int narg) {
 	void *lib;
 	su_nativefunc sym;
 	
-	if (narg > 1) {
-		su_check_type(s, -narg, SU_STRING);
-		su_check_type(s, -narg + 1, SU_STRING);
-		libname = su_tostring(s, -narg, NULL);
-		symname = su_tostring(s, -narg + 1, NULL);
-		lib = lib_load(libname);
-		su_assert(s, lib != NULL, "Could not load: %s", libname);
-		sym = (su_nativefunc)lib_sym(lib, symname);
-		if (!sym) {
-			lib_unload(lib);
-			su_error(s, "Could not load symbol '%s' in library: %s", symname, libname);
-		}
-		return sym(s, narg - 2);
+	libname = su_tostring(s, -narg, NULL);
+	symname = su_tostring(s, -narg + 1, NULL);
+	lib = lib_load(libname);
+	su_assert(s, lib != NULL, "Could not load: %s", libname);
+	sym = (su_nativefunc)lib_sym(lib, symname);
+	if (!sym) {
+		lib_unload(lib);
+		su_error(s, "Could not load symbol '%s' in library: %s", symname, libname);
 	}
-	
-	su_check_arguments(s, 2, SU_STRING, SU_STRING);
-	return 0;
+	return sym(s, narg - 2);
 }
 
 static int execute(su_state *s, int narg) {
-	su_check_arguments(s, 1, SU_STRING);
 	su_pushinteger(s, system(su_tostring(s, -1, NULL)));
 	return 1;
 }
@@ -197,38 +186,35 @@ static int print(su_state *s, int narg) {
 }
 
 static int apply(su_state *s, int narg) {
-	su_object_type_t t;
-	su_assert(s, narg == 2, "apply expected 2 arguments!");
-	t = su_type(s, -2);
+	su_object_type_t t = su_type(s, -2);
 	su_assert(s, t == SU_FUNCTION || t == SU_NATIVEFUNC, "apply expected function to call!");
-	su_check_type(s, -1, SU_SEQ);
 	su_copy(s, -2);
 	su_call(s, su_unpack_seq(s, -2), 1);
 	return 1;
 }
 
+static int values(su_state *s, int narg) {
+	return narg;
+}
+
 static int type(su_state *s, int narg) {
-	su_check_arguments(s, 1, SU_NIL);
 	su_pushstring(s, su_type_name(s, -1));
 	return 1;
 }
 
 static int string(su_state *s, int narg) {
-	su_check_arguments(s, 1, SU_NIL);
 	if (su_type(s, -1) != SU_STRING)
 		su_pushstring(s, su_stringify(s, -1));
 	return 1;
 }
 
 static int number(su_state *s, int narg) {
-	su_check_arguments(s, 1, SU_STRING);
 	su_pushnumber(s, atof(su_tostring(s, -1, NULL)));
 	return 1;
 }
 
 static int unref(su_state *s, int narg) {
 	su_object_type_t t;
-	su_check_arguments(s, 1, SU_NIL);
 	t = su_type(s, -1);
 	su_assert(s, t == SU_LOCAL || t == SU_GLOBAL, "Expected mutable object!");
 	su_unref(s, -1);
@@ -236,14 +222,12 @@ static int unref(su_state *s, int narg) {
 }
 
 static int local_ref(su_state *s, int narg) {
-	su_check_arguments(s, 1, SU_NIL);
 	su_ref_local(s, -1);
 	return 1;
 }
 
 static int global_ref(su_state *s, int narg) {
 	su_object_type_t t;
-	su_check_num_arguments(s, 1);
 	t = su_type(s, -1);
 	su_assert(s, t == SU_NIL || t == SU_MAP, "Expected hashmap or nil!");
 	su_ref_global(s, -1);
@@ -251,7 +235,6 @@ static int global_ref(su_state *s, int narg) {
 }
 
 static int set(su_state *s, int narg) {
-	su_check_arguments(s, 2, SU_LOCAL, SU_NIL);
 	su_copy(s, -1);
 	su_setref(s, -3);
 	return 1;
@@ -270,7 +253,6 @@ static int read_(su_state *s, int narg) {
 		return 1;
 	}
 
-	su_check_arguments(s, 1, SU_STRING);
 	#ifdef SU_OPT_NO_FILE_IO
 		return 0;
 	#else
@@ -298,7 +280,6 @@ static int write_(su_state *s, int narg) {
 	FILE *fp;
 	unsigned size, tmp;
 	const char *str;
-	su_check_arguments(s, 2, SU_STRING, SU_STRING);
 	#ifdef SU_OPT_NO_FILE_IO
 		return 0;
 	#else
@@ -321,7 +302,6 @@ static int write_(su_state *s, int narg) {
 static int size_(su_state *s, int narg) {
 	FILE *fp;
 	double size;
-	su_check_arguments(s, 1, SU_STRING);
 #ifdef SU_OPT_NO_FILE_IO
 	return 0;
 #else
@@ -337,7 +317,6 @@ static int size_(su_state *s, int narg) {
 }
 
 static int delete_(su_state *s, int narg) {
-	su_check_arguments(s, 1, SU_STRING);
 #ifdef SU_OPT_NO_FILE_IO
 	su_pushboolean(s, 0);
 #else
@@ -347,14 +326,12 @@ static int delete_(su_state *s, int narg) {
 }
 
 static int error(su_state *s, int narg) {
-	su_check_arguments(s, 1, SU_STRING);
 	su_error(s, su_tostring(s, -1, NULL));
 	return 0;
 }
 
 static int assert_(su_state *s, int narg) {
 	su_object_type_t t;
-	su_check_arguments(s, 2, SU_NIL, SU_STRING);
 	t = su_type(s, -2);
 	if (t == SU_NIL || (t == SU_BOOLEAN && !su_toboolean(s, -2)))
 		su_error(s, su_tostring(s, -1, NULL));
@@ -415,7 +392,6 @@ static int format(su_state *s, int narg) {
 }
 
 static int char_(su_state *s, int narg) {
-	su_check_arguments(s, 1, SU_NUMBER);
 	su_string_begin(s, NULL);
 	su_string_ch(s, (char)su_tointeger(s, -1));
 	su_string_push(s);
@@ -424,7 +400,6 @@ static int char_(su_state *s, int narg) {
 
 static int byte_(su_state *s, int narg) {
 	const char *str;
-	su_check_arguments(s, 1, SU_STRING);
 	str = su_tostring(s, -1, NULL);
 	su_pushinteger(s, (int)str[0]);
 	return 1;
@@ -491,8 +466,6 @@ static int find(su_state *s, int narg) {
 		struct slre_cap cap;
 		cap.len = 0;
 
-		su_check_arguments(s, 2, SU_STRING, SU_STRING);
-
 		buffer = su_tostring(s, -2, &size);
 		pattern = su_tostring(s, -1, NULL);
 		offset = slre_match(pattern, buffer, (int)size - 1, &cap, 1, 0);
@@ -503,8 +476,7 @@ static int find(su_state *s, int narg) {
 				su_pushinteger(s, (int)((cap.ptr + cap.len) - buffer));
 			else
 				su_pushinteger(s, (int)size - 2);
-			su_cons(s);
-			return 1;
+			return 2;
 		} else if (offset < -1) {
 			pattern_error(s, offset);
 		}
@@ -513,26 +485,22 @@ static int find(su_state *s, int narg) {
 }
 
 static int time_(su_state *s, int narg) {
-	su_check_arguments(s, 0);
 	su_pushnumber(s, (double)time(NULL));
 	return 1;
 }
 
 static int num_threads(su_state *s, int narg) {
-	su_check_num_arguments(s, 0);
 	su_pushinteger(s, su_num_threads(s));
 	return 1;
 }
 
 static int num_cores_(su_state *s, int narg) {
-	su_check_num_arguments(s, 0);
 	su_pushinteger(s, su_num_cores(s));
 	return 1;
 }
 
 static int sleep_(su_state *s, int narg) {
 	unsigned tmp;
-	su_check_arguments(s, 1, SU_NUMBER);
 	tmp = (unsigned)su_tonumber(s, -1);
 	su_thread_indisposable(s);
 	tmp = thread_sleep(tmp);
@@ -560,86 +528,81 @@ static int sync_(su_state *s, int narg) {
 	return 1;
 }
 
+static const su_native_sig globals[] = {
+	{"apply", &apply, 2, 2, {SU_NIL, SU_SEQ}},
+	{"values", &values, 0, -1},
+	{"type?", &type, 1, 1},
+	{"load", &load, 1, 1, {SU_STRING}},
+	{"compile", &compile, 1, 2, {SU_STRING, SU_STRING}},
+	{"cat", &cat, 0, -1},
+	
+	{"error", &error, 1, 1, {SU_STRING}},
+	{"assert", &assert_, 2, 2, {SU_NIL, SU_STRING}},
+	
+	{"unref", &unref, 1, 1},
+	{"local", &local_ref, 1, 1},
+	{"global", &global_ref, 1, 1},
+	{"set", &set, 2, 2, {SU_LOCAL}}
+};
+
+static const su_native_sig process[] = {
+	{"async", &async, 0, -1},
+	{"sync", &sync_, 0, -1},
+	{"sleep", &sleep_, 1, 1, {SU_NUMBER}},
+	{"num_threads", &num_threads, 0, 0},
+	{"num_cores", &num_cores_, 0, 0}
+};
+
+static const su_native_sig strings[] = {
+	{"string!", &string, 1, 1},
+	{"number!", &number, 1, 1, {SU_STRING}},
+	{"format", &format, 0, -1},
+	{"find", &find, 2, 2, {SU_STRING, SU_STRING}},
+	{"byte", &byte_, 1, 1, {SU_STRING}},
+	{"char", &char_, 1, 1, {SU_NUMBER}}
+};
+
+static const su_native_sig io[] = {
+	{"print", &print, 0, -1},
+	{"read", &read_, 0, 1, {SU_STRING}},
+	{"write", &write_, 2, 2, {SU_STRING, SU_STRING}},
+	{"size", &size_, 1, 1, {SU_STRING}},
+	{"delete", &delete_, 1, 1, {SU_STRING}}
+};
+
+static const su_native_sig os[] = {
+	{"time", &time_, 0, 0},
+	{"loadlib", &loadlib, 2, -1, {SU_STRING, SU_STRING}},
+	{"execute", &execute, 1, 1, {SU_STRING}}
+};
+
+#define NUM_SIGS(sigs) (sizeof(sigs) / sizeof((sigs)[0]))
+
 extern void libmath(su_state *s);
 extern void libseq(su_state *s);
 extern void libhttp(su_state *s);
 
 void su_libinit(su_state *s) {
-	int top;
+	int i, top;
 	const char *name = platform_name();
 	su_pushstring(s, su_version(NULL, NULL, NULL));
 	su_setglobal(s, "_VERSION");
 
-	su_pushfunction(s, &apply);
-	su_setglobal(s, "apply");
-	su_pushfunction(s, &type);
-	su_setglobal(s, "type?");
-	su_pushfunction(s, &load);
-	su_setglobal(s, "load");
-	su_pushfunction(s, &compile);
-	su_setglobal(s, "compile");
-	su_pushfunction(s, &cat);
-	su_setglobal(s, "cat");
-
-	su_pushfunction(s, &error);
-	su_setglobal(s, "error");
-	su_pushfunction(s, &assert_);
-	su_setglobal(s, "assert");
-
-	su_pushfunction(s, &unref);
-	su_setglobal(s, "unref");
-	su_pushfunction(s, &local_ref);
-	su_setglobal(s, "local");
-	su_pushfunction(s, &global_ref);
-	su_setglobal(s, "global");
-	su_pushfunction(s, &set);
-	su_setglobal(s, "set");
+	for (i = 0; i < NUM_SIGS(globals); i++) {
+		su_pushnative(s, &globals[i]);
+		su_setglobal(s, globals[i].name);
+	}
 	
 	top = su_top(s);
-	
-	su_pushstring(s, "async");
-	su_pushfunction(s, &async);
-	su_pushstring(s, "sync");
-	su_pushfunction(s, &sync_);
-	su_pushstring(s, "sleep");
-	su_pushfunction(s, &sleep_);
-	su_pushstring(s, "num_threads");
-	su_pushfunction(s, &num_threads);
-	su_pushstring(s, "num_cores");
-	su_pushfunction(s, &num_cores_);
-	
+	su_pushnatives(s, process, NUM_SIGS(process));
 	su_map(s, (su_top(s) - top) / 2);
 	su_setglobal(s, "process");
 	
-	top = su_top(s);
-	
-	su_pushstring(s, "string!");
-	su_pushfunction(s, &string);
-	su_pushstring(s, "number!");
-	su_pushfunction(s, &number);
-	su_pushstring(s, "format");
-	su_pushfunction(s, &format);
-	su_pushstring(s, "find");
-	su_pushfunction(s, &find);
-	su_pushstring(s, "byte");
-	su_pushfunction(s, &byte_);
-	su_pushstring(s, "char");
-	su_pushfunction(s, &char_);
-
+	su_pushnatives(s, strings, NUM_SIGS(strings));
 	su_map(s, (su_top(s) - top) / 2);
 	su_setglobal(s, "string");
 
-	su_pushstring(s, "print");
-	su_pushfunction(s, &print);
-	su_pushstring(s, "read");
-	su_pushfunction(s, &read_);
-	su_pushstring(s, "write");
-	su_pushfunction(s, &write_);
-	su_pushstring(s, "size");
-	su_pushfunction(s, &size_);
-	su_pushstring(s, "delete");
-	su_pushfunction(s, &delete_);
-	
+	su_pushnatives(s, io, NUM_SIGS(io));
 	su_map(s, (su_top(s) - top) / 2);
 	su_setglobal(s, "io");
 	
@@ -649,13 +612,7 @@ void su_libinit(su_state *s) {
 	else
 		su_pushnil(s);
 	
-	su_pushstring(s, "time");
-	su_pushfunction(s, &time_);
-	su_pushstring(s, "loadlib");
-	su_pushfunction(s, &loadlib);
-	su_pushstring(s, "execute");
-	su_pushfunction(s, &execute);
-	
+	su_pushnatives(s, os, NUM_SIGS(os));
 	su_map(s, (su_top(s) - top) / 2);
 	su_setglobal(s, "os");
 
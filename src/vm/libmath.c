@@ -15,25 +15,22 @@ const double pi = 3.141592653589793;
 
 #define FUNC1D_DEF(f) \
 	static int _##f(su_state *s, int narg) { \
-		su_check_arguments(s, 1, SU_NUMBER); \
 		su_pushnumber(s, f(su_tonumber(s, -1))); \
 		return 1; }
 
 #define FUNC2D_DEF(f) \
 	static int _##f(su_state *s, int narg) { \
-		su_check_arguments(s, 2, SU_NUMBER, SU_NUMBER); \
 		su_pushnumber(s, f(su_tonumber(s, -2), su_tonumber(s, -1))); \
 		return 1; }
 		
 #define FUNC1I_DEF(f) \
 	static int _##f(su_state *s, int narg) { \
-		su_check_arguments(s, 1, SU_NUMBER); \
 		su_pushinteger(s, f(su_tointeger(s, -1))); \
 		return 1; }
 
-#define FUNC_DEC(f) \
-	su_pushstring(s, #f); \
-	su_pushfunction(s, (su_nativefunc)&_##f);
+/* Arguments are checked by the VM against the signatures in libmath. */
+#define FUNC1_SIG(f) {#f, &_##f, 1, 1, {SU_NUMBER}},
+#define FUNC2_SIG(f) {#f, &_##f, 2, 2, {SU_NUMBER, SU_NUMBER}},
 
 FUNC1I_DEF(abs)
 FUNC1D_DEF(acos)
@@ -53,39 +50,31 @@ FUNC1D_DEF(tanh)
 FUNC1D_DEF(exp)
 
 static int atan_(su_state *s, int narg) {
-	if (narg == 1) {
-		su_check_arguments(s, 1, SU_NUMBER);
+	if (narg == 1)
 		su_pushnumber(s, atan(su_tonumber(s, -1)));
-	} else {
-		su_check_arguments(s, 2, SU_NUMBER, SU_NUMBER);
+	else
 		su_pushnumber(s, atan2(su_tonumber(s, -2), su_tonumber(s, -1)));
-	}
 	return 1;
 }
 
 static int modf_(su_state *s, int narg) {
 	double f, r;
-	su_check_arguments(s, 1, SU_NUMBER);
 	f = modf(su_tonumber(s, -1), &r);
 	su_pushnumber(s, f);
 	su_pushnumber(s, r);
-	su_cons(s);
-	return 1;
+	return 2;
 }
 
 static int frexp_(su_state *s, int narg) {
 	double f;
 	int r;
-	su_check_arguments(s, 1, SU_NUMBER);
 	f = frexp(su_tonumber(s, -1), &r);
 	su_pushnumber(s, f);
 	su_pushinteger(s, r);
-	su_cons(s);
-	return 1;
+	return 2;
 }
 
 static int ldexp_(su_state *s, int narg) {
-	su_check_arguments(s, 2, SU_NUMBER, SU_NUMBER);
 	su_pushnumber(s, ldexp(su_tonumber(s, -2), su_tointeger(s, -1)));
 	return 1;
 }
@@ -119,29 +108,55 @@ static int max_(su_state *s, int narg) {
 }
 
 static int deg_(su_state *s, int narg) {
-	su_check_arguments(s, 1, SU_NUMBER);
 	su_pushnumber(s, su_tointeger(s, -1) * (180.0 / pi));
 	return 1;
 }
 
 static int rad_(su_state *s, int narg) {
-	su_check_arguments(s, 1, SU_NUMBER);
 	su_pushnumber(s, su_tointeger(s, -1) * (pi / 180.0));
 	return 1;
 }
 
 static int random_(su_state *s, int narg) {
-	su_check_arguments(s, 2, SU_NUMBER, SU_NUMBER);
 	su_pushinteger(s, (rand() % (su_tointeger(s, -2) + 1)) + su_tointeger(s, -1));
 	return 1;
 }
 
 static int seed(su_state *s, int narg) {
-	su_check_arguments(s, 1, SU_NUMBER);
 	srand((unsigned)su_tonumber(s, -1));
 	return 0;
 }
 
+static const su_native_sig natives[] = {
+	FUNC1_SIG(abs)
+	FUNC1_SIG(acos)
+	FUNC1_SIG(asin)
+	FUNC1_SIG(cos)
+	FUNC1_SIG(cosh)
+	FUNC1_SIG(ceil)
+	FUNC1_SIG(floor)
+	FUNC2_SIG(fmod)
+	FUNC1_SIG(log)
+	FUNC1_SIG(log10)
+	FUNC1_SIG(sin)
+	FUNC1_SIG(sinh)
+	FUNC1_SIG(sqrt)
+	FUNC1_SIG(tan)
+	FUNC1_SIG(tanh)
+	
+	{"atan", &atan_, 1, 2, {SU_NUMBER, SU_NUMBER}},
+	{"modf", &modf_, 1, 1, {SU_NUMBER}},
+	{"frexp", &frexp_, 1, 1, {SU_NUMBER}},
+	{"ldexp", &ldexp_, 2, 2, {SU_NUMBER, SU_NUMBER}},
+	{"min", &min_, 0, -1},
+	{"max", &max_, 0, -1},
+	{"deg", &deg_, 1, 1, {SU_NUMBER}},
+	{"rad", &rad_, 1, 1, {SU_NUMBER}},
+	
+	{"random", &random_, 2, 2, {SU_NUMBER, SU_NUMBER}},
+	{"seed", &seed, 1, 1, {SU_NUMBER}}
+};
+
 extern void libseq(su_state *s);
 
 void libmath(su_state *s) {
@@ -152,43 +167,7 @@ void libmath(su_state *s) {
 	su_pushstring(s, "huge");
 	su_pushnumber(s, HUGE_VAL);
 	
-	FUNC_DEC(abs)
-	FUNC_DEC(acos)
-	FUNC_DEC(asin)
-	FUNC_DEC(cos)
-	FUNC_DEC(cosh)
-	FUNC_DEC(ceil)
-	FUNC_DEC(floor)
-	FUNC_DEC(fmod)
-	FUNC_DEC(log)
-	FUNC_DEC(log10)
-	FUNC_DEC(sin)
-	FUNC_DEC(sinh)
-	FUNC_DEC(sqrt)
-	FUNC_DEC(tan)
-	FUNC_DEC(tanh)
-	
-	su_pushstring(s, "atan");
-	su_pushfunction(s, &atan_);
-	su_pushstring(s, "modf");
-	su_pushfunction(s, &modf_);
-	su_pushstring(s, "frexp");
-	su_pushfunction(s, &frexp_);
-	su_pushstring(s, "ldexp");
-	su_pushfunction(s, &ldexp_);
-	su_pushstring(s, "min");
-	su_pushfunction(s, &min_);
-	su_pushstring(s, "max");
-	su_pushfunction(s, &max_);
-	su_pushstring(s, "deg");
-	su_pushfunction(s, &deg_);
-	su_pushstring(s, "rad");
-	su_pushfunction(s, &rad_);
-	
-	su_pushstring(s, "random");
-	su_pushfunction(s, &random_);
-	su_pushstring(s, "seed");
-	su_pushfunction(s, &seed);
+	su_pushnatives(s, natives, sizeof(natives) / sizeof(natives[0]));
 
 	su_map(s, (su_top(s) - top) / 2);
 	su_setglobal(s, "math");
@@ -10,13 +10,11 @@
 #include "saurus.h"
 
 static int seq(su_state *s, int narg) {
-	su_check_arguments(s, 1, SU_NIL);
 	su_seq(s, -1, 0);
 	return 1;
 }
 
 static int rseq(su_state *s, int narg) {
-	su_check_arguments(s, 1, SU_NIL);
 	su_seq(s, -1, 1);
 	return 1;
 }
@@ -31,25 +29,21 @@ static int list(su_state *s, int narg) {
 }
 
 static int cons(su_state *s, int narg) {
-	su_check_arguments(s, 2, SU_NIL, SU_NIL);
 	su_cons(s);
 	return 1;
 }
 
 static int range(su_state *s, int narg) {
-	su_check_arguments(s, 2, SU_NUMBER, SU_NUMBER);
 	su_range(s, -2);
 	return 1;
 }
 
 static int first(su_state *s, int narg) {
-	su_check_arguments(s, 1, SU_SEQ);
 	su_first(s, -1);
 	return 1;
 }
 
 static int rest(su_state *s, int narg) {
-	su_check_arguments(s, 1, SU_SEQ);
 	su_rest(s, -1);
 	return 1;
 }
@@ -60,13 +54,11 @@ static int vector(su_state *s, int narg) {
 }
 
 static int push(su_state *s, int narg) {
-	su_check_arguments(s, -1, SU_VECTOR);
 	su_vector_push(s, -narg, narg - 1);
 	return 1;
 }
 
 static int pop(su_state *s, int narg) {
-	su_check_arguments(s, 2, SU_VECTOR, SU_NUMBER);
 	su_vector_pop(s, -2, -1);
 	return 1;
 }
@@ -78,13 +70,11 @@ static int map(su_state *s, int narg) {
 }
 
 static int dissoc(su_state *s, int narg) {
-	su_check_arguments(s, 2, SU_MAP, SU_NIL);
 	su_map_remove(s, -1);
 	return 1;
 }
 
 static int assocq(su_state *s, int narg) {
-	su_check_arguments(s, 2, SU_MAP, SU_NIL);
 	su_pushboolean(s, su_map_has(s, -1));
 	return 1;
 }
@@ -92,7 +82,6 @@ static int assocq(su_state *s, int narg) {
 static int length(su_state *s, int narg) {
 	unsigned size;
 	su_object_type_t type;
-	su_check_num_arguments(s, 1);
 	type = su_type(s, -1);
 	switch (type) {
 		case SU_VECTOR:
@@ -113,7 +102,6 @@ static int length(su_state *s, int narg) {
 
 static int assoc(su_state *s, int narg) {
 	su_object_type_t type;
-	su_check_num_arguments(s, 3);
 	type = su_type(s, -3);
 	switch (type) {
 		case SU_VECTOR:
@@ -133,47 +121,41 @@ static int assoc(su_state *s, int narg) {
 	return 1;
 }
 
-void libseq(su_state *s) {
-	int top;
-	su_pushfunction(s, &seq);
-	su_setglobal(s, "seq");
-	su_pushfunction(s, &cons);
-	su_setglobal(s, "cons");
-	su_pushfunction(s, &range);
-	su_setglobal(s, "range");
-	
-	su_pushfunction(s, &first);
-	su_setglobal(s, "first");
-	su_pushfunction(s, &rest);
-	su_setglobal(s, "rest");
+static const su_native_sig globals[] = {
+	{"seq", &seq, 1, 1},
+	{"cons", &cons, 2, 2},
+	{"range", &range, 2, 2, {SU_NUMBER, SU_NUMBER}},
 	
-	su_pushfunction(s, &vector);
-	su_setglobal(s, "vector");
-	su_pushfunction(s, &map);
-	su_setglobal(s, "hashmap");
+	{"first", &first, 1, 1, {SU_SEQ}},
+	{"rest", &rest, 1, 1, {SU_SEQ}},
 	
-	top = su_top(s);
+	{"vector", &vector, 0, -1},
+	{"hashmap", &map, 0, -1}
+};
+
+static const su_native_sig natives[] = {
+	{"rseq", &rseq, 1, 1},
+	{"list", &list, 0, -1},
 	
-	su_pushstring(s, "rseq");
-	su_pushfunction(s, &rseq);
-	su_pushstring(s, "list");
-	su_pushfunction(s, &list);
+	{"push", &push, 1, -1, {SU_VECTOR}},
+	{"pop", &pop, 2, 2, {SU_VECTOR, SU_NUMBER}},
 	
-	su_pushstring(s, "push");
-	su_pushfunction(s, &push);
-	su_pushstring(s, "pop");
-	su_pushfunction(s, &pop);
-
-	su_pushstring(s, "dissoc");
-	su_pushfunction(s, &dissoc);
-	su_pushstring(s, "assoc?");
-	su_pushfunction(s, &assocq);
+	{"dissoc", &dissoc, 2, 2, {SU_MAP}},
+	{"assoc?", &assocq, 2, 2, {SU_MAP}},
 	
-	su_pushstring(s, "assoc");
-	su_pushfunction(s, &assoc);
-	su_pushstring(s, "length");
-	su_pushfunction(s, &length);
+	{"assoc", &assoc, 3, 3},
+	{"length", &length, 1, 1}
+};
+
+void libseq(su_state *s) {
+	int i, top;
+	for (i = 0; i < sizeof(globals) / sizeof(globals[0]); i++) {
+		su_pushnative(s, &globals[i]);
+		su_setglobal(s, globals[i].name);
+	}
 	
+	top = su_top(s);
+	su_pushnatives(s, natives, sizeof(natives) / sizeof(natives[0]));
 	su_map(s, (su_top(s) - top) / 2);
 	su_setglobal(s, "sequence");
 }
@@ -16,12 +16,31 @@
 /* #define SU_OPT_NO_FILE_IO */
 /* #define SU_OPT_NO_PATTERN */
 /* #define SU_OPT_NO_SOCKET */
+/* #define SU_OPT_NO_COMPUTED_GOTO */
+/* #define SU_OPT_VM_STATS */ /* Count dispatched instructions, reported by su_close. */
+/* #define SU_OPT_JIT */ /* Compile hot prototypes to machine code, x86-64 Linux only. */
+/* #define SU_OPT_PROFILE */ /* Record type feedback per instruction, written by su_profile. */
+
+#define SU_OPT_JIT_THRESHOLD 1000 /* Function entries and backward jumps before a prototype is compiled. */
 
 #define SU_OPT_MAX_THREADS 128
+#define SU_OPT_STACK_LIMIT 262144 /* Default values per thread stack, see su_set_stack_limit. */
+#define SU_OPT_CALL_LIMIT 65536 /* Default call frames per thread. */
+#define SU_OPT_NATIVE_LIMIT 4096 /* Nested native calls through su_call, they recurse on the C stack. */
 #define SU_OPT_GC_OVERHEAD_DIVISOR 4 /* Allow for 25% memory overhead per thread. */
+#define SU_OPT_GC_NURSERY_SIZE 16384 /* Young objects allocated between minor collections, 0 disables them. */
 
 /******************************/
 
+#if defined(__GNUC__) && !defined(SU_OPT_NO_COMPUTED_GOTO)
+	#define SU_COMPUTED_GOTO
+#endif
+
+/* The JIT assumes the 16 byte value layout and does not count instructions or record feedback. */
+#if defined(SU_OPT_JIT) && defined(__x86_64__) && defined(__linux__) && !defined(SU_OPT_NAN_BOXING) && !defined(SU_OPT_VM_STATS) && !defined(SU_OPT_PROFILE)
+	#define SU_JIT
+#endif
+
 #ifndef false
 	#define false 0
 #endif
@@ -175,6 +194,7 @@ typedef struct {
 	#define atomic_set_ptr(a, v) __sync_lock_test_and_set(&(a)->value, v)
 	#define atomic_cas(a, oldval, newval) __sync_bool_compare_and_swap(&(a)->value, oldval, newval)
 	#define atomic_cas_ptr(a, oldval, newval) __sync_bool_compare_and_swap(&(a)->value, oldval, newval)
+	#define atomic_cas_char(p, oldval, newval) __sync_bool_compare_and_swap((p), oldval, newval)
 #elif _MSC_VER
 	void _ReadWriteBarrier();
 	#pragma intrinsic(_ReadWriteBarrier)
@@ -184,6 +204,7 @@ typedef struct {
 	#define atomic_add(a, v)     _InterlockedExchangeAdd((long*)&(a)->value, (v))
 	#define atomic_set_ptr(a, v)  _InterlockedExchangePointer(&(a)->value, (v))
 	#define atomic_cas(a, oldval, newval) (_InterlockedCompareExchange((long*)&(a)->value, (newval), (oldval)) == (oldval))
+	#define atomic_cas_char(p, oldval, newval) (_InterlockedCompareExchange8((char*)(p), (char)(newval), (char)(oldval)) == (char)(oldval))
 
 	#if _M_IX86
 		#define atomic_cas_ptr(a, oldval, newval) (_InterlockedCompareExchange((long*)(a), (long)(newval), (long)(oldval)) == (long)(oldval))
@@ -228,6 +249,12 @@ static INLINE void *atomic_get_ptr(aptr_t *a)
 		return (req.tv_sec - rem.tv_sec) * 1000 + (req.tv_nsec - rem.tv_nsec) / 1000000;
 	}
 
+	static INLINE unsigned long time_us() {
+		struct timespec ts;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		return (unsigned long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+	}
+
 	static INLINE int thread_init(void *(*func)(su_state*), void *data) {
 		pthread_t handle;
 		pthread_attr_t type;
@@ -248,6 +275,13 @@ static INLINE void *atomic_get_ptr(aptr_t *a)
 		return 0;
 	}
 
+	static INLINE unsigned long time_us() {
+		LARGE_INTEGER freq, count;
+		QueryPerformanceFrequency(&freq);
+		QueryPerformanceCounter(&count);
+		return (unsigned long)(count.QuadPart * 1000000 / freq.QuadPart);
+	}
+
 	static INLINE int thread_init(void *(*func)(su_state*), void *data) {
 		CloseHandle((HANDLE)_beginthread(func, 0, data));
 		return 0;
@@ -18,10 +18,9 @@
 
 value_t ref_global(su_state *s, value_t *val) {
 	value_t v;
-	v.type = SU_GLOBAL;
-	v.obj.glob = (global_t*)su_allocate(s, NULL, sizeof(global_t));
-	v.obj.glob->value.value = val->type == SU_NIL ? NULL : val->obj.ptr;
-	gc_insert_object(s, v.obj.gc_object, SU_GLOBAL);
+	SET_OBJ(&v, SU_GLOBAL, (global_t*)gc_allocate(s, sizeof(global_t)));
+	VAL_GLOB(&v)->value.value = VAL_TYPE(val) == SU_NIL ? NULL : VAL_PTR(val);
+	gc_insert_object(s, VAL_GC(&v), SU_GLOBAL);
 	return v;
 }
 
@@ -29,21 +28,19 @@ value_t unref_global(su_state *s, global_t *glob) {
 	value_t v;
 	void *ptr = atomic_get_ptr(&glob->value);
 	if (!ptr) {
-		v.type = SU_NIL;
+		SET_NIL(&v);
 		return v;
 	}
-	v.type = SU_MAP;
-	v.obj.ptr = ptr;
+	SET_OBJ(&v, SU_MAP, ptr);
 	return v;
 }
 
 value_t ref_local(su_state *s, value_t *val) {
 	value_t v;
-	v.type = SU_LOCAL;
-	v.obj.loc = (local_t*)su_allocate(s, NULL, sizeof(local_t));
-	v.obj.loc->v = *val;
-	v.obj.loc->tid = s->tid;
-	gc_insert_object(s, &v.obj.loc->gc, SU_LOCAL);
+	SET_OBJ(&v, SU_LOCAL, (local_t*)gc_allocate(s, sizeof(local_t)));
+	VAL_LOC(&v)->v = *val;
+	VAL_LOC(&v)->tid = s->tid;
+	gc_insert_object(s, &VAL_LOC(&v)->gc, SU_LOCAL);
 	return v;
 }
 
@@ -70,16 +67,16 @@ void su_ref_local(su_state *s, int idx) {
 
 void su_unref(su_state *s, int idx) {
 	value_t v = *STK(TOP(idx));
-	if (v.type == SU_LOCAL)
-		v = unref_local(s, v.obj.loc);
-	else if (v.type == SU_GLOBAL)
-		v = unref_global(s, v.obj.glob);
+	if (VAL_TYPE(&v) == SU_LOCAL)
+		v = unref_local(s, VAL_LOC(&v));
+	else if (VAL_TYPE(&v) == SU_GLOBAL)
+		v = unref_global(s, VAL_GLOB(&v));
 	push_value(s, &v);
 }
 
 void su_setref(su_state *s, int idx) {
 	value_t *v = STK(TOP(idx));
-	set_local(s, v->obj.loc, STK(-1));
+	set_local(s, VAL_LOC(v), STK(-1));
 	su_pop(s, 1);
 }
 
@@ -88,7 +85,7 @@ void su_transaction(su_state *s, int narg) {
 	value_t v;
 	su_object_type_t t;
 	unsigned tries = 0;
-	global_t *glob = STK(-narg - 2)->obj.glob;
+	global_t *glob = VAL_GLOB(STK(-narg - 2));
 	
 	do {
 		/*
@@ -104,19 +101,18 @@ void su_transaction(su_state *s, int narg) {
 		
 		ptr = (map_t*)atomic_get_ptr(&glob->value);
 		if (ptr) {
-			v.type = SU_MAP;
-			v.obj.ptr = ptr;
+			SET_OBJ(&v, SU_MAP, ptr);
 		} else {
-			v.type = SU_NIL;
+			SET_NIL(&v);
 		}
 		
 		su_copy(s, -narg - 1);
 		push_value(s, &v);
 		su_copy_range(s, -narg - 2, narg);
 		su_call(s, narg + 1, 1);
-		t = STK(-1)->type;
+		t = VAL_TYPE(STK(-1));
 		su_assert(s, t == SU_NIL || t == SU_MAP, "Expected hashmap or nil!");
-		nptr = t == SU_MAP ? STK(-1)->obj.ptr : NULL;
+		nptr = t == SU_MAP ? VAL_PTR(STK(-1)) : NULL;
 	} while(!atomic_cas_ptr(&glob->value, ptr, nptr));
 	
 	gc_gray_mutable(s, &glob->gc);
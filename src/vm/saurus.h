@@ -13,6 +13,7 @@
 /********** Options ***********/
 
 /* #define SU_OPT_C_LINE */
+/* #define SU_OPT_NAN_BOXING */
 
 /******************************/
 
@@ -22,7 +23,13 @@
 
 #define SU_SCRATCHPAD_SIZE 1024
 #define SU_VALUE_DATA_SIZE 8
-#define SU_VALUE_SIZE 16
+#define SU_SIG_ARGS 4
+
+#ifdef SU_OPT_NAN_BOXING
+	#define SU_VALUE_SIZE 8
+#else
+	#define SU_VALUE_SIZE 16
+#endif
 
 typedef struct state su_state;
 
@@ -78,6 +85,16 @@ typedef struct {
 	su_native_data_trace_cb_t trace_callback;
 } su_data_class_t;
 
+/* Arity and argument types of a native function, checked by the VM before
+   each call. Arguments given as SU_NIL, or left out, accept any type and a
+   negative max_narg means no upper bound. Signatures must outlive the state. */
+typedef struct {
+	const char *name;
+	su_nativefunc func;
+	int min_narg, max_narg;
+	su_object_type_t args[SU_SIG_ARGS];
+} su_native_sig;
+
 su_state *su_init(su_alloc alloc);
 void su_close(su_state *s);
 void su_libinit(su_state *s);
@@ -88,11 +105,13 @@ char *su_scratchpad(su_state *s);
 int su_compile(su_state *s, const char *code, const char *name, char **inline_c, char **result, size_t *size);
 int su_clambda(su_state *s, su_nativefunc f);
 void su_debug(su_state *s, int mask, su_debugfunc f, void *data);
+void su_profile(su_state *s, FILE *fp);
 
 void su_fork(su_state *s, int narg);
 void su_transaction(su_state *s, int narg);
 void su_thread_disposable(su_state *s);
 void su_thread_indisposable(su_state *s);
+void su_safepoint(su_state *s);
 int su_num_threads(su_state *s);
 int su_num_cores(su_state *s);
 
@@ -112,9 +131,12 @@ void su_check_num_arguments(su_state *s, int num);
 const char *su_stringify(su_state *s, int idx);
 const char *su_type_name(su_state *s, int idx);
 su_object_type_t su_type(su_state *s, int idx);
+int su_equal(su_state *s, int a, int b);
 
 void su_pushnil(su_state *s);
 void su_pushfunction(su_state *s, su_nativefunc f);
+void su_pushnative(su_state *s, const su_native_sig *sig);
+void su_pushnatives(su_state *s, const su_native_sig *sigs, int num);
 su_nativefunc su_tofunction(su_state *s, int idx);
 void su_pushnumber(su_state *s, double n);
 double su_tonumber(su_state *s, int idx);
@@ -172,6 +194,10 @@ int su_getglobal(su_state *s, const char *name);
 void su_setglobal(su_state *s, const char *name);
 
 int su_load(su_state *s, su_reader reader, void *data);
+
+/* Calls the value below the narg arguments and leaves exactly nret results
+   in its place, padded with nil. A native function returns the number of
+   results it left on top of the stack. */
 void su_call(su_state *s, int narg, int nret);
 void su_pop(su_state *s, int n);
 void su_copy(su_state *s, int idx);
@@ -187,5 +213,6 @@ FILE *su_stderr(su_state *s);
 void su_set_stdout(su_state *s, FILE *fp);
 void su_set_stdin(su_state *s, FILE *fp);
 void su_set_stderr(su_state *s, FILE *fp);
+void su_set_stack_limit(su_state *s, int values, int calls);
 
 #endif
@@ -30,16 +30,16 @@ const seq_class_t cell_vt = {&cell_first, &cell_rest};
 value_t cell_create_array(su_state *s, value_t *array, int num) {
 	int i;
 	value_t tmp;
-	cell_seq_t *cell = (cell_seq_t*)su_allocate(s, NULL, sizeof(cell_seq_t) * num);
-	tmp.type = SU_NIL;
+	cell_seq_t *cell;
+	SET_NIL(&tmp);
 	
+	/* Each cell is freed on its own, so each gets its own slot. */
 	for (i = num - 1; i >= 0; i--) {
+		cell = (cell_seq_t*)gc_allocate(s, sizeof(cell_seq_t));
 		cell->first = array[i];
 		cell->rest = tmp;
 		cell->q.vt = &cell_vt;
-		tmp.type = CELL_SEQ;
-		tmp.obj.gc_object = gc_insert_object(s, &cell->q.gc, CELL_SEQ);
-		cell++;
+		SET_OBJ(&tmp, CELL_SEQ, gc_insert_object(s, &cell->q.gc, CELL_SEQ));
 	}
 	
 	return tmp;
@@ -47,26 +47,24 @@ value_t cell_create_array(su_state *s, value_t *array, int num) {
 
 value_t cell_create(su_state *s, value_t *first, value_t *rest) {
 	value_t v;
-	cell_seq_t *cell = (cell_seq_t*)su_allocate(s, NULL, sizeof(cell_seq_t));
+	cell_seq_t *cell = (cell_seq_t*)gc_allocate(s, sizeof(cell_seq_t));
 	cell->first = *first;
 	cell->rest = *rest;
 	cell->q.vt = &cell_vt;
 	
-	v.type = CELL_SEQ;
-	v.obj.gc_object = gc_insert_object(s, &cell->q.gc, CELL_SEQ);
+	SET_OBJ(&v, CELL_SEQ, gc_insert_object(s, &cell->q.gc, CELL_SEQ));
 	return v;
 }
 
 static value_t it_next(su_state *s, it_seq_t *iq) {
 	value_t v;
-	it_seq_t *it = (it_seq_t*)su_allocate(s, NULL, sizeof(it_seq_t));
+	it_seq_t *it = (it_seq_t*)gc_allocate(s, sizeof(it_seq_t));
 	it->idx = iq->idx + iq->step;
 	it->step = iq->step;
 	it->obj = iq->obj;
 	it->q.vt = iq->q.vt;
 	
-	v.type = IT_SEQ;
-	v.obj.gc_object = gc_insert_object(s, &it->q.gc, IT_SEQ);
+	SET_OBJ(&v, IT_SEQ, gc_insert_object(s, &it->q.gc, IT_SEQ));
 	return v;
 }
 
@@ -76,8 +74,7 @@ static value_t it_string_first(su_state *s, seq_t *q) {
 	it_seq_t *iq = (it_seq_t*)q;
 	buffer[0] = ((string_t*)iq->obj)->str[iq->idx];
 	
-	v.type = SU_STRING;
-	v.obj.gc_object = string_from_cache(s, buffer, 2);
+	SET_OBJ(&v, SU_STRING, string_from_cache(s, buffer, 2));
 	return v;
 }
 
@@ -86,7 +83,7 @@ static value_t it_string_rest(su_state *s, seq_t *q) {
 	it_seq_t *iq = (it_seq_t*)q;
 	
 	if (iq->step > 0 ? (iq->idx + 2 == ((string_t*)iq->obj)->size) : !iq->idx) {
-		v.type = SU_NIL;
+		SET_NIL(&v);
 		return v;
 	} 
 	
@@ -103,7 +100,7 @@ static value_t it_vector_rest(su_state *s, seq_t *q) {
 	it_seq_t *iq = (it_seq_t*)q;
 	
 	if (iq->step > 0 ? (iq->idx + 1 == ((vector_t*)iq->obj)->cnt) : !iq->idx) {
-		v.type = SU_NIL;
+		SET_NIL(&v);
 		return v;
 	}
 	
@@ -117,11 +114,11 @@ value_t it_create_vector(su_state *s, vector_t *vec, int reverse) {
 	it_seq_t *it;
 	
 	if (vec->cnt == 0) {
-		v.type = SU_NIL;
+		SET_NIL(&v);
 		return v;
 	}
 	
-	it = (it_seq_t*)su_allocate(s, NULL, sizeof(it_seq_t));
+	it = (it_seq_t*)gc_allocate(s, sizeof(it_seq_t));
 	if (reverse) {
 		it->idx = vec->cnt - 1;
 		it->step = -1;
@@ -133,8 +130,7 @@ value_t it_create_vector(su_state *s, vector_t *vec, int reverse) {
 	it->obj = (gc_t*)vec;
 	it->q.vt = &it_vt;
 	
-	v.type = IT_SEQ;
-	v.obj.gc_object = gc_insert_object(s, &it->q.gc, IT_SEQ);
+	SET_OBJ(&v, IT_SEQ, gc_insert_object(s, &it->q.gc, IT_SEQ));
 	return v;
 }
 
@@ -145,11 +141,11 @@ value_t it_create_string(su_state *s, string_t *str, int reverse) {
 	it_seq_t *it;
 	
 	if (str->size <= 1) {
-		v.type = SU_NIL;
+		SET_NIL(&v);
 		return v;
 	}
 	
-	it = (it_seq_t*)su_allocate(s, NULL, sizeof(it_seq_t));
+	it = (it_seq_t*)gc_allocate(s, sizeof(it_seq_t));
 	if (reverse) {
 		it->idx = str->size - 2;
 		it->step = -1;
@@ -161,16 +157,14 @@ value_t it_create_string(su_state *s, string_t *str, int reverse) {
 	it->obj = (gc_t*)str;
 	it->q.vt = &str_vt;
 	
-	v.type = IT_SEQ;
-	v.obj.gc_object = gc_insert_object(s, &it->q.gc, IT_SEQ);
+	SET_OBJ(&v, IT_SEQ, gc_insert_object(s, &it->q.gc, IT_SEQ));
 	return v;
 }
 
 static value_t range_first(su_state *s, seq_t *q) {
 	value_t v;
 	range_seq_t *r = (range_seq_t*)q;
-	v.type = SU_NUMBER;
-	v.obj.num = (double)r->cnt;
+	SET_NUM(&v, (double)r->cnt);
 	return v;
 }
 
@@ -180,14 +174,15 @@ static value_t range_rest(su_state *s, seq_t *q) {
 	range_seq_t *r = (range_seq_t*)q;
 	
 	if (r->cnt + r->step == r->end) {
-		v.type = SU_NIL;
+		SET_NIL(&v);
 		return v;
 	} else {
-		tmp = (range_seq_t*)su_allocate(s, NULL, sizeof(range_seq_t));
-		memcpy(tmp, r, sizeof(range_seq_t));
-		tmp->cnt += tmp->step;
-		v.type = RANGE_SEQ;
-		v.obj.gc_object = gc_insert_object(s, &tmp->q.gc, RANGE_SEQ);
+		tmp = (range_seq_t*)gc_allocate(s, sizeof(range_seq_t));
+		tmp->q.vt = r->q.vt;
+		tmp->cnt = r->cnt + r->step;
+		tmp->end = r->end;
+		tmp->step = r->step;
+		SET_OBJ(&v, RANGE_SEQ, gc_insert_object(s, &tmp->q.gc, RANGE_SEQ));
 		return v;
 	}
 }
@@ -199,15 +194,14 @@ value_t range_create(su_state *s, int from, int to) {
 	range_seq_t *r;
 	int range = to - from;
 	
-	r = (range_seq_t*)su_allocate(s, NULL, sizeof(range_seq_t));
+	r = (range_seq_t*)gc_allocate(s, sizeof(range_seq_t));
 	r->step = (range > 0) ? 1 : -1;
 	r->end = to + r->step;
 	r->cnt = from;
 	
 	r->q.vt = &range_vt;
 	
-	v.type = RANGE_SEQ;
-	v.obj.gc_object = gc_insert_object(s, &r->q.gc, RANGE_SEQ);
+	SET_OBJ(&v, RANGE_SEQ, gc_insert_object(s, &r->q.gc, RANGE_SEQ));
 	return v;
 }
 
@@ -224,19 +218,18 @@ static value_t lazy_rest(su_state *s, seq_t *q) {
 	push_value(s, &r->d);
 	su_call(s, 1, 1);
 	
-	if (STK(-1)->type == SU_NIL) {
+	if (VAL_TYPE(STK(-1)) == SU_NIL) {
 		su_pop(s, 1);
-		v.type = SU_NIL;
+		SET_NIL(&v);
 		return v;
 	} else {
-		tmp = (lazy_seq_t*)su_allocate(s, NULL, sizeof(lazy_seq_t));
-		memcpy(tmp, r, sizeof(lazy_seq_t));
-		
+		tmp = (lazy_seq_t*)gc_allocate(s, sizeof(lazy_seq_t));
+		tmp->q.vt = r->q.vt;
+		tmp->f = r->f;
 		tmp->d = *STK(-1);
 		su_pop(s, 1);
 		
-		v.type = LAZY_SEQ;
-		v.obj.gc_object = gc_insert_object(s, &tmp->q.gc, LAZY_SEQ);
+		SET_OBJ(&v, LAZY_SEQ, gc_insert_object(s, &tmp->q.gc, LAZY_SEQ));
 		return v;
 	}
 }
@@ -246,7 +239,7 @@ const seq_class_t lazy_vt = {&lazy_first, &lazy_rest};
 value_t lazy_create(su_state *s, value_t *f) {
 	lazy_seq_t r;
 	r.f = *f;
-	r.d.type = SU_NIL;
+	SET_NIL(&r.d);
 	r.q.vt = &lazy_vt;
 	return lazy_rest(s, (seq_t*)&r);
 }
@@ -280,7 +273,7 @@ static node_leaf_t *tree_next(tree_link_t *path, node_t *n, int depth, int *out_
 	vn = *(vector_node_t**)(n + 1);
 	for (i = path[depth].idx; i < vn->len; i++) {
 		v = &vn->data[i];
-		leaf = tree_next(path, (node_t*)v->obj.map_node, depth + 1, out_depth, first_leaf);
+		leaf = tree_next(path, (node_t*)VAL_MNODE(v), depth + 1, out_depth, first_leaf);
 		if (leaf) {
 			path[depth].n = (node_t*)n;
 			path[depth].idx = i;
@@ -302,7 +295,7 @@ static value_t tree_rest(su_state *s, seq_t *q) {
 	memcpy(path, ts->links, sizeof(tree_link_t) * ts->nlinks);
 
 	if (!tree_next(path, path[0].n, 0, &depth, &leaf)) {
-		v.type = SU_NIL;
+		SET_NIL(&v);
 		return v;
 	}
 	
@@ -313,13 +306,12 @@ const seq_class_t tree_vt = {&tree_first, &tree_rest};
 
 static value_t build_tree_seq(su_state *s, tree_link_t *path, int depth) {
 	value_t v;
-	tree_seq_t *ts = (tree_seq_t*)su_allocate(s, NULL, sizeof(tree_seq_t) + sizeof(tree_link_t) * (depth - 1));
+	tree_seq_t *ts = (tree_seq_t*)gc_allocate(s, sizeof(tree_seq_t) + sizeof(tree_link_t) * (depth - 1));
 	ts->nlinks = depth;
 	ts->q.vt = &tree_vt;
 	memcpy(ts->links, path, sizeof(tree_link_t) * depth);
 	
-	v.type = TREE_SEQ;
-	v.obj.gc_object = gc_insert_object(s, &ts->q.gc, TREE_SEQ);
+	SET_OBJ(&v, TREE_SEQ, gc_insert_object(s, &ts->q.gc, TREE_SEQ));
 	return v;
 }
 
@@ -330,7 +322,7 @@ value_t tree_create_map(su_state *s, map_t *m) {
 	node_t *n, *ln;
 	
 	if (!m->cnt) {
-		v.type = SU_NIL;
+		SET_NIL(&v);
 		return v;
 	}
 	
@@ -341,7 +333,7 @@ value_t tree_create_map(su_state *s, map_t *m) {
 		path[i].idx = 0;
 		if (n->gc.type == MAP_LEAF)
 			break;
-		n = ((vector_node_t*)ln)->data[0].obj.map_node;
+		n = VAL_MNODE(&((vector_node_t*)ln)->data[0]);
 	}
 
 	return build_tree_seq(s, path, i + 1);
@@ -364,7 +356,7 @@ static vector_node_t *insert(su_state *s, int level, vector_node_t *arr, int i,
 static vector_node_t *pop_tail(su_state *s, int shift, vector_node_t *arr, vector_node_t **ptail);
 
 static vector_node_t *node_create_only(su_state *s, int len) {
-	vector_node_t *node = (vector_node_t*)su_allocate(s, NULL, (sizeof(vector_node_t) + sizeof(value_t) * len) - sizeof(value_t));
+	vector_node_t *node = (vector_node_t*)gc_allocate(s, (sizeof(vector_node_t) + sizeof(value_t) * len) - sizeof(value_t));
 	node->len = (unsigned char)len;
 	gc_insert_object(s, (gc_t*)node, VECTOR_NODE);
 	return node;
@@ -396,11 +388,10 @@ int vector_length(vector_t *v) {
 value_t vector_cat(su_state *s, vector_t *a, vector_t *b) {
 	int i;
 	value_t v, tmp;
-	v.type = SU_VECTOR;
-	v.obj.vec = a;
+	SET_OBJ(&v, SU_VECTOR, a);
 	for (i = 0; i < b->cnt; i++) {
 		tmp = vector_index(s, b, i);
-		v = vector_push(s, v.obj.vec, &tmp);
+		v = vector_push(s, VAL_VEC(&v), &tmp);
 	}
 	return v;
 }
@@ -413,7 +404,7 @@ value_t vector_index(su_state *s, vector_t *v, int i) {
 			return v->tail->data[i & 0x01f];
 		arr = v->root;
 		for (level = v->shift; level > 0; level -= 5)
-			arr = arr->data[(i >> level) & 0x01f].obj.vec_node;
+			arr = VAL_VNODE(&arr->data[(i >> level) & 0x01f]);
 		return arr->data[i & 0x01f];
 	}
 	su_error(s, "Index is out of bounds: %i", i);
@@ -423,14 +414,13 @@ value_t vector_index(su_state *s, vector_t *v, int i) {
 value_t vector_create(su_state *s, unsigned cnt, int shift, vector_node_t *root, vector_node_t *tail) {
 	vector_t *vec;
 	value_t v;
-	v.type = SU_VECTOR;
-	v.obj.gc_object = (gc_t*)su_allocate(s, NULL, sizeof(vector_t));
-	gc_insert_object(s, v.obj.gc_object, SU_VECTOR);
+	SET_OBJ(&v, SU_VECTOR, (gc_t*)gc_allocate(s, sizeof(vector_t)));
+	gc_insert_object(s, VAL_GC(&v), SU_VECTOR);
 	
 	assert(root);
 	assert(tail);
 	
-	vec = (vector_t*)v.obj.gc_object;
+	vec = (vector_t*)VAL_GC(&v);
 	vec->cnt = cnt;
 	vec->shift = shift;
 	vec->root = root;
@@ -442,6 +432,48 @@ value_t vector_create_empty(su_state *s) {
 	return vector_create(s, 0, 5, node_create_only(s, 0), node_create_only(s, 0));
 }
 
+static vector_node_t *node_create_parent(su_state *s, vector_node_t **children, int len) {
+	int i;
+	vector_node_t *node = node_create_only(s, len);
+	for (i = 0; i < len; i++)
+		SET_OBJ(&node->data[i], VECTOR_NODE, children[i]);
+	return node;
+}
+
+/* Builds the vector in one pass, in the shape repeated pushes would give.
+   The tail takes the last 1 to 32 values and the trie is built bottom up
+   from full leaves, each node but the rightmost on a level being full. */
+value_t vector_create_array(su_state *s, value_t *array, int num) {
+	int i, len, shift = 5;
+	int tail_len = num ? ((num - 1) & 0x1f) + 1 : 0;
+	int count = (num - tail_len) >> 5;
+	vector_node_t *root, *tail;
+	vector_node_t *buffer[32];
+	vector_node_t **nodes = count > 32 ? (vector_node_t**)su_allocate(s, NULL, sizeof(vector_node_t*) * count) : buffer;
+	
+	for (i = 0; i < count; i++) {
+		nodes[i] = node_create_only(s, 32);
+		memcpy(nodes[i]->data, &array[i << 5], sizeof(value_t) * 32);
+	}
+	
+	while (count > 32) {
+		for (i = 0; i < count; i += 32) {
+			len = count - i < 32 ? count - i : 32;
+			nodes[i >> 5] = node_create_parent(s, &nodes[i], len);
+		}
+		count = (count + 31) >> 5;
+		shift += 5;
+	}
+	
+	root = node_create_parent(s, nodes, count);
+	if (nodes != buffer)
+		su_allocate(s, nodes, 0);
+	
+	tail = node_create_only(s, tail_len);
+	memcpy(tail->data, &array[num - tail_len], sizeof(value_t) * tail_len);
+	return vector_create(s, num, shift, root, tail);
+}
+
 value_t vector_push(su_state *s, vector_t *vec, value_t *val) {
 	value_t expansion_value, tmp;
 	vector_node_t *expansion = NULL, *new_root;
@@ -456,9 +488,8 @@ value_t vector_push(su_state *s, vector_t *vec, value_t *val) {
 	
 	new_root = push_tail(s, vec->shift - 5, vec->root, vec->tail, &expansion);
 	if (expansion) {
-		expansion_value.type = tmp.type = VECTOR_NODE;
-		expansion_value.obj.vec_node = expansion;
-		tmp.obj.vec_node = new_root;
+		SET_OBJ(&expansion_value, VECTOR_NODE, expansion);
+		SET_OBJ(&tmp, VECTOR_NODE, new_root);
 		new_root = node_create2(s, &tmp, &expansion_value);
 		new_shift += 5;
 	}
@@ -473,11 +504,10 @@ static vector_node_t *push_tail(su_state *s, int level, vector_node_t *arr, vect
 	if (level == 0) {
 		new_child = tail_node;
 	} else {
-		new_child = push_tail(s, level - 5, arr->data[arr->len - 1].obj.vec_node, tail_node, expansion);
+		new_child = push_tail(s, level - 5, VAL_VNODE(&arr->data[arr->len - 1]), tail_node, expansion);
 		if (*expansion == NULL) {
 			ret = node_clone(s, arr);
-			tmp.type = VECTOR_NODE;
-			tmp.obj.vec_node = new_child;
+			SET_OBJ(&tmp, VECTOR_NODE, new_child);
 			ret->data[arr->len - 1] = tmp;
 			return ret;
 		} else {
@@ -487,8 +517,7 @@ static vector_node_t *push_tail(su_state *s, int level, vector_node_t *arr, vect
 	
 	/* Do expansion */
 	
-	tmp.type = VECTOR_NODE;
-	tmp.obj.vec_node = new_child;
+	SET_OBJ(&tmp, VECTOR_NODE, new_child);
 	
 	if (arr->len == 32) {
 		*expansion = node_create1(s, &tmp);
@@ -525,8 +554,7 @@ static vector_node_t *insert(su_state *s, int level, vector_node_t *arr, int i,
 		ret->data[i & 0x01f] = *val;
 	} else {
 		subidx = (i >> level) & 0x01f;
-		tmp.type = VECTOR_NODE;
-		tmp.obj.vec_node = insert(s, level - 5, arr->data[subidx].obj.vec_node, i, val);
+		SET_OBJ(&tmp, VECTOR_NODE, insert(s, level - 5, VAL_VNODE(&arr->data[subidx]), i, val));
 		ret->data[subidx] = tmp;
 	}
 	return ret;
@@ -553,7 +581,7 @@ value_t vector_pop(su_state *s, vector_t *vec) {
 		new_root = node_create_only(s, 0);
 
 	if (vec->shift > 5 && new_root->len == 1) {
-		new_root = new_root->data[0].obj.vec_node;
+		new_root = VAL_VNODE(&new_root->data[0]);
 		new_shift -= 5;
 	}
 
@@ -565,10 +593,9 @@ static vector_node_t *pop_tail(su_state *s, int shift, vector_node_t *arr, vecto
 	value_t tmp;
 	
 	if (shift > 0) {
-		new_child = pop_tail(s, shift - 5, arr->data[arr->len - 1].obj.vec_node, ptail);
+		new_child = pop_tail(s, shift - 5, VAL_VNODE(&arr->data[arr->len - 1]), ptail);
 		if (new_child != NULL) {
-			tmp.type = VECTOR_NODE;
-			tmp.obj.vec_node = new_child;
+			SET_OBJ(&tmp, VECTOR_NODE, new_child);
 			ret = node_clone(s, arr);
 			ret->data[arr->len - 1] = tmp;
 			return ret;
@@ -576,7 +603,7 @@ static vector_node_t *pop_tail(su_state *s, int shift, vector_node_t *arr, vecto
 	}
 	
 	if (shift == 0)
-		*ptail = arr->data[arr->len - 1].obj.vec_node;
+		*ptail = VAL_VNODE(&arr->data[arr->len - 1]);
 	
 	/* Contraction */
 	
@@ -613,14 +640,13 @@ static node_t *full_node_set(su_state *s, node_t *n, int shift, int hash, value_
 	CAST_AND_TEST(node_full_t, MAP_FULL);
 	
 	idx = MASK(hash, shift);
-	tmp = thiz->nodes->data[idx].obj.map_node;
+	tmp = VAL_MNODE(&thiz->nodes->data[idx]);
 	tmp = tmp->vt->set(s, tmp, shift + 5, hash, key, val, added_leaf);
-	if (tmp == thiz->nodes->data[idx].obj.map_node) {
+	if (tmp == VAL_MNODE(&thiz->nodes->data[idx])) {
 		return n;
 	} else {
 		new_nodes = node_clone(s, thiz->nodes);
-		v.type = tmp->gc.type;
-		v.obj.map_node = tmp;
+		SET_OBJ(&v, tmp->gc.type, tmp);
 		new_nodes->data[idx] = v;
 		return create_full_node(s, new_nodes, shift);
 	}
@@ -634,9 +660,9 @@ static node_t *full_node_without(su_state *s, node_t *n, int hash, value_t *key)
 	CAST_AND_TEST(node_full_t, MAP_FULL);
 	
 	idx = MASK(hash, thiz->shift);
-	tmp = thiz->nodes->data[idx].obj.map_node;
+	tmp = VAL_MNODE(&thiz->nodes->data[idx]);
 	tmp = tmp->vt->without(s, tmp, hash, key);
-	if (tmp != thiz->nodes->data[idx].obj.map_node) {
+	if (tmp != VAL_MNODE(&thiz->nodes->data[idx])) {
 		if (!tmp) {
 			new_nodes = node_create_only(s, thiz->nodes->len - 1);
 			memcpy(new_nodes->data, thiz->nodes->data, sizeof(value_t) * idx);
@@ -645,8 +671,7 @@ static node_t *full_node_without(su_state *s, node_t *n, int hash, value_t *key)
 		}
 		
 		new_nodes = node_clone(s, thiz->nodes);
-		v.type = tmp->gc.type;
-		v.obj.map_node = tmp;
+		SET_OBJ(&v, tmp->gc.type, tmp);
 		new_nodes->data[idx] = v;
 		return create_full_node(s, new_nodes, thiz->shift);
 	}
@@ -656,7 +681,7 @@ static node_t *full_node_without(su_state *s, node_t *n, int hash, value_t *key)
 static node_leaf_t *full_node_find(su_state *s, node_t *n, int hash, value_t *key) {
 	node_t *tmp;
 	CAST_AND_TEST(node_full_t, MAP_FULL);
-	tmp = thiz->nodes->data[MASK(hash, thiz->shift)].obj.map_node;
+	tmp = VAL_MNODE(&thiz->nodes->data[MASK(hash, thiz->shift)]);
 	return tmp->vt->find(s, tmp, hash, key);
 }
 
@@ -674,10 +699,10 @@ const node_class_t full_vt = {
 
 static node_t *create_full_node(su_state *s, vector_node_t *nodes, int shift) {
 	node_t *tmp, *n;
-	node_full_t *fn = (node_full_t*)su_allocate(s, NULL, sizeof(node_full_t));
+	node_full_t *fn = (node_full_t*)gc_allocate(s, sizeof(node_full_t));
 	fn->nodes = nodes;
 	fn->shift = shift;
-	tmp = nodes->data[0].obj.map_node;
+	tmp = VAL_MNODE(&nodes->data[0]);
 	fn->hash = tmp->vt->get_hash(s, tmp);
 	
 	n = (node_t*)fn;
@@ -702,22 +727,21 @@ static node_t *idx_node_set(su_state *s, node_t *n, int shift, int hash, value_t
 	idx = idx_node_index(n, bit);
 	
 	if ((thiz->bitmap & bit) != 0) {
-		tmp = thiz->nodes->data[idx].obj.map_node;
+		tmp = VAL_MNODE(&thiz->nodes->data[idx]);
 		tmp = tmp->vt->set(s, tmp, shift + 5, hash, key, val, added_leaf);
-		if (tmp == thiz->nodes->data[idx].obj.map_node) {
+		if (tmp == VAL_MNODE(&thiz->nodes->data[idx])) {
 			return n;
 		} else {
 			new_nodes = node_clone(s, thiz->nodes);
-			v.type = tmp->gc.type;
-			v.obj.map_node = tmp;
+			SET_OBJ(&v, tmp->gc.type, tmp);
 			new_nodes->data[idx] = v;
 			return create_idx_node(s, thiz->bitmap, new_nodes, shift);
 		}
 	} else {
 		new_nodes = node_create_only(s, thiz->nodes->len + 1);
 		memcpy(new_nodes->data, thiz->nodes->data, sizeof(value_t) * idx);
-		*added_leaf = new_nodes->data[idx].obj.map_node = create_leaf_node(s, hash, key, val);
-		new_nodes->data[idx].type = (*added_leaf)->gc.type;
+		*added_leaf = create_leaf_node(s, hash, key, val);
+		SET_OBJ(&new_nodes->data[idx], (*added_leaf)->gc.type, *added_leaf);
 		xmemcpy(new_nodes->data, sizeof(value_t) * (idx + 1), thiz->nodes->data, sizeof(value_t) * idx, sizeof(value_t) * (thiz->nodes->len - idx));
 		return create_idx_node2(s, thiz->bitmap | bit, new_nodes, shift);
 	}
@@ -733,9 +757,9 @@ static node_t *idx_node_without(su_state *s, node_t *n, int hash, value_t *key)
 	
 	if ((thiz->bitmap & bit) != 0) {
 		idx = idx_node_index(n, bit);
-		tmp = thiz->nodes->data[idx].obj.map_node;
+		tmp = VAL_MNODE(&thiz->nodes->data[idx]);
 		tmp = tmp->vt->without(s, tmp, hash, key);
-		if (tmp != thiz->nodes->data[idx].obj.map_node) {
+		if (tmp != VAL_MNODE(&thiz->nodes->data[idx])) {
 			if (!tmp) {
 				if (thiz->bitmap == bit)
 					return NULL;
@@ -746,8 +770,7 @@ static node_t *idx_node_without(su_state *s, node_t *n, int hash, value_t *key)
 				return create_idx_node(s, thiz->bitmap & ~bit, new_nodes, thiz->shift);
 			}
 			new_nodes = node_clone(s, thiz->nodes);
-			v.type = tmp->gc.type;
-			v.obj.map_node = tmp;
+			SET_OBJ(&v, tmp->gc.type, tmp);
 			new_nodes->data[idx] = v;
 			return create_idx_node(s, thiz->bitmap, new_nodes, thiz->shift);
 		}
@@ -761,7 +784,7 @@ static node_leaf_t *idx_node_find(su_state *s, node_t *n, int hash, value_t *key
 	CAST_AND_TEST(node_idx_t, MAP_IDX);
 	bit = BITPOS(hash, thiz->shift);
 	if ((thiz->bitmap & bit) != 0) {
-		tmp = thiz->nodes->data[idx_node_index(n, bit)].obj.map_node;
+		tmp = VAL_MNODE(&thiz->nodes->data[idx_node_index(n, bit)]);
 		return tmp->vt->find(s, tmp, hash, key);
 	} else {
 		return NULL;
@@ -783,11 +806,11 @@ const node_class_t idx_vt = {
 static node_t *create_idx_node(su_state *s, int bitmap, vector_node_t *nodes, int shift) {
 	node_t *n;
 	node_t *tmp;
-	node_idx_t *in = (node_idx_t*)su_allocate(s, NULL, sizeof(node_idx_t));
+	node_idx_t *in = (node_idx_t*)gc_allocate(s, sizeof(node_idx_t));
 	in->bitmap = bitmap;
 	in->shift = shift;
 	in->nodes = nodes;
-	tmp = nodes->data[0].obj.map_node;
+	tmp = VAL_MNODE(&nodes->data[0]);
 	in->hash = tmp->vt->get_hash(s, tmp);
 	
 	n = (node_t*)in;
@@ -806,8 +829,7 @@ static node_t *create_idx_node3(su_state *s, int shift, node_t *branch, int hash
 	vector_node_t *vec;
 	node_t *n;
 	
-	v.type = branch->gc.type;
-	v.obj.map_node = branch;
+	SET_OBJ(&v, branch->gc.type, branch);
 	vec = node_create1(s, &v);
 	
 	n = create_idx_node(s, BITPOS(branch->vt->get_hash(s, branch), shift), vec, shift);
@@ -821,7 +843,7 @@ static int collision_node_find_index(su_state *s, node_t *n, int hash, value_t *
 	node_t *tmp;
 	CAST_AND_TEST(node_collision_t, MAP_COLLISION);
 	for (i = 0; i < thiz->leaves->len; i++) {
-		tmp = thiz->leaves->data[i].obj.map_node;
+		tmp = VAL_MNODE(&thiz->leaves->data[i]);
 		if (tmp->vt->find(s, tmp, hash, key))
 			return i;
 	}
@@ -841,8 +863,7 @@ static node_t *collision_node_set(su_state *s, node_t *n, int shift, int hash, v
 				return n;
 			
 			new_leaves = node_clone(s, thiz->leaves);
-			v.type = MAP_LEAF;
-			v.obj.map_node = (node_t*)create_leaf_node(s, hash, key, val);
+			SET_OBJ(&v, MAP_LEAF, (node_t*)create_leaf_node(s, hash, key, val));
 			new_leaves->data[idx] = v;
 			return create_collision_node(s, hash, new_leaves);
 		}
@@ -851,8 +872,7 @@ static node_t *collision_node_set(su_state *s, node_t *n, int shift, int hash, v
 		memcpy(new_leaves->data, thiz->leaves->data, sizeof(value_t) * thiz->leaves->len);
 		
 		*added_leaf = (node_t*)create_leaf_node(s, hash, key, val);
-		v.obj.map_node = *added_leaf;
-		v.type = v.obj.map_node->gc.type;
+		SET_OBJ(&v, (*added_leaf)->gc.type, *added_leaf);
 		new_leaves->data[thiz->leaves->len] = v;
 		return create_collision_node(s, hash, new_leaves);
 	}
@@ -867,7 +887,7 @@ static node_t *collision_node_without(su_state *s, node_t *n, int hash, value_t
 	if (idx == -1)
 		return n;
 	if (thiz->leaves->len == 2)
-		return idx == 0 ? thiz->leaves->data[1].obj.map_node : thiz->leaves->data[0].obj.map_node;
+		return idx == 0 ? VAL_MNODE(&thiz->leaves->data[1]) : VAL_MNODE(&thiz->leaves->data[0]);
 	
 	new_leaves = node_create_only(s, thiz->leaves->len - 1);
 	memcpy(new_leaves->data, thiz->leaves->data, sizeof(value_t) * idx);
@@ -881,7 +901,7 @@ static node_leaf_t *collision_node_find(su_state *s, node_t *n, int hash, value_
 	CAST_AND_TEST(node_collision_t, MAP_COLLISION);
 	idx = collision_node_find_index(s, n, hash, key);
 	if (idx != -1) {
-		tmp = (node_leaf_t*)thiz->leaves->data[idx].obj.map_node;
+		tmp = (node_leaf_t*)VAL_MNODE(&thiz->leaves->data[idx]);
 		assert(tmp->n.gc.type == MAP_LEAF);
 		return tmp;
 	}
@@ -902,7 +922,7 @@ const node_class_t collision_vt = {
 
 static node_t *create_collision_node(su_state *s, int hash, vector_node_t *leaves) {
 	node_t *n;
-	node_collision_t *cn = (node_collision_t*)su_allocate(s, NULL, sizeof(node_collision_t));
+	node_collision_t *cn = (node_collision_t*)gc_allocate(s, sizeof(node_collision_t));
 	cn->hash = hash;
 	cn->leaves = leaves;
 	
@@ -925,10 +945,8 @@ static node_t *leaf_node_set(su_state *s, node_t *n, int shift, int hash, value_
 		}
 		
 		*added_leaf = create_leaf_node(s, hash, key, val);
-		v.type = (*added_leaf)->gc.type;
-		v.obj.map_node = *added_leaf;
-		t.type = n->gc.type;
-		t.obj.map_node = n;
+		SET_OBJ(&v, (*added_leaf)->gc.type, *added_leaf);
+		SET_OBJ(&t, n->gc.type, n);
 		
 		return create_collision_node(s, hash, node_create2(s, &t, &v));
 	}
@@ -963,7 +981,7 @@ const node_class_t leaf_vt = {
 
 static node_t *create_leaf_node(su_state *s, int hash, value_t *key, value_t *val) {
 	node_t *n;
-	node_leaf_t *ln = (node_leaf_t*)su_allocate(s, NULL, sizeof(node_leaf_t));
+	node_leaf_t *ln = (node_leaf_t*)gc_allocate(s, sizeof(node_leaf_t));
 	ln->hash = hash;
 	ln->key = *key;
 	ln->val = *val;
@@ -1009,7 +1027,7 @@ const node_class_t empty_vt = {
 };
 
 static node_t *create_empty_node(su_state *s) {
-	node_t *n = (node_t*)su_allocate(s, NULL, sizeof(node_t));
+	node_t *n = (node_t*)gc_allocate(s, sizeof(node_t));
 	n->vt = &empty_vt;
 	return (node_t*)gc_insert_object(s, &n->gc, MAP_EMPTY);
 }
@@ -1018,11 +1036,10 @@ static node_t *create_empty_node(su_state *s) {
 
 static value_t map_create(su_state *s, int cnt, node_t *root) {
 	value_t v;
-	map_t *m = (map_t*)su_allocate(s, NULL, sizeof(map_t));
+	map_t *m = (map_t*)gc_allocate(s, sizeof(map_t));
 	m->root = root;
 	m->cnt = cnt;
-	v.type = SU_MAP;
-	v.obj.gc_object = gc_insert_object(s, (gc_t*)m, SU_MAP);
+	SET_OBJ(&v, SU_MAP, gc_insert_object(s, (gc_t*)m, SU_MAP));
 	return v;
 }
 
@@ -1034,7 +1051,7 @@ value_t map_get(su_state *s, map_t *m, value_t *key, unsigned hash) {
 	value_t v;
 	node_leaf_t *n = m->root->vt->find(s, m->root, (int)hash, key);
 	if (!n) {
-		v.type = SU_INV;
+		SET_INV(&v);
 		return v;
 	}
 	return n->val;
@@ -1043,9 +1060,8 @@ value_t map_get(su_state *s, map_t *m, value_t *key, unsigned hash) {
 value_t map_remove(su_state *s, map_t *m, value_t *key, unsigned hash) {
 	value_t v;
 	node_t *new_root = m->root->vt->without(s, m->root, (int)hash, key);
-	v.type = SU_MAP;
 	if (new_root == m->root) {
-		v.obj.m = m;
+		SET_OBJ(&v, SU_MAP, m);
 		return v;
 	}
 	if (!new_root)
@@ -1058,8 +1074,7 @@ value_t map_insert(su_state *s, map_t *m, value_t *key, unsigned hash, value_t *
 	node_t *added_leaf = NULL;
 	node_t *new_root = m->root->vt->set(s, m->root, 0, (int)hash, key, val, &added_leaf);
 	if (new_root == m->root) {
-		v.type = SU_MAP;
-		v.obj.m = m;
+		SET_OBJ(&v, SU_MAP, m);
 		return v;
 	}
 	return map_create(s, added_leaf ? m->cnt + 1 : m->cnt, new_root);
@@ -1069,15 +1084,14 @@ value_t map_cat(su_state *s, map_t *a, map_t *b) {
 	value_t first, rest, kv, ret;
 	value_t seq = tree_create_map(s, b);
 	
-	ret.type = SU_MAP;
-	ret.obj.m = a;
+	SET_OBJ(&ret, SU_MAP, a);
 	
-	while (seq.type != SU_NIL) {
-		kv = seq_first(s, seq.obj.q);
-		first = seq_first(s, kv.obj.q);
-		rest = seq_rest(s, kv.obj.q);
+	while (VAL_TYPE(&seq) != SU_NIL) {
+		kv = seq_first(s, VAL_SEQ(&seq));
+		first = seq_first(s, VAL_SEQ(&kv));
+		rest = seq_rest(s, VAL_SEQ(&kv));
 		map_insert(s, a, &first, hash_value(&first), &rest);
-		seq = seq_rest(s, seq.obj.q);
+		seq = seq_rest(s, VAL_SEQ(&seq));
 	}
 	
 	return ret;
@@ -1096,16 +1110,15 @@ static value_t it_seq_string_first(su_state *s, seq_t *q) {
 	char buffer[2] = {0, 0};
 	it_seq_t *itq = (it_seq_t*)q;
 	string_t *str = (string_t*)itq->obj;
-	v.type = SU_STRING;
 	buffer[0] = str->str[itq->idx];
-	v.obj.gc_object = string_from_cache(s, buffer, 2);
+	SET_OBJ(&v, SU_STRING, string_from_cache(s, buffer, 2));
 	return v;
 }
 
 static value_t it_seq_string_rest(su_state *s, seq_t *q) {
 	value_t v;
 	it_seq_t *itq = (it_seq_t*)q;
-	v.type = SU_NIL;
+	SET_NIL(&v);
 	if (itq->idx + 1 >= ((string_t*)itq->obj)->size)
 		return v;
 	return it_seq_create_with_index(s, itq->obj, itq->idx + 1);
@@ -1119,7 +1132,7 @@ static value_t it_seq_vector_first(su_state *s, seq_t *q) {
 static value_t it_seq_vector_rest(su_state *s, seq_t *q) {
 	value_t v;
 	it_seq_t *itq = (it_seq_t*)q;
-	v.type = SU_NIL;
+	SET_NIL(&v);
 	if (itq->idx + 1 >= ((vector_t*)itq->obj)->cnt)
 		return v;
 	return it_seq_create_with_index(s, itq->obj, itq->idx + 1);
@@ -1130,16 +1143,15 @@ const seq_class_t seq_vector_vt = {&it_seq_vector_first, &it_seq_vector_rest};
 
 static value_t it_seq_create_with_index(su_state *s, gc_t *obj, int idx) {
 	value_t v;
-	it_seq_t *q = (it_seq_t*)su_allocate(s, NULL, sizeof(it_seq_t));
-	v.type = IT_SEQ;
+	it_seq_t *q = (it_seq_t*)gc_allocate(s, sizeof(it_seq_t));
 	q->obj = obj;
 	q->idx = idx;
 	
-	q->q.vt = v.type == SU_STRING ? &seq_string_vt : &seq_vector_vt;
-	v.obj.gc_object = gc_insert_object(s, &q->q.gc, IT_SEQ);
+	q->q.vt = obj->type == SU_STRING ? &seq_string_vt : &seq_vector_vt;
+	SET_OBJ(&v, IT_SEQ, gc_insert_object(s, &q->q.gc, IT_SEQ));
 	return v;
 }
 
 value_t it_seq_create(su_state *s, value_t *obj) {
-	return it_seq_create_with_index(s, obj->obj.gc_object, 0);
+	return it_seq_create_with_index(s, VAL_GC(obj), 0);
 }
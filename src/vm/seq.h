@@ -31,6 +31,7 @@ int vector_length(vector_t *v);
 value_t vector_cat(su_state *s, vector_t *a, vector_t *b);
 value_t vector_index(su_state *s, vector_t *v, int i);
 value_t vector_create_empty(su_state *s);
+value_t vector_create_array(su_state *s, value_t *array, int num);
 value_t vector_push(su_state *s, vector_t *vec, value_t *val);
 value_t vector_pop(su_state *s, vector_t *vec);
 value_t vector_set(su_state *s, vector_t *vec, int i, value_t *val);
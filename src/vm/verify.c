@@ -0,0 +1,243 @@
+/*
+ * S A U R U S
+ * Copyright (c) 2009-2015 Andreas T Jonsson <andreas@saurus.org>
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#include "saurus.h"
+#include "intern.h"
+
+/* Load time bytecode verifier. Every path through a prototype is walked
+   with the stack depth relative to the frame base, which must agree where
+   paths meet. Operand indices, jump targets and superinstruction operand
+   words are checked on the way, so vm_loop can run them unchecked and
+   reserve max_stack once per call. */
+
+#define NO_NARG 0x7fff
+
+typedef struct {
+	prototype_t *prot;
+	int *depth;
+	int *work;
+	int num_work;
+	short *narg;
+	unsigned max;
+} verifier_t;
+
+static int flow(verifier_t *v, int pc, int d) {
+	if (pc < 0 || pc > (int)v->prot->num_inst || d < 0)
+		return -1;
+	if ((unsigned)d > v->max)
+		v->max = (unsigned)d;
+	if (pc == (int)v->prot->num_inst)
+		return 0;
+	if (v->depth[pc] < 0) {
+		v->depth[pc] = d;
+		v->work[v->num_work++] = pc;
+		return 0;
+	}
+	return v->depth[pc] == d ? 0 : -1;
+}
+
+static int is_const(verifier_t *v, int k) {
+	return k >= 0 && k < (int)v->prot->num_const;
+}
+
+static int is_string_const(verifier_t *v, int k) {
+	return is_const(v, k) && v->prot->constants[k].id == CSTRING;
+}
+
+static int operand_word(verifier_t *v, int pc, int op) {
+	return pc + 1 < (int)v->prot->num_inst && v->prot->inst[pc + 1].id == op;
+}
+
+static int verify_instruction(su_state *s, verifier_t *v, int pc) {
+	instruction_t inst = v->prot->inst[pc];
+	int a = inst.a, b = inst.b, d = v->depth[pc];
+
+	#define NEED(n) if (d < (n)) return -1;
+	#define LOCAL(i) if ((i) < 0 || (i) >= d) return -1;
+	#define CONST(k) if (!is_const(v, (k))) return -1;
+	#define NEXT(nd) return flow(v, pc + 1, (nd));
+	#define PEAK(nd) if ((unsigned)(nd) > v->max) v->max = (unsigned)(nd);
+
+	switch (inst.id) {
+		case OP_PUSH:
+			CONST(a)
+			NEXT(d + 1)
+		case OP_POP:
+			NEED(a)
+			NEXT(d - a)
+		case OP_LOAD:
+			LOCAL(a)
+			NEXT(d + 1)
+		case OP_LUP:
+			if (a >= (int)v->prot->num_ups)
+				return -1;
+			NEXT(d + 1)
+		case OP_LCL:
+			if (b < 0 || b >= s->msi->num_c_lambdas)
+				return -1;
+			NEXT(d + 1)
+		case OP_ADD: case OP_SUB: case OP_MUL: case OP_DIV: case OP_MOD: case OP_POW:
+		case OP_EQ: case OP_LESS: case OP_LEQUAL: case OP_AND: case OP_OR:
+		case OP_ADD_NN: case OP_SUB_NN: case OP_MUL_NN: case OP_LESS_NN: case OP_LEQUAL_NN:
+			NEED(2)
+			NEXT(d - 1)
+		case OP_UNM:
+		case OP_NOT:
+			NEED(1)
+			NEXT(d)
+		case OP_TEST:
+			NEED(1)
+			if (flow(v, b, d - 1))
+				return -1;
+			NEXT(d - 1)
+		case OP_FOR:
+			/* su_rest and su_first need one slot above the sequence. */
+			NEED(2)
+			PEAK(d + 1)
+			if (flow(v, b, d - 1))
+				return -1;
+			NEXT(d)
+		case OP_JMP:
+			return flow(v, b, d);
+		case OP_RETURN:
+			NEED(1)
+			return 0;
+		case OP_SHIFT:
+			NEED(a + 1)
+			NEXT(d - a)
+		case OP_CALL:
+			/* The function slot is replaced with b results, at least one. */
+			if (b < 0)
+				return -1;
+			NEED(a + 1)
+			NEXT(d - a - 1 + (b ? b : 1))
+		case OP_TCALL:
+			NEED(a + 1)
+			return 0;
+		case OP_LAMBDA:
+			if (a >= (int)v->prot->num_prot || (v->narg[a] != NO_NARG && v->narg[a] != b))
+				return -1;
+			v->narg[a] = (short)b;
+			NEXT(d + 1)
+		case OP_GETGLOBAL:
+			if (!is_string_const(v, a))
+				return -1;
+			NEXT(d + 1)
+		case OP_SETGLOBAL:
+			if (!is_string_const(v, a))
+				return -1;
+			NEED(1)
+			NEXT(d)
+		case OP_GETFIELD:
+			/* Anything but a map is called with the key pushed. */
+			CONST(a)
+			NEED(1)
+			PEAK(d + 1)
+			NEXT(d)
+		case OP_FORPREP:
+			NEED(2)
+			NEXT(d)
+		case OP_FORLOOP:
+			NEED(3)
+			if (flow(v, b, d - 1))
+				return -1;
+			NEXT(d - 2)
+		case OP_STORE:
+			if (b < 0 || b + a > d)
+				return -1;
+			NEXT(b + a)
+		case OP_ADD_LL: case OP_SUB_LL: case OP_MUL_LL:
+		case OP_EQ_LL: case OP_LESS_LL: case OP_LEQUAL_LL:
+			LOCAL(a)
+			LOCAL(b)
+			NEXT(d + 1)
+		case OP_ADD_LK: case OP_SUB_LK: case OP_SUB_KL: case OP_MUL_LK:
+		case OP_EQ_LK: case OP_LESS_LK: case OP_LESS_KL: case OP_LEQUAL_LK: case OP_LEQUAL_KL:
+			LOCAL(a)
+			CONST(b)
+			NEXT(d + 1)
+		case OP_EQ_LL_TEST: case OP_LESS_LL_TEST: case OP_LEQUAL_LL_TEST:
+		case OP_EQ_LK_TEST: case OP_LESS_LK_TEST: case OP_LESS_KL_TEST:
+		case OP_LEQUAL_LK_TEST: case OP_LEQUAL_KL_TEST:
+			if (!operand_word(v, pc, OP_TEST))
+				return -1;
+			LOCAL(a)
+			if (inst.id == OP_EQ_LL_TEST || inst.id == OP_LESS_LL_TEST || inst.id == OP_LEQUAL_LL_TEST) {
+				LOCAL(b)
+			} else {
+				CONST(b)
+			}
+			if (flow(v, v->prot->inst[pc + 1].b, d))
+				return -1;
+			return flow(v, pc + 2, d);
+		case OP_SHIFT_JMP:
+			if (!operand_word(v, pc, OP_JMP))
+				return -1;
+			NEED(a + 1)
+			return flow(v, v->prot->inst[pc + 1].b, d - a);
+		case OP_LOAD_LOAD:
+			/* The operand word may start the next pair. */
+			if (!operand_word(v, pc, OP_LOAD) && !operand_word(v, pc, OP_LOAD_LOAD))
+				return -1;
+			LOCAL(a)
+			if (v->prot->inst[pc + 1].a > d)
+				return -1;
+			return flow(v, pc + 2, d + 2);
+	}
+
+	#undef NEED
+	#undef LOCAL
+	#undef CONST
+	#undef NEXT
+	#undef PEAK
+
+	return -1;
+}
+
+int verify_prototype(su_state *s, prototype_t *prot, int narg) {
+	unsigned i;
+	int ret = -1;
+	verifier_t v;
+
+	if (prot->num_lineinf < prot->num_inst)
+		return -1;
+
+	v.prot = prot;
+	v.num_work = 0;
+	v.max = 0;
+	v.depth = su_allocate(s, NULL, sizeof(int) * (prot->num_inst + 1));
+	v.work = su_allocate(s, NULL, sizeof(int) * (prot->num_inst + 1));
+	v.narg = su_allocate(s, NULL, sizeof(short) * (prot->num_prot + 1));
+	for (i = 0; i < prot->num_inst; i++)
+		v.depth[i] = -1;
+	for (i = 0; i < prot->num_prot; i++)
+		v.narg[i] = NO_NARG;
+
+	/* The function and its arguments, a variadic function gets one vector. */
+	if (flow(&v, 0, (narg < 0 ? 1 : narg) + 1))
+		goto done;
+	while (v.num_work > 0) {
+		if (verify_instruction(s, &v, v.work[--v.num_work]))
+			goto done;
+	}
+	prot->max_stack = v.max;
+
+	/* Prototypes that no LAMBDA refers to can never run. */
+	for (i = 0; i < prot->num_prot; i++) {
+		if (v.narg[i] != NO_NARG && verify_prototype(s, &prot->prot[i], v.narg[i]))
+			goto done;
+	}
+	ret = 0;
+
+done:
+	su_allocate(s, v.depth, 0);
+	su_allocate(s, v.work, 0);
+	su_allocate(s, v.narg, 0);
+	return ret;
+}
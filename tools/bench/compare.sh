@@ -0,0 +1,46 @@
+#!/bin/sh
+#
+# S A U R U S
+# Copyright (c) 2009-2015 Andreas T Jonsson <andreas@saurus.org>
+#
+# This Source Code Form is subject to the terms of the Mozilla Public
+# License, v. 2.0. If a copy of the MPL was not distributed with this
+# file, You can obtain one at http://mozilla.org/MPL/2.0/.
+#
+# Usage: compare.sh <saurus-a> <saurus-b> [runs]
+#
+# Runs every benchmark in this directory with both interpreters and
+# prints the best wall-clock time in milliseconds for each. Build the
+# two interpreters with different options, e.g. with and without
+# 'premake4 gmake no-computed-goto', to compare dispatch strategies.
+
+if [ $# -lt 2 ]; then
+	echo "Usage: $0 <saurus-a> <saurus-b> [runs]"
+	exit 1
+fi
+
+A=$1
+B=$2
+RUNS=${3:-3}
+DIR=$(dirname "$0")
+
+best() {
+	min=
+	i=0
+	while [ $i -lt $RUNS ]; do
+		start=$(date +%s%N)
+		"$1" "$2" > /dev/null || echo "$1 $2: failed" 1>&2
+		t=$(( ($(date +%s%N) - start) / 1000000 ))
+		if [ -z "$min" ] || [ $t -lt $min ]; then min=$t; fi
+		i=$((i + 1))
+	done
+	echo $min
+}
+
+printf "%-16s %10s %10s %8s\n" "benchmark" "a (ms)" "b (ms)" "b/a"
+for f in "$DIR"/*.su; do
+	ta=$(best "$A" "$f")
+	tb=$(best "$B" "$f")
+	ratio=$(awk "BEGIN { printf \"%.2f\", $tb / ($ta ? $ta : 1) }")
+	printf "%-16s %10s %10s %8s\n" "$(basename "$f" .su)" "$ta" "$tb" "$ratio"
+done
@@ -0,0 +1,45 @@
+#!/bin/sh
+#
+# S A U R U S
+# Copyright (c) 2009-2015 Andreas T Jonsson <andreas@saurus.org>
+#
+# This Source Code Form is subject to the terms of the Mozilla Public
+# License, v. 2.0. If a copy of the MPL was not distributed with this
+# file, You can obtain one at http://mozilla.org/MPL/2.0/.
+#
+# Usage: diff.sh <saurus-a> <saurus-b> [scripts]
+#
+# Runs each script with both interpreters and reports any difference in
+# output, error messages or exit status. Build the two interpreters with
+# and without 'premake4 gmake jit' to check the JIT against the
+# interpreter. Defaults to every benchmark in this directory and the JIT
+# scripts in tools/jit, which cover each instruction template, jumps into
+# superinstructions, guard exits and errors raised from compiled code.
+
+if [ $# -lt 2 ]; then
+	echo "Usage: $0 <saurus-a> <saurus-b> [scripts]"
+	exit 1
+fi
+
+A=$1
+B=$2
+shift 2
+DIR=$(dirname "$0")
+SCRIPTS=${*:-"$DIR"/*.su "$DIR"/../jit/*.su}
+TMP=${TMPDIR:-/tmp}/saurus-diff.$$
+FAILED=0
+
+for f in $SCRIPTS; do
+	"$A" "$f" > "$TMP.a" 2>&1; echo "exit $?" >> "$TMP.a"
+	"$B" "$f" > "$TMP.b" 2>&1; echo "exit $?" >> "$TMP.b"
+	if cmp -s "$TMP.a" "$TMP.b"; then
+		echo "ok     $f"
+	else
+		echo "FAILED $f"
+		diff "$TMP.a" "$TMP.b" | head -20
+		FAILED=1
+	fi
+done
+
+rm -f "$TMP.a" "$TMP.b"
+exit $FAILED
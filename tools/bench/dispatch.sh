@@ -0,0 +1,36 @@
+#!/bin/sh
+#
+# S A U R U S
+# Copyright (c) 2009-2015 Andreas T Jonsson <andreas@saurus.org>
+#
+# This Source Code Form is subject to the terms of the Mozilla Public
+# License, v. 2.0. If a copy of the MPL was not distributed with this
+# file, You can obtain one at http://mozilla.org/MPL/2.0/.
+#
+# Usage: dispatch.sh <saurus> [SU_OPT_...]
+#
+# Counts the instructions dispatched by every benchmark in this
+# directory, compiled with and without the given compiler option
+# (default SU_OPT_NO_OPERANDS). The interpreter must be built with
+# 'premake4 gmake stats' (SU_OPT_VM_STATS).
+
+if [ $# -lt 1 ]; then
+	echo "Usage: $0 <saurus> [SU_OPT_...]"
+	exit 1
+fi
+
+SAURUS=$1
+OPT=${2:-SU_OPT_NO_OPERANDS}
+DIR=$(dirname "$0")
+
+count() {
+	"$@" 2>&1 > /dev/null | awk '$1 == "dispatched" { n = $2 } END { print n }'
+}
+
+printf "%-16s %14s %14s %8s\n" "benchmark" "$OPT" "default" "ratio"
+for f in "$DIR"/*.su; do
+	a=$(count env "$OPT=1" "$SAURUS" "$f")
+	b=$(count "$SAURUS" "$f")
+	ratio=$(awk "BEGIN { printf \"%.2f\", $b / ($a ? $a : 1) }")
+	printf "%-16s %14s %14s %8s\n" "$(basename "$f" .su)" "$a" "$b" "$ratio"
+done
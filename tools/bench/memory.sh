@@ -0,0 +1,47 @@
+#!/bin/sh
+#
+# S A U R U S
+# Copyright (c) 2009-2015 Andreas T Jonsson <andreas@saurus.org>
+#
+# This Source Code Form is subject to the terms of the Mozilla Public
+# License, v. 2.0. If a copy of the MPL was not distributed with this
+# file, You can obtain one at http://mozilla.org/MPL/2.0/.
+#
+# Usage: memory.sh <saurus-a> <saurus-b> [scripts]
+#
+# Prints the peak resident set size in kilobytes of each benchmark for
+# both interpreters, sampled from /proc while the script runs. Build the
+# two interpreters with and without 'premake4 gmake nan-boxing' to
+# compare value layouts. Defaults to vector.su and map.su.
+
+if [ $# -lt 2 ]; then
+	echo "Usage: $0 <saurus-a> <saurus-b> [scripts]"
+	exit 1
+fi
+
+A=$1
+B=$2
+shift 2
+DIR=$(dirname "$0")
+SCRIPTS=${*:-"$DIR/vector.su $DIR/map.su"}
+
+peak() {
+	"$1" "$2" > /dev/null &
+	pid=$!
+	kb=0
+	while kill -0 $pid 2> /dev/null; do
+		t=$(awk '/^VmHWM/ { print $2 }' /proc/$pid/status 2> /dev/null)
+		if [ -n "$t" ]; then kb=$t; fi
+		sleep 0.01
+	done
+	wait $pid
+	echo $kb
+}
+
+printf "%-16s %10s %10s %8s\n" "benchmark" "a (kB)" "b (kB)" "b/a"
+for f in $SCRIPTS; do
+	ka=$(peak "$A" "$f")
+	kb=$(peak "$B" "$f")
+	ratio=$(awk "BEGIN { printf \"%.2f\", $kb / ($ka ? $ka : 1) }")
+	printf "%-16s %10s %10s %8s\n" "$(basename "$f" .su)" "$ka" "$kb" "$ratio"
+done
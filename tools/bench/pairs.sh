@@ -0,0 +1,34 @@
+#!/bin/sh
+#
+# S A U R U S
+# Copyright (c) 2009-2015 Andreas T Jonsson <andreas@saurus.org>
+#
+# This Source Code Form is subject to the terms of the Mozilla Public
+# License, v. 2.0. If a copy of the MPL was not distributed with this
+# file, You can obtain one at http://mozilla.org/MPL/2.0/.
+#
+# Usage: pairs.sh <saurus> [count] [script.su ...]
+#
+# Prints the most frequently dispatched opcode pairs, summed over the
+# given scripts (default every benchmark in this directory). This is
+# the histogram the assembler superinstructions are picked from. The
+# interpreter must be built with 'premake4 gmake stats' (SU_OPT_VM_STATS).
+# Set SU_OPT_NO_SUPERINST=1 to see the pairs before fusion.
+
+if [ $# -lt 1 ]; then
+	echo "Usage: $0 <saurus> [count] [script.su ...]"
+	exit 1
+fi
+
+SAURUS=$1
+COUNT=${2:-20}
+DIR=$(dirname "$0")
+[ $# -gt 0 ] && shift
+[ $# -gt 0 ] && shift
+[ $# -eq 0 ] && set -- "$DIR"/*.su
+
+for f in "$@"; do
+	"$SAURUS" "$f" 2>&1 > /dev/null
+done | awk '$1 == "pair" { n[$2 " " $3] += $4 } END { for (p in n) print n[p], p }' |
+	sort -rn | head -n "$COUNT" |
+	awk '{ printf "%-16s %-16s %12s\n", $2, $3, $1 }'
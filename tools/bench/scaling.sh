@@ -0,0 +1,48 @@
+#!/bin/sh
+#
+# S A U R U S
+# Copyright (c) 2009-2015 Andreas T Jonsson <andreas@saurus.org>
+#
+# This Source Code Form is subject to the terms of the Mozilla Public
+# License, v. 2.0. If a copy of the MPL was not distributed with this
+# file, You can obtain one at http://mozilla.org/MPL/2.0/.
+#
+# Usage: scaling.sh <saurus> [max-threads] [runs]
+#
+# Runs alloc.su with 1 up to max-threads threads (default 4) and prints
+# the best wall-clock time in milliseconds and the speedup over a single
+# thread. The total work is the same for every run, so a flat time means
+# the allocator or collector is serializing the threads.
+
+if [ $# -lt 1 ]; then
+	echo "Usage: $0 <saurus> [max-threads] [runs]"
+	exit 1
+fi
+
+BIN=$1
+MAX=${2:-4}
+RUNS=${3:-3}
+DIR=$(dirname "$0")
+
+best() {
+	min=
+	i=0
+	while [ $i -lt $RUNS ]; do
+		start=$(date +%s%N)
+		"$BIN" "$DIR/alloc.su" "$1" > /dev/null || echo "$BIN alloc.su $1: failed" 1>&2
+		t=$(( ($(date +%s%N) - start) / 1000000 ))
+		if [ -z "$min" ] || [ $t -lt $min ]; then min=$t; fi
+		i=$((i + 1))
+	done
+	echo $min
+}
+
+printf "%-8s %10s %8s\n" "threads" "time (ms)" "speedup"
+n=1
+while [ $n -le $MAX ]; do
+	t=$(best $n)
+	if [ $n -eq 1 ]; then base=$t; fi
+	speedup=$(awk "BEGIN { printf \"%.2f\", $base / ($t ? $t : 1) }")
+	printf "%-8s %10s %8s\n" "$n" "$t" "$speedup"
+	n=$((n + 1))
+done